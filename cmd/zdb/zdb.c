@@ -2387,6 +2387,7 @@ typedef struct zdb_cb {
 	uint64_t	zcb_start;
 	uint64_t	zcb_lastprint;
 	uint64_t	zcb_totalasize;
+	uint64_t	zcb_removing_size;
 	uint64_t	zcb_errors[256];
 	int		zcb_readfails;
 	int		zcb_haderrors;
@@ -2620,45 +2621,127 @@ static metaslab_ops_t zdb_metaslab_ops = {
 	NULL	/* alloc */
 };
 
+static void
+zdb_ddt_leak_entry(spa_t *spa, zdb_cb_t *zcb, enum zio_checksum checksum,
+    ddt_entry_t *dde)
+{
+	blkptr_t blk;
+	ddt_phys_t *ddp = dde->dde_phys;
+	int p;
+
+	ASSERT(ddt_phys_total_refcnt(dde) > 1);
+
+	for (p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
+		if (ddp->ddp_phys_birth == 0)
+			continue;
+		ddt_bp_create(checksum, &dde->dde_key, ddp, &blk);
+		if (p == DDT_PHYS_DITTO) {
+			zdb_count_block(zcb, NULL, &blk, ZDB_OT_DITTO);
+		} else {
+			zcb->zcb_dedup_asize +=
+			    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
+			zcb->zcb_dedup_blocks++;
+		}
+	}
+	if (!dump_opt['L']) {
+		ddt_t *ddt = spa->spa_ddt[checksum];
+		ddt_enter(ddt);
+		VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
+		ddt_exit(ddt);
+	}
+}
+
 static void
 zdb_ddt_leak_init(spa_t *spa, zdb_cb_t *zcb)
 {
 	ddt_bookmark_t ddb = { 0 };
 	ddt_entry_t dde;
+	enum zio_checksum c;
 	int error;
-	int p;
 
 	while ((error = ddt_walk(spa, &ddb, &dde)) == 0) {
-		blkptr_t blk;
-		ddt_phys_t *ddp = dde.dde_phys;
-
 		if (ddb.ddb_class == DDT_CLASS_UNIQUE)
-			return;
+			break;
+		zdb_ddt_leak_entry(spa, zcb, ddb.ddb_checksum, &dde);
+	}
 
-		ASSERT(ddt_phys_total_refcnt(&dde) > 1);
+	ASSERT(error == 0 || error == ENOENT);
 
-		for (p = 0; p < DDT_PHYS_TYPES; p++, ddp++) {
-			if (ddp->ddp_phys_birth == 0)
-				continue;
-			ddt_bp_create(ddb.ddb_checksum,
-			    &dde.dde_key, ddp, &blk);
-			if (p == DDT_PHYS_DITTO) {
-				zdb_count_block(zcb, NULL, &blk, ZDB_OT_DITTO);
-			} else {
-				zcb->zcb_dedup_asize +=
-				    BP_GET_ASIZE(&blk) * (ddp->ddp_refcnt - 1);
-				zcb->zcb_dedup_blocks++;
-			}
-		}
-		if (!dump_opt['L']) {
-			ddt_t *ddt = spa->spa_ddt[ddb.ddb_checksum];
-			ddt_enter(ddt);
-			VERIFY(ddt_lookup(ddt, &blk, B_TRUE) != NULL);
-			ddt_exit(ddt);
+	/*
+	 * ddt_walk() skips the logged entries which have moved.
+	 */
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		uint64_t walk = 0;
+
+		while (ddt_log_walk(ddt, &walk, &dde) == 0) {
+			if (dde.dde_class != DDT_CLASS_UNIQUE)
+				zdb_ddt_leak_entry(spa, zcb, c, &dde);
 		}
 	}
+}
 
-	ASSERT(error == ENOENT);
+static void
+zdb_claim_removing_cb(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size)
+{
+	zdb_cb_t *zcb = arg;
+	metaslab_t *msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
+	uint64_t space;
+
+	mutex_enter(&msp->ms_lock);
+	space = range_tree_space(msp->ms_tree);
+	range_tree_clear(msp->ms_tree, offset, size);
+	zcb->zcb_removing_size += space - range_tree_space(msp->ms_tree);
+	mutex_exit(&msp->ms_lock);
+}
+
+static void
+zdb_claim_removing_range(void *arg, uint64_t start, uint64_t size)
+{
+	zdb_cb_t *zcb = arg;
+	vdev_t *vd = vdev_lookup_top(zcb->zcb_spa,
+	    zcb->zcb_spa->spa_vdev_removal->svr_vdev_id);
+
+	VERIFY0(vdev_indirect_remap(vd, start, size,
+	    zdb_claim_removing_cb, zcb));
+}
+
+/*
+ * While a removal is in progress, the blocks already copied off the
+ * removing vdev are allocated on both the removing vdev and the vdevs they
+ * were copied to, but the block pointers only refer to the removing vdev.
+ * Claim the copies up front, so they are not reported as leaked.
+ */
+static void
+zdb_claim_removing(spa_t *spa, zdb_cb_t *zcb)
+{
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	vdev_t *vd;
+	range_tree_t *live;
+	kmutex_t lock;
+
+	if (svr == NULL)
+		return;
+
+	vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+	if (vd->vdev_indirect_mapping == NULL)
+		return;
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	live = range_tree_create(NULL, NULL, &lock);
+
+	mutex_enter(&vd->vdev_obsolete_lock);
+	vdev_indirect_live_ranges(vd, live, B_FALSE);
+	mutex_exit(&vd->vdev_obsolete_lock);
+
+	mutex_enter(&lock);
+	range_tree_walk(live, zdb_claim_removing_range, zcb);
+	range_tree_vacate(live, NULL, NULL);
+	mutex_exit(&lock);
+
+	range_tree_destroy(live);
+	mutex_destroy(&lock);
 }
 
 static void
@@ -2683,7 +2766,8 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 				 * we can't use the normal metaslab_load/unload
 				 * interfaces.
 				 */
-				if (msp->ms_sm != NULL) {
+				if (msp->ms_sm != NULL ||
+				    msp->ms_unflushed_txg != 0) {
 					(void) fprintf(stderr,
 					    "\rloading space map for "
 					    "vdev %llu of %llu, "
@@ -2702,8 +2786,13 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 					 * ops.
 					 */
 					msp->ms_tree->rt_ops = NULL;
-					VERIFY0(space_map_load(msp->ms_sm,
-					    msp->ms_tree, SM_ALLOC));
+					if (msp->ms_sm != NULL) {
+						VERIFY0(space_map_load(
+						    msp->ms_sm, msp->ms_tree,
+						    SM_ALLOC));
+					}
+					metaslab_unflushed_apply(msp,
+					    msp->ms_tree, SM_ALLOC);
 					msp->ms_loaded = B_TRUE;
 				}
 				mutex_exit(&msp->ms_lock);
@@ -2714,6 +2803,9 @@ zdb_leak_init(spa_t *spa, zdb_cb_t *zcb)
 
 	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
 
+	if (!dump_opt['L'])
+		zdb_claim_removing(spa, zcb);
+
 	zdb_ddt_leak_init(spa, zcb);
 
 	spa_config_exit(spa, SCL_CONFIG, FTAG);
@@ -2773,6 +2865,7 @@ dump_block_stats(spa_t *spa)
 	zdb_cb_t zcb;
 	zdb_blkstats_t *zb, *tzb;
 	uint64_t norm_alloc, norm_space, total_alloc, total_found;
+	uint64_t spec_alloc, spec_space;
 	int flags = TRAVERSE_PRE | TRAVERSE_PREFETCH_METADATA |
 	    TRAVERSE_NO_DECRYPT | TRAVERSE_HARD;
 	boolean_t leaks = B_FALSE;
@@ -2815,7 +2908,8 @@ dump_block_stats(spa_t *spa)
 	if (dump_opt['c'] > 1)
 		flags |= TRAVERSE_PREFETCH_DATA;
 
-	zcb.zcb_totalasize = metaslab_class_get_alloc(spa_normal_class(spa));
+	zcb.zcb_totalasize = metaslab_class_get_alloc(spa_normal_class(spa)) +
+	    metaslab_class_get_alloc(spa_special_class(spa));
 	zcb.zcb_start = zcb.zcb_lastprint = gethrtime();
 	zcb.zcb_haderrors |= traverse_pool(spa, 0, flags, zdb_blkptr_cb, &zcb);
 
@@ -2854,8 +2948,13 @@ dump_block_stats(spa_t *spa)
 	norm_alloc = metaslab_class_get_alloc(spa_normal_class(spa));
 	norm_space = metaslab_class_get_space(spa_normal_class(spa));
 
-	total_alloc = norm_alloc + metaslab_class_get_alloc(spa_log_class(spa));
-	total_found = tzb->zb_asize - zcb.zcb_dedup_asize;
+	spec_alloc = metaslab_class_get_alloc(spa_special_class(spa));
+	spec_space = metaslab_class_get_space(spa_special_class(spa));
+
+	total_alloc = norm_alloc + spec_alloc +
+	    metaslab_class_get_alloc(spa_log_class(spa));
+	total_found = tzb->zb_asize - zcb.zcb_dedup_asize +
+	    zcb.zcb_removing_size;
 
 	if (total_found == total_alloc) {
 		if (!dump_opt['L'])
@@ -2899,6 +2998,10 @@ dump_block_stats(spa_t *spa)
 	    (double)zcb.zcb_dedup_asize / tzb->zb_asize + 1.0);
 	(void) printf("\tSPA allocated: %10llu     used: %5.2f%%\n",
 	    (u_longlong_t)norm_alloc, 100.0 * norm_alloc / norm_space);
+	if (spec_space != 0) {
+		(void) printf("\tSpecial class: %10llu     used: %5.2f%%\n",
+		    (u_longlong_t)spec_alloc, 100.0 * spec_alloc / spec_space);
+	}
 
 	for (i = 0; i < NUM_BP_EMBEDDED_TYPES; i++) {
 		if (zcb.zcb_embedded_blocks[i] == 0)
@@ -3469,7 +3572,8 @@ zdb_read_block(char *thing, spa_t *spa)
 	DVA_SET_VDEV(&dva[0], vd->vdev_id);
 	DVA_SET_OFFSET(&dva[0], offset);
 	DVA_SET_GANG(&dva[0], !!(flags & ZDB_FLAG_GBH));
-	DVA_SET_ASIZE(&dva[0], vdev_psize_to_asize(vd, psize));
+	DVA_SET_ASIZE(&dva[0],
+	    vdev_psize_to_asize_txg(vd, psize, TXG_INITIAL));
 
 	BP_SET_BIRTH(bp, TXG_INITIAL, TXG_INITIAL);
 
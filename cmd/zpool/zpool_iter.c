@@ -277,7 +277,7 @@ for_each_vdev_cb(zpool_handle_t *zhp, nvlist_t *nv, pool_vdev_iter_f func,
 				(void) nvlist_lookup_uint64(child[c],
 				    ZPOOL_CONFIG_IS_HOLE, &ishole);
 
-				if (ishole)
+				if (ishole || vdev_is_indirect(child[c]))
 					continue;
 
 				ret |= for_each_vdev_cb(zhp, child[c], func,
@@ -85,6 +85,7 @@ static int zpool_do_replace(int, char **);
 static int zpool_do_split(int, char **);
 
 static int zpool_do_scrub(int, char **);
+static int zpool_do_trim(int, char **);
 
 static int zpool_do_import(int, char **);
 static int zpool_do_export(int, char **);
@@ -134,6 +135,7 @@ typedef enum {
 	HELP_REPLACE,
 	HELP_REMOVE,
 	HELP_SCRUB,
+	HELP_TRIM,
 	HELP_STATUS,
 	HELP_UPGRADE,
 	HELP_EVENTS,
@@ -258,6 +260,7 @@ static zpool_command_t command_table[] = {
 	{ "split",	zpool_do_split,		HELP_SPLIT		},
 	{ NULL },
 	{ "scrub",	zpool_do_scrub,		HELP_SCRUB		},
+	{ "trim",	zpool_do_trim,		HELP_TRIM		},
 	{ NULL },
 	{ "import",	zpool_do_import,	HELP_IMPORT		},
 	{ "export",	zpool_do_export,	HELP_EXPORT		},
@@ -330,11 +333,15 @@ get_usage(zpool_help_t idx) {
 		return (gettext("\treplace [-f] [-o property=value] "
 		    "<pool> <device> [new-device]\n"));
 	case HELP_REMOVE:
-		return (gettext("\tremove <pool> <device> ...\n"));
+		return (gettext("\tremove <pool> <device> ...\n"
+		    "\tremove -s <pool>\n"));
 	case HELP_REOPEN:
 		return (gettext("\treopen <pool>\n"));
 	case HELP_SCRUB:
 		return (gettext("\tscrub [-s] <pool> ...\n"));
+	case HELP_TRIM:
+		return (gettext("\ttrim [-c | -s] [-r rate] <pool> "
+		    "[<device> ...]\n"));
 	case HELP_STATUS:
 		return (gettext("\tstatus [-c CMD] [-gLPvxD] [-T d|u] [pool]"
 		    " ... [interval [count]]\n"));
@@ -447,9 +454,13 @@ usage(boolean_t requested)
 	exit(requested ? 0 : 2);
 }
 
+/*
+ * Print the tree of top-level vdevs in the given allocation class: NULL for
+ * the normal class, VDEV_ALLOC_CLASS_LOGS for logs, or an allocation bias.
+ */
 void
 print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
-    boolean_t print_logs, int name_flags)
+    const char *match, int name_flags)
 {
 	nvlist_t **child;
 	uint_t c, children;
@@ -463,16 +474,15 @@ print_vdev_tree(zpool_handle_t *zhp, const char *name, nvlist_t *nv, int indent,
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
+		const char *class = vdev_alloc_class(child[c]);
 
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if ((is_log && !print_logs) || (!is_log && print_logs))
+		if (class != match && (class == NULL || match == NULL ||
+		    strcmp(class, match) != 0))
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, zhp, child[c], name_flags);
 		print_vdev_tree(zhp, vname, child[c], indent + 2,
-		    B_FALSE, name_flags);
+		    NULL, name_flags);
 		free(vname);
 	}
 }
@@ -697,19 +707,30 @@ zpool_do_add(int argc, char **argv)
 		    "configuration:\n"), zpool_get_name(zhp));
 
 		/* print original main pool and new tree */
-		print_vdev_tree(zhp, poolname, poolnvroot, 0, B_FALSE,
+		print_vdev_tree(zhp, poolname, poolnvroot, 0, NULL,
 		    name_flags);
-		print_vdev_tree(zhp, NULL, nvroot, 0, B_FALSE, name_flags);
+		print_vdev_tree(zhp, NULL, nvroot, 0, NULL, name_flags);
+
+		/* Do the same for the special class */
+		if (num_special(poolnvroot) > 0) {
+			print_vdev_tree(zhp, "special", poolnvroot, 0,
+			    VDEV_ALLOC_BIAS_SPECIAL, name_flags);
+			print_vdev_tree(zhp, NULL, nvroot, 0,
+			    VDEV_ALLOC_BIAS_SPECIAL, name_flags);
+		} else if (num_special(nvroot) > 0) {
+			print_vdev_tree(zhp, "special", nvroot, 0,
+			    VDEV_ALLOC_BIAS_SPECIAL, name_flags);
+		}
 
 		/* Do the same for the logs */
 		if (num_logs(poolnvroot) > 0) {
-			print_vdev_tree(zhp, "logs", poolnvroot, 0, B_TRUE,
-			    name_flags);
-			print_vdev_tree(zhp, NULL, nvroot, 0, B_TRUE,
-			    name_flags);
+			print_vdev_tree(zhp, "logs", poolnvroot, 0,
+			    VDEV_ALLOC_CLASS_LOGS, name_flags);
+			print_vdev_tree(zhp, NULL, nvroot, 0,
+			    VDEV_ALLOC_CLASS_LOGS, name_flags);
 		} else if (num_logs(nvroot) > 0) {
-			print_vdev_tree(zhp, "logs", nvroot, 0, B_TRUE,
-			    name_flags);
+			print_vdev_tree(zhp, "logs", nvroot, 0,
+			    VDEV_ALLOC_CLASS_LOGS, name_flags);
 		}
 
 		/* Do the same for the caches */
@@ -750,26 +771,48 @@ zpool_do_add(int argc, char **argv)
 
 /*
  * zpool remove  <pool> <vdev> ...
+ * zpool remove -s <pool>
+ *
+ * Removes the given vdev from the pool.  This supports removing spares,
+ * cache, and log devices, and top-level vdevs whose data is copied to the
+ * other vdevs of the pool.
  *
- * Removes the given vdev from the pool.  Currently, this supports removing
- * spares, cache, and log devices from the pool.
+ *	-s	Stop and cancel the removal of a top-level vdev in progress.
  */
 int
 zpool_do_remove(int argc, char **argv)
 {
 	char *poolname;
-	int i, ret = 0;
+	int c, i, ret = 0;
 	zpool_handle_t *zhp = NULL;
+	boolean_t stop = B_FALSE;
 
-	argc--;
-	argv++;
+	/* check options */
+	while ((c = getopt(argc, argv, "s")) != -1) {
+		switch (c) {
+		case 's':
+			stop = B_TRUE;
+			break;
+		case '?':
+			(void) fprintf(stderr, gettext("invalid option '%c'\n"),
+			    optopt);
+			usage(B_FALSE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
 
 	/* get pool name and check number of arguments */
 	if (argc < 1) {
 		(void) fprintf(stderr, gettext("missing pool name argument\n"));
 		usage(B_FALSE);
 	}
-	if (argc < 2) {
+	if (stop && argc > 1) {
+		(void) fprintf(stderr, gettext("too many arguments\n"));
+		usage(B_FALSE);
+	}
+	if (!stop && argc < 2) {
 		(void) fprintf(stderr, gettext("missing device\n"));
 		usage(B_FALSE);
 	}
@@ -779,9 +822,14 @@ zpool_do_remove(int argc, char **argv)
 	if ((zhp = zpool_open(g_zfs, poolname)) == NULL)
 		return (1);
 
-	for (i = 1; i < argc; i++) {
-		if (zpool_vdev_remove(zhp, argv[i]) != 0)
+	if (stop) {
+		if (zpool_vdev_remove_cancel(zhp) != 0)
 			ret = 1;
+	} else {
+		for (i = 1; i < argc; i++) {
+			if (zpool_vdev_remove(zhp, argv[i]) != 0)
+				ret = 1;
+		}
 	}
 	zpool_close(zhp);
 
@@ -1181,9 +1229,13 @@ zpool_do_create(int argc, char **argv)
 		(void) printf(gettext("would create '%s' with the "
 		    "following layout:\n\n"), poolname);
 
-		print_vdev_tree(NULL, poolname, nvroot, 0, B_FALSE, 0);
+		print_vdev_tree(NULL, poolname, nvroot, 0, NULL, 0);
+		if (num_special(nvroot) > 0)
+			print_vdev_tree(NULL, "special", nvroot, 0,
+			    VDEV_ALLOC_BIAS_SPECIAL, 0);
 		if (num_logs(nvroot) > 0)
-			print_vdev_tree(NULL, "logs", nvroot, 0, B_TRUE, 0);
+			print_vdev_tree(NULL, "logs", nvroot, 0,
+			    VDEV_ALLOC_CLASS_LOGS, 0);
 
 		ret = 0;
 	} else {
@@ -1528,6 +1580,39 @@ zpool_print_cmd(vdev_cmd_data_list_t *vcdl, const char *pool, char *path)
 	}
 }
 
+/*
+ * Print the state of a manual trim for a leaf vdev, e.g. "(trimming, 45%)".
+ */
+static void
+print_trim_status(vdev_stat_t *vs)
+{
+	uint64_t pct = 0;
+
+	if (vs->vs_trim_bytes_est != 0) {
+		pct = MIN(100, vs->vs_trim_bytes_done * 100 /
+		    vs->vs_trim_bytes_est);
+	}
+
+	switch (vs->vs_trim_state) {
+	case VDEV_TRIM_ACTIVE:
+		(void) printf(gettext("  (trimming, %llu%%)"),
+		    (u_longlong_t)pct);
+		break;
+	case VDEV_TRIM_SUSPENDED:
+		(void) printf(gettext("  (trim suspended, %llu%%)"),
+		    (u_longlong_t)pct);
+		break;
+	case VDEV_TRIM_CANCELED:
+		(void) printf(gettext("  (trim canceled)"));
+		break;
+	case VDEV_TRIM_COMPLETE:
+		(void) printf(gettext("  (trimmed)"));
+		break;
+	default:
+		break;
+	}
+}
+
 /*
  * Print out configuration state as requested by status_callback.
  */
@@ -1536,7 +1621,7 @@ print_status_config(zpool_handle_t *zhp, status_cbdata_t *cb, const char *name,
     nvlist_t *nv, int depth, boolean_t isspare)
 {
 	nvlist_t **child;
-	uint_t c, children;
+	uint_t c, vsc, children;
 	pool_scan_stat_t *ps = NULL;
 	vdev_stat_t *vs;
 	char rbuf[6], wbuf[6], cbuf[6];
@@ -1551,7 +1636,7 @@ print_status_config(zpool_handle_t *zhp, status_cbdata_t *cb, const char *name,
 		children = 0;
 
 	verify(nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
-	    (uint64_t **)&vs, &c) == 0);
+	    (uint64_t **)&vs, &vsc) == 0);
 
 	state = zpool_state_to_name(vs->vs_state, vs->vs_aux);
 	if (isspare) {
@@ -1657,6 +1742,13 @@ print_status_config(zpool_handle_t *zhp, status_cbdata_t *cb, const char *name,
 		    "resilvering" : "repairing");
 	}
 
+	/* Display the progress of a manual trim on leaf vdevs */
+	if (children == 0 && vsc >= (offsetof(vdev_stat_t, vs_trim_bytes_est) +
+	    sizeof (vs->vs_trim_bytes_est)) / sizeof (uint64_t) &&
+	    vs->vs_trim_state != VDEV_TRIM_NONE) {
+		print_trim_status(vs);
+	}
+
 	if (cb->vcdl != NULL) {
 		if (nvlist_lookup_string(nv, ZPOOL_CONFIG_PATH, &path) == 0) {
 			printf("  ");
@@ -1667,14 +1759,13 @@ print_status_config(zpool_handle_t *zhp, status_cbdata_t *cb, const char *name,
 	(void) printf("\n");
 
 	for (c = 0; c < children; c++) {
-		uint64_t islog = B_FALSE, ishole = B_FALSE;
+		uint64_t ishole = B_FALSE;
 
-		/* Don't print logs or holes here */
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &islog);
+		/* Don't print logs, special vdevs, holes or removed vdevs */
 		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_HOLE,
 		    &ishole);
-		if (islog || ishole)
+		if (vdev_alloc_class(child[c]) != NULL || ishole ||
+		    vdev_is_indirect(child[c]))
 			continue;
 		vname = zpool_vdev_name(g_zfs, zhp, child[c],
 		    cb->cb_name_flags | VDEV_NAME_TYPE_ID);
@@ -1699,7 +1790,8 @@ print_import_config(status_cbdata_t *cb, const char *name, nvlist_t *nv,
 
 	verify(nvlist_lookup_string(nv, ZPOOL_CONFIG_TYPE, &type) == 0);
 	if (strcmp(type, VDEV_TYPE_MISSING) == 0 ||
-	    strcmp(type, VDEV_TYPE_HOLE) == 0)
+	    strcmp(type, VDEV_TYPE_HOLE) == 0 ||
+	    strcmp(type, VDEV_TYPE_INDIRECT) == 0)
 		return;
 
 	verify(nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
@@ -1748,11 +1840,7 @@ print_import_config(status_cbdata_t *cb, const char *name, nvlist_t *nv,
 		return;
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
-
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (is_log)
+		if (vdev_alloc_class(child[c]) != NULL)
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, NULL, child[c],
@@ -1785,15 +1873,17 @@ print_import_config(status_cbdata_t *cb, const char *name, nvlist_t *nv,
 }
 
 /*
- * Print log vdevs.
+ * Print log or special vdevs.
  * Logs are recorded as top level vdevs in the main pool child array
- * but with "is_log" set to 1. We use either print_status_config() or
- * print_import_config() to print the top level logs then any log
- * children (eg mirrored slogs) are printed recursively - which
- * works because only the top level vdev is marked "is_log"
+ * but with "is_log" set to 1, and special vdevs with an allocation
+ * bias. We use either print_status_config() or print_import_config()
+ * to print the top level vdevs of the class then any children (eg
+ * mirrored slogs) are printed recursively - which works because only
+ * the top level vdev is marked.
  */
 static void
-print_logs(zpool_handle_t *zhp, status_cbdata_t *cb, nvlist_t *nv)
+print_class_vdevs(zpool_handle_t *zhp, status_cbdata_t *cb, nvlist_t *nv,
+    const char *class)
 {
 	uint_t c, children;
 	nvlist_t **child;
@@ -1802,15 +1892,13 @@ print_logs(zpool_handle_t *zhp, status_cbdata_t *cb, nvlist_t *nv)
 	    &children) != 0)
 		return;
 
-	(void) printf(gettext("\tlogs\n"));
+	(void) printf("\t%s\n", class);
 
 	for (c = 0; c < children; c++) {
-		uint64_t is_log = B_FALSE;
+		const char *vclass = vdev_alloc_class(child[c]);
 		char *name;
 
-		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    &is_log);
-		if (!is_log)
+		if (vclass == NULL || strcmp(vclass, class) != 0)
 			continue;
 		name = zpool_vdev_name(g_zfs, zhp, child[c],
 		    cb->cb_name_flags | VDEV_NAME_TYPE_ID);
@@ -2072,8 +2160,10 @@ show_import(nvlist_t *config)
 		cb.cb_namewidth = 10;
 
 	print_import_config(&cb, name, nvroot, 0);
+	if (num_special(nvroot) > 0)
+		print_class_vdevs(NULL, &cb, nvroot, VDEV_ALLOC_BIAS_SPECIAL);
 	if (num_logs(nvroot) > 0)
-		print_logs(NULL, &cb, nvroot);
+		print_class_vdevs(NULL, &cb, nvroot, VDEV_ALLOC_CLASS_LOGS);
 
 	if (reason == ZPOOL_STATUS_BAD_GUID_SUM) {
 		(void) printf(gettext("\n\tAdditional devices are known to "
@@ -3351,10 +3441,12 @@ print_vdev_stats(zpool_handle_t *zhp, const char *name, nvlist_t *oldnv,
 	vdev_stat_t *oldvs, *newvs, *calcvs;
 	vdev_stat_t zerovs = { 0 };
 	char *vname;
-	int i;
+	int i, n;
 	int ret = 0;
 	uint64_t tdelta;
 	double scale;
+	const char *class_name[] = { VDEV_ALLOC_BIAS_SPECIAL,
+	    VDEV_ALLOC_CLASS_LOGS };
 
 	calcvs = safe_malloc(sizeof (*calcvs));
 
@@ -3467,15 +3559,13 @@ children:
 		return (ret);
 
 	for (c = 0; c < children; c++) {
-		uint64_t ishole = B_FALSE, islog = B_FALSE;
+		uint64_t ishole = B_FALSE;
 
 		(void) nvlist_lookup_uint64(newchild[c], ZPOOL_CONFIG_IS_HOLE,
 		    &ishole);
 
-		(void) nvlist_lookup_uint64(newchild[c], ZPOOL_CONFIG_IS_LOG,
-		    &islog);
-
-		if (ishole || islog)
+		if (ishole || vdev_alloc_class(newchild[c]) != NULL ||
+		    vdev_is_indirect(newchild[c]))
 			continue;
 
 		vname = zpool_vdev_name(g_zfs, zhp, newchild[c],
@@ -3486,30 +3576,30 @@ children:
 	}
 
 	/*
-	 * Log device section
+	 * Special and log device sections
 	 */
+	for (n = 0; n < ARRAY_SIZE(class_name); n++) {
+		if (strcmp(class_name[n], VDEV_ALLOC_CLASS_LOGS) == 0 ?
+		    num_logs(newnv) == 0 : num_special(newnv) == 0)
+			continue;
 
-	if (num_logs(newnv) > 0) {
 		if ((!(cb->cb_flags & IOS_ANYHISTO_M)) && !cb->cb_scripted &&
 		    !cb->cb_vdev_names) {
-			print_iostat_dashes(cb, 0, "logs");
+			print_iostat_dashes(cb, 0, class_name[n]);
 		}
 
 		for (c = 0; c < children; c++) {
-			uint64_t islog = B_FALSE;
-			(void) nvlist_lookup_uint64(newchild[c],
-			    ZPOOL_CONFIG_IS_LOG, &islog);
-
-			if (islog) {
-				vname = zpool_vdev_name(g_zfs, zhp, newchild[c],
-				    cb->cb_name_flags);
-				ret += print_vdev_stats(zhp, vname, oldnv ?
-				    oldchild[c] : NULL, newchild[c],
-				    cb, depth + 2);
-				free(vname);
-			}
-		}
+			const char *class = vdev_alloc_class(newchild[c]);
 
+			if (class == NULL || strcmp(class, class_name[n]) != 0)
+				continue;
+
+			vname = zpool_vdev_name(g_zfs, zhp, newchild[c],
+			    cb->cb_name_flags);
+			ret += print_vdev_stats(zhp, vname, oldnv ?
+			    oldchild[c] : NULL, newchild[c], cb, depth + 2);
+			free(vname);
+		}
 	}
 
 	/*
@@ -4504,6 +4594,55 @@ print_one_column(zpool_prop_t prop, uint64_t value, boolean_t scripted,
 		(void) printf("  %*s", (int)width, propval);
 }
 
+/*
+ * Print the space usage of an allocation class as a whole, as reported in
+ * the pool's class statistics, or dashes if there are none.
+ */
+static void
+print_list_class(zpool_handle_t *zhp, const char *class, const char *label,
+    list_cbdata_t *cb)
+{
+	nvlist_t *config, *nvl;
+	pool_class_stat_t *pcs;
+	enum zfs_nicenum_format format;
+	boolean_t scripted = cb->cb_scripted;
+	uint64_t cap;
+	uint_t c;
+	char *dashes = "%-*s      -      -      -         -      -      -\n";
+
+	config = zpool_get_config(zhp, NULL);
+	if (config == NULL || nvlist_lookup_nvlist(config,
+	    ZPOOL_CONFIG_CLASS_STATS, &nvl) != 0 ||
+	    nvlist_lookup_uint64_array(nvl, class, (uint64_t **)&pcs,
+	    &c) != 0 || c < sizeof (*pcs) / sizeof (uint64_t)) {
+		/* LINTED E_SEC_PRINTF_VAR_FMT */
+		(void) printf(dashes, cb->cb_namewidth, label);
+		return;
+	}
+
+	format = cb->cb_literal ? ZFS_NICENUM_RAW : ZFS_NICENUM_1024;
+
+	if (scripted)
+		(void) printf("\t%s", label);
+	else
+		(void) printf("%-*s", (int)cb->cb_namewidth, label);
+
+	print_one_column(ZPOOL_PROP_SIZE, pcs->pcs_space, scripted, B_TRUE,
+	    format);
+	print_one_column(ZPOOL_PROP_ALLOCATED, pcs->pcs_alloc, scripted,
+	    B_TRUE, format);
+	print_one_column(ZPOOL_PROP_FREE, pcs->pcs_space - pcs->pcs_alloc,
+	    scripted, B_TRUE, format);
+	print_one_column(ZPOOL_PROP_EXPANDSZ, pcs->pcs_esize, scripted,
+	    B_TRUE, format);
+	print_one_column(ZPOOL_PROP_FRAGMENTATION, pcs->pcs_fragmentation,
+	    scripted, pcs->pcs_fragmentation != ZFS_FRAG_INVALID, format);
+	cap = (pcs->pcs_space == 0) ? 0 :
+	    (pcs->pcs_alloc * 100 / pcs->pcs_space);
+	print_one_column(ZPOOL_PROP_CAPACITY, cap, scripted, B_TRUE, format);
+	(void) printf("\n");
+}
+
 void
 print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
     list_cbdata_t *cb, int depth)
@@ -4513,8 +4652,8 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 	uint_t c, children;
 	char *vname;
 	boolean_t scripted = cb->cb_scripted;
-	uint64_t islog = B_FALSE;
-	boolean_t haslog = B_FALSE;
+	boolean_t haslog = (num_logs(nv) > 0);
+	boolean_t hasspecial = (num_special(nv) > 0);
 	char *dashes = "%-*s      -      -      -         -      -      -\n";
 
 	verify(nvlist_lookup_uint64_array(nv, ZPOOL_CONFIG_VDEV_STATS,
@@ -4574,11 +4713,9 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 		    ZPOOL_CONFIG_IS_HOLE, &ishole) == 0 && ishole)
 			continue;
 
-		if (nvlist_lookup_uint64(child[c],
-		    ZPOOL_CONFIG_IS_LOG, &islog) == 0 && islog) {
-			haslog = B_TRUE;
+		if (vdev_alloc_class(child[c]) != NULL ||
+		    vdev_is_indirect(child[c]))
 			continue;
-		}
 
 		vname = zpool_vdev_name(g_zfs, zhp, child[c],
 		    cb->cb_name_flags);
@@ -4586,10 +4723,25 @@ print_list_stats(zpool_handle_t *zhp, const char *name, nvlist_t *nv,
 		free(vname);
 	}
 
+	if (hasspecial == B_TRUE) {
+		print_list_class(zhp, VDEV_ALLOC_BIAS_SPECIAL, "special", cb);
+		for (c = 0; c < children; c++) {
+			if (!nvlist_exists(child[c],
+			    ZPOOL_CONFIG_ALLOCATION_BIAS))
+				continue;
+			vname = zpool_vdev_name(g_zfs, zhp, child[c],
+			    cb->cb_name_flags);
+			print_list_stats(zhp, vname, child[c], cb, depth + 2);
+			free(vname);
+		}
+	}
+
 	if (haslog == B_TRUE) {
 		/* LINTED E_SEC_PRINTF_VAR_FMT */
 		(void) printf(dashes, cb->cb_namewidth, "log");
 		for (c = 0; c < children; c++) {
+			uint64_t islog = B_FALSE;
+
 			if (nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
 			    &islog) != 0 || !islog)
 				continue;
@@ -5094,7 +5246,7 @@ zpool_do_split(int argc, char **argv)
 		if (flags.dryrun) {
 			(void) printf(gettext("would create '%s' with the "
 			    "following layout:\n\n"), newpool);
-			print_vdev_tree(NULL, newpool, config, 0, B_FALSE,
+			print_vdev_tree(NULL, newpool, config, 0, NULL,
 			    flags.name_flags);
 		}
 	}
@@ -5507,17 +5659,199 @@ zpool_do_scrub(int argc, char **argv)
 }
 
 /*
- * Print out detailed scrub status.
+ * Add the names of all leaf vdevs below 'nv' to 'res'.  Holes and removed
+ * vdevs are skipped, and the caller is expected to pass the root of the main vdev tree so that
+ * hot spares and cache devices are never included.
+ */
+static void
+zpool_collect_leaves(zpool_handle_t *zhp, nvlist_t *nv, nvlist_t *res)
+{
+	nvlist_t **child;
+	uint_t c, children;
+	uint64_t ishole = B_FALSE;
+	char *vname;
+
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_HOLE, &ishole);
+	if (ishole || vdev_is_indirect(nv))
+		return;
+
+	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0 || children == 0) {
+		vname = zpool_vdev_name(g_zfs, zhp, nv, VDEV_NAME_PATH);
+		fnvlist_add_boolean(res, vname);
+		free(vname);
+		return;
+	}
+
+	for (c = 0; c < children; c++)
+		zpool_collect_leaves(zhp, child[c], res);
+}
+
+/*
+ * zpool trim [-c | -s] [-r rate] <pool> [<device> ...]
+ *
+ *	-c		Cancel.  Ends any in-progress trim.
+ *	-r rate		Limit each device to 'rate' bytes trimmed per second.
+ *	-s		Suspend.  The trim can be resumed later by running
+ *			'zpool trim' again without -c or -s.
+ *
+ * Trims the free space of the named leaf devices, or of every leaf device
+ * in the pool when none are given.
+ */
+int
+zpool_do_trim(int argc, char **argv)
+{
+	int c;
+	char *poolname;
+	zpool_handle_t *zhp;
+	nvlist_t *vdevs;
+	pool_trim_func_t cmd_type = POOL_TRIM_START;
+	uint64_t rate = 0;
+	int err;
+
+	/* check options */
+	while ((c = getopt(argc, argv, "cr:s")) != -1) {
+		switch (c) {
+		case 'c':
+			if (cmd_type != POOL_TRIM_START) {
+				(void) fprintf(stderr, gettext("-c cannot be "
+				    "combined with -s\n"));
+				usage(B_FALSE);
+			}
+			cmd_type = POOL_TRIM_CANCEL;
+			break;
+		case 'r':
+			if (zfs_nicestrtonum(g_zfs, optarg, &rate) != 0) {
+				(void) fprintf(stderr, "%s: %s\n",
+				    libzfs_error_description(g_zfs), optarg);
+				usage(B_FALSE);
+			}
+			break;
+		case 's':
+			if (cmd_type != POOL_TRIM_START) {
+				(void) fprintf(stderr, gettext("-s cannot be "
+				    "combined with -c\n"));
+				usage(B_FALSE);
+			}
+			cmd_type = POOL_TRIM_SUSPEND;
+			break;
+		case ':':
+			(void) fprintf(stderr, gettext("missing argument for "
+			    "'%c' option\n"), optopt);
+			usage(B_FALSE);
+			break;
+		case '?':
+			(void) fprintf(stderr, gettext("invalid option '%c'\n"),
+			    optopt);
+			usage(B_FALSE);
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		(void) fprintf(stderr, gettext("missing pool name argument\n"));
+		usage(B_FALSE);
+	}
+
+	if (rate != 0 && cmd_type != POOL_TRIM_START) {
+		(void) fprintf(stderr, gettext("-r cannot be combined with "
+		    "-c or -s\n"));
+		usage(B_FALSE);
+	}
+
+	poolname = argv[0];
+	zhp = zpool_open(g_zfs, poolname);
+	if (zhp == NULL)
+		return (1);
+
+	vdevs = fnvlist_alloc();
+	if (argc == 1) {
+		nvlist_t *config = zpool_get_config(zhp, NULL);
+		nvlist_t *nvroot = fnvlist_lookup_nvlist(config,
+		    ZPOOL_CONFIG_VDEV_TREE);
+		zpool_collect_leaves(zhp, nvroot, vdevs);
+	} else {
+		int i;
+
+		for (i = 1; i < argc; i++)
+			fnvlist_add_boolean(vdevs, argv[i]);
+	}
+
+	err = zpool_trim(zhp, cmd_type, vdevs, rate);
+
+	fnvlist_free(vdevs);
+	zpool_close(zhp);
+
+	return (err != 0);
+}
+
+/*
+ * Print out the progress of a scan reported by a kernel module which does
+ * not track issued bytes yet, and so only provides the examined ones.
+ */
+static void
+print_scan_examined(pool_scan_stat_t *ps, const char *processed_buf)
+{
+	uint64_t elapsed, mins_left, hours_left;
+	uint64_t examined, pass_exam, total, rate;
+	double fraction_done;
+	char examined_buf[7], total_buf[7], rate_buf[7];
+
+	examined = ps->pss_examined ? ps->pss_examined : 1;
+	total = ps->pss_to_examine;
+	fraction_done = (double)examined / total;
+
+	/* elapsed time for this pass */
+	elapsed = time(NULL) - ps->pss_pass_start;
+	elapsed = elapsed ? elapsed : 1;
+	pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
+	rate = pass_exam / elapsed;
+	rate = rate ? rate : 1;
+	mins_left = ((total - examined) / rate) / 60;
+	hours_left = mins_left / 60;
+
+	zfs_nicenum(examined, examined_buf, sizeof (examined_buf));
+	zfs_nicenum(total, total_buf, sizeof (total_buf));
+	zfs_nicenum(rate, rate_buf, sizeof (rate_buf));
+
+	/*
+	 * do not print estimated time if hours_left is more than 30 days
+	 */
+	(void) printf(gettext("\t%s scanned out of %s at %s/s"),
+	    examined_buf, total_buf, rate_buf);
+	if (hours_left < (30 * 24)) {
+		(void) printf(gettext(", %lluh%um to go\n"),
+		    (u_longlong_t)hours_left, (uint_t)(mins_left % 60));
+	} else {
+		(void) printf(gettext(
+		    ", (scan is slow, no estimated time)\n"));
+	}
+
+	if (ps->pss_func == POOL_SCAN_RESILVER) {
+		(void) printf(gettext("\t%s resilvered, %.2f%% done\n"),
+		    processed_buf, 100 * fraction_done);
+	} else if (ps->pss_func == POOL_SCAN_SCRUB) {
+		(void) printf(gettext("\t%s repaired, %.2f%% done\n"),
+		    processed_buf, 100 * fraction_done);
+	}
+}
+
+/*
+ * Print out detailed scrub status.  c is the number of uint64_t in the
+ * stats, which is smaller than pool_scan_stat_t with older kernel modules.
  */
 void
-print_scan_status(pool_scan_stat_t *ps)
+print_scan_status(pool_scan_stat_t *ps, uint_t c)
 {
 	time_t start, end;
 	uint64_t elapsed, mins_left, hours_left;
-	uint64_t pass_exam, examined, total;
-	uint_t rate;
+	uint64_t scanned, pass_scanned, issued, pass_issued, total;
+	uint64_t scan_rate, issue_rate;
 	double fraction_done;
-	char processed_buf[7], examined_buf[7], total_buf[7], rate_buf[7];
+	char processed_buf[7], scanned_buf[7], issued_buf[7], total_buf[7];
+	char srate_buf[7], irate_buf[7];
 
 	(void) printf(gettext("  scan: "));
 
@@ -5579,28 +5913,57 @@ print_scan_status(pool_scan_stat_t *ps)
 		    ctime(&start));
 	}
 
-	examined = ps->pss_examined ? ps->pss_examined : 1;
+	if (c < sizeof (pool_scan_stat_t) / sizeof (uint64_t)) {
+		print_scan_examined(ps, processed_buf);
+		return;
+	}
+
+	scanned = ps->pss_examined;
+	pass_scanned = ps->pss_pass_exam;
+	issued = ps->pss_issued;
+	pass_issued = ps->pss_pass_issued;
 	total = ps->pss_to_examine;
-	fraction_done = (double)examined / total;
+
+	/* a block is only done once the I/O for it has been issued */
+	fraction_done = (total != 0) ? (double)issued / total : 0;
 
 	/* elapsed time for this pass */
 	elapsed = time(NULL) - ps->pss_pass_start;
 	elapsed = elapsed ? elapsed : 1;
-	pass_exam = ps->pss_pass_exam ? ps->pss_pass_exam : 1;
-	rate = pass_exam / elapsed;
-	rate = rate ? rate : 1;
-	mins_left = ((total - examined) / rate) / 60;
+	scan_rate = pass_scanned / elapsed;
+	issue_rate = pass_issued / elapsed;
+	if (issue_rate != 0 && total > issued) {
+		mins_left = ((total - issued) / issue_rate) / 60;
+	} else {
+		mins_left = (total > issued) ? UINT64_MAX : 0;
+	}
 	hours_left = mins_left / 60;
 
-	zfs_nicenum(examined, examined_buf, sizeof (examined_buf));
+	zfs_nicenum(scanned, scanned_buf, sizeof (scanned_buf));
+	zfs_nicenum(issued, issued_buf, sizeof (issued_buf));
 	zfs_nicenum(total, total_buf, sizeof (total_buf));
-	zfs_nicenum(rate, rate_buf, sizeof (rate_buf));
+	zfs_nicenum(scan_rate, srate_buf, sizeof (srate_buf));
+	zfs_nicenum(issue_rate, irate_buf, sizeof (irate_buf));
+
+	/*
+	 * Blocks are scanned (found by the metadata traversal) ahead of
+	 * being issued (actually read) since the reads are sorted first.
+	 */
+	(void) printf(gettext("	%s scanned at %s/s, "
+	    "%s issued at %s/s, %s total\n"),
+	    scanned_buf, srate_buf, issued_buf, irate_buf, total_buf);
+
+	if (ps->pss_func == POOL_SCAN_RESILVER) {
+		(void) printf(gettext("	%s resilvered, %.2f%% done"),
+		    processed_buf, 100 * fraction_done);
+	} else if (ps->pss_func == POOL_SCAN_SCRUB) {
+		(void) printf(gettext("	%s repaired, %.2f%% done"),
+		    processed_buf, 100 * fraction_done);
+	}
 
 	/*
 	 * do not print estimated time if hours_left is more than 30 days
 	 */
-	(void) printf(gettext("\t%s scanned out of %s at %s/s"),
-	    examined_buf, total_buf, rate_buf);
 	if (hours_left < (30 * 24)) {
 		(void) printf(gettext(", %lluh%um to go\n"),
 		    (u_longlong_t)hours_left, (uint_t)(mins_left % 60));
@@ -5608,14 +5971,193 @@ print_scan_status(pool_scan_stat_t *ps)
 		(void) printf(gettext(
 		    ", (scan is slow, no estimated time)\n"));
 	}
+}
 
-	if (ps->pss_func == POOL_SCAN_RESILVER) {
-		(void) printf(gettext("\t%s resilvered, %.2f%% done\n"),
-		    processed_buf, 100 * fraction_done);
-	} else if (ps->pss_func == POOL_SCAN_SCRUB) {
-		(void) printf(gettext("\t%s repaired, %.2f%% done\n"),
-		    processed_buf, 100 * fraction_done);
+/*
+ * Print out the progress of the current or last top-level vdev removal.
+ */
+static void
+print_removal_status(zpool_handle_t *zhp, pool_removal_stat_t *prs)
+{
+	char copied_buf[7], total_buf[7], rate_buf[7], mem_buf[7];
+	time_t start, end;
+	nvlist_t *config, *nvroot;
+	nvlist_t **child;
+	uint_t children;
+	char *vdev_name;
+
+	if (prs == NULL || prs->prs_state == DSS_NONE)
+		return;
+
+	/*
+	 * Determine name of vdev.
+	 */
+	config = zpool_get_config(zhp, NULL);
+	nvroot = fnvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE);
+	verify(nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) == 0);
+	assert(prs->prs_removing_vdev < children);
+	vdev_name = zpool_vdev_name(g_zfs, zhp,
+	    child[prs->prs_removing_vdev], VDEV_NAME_TYPE_ID);
+
+	(void) printf(gettext("remove: "));
+
+	start = prs->prs_start_time;
+	end = prs->prs_end_time;
+	zfs_nicenum(prs->prs_copied, copied_buf, sizeof (copied_buf));
+
+	/*
+	 * Removal is finished or canceled.
+	 */
+	if (prs->prs_state == DSS_FINISHED) {
+		uint64_t minutes_taken = (end - start) / 60;
+
+		(void) printf(gettext("Removal of vdev %llu copied %s "
+		    "in %lluh%um, completed on %s"),
+		    (u_longlong_t)prs->prs_removing_vdev, copied_buf,
+		    (u_longlong_t)(minutes_taken / 60),
+		    (uint_t)(minutes_taken % 60), ctime(&end));
+	} else if (prs->prs_state == DSS_CANCELED) {
+		(void) printf(gettext("Removal of %s canceled on %s"),
+		    vdev_name, ctime(&end));
+	} else {
+		uint64_t copied, total, elapsed, rate, mins_left, hours_left;
+		double fraction_done;
+
+		assert(prs->prs_state == DSS_SCANNING);
+
+		/*
+		 * Removal is in progress.
+		 */
+		(void) printf(gettext("Evacuation of %s in progress since %s"),
+		    vdev_name, ctime(&start));
+
+		copied = prs->prs_copied;
+		total = prs->prs_to_copy;
+		fraction_done = (total != 0) ? (double)copied / total : 0;
+
+		elapsed = time(NULL) - start;
+		elapsed = elapsed ? elapsed : 1;
+		rate = copied / elapsed;
+		if (rate != 0 && total > copied) {
+			mins_left = ((total - copied) / rate) / 60;
+		} else {
+			mins_left = (total > copied) ? UINT64_MAX : 0;
+		}
+		hours_left = mins_left / 60;
+
+		zfs_nicenum(total, total_buf, sizeof (total_buf));
+		zfs_nicenum(rate, rate_buf, sizeof (rate_buf));
+
+		(void) printf(gettext("	%s copied out of %s at %s/s, "
+		    "%.2f%% done"), copied_buf, total_buf, rate_buf,
+		    100 * fraction_done);
+
+		/*
+		 * do not print estimated time if hours_left is more than
+		 * 30 days
+		 */
+		if (hours_left < (30 * 24)) {
+			(void) printf(gettext(", %lluh%um to go\n"),
+			    (u_longlong_t)hours_left, (uint_t)(mins_left % 60));
+		} else {
+			(void) printf(gettext(
+			    ", (copy is slow, no estimated time)\n"));
+		}
+	}
+	free(vdev_name);
+
+	if (prs->prs_mapping_memory > 0) {
+		zfs_nicenum(prs->prs_mapping_memory, mem_buf, sizeof (mem_buf));
+		(void) printf(gettext("	%s memory used for "
+		    "removed device mappings\n"), mem_buf);
+	}
+}
+
+/*
+ * Print out the progress of the current or last raidz expansion.
+ */
+static void
+print_raidz_expand_status(zpool_handle_t *zhp, pool_raidz_expand_stat_t *pres)
+{
+	char copied_buf[7], total_buf[7], rate_buf[7];
+	time_t start, end;
+	nvlist_t *config, *nvroot;
+	nvlist_t **child;
+	uint_t children;
+	char *vdev_name;
+
+	if (pres == NULL || pres->pres_state == DSS_NONE)
+		return;
+
+	/*
+	 * Determine name of vdev.
+	 */
+	config = zpool_get_config(zhp, NULL);
+	nvroot = fnvlist_lookup_nvlist(config, ZPOOL_CONFIG_VDEV_TREE);
+	verify(nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) == 0);
+	assert(pres->pres_expanding_vdev < children);
+	vdev_name = zpool_vdev_name(g_zfs, zhp,
+	    child[pres->pres_expanding_vdev], VDEV_NAME_TYPE_ID);
+
+	(void) printf(gettext("expand: "));
+
+	start = pres->pres_start_time;
+	end = pres->pres_end_time;
+	zfs_nicenum(pres->pres_reflowed, copied_buf, sizeof (copied_buf));
+
+	if (pres->pres_state == DSS_FINISHED) {
+		uint64_t minutes_taken = (end - start) / 60;
+
+		(void) printf(gettext("Expansion of %s reflowed %s "
+		    "in %lluh%um, completed on %s"),
+		    vdev_name, copied_buf,
+		    (u_longlong_t)(minutes_taken / 60),
+		    (uint_t)(minutes_taken % 60), ctime(&end));
+	} else {
+		uint64_t copied, total, elapsed, rate, mins_left, hours_left;
+		double fraction_done;
+
+		assert(pres->pres_state == DSS_SCANNING);
+
+		(void) printf(gettext("Expansion of %s in progress since %s"),
+		    vdev_name, ctime(&start));
+
+		copied = pres->pres_reflowed;
+		total = pres->pres_to_reflow;
+		fraction_done = (total != 0) ? (double)copied / total : 0;
+
+		elapsed = time(NULL) - start;
+		elapsed = elapsed ? elapsed : 1;
+		rate = copied / elapsed;
+		if (rate != 0 && total > copied) {
+			mins_left = ((total - copied) / rate) / 60;
+		} else {
+			mins_left = (total > copied) ? UINT64_MAX : 0;
+		}
+		hours_left = mins_left / 60;
+
+		zfs_nicenum(total, total_buf, sizeof (total_buf));
+		zfs_nicenum(rate, rate_buf, sizeof (rate_buf));
+
+		(void) printf(gettext("	%s reflowed out of %s at %s/s, "
+		    "%.2f%% done"), copied_buf, total_buf, rate_buf,
+		    100 * MIN(fraction_done, 1.0));
+
+		/*
+		 * do not print estimated time if hours_left is more than
+		 * 30 days
+		 */
+		if (hours_left < (30 * 24)) {
+			(void) printf(gettext(", %lluh%um to go\n"),
+			    (u_longlong_t)hours_left, (uint_t)(mins_left % 60));
+		} else {
+			(void) printf(gettext(
+			    ", (reflow is slow, no estimated time)\n"));
+		}
 	}
+	free(vdev_name);
 }
 
 static void
@@ -6024,10 +6566,20 @@ status_callback(zpool_handle_t *zhp, void *data)
 		nvlist_t **spares, **l2cache;
 		uint_t nspares, nl2cache;
 		pool_scan_stat_t *ps = NULL;
+		pool_removal_stat_t *prs = NULL;
+		pool_raidz_expand_stat_t *pres = NULL;
 
 		(void) nvlist_lookup_uint64_array(nvroot,
 		    ZPOOL_CONFIG_SCAN_STATS, (uint64_t **)&ps, &c);
-		print_scan_status(ps);
+		print_scan_status(ps, c);
+
+		(void) nvlist_lookup_uint64_array(nvroot,
+		    ZPOOL_CONFIG_REMOVAL_STATS, (uint64_t **)&prs, &c);
+		print_removal_status(zhp, prs);
+
+		(void) nvlist_lookup_uint64_array(nvroot,
+		    ZPOOL_CONFIG_RAIDZ_EXPAND_STATS, (uint64_t **)&pres, &c);
+		print_raidz_expand_status(zhp, pres);
 
 		cbp->cb_namewidth = max_width(zhp, nvroot, 0, 0,
 		    cbp->cb_name_flags | VDEV_NAME_TYPE_ID);
@@ -6041,8 +6593,12 @@ status_callback(zpool_handle_t *zhp, void *data)
 		print_status_config(zhp, cbp, zpool_get_name(zhp), nvroot, 0,
 		    B_FALSE);
 
+		if (num_special(nvroot) > 0)
+			print_class_vdevs(zhp, cbp, nvroot,
+			    VDEV_ALLOC_BIAS_SPECIAL);
 		if (num_logs(nvroot) > 0)
-			print_logs(zhp, cbp, nvroot);
+			print_class_vdevs(zhp, cbp, nvroot,
+			    VDEV_ALLOC_CLASS_LOGS);
 		if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_L2CACHE,
 		    &l2cache, &nl2cache) == 0)
 			print_l2cache(zhp, cbp, l2cache, nl2cache);
@@ -6291,6 +6847,16 @@ upgrade_enable_all(zpool_handle_t *zhp, int *countp)
 			verify(-1 != asprintf(&propname, "feature@%s", fname));
 			ret = zpool_set_prop(zhp, propname,
 			    ZFS_FEATURE_ENABLED);
+			/*
+			 * The kernel may not support every feature we know
+			 * about, e.g. zstd_compress when it was built without
+			 * zstd.  Skip those rather than stopping the upgrade.
+			 */
+			if (ret != 0 &&
+			    libzfs_errno(g_zfs) == EZFS_POOL_NOTSUP) {
+				free(propname);
+				continue;
+			}
 			if (ret != 0) {
 				free(propname);
 				return (ret);
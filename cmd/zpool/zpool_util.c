@@ -86,6 +86,57 @@ num_logs(nvlist_t *nv)
 	return (nlogs);
 }
 
+/*
+ * Return the number of special allocation class vdevs in supplied nvlist
+ */
+uint_t
+num_special(nvlist_t *nv)
+{
+	uint_t nspecial = 0;
+	uint_t c, children;
+	nvlist_t **child;
+
+	if (nvlist_lookup_nvlist_array(nv, ZPOOL_CONFIG_CHILDREN,
+	    &child, &children) != 0)
+		return (0);
+
+	for (c = 0; c < children; c++) {
+		if (nvlist_exists(child[c], ZPOOL_CONFIG_ALLOCATION_BIAS))
+			nspecial++;
+	}
+	return (nspecial);
+}
+
+/*
+ * Return the allocation class of a top-level vdev: NULL for the normal
+ * class, VDEV_ALLOC_CLASS_LOGS for a log device, or its allocation bias.
+ */
+const char *
+vdev_alloc_class(nvlist_t *nv)
+{
+	uint64_t is_log = B_FALSE;
+	char *bias;
+
+	(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_IS_LOG, &is_log);
+	if (is_log)
+		return (VDEV_ALLOC_CLASS_LOGS);
+	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS, &bias) == 0)
+		return (bias);
+	return (NULL);
+}
+
+/*
+ * Return B_TRUE if the vdev is what remains of a removed top-level vdev.
+ */
+boolean_t
+vdev_is_indirect(nvlist_t *nv)
+{
+	char *type;
+
+	return (nvlist_lookup_string(nv, ZPOOL_CONFIG_TYPE, &type) == 0 &&
+	    strcmp(type, VDEV_TYPE_INDIRECT) == 0);
+}
+
 /* Find the max element in an array of uint64_t values */
 uint64_t
 array64_max(uint64_t array[], unsigned int len) {
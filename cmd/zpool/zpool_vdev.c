@@ -1413,6 +1413,12 @@ is_grouping(const char *type, int *mindev, int *maxdev)
 		return (VDEV_TYPE_LOG);
 	}
 
+	if (strcmp(type, VDEV_ALLOC_BIAS_SPECIAL) == 0) {
+		if (mindev != NULL)
+			*mindev = 1;
+		return (VDEV_ALLOC_BIAS_SPECIAL);
+	}
+
 	if (strcmp(type, "cache") == 0) {
 		if (mindev != NULL)
 			*mindev = 1;
@@ -1432,10 +1438,10 @@ nvlist_t *
 construct_spec(nvlist_t *props, int argc, char **argv)
 {
 	nvlist_t *nvroot, *nv, **top, **spares, **l2cache;
-	int t, toplevels, mindev, maxdev, nspares, nlogs, nl2cache;
-	const char *type;
+	int t, toplevels, mindev, maxdev, nspares, nlogs, nl2cache, nspecial;
+	const char *type, *alloc_bias;
 	uint64_t is_log;
-	boolean_t seen_logs;
+	boolean_t seen_logs, seen_special;
 
 	top = NULL;
 	toplevels = 0;
@@ -1444,8 +1450,11 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 	nspares = 0;
 	nlogs = 0;
 	nl2cache = 0;
+	nspecial = 0;
 	is_log = B_FALSE;
 	seen_logs = B_FALSE;
+	alloc_bias = NULL;
+	seen_special = B_FALSE;
 	nvroot = NULL;
 
 	while (argc > 0) {
@@ -1468,6 +1477,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 					goto spec_out;
 				}
 				is_log = B_FALSE;
+				alloc_bias = NULL;
 			}
 
 			if (strcmp(type, VDEV_TYPE_LOG) == 0) {
@@ -1480,6 +1490,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				}
 				seen_logs = B_TRUE;
 				is_log = B_TRUE;
+				alloc_bias = NULL;
 				argc--;
 				argv++;
 				/*
@@ -1489,6 +1500,27 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 				continue;
 			}
 
+			if (strcmp(type, VDEV_ALLOC_BIAS_SPECIAL) == 0) {
+				if (seen_special) {
+					(void) fprintf(stderr,
+					    gettext("invalid vdev "
+					    "specification: 'special' can be "
+					    "specified only once\n"));
+					goto spec_out;
+				}
+				seen_special = B_TRUE;
+				is_log = B_FALSE;
+				alloc_bias = type;
+				argc--;
+				argv++;
+				/*
+				 * Like a log, 'special' is not a real
+				 * grouping device.  The vdevs which follow
+				 * it are placed in the special class.
+				 */
+				continue;
+			}
+
 			if (strcmp(type, VDEV_TYPE_L2CACHE) == 0) {
 				if (l2cache != NULL) {
 					(void) fprintf(stderr,
@@ -1498,6 +1530,7 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 					goto spec_out;
 				}
 				is_log = B_FALSE;
+				alloc_bias = NULL;
 			}
 
 			if (is_log) {
@@ -1596,6 +1629,12 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 			argv++;
 		}
 
+		if (alloc_bias != NULL) {
+			verify(nvlist_add_string(nv,
+			    ZPOOL_CONFIG_ALLOCATION_BIAS, alloc_bias) == 0);
+			nspecial++;
+		}
+
 		toplevels++;
 		top = realloc(top, toplevels * sizeof (nvlist_t *));
 		if (top == NULL)
@@ -1616,6 +1655,12 @@ construct_spec(nvlist_t *props, int argc, char **argv)
 		goto spec_out;
 	}
 
+	if (seen_special && nspecial == 0) {
+		(void) fprintf(stderr, gettext("invalid vdev specification: "
+		    "special requires at least 1 device\n"));
+		goto spec_out;
+	}
+
 	/*
 	 * Finally, create nvroot and add all top-level vdevs to it.
 	 */
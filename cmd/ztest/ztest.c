@@ -312,6 +312,7 @@ ztest_func_t ztest_zap;
 ztest_func_t ztest_zap_parallel;
 ztest_func_t ztest_zil_commit;
 ztest_func_t ztest_zil_remount;
+ztest_func_t ztest_zil_readonly;
 ztest_func_t ztest_dmu_read_write_zcopy;
 ztest_func_t ztest_dmu_objset_create_destroy;
 ztest_func_t ztest_dmu_prealloc;
@@ -322,19 +323,24 @@ ztest_func_t ztest_spa_prop_get_set;
 ztest_func_t ztest_spa_create_destroy;
 ztest_func_t ztest_fault_inject;
 ztest_func_t ztest_ddt_repair;
+ztest_func_t ztest_ddt_log;
+ztest_func_t ztest_raidz_expand;
 ztest_func_t ztest_dmu_snapshot_hold;
 ztest_func_t ztest_spa_rename;
 ztest_func_t ztest_scrub;
+ztest_func_t ztest_vdev_trim;
 ztest_func_t ztest_dsl_dataset_promote_busy;
 ztest_func_t ztest_vdev_attach_detach;
 ztest_func_t ztest_vdev_LUN_growth;
 ztest_func_t ztest_vdev_add_remove;
+ztest_func_t ztest_device_removal;
 ztest_func_t ztest_vdev_aux_add_remove;
 ztest_func_t ztest_split_pool;
 ztest_func_t ztest_reguid;
 ztest_func_t ztest_spa_upgrade;
 ztest_func_t ztest_fletcher;
 ztest_func_t ztest_fletcher_incr;
+ztest_func_t ztest_zstd;
 ztest_func_t ztest_verify_dnode_bt;
 
 uint64_t zopt_always = 0ULL * NANOSEC;		/* all the time */
@@ -359,6 +365,7 @@ ztest_info_t ztest_info[] = {
 	ZTI_INIT(ztest_split_pool, 1, &zopt_always),
 	ZTI_INIT(ztest_zil_commit, 1, &zopt_incessant),
 	ZTI_INIT(ztest_zil_remount, 1, &zopt_sometimes),
+	ZTI_INIT(ztest_zil_readonly, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_dmu_read_write_zcopy, 1, &zopt_often),
 	ZTI_INIT(ztest_dmu_objset_create_destroy, 1, &zopt_often),
 	ZTI_INIT(ztest_dsl_prop_get_set, 1, &zopt_often),
@@ -371,18 +378,23 @@ ztest_info_t ztest_info[] = {
 	ZTI_INIT(ztest_spa_create_destroy, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_fault_inject, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_ddt_repair, 1, &zopt_sometimes),
+	ZTI_INIT(ztest_ddt_log, 1, &zopt_sometimes),
+	ZTI_INIT(ztest_raidz_expand, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_dmu_snapshot_hold, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_reguid, 1, &zopt_rarely),
 	ZTI_INIT(ztest_spa_rename, 1, &zopt_rarely),
 	ZTI_INIT(ztest_scrub, 1, &zopt_rarely),
+	ZTI_INIT(ztest_vdev_trim, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_spa_upgrade, 1, &zopt_rarely),
 	ZTI_INIT(ztest_dsl_dataset_promote_busy, 1, &zopt_rarely),
 	ZTI_INIT(ztest_vdev_attach_detach, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_vdev_LUN_growth, 1, &zopt_rarely),
 	ZTI_INIT(ztest_vdev_add_remove, 1, &ztest_opts.zo_vdevtime),
 	ZTI_INIT(ztest_vdev_aux_add_remove, 1, &ztest_opts.zo_vdevtime),
+	ZTI_INIT(ztest_device_removal, 1, &zopt_sometimes),
 	ZTI_INIT(ztest_fletcher, 1, &zopt_rarely),
 	ZTI_INIT(ztest_fletcher_incr, 1, &zopt_rarely),
+	ZTI_INIT(ztest_zstd, 1, &zopt_rarely),
 	ZTI_INIT(ztest_verify_dnode_bt, 1, &zopt_sometimes),
 };
 
@@ -429,6 +441,7 @@ static spa_t *ztest_spa = NULL;
 static ztest_ds_t *ztest_ds;
 
 static kmutex_t ztest_vdev_lock;
+static boolean_t ztest_device_removal_active = B_FALSE;
 
 /*
  * The ztest_name_lock protects the pool and dataset namespace used by
@@ -972,7 +985,7 @@ make_vdev_mirror(char *path, char *aux, char *pool, size_t size,
 
 static nvlist_t *
 make_vdev_root(char *path, char *aux, char *pool, size_t size, uint64_t ashift,
-    int log, int r, int m, int t)
+    const char *class, int r, int m, int t)
 {
 	nvlist_t *root, **child;
 	int c;
@@ -985,7 +998,12 @@ make_vdev_root(char *path, char *aux, char *pool, size_t size, uint64_t ashift,
 		child[c] = make_vdev_mirror(path, aux, pool, size, ashift,
 		    r, m);
 		VERIFY(nvlist_add_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
-		    log) == 0);
+		    class != NULL && strcmp(class, VDEV_TYPE_LOG) == 0) == 0);
+		if (class != NULL &&
+		    strcmp(class, VDEV_ALLOC_BIAS_SPECIAL) == 0) {
+			VERIFY(nvlist_add_string(child[c],
+			    ZPOOL_CONFIG_ALLOCATION_BIAS, class) == 0);
+		}
 	}
 
 	VERIFY(nvlist_alloc(&root, NV_UNIQUE_NAME, 0) == 0);
@@ -1086,7 +1104,7 @@ ztest_random_vdev_top(spa_t *spa, boolean_t log_ok)
 	do {
 		top = ztest_random(rvd->vdev_children);
 		tvd = rvd->vdev_child[top];
-	} while (tvd->vdev_ishole || (tvd->vdev_islog && !log_ok) ||
+	} while (!vdev_is_concrete(tvd) || (tvd->vdev_islog && !log_ok) ||
 	    tvd->vdev_mg == NULL || tvd->vdev_mg->mg_class == NULL);
 
 	return (top);
@@ -2607,6 +2625,91 @@ ztest_zil_remount(ztest_ds_t *zd, uint64_t id)
 	mutex_exit(&zd->zd_dirobj_lock);
 }
 
+/*
+ * Open, commit and close the intent log of a snapshot, as when a snapshot
+ * zvol is opened and closed, and of a dataset on a pool imported
+ * read-only, as when a read-only file system is synced.  Neither can
+ * have anything to commit, and a commit must not dirty either of them.
+ */
+/* ARGSUSED */
+void
+ztest_zil_readonly(ztest_ds_t *zd, uint64_t id)
+{
+	char snapname[ZFS_MAX_DATASET_NAME_LEN];
+	nvlist_t *nvroot, *props, *config;
+	zilog_t *zilog;
+	objset_t *os;
+	spa_t *spa;
+	char *name;
+	int error;
+
+	(void) rw_rdlock(&ztest_name_lock);
+	(void) snprintf(snapname, sizeof (snapname), "%s@zil_%llu",
+	    zd->zd_name, (u_longlong_t)id);
+	error = dmu_objset_snapshot_one(zd->zd_name, strchr(snapname, '@') + 1);
+	if (error == ENOSPC) {
+		(void) rw_unlock(&ztest_name_lock);
+		ztest_record_enospc(FTAG);
+		return;
+	}
+	if (error != 0 && error != EEXIST)
+		fatal(0, "dmu_objset_snapshot_one(%s) = %d", snapname, error);
+
+	VERIFY0(dmu_objset_own(snapname, DMU_OST_ANY, B_TRUE, B_TRUE, FTAG,
+	    &os));
+	zilog = zil_open(os, ztest_get_data);
+	zil_commit(zilog, 0);
+	zil_close(zilog);
+	dmu_objset_disown(os, FTAG);
+
+	error = dsl_destroy_snapshot(snapname, B_FALSE);
+	if (error != 0 && error != ENOENT)
+		fatal(0, "dsl_destroy_snapshot(%s) = %d", snapname, error);
+	(void) rw_unlock(&ztest_name_lock);
+
+	mutex_enter(&ztest_vdev_lock);
+	name = kmem_asprintf("%s_ro", ztest_opts.zo_pool);
+
+	/*
+	 * Clean up from previous runs.
+	 */
+	(void) spa_destroy(name);
+
+	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size, 0,
+	    NULL, 0, 0, 1);
+	VERIFY0(spa_create(name, nvroot, NULL, NULL, NULL));
+	nvlist_free(nvroot);
+	VERIFY0(spa_export(name, &config, B_FALSE, B_FALSE));
+
+	props = fnvlist_alloc();
+	fnvlist_add_uint64(props, zpool_prop_to_name(ZPOOL_PROP_READONLY), 1);
+	VERIFY0(spa_import(name, config, props, 0));
+	fnvlist_free(props);
+	nvlist_free(config);
+
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_TRUE, B_TRUE, FTAG, &os));
+	zilog = zil_open(os, ztest_get_data);
+	zil_commit(zilog, 0);
+	zil_close(zilog);
+	dmu_objset_disown(os, FTAG);
+
+	/*
+	 * A read-only pool isn't syncing, so spa_export() doesn't wait for
+	 * the disowned objset to be evicted and would fail with EBUSY.
+	 */
+	VERIFY0(spa_open(name, &spa, FTAG));
+	spa_evicting_os_wait(spa);
+	spa_close(spa, FTAG);
+
+	/*
+	 * The vdevs of a read-only pool can't be marked destroyed; they
+	 * are recreated by the next run.
+	 */
+	VERIFY0(spa_export(name, NULL, B_FALSE, B_FALSE));
+	strfree(name);
+	mutex_exit(&ztest_vdev_lock);
+}
+
 /*
  * Verify that we can't destroy an active pool, create an existing pool,
  * or create a pool with a bad vdev spec.
@@ -2622,7 +2725,7 @@ ztest_spa_create_destroy(ztest_ds_t *zd, uint64_t id)
 	/*
 	 * Attempt to create using a bad file.
 	 */
-	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, 0, 0, 0, 1);
+	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, NULL, 0, 0, 1);
 	VERIFY3U(ENOENT, ==,
 	    spa_create("ztest_bad_file", nvroot, NULL, NULL, NULL));
 	nvlist_free(nvroot);
@@ -2630,7 +2733,7 @@ ztest_spa_create_destroy(ztest_ds_t *zd, uint64_t id)
 	/*
 	 * Attempt to create using a bad mirror.
 	 */
-	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, 0, 0, 2, 1);
+	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, NULL, 0, 2, 1);
 	VERIFY3U(ENOENT, ==,
 	    spa_create("ztest_bad_mirror", nvroot, NULL, NULL, NULL));
 	nvlist_free(nvroot);
@@ -2640,7 +2743,7 @@ ztest_spa_create_destroy(ztest_ds_t *zd, uint64_t id)
 	 * what's in the nvroot; we should fail with EEXIST.
 	 */
 	(void) rw_rdlock(&ztest_name_lock);
-	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, 0, 0, 0, 1);
+	nvroot = make_vdev_root("/dev/bogus", NULL, NULL, 0, 0, NULL, 0, 0, 1);
 	VERIFY3U(EEXIST, ==,
 	    spa_create(zo->zo_pool, nvroot, NULL, NULL, NULL));
 	nvlist_free(nvroot);
@@ -2670,7 +2773,7 @@ ztest_spa_upgrade(ztest_ds_t *zd, uint64_t id)
 	(void) spa_destroy(name);
 
 	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size, 0,
-	    0, ztest_opts.zo_raidz, ztest_opts.zo_mirrors, 1);
+	    NULL, ztest_opts.zo_raidz, ztest_opts.zo_mirrors, 1);
 
 	/*
 	 * If we're configuring a RAIDZ device then make sure that the
@@ -2807,28 +2910,95 @@ ztest_vdev_add_remove(ztest_ds_t *zd, uint64_t id)
 		if (error && error != EEXIST)
 			fatal(0, "spa_vdev_remove() = %d", error);
 	} else {
+		const char *class = NULL;
+
 		spa_config_exit(spa, SCL_VDEV, FTAG);
 
 		/*
-		 * Make 1/4 of the devices be log devices.
+		 * Make 1/4 of the devices be log devices, and 1/4 of the
+		 * rest be special devices if the pool supports them.
 		 */
+		if (ztest_random(4) == 0) {
+			class = VDEV_TYPE_LOG;
+		} else if (ztest_random(4) == 0 && spa_feature_is_enabled(spa,
+		    SPA_FEATURE_ALLOCATION_CLASSES)) {
+			class = VDEV_ALLOC_BIAS_SPECIAL;
+		}
+
 		nvroot = make_vdev_root(NULL, NULL, NULL,
-		    ztest_opts.zo_vdev_size, 0,
-		    ztest_random(4) == 0, ztest_opts.zo_raidz,
+		    ztest_opts.zo_vdev_size, 0, class, ztest_opts.zo_raidz,
 		    zs->zs_mirrors, 1);
 
 		error = spa_vdev_add(spa, nvroot);
 		nvlist_free(nvroot);
 
+		/*
+		 * A device removal refuses vdevs it couldn't copy to.
+		 */
 		if (error == ENOSPC)
 			ztest_record_enospc("spa_vdev_add");
-		else if (error != 0)
+		else if (error != 0 && (error != EINVAL ||
+		    !ztest_device_removal_active))
 			fatal(0, "spa_vdev_add() = %d", error);
 	}
 
 	mutex_exit(&ztest_vdev_lock);
 }
 
+/*
+ * Verify that a top-level vdev can be removed, by copying its data to the
+ * other vdevs of the pool.
+ */
+/* ARGSUSED */
+void
+ztest_device_removal(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa = ztest_spa;
+	vdev_t *vd;
+	uint64_t guid;
+	int error;
+
+	mutex_enter(&ztest_vdev_lock);
+
+	if (ztest_device_removal_active) {
+		mutex_exit(&ztest_vdev_lock);
+		return;
+	}
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	vd = vdev_lookup_top(spa, ztest_random_vdev_top(spa, B_FALSE));
+	guid = vd->vdev_guid;
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	/*
+	 * Removal isn't supported with RAID-Z, and fails if the other
+	 * vdevs are too full.
+	 */
+	error = spa_vdev_remove(spa, guid, B_FALSE);
+	if (error != 0) {
+		mutex_exit(&ztest_vdev_lock);
+		if (error == ENOSPC)
+			ztest_record_enospc("spa_vdev_remove");
+		else if (error != EINVAL && error != EBUSY)
+			fatal(0, "spa_vdev_remove() = %d", error);
+		return;
+	}
+
+	/*
+	 * Faults injected while the data is copied could end up in the
+	 * only copy, see ztest_fault_inject().
+	 */
+	ztest_device_removal_active = B_TRUE;
+	mutex_exit(&ztest_vdev_lock);
+
+	while (spa->spa_vdev_removal != NULL)
+		txg_wait_synced(spa_get_dsl(spa), 0);
+
+	mutex_enter(&ztest_vdev_lock);
+	ztest_device_removal_active = B_FALSE;
+	mutex_exit(&ztest_vdev_lock);
+}
+
 /*
  * Verify that adding/removing aux devices (l2arc, hot spare) works as expected.
  */
@@ -2892,7 +3062,7 @@ ztest_vdev_aux_add_remove(ztest_ds_t *zd, uint64_t id)
 		 * Add a new device.
 		 */
 		nvlist_t *nvroot = make_vdev_root(NULL, aux, NULL,
-		    (ztest_opts.zo_vdev_size * 5) / 4, 0, 0, 0, 0, 1);
+		    (ztest_opts.zo_vdev_size * 5) / 4, 0, NULL, 0, 0, 1);
 		error = spa_vdev_add(spa, nvroot);
 		if (error != 0)
 			fatal(0, "spa_vdev_add(%p) = %d", nvroot, error);
@@ -3165,7 +3335,7 @@ ztest_vdev_attach_detach(ztest_ds_t *zd, uint64_t id)
 	 * Build the nvlist describing newpath.
 	 */
 	root = make_vdev_root(newpath, NULL, NULL, newvd == NULL ? newsize : 0,
-	    ashift, 0, 0, 0, 1);
+	    ashift, NULL, 0, 0, 1);
 
 	error = spa_vdev_attach(spa, oldguid, root, replacing);
 
@@ -5033,6 +5203,11 @@ ztest_dsl_prop_get_set(ztest_ds_t *zd, uint64_t id)
 	VERIFY0(ztest_dsl_prop_set_uint64(zd->zd_name, ZFS_PROP_RECORDSIZE,
 	    ztest_random_blocksize(), (int)ztest_random(2)));
 
+	VERIFY0(ztest_dsl_prop_set_uint64(zd->zd_name,
+	    ZFS_PROP_SPECIAL_SMALL_BLOCKS, ztest_random(2) == 0 ? 0 :
+	    1ULL << (SPA_MINBLOCKSHIFT + ztest_random(SPA_OLD_MAXBLOCKSHIFT -
+	    SPA_MINBLOCKSHIFT + 1)), (int)ztest_random(2)));
+
 	(void) rw_unlock(&ztest_name_lock);
 }
 
@@ -5047,6 +5222,8 @@ ztest_spa_prop_get_set(ztest_ds_t *zd, uint64_t id)
 	(void) ztest_spa_prop_set_uint64(ZPOOL_PROP_DEDUPDITTO,
 	    ZIO_DEDUPDITTO_MIN + ztest_random(ZIO_DEDUPDITTO_MIN));
 
+	(void) ztest_spa_prop_set_uint64(ZPOOL_PROP_AUTOTRIM, ztest_random(2));
+
 	VERIFY0(spa_prop_get(ztest_spa, &props));
 
 	if (ztest_opts.zo_verbose >= 6)
@@ -5227,6 +5404,16 @@ ztest_fault_inject(ztest_ds_t *zd, uint64_t id)
 	pathrand = umem_alloc(MAXPATHLEN, UMEM_NOFAIL);
 
 	mutex_enter(&ztest_vdev_lock);
+
+	/*
+	 * The data of a vdev being removed is copied without verifying
+	 * its checksums, so damaging it could damage the only copy.
+	 */
+	if (ztest_device_removal_active) {
+		mutex_exit(&ztest_vdev_lock);
+		goto out;
+	}
+
 	maxfaults = MAXFAULTS();
 	leaves = MAX(zs->zs_mirrors, 1) * ztest_opts.zo_raidz;
 	mirror_save = zs->zs_mirrors;
@@ -5543,6 +5730,317 @@ ztest_ddt_repair(ztest_ds_t *zd, uint64_t id)
 	umem_free(od, sizeof (ztest_od_t));
 }
 
+/*
+ * Verify that the DDT logs are replayed when a pool is imported.  Write
+ * duplicate blocks to a new pool with dedup on, export it while most of
+ * the logged entries have not been merged, and check that they are back
+ * in the log once it is imported again.  Freeing the blocks then needs
+ * the replayed entries to find their references.
+ */
+/* ARGSUSED */
+void
+ztest_ddt_log(ztest_ds_t *zd, uint64_t id)
+{
+	enum zio_checksum checksum = ZIO_CHECKSUM_SHA256;
+	uint64_t blocksize = SPA_MINBLOCKSIZE << ztest_random(4);
+	uint64_t nblocks = 128, unique = nblocks / 2;
+	uint64_t object, pattern, logged, replayed, i;
+	int txg_max, entries_min;
+	nvlist_t *nvroot, *props, *config;
+	objset_t *os;
+	dmu_tx_t *tx;
+	ddt_t *ddt;
+	spa_t *spa;
+	void *buf;
+	char *name;
+
+	mutex_enter(&ztest_vdev_lock);
+	name = kmem_asprintf("%s_ddtlog", ztest_opts.zo_pool);
+
+	/*
+	 * Clean up from previous runs.
+	 */
+	(void) spa_destroy(name);
+
+	if (!zfs_dedup_log) {
+		strfree(name);
+		mutex_exit(&ztest_vdev_lock);
+		return;
+	}
+
+	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size, 0,
+	    NULL, 0, 0, 1);
+	props = fnvlist_alloc();
+	fnvlist_add_uint64(props, "feature@ddt_log", 0);
+	VERIFY0(spa_create(name, nvroot, props, NULL, NULL));
+	fnvlist_free(nvroot);
+	fnvlist_free(props);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	VERIFY(spa_feature_is_enabled(spa, SPA_FEATURE_DDT_LOG));
+
+	/*
+	 * Only merge one entry per txg, so that the few txgs synced by the
+	 * export leave most of them in the log.
+	 */
+	txg_max = zfs_dedup_log_txg_max;
+	entries_min = zfs_dedup_log_flush_entries_min;
+	zfs_dedup_log_txg_max = INT_MAX;
+	zfs_dedup_log_flush_entries_min = 1;
+
+	(void) ztest_dsl_prop_set_uint64(name, ZFS_PROP_DEDUP, checksum,
+	    B_FALSE);
+	(void) ztest_dsl_prop_set_uint64(name, ZFS_PROP_COMPRESSION,
+	    ZIO_COMPRESS_OFF, B_FALSE);
+
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_FALSE, B_TRUE, FTAG, &os));
+	pattern = dmu_objset_fsid_guid(os) | 1;
+	buf = umem_alloc(blocksize, UMEM_NOFAIL);
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_bonus(tx, DMU_NEW_OBJECT);
+	dmu_tx_hold_write(tx, DMU_NEW_OBJECT, 0, nblocks * blocksize);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	object = dmu_object_alloc(os, DMU_OT_UINT64_OTHER, blocksize,
+	    DMU_OT_NONE, 0, tx);
+	for (i = 0; i < nblocks; i++) {
+		ztest_pattern_set(buf, blocksize, pattern + i % unique);
+		dmu_write(os, object, i * blocksize, blocksize, buf, tx);
+	}
+	dmu_tx_commit(tx);
+	txg_wait_synced(spa_get_dsl(spa), 0);
+	dmu_objset_disown(os, FTAG);
+
+	ddt = spa->spa_ddt[checksum];
+	ddt_enter(ddt);
+	logged = avl_numnodes(&ddt->ddt_log_tree);
+	ddt_exit(ddt);
+	VERIFY3U(logged, ==, unique);
+	spa_close(spa, FTAG);
+
+	VERIFY0(spa_export(name, &config, B_FALSE, B_FALSE));
+	VERIFY0(spa_import(name, config, NULL, 0));
+	nvlist_free(config);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	ddt = spa->spa_ddt[checksum];
+	ddt_enter(ddt);
+	replayed = avl_numnodes(&ddt->ddt_log_tree);
+	ddt_exit(ddt);
+
+	if (ztest_opts.zo_verbose >= 4) {
+		(void) printf("ddt log: %llu entries logged, %llu replayed\n",
+		    (u_longlong_t)logged, (u_longlong_t)replayed);
+	}
+	VERIFY3U(replayed, >, 0);
+	VERIFY3U(replayed, <=, logged);
+
+	/*
+	 * Read the blocks back, then free them.
+	 */
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_FALSE, B_TRUE, FTAG, &os));
+	for (i = 0; i < nblocks; i++) {
+		VERIFY0(dmu_read(os, object, i * blocksize, blocksize, buf,
+		    DMU_READ_NO_PREFETCH));
+		ASSERT(ztest_pattern_match(buf, blocksize,
+		    pattern + i % unique));
+	}
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_free(tx, object, 0, DMU_OBJECT_END);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	VERIFY0(dmu_object_free(os, object, tx));
+	dmu_tx_commit(tx);
+	txg_wait_synced(spa_get_dsl(spa), 0);
+	dmu_objset_disown(os, FTAG);
+
+	zfs_dedup_log_txg_max = txg_max;
+	zfs_dedup_log_flush_entries_min = entries_min;
+
+	umem_free(buf, blocksize);
+	spa_close(spa, FTAG);
+	VERIFY0(spa_destroy(name));
+	strfree(name);
+	mutex_exit(&ztest_vdev_lock);
+}
+
+/*
+ * Verify that a RAID-Z expansion resumes where it left off when the pool
+ * is imported again.  Write to a new RAID-Z pool, attach another child to
+ * its vdev, and export the pool while the data is being moved.  Once it
+ * is imported again, the data must read back both while the expansion
+ * goes on and after it is complete, as must blocks written with the new
+ * width.
+ */
+/* ARGSUSED */
+void
+ztest_raidz_expand(ztest_ds_t *zd, uint64_t id)
+{
+	uint64_t blocksize = SPA_OLD_MAXBLOCKSIZE;
+	uint64_t nblocks = 16;
+	uint64_t ashift = ztest_get_ashift();
+	uint64_t object, pattern, guid, offset, i;
+	pool_raidz_expand_stat_t pres;
+	vdev_raidz_expand_t *vre;
+	nvlist_t *nvroot, *props, *config;
+	objset_t *os;
+	dmu_tx_t *tx;
+	vdev_t *rzvd;
+	spa_t *spa;
+	int max_copy;
+	void *buf;
+	char *name;
+
+	mutex_enter(&ztest_vdev_lock);
+	name = kmem_asprintf("%s_raidzx", ztest_opts.zo_pool);
+
+	/*
+	 * Clean up from previous runs.
+	 */
+	(void) spa_destroy(name);
+
+	if (ztest_opts.zo_raidz < 2) {
+		strfree(name);
+		mutex_exit(&ztest_vdev_lock);
+		return;
+	}
+
+	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size,
+	    ashift, NULL, ztest_opts.zo_raidz, 0, 1);
+	props = fnvlist_alloc();
+	fnvlist_add_uint64(props, "feature@raidz_expansion", 0);
+	VERIFY0(spa_create(name, nvroot, props, NULL, NULL));
+	fnvlist_free(nvroot);
+	fnvlist_free(props);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	VERIFY(spa_feature_is_enabled(spa, SPA_FEATURE_RAIDZ_EXPANSION));
+
+	(void) ztest_dsl_prop_set_uint64(name, ZFS_PROP_COMPRESSION,
+	    ZIO_COMPRESS_OFF, B_FALSE);
+
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_FALSE, B_TRUE, FTAG, &os));
+	pattern = dmu_objset_fsid_guid(os) | 1;
+	buf = umem_alloc(blocksize, UMEM_NOFAIL);
+
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_bonus(tx, DMU_NEW_OBJECT);
+	dmu_tx_hold_write(tx, DMU_NEW_OBJECT, 0, 2 * nblocks * blocksize);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	object = dmu_object_alloc(os, DMU_OT_UINT64_OTHER, blocksize,
+	    DMU_OT_NONE, 0, tx);
+	for (i = 0; i < nblocks; i++) {
+		ztest_pattern_set(buf, blocksize, pattern + i);
+		dmu_write(os, object, i * blocksize, blocksize, buf, tx);
+	}
+	dmu_tx_commit(tx);
+	txg_wait_synced(spa_get_dsl(spa), 0);
+	dmu_objset_disown(os, FTAG);
+
+	/*
+	 * Move the data in many small chunks, each of which has to wait
+	 * for the I/Os to the sectors it moves.
+	 */
+	max_copy = zfs_raidz_expand_max_copy_bytes;
+	zfs_raidz_expand_max_copy_bytes = 64 << ashift;
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	rzvd = spa->spa_root_vdev->vdev_child[0];
+	ASSERT3P(rzvd->vdev_ops, ==, &vdev_raidz_ops);
+	guid = rzvd->vdev_guid;
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	nvroot = make_vdev_root(NULL, NULL, name, ztest_opts.zo_vdev_size,
+	    ashift, NULL, 0, 0, 1);
+	VERIFY0(spa_vdev_attach(spa, guid, nvroot, B_FALSE));
+	nvlist_free(nvroot);
+
+	/*
+	 * The reflow has only just started, and takes many txgs to move
+	 * the data, so the pool is exported in the middle of it.
+	 */
+	spa_async_suspend(spa);
+	vre = spa->spa_raidz_expand;
+	VERIFY3P(vre, !=, NULL);
+	mutex_enter(&vre->vre_lock);
+	offset = vre->vre_offset;
+	mutex_exit(&vre->vre_lock);
+	spa_async_resume(spa);
+	spa_close(spa, FTAG);
+
+	VERIFY0(spa_export(name, &config, B_FALSE, B_FALSE));
+	VERIFY0(spa_import(name, config, NULL, 0));
+	nvlist_free(config);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_FALSE, B_TRUE, FTAG, &os));
+	for (i = 0; i < nblocks; i++) {
+		VERIFY0(dmu_read(os, object, i * blocksize, blocksize, buf,
+		    DMU_READ_NO_PREFETCH));
+		ASSERT(ztest_pattern_match(buf, blocksize, pattern + i));
+	}
+
+	/*
+	 * Wait for the expansion to complete.
+	 */
+	for (;;) {
+		VERIFY0(spa_raidz_expand_get_stats(spa, &pres));
+		if (pres.pres_state == DSS_FINISHED)
+			break;
+		VERIFY3U(pres.pres_state, ==, DSS_SCANNING);
+		txg_wait_synced(spa_get_dsl(spa), 0);
+	}
+	zfs_raidz_expand_max_copy_bytes = max_copy;
+
+	if (ztest_opts.zo_verbose >= 4) {
+		(void) printf("raidz expand: exported at offset %llu, "
+		    "%llu bytes reflowed\n", (u_longlong_t)offset,
+		    (u_longlong_t)pres.pres_reflowed);
+	}
+	VERIFY3U(pres.pres_reflowed, >, 0);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	rzvd = spa->spa_root_vdev->vdev_child[0];
+	VERIFY3U(rzvd->vdev_children, ==, ztest_opts.zo_raidz + 1);
+	VERIFY0(rzvd->vdev_rz_expanding);
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	/*
+	 * Write the same number of blocks with the new width, then read
+	 * everything back from disk.
+	 */
+	tx = dmu_tx_create(os);
+	dmu_tx_hold_write(tx, object, nblocks * blocksize,
+	    nblocks * blocksize);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	for (i = nblocks; i < 2 * nblocks; i++) {
+		ztest_pattern_set(buf, blocksize, pattern + i);
+		dmu_write(os, object, i * blocksize, blocksize, buf, tx);
+	}
+	dmu_tx_commit(tx);
+	txg_wait_synced(spa_get_dsl(spa), 0);
+	dmu_objset_disown(os, FTAG);
+	spa_close(spa, FTAG);
+
+	VERIFY0(spa_export(name, &config, B_FALSE, B_FALSE));
+	VERIFY0(spa_import(name, config, NULL, 0));
+	nvlist_free(config);
+
+	VERIFY0(spa_open(name, &spa, FTAG));
+	VERIFY0(dmu_objset_own(name, DMU_OST_ANY, B_FALSE, B_TRUE, FTAG, &os));
+	for (i = 0; i < 2 * nblocks; i++) {
+		VERIFY0(dmu_read(os, object, i * blocksize, blocksize, buf,
+		    DMU_READ_NO_PREFETCH));
+		ASSERT(ztest_pattern_match(buf, blocksize, pattern + i));
+	}
+	dmu_objset_disown(os, FTAG);
+
+	umem_free(buf, blocksize);
+	spa_close(spa, FTAG);
+	VERIFY0(spa_destroy(name));
+	strfree(name);
+	mutex_exit(&ztest_vdev_lock);
+}
+
 /*
  * Scrub the pool.
  */
@@ -5557,6 +6055,40 @@ ztest_scrub(ztest_ds_t *zd, uint64_t id)
 	(void) spa_scan(spa, POOL_SCAN_SCRUB);
 }
 
+/*
+ * Start, suspend or cancel a manual TRIM of a random leaf vdev.
+ */
+/* ARGSUSED */
+void
+ztest_vdev_trim(ztest_ds_t *zd, uint64_t id)
+{
+	spa_t *spa = ztest_spa;
+	vdev_t *vd;
+	nvlist_t *vdevs, *errlist;
+	pool_trim_func_t cmd;
+	uint64_t rate;
+
+	mutex_enter(&ztest_vdev_lock);
+
+	spa_config_enter(spa, SCL_VDEV, FTAG, RW_READER);
+	vd = spa->spa_root_vdev;
+	while (vd->vdev_children != 0)
+		vd = vd->vdev_child[ztest_random(vd->vdev_children)];
+	vdevs = fnvlist_alloc();
+	fnvlist_add_uint64(vdevs, "vdev", vd->vdev_guid);
+	spa_config_exit(spa, SCL_VDEV, FTAG);
+
+	cmd = ztest_random(POOL_TRIM_FUNCS);
+	rate = ztest_random(2) ? 0 : (1ULL << 20) * (1 + ztest_random(16));
+
+	errlist = fnvlist_alloc();
+	(void) spa_vdev_trim(spa, vdevs, cmd, rate, errlist);
+	fnvlist_free(errlist);
+	fnvlist_free(vdevs);
+
+	mutex_exit(&ztest_vdev_lock);
+}
+
 /*
  * Change the guid for the pool.
  */
@@ -5757,6 +6289,62 @@ ztest_fletcher_incr(ztest_ds_t *zd, uint64_t id)
 	}
 }
 
+/*
+ * Compress blocks at a random zstd level, check that they decompress to
+ * what went in, and that compressing them again gives the same bytes; the
+ * L2ARC relies on that when compressed ARC is disabled.  Without a zstd
+ * library every block must be left uncompressed.
+ */
+/* ARGSUSED */
+void
+ztest_zstd(ztest_ds_t *zd, uint64_t id)
+{
+	hrtime_t end = gethrtime() + NANOSEC;
+
+	while (gethrtime() <= end) {
+		enum zio_compress c = ZIO_COMPRESS_ZSTD_1 +
+		    ztest_random(ZIO_COMPRESS_ZSTD_FAST_1000 -
+		    ZIO_COMPRESS_ZSTD_1 + 1);
+		uint64_t mask = -1ULL;
+		size_t size, csize;
+		void *buf, *cbuf, *dbuf;
+		uint64_t *ptr;
+		abd_t *abd;
+		int i;
+
+		size = ztest_random_blocksize();
+		buf = umem_alloc(size, UMEM_NOFAIL);
+		cbuf = umem_alloc(size, UMEM_NOFAIL);
+		dbuf = umem_alloc(size, UMEM_NOFAIL);
+
+		/* Most blocks get two bits per byte, so that they compress. */
+		if (ztest_random(4) != 0)
+			mask = 0x0303030303030303ULL;
+		for (i = 0, ptr = buf; i < size / sizeof (*ptr); i++, ptr++)
+			*ptr = ztest_random(-1ULL) & mask;
+
+		abd = abd_get_from_buf(buf, size);
+		csize = zio_compress_data(c, abd, cbuf, size);
+
+		if (!zstd_available()) {
+			VERIFY3U(csize, ==, size);
+		} else if (csize < size) {
+			VERIFY0(zio_decompress_data_buf(c, cbuf, dbuf,
+			    csize, size));
+			VERIFY0(bcmp(buf, dbuf, size));
+
+			VERIFY3U(zio_compress_data(c, abd, dbuf, size), ==,
+			    csize);
+			VERIFY0(bcmp(cbuf, dbuf, csize));
+		}
+
+		abd_put(abd);
+		umem_free(dbuf, size);
+		umem_free(cbuf, size);
+		umem_free(buf, size);
+	}
+}
+
 static int
 ztest_check_path(char *path)
 {
@@ -6526,7 +7114,7 @@ ztest_init(ztest_shared_t *zs)
 	zs->zs_splits = 0;
 	zs->zs_mirrors = ztest_opts.zo_mirrors;
 	nvroot = make_vdev_root(NULL, NULL, NULL, ztest_opts.zo_vdev_size, 0,
-	    0, ztest_opts.zo_raidz, zs->zs_mirrors, 1);
+	    NULL, ztest_opts.zo_raidz, zs->zs_mirrors, 1);
 	props = make_random_props();
 	for (i = 0; i < SPA_FEATURES; i++) {
 		char *buf;
@@ -0,0 +1,39 @@
+dnl #
+dnl # 4.9 API change
+dnl # BLK_MQ_F_BLOCKING allows blk_mq_ops->queue_rq() to sleep, which zvols
+dnl # need to take their range lock before handing a request to zvol_taskq.
+dnl # Until 4.13 queue_rq() returns an int and blk_mq_end_request() takes
+dnl # an errno.  Without both, zvols only use make_request_fn.
+dnl #
+AC_DEFUN([ZFS_AC_KERNEL_BLK_MQ], [
+	AC_MSG_CHECKING([whether blk-mq allows blocking queue_rq()])
+	ZFS_LINUX_TRY_COMPILE([
+		#include <linux/blk-mq.h>
+
+		int queue_rq(struct blk_mq_hw_ctx *hctx,
+		    const struct blk_mq_queue_data *bd)
+		{
+			blk_mq_start_request(bd->rq);
+			blk_mq_end_request(bd->rq, 0);
+			return (BLK_MQ_RQ_QUEUE_OK);
+		}
+
+		static struct blk_mq_ops mq_ops __attribute__ ((unused)) = {
+			.queue_rq = queue_rq,
+		};
+	],[
+		struct blk_mq_tag_set tag_set;
+		struct request_queue *q __attribute__ ((unused));
+
+		tag_set.ops = &mq_ops;
+		tag_set.flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+		(void) blk_mq_alloc_tag_set(&tag_set);
+		q = blk_mq_init_queue(&tag_set);
+		blk_mq_free_tag_set(&tag_set);
+	],[
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_BLK_MQ, 1, [blk-mq allows blocking queue_rq()])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
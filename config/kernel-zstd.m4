@@ -0,0 +1,29 @@
+dnl #
+dnl # 4.14 API change
+dnl # The kernel provides the Zstandard library in <linux/zstd.h>.
+dnl #
+dnl # The header is installed whether or not the library was built, so
+dnl # also require CONFIG_ZSTD_COMPRESS and CONFIG_ZSTD_DECOMPRESS and
+dnl # check that the symbols are exported.  Otherwise the module would
+dnl # build but fail to load with unresolved zstd symbols.
+dnl #
+AC_DEFUN([ZFS_AC_KERNEL_ZSTD], [
+	AC_MSG_CHECKING([whether the kernel zstd library is available])
+	ZFS_LINUX_TRY_COMPILE_SYMBOL([
+		#include <linux/zstd.h>
+	],[
+		#if !IS_ENABLED(CONFIG_ZSTD_COMPRESS) || \
+		    !IS_ENABLED(CONFIG_ZSTD_DECOMPRESS)
+		#error "kernel built without zstd"
+		#endif
+		ZSTD_parameters params = ZSTD_getParams(3, 0, 0);
+		size_t ws = ZSTD_CCtxWorkspaceBound(params.cParams);
+		ZSTD_CCtx *cctx __attribute__ ((unused)) =
+		    ZSTD_initCCtx(NULL, ws);
+	], [ZSTD_initCCtx], [lib/zstd/compress.c], [
+		AC_MSG_RESULT(yes)
+		AC_DEFINE(HAVE_KERNEL_ZSTD, 1, [kernel zstd library is available])
+	],[
+		AC_MSG_RESULT(no)
+	])
+])
@@ -0,0 +1,26 @@
+dnl #
+dnl # Check for libzstd - needed for the zstd compression algorithm
+dnl #
+AC_DEFUN([ZFS_AC_CONFIG_USER_ZSTD], [
+	LIBZSTD=
+
+	AC_CHECK_HEADER([zstd.h], [
+	    user_zstd=yes
+	], [
+	    user_zstd=no
+	])
+
+	AS_IF([test "x$user_zstd" = xyes], [
+	    AC_CHECK_LIB([zstd], [ZSTD_compressCCtx], [
+		AC_SUBST([LIBZSTD], ["-lzstd"])
+		AC_DEFINE([HAVE_LIBZSTD], 1, [Define if you have libzstd])
+	    ], [
+		user_zstd=no
+	    ])
+	])
+
+	AS_IF([test "x$user_zstd" = xno], [
+	    AC_MSG_WARN([
+	*** zstd.h or libzstd missing, zstd compression will be unavailable])
+	])
+])
@@ -46,6 +46,8 @@ int lzc_bookmark(nvlist_t *, nvlist_t **);
 int lzc_get_bookmarks(const char *, nvlist_t *, nvlist_t **);
 int lzc_destroy_bookmarks(nvlist_t *, nvlist_t **);
 int lzc_key(const char *, uint64_t, nvlist_t *, nvlist_t *);
+int lzc_trim(const char *, pool_trim_func_t, uint64_t, nvlist_t *,
+    nvlist_t **);
 
 int lzc_snaprange_space(const char *, const char *, uint64_t *);
 
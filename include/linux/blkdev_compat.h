@@ -31,6 +31,9 @@
 
 #include <linux/blkdev.h>
 #include <linux/elevator.h>
+#ifdef HAVE_BLK_MQ
+#include <linux/blk-mq.h>
+#endif /* HAVE_BLK_MQ */
 
 #ifndef HAVE_FMODE_T
 typedef unsigned __bitwise__ fmode_t;
@@ -50,6 +50,11 @@
  * 	zfs_bmi1_available()
  * 	zfs_bmi2_available()
  *
+ * 	zfs_shani_available()
+ *
+ * 	zfs_aes_available()
+ * 	zfs_pclmulqdq_available()
+ *
  * 	zfs_avx512f_available()
  * 	zfs_avx512cd_available()
  * 	zfs_avx512er_available()
@@ -140,6 +145,9 @@ typedef enum cpuid_inst_sets {
 	AVX2,
 	BMI1,
 	BMI2,
+	SHA_NI,
+	AES,
+	PCLMULQDQ,
 	AVX512F,
 	AVX512CD,
 	AVX512DQ,
@@ -186,6 +194,9 @@ static const cpuid_feature_desc_t cpuid_features[] = {
 	[AVX2]		= {7U, 0U,	1U << 5,	EBX	},
 	[BMI1]		= {7U, 0U,	1U << 3,	EBX	},
 	[BMI2]		= {7U, 0U,	1U << 8,	EBX	},
+	[SHA_NI]	= {7U, 0U,	1U << 29,	EBX	},
+	[AES]		= {1U, 0U,	1U << 25,	ECX	},
+	[PCLMULQDQ]	= {1U, 0U,	1U << 1,	ECX	},
 	[AVX512F]	= {7U, 0U, _AVX512F_BIT,	EBX	},
 	[AVX512CD]	= {7U, 0U, _AVX512CD_BIT,	EBX	},
 	[AVX512DQ]	= {7U, 0U, _AVX512DQ_BIT,	EBX	},
@@ -256,6 +267,9 @@ CPUID_FEATURE_CHECK(avx2, AVX2);
 CPUID_FEATURE_CHECK(osxsave, OSXSAVE);
 CPUID_FEATURE_CHECK(bmi1, BMI1);
 CPUID_FEATURE_CHECK(bmi2, BMI2);
+CPUID_FEATURE_CHECK(shani, SHA_NI);
+CPUID_FEATURE_CHECK(aes, AES);
+CPUID_FEATURE_CHECK(pclmulqdq, PCLMULQDQ);
 CPUID_FEATURE_CHECK(avx512f, AVX512F);
 CPUID_FEATURE_CHECK(avx512cd, AVX512CD);
 CPUID_FEATURE_CHECK(avx512dq, AVX512DQ);
@@ -442,6 +456,51 @@ zfs_bmi2_available(void)
 #endif
 }
 
+/*
+ * Check if SHA extensions are available
+ */
+static inline boolean_t
+zfs_shani_available(void)
+{
+#if defined(_KERNEL) && defined(X86_FEATURE_SHA_NI)
+	return (!!boot_cpu_has(X86_FEATURE_SHA_NI));
+#elif defined(_KERNEL) && !defined(X86_FEATURE_SHA_NI)
+	return (B_FALSE);
+#else
+	return (__cpuid_has_shani());
+#endif
+}
+
+/*
+ * Check if AES instructions are available
+ */
+static inline boolean_t
+zfs_aes_available(void)
+{
+#if defined(_KERNEL) && defined(X86_FEATURE_AES)
+	return (!!boot_cpu_has(X86_FEATURE_AES));
+#elif defined(_KERNEL) && !defined(X86_FEATURE_AES)
+	return (B_FALSE);
+#else
+	return (__cpuid_has_aes());
+#endif
+}
+
+/*
+ * Check if the carry-less multiplication instruction is available
+ */
+static inline boolean_t
+zfs_pclmulqdq_available(void)
+{
+#if defined(_KERNEL) && defined(X86_FEATURE_PCLMULQDQ)
+	return (!!boot_cpu_has(X86_FEATURE_PCLMULQDQ));
+#elif defined(_KERNEL) && !defined(X86_FEATURE_PCLMULQDQ)
+	return (B_FALSE);
+#else
+	return (__cpuid_has_pclmulqdq());
+#endif
+}
+
 
 /*
  * AVX-512 family of instruction sets:
@@ -193,25 +193,135 @@ typedef struct arc_buf_hdr_crypt {
 	uint8_t			b_mac[DATA_MAC_LEN];
 } arc_buf_hdr_crypt_t;
 
+/*
+ * Persistent L2ARC on-disk structures.
+ *
+ * A cache device carries a device header directly after the front vdev
+ * labels, followed by the usual rotor of cached buffers. Interleaved
+ * with those buffers, the feed thread writes log blocks, each of which
+ * describes up to L2ARC_LOG_BLK_MAX_ENTRIES buffers written before it
+ * and points back to the previously written log block. The device
+ * header points at the most recently written log block, so on import
+ * the chain can be walked backwards to recreate the L2-only ARC
+ * headers for everything still present on the device:
+ *
+ *	+------+------+-----+-----+----+-----+-----+----+----
+ *	|labels|devhdr| buf | buf | LB | buf | buf | LB | ...
+ *	+------+------+-----+-----+----+-----+-----+----+----
+ *	           |               ^               |  ^
+ *	           |               +--lb_prev_lbp--+  |
+ *	           +----------dh_start_lbp------------+
+ */
+#define	L2ARC_DEV_HDR_MAGIC	0x5a46534341434845ULL	/* "ZFSCACHE" */
+#define	L2ARC_LOG_BLK_MAGIC	0x4c4f47424c4b4844ULL	/* "LOGBLKHD" */
+#define	L2ARC_PERSIST_VERSION	1ULL
+
+/* Number of buffers described by a single log block */
+#define	L2ARC_LOG_BLK_MAX_ENTRIES	(1022)
+
+/* dh_flags: the device has not yet wrapped around since it was added */
+#define	L2ARC_DEV_HDR_EVICT_FIRST	(1ULL << 0)
+
+/*
+ * Accessors for the le_prop and lbp_prop fields; sizes are stored in
+ * units of SPA_MINBLOCKSIZE, in the same way as in a blkptr_t.
+ */
+#define	L2BLK_GET_LSIZE(field)	\
+	BF64_GET_SB((field), 0, SPA_LSIZEBITS, SPA_MINBLOCKSHIFT, 1)
+#define	L2BLK_SET_LSIZE(field, x)	\
+	BF64_SET_SB((field), 0, SPA_LSIZEBITS, SPA_MINBLOCKSHIFT, 1, x)
+#define	L2BLK_GET_PSIZE(field)	\
+	BF64_GET_SB((field), 16, SPA_PSIZEBITS, SPA_MINBLOCKSHIFT, 1)
+#define	L2BLK_SET_PSIZE(field, x)	\
+	BF64_SET_SB((field), 16, SPA_PSIZEBITS, SPA_MINBLOCKSHIFT, 1, x)
+#define	L2BLK_GET_COMPRESS(field)	BF64_GET((field), 32, 7)
+#define	L2BLK_SET_COMPRESS(field, x)	BF64_SET((field), 32, 7, x)
+#define	L2BLK_GET_TYPE(field)		BF64_GET((field), 48, 8)
+#define	L2BLK_SET_TYPE(field, x)	BF64_SET((field), 48, 8, x)
+
+/*
+ * Pointer to a log block on a cache device. A log block covers the
+ * device range from lbp_payload_start (the device hand right after the
+ * previous log block was written) up to the end of the log block itself.
+ * Should any part of that range be overwritten, the log block and every
+ * log block preceding it are considered stale.
+ */
+typedef struct l2arc_log_blkptr {
+	uint64_t	lbp_daddr;		/* device address of log block */
+	uint64_t	lbp_payload_start;	/* start of described range */
+	uint64_t	lbp_prop;		/* lsize, asize, compression */
+	zio_cksum_t	lbp_cksum;		/* fletcher4 of on-disk block */
+} l2arc_log_blkptr_t;
+
+/*
+ * The device header. It occupies one device block after the front vdev
+ * labels, the last sizeof (zio_eck_t) bytes of which hold its embedded
+ * (ZIO_CHECKSUM_LABEL) checksum.
+ */
+typedef struct l2arc_dev_hdr_phys {
+	uint64_t		dh_magic;	/* L2ARC_DEV_HDR_MAGIC */
+	uint64_t		dh_version;	/* L2ARC_PERSIST_VERSION */
+	uint64_t		dh_spa_guid;	/* pool the device belongs to */
+	uint64_t		dh_vdev_guid;	/* guid of the cache vdev */
+	uint64_t		dh_flags;	/* L2ARC_DEV_HDR_* */
+	uint64_t		dh_start;	/* l2ad_start when written */
+	uint64_t		dh_end;		/* l2ad_end when written */
+	uint64_t		dh_hand;	/* l2ad_hand when written */
+	uint64_t		dh_evict;	/* l2ad_evict when written */
+	l2arc_log_blkptr_t	dh_start_lbp;	/* most recent log block */
+	uint64_t		dh_pad[43];	/* pad to 512 bytes with tail */
+} l2arc_dev_hdr_phys_t;
+
+/* A single buffer as recorded in a log block */
+typedef struct l2arc_log_ent_phys {
+	dva_t			le_dva;		/* dva of buffer */
+	uint64_t		le_birth;	/* birth txg of buffer */
+	uint64_t		le_prop;	/* lsize, psize, compr, type */
+	uint64_t		le_daddr;	/* buffer location on device */
+	uint64_t		le_pad[3];	/* pad to 64 bytes */
+} l2arc_log_ent_phys_t;
+
+/* An on-disk log block, before compression; exactly 64K in size */
+typedef struct l2arc_log_blk_phys {
+	uint64_t		lb_magic;	/* L2ARC_LOG_BLK_MAGIC */
+	l2arc_log_blkptr_t	lb_prev_lbp;	/* previous log block */
+	uint64_t		lb_pad[8];	/* pad to 128 bytes */
+	l2arc_log_ent_phys_t	lb_entries[L2ARC_LOG_BLK_MAX_ENTRIES];
+} l2arc_log_blk_phys_t;
+
 typedef struct l2arc_dev {
 	vdev_t			*l2ad_vdev;	/* vdev */
 	spa_t			*l2ad_spa;	/* spa */
 	uint64_t		l2ad_hand;	/* next write location */
 	uint64_t		l2ad_start;	/* first addr on device */
 	uint64_t		l2ad_end;	/* last addr on device */
+	uint64_t		l2ad_evict;	/* last addr evicted */
 	boolean_t		l2ad_first;	/* first sweep through */
 	boolean_t		l2ad_writing;	/* currently writing */
 	kmutex_t		l2ad_mtx;	/* lock for buffer list */
 	list_t			l2ad_buflist;	/* buffer list */
 	list_node_t		l2ad_node;	/* device list node */
 	refcount_t		l2ad_alloc;	/* allocated bytes */
+	/*
+	 * Persistence state. The device header is always present; the
+	 * log block being filled is NULL if the device is too small to
+	 * be worth persisting (see l2arc_rebuild_blocks_min_l2size).
+	 */
+	l2arc_dev_hdr_phys_t	*l2ad_dev_hdr;	/* in-core device header */
+	uint64_t		l2ad_dev_hdr_asize; /* on-disk size of header */
+	l2arc_log_blk_phys_t	*l2ad_log_blk;	/* log block being filled */
+	int			l2ad_log_ent_idx; /* entries in l2ad_log_blk */
+	uint64_t		l2ad_log_blk_payload_start; /* see lbp */
+	/* protected by l2arc_rebuild_thr_lock */
+	boolean_t		l2ad_rebuild;	/* rebuild pending or running */
+	boolean_t		l2ad_rebuild_began; /* rebuild thread started */
+	boolean_t		l2ad_rebuild_cancel; /* stop the rebuild */
 } l2arc_dev_t;
 
 typedef struct l2arc_buf_hdr {
 	/* protected by arc_buf_hdr mutex */
 	l2arc_dev_t		*b_dev;		/* L2ARC device */
 	uint64_t		b_daddr;	/* disk address, offset byte */
-	uint32_t		b_hits;
 
 	list_node_t		b_l2node;
 } l2arc_buf_hdr_t;
@@ -221,13 +331,23 @@ typedef struct l2arc_write_callback {
 	arc_buf_hdr_t	*l2wcb_head;		/* head of write buflist */
 } l2arc_write_callback_t;
 
+/*
+ * The header of a buffer only in the L2ARC is the part of arc_buf_hdr_t
+ * before b_l1hdr, and one is kept for every buffer on a cache device, so
+ * the fields before b_l1hdr are ordered to leave no padding between them.
+ * The type of the buffer is kept in b_flags (ARC_FLAG_BUFC_METADATA), and
+ * its L2ARC hits in the L1 header, as they are only updated by reads.  On
+ * LP64 the L2-only header is 80 bytes, 32 of which are b_l2hdr.  There is
+ * no separate packed representation: the DVA, birth txg, device and device
+ * address are kept at full width, as in any other header.
+ */
 struct arc_buf_hdr {
 	/* protected by hash lock */
 	dva_t			b_dva;
 	uint64_t		b_birth;
 
-	arc_buf_contents_t	b_type;
 	arc_buf_hdr_t		*b_hash_next;
+	uint64_t		b_spa;		/* immutable */
 	arc_flags_t		b_flags;
 
 	/*
@@ -255,7 +375,6 @@ struct arc_buf_hdr {
 	 * of SPA_MINBLOCKSIZE (e.g. 2 == 1024 bytes)
 	 */
 	uint16_t		b_lsize;	/* immutable */
-	uint64_t		b_spa;		/* immutable */
 
 	/* L2ARC fields. Undefined when not in L2ARC. */
 	l2arc_buf_hdr_t		b_l2hdr;
@@ -58,7 +58,7 @@ typedef struct {
  */
 
 #define	CRYPTO_MECH_INVALID	((uint64_t)-1)
-extern crypto_mech_type_t crypto_mech2id(crypto_mech_name_t name);
+extern crypto_mech_type_t crypto_mech2id(char *name);
 
 /*
  * Create and destroy context templates.
@@ -206,6 +206,31 @@ extern int crypto_decrypt_update(crypto_context_t ctx,
 extern int crypto_decrypt_final(crypto_context_t ctx, crypto_data_t *plaintext,
     crypto_call_req_t *cr);
 
+/*
+ * AES-CCM and AES-GCM operations which call the AES software provider
+ * directly, skipping the provider selection and accounting done for every
+ * crypto_encrypt() and crypto_decrypt() call.  The multi-part context lives
+ * in caller storage, input must be passed in whole AES blocks, and
+ * crypto_aes_encrypt_final() must follow every successful
+ * crypto_aes_encrypt_init().
+ */
+typedef struct crypto_aes_ctx {
+	uint64_t	cac_opaque[32];
+} crypto_aes_ctx_t;
+
+extern int crypto_aes_encrypt(crypto_mechanism_t *mech,
+    crypto_data_t *plaintext, crypto_key_t *key, crypto_ctx_template_t tmpl,
+    crypto_data_t *ciphertext);
+extern int crypto_aes_decrypt(crypto_mechanism_t *mech,
+    crypto_data_t *ciphertext, crypto_key_t *key, crypto_ctx_template_t tmpl,
+    crypto_data_t *plaintext);
+extern int crypto_aes_encrypt_init(crypto_mechanism_t *mech,
+    crypto_key_t *key, crypto_ctx_template_t tmpl, crypto_aes_ctx_t *ctx);
+extern int crypto_aes_encrypt_update(crypto_aes_ctx_t *ctx, uint8_t *in,
+    uint8_t *out, size_t len);
+extern int crypto_aes_encrypt_final(crypto_aes_ctx_t *ctx, uint8_t *mac,
+    size_t maclen);
+
 /*
  * Single and multi-part encrypt/MAC dual operations.
  */
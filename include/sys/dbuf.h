@@ -262,13 +262,39 @@ typedef struct dmu_buf_impl {
 	uint8_t db_dirtycnt;
 } dmu_buf_impl_t;
 
-/* Note: the dbuf hash table is exposed only for the mdb module */
-#define	DBUF_MUTEXES 8192
-#define	DBUF_HASH_MUTEX(h, idx) (&(h)->hash_mutexes[(idx) & (DBUF_MUTEXES-1)])
+/*
+ * The buckets of the dbuf hash table are striped over DBUF_RWLOCKS locks,
+ * which lookups take as reader and insertions and removals as writer.  The
+ * table always has at least DBUF_RWLOCKS buckets, so that the stripe of a
+ * dbuf only depends on its hash value and not on the size of the table.
+ * Each stripe also records which table its buckets are in, as the table is
+ * grown one stripe at a time, and counts the lookups done under it.  The
+ * table is only ever grown, never shrunk.  Each stripe starts on a cache
+ * line, so that lookups under neighbouring stripes don't contend for the
+ * lines holding the lock and the counters.  With lock debugging a stripe
+ * can span more than one line.
+ */
+#define	DBUF_RWLOCKS 8192
+#define	DBUF_HASH_RWLOCK(h, idx) (&(h)->hash_rwlocks[(idx) & (DBUF_RWLOCKS-1)])
+
+#define	DBUF_HASH_RWLOCK_ALIGN	64
+
+typedef struct dbuf_hash_rwlock {
+	krwlock_t	dhr_lock;
+	dmu_buf_impl_t	**dhr_table;	/* table the buckets are in */
+	uint64_t	dhr_mask;	/* and its mask */
+	uint64_t	dhr_hits;	/* lookups which found a dbuf */
+	uint64_t	dhr_misses;	/* lookups which did not */
+} __attribute__((aligned(DBUF_HASH_RWLOCK_ALIGN))) dbuf_hash_rwlock_t;
+
 typedef struct dbuf_hash_table {
 	uint64_t hash_table_mask;
 	dmu_buf_impl_t **hash_table;
-	kmutex_t hash_mutexes[DBUF_MUTEXES];
+	dbuf_hash_rwlock_t hash_rwlocks[DBUF_RWLOCKS];
+	uint64_t hash_elements;		/* dbufs in the table */
+	uint64_t hash_collisions;	/* insertions into a non-empty bucket */
+	uint64_t hash_chain_max;	/* longest chain since the last grow */
+	uint64_t hash_grows;		/* times the table was doubled */
 } dbuf_hash_table_t;
 
 uint64_t dbuf_whichblock(const struct dnode *di, const int64_t level,
@@ -299,6 +325,8 @@ void dbuf_rele_and_unlock(dmu_buf_impl_t *db, void *tag);
 
 dmu_buf_impl_t *dbuf_find(struct objset *os, uint64_t object, uint8_t level,
     uint64_t blkid);
+int dbuf_dnode_findbp(struct dnode *dn, uint64_t level, uint64_t blkid,
+    blkptr_t *bp);
 
 int dbuf_read(dmu_buf_impl_t *db, zio_t *zio, uint32_t flags);
 void dmu_buf_will_not_fill(dmu_buf_t *db, dmu_tx_t *tx);
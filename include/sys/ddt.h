@@ -126,6 +126,67 @@ struct ddt_entry {
 	avl_node_t	dde_node;
 };
 
+/*
+ * The DDT log of a txg is a MOS object holding an array of ddt_log_record_t,
+ * with a ddt_log_phys_t in its bonus buffer.  The logs of a DDT are found
+ * through the DMU_POOL_DDT_LOG object, which maps the txg of each log to its
+ * object.
+ */
+typedef struct ddt_log_phys {
+	uint64_t	ddlp_txg;	/* txg the log was written in */
+	uint64_t	ddlp_length;	/* bytes of records in the object */
+} ddt_log_phys_t;
+
+/*
+ * On-disk ddt log record: the entry as of the txg of the log, and the ZAP
+ * object holding the entry when it was logged.  The type and class are
+ * DDT_TYPES and DDT_CLASSES if the entry was removed, and so are the ZAP
+ * type and class if no ZAP object held it.
+ */
+typedef struct ddt_log_record {
+	ddt_key_t	ddlr_key;
+	uint64_t	ddlr_prop;
+	ddt_phys_t	ddlr_phys[DDT_PHYS_TYPES];
+} ddt_log_record_t;
+
+#define	DDLR_GET_TYPE(ddlr)		BF64_GET((ddlr)->ddlr_prop, 0, 8)
+#define	DDLR_SET_TYPE(ddlr, x)		BF64_SET((ddlr)->ddlr_prop, 0, 8, x)
+#define	DDLR_GET_CLASS(ddlr)		BF64_GET((ddlr)->ddlr_prop, 8, 8)
+#define	DDLR_SET_CLASS(ddlr, x)		BF64_SET((ddlr)->ddlr_prop, 8, 8, x)
+#define	DDLR_GET_ZAP_TYPE(ddlr)		BF64_GET((ddlr)->ddlr_prop, 16, 8)
+#define	DDLR_SET_ZAP_TYPE(ddlr, x)	BF64_SET((ddlr)->ddlr_prop, 16, 8, x)
+#define	DDLR_GET_ZAP_CLASS(ddlr)	BF64_GET((ddlr)->ddlr_prop, 24, 8)
+#define	DDLR_SET_ZAP_CLASS(ddlr, x)	BF64_SET((ddlr)->ddlr_prop, 24, 8, x)
+
+/*
+ * In-core state of the log of a txg.  ddl_entries holds the entries whose
+ * newest record is in this log; once it and the list of every older log
+ * are empty, the log is not needed anymore.
+ */
+typedef struct ddt_log {
+	uint64_t	ddl_txg;
+	uint64_t	ddl_object;
+	list_t		ddl_entries;	/* ddt_log_entry_t */
+	list_node_t	ddl_node;	/* ddt_logs */
+	avl_node_t	ddl_load_node;	/* ddt_log_load() */
+} ddt_log_t;
+
+/*
+ * In-core ddt log entry: the newest logged version of an entry which has
+ * not been merged into the ZAP objects yet.
+ */
+typedef struct ddt_log_entry {
+	ddt_key_t	ddle_key;
+	ddt_phys_t	ddle_phys[DDT_PHYS_TYPES];
+	uint8_t		ddle_type;
+	uint8_t		ddle_class;
+	uint8_t		ddle_zap_type;
+	uint8_t		ddle_zap_class;
+	ddt_log_t	*ddle_log;
+	avl_node_t	ddle_node;	/* ddt_log_tree */
+	list_node_t	ddle_log_node;	/* ddl_entries */
+} ddt_log_entry_t;
+
 /*
  * In-core ddt
  */
@@ -133,6 +194,11 @@ struct ddt {
 	kmutex_t	ddt_lock;
 	avl_tree_t	ddt_tree;
 	avl_tree_t	ddt_repair_tree;
+	avl_tree_t	ddt_log_tree;	/* ddt_log_entry_t, by key */
+	list_t		ddt_logs;	/* ddt_log_t, oldest first */
+	uint64_t	ddt_log_zap;	/* txg -> log object */
+	ddt_log_record_t *ddt_log_buf;	/* records not written yet */
+	uint64_t	ddt_log_buf_count;
 	enum zio_checksum ddt_checksum;
 	spa_t		*ddt_spa;
 	objset_t	*ddt_os;
@@ -237,6 +303,7 @@ extern boolean_t ddt_class_contains(spa_t *spa, enum ddt_class max_class,
 extern ddt_entry_t *ddt_repair_start(ddt_t *ddt, const blkptr_t *bp);
 extern void ddt_repair_done(ddt_t *ddt, ddt_entry_t *dde);
 
+extern int ddt_key_compare(const ddt_key_t *k1, const ddt_key_t *k2);
 extern int ddt_entry_compare(const void *x1, const void *x2);
 
 extern void ddt_create(spa_t *spa);
@@ -246,6 +313,27 @@ extern void ddt_sync(spa_t *spa, uint64_t txg);
 extern int ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde);
 extern int ddt_object_update(ddt_t *ddt, enum ddt_type type,
     enum ddt_class class, ddt_entry_t *dde, dmu_tx_t *tx);
+extern int ddt_object_remove(ddt_t *ddt, enum ddt_type type,
+    enum ddt_class class, ddt_entry_t *dde, dmu_tx_t *tx);
+
+extern void ddt_log_init(void);
+extern void ddt_log_fini(void);
+extern void ddt_log_alloc(ddt_t *ddt);
+extern void ddt_log_free(ddt_t *ddt);
+extern boolean_t ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde,
+    boolean_t *moved);
+extern int ddt_log_walk(ddt_t *ddt, uint64_t *walk, ddt_entry_t *dde);
+extern boolean_t ddt_log_begin(ddt_t *ddt, dmu_tx_t *tx);
+extern void ddt_log_entry(ddt_t *ddt, const ddt_entry_t *dde,
+    enum ddt_type ztype, enum ddt_class zclass, dmu_tx_t *tx);
+extern void ddt_log_commit(ddt_t *ddt, dmu_tx_t *tx);
+extern boolean_t ddt_log_flush(ddt_t *ddt, dmu_tx_t *tx);
+extern int ddt_log_load(ddt_t *ddt);
+
+extern int zfs_dedup_log;
+extern int zfs_dedup_log_flush_entries_min;
+extern int zfs_dedup_log_txg_max;
+extern unsigned long zfs_dedup_log_mem_max;
 
 extern const ddt_ops_t ddt_zap_ops;
 
@@ -50,6 +50,20 @@ typedef struct zstream {
 	 */
 	uint64_t	zs_ipf_blkid;
 
+	/*
+	 * Distance between the starts of successive accesses of a reverse
+	 * or strided stream, each of which is zs_nblks long, or 0 for a
+	 * forward sequential stream, whose accesses start where the
+	 * previous one ended.
+	 */
+	int64_t		zs_stride;
+	uint64_t	zs_nblks;
+	uint64_t	zs_last_blkid;	/* start of the last access */
+
+	uint64_t	zs_max_dist;	/* max bytes to prefetch ahead */
+	uint64_t	zs_hits;	/* accesses which matched the stream */
+	uint64_t	zs_io_waits;	/* of which still waited for i/o */
+
 	kmutex_t	zs_lock;	/* protects stream */
 	hrtime_t	zs_atime;	/* time last prefetch issued */
 	list_node_t	zs_node;	/* link for zf_stream */
@@ -66,7 +80,8 @@ void		zfetch_fini(void);
 
 void		dmu_zfetch_init(zfetch_t *, struct dnode *);
 void		dmu_zfetch_fini(zfetch_t *);
-void		dmu_zfetch(zfetch_t *, uint64_t, uint64_t, boolean_t);
+void		dmu_zfetch(zfetch_t *, uint64_t, uint64_t, boolean_t,
+    boolean_t);
 
 
 #ifdef	__cplusplus
@@ -35,6 +35,7 @@
 #include <sys/refcount.h>
 #include <sys/dmu_zfetch.h>
 #include <sys/zrlock.h>
+#include <sys/multilist.h>
 
 #ifdef	__cplusplus
 extern "C" {
@@ -239,8 +240,8 @@ struct dnode {
 	/* There are no level-0 blocks of this blkid or higher in dn_dbufs */
 	uint64_t dn_unlisted_l0_blkid;
 
-	/* protected by os_lock: */
-	list_node_t dn_dirty_link[TXG_SIZE];	/* next on dataset's dirty */
+	/* on the objset's dirty list; protected by its sublist lock: */
+	multilist_node_t dn_dirty_link[TXG_SIZE];
 
 	/* protected by dn_mtx: */
 	kmutex_t dn_mtx;
@@ -74,6 +74,8 @@ typedef enum dsl_scan_flags {
 
 #define	DSL_SCAN_FLAGS_MASK (DSF_VISIT_DS_AGAIN)
 
+typedef struct dsl_scan_io_queue dsl_scan_io_queue_t;
+
 /*
  * Every pool will have one dsl_scan_t and this structure will contain
  * in-memory information about the scan and a pointer to the on-disk
@@ -98,6 +100,21 @@ typedef enum dsl_scan_flags {
  *			the scan but have not yet been processed (i.e deferred
  *			frees) are accounted for.
  *
+ * scn_is_sorted -	scrub and resilver I/Os are gathered into per top-level
+ *			vdev queues sorted by on-disk offset instead of being
+ *			issued in traversal order.  See the comment above
+ *			scan_io_queues_run() in dsl_scan.c.
+ *
+ * scn_clearing -	a sorted scan has stopped traversing metadata and is
+ *			only issuing I/O from its queues, either because it
+ *			has exceeded its memory limit or because it needs to
+ *			checkpoint.
+ *
+ * scn_checkpointing -	all queued I/O is being drained so that the in-core
+ *			scan position (scn_phys) can be written to disk.
+ *			Until then scn_phys_cached, the last position whose
+ *			blocks have all been issued, is what gets synced.
+ *
  * This structure also maintains information about deferred frees which are
  * a special kind of traversal. Deferred free can exist in either a bptree or
  * a bpobj structure. The scn_is_bptree flag will indicate the type of
@@ -118,14 +135,31 @@ typedef struct dsl_scan {
 	boolean_t scn_async_destroying;
 	boolean_t scn_async_stalled;
 
+	/* for sorted (sequential) scans */
+	boolean_t scn_is_sorted;
+	boolean_t scn_clearing;
+	boolean_t scn_checkpointing;
+	uint64_t scn_last_checkpoint;	/* lbolt of the last checkpoint */
+	uint64_t scn_bytes_pending;	/* bytes queued but not yet issued */
+	taskq_t *scn_taskq;		/* issues I/O from the vdev queues */
+	avl_tree_t scn_queue;		/* in-core copy of the dataset queue */
+
 	/* for debugging / information */
 	uint64_t scn_visited_this_txg;
-
-	dsl_scan_phys_t scn_phys;
+	uint64_t scn_issued_before_pass;
+	uint64_t scn_segs_this_txg;
+	uint64_t scn_avg_seg_size_this_txg;
+	uint64_t scn_zios_this_txg;
+	uint64_t scn_avg_zio_size_this_txg;
+
+	dsl_scan_phys_t scn_phys;	/* on-disk format, in-core progress */
+	dsl_scan_phys_t scn_phys_cached; /* last checkpointed scn_phys */
 } dsl_scan_t;
 
 int dsl_scan_init(struct dsl_pool *dp, uint64_t txg);
 void dsl_scan_fini(struct dsl_pool *dp);
+void scan_init(void);
+void scan_fini(void);
 void dsl_scan_sync(struct dsl_pool *, dmu_tx_t *);
 int dsl_scan_cancel(struct dsl_pool *);
 int dsl_scan(struct dsl_pool *, pool_scan_func_t);
@@ -139,6 +173,9 @@ void dsl_scan_ds_snapshotted(struct dsl_dataset *ds, struct dmu_tx *tx);
 void dsl_scan_ds_clone_swapped(struct dsl_dataset *ds1, struct dsl_dataset *ds2,
     struct dmu_tx *tx);
 boolean_t dsl_scan_active(dsl_scan_t *scn);
+void dsl_scan_freed(spa_t *spa, const blkptr_t *bp);
+void dsl_scan_io_queue_destroy(dsl_scan_io_queue_t *queue);
+void dsl_scan_io_queue_vdev_xfer(vdev_t *svd, vdev_t *tvd);
 
 #ifdef	__cplusplus
 }
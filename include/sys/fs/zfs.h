@@ -168,6 +168,7 @@ typedef enum {
 	ZFS_PROP_PBKDF2_ITERS,
 	ZFS_PROP_KEYSOURCE,
 	ZFS_PROP_KEYSTATUS,
+	ZFS_PROP_SPECIAL_SMALL_BLOCKS,
 	ZFS_NUM_PROPS
 } zfs_prop_t;
 
@@ -220,6 +221,7 @@ typedef enum {
 	ZPOOL_PROP_MAXBLOCKSIZE,
 	ZPOOL_PROP_TNAME,
 	ZPOOL_PROP_MAXDNODESIZE,
+	ZPOOL_PROP_AUTOTRIM,
 	ZPOOL_NUM_PROPS
 } zpool_prop_t;
 
@@ -556,6 +558,8 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_ASIZE		"asize"
 #define	ZPOOL_CONFIG_DTL		"DTL"
 #define	ZPOOL_CONFIG_SCAN_STATS		"scan_stats"	/* not stored on disk */
+#define	ZPOOL_CONFIG_REMOVAL_STATS	"removal_stats"	/* not stored on disk */
+#define	ZPOOL_CONFIG_RAIDZ_EXPAND_STATS	"raidz_expand_stats" /* not on disk */
 #define	ZPOOL_CONFIG_VDEV_STATS		"vdev_stats"	/* not stored on disk */
 
 /* container nvlist of extended stats */
@@ -607,6 +611,8 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_SPARES		"spares"
 #define	ZPOOL_CONFIG_IS_SPARE		"is_spare"
 #define	ZPOOL_CONFIG_NPARITY		"nparity"
+#define	ZPOOL_CONFIG_RAIDZ_EXPANDING	"raidz_expanding"
+#define	ZPOOL_CONFIG_RAIDZ_EXPAND_TXGS	"raidz_expand_txgs"
 #define	ZPOOL_CONFIG_HOSTID		"hostid"
 #define	ZPOOL_CONFIG_HOSTNAME		"hostname"
 #define	ZPOOL_CONFIG_LOADED_TIME	"initial_load_time"
@@ -616,6 +622,7 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_L2CACHE		"l2cache"
 #define	ZPOOL_CONFIG_HOLE_ARRAY		"hole_array"
 #define	ZPOOL_CONFIG_VDEV_CHILDREN	"vdev_children"
+#define	ZPOOL_CONFIG_INDIRECT_VDEVS	"indirect_vdevs"
 #define	ZPOOL_CONFIG_IS_HOLE		"is_hole"
 #define	ZPOOL_CONFIG_DDT_HISTOGRAM	"ddt_histogram"
 #define	ZPOOL_CONFIG_DDT_OBJ_STATS	"ddt_object_stats"
@@ -642,6 +649,10 @@ typedef struct zpool_rewind_policy {
 #define	ZPOOL_CONFIG_VDEV_TOP_ZAP	"com.delphix:vdev_zap_top"
 #define	ZPOOL_CONFIG_VDEV_LEAF_ZAP	"com.delphix:vdev_zap_leaf"
 #define	ZPOOL_CONFIG_HAS_PER_VDEV_ZAPS	"com.delphix:has_per_vdev_zaps"
+#define	ZPOOL_CONFIG_ALLOCATION_BIAS	"alloc_bias"
+#define	ZPOOL_CONFIG_INDIRECT_OBJECT	"com.delphix:indirect_object"
+#define	ZPOOL_CONFIG_INDIRECT_OBSOLETE_SM "com.delphix:indirect_obsolete_sm"
+#define	ZPOOL_CONFIG_CLASS_STATS	"class_stats"	/* not stored on disk */
 /*
  * The persistent vdev state is stored as separate values rather than a single
  * 'vdev_state' entry.  This is because a device can be in multiple states, such
@@ -674,10 +685,19 @@ typedef struct zpool_rewind_policy {
 #define	VDEV_TYPE_FILE			"file"
 #define	VDEV_TYPE_MISSING		"missing"
 #define	VDEV_TYPE_HOLE			"hole"
+#define	VDEV_TYPE_INDIRECT		"indirect"
 #define	VDEV_TYPE_SPARE			"spare"
 #define	VDEV_TYPE_LOG			"log"
 #define	VDEV_TYPE_L2CACHE		"l2cache"
 
+/*
+ * Allocation bias of a top-level vdev (ZPOOL_CONFIG_ALLOCATION_BIAS), and the
+ * names of the allocation classes reported in ZPOOL_CONFIG_CLASS_STATS.
+ */
+#define	VDEV_ALLOC_BIAS_SPECIAL		"special"
+#define	VDEV_ALLOC_CLASS_NORMAL		"normal"
+#define	VDEV_ALLOC_CLASS_LOGS		"logs"
+
 /*
  * This is needed in userland to report the minimum necessary device size.
  */
@@ -763,6 +783,23 @@ typedef enum pool_scan_func {
 	POOL_SCAN_FUNCS
 } pool_scan_func_t;
 
+/*
+ * TRIM command configuration info.
+ */
+typedef enum pool_trim_func {
+	POOL_TRIM_START,
+	POOL_TRIM_CANCEL,
+	POOL_TRIM_SUSPEND,
+	POOL_TRIM_FUNCS
+} pool_trim_func_t;
+
+/*
+ * nvlist name constants used by the ZFS_IOC_POOL_TRIM ioctl.
+ */
+#define	ZPOOL_TRIM_COMMAND	"trim_command"
+#define	ZPOOL_TRIM_VDEVS	"trim_vdevs"
+#define	ZPOOL_TRIM_RATE		"trim_rate"
+
 /*
  * ZIO types.  Needed to interpret vdev statistics below.
  */
@@ -773,9 +810,17 @@ typedef enum zio_type {
 	ZIO_TYPE_FREE,
 	ZIO_TYPE_CLAIM,
 	ZIO_TYPE_IOCTL,
+	ZIO_TYPE_TRIM,
 	ZIO_TYPES
 } zio_type_t;
 
+/*
+ * Number of ZIO types reported in vdev_stat_t.  ZIO_TYPE_TRIM is not
+ * included, so that the layout of vdev_stat_t is unchanged; TRIM operations
+ * are accounted as ZIO_TYPE_IOCTL instead.
+ */
+#define	VS_ZIO_TYPES	6
+
 /*
  * Pool statistics.  Note: all fields should be 64-bit because this
  * is passed between kernel and userland as an nvlist uint64 array.
@@ -795,8 +840,52 @@ typedef struct pool_scan_stat {
 	/* values not stored on disk */
 	uint64_t	pss_pass_exam;	/* examined bytes per scan pass */
 	uint64_t	pss_pass_start;	/* start time of a scan pass */
+	uint64_t	pss_pass_issued; /* issued bytes per scan pass */
+	uint64_t	pss_issued;	/* total bytes checked by scanner */
 } pool_scan_stat_t;
 
+/*
+ * Space statistics of an allocation class, reported per class in
+ * ZPOOL_CONFIG_CLASS_STATS.  Like pool_scan_stat_t, this is passed as a
+ * uint64 array and so must only contain 64-bit fields.
+ */
+typedef struct pool_class_stat {
+	uint64_t	pcs_space;	/* total capacity */
+	uint64_t	pcs_alloc;	/* allocated space */
+	uint64_t	pcs_dspace;	/* deflated capacity */
+	uint64_t	pcs_fragmentation; /* class fragmentation */
+	uint64_t	pcs_esize;	/* expandable space */
+} pool_class_stat_t;
+
+/*
+ * Progress of the current or last removal of a top-level vdev, reported in
+ * ZPOOL_CONFIG_REMOVAL_STATS.  Passed as a uint64 array like
+ * pool_scan_stat_t.
+ */
+typedef struct pool_removal_stat {
+	uint64_t	prs_state;	/* dsl_scan_state_t */
+	uint64_t	prs_removing_vdev; /* id of the vdev */
+	uint64_t	prs_start_time;
+	uint64_t	prs_end_time;
+	uint64_t	prs_to_copy;	/* bytes that need to be copied */
+	uint64_t	prs_copied;	/* bytes that have been copied */
+	uint64_t	prs_mapping_memory; /* in-core size of all mappings */
+} pool_removal_stat_t;
+
+/*
+ * Progress of the current or last expansion of a RAID-Z vdev, reported in
+ * ZPOOL_CONFIG_RAIDZ_EXPAND_STATS.  Passed as a uint64 array like
+ * pool_scan_stat_t.
+ */
+typedef struct pool_raidz_expand_stat {
+	uint64_t	pres_state;	/* dsl_scan_state_t */
+	uint64_t	pres_expanding_vdev; /* id of the vdev */
+	uint64_t	pres_start_time;
+	uint64_t	pres_end_time;
+	uint64_t	pres_to_reflow;	/* bytes that need to be moved */
+	uint64_t	pres_reflowed;	/* bytes that have been moved */
+} pool_raidz_expand_stat_t;
+
 typedef enum dsl_scan_state {
 	DSS_NONE,
 	DSS_SCANNING,
@@ -830,8 +919,8 @@ typedef struct vdev_stat {
 	uint64_t	vs_dspace;		/* deflated capacity	*/
 	uint64_t	vs_rsize;		/* replaceable dev size */
 	uint64_t	vs_esize;		/* expandable dev size */
-	uint64_t	vs_ops[ZIO_TYPES];	/* operation count	*/
-	uint64_t	vs_bytes[ZIO_TYPES];	/* bytes read/written	*/
+	uint64_t	vs_ops[VS_ZIO_TYPES];	/* operation count	*/
+	uint64_t	vs_bytes[VS_ZIO_TYPES];	/* bytes read/written	*/
 	uint64_t	vs_read_errors;		/* read errors		*/
 	uint64_t	vs_write_errors;	/* write errors		*/
 	uint64_t	vs_checksum_errors;	/* checksum errors	*/
@@ -839,9 +928,25 @@ typedef struct vdev_stat {
 	uint64_t	vs_scan_removing;	/* removing?	*/
 	uint64_t	vs_scan_processed;	/* scan processed bytes	*/
 	uint64_t	vs_fragmentation;	/* device fragmentation */
-
+	uint64_t	vs_trim_notsup;		/* trim not supported	*/
+	uint64_t	vs_trim_errors;		/* trim i/o errors	*/
+	uint64_t	vs_trim_state;		/* vdev_trim_state_t	*/
+	uint64_t	vs_trim_action_time;	/* time of last change	*/
+	uint64_t	vs_trim_bytes_done;	/* bytes trimmed	*/
+	uint64_t	vs_trim_bytes_est;	/* total bytes to trim	*/
 } vdev_stat_t;
 
+/*
+ * State of an on-demand TRIM of a leaf vdev, see vdev_trim.c.
+ */
+typedef enum vdev_trim_state {
+	VDEV_TRIM_NONE,
+	VDEV_TRIM_ACTIVE,
+	VDEV_TRIM_CANCELED,
+	VDEV_TRIM_SUSPENDED,
+	VDEV_TRIM_COMPLETE
+} vdev_trim_state_t;
+
 /*
  * Extended stats
  *
@@ -1018,6 +1123,7 @@ typedef enum zfs_ioc {
 	ZFS_IOC_DESTROY_BOOKMARKS,
 	ZFS_IOC_RECV_NEW,
 	ZFS_IOC_KEY,
+	ZFS_IOC_POOL_TRIM,
 
 	/*
 	 * Linux - 3/64 numbers reserved.
@@ -53,6 +53,11 @@ void metaslab_unload(metaslab_t *);
 void metaslab_sync(metaslab_t *, uint64_t);
 void metaslab_sync_done(metaslab_t *, uint64_t);
 void metaslab_sync_reassess(metaslab_group_t *);
+boolean_t metaslab_flush(metaslab_t *, dmu_tx_t *);
+void metaslab_unflushed_apply(metaslab_t *, range_tree_t *, maptype_t);
+void metaslab_unflushed_replay(metaslab_t *, uint64_t, uint64_t, uint64_t,
+    maptype_t);
+void metaslab_unflushed_replay_done(metaslab_t *);
 uint64_t metaslab_block_maxsize(metaslab_t *);
 
 #define	METASLAB_HINTBP_FAVOR		0x0
@@ -65,7 +70,10 @@ uint64_t metaslab_block_maxsize(metaslab_t *);
 
 int metaslab_alloc(spa_t *, metaslab_class_t *, uint64_t,
     blkptr_t *, int, uint64_t, blkptr_t *, int, zio_t *);
+int metaslab_alloc_dva(spa_t *, metaslab_class_t *, uint64_t,
+    dva_t *, int, dva_t *, uint64_t, int);
 void metaslab_free(spa_t *, const blkptr_t *, uint64_t, boolean_t);
+void metaslab_free_concrete(vdev_t *, uint64_t, uint64_t, uint64_t);
 int metaslab_claim(spa_t *, const blkptr_t *, uint64_t);
 void metaslab_check_free(spa_t *, const blkptr_t *);
 void metaslab_fastwrite_mark(spa_t *, const blkptr_t *);
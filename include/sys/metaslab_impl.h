@@ -215,6 +215,21 @@ struct metaslab_group {
  * representation, we rewrite it in its minimized form. If a metaslab
  * needs to condense then we must set the ms_condensing flag to ensure
  * that allocations are not performed on the metaslab that is being written.
+ *
+ * Similarly, while free space of a metaslab is being trimmed ms_trimming is
+ * non-zero, and no allocations are performed on the metaslab so that the
+ * ranges being trimmed remain free until the TRIM I/O has completed.
+ * Likewise ms_reflowing is set while the data of the metaslab is being moved
+ * by the expansion of a RAID-Z vdev, so that no new data is written to the
+ * ranges that have not been moved yet.
+ *
+ * When the pool uses log space maps, the allocs and frees of each txg are
+ * appended to the pool-wide log of the txg instead of the space map, and
+ * accumulate in ms_unflushed_allocs and ms_unflushed_frees until the
+ * metaslab is flushed, i.e. they are written to its space map.  The space
+ * map then only reflects the metaslab up to its smp_flushed_txg, and
+ * ms_allocated_space is what must be used for the allocated space of the
+ * metaslab.  See spa_log_spacemap.c.
  */
 struct metaslab {
 	kmutex_t	ms_lock;
@@ -231,8 +246,38 @@ struct metaslab {
 	range_tree_t	*ms_defertree[TXG_DEFER_SIZE];
 	range_tree_t	*ms_tree;
 
+	/*
+	 * Recently freed space which has not been trimmed yet, collected
+	 * while the pool's autotrim property is on.  See vdev_trim.c.
+	 */
+	range_tree_t	*ms_trim;
+
+	/*
+	 * Changes of the metaslab which are only in the log space maps, and
+	 * those being written to its space map by the txg that is syncing,
+	 * which are kept until the txg is synced for metaslab_load().
+	 * ms_unflushed_txg is the txg of the oldest log with changes of the
+	 * metaslab, or 0 if there are none, and ms_unflushed_node links the
+	 * metaslab in spa_metaslabs_by_flushed.
+	 */
+	range_tree_t	*ms_unflushed_allocs;
+	range_tree_t	*ms_unflushed_frees;
+	range_tree_t	*ms_flushing_allocs;
+	range_tree_t	*ms_flushing_frees;
+	uint64_t	ms_unflushed_txg;
+	avl_node_t	ms_unflushed_node;
+
+	/*
+	 * Allocated space of the metaslab as of the last synced txg, and
+	 * the change to it by the syncing txg which is not in ms_sm.
+	 */
+	uint64_t	ms_allocated_space;
+	int64_t		ms_allocated_this_txg;
+
 	boolean_t	ms_condensing;	/* condensing? */
 	boolean_t	ms_condense_wanted;
+	int		ms_trimming;	/* ranges being trimmed, no allocs */
+	boolean_t	ms_reflowing;	/* raidz reflow, no allocs */
 	boolean_t	ms_loaded;
 	boolean_t	ms_loading;
 
@@ -619,6 +619,9 @@ extern spa_t *spa_inject_addref(char *pool);
 extern void spa_inject_delref(spa_t *spa);
 extern void spa_scan_stat_init(spa_t *spa);
 extern int spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps);
+extern int spa_removal_get_stats(spa_t *spa, pool_removal_stat_t *prs);
+extern int spa_raidz_expand_get_stats(spa_t *spa,
+    pool_raidz_expand_stat_t *pres);
 
 #define	SPA_ASYNC_CONFIG_UPDATE	0x01
 #define	SPA_ASYNC_REMOVE	0x02
@@ -628,6 +631,9 @@ extern int spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps);
 #define	SPA_ASYNC_AUTOEXPAND	0x20
 #define	SPA_ASYNC_REMOVE_DONE	0x40
 #define	SPA_ASYNC_REMOVE_STOP	0x80
+#define	SPA_ASYNC_L2CACHE_REBUILD	0x100
+#define	SPA_ASYNC_AUTOTRIM_RESTART	0x200
+#define	SPA_ASYNC_RAIDZ_EXPAND_DONE	0x400
 
 /*
  * Controls the behavior of spa_vdev_remove().
@@ -642,6 +648,7 @@ extern int spa_vdev_attach(spa_t *spa, uint64_t guid, nvlist_t *nvroot,
 extern int spa_vdev_detach(spa_t *spa, uint64_t guid, uint64_t pguid,
     int replace_done);
 extern int spa_vdev_remove(spa_t *spa, uint64_t guid, boolean_t unspare);
+extern int spa_vdev_remove_cancel(spa_t *spa);
 extern boolean_t spa_vdev_remove_active(spa_t *spa);
 extern int spa_vdev_setpath(spa_t *spa, uint64_t guid, const char *newpath);
 extern int spa_vdev_setfru(spa_t *spa, uint64_t guid, const char *newfru);
@@ -665,6 +672,10 @@ extern void spa_l2cache_drop(spa_t *spa);
 extern int spa_scan(spa_t *spa, pool_scan_func_t func);
 extern int spa_scan_stop(spa_t *spa);
 
+/* trim */
+extern int spa_vdev_trim(spa_t *spa, nvlist_t *nv, pool_trim_func_t cmd,
+    uint64_t rate, nvlist_t *vdev_errlist);
+
 /* spa syncing */
 extern void spa_sync(spa_t *spa, uint64_t txg); /* only for DMU use */
 extern void spa_sync_allpools(void);
@@ -732,8 +743,23 @@ typedef struct spa_stats {
 	spa_stats_history_t	txg_history;
 	spa_stats_history_t	tx_assign_histogram;
 	spa_stats_history_t	io_history;
+	spa_stats_history_t	load_phases;
 } spa_stats_t;
 
+/* Steps of spa_load() whose duration is reported in the import kstat */
+typedef enum spa_load_phase {
+	SPA_LOAD_PHASE_VDEV_OPEN,	/* open vdevs and read their labels */
+	SPA_LOAD_PHASE_UBERBLOCK,	/* validate labels, pick uberblock */
+	SPA_LOAD_PHASE_MOS,		/* open the MOS and its objects */
+	SPA_LOAD_PHASE_VDEV_LOAD,	/* load metaslabs and DTLs */
+	SPA_LOAD_PHASE_DDT,		/* load the dedup tables */
+	SPA_LOAD_PHASE_LOG_CHECK,	/* validate config, check the ZIL */
+	SPA_LOAD_PHASE_VERIFY,		/* spa_load_verify() traversal */
+	SPA_LOAD_PHASE_LOG_CLAIM,	/* claim logs, sync first txgs */
+	SPA_LOAD_PHASE_TOTAL,
+	SPA_LOAD_PHASES
+} spa_load_phase_t;
+
 typedef enum txg_state {
 	TXG_STATE_BIRTH		= 0,
 	TXG_STATE_OPEN		= 1,
@@ -761,6 +787,8 @@ extern txg_stat_t *spa_txg_history_init_io(spa_t *, uint64_t,
     struct dsl_pool *);
 extern void spa_txg_history_fini_io(spa_t *, txg_stat_t *);
 extern void spa_tx_assign_add_nsecs(spa_t *spa, uint64_t nsecs);
+extern void spa_load_phase_start(spa_t *spa);
+extern void spa_load_phase_done(spa_t *spa, spa_load_phase_t phase);
 
 /* Pool configuration locks */
 extern int spa_config_tryenter(spa_t *spa, int locks, void *tag, krw_t rw);
@@ -821,6 +849,9 @@ extern uint64_t spa_version(spa_t *spa);
 extern boolean_t spa_deflate(spa_t *spa);
 extern metaslab_class_t *spa_normal_class(spa_t *spa);
 extern metaslab_class_t *spa_log_class(spa_t *spa);
+extern metaslab_class_t *spa_special_class(spa_t *spa);
+extern metaslab_class_t *spa_preferred_class(spa_t *spa, uint64_t size,
+    dmu_object_type_t objtype, uint_t level, uint_t special_smallblk);
 extern void spa_evicting_os_register(spa_t *, objset_t *os);
 extern void spa_evicting_os_deregister(spa_t *, objset_t *os);
 extern void spa_evicting_os_wait(spa_t *spa);
@@ -42,6 +42,9 @@
 #include <sys/bplist.h>
 #include <sys/bpobj.h>
 #include <sys/dsl_crypt.h>
+#include <sys/vdev_removal.h>
+#include <sys/vdev_raidz_expand.h>
+#include <sys/spa_log_spacemap.h>
 #include <sys/zfeature.h>
 #include <zfeature_common.h>
 
@@ -147,6 +150,7 @@ struct spa {
 	boolean_t	spa_is_initializing;	/* true while opening pool */
 	metaslab_class_t *spa_normal_class;	/* normal data class */
 	metaslab_class_t *spa_log_class;	/* intent log data class */
+	metaslab_class_t *spa_special_class;	/* special allocation class */
 	uint64_t	spa_first_txg;		/* first txg after spa_open() */
 	uint64_t	spa_final_txg;		/* txg of export/destroy */
 	uint64_t	spa_freeze_txg;		/* freeze pool at this txg */
@@ -194,6 +198,19 @@ struct spa {
 	uint8_t		spa_scrub_reopen;	/* scrub doing vdev_reopen */
 	uint64_t	spa_scan_pass_start;	/* start time per pass/reboot */
 	uint64_t	spa_scan_pass_exam;	/* examined bytes per pass */
+	uint64_t	spa_scan_pass_issued;	/* issued bytes per pass */
+	spa_removing_phys_t spa_removing_phys;	/* last top-level removal */
+	spa_vdev_removal_t *spa_vdev_removal;	/* removal in progress */
+	spa_raidz_expand_phys_t spa_raidz_expand_phys; /* last expansion */
+	vdev_raidz_expand_t *spa_raidz_expand;	/* expansion in progress */
+	kmutex_t	spa_flushed_ms_lock;	/* for the two below */
+	avl_tree_t	spa_metaslabs_by_flushed; /* by ms_unflushed_txg */
+	list_t		spa_sm_logs_by_txg;	/* spa_log_sm_t, oldest first */
+	uint64_t	spa_log_sm_zap;		/* txg -> log object */
+	spa_log_sm_t	*spa_syncing_log_sm;	/* log of the syncing txg */
+	uint64_t	spa_unflushed_segs;	/* segments only in the logs */
+	uint64_t	spa_log_sm_pin_txg;	/* logs to keep, see replay */
+	zio_t		*spa_txg_zio[TXG_SIZE];	/* wait for these in spa_sync */
 	kmutex_t	spa_async_lock;		/* protect async state */
 	kthread_t	*spa_async_thread;	/* thread doing async task */
 	int		spa_async_suspended;	/* async tasks suspended */
@@ -238,6 +255,7 @@ struct spa {
 	int		spa_mode;		/* FREAD | FWRITE */
 	spa_log_state_t spa_log_state;		/* log state */
 	uint64_t	spa_autoexpand;		/* lun expansion on/off */
+	uint64_t	spa_autotrim;		/* automatic trim on/off */
 	ddt_t		*spa_ddt[ZIO_CHECKSUM_FUNCTIONS]; /* in-core DDTs */
 	uint64_t	spa_ddt_stat_object;	/* DDT statistics */
 	uint64_t	spa_dedup_dspace;	/* Cache get_dedup_dspace() */
@@ -0,0 +1,98 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_SPA_LOG_SPACEMAP_H
+#define	_SYS_SPA_LOG_SPACEMAP_H
+
+#include <sys/avl.h>
+#include <sys/list.h>
+#include <sys/range_tree.h>
+#include <sys/space_map.h>
+#include <sys/spa.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * The log of a txg is a MOS object holding an array of two-word entries,
+ * with a spa_log_sm_phys_t in its bonus buffer.  The logs of a pool are
+ * found through the DMU_POOL_LOG_SPACEMAP_ZAP object, which maps the txg
+ * of each log to its object.
+ */
+typedef struct spa_log_sm_phys {
+	uint64_t	slsp_txg;	/* txg the log was written in */
+	uint64_t	slsp_length;	/* bytes of entries in the object */
+} spa_log_sm_phys_t;
+
+/*
+ * log entry
+ *
+ *    1         24                          39
+ *  ,---+---------------+-----------------------------------------.
+ *  | t |     vdev      |        run (SPA_MINBLOCKSIZE units)       |
+ *  `---+---------------+-----------------------------------------'
+ *   63  62           39 38                                       0
+ *  ,-------------------------------------------------------------.
+ *  |                     offset (bytes)                           |
+ *  `-------------------------------------------------------------'
+ *   63                                                           0
+ *
+ * t is the maptype_t of the range.
+ */
+#define	SLE_TYPE_DECODE(x)	BF64_DECODE(x, 63, 1)
+#define	SLE_TYPE_ENCODE(x)	BF64_ENCODE(x, 63, 1)
+#define	SLE_VDEV_DECODE(x)	BF64_DECODE(x, 39, 24)
+#define	SLE_VDEV_ENCODE(x)	BF64_ENCODE(x, 39, 24)
+#define	SLE_RUN_DECODE(x)	(BF64_DECODE(x, 0, 39) << SPA_MINBLOCKSHIFT)
+#define	SLE_RUN_ENCODE(x)	BF64_ENCODE((x) >> SPA_MINBLOCKSHIFT, 0, 39)
+
+#define	SLE_RUN_MAX		SLE_RUN_DECODE(~0ULL)
+#define	SLE_WORDS		2
+
+/*
+ * In-core state of the log of a txg.  sls_mscount is the number of
+ * metaslabs whose oldest unflushed change is in this log; once it and
+ * the count of every older log are zero, the log is not needed anymore.
+ */
+typedef struct spa_log_sm {
+	uint64_t	sls_txg;
+	uint64_t	sls_object;
+	uint64_t	sls_mscount;
+	dmu_buf_t	*sls_dbuf;	/* bonus, held while syncing */
+	list_node_t	sls_node;	/* spa_sm_logs_by_txg */
+} spa_log_sm_t;
+
+extern int spa_log_sm_ms_compare(const void *x1, const void *x2);
+extern boolean_t spa_uses_log_spacemap(spa_t *spa);
+extern void spa_log_sm_open_syncing(spa_t *spa, dmu_tx_t *tx);
+extern void spa_log_sm_write(spa_t *spa, uint64_t vdev_id, range_tree_t *rt,
+    maptype_t maptype, dmu_tx_t *tx);
+extern void spa_log_sm_ms_dirty(spa_t *spa, metaslab_t *msp, uint64_t txg);
+extern void spa_log_sm_ms_clean(spa_t *spa, metaslab_t *msp);
+extern void spa_log_sm_sync(spa_t *spa, dmu_tx_t *tx);
+extern void spa_log_sm_sync_done(spa_t *spa);
+extern int spa_log_sm_load(spa_t *spa);
+extern void spa_log_sm_unload(spa_t *spa);
+
+extern unsigned long zfs_unflushed_max_mem_amt;
+extern int zfs_unflushed_log_txg_max;
+extern int zfs_min_metaslabs_to_flush;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_SPA_LOG_SPACEMAP_H */
@@ -58,7 +58,8 @@ typedef struct space_map_phys {
 	uint64_t	smp_object;	/* on-disk space map object */
 	uint64_t	smp_objsize;	/* size of the object */
 	uint64_t	smp_alloc;	/* space allocated from the map */
-	uint64_t	smp_pad[5];	/* reserved */
+	uint64_t	smp_flushed_txg; /* see spa_log_spacemap.c */
+	uint64_t	smp_pad[4];	/* reserved */
 
 	/*
 	 * The smp_histogram maintains a histogram of free regions. Each
@@ -144,6 +145,8 @@ void space_map_update(space_map_t *sm);
 uint64_t space_map_object(space_map_t *sm);
 uint64_t space_map_allocated(space_map_t *sm);
 uint64_t space_map_length(space_map_t *sm);
+uint64_t space_map_flushed_txg(space_map_t *sm);
+void space_map_set_flushed_txg(space_map_t *sm, uint64_t txg, dmu_tx_t *tx);
 
 void space_map_write(space_map_t *sm, range_tree_t *rt, maptype_t maptype,
     dmu_tx_t *tx);
@@ -54,6 +54,9 @@ struct uberblock {
 
 	/* highest SPA_VERSION supported by software that wrote this txg */
 	uint64_t	ub_software_version;
+
+	/* offset up to which an expanding raidz vdev has been reflowed */
+	uint64_t	ub_raidz_reflow_info;
 };
 
 #ifdef	__cplusplus
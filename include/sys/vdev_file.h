@@ -35,6 +35,14 @@ extern "C" {
 
 typedef struct vdev_file {
 	vnode_t		*vf_vnode;
+	kmutex_t	vf_lock;
+	kcondvar_t	vf_cv;
+	zio_t		**vf_queue;	/* ring of zios waiting for a worker */
+	uint_t		vf_queue_size;	/* slots in vf_queue */
+	uint_t		vf_queue_head;	/* slot of the next zio to issue */
+	uint_t		vf_queue_count;	/* zios in vf_queue */
+	int		vf_workers;	/* workers draining vf_queue */
+	int		vf_busy;	/* workers issuing a zio */
 } vdev_file_t;
 
 extern void vdev_file_init(void);
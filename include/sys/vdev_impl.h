@@ -64,13 +64,21 @@ extern uint32_t zfs_vdev_async_write_max_active;
 typedef int	vdev_open_func_t(vdev_t *vd, uint64_t *size, uint64_t *max_size,
     uint64_t *ashift);
 typedef void	vdev_close_func_t(vdev_t *vd);
-typedef uint64_t vdev_asize_func_t(vdev_t *vd, uint64_t psize);
+typedef uint64_t vdev_asize_func_t(vdev_t *vd, uint64_t psize,
+    uint64_t txg);
 typedef void	vdev_io_start_func_t(zio_t *zio);
 typedef void	vdev_io_done_func_t(zio_t *zio);
 typedef void	vdev_state_change_func_t(vdev_t *vd, int, int);
 typedef void	vdev_hold_func_t(vdev_t *vd);
 typedef void	vdev_rele_func_t(vdev_t *vd);
 
+/*
+ * Given a target vdev, translates the logical range "in" to the physical
+ * range "res"
+ */
+typedef void vdev_xlation_func_t(vdev_t *cvd, const range_seg_t *in,
+    range_seg_t *res);
+
 typedef const struct vdev_ops {
 	vdev_open_func_t		*vdev_op_open;
 	vdev_close_func_t		*vdev_op_close;
@@ -80,6 +88,7 @@ typedef const struct vdev_ops {
 	vdev_state_change_func_t	*vdev_op_state_change;
 	vdev_hold_func_t		*vdev_op_hold;
 	vdev_rele_func_t		*vdev_op_rele;
+	vdev_xlation_func_t		*vdev_op_xlate;
 	char				vdev_op_type[16];
 	boolean_t			vdev_op_leaf;
 } vdev_ops_t;
@@ -114,12 +123,22 @@ typedef struct vdev_queue_class {
 	avl_tree_t	vqc_queued_tree;
 } vdev_queue_class_t;
 
+/*
+ * Which metaslab class, besides the normal and log classes, the metaslabs of
+ * a top-level vdev belong to (see spa_preferred_class()).
+ */
+typedef enum vdev_alloc_bias {
+	VDEV_BIAS_NONE,
+	VDEV_BIAS_SPECIAL	/* metadata and small blocks */
+} vdev_alloc_bias_t;
+
 struct vdev_queue {
 	vdev_t		*vq_vdev;
 	vdev_queue_class_t vq_class[ZIO_PRIORITY_NUM_QUEUEABLE];
 	avl_tree_t	vq_active_tree;
 	avl_tree_t	vq_read_offset_tree;
 	avl_tree_t	vq_write_offset_tree;
+	avl_tree_t	vq_trim_offset_tree;
 	uint64_t	vq_last_offset;
 	hrtime_t	vq_io_complete_ts; /* time last i/o completed */
 	hrtime_t	vq_io_delta_ts;
@@ -161,6 +180,7 @@ struct vdev {
 	boolean_t	vdev_nonrot;	/* true if solid state		*/
 	int		vdev_open_error; /* error on last open		*/
 	kthread_t	*vdev_open_thread; /* thread opening children	*/
+	int		vdev_load_error; /* error on last load		*/
 	uint64_t	vdev_crtxg;	/* txg when top-level was added */
 
 	/*
@@ -181,6 +201,7 @@ struct vdev {
 	list_node_t	vdev_state_dirty_node; /* state dirty list	*/
 	uint64_t	vdev_deflate_ratio; /* deflation ratio (x512)	*/
 	uint64_t	vdev_islog;	/* is an intent log device	*/
+	vdev_alloc_bias_t vdev_alloc_bias; /* metaslab allocation bias	*/
 	uint64_t	vdev_removing;	/* device is being removed?	*/
 	boolean_t	vdev_ishole;	/* is a hole in the namespace	*/
 	kmutex_t	vdev_queue_lock; /* protects vdev_queue_depth	*/
@@ -196,6 +217,23 @@ struct vdev {
 	uint64_t	vdev_async_write_queue_depth;
 	uint64_t	vdev_max_async_write_queue_depth;
 
+	/* pending scrub/resilver I/O sorted by offset, see dsl_scan.c */
+	struct dsl_scan_io_queue *vdev_scan_io_queue;
+
+	/* automatic TRIM of freed space, see vdev_trim.c */
+	kthread_t	*vdev_autotrim_thread;
+	boolean_t	vdev_autotrim_exit_wanted;
+
+	/*
+	 * Removed top-level vdevs, see vdev_indirect.c.  The mapping also
+	 * exists while the vdev is being removed.
+	 */
+	uint64_t	vdev_im_object;	/* indirect mapping object	*/
+	struct vdev_indirect_mapping *vdev_indirect_mapping;
+	uint64_t	vdev_obsolete_sm_object; /* until the below is open */
+	space_map_t	*vdev_obsolete_sm; /* freed ranges still mapped	*/
+	range_tree_t	*vdev_obsolete_segments; /* not yet in the above */
+
 	/*
 	 * Leaf vdev state.
 	 */
@@ -211,6 +249,9 @@ struct vdev {
 	uint64_t	vdev_removed;	/* persistent removed state	*/
 	uint64_t	vdev_resilver_txg; /* persistent resilvering state */
 	uint64_t	vdev_nparity;	/* number of parity devices for raidz */
+	uint64_t	vdev_rz_expanding; /* txg raidz expansion started */
+	uint64_t	*vdev_rz_widths; /* (txg, width) pairs of raidz */
+	uint_t		vdev_rz_nwidths; /* number of vdev_rz_widths pairs */
 	char		*vdev_path;	/* vdev path (if any)		*/
 	char		*vdev_devid;	/* vdev devid (if any)		*/
 	char		*vdev_physpath;	/* vdev device path (if any)	*/
@@ -236,6 +277,19 @@ struct vdev {
 	vdev_aux_t	vdev_label_aux;	/* on-disk aux state		*/
 	uint64_t	vdev_leaf_zap;
 
+	/*
+	 * On-demand TRIM state, see vdev_trim.c.
+	 */
+	boolean_t	vdev_has_trim;	/* TRIM is supported		*/
+	kthread_t	*vdev_trim_thread;
+	boolean_t	vdev_trim_exit_wanted;
+	vdev_trim_state_t vdev_trim_state;
+	uint64_t	vdev_trim_rate;	/* bytes/sec, 0 for no limit	*/
+	uint64_t	vdev_trim_next_ms; /* where a suspended trim resumes */
+	uint64_t	vdev_trim_bytes_done;
+	uint64_t	vdev_trim_bytes_est;
+	time_t		vdev_trim_action_time;
+
 	/*
 	 * For DTrace to work in userland (libzpool) context, these fields must
 	 * remain at the end of the structure.  DTrace will use the kernel's
@@ -246,6 +300,11 @@ struct vdev {
 	kmutex_t	vdev_dtl_lock;	/* vdev_dtl_{map,resilver}	*/
 	kmutex_t	vdev_stat_lock;	/* vdev_stat			*/
 	kmutex_t	vdev_probe_lock; /* protects vdev_probe_zio	*/
+	kmutex_t	vdev_scan_io_queue_lock; /* vdev_scan_io_queue	*/
+	kmutex_t	vdev_trim_lock;	/* vdev_{auto,}trim_* fields	*/
+	kcondvar_t	vdev_trim_cv;
+	krwlock_t	vdev_indirect_rwlock; /* vdev_indirect_mapping	*/
+	kmutex_t	vdev_obsolete_lock; /* vdev_obsolete_segments	*/
 
 	/*
 	 * We rate limit ZIO delay and ZIO checksum events, since they
@@ -360,14 +419,41 @@ extern vdev_ops_t vdev_file_ops;
 extern vdev_ops_t vdev_missing_ops;
 extern vdev_ops_t vdev_hole_ops;
 extern vdev_ops_t vdev_spare_ops;
+extern vdev_ops_t vdev_indirect_ops;
 
 /*
  * Common size functions
  */
-extern uint64_t vdev_default_asize(vdev_t *vd, uint64_t psize);
+extern uint64_t vdev_default_asize(vdev_t *vd, uint64_t psize,
+    uint64_t txg);
 extern uint64_t vdev_get_min_asize(vdev_t *vd);
 extern void vdev_set_min_asize(vdev_t *vd);
 
+/*
+ * Range translation functions
+ */
+extern void vdev_default_xlate(vdev_t *vd, const range_seg_t *in,
+    range_seg_t *res);
+extern void vdev_xlate(vdev_t *vd, const range_seg_t *logical_rs,
+    range_seg_t *physical_rs);
+
+/*
+ * Removed top-level vdevs, see vdev_indirect.c.  The callback of
+ * vdev_indirect_remap() is called for each range of a vdev that the
+ * given range was copied to.
+ */
+typedef void vdev_remap_cb_t(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size);
+extern int vdev_indirect_remap(vdev_t *vd, uint64_t offset, uint64_t size,
+    vdev_remap_cb_t *func, void *arg);
+extern int vdev_indirect_load(vdev_t *vd);
+extern void vdev_indirect_unload(vdev_t *vd);
+extern void vdev_indirect_mark_obsolete(vdev_t *vd, uint64_t offset,
+    uint64_t size, uint64_t txg);
+extern void vdev_indirect_sync_obsolete(vdev_t *vd, dmu_tx_t *tx);
+extern void vdev_indirect_live_ranges(vdev_t *vd, range_tree_t *live,
+    boolean_t in_core);
+
 /*
  * Global variables
  */
@@ -0,0 +1,100 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_VDEV_INDIRECT_MAPPING_H
+#define	_SYS_VDEV_INDIRECT_MAPPING_H
+
+#include <sys/dmu.h>
+#include <sys/list.h>
+#include <sys/spa.h>
+#include <sys/space_map.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * One entry of the mapping of a removed vdev: the range starting at
+ * vimep_src on the removed vdev now lives at vimep_dst.  The length of the
+ * range is the asize of vimep_dst, so an entry is only 24 bytes both on
+ * disk and in core.
+ */
+typedef struct vdev_indirect_mapping_entry_phys {
+	uint64_t	vimep_src;
+	dva_t		vimep_dst;
+} vdev_indirect_mapping_entry_phys_t;
+
+#define	DVA_MAPPING_GET_SRC_OFFSET(vimep)	((vimep)->vimep_src)
+#define	DVA_MAPPING_GET_SIZE(vimep)		DVA_GET_ASIZE(&(vimep)->vimep_dst)
+
+/*
+ * Bonus buffer of the mapping object, which holds the entries as a packed
+ * array sorted by vimep_src.
+ */
+typedef struct vdev_indirect_mapping_phys {
+	uint64_t	vimp_max_offset;	/* end of the last entry */
+	uint64_t	vimp_bytes_mapped;	/* sum of the entry sizes */
+	uint64_t	vimp_num_entries;	/* number of entries */
+} vdev_indirect_mapping_phys_t;
+
+typedef struct vdev_indirect_mapping {
+	uint64_t	vim_object;
+	objset_t	*vim_objset;
+	dmu_buf_t	*vim_dbuf;
+	vdev_indirect_mapping_phys_t *vim_phys;
+
+	/*
+	 * In-core copy of the entries.  During a removal, this also holds
+	 * the entries added in open context which are not yet synced, so
+	 * vim_entries_count may exceed vim_phys->vimp_num_entries.
+	 */
+	vdev_indirect_mapping_entry_phys_t *vim_entries;
+	uint64_t	vim_entries_count;
+	uint64_t	vim_entries_alloc;
+	uint64_t	vim_bytes_mapped;	/* of all in-core entries */
+	uint64_t	vim_max_offset;		/* of all in-core entries */
+} vdev_indirect_mapping_t;
+
+extern uint64_t vdev_indirect_mapping_alloc(objset_t *os, dmu_tx_t *tx);
+extern void vdev_indirect_mapping_free(objset_t *os, uint64_t object,
+    dmu_tx_t *tx);
+extern int vdev_indirect_mapping_open(objset_t *os, uint64_t object,
+    vdev_indirect_mapping_t **vimp);
+extern void vdev_indirect_mapping_close(vdev_indirect_mapping_t *vim);
+
+extern void vdev_indirect_mapping_add_entry(vdev_indirect_mapping_t *vim,
+    uint64_t src, const dva_t *dst);
+extern void vdev_indirect_mapping_sync(vdev_indirect_mapping_t *vim,
+    uint64_t count, dmu_tx_t *tx);
+extern uint64_t vdev_indirect_mapping_write(objset_t *os,
+    const vdev_indirect_mapping_entry_phys_t *entries, uint64_t count,
+    dmu_tx_t *tx);
+
+extern vdev_indirect_mapping_entry_phys_t *
+    vdev_indirect_mapping_entry_for_offset(vdev_indirect_mapping_t *vim,
+    uint64_t offset);
+extern uint64_t vdev_indirect_mapping_num_entries(
+    vdev_indirect_mapping_t *vim);
+extern uint64_t vdev_indirect_mapping_bytes_mapped(
+    vdev_indirect_mapping_t *vim);
+extern uint64_t vdev_indirect_mapping_max_offset(
+    vdev_indirect_mapping_t *vim);
+extern uint64_t vdev_indirect_mapping_size(vdev_indirect_mapping_t *vim);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_INDIRECT_MAPPING_H */
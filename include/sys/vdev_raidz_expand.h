@@ -0,0 +1,95 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_VDEV_RAIDZ_EXPAND_H
+#define	_SYS_VDEV_RAIDZ_EXPAND_H
+
+#include <sys/spa.h>
+#include <sys/zfs_rlock.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * State of the current or last expansion of a RAID-Z vdev, stored in the
+ * MOS object directory under DMU_POOL_RAIDZ_EXPAND.  Like pool_scan_stat_t,
+ * it is written as a uint64 array and so must only contain 64-bit fields.
+ */
+typedef struct spa_raidz_expand_phys {
+	uint64_t	rep_state;		/* dsl_scan_state_t */
+	uint64_t	rep_expanding_vdev;	/* -1 if none */
+	uint64_t	rep_start_time;
+	uint64_t	rep_end_time;
+	uint64_t	rep_to_reflow;		/* bytes that need to be moved */
+	uint64_t	rep_reflowed;		/* bytes that have been moved */
+} spa_raidz_expand_phys_t;
+
+/*
+ * In-core state of an expansion in progress.  vre_lock protects everything
+ * below it, and is acquired before the ms_lock of any metaslab.
+ */
+typedef struct vdev_raidz_expand {
+	uint64_t	vre_vdev_id;
+	kthread_t	*vre_thread;
+	boolean_t	vre_thread_exit;
+	boolean_t	vre_failed;
+	kmutex_t	vre_lock;
+	kcondvar_t	vre_cv;
+
+	/*
+	 * Held as reader by every I/O to the vdev for the sectors it covers,
+	 * and as writer by the reflow for the sectors being moved.
+	 */
+	zfs_rlock_t	vre_rangelock;
+
+	/*
+	 * Sectors of the vdev below vre_offset have been moved to their
+	 * location in the wider stripe.  Only the move of those below
+	 * vre_offset_synced is on disk, so writes between the two must also
+	 * go to the old location of the sector, which is where the reflow
+	 * resumes after a crash.
+	 */
+	uint64_t	vre_offset;
+	uint64_t	vre_offset_synced;
+
+	/*
+	 * Per-txg state, for the sync task recording progress: the value
+	 * of vre_offset at the end of each txg and the bytes moved.
+	 */
+	uint64_t	vre_offset_pending[TXG_SIZE];
+	uint64_t	vre_bytes_done[TXG_SIZE];
+	uint64_t	vre_last_txg;
+} vdev_raidz_expand_t;
+
+extern uint64_t vdev_raidz_logical_width(vdev_t *vd, uint64_t txg);
+extern struct rl *vdev_raidz_expand_lock(vdev_t *vd, uint64_t offset,
+    uint64_t size, uint64_t *synced, uint64_t *reflowed);
+extern int vdev_raidz_attach(vdev_t *vd, vdev_t *newvd, uint64_t txg);
+
+extern void spa_raidz_expand_load(spa_t *spa);
+extern int spa_raidz_expand_init(spa_t *spa);
+extern void spa_restart_raidz_expand(spa_t *spa);
+extern void spa_raidz_expand_suspend(spa_t *spa);
+extern void spa_raidz_expand_complete(spa_t *spa);
+extern void vdev_raidz_expand_destroy(vdev_raidz_expand_t *vre);
+
+extern int zfs_raidz_expand_max_copy_bytes;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_RAIDZ_EXPAND_H */
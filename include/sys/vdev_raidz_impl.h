@@ -110,6 +110,8 @@ typedef struct raidz_col {
 	int rc_error;			/* I/O error for this device */
 	unsigned int rc_tried;		/* Did we attempt this I/O column? */
 	unsigned int rc_skipped;	/* Did we skip this I/O column? */
+	size_t rc_shadow_devidx;	/* old location of reflowed sector */
+	size_t rc_shadow_offset;	/* (SIZE_MAX devidx if none) */
 } raidz_col_t;
 
 typedef struct raidz_map {
@@ -127,6 +129,9 @@ typedef struct raidz_map {
 	unsigned int rm_freed;		/* map no longer has referencing ZIO */
 	unsigned int rm_ecksuminjected;	/* checksum error was injected */
 	raidz_impl_ops_t *rm_ops;	/* RAIDZ math operations */
+	struct raidz_map **rm_row;	/* per-sector rows of an expanded */
+	size_t rm_nrows;		/*   raidz, see vdev_raidz_expand.c */
+	struct rl *rm_lr;		/* range lock against reflow */
 	raidz_col_t rm_col[1];		/* Flexible array of I/O columns */
 } raidz_map_t;
 
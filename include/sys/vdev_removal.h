@@ -0,0 +1,92 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef _SYS_VDEV_REMOVAL_H
+#define	_SYS_VDEV_REMOVAL_H
+
+#include <sys/spa.h>
+#include <sys/range_tree.h>
+#include <sys/vdev_indirect_mapping.h>
+
+#ifdef	__cplusplus
+extern "C" {
+#endif
+
+/*
+ * State of the current or last removal of a top-level vdev, stored in the
+ * MOS object directory under DMU_POOL_REMOVING.  Like pool_scan_stat_t, it
+ * is written as a uint64 array and so must only contain 64-bit fields.
+ */
+typedef struct spa_removing_phys {
+	uint64_t	sr_state;		/* dsl_scan_state_t */
+	uint64_t	sr_removing_vdev;	/* -1 if none */
+	uint64_t	sr_start_time;
+	uint64_t	sr_end_time;
+	uint64_t	sr_to_copy;		/* bytes that need to be copied */
+	uint64_t	sr_copied;		/* bytes that have been copied */
+} spa_removing_phys_t;
+
+/*
+ * In-core state of a removal in progress.  svr_lock protects everything
+ * below it, and is acquired before the ms_lock of any metaslab.
+ */
+typedef struct spa_vdev_removal {
+	uint64_t	svr_vdev_id;
+	kthread_t	*svr_thread;
+	boolean_t	svr_thread_exit;
+	kmutex_t	svr_lock;
+	kcondvar_t	svr_cv;
+
+	/*
+	 * Every allocated range of the vdev below svr_max_offset has been
+	 * copied and has an entry in the vdev's indirect mapping.
+	 */
+	uint64_t	svr_max_offset;
+
+	/* allocated ranges of the current metaslab still to be copied */
+	range_tree_t	*svr_allocd_segs;
+
+	/* copies issued but not yet written */
+	uint64_t	svr_bytes_inflight;
+	uint64_t	svr_copy_errors;
+
+	/*
+	 * Per-txg state, for the sync task writing out the mapping: the
+	 * number of entries and the end of the last range copied in each
+	 * txg, and the bytes copied.
+	 */
+	uint64_t	svr_entries_to_sync[TXG_SIZE];
+	uint64_t	svr_max_offset_to_sync[TXG_SIZE];
+	uint64_t	svr_bytes_done[TXG_SIZE];
+} spa_vdev_removal_t;
+
+extern int spa_remove_init(spa_t *spa);
+extern void spa_restart_removal(spa_t *spa);
+extern int spa_vdev_remove_top(vdev_t *vd, uint64_t *txg);
+extern boolean_t spa_vdev_remove_copyable(vdev_t *vd, vdev_t *tvd);
+extern void spa_vdev_remove_suspend(spa_t *spa);
+extern void spa_vdev_remove_complete(spa_t *spa);
+extern void spa_vdev_removal_destroy(spa_vdev_removal_t *svr);
+extern void free_from_removing_vdev(vdev_t *vd, uint64_t offset,
+    uint64_t size, uint64_t txg);
+
+extern int zfs_remove_max_copy_bytes;
+extern int zfs_remove_max_segment;
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _SYS_VDEV_REMOVAL_H */
@@ -603,11 +603,21 @@ typedef struct vsecattr {
 
 extern int fop_getattr(vnode_t *vp, vattr_t *vap);
 
+#ifndef F_FREESP
+#define	F_FREESP	11
+#endif
+
+typedef struct flock64 flock64_t;
+
+extern int fop_space(vnode_t *vp, int cmd, flock64_t *flck);
+
 #define	VOP_CLOSE(vp, f, c, o, cr, ct)	vn_close(vp)
 #define	VOP_PUTPAGE(vp, of, sz, fl, cr, ct)	0
 #define	VOP_GETATTR(vp, vap, fl, cr, ct)  fop_getattr((vp), (vap));
 
 #define	VOP_FSYNC(vp, f, cr, ct)	fsync((vp)->v_fd)
+#define	VOP_SPACE(vp, cmd, flck, fl, off, cr, ct) \
+	fop_space((vp), (cmd), (flck))
 
 #define	VN_RELE(vp)	vn_close(vp)
 
@@ -131,6 +131,7 @@ typedef enum zil_create {
 /*
  * Intent log transaction types and record structures
  */
+#define	TX_COMMIT		0	/* Commit marker (not on disk) */
 #define	TX_CREATE		1	/* Create file */
 #define	TX_MKDIR		2	/* Make directory */
 #define	TX_MKXATTR		3	/* Make XATTR directory */
@@ -402,9 +403,9 @@ typedef struct zil_stats {
 	kstat_named_t zil_commit_count;
 
 	/*
-	 * Number of times the ZIL has been flushed to stable storage.
-	 * This is less than zil_commit_count when commits are "merged"
-	 * (see the documentation above zil_commit()).
+	 * Number of times a committing thread copied pending itxs into log
+	 * blocks and issued them.  This is less than zil_commit_count when
+	 * commits are "merged" (see the documentation above zil_commit()).
 	 */
 	kstat_named_t zil_commit_writer_count;
 
@@ -35,6 +35,22 @@
 extern "C" {
 #endif
 
+/*
+ * Possible states of a log write buffer.  An lwb is CLOSED until the first
+ * record is copied into it, OPENED while the writer fills it, ISSUED once
+ * its write has been started, WRITE_DONE once the write completed but the
+ * vdev flushes that make it stable have not, and DONE after that.  Several
+ * lwbs can be ISSUED at the same time; each one's root zio depends on the
+ * root zio of the lwb issued before it, so they become DONE in log order.
+ */
+typedef enum {
+	LWB_STATE_CLOSED,
+	LWB_STATE_OPENED,
+	LWB_STATE_ISSUED,
+	LWB_STATE_WRITE_DONE,
+	LWB_STATE_DONE
+} lwb_state_t;
+
 /*
  * Log write buffer.
  */
@@ -42,15 +58,33 @@ typedef struct lwb {
 	zilog_t		*lwb_zilog;	/* back pointer to log struct */
 	blkptr_t	lwb_blk;	/* on disk address of this log blk */
 	boolean_t	lwb_fastwrite;	/* is blk marked for fastwrite? */
+	lwb_state_t	lwb_state;	/* see above, protected by zl_lock */
 	int		lwb_nused;	/* # used bytes in buffer */
 	int		lwb_sz;		/* size of block and buffer */
 	char		*lwb_buf;	/* log write buffer */
 	zio_t		*lwb_zio;	/* zio for this buffer */
+	zio_t		*lwb_root_zio;	/* write and vdev flushes */
 	dmu_tx_t	*lwb_tx;	/* tx for log block allocation */
 	uint64_t	lwb_max_txg;	/* highest txg in this lwb */
+	uint64_t	lwb_max_lr_seq;	/* highest lr seq in this lwb */
 	list_node_t	lwb_node;	/* zilog->zl_lwb_list linkage */
+	list_t		lwb_itxs;	/* itxs to clean up once stable */
+	list_t		lwb_waiters;	/* zil_commit_waiter_t to wake */
 } lwb_t;
 
+/*
+ * A zil_commit() caller sleeps on one of these until the lwb holding its
+ * commit itx, and so every itx assigned before it, is on stable storage.
+ */
+typedef struct zil_commit_waiter {
+	kmutex_t	zcw_lock;	/* protects the fields below */
+	kcondvar_t	zcw_cv;		/* signalled when zcw_done is set */
+	list_node_t	zcw_node;	/* lwb_waiters linkage */
+	lwb_t		*zcw_lwb;	/* lwb this waiter is attached to */
+	boolean_t	zcw_done;	/* itxs are on stable storage */
+	int		zcw_zio_error;	/* error writing the lwb */
+} zil_commit_waiter_t;
+
 /*
  * Intent log transaction lists
  */
@@ -74,8 +108,9 @@ typedef struct itx_async_node {
 } itx_async_node_t;
 
 /*
- * Vdev flushing: during a zil_commit(), we build up an AVL tree of the vdevs
- * we've touched so we know which ones need a write cache flush at the end.
+ * Vdev flushing: as log blocks and dmu_sync() blocks are written we build up
+ * an AVL tree of the vdevs they touched.  When an lwb write completes it
+ * takes the tree and flushes those vdevs before it is considered stable.
  */
 typedef struct zil_vdev_node {
 	uint64_t	zv_vdev;	/* vdev to be flushed */
@@ -84,6 +119,13 @@ typedef struct zil_vdev_node {
 
 #define	ZIL_PREV_BLKS 16
 
+/*
+ * Commit latency histogram of a dataset: bucket i counts the zil_commit()
+ * calls that took [2^i, 2^(i+1)) microseconds, the last one everything
+ * slower.
+ */
+#define	ZIL_COMMIT_LAT_BUCKETS	25
+
 /*
  * Stable storage intent log management structure.  One per dataset.
  */
@@ -94,20 +136,17 @@ struct zilog {
 	const zil_header_t *zl_header;	/* log header buffer */
 	objset_t	*zl_os;		/* object set we're logging */
 	zil_get_data_t	*zl_get_data;	/* callback to get object content */
-	zio_t		*zl_root_zio;	/* log writer root zio */
 	uint64_t	zl_lr_seq;	/* on-disk log record sequence number */
 	uint64_t	zl_commit_lr_seq; /* last committed on-disk lr seq */
 	uint64_t	zl_destroy_txg;	/* txg of last zil_destroy() */
 	uint64_t	zl_replayed_seq[TXG_SIZE]; /* last replayed rec seq */
 	uint64_t	zl_replaying_seq; /* current replay seq number */
 	uint32_t	zl_suspend;	/* log suspend count */
-	kcondvar_t	zl_cv_writer;	/* log writer thread completion */
 	kcondvar_t	zl_cv_suspend;	/* log suspend completion */
 	uint8_t		zl_suspending;	/* log is currently suspending */
 	uint8_t		zl_keep_first;	/* keep first log block in destroy */
 	uint8_t		zl_replay;	/* replaying records while set */
 	uint8_t		zl_stop_sync;	/* for debugging */
-	uint8_t		zl_writer;	/* boolean: write setup in progress */
 	uint8_t		zl_logbias;	/* latency or throughput */
 	uint8_t		zl_sync;	/* synchronous or asynchronous */
 	int		zl_parse_error;	/* last zil_parse() error */
@@ -115,16 +154,19 @@ struct zilog {
 	uint64_t	zl_parse_lr_seq; /* highest lr seq on last parse */
 	uint64_t	zl_parse_blk_count; /* number of blocks parsed */
 	uint64_t	zl_parse_lr_count; /* number of log records parsed */
-	uint64_t	zl_next_batch;	/* next batch number */
-	uint64_t	zl_com_batch;	/* committed batch number */
-	kcondvar_t	zl_cv_batch[2];	/* batch condition variables */
+	kmutex_t	zl_writer_lock;	/* serializes lwb filling and issue */
 	itxg_t		zl_itxg[TXG_SIZE]; /* intent log txg chains */
 	list_t		zl_itx_commit_list; /* itx list to be committed */
 	uint64_t	zl_itx_list_sz;	/* total size of records on list */
 	uint64_t	zl_cur_used;	/* current commit log size used */
+	uint64_t	zl_dirty_max_txg; /* highest txg used to dirty zilog */
 	list_t		zl_lwb_list;	/* in-flight log write list */
+	lwb_t		*zl_last_lwb_issued; /* most recently issued lwb */
+	uint64_t	zl_lwb_inflight; /* issued lwbs not yet DONE */
+	kcondvar_t	zl_cv_lwb_done;	/* signalled when lwbs become DONE */
+	int		zl_lwb_error;	/* first lwb write error of chain */
 	kmutex_t	zl_vdev_lock;	/* protects zl_vdev_tree */
-	avl_tree_t	zl_vdev_tree;	/* vdevs to flush in zil_commit() */
+	avl_tree_t	zl_vdev_tree;	/* vdevs to flush after lwb write */
 	taskq_t		*zl_clean_taskq; /* runs lwb and itx clean tasks */
 	avl_tree_t	zl_bp_tree;	/* track bps during log parse */
 	clock_t		zl_replay_time;	/* lbolt of when replay started */
@@ -133,6 +175,10 @@ struct zilog {
 	uint_t		zl_prev_blks[ZIL_PREV_BLKS]; /* size - sector rounded */
 	uint_t		zl_prev_rotor;	/* rotor for zl_prev[] */
 	txg_node_t	zl_dirty_link;	/* protected by dp_dirty_zilogs list */
+	kstat_t		*zl_ksp;	/* per-dataset commit statistics */
+	uint64_t	zl_commit_count; /* zil_commit() calls */
+	uint64_t	zl_lwb_count;	/* lwbs issued */
+	uint64_t	zl_commit_lat[ZIL_COMMIT_LAT_BUCKETS];
 };
 
 typedef struct zil_bp_node {
@@ -318,6 +318,7 @@ typedef struct zio_prop {
 	boolean_t		zp_dedup_verify;
 	boolean_t		zp_nopwrite;
 	boolean_t		zp_encrypt;
+	uint32_t		zp_zpl_smallblk;
 	uint8_t			zp_salt[DATA_SALT_LEN];
 	uint8_t			zp_iv[DATA_IV_LEN];
 	uint8_t			zp_mac[DATA_MAC_LEN];
@@ -410,6 +411,7 @@ struct zio {
 	blkptr_t	*io_bp;
 	blkptr_t	*io_bp_override;
 	blkptr_t	io_bp_copy;
+	struct metaslab_class *io_metaslab_class;	/* dva throttle class */
 	list_t		io_parent_list;
 	list_t		io_child_list;
 	zio_t		*io_logical;
@@ -513,6 +515,10 @@ extern zio_t *zio_claim(zio_t *pio, spa_t *spa, uint64_t txg,
 extern zio_t *zio_ioctl(zio_t *pio, spa_t *spa, vdev_t *vd, int cmd,
     zio_done_func_t *done, void *private, enum zio_flag flags);
 
+extern zio_t *zio_trim(zio_t *pio, vdev_t *vd, uint64_t offset, uint64_t size,
+    zio_done_func_t *done, void *private, zio_priority_t priority,
+    enum zio_flag flags);
+
 extern zio_t *zio_read_phys(zio_t *pio, vdev_t *vd, uint64_t offset,
     uint64_t size, struct abd *data, int checksum,
     zio_done_func_t *done, void *private, zio_priority_t priority,
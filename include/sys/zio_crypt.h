@@ -137,6 +137,18 @@ typedef struct zio_crypt_key {
 	/* template of hmac key for illumos crypto api */
 	crypto_ctx_template_t zk_hmac_tmpl;
 
+	/* salt of the last key derived for a block with an older salt */
+	uint8_t zk_prev_salt[DATA_SALT_LEN];
+
+	/* buffer for the key derived from zk_prev_salt */
+	uint8_t zk_prev_keydata[MAX_MASTER_KEY_LEN];
+
+	/* illumos crypto api key derived from zk_prev_salt */
+	crypto_key_t zk_prev_key;
+
+	/* template of zk_prev_key, NULL if no key is cached */
+	crypto_ctx_template_t zk_prev_tmpl;
+
 	/* lock for changing the salt and dependant values */
 	krwlock_t zk_salt_lock;
 } zio_crypt_key_t;
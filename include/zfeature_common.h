@@ -56,6 +56,12 @@ typedef enum spa_feature {
 	SPA_FEATURE_EDONR,
 	SPA_FEATURE_USEROBJ_ACCOUNTING,
 	SPA_FEATURE_ENCRYPTION,
+	SPA_FEATURE_ZSTD_COMPRESS,
+	SPA_FEATURE_ALLOCATION_CLASSES,
+	SPA_FEATURE_DEVICE_REMOVAL,
+	SPA_FEATURE_RAIDZ_EXPANSION,
+	SPA_FEATURE_LOG_SPACEMAP,
+	SPA_FEATURE_DDT_LOG,
 	SPA_FEATURES
 } spa_feature_t;
 
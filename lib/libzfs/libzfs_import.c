@@ -895,8 +895,9 @@ get_configs(libzfs_handle_t *hdl, pool_list_t *pl, boolean_t active_ok)
 	uint64_t guid;
 	uint_t children = 0;
 	nvlist_t **child = NULL;
-	uint_t holes;
+	uint_t holes, nindirect = 0;
 	uint64_t *hole_array, max_id;
+	nvlist_t **indirect = NULL;
 	uint_t c;
 	boolean_t isactive;
 	uint64_t hostid;
@@ -951,6 +952,8 @@ get_configs(libzfs_handle_t *hdl, pool_list_t *pl, boolean_t active_ok)
 				max_txg = best_txg;
 				hole_array = NULL;
 				holes = 0;
+				indirect = NULL;
+				nindirect = 0;
 				max_id = 0;
 				valid_top_config = B_FALSE;
 
@@ -969,6 +972,10 @@ get_configs(libzfs_handle_t *hdl, pool_list_t *pl, boolean_t active_ok)
 					    ZPOOL_CONFIG_HOLE_ARRAY,
 					    hole_array, holes) == 0);
 				}
+
+				(void) nvlist_lookup_nvlist_array(tmp,
+				    ZPOOL_CONFIG_INDIRECT_VDEVS, &indirect,
+				    &nindirect);
 			}
 
 			if (!config_seen) {
@@ -1122,6 +1129,21 @@ get_configs(libzfs_handle_t *hdl, pool_list_t *pl, boolean_t active_ok)
 			}
 		}
 
+		/*
+		 * Removed vdevs have no labels; their configs are recorded
+		 * in the labels of the other top-level vdevs.
+		 */
+		for (c = 0; c < nindirect; c++) {
+			uint64_t id;
+
+			if (nvlist_lookup_uint64(indirect[c],
+			    ZPOOL_CONFIG_ID, &id) != 0 || id >= children ||
+			    child[id] != NULL)
+				continue;
+			if (nvlist_dup(indirect[c], &child[id], 0) != 0)
+				goto nomem;
+		}
+
 		/*
 		 * Look for any missing top-level vdevs.  If this is the case,
 		 * create a faked up 'missing' vdev as a placeholder.  We cannot
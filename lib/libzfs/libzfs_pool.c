@@ -2247,6 +2247,111 @@ zpool_find_vdev(zpool_handle_t *zhp, const char *path, boolean_t *avail_spare,
 	return (ret);
 }
 
+/*
+ * Start, cancel or suspend the TRIM of the leaf vdevs named in vds.
+ */
+int
+zpool_trim(zpool_handle_t *zhp, pool_trim_func_t cmd_type, nvlist_t *vds,
+    uint64_t rate)
+{
+	char msg[1024];
+	libzfs_handle_t *hdl = zhp->zpool_hdl;
+	nvlist_t *vdev_guids, *errlist = NULL, *vd_errlist;
+	nvpair_t *elem;
+	const char *action;
+	int err;
+
+	switch (cmd_type) {
+	case POOL_TRIM_START:
+		action = dgettext(TEXT_DOMAIN, "cannot trim");
+		break;
+	case POOL_TRIM_CANCEL:
+		action = dgettext(TEXT_DOMAIN, "cannot cancel trimming");
+		break;
+	case POOL_TRIM_SUSPEND:
+		action = dgettext(TEXT_DOMAIN, "cannot suspend trimming");
+		break;
+	default:
+		assert(!"unexpected trim command");
+		return (-1);
+	}
+
+	vdev_guids = fnvlist_alloc();
+	for (elem = nvlist_next_nvpair(vds, NULL); elem != NULL;
+	    elem = nvlist_next_nvpair(vds, elem)) {
+		boolean_t spare, cache;
+		char *vd_path = nvpair_name(elem);
+		nvlist_t *tgt;
+
+		(void) snprintf(msg, sizeof (msg), "%s '%s'", action, vd_path);
+
+		tgt = zpool_find_vdev(zhp, vd_path, &spare, &cache, NULL);
+		if (tgt == NULL) {
+			fnvlist_free(vdev_guids);
+			return (zfs_error(hdl, EZFS_NODEVICE, msg));
+		} else if (spare) {
+			fnvlist_free(vdev_guids);
+			return (zfs_error(hdl, EZFS_ISSPARE, msg));
+		} else if (cache) {
+			fnvlist_free(vdev_guids);
+			return (zfs_error(hdl, EZFS_ISL2CACHE, msg));
+		}
+
+		fnvlist_add_uint64(vdev_guids, vd_path,
+		    fnvlist_lookup_uint64(tgt, ZPOOL_CONFIG_GUID));
+	}
+
+	err = lzc_trim(zhp->zpool_name, cmd_type, rate, vdev_guids, &errlist);
+	fnvlist_free(vdev_guids);
+
+	if (err == 0) {
+		nvlist_free(errlist);
+		return (0);
+	}
+
+	if (errlist == NULL || nvlist_lookup_nvlist(errlist,
+	    ZPOOL_TRIM_VDEVS, &vd_errlist) != 0) {
+		nvlist_free(errlist);
+		(void) snprintf(msg, sizeof (msg), "%s '%s'", action,
+		    zhp->zpool_name);
+		return (zpool_standard_error(hdl, err, msg));
+	}
+
+	for (elem = nvlist_next_nvpair(vd_errlist, NULL); elem != NULL;
+	    elem = nvlist_next_nvpair(vd_errlist, elem)) {
+		int vd_error = (int)fnvpair_value_int64(elem);
+
+		(void) snprintf(msg, sizeof (msg), "%s '%s'", action,
+		    nvpair_name(elem));
+
+		switch (vd_error) {
+		case EBUSY:
+			(void) zfs_error(hdl, EZFS_TRIMMING, msg);
+			break;
+		case ESRCH:
+			(void) zfs_error(hdl, EZFS_NO_TRIM, msg);
+			break;
+		case ENOTSUP:
+			(void) zfs_error(hdl, EZFS_TRIM_NOTSUP, msg);
+			break;
+		case ENODEV:
+			(void) zfs_error(hdl, EZFS_NODEVICE, msg);
+			break;
+		case EINVAL:
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "only leaf vdevs of the pool can be trimmed"));
+			(void) zfs_error(hdl, EZFS_BADDEV, msg);
+			break;
+		default:
+			(void) zpool_standard_error(hdl, vd_error, msg);
+			break;
+		}
+	}
+	nvlist_free(errlist);
+
+	return (-1);
+}
+
 static int
 vdev_online(nvlist_t *nv)
 {
@@ -2666,9 +2771,9 @@ zpool_vdev_attach(zpool_handle_t *zhp,
 	char msg[1024];
 	int ret;
 	nvlist_t *tgt;
-	boolean_t avail_spare, l2cache, islog;
+	boolean_t avail_spare, l2cache, islog, israidz;
 	uint64_t val;
-	char *newname;
+	char *newname, *type;
 	nvlist_t **child;
 	uint_t children;
 	nvlist_t *config_root;
@@ -2708,6 +2813,10 @@ zpool_vdev_attach(zpool_handle_t *zhp,
 	verify(nvlist_lookup_uint64(tgt, ZPOOL_CONFIG_GUID, &zc.zc_guid) == 0);
 	zc.zc_cookie = replacing;
 
+	/* attaching to a raidz vdev expands it */
+	israidz = (nvlist_lookup_string(tgt, ZPOOL_CONFIG_TYPE, &type) == 0 &&
+	    strcmp(type, VDEV_TYPE_RAIDZ) == 0);
+
 	if (nvlist_lookup_nvlist_array(nvroot, ZPOOL_CONFIG_CHILDREN,
 	    &child, &children) != 0 || children != 1) {
 		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
@@ -2777,10 +2886,14 @@ zpool_vdev_attach(zpool_handle_t *zhp,
 			else
 				zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
 				    "cannot replace a replacing device"));
+		} else if (israidz) {
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "the raidz_expansion feature must be enabled "
+			    "to attach to a raidz vdev"));
 		} else {
 			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
-			    "can only attach to mirrors and top-level "
-			    "disks"));
+			    "can only attach to mirrors, raidz vdevs and "
+			    "top-level disks"));
 		}
 		(void) zfs_error(hdl, EZFS_BADTARGET, msg);
 		break;
@@ -2795,8 +2908,13 @@ zpool_vdev_attach(zpool_handle_t *zhp,
 		break;
 
 	case EBUSY:
-		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN, "%s is busy"),
-		    new_disk);
+		if (israidz) {
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "%s is already being expanded"), old_disk);
+		} else {
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "%s is busy"), new_disk);
+		}
 		(void) zfs_error(hdl, EZFS_BADDEV, msg);
 		break;
 
@@ -3139,8 +3257,9 @@ out:
 }
 
 /*
- * Remove the given device.  Currently, this is supported only for hot spares,
- * cache, and log devices.
+ * Remove the given device.  Hot spares, cache and log devices are removed
+ * right away.  The data of a top-level vdev is copied to the other vdevs of
+ * the pool first, which continues in the background.
  */
 int
 zpool_vdev_remove(zpool_handle_t *zhp, const char *path)
@@ -3159,15 +3278,6 @@ zpool_vdev_remove(zpool_handle_t *zhp, const char *path)
 	if ((tgt = zpool_find_vdev(zhp, path, &avail_spare, &l2cache,
 	    &islog)) == 0)
 		return (zfs_error(hdl, EZFS_NODEVICE, msg));
-	/*
-	 * XXX - this should just go away.
-	 */
-	if (!avail_spare && !l2cache && !islog) {
-		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
-		    "only inactive hot spares, cache, "
-		    "or log devices can be removed"));
-		return (zfs_error(hdl, EZFS_NODEVICE, msg));
-	}
 
 	version = zpool_get_prop_int(zhp, ZPOOL_PROP_VERSION, NULL);
 	if (islog && version < SPA_VERSION_HOLES) {
@@ -3181,6 +3291,62 @@ zpool_vdev_remove(zpool_handle_t *zhp, const char *path)
 	if (zfs_ioctl(hdl, ZFS_IOC_VDEV_REMOVE, &zc) == 0)
 		return (0);
 
+	switch (errno) {
+	case ENOTSUP:
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "only inactive hot spares, cache, log, or top-level "
+		    "devices can be removed, and the latter require the "
+		    "device_removal feature"));
+		return (zfs_error(hdl, EZFS_NODEVICE, msg));
+
+	case EINVAL:
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "invalid config; all top-level vdevs must have the same "
+		    "sector size and not be raidz"));
+		return (zfs_error(hdl, EZFS_INVALCONFIG, msg));
+
+	case EBUSY:
+		if (!avail_spare) {
+			zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+			    "a removal is already in progress"));
+		}
+		return (zfs_error(hdl, EZFS_BUSY, msg));
+
+	case ENOSPC:
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "the other devices are too full to hold its data"));
+		return (zfs_error(hdl, EZFS_NOSPC, msg));
+
+	default:
+		return (zpool_standard_error(hdl, errno, msg));
+	}
+}
+
+/*
+ * Stop and cancel the removal of a top-level vdev in progress.
+ */
+int
+zpool_vdev_remove_cancel(zpool_handle_t *zhp)
+{
+	zfs_cmd_t zc = {"\0"};
+	char msg[1024];
+	libzfs_handle_t *hdl = zhp->zpool_hdl;
+
+	(void) snprintf(msg, sizeof (msg),
+	    dgettext(TEXT_DOMAIN, "cannot cancel removal"));
+
+	(void) strlcpy(zc.zc_name, zhp->zpool_name, sizeof (zc.zc_name));
+	zc.zc_cookie = 1;
+
+	if (zfs_ioctl(hdl, ZFS_IOC_VDEV_REMOVE, &zc) == 0)
+		return (0);
+
+	if (errno == ENOENT) {
+		zfs_error_aux(hdl, dgettext(TEXT_DOMAIN,
+		    "no removal in progress"));
+		return (zfs_error(hdl, EZFS_NOENT, msg));
+	}
+
 	return (zpool_standard_error(hdl, errno, msg));
 }
 
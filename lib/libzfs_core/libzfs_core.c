@@ -954,3 +954,24 @@ lzc_key(const char *fsname, uint64_t crypto_cmd, nvlist_t *args,
 	nvlist_free(ioc_args);
 	return (error);
 }
+
+/*
+ * Starts, cancels or suspends the TRIM of the given leaf vdevs of a pool.
+ *
+ * The vdevs nvlist maps each vdev name to its guid.  If some of the vdevs
+ * failed, *errlist is set to an nvlist whose ZPOOL_TRIM_VDEVS entry maps
+ * their names to the errno of the failure.
+ */
+int
+lzc_trim(const char *poolname, pool_trim_func_t cmd_type, uint64_t rate,
+    nvlist_t *vdevs, nvlist_t **errlist)
+{
+	int error;
+	nvlist_t *args = fnvlist_alloc();
+	fnvlist_add_uint64(args, ZPOOL_TRIM_COMMAND, (uint64_t)cmd_type);
+	fnvlist_add_nvlist(args, ZPOOL_TRIM_VDEVS, vdevs);
+	fnvlist_add_uint64(args, ZPOOL_TRIM_RATE, rate);
+	error = lzc_ioctl(ZFS_IOC_POOL_TRIM, poolname, args, errlist);
+	nvlist_free(args);
+	return (error);
+}
@@ -816,6 +816,27 @@ fop_getattr(vnode_t *vp, vattr_t *vap)
 	return (0);
 }
 
+/*
+ * Only F_FREESP is supported, which is implemented by punching a hole
+ * in the file.  It's used to TRIM file vdevs.
+ */
+int
+fop_space(vnode_t *vp, int cmd, flock64_t *flck)
+{
+	if (cmd != F_FREESP || flck->l_whence != 0)
+		return (EOPNOTSUPP);
+
+#if defined(FALLOC_FL_PUNCH_HOLE) && defined(FALLOC_FL_KEEP_SIZE)
+	if (fallocate(vp->v_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+	    flck->l_start, flck->l_len) == -1)
+		return (errno);
+
+	return (0);
+#else
+	return (EOPNOTSUPP);
+#endif
+}
+
 /*
  * =========================================================================
  * Figure out which debugging statements to print
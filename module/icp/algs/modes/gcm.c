@@ -27,28 +27,40 @@
 #include <sys/crypto/common.h>
 #include <sys/crypto/impl.h>
 #include <sys/byteorder.h>
+#include <modes/gcm_impl.h>
+#include <aes/aes_impl.h>
 
-#ifdef __amd64
-
-#ifdef _KERNEL
-/* Workaround for no XMM kernel thread save/restore */
-#define	KPREEMPT_DISABLE	kpreempt_disable()
-#define	KPREEMPT_ENABLE		kpreempt_enable()
-
-#else
-#define	KPREEMPT_DISABLE
-#define	KPREEMPT_ENABLE
-#endif	/* _KERNEL */
-
-extern void gcm_mul_pclmulqdq(uint64_t *x_in, uint64_t *y, uint64_t *res);
-static int intel_pclmulqdq_instruction_present(void);
-#endif	/* __amd64 */
+#if defined(__amd64)
+#include <linux/simd_x86.h>
+#endif
 
 struct aes_block {
 	uint64_t a;
 	uint64_t b;
 };
 
+/*
+ * Save the FPU state for the duration of a GCM call, if the implementation
+ * needs it.  All multiplies and single pass runs of the call are made with
+ * the implementation passed here.
+ */
+static inline void
+gcm_fpu_begin(const gcm_ops_t *ops)
+{
+#if defined(__amd64)
+	if (ops->fpu)
+		kfpu_begin();
+#endif
+}
+
+static inline void
+gcm_fpu_end(const gcm_ops_t *ops)
+{
+#if defined(__amd64)
+	if (ops->fpu)
+		kfpu_end();
+#endif
+}
 
 /*
  * gcm_mul()
@@ -63,48 +75,109 @@ struct aes_block {
 void
 gcm_mul(uint64_t *x_in, uint64_t *y, uint64_t *res)
 {
-#ifdef __amd64
-	if (intel_pclmulqdq_instruction_present()) {
-		KPREEMPT_DISABLE;
-		gcm_mul_pclmulqdq(x_in, y, res);
-		KPREEMPT_ENABLE;
-	} else
-#endif	/* __amd64 */
-	{
-		static const uint64_t R = 0xe100000000000000ULL;
-		struct aes_block z = {0, 0};
-		struct aes_block v;
-		uint64_t x;
-		int i, j;
-
-		v.a = ntohll(y[0]);
-		v.b = ntohll(y[1]);
-
-		for (j = 0; j < 2; j++) {
-			x = ntohll(x_in[j]);
-			for (i = 0; i < 64; i++, x <<= 1) {
-				if (x & 0x8000000000000000ULL) {
-					z.a ^= v.a;
-					z.b ^= v.b;
-				}
-				if (v.b & 1ULL) {
-					v.b = (v.a << 63)|(v.b >> 1);
-					v.a = (v.a >> 1) ^ R;
-				} else {
-					v.b = (v.a << 63)|(v.b >> 1);
-					v.a = v.a >> 1;
-				}
+	const gcm_ops_t *ops = gcm_impl_get();
+
+	gcm_fpu_begin(ops);
+	ops->mul(x_in, y, res);
+	gcm_fpu_end(ops);
+}
+
+static void
+gcm_generic_mul(uint64_t *x_in, uint64_t *y, uint64_t *res)
+{
+	static const uint64_t R = 0xe100000000000000ULL;
+	struct aes_block z = {0, 0};
+	struct aes_block v;
+	uint64_t x;
+	int i, j;
+
+	v.a = ntohll(y[0]);
+	v.b = ntohll(y[1]);
+
+	for (j = 0; j < 2; j++) {
+		x = ntohll(x_in[j]);
+		for (i = 0; i < 64; i++, x <<= 1) {
+			if (x & 0x8000000000000000ULL) {
+				z.a ^= v.a;
+				z.b ^= v.b;
+			}
+			if (v.b & 1ULL) {
+				v.b = (v.a << 63)|(v.b >> 1);
+				v.a = (v.a >> 1) ^ R;
+			} else {
+				v.b = (v.a << 63)|(v.b >> 1);
+				v.a = v.a >> 1;
 			}
 		}
-		res[0] = htonll(z.a);
-		res[1] = htonll(z.b);
 	}
+	res[0] = htonll(z.a);
+	res[1] = htonll(z.b);
 }
 
+static boolean_t
+gcm_generic_valid(void)
+{
+	return (B_TRUE);
+}
+
+const gcm_ops_t gcm_generic_ops = {
+	.mul = gcm_generic_mul,
+	.crypt_blocks = NULL,
+	.valid = gcm_generic_valid,
+	.fpu = B_FALSE,
+	.name = "generic"
+};
+
+/*
+ * Returns the implementation's single pass routine, if it has one and the
+ * block cipher is AES.  Only whole runs of GCM_CRYPT_BLOCKS_MIN bytes are
+ * handed to it.
+ */
+#define	GCM_CRYPT_BLOCKS_MIN	(4 * AES_BLOCK_LEN)
+
+static gcm_crypt_blocks_f
+gcm_crypt_blocks_get(const gcm_ops_t *ops,
+    int (*encrypt_block)(const void *, const uint8_t *, uint8_t *))
+{
+	if (encrypt_block != aes_encrypt_block)
+		return (NULL);
+
+	return (ops->crypt_blocks);
+}
+
+/*
+ * Bytes left in the output buffer's current segment, which starts at *outp.
+ */
+static size_t
+gcm_out_contig(crypto_data_t *out, void *iov_or_mp, offset_t offset,
+    uint8_t **outp)
+{
+	iovec_t *iov;
+
+	switch (out->cd_format) {
+	case CRYPTO_DATA_RAW:
+		iov = &out->cd_raw;
+		break;
+	case CRYPTO_DATA_UIO:
+		if ((uintptr_t)iov_or_mp >= out->cd_uio->uio_iovcnt)
+			return (0);
+		iov = (iovec_t *)&out->cd_uio->uio_iov[(uintptr_t)iov_or_mp];
+		break;
+	default:
+		return (0);
+	}
+
+	if (offset >= iov->iov_len)
+		return (0);
+
+	*outp = (uint8_t *)iov->iov_base + offset;
+	return (iov->iov_len - offset);
+}
 
-#define	GHASH(c, d, t) \
+/* Must be used between gcm_fpu_begin() and gcm_fpu_end() */
+#define	GHASH(c, d, t, o) \
 	xor_block((uint8_t *)(d), (uint8_t *)(c)->gcm_ghash); \
-	gcm_mul((uint64_t *)(void *)(c)->gcm_ghash, (c)->gcm_H, \
+	(o)->mul((uint64_t *)(void *)(c)->gcm_ghash, (c)->gcm_H, \
 	(uint64_t *)(void *)(t));
 
 
@@ -131,6 +204,10 @@ gcm_mode_encrypt_contiguous_blocks(gcm_ctx_t *ctx, char *data, size_t length,
 	size_t out_data_1_len;
 	uint64_t counter;
 	uint64_t counter_mask = ntohll(0x00000000ffffffffULL);
+	const gcm_ops_t *ops = gcm_impl_get();
+	gcm_crypt_blocks_f crypt_blocks =
+	    gcm_crypt_blocks_get(ops, encrypt_block);
+	int rv = CRYPTO_SUCCESS;
 
 	if (length + ctx->gcm_remainder_len < block_size) {
 		/* accumulate bytes here and return */
@@ -146,13 +223,54 @@ gcm_mode_encrypt_contiguous_blocks(gcm_ctx_t *ctx, char *data, size_t length,
 	if (out != NULL)
 		crypto_init_ptrs(out, &iov_or_mp, &offset);
 
+	gcm_fpu_begin(ops);
 	do {
+		/*
+		 * Encrypt and hash whole runs of blocks in a single pass,
+		 * as far as they can be written out contiguously.
+		 */
+		if (crypt_blocks != NULL && out != NULL &&
+		    ctx->gcm_remainder_len == 0 &&
+		    remainder >= GCM_CRYPT_BLOCKS_MIN) {
+			size_t done, len;
+			uint8_t *outp = NULL;
+
+			len = MIN(P2ALIGN(remainder, GCM_CRYPT_BLOCKS_MIN),
+			    P2ALIGN(gcm_out_contig(out, iov_or_mp, offset,
+			    &outp), GCM_CRYPT_BLOCKS_MIN));
+			done = (len > 0) ?
+			    crypt_blocks(ctx, datap, outp, len, B_TRUE) : 0;
+
+			if (done > 0) {
+				ctx->gcm_processed_data_len += done;
+				crypto_get_ptrs(out, &iov_or_mp, &offset,
+				    &out_data_1, &out_data_1_len, &out_data_2,
+				    done);
+				out->cd_offset += done;
+				datap += done;
+				remainder -= done;
+				ctx->gcm_copy_to = NULL;
+
+				if (remainder == 0)
+					goto out;
+				if (remainder < block_size) {
+					bcopy(datap, ctx->gcm_remainder,
+					    remainder);
+					ctx->gcm_remainder_len = remainder;
+					ctx->gcm_copy_to = datap;
+					goto out;
+				}
+			}
+		}
+
 		/* Unprocessed data from last call. */
 		if (ctx->gcm_remainder_len > 0) {
 			need = block_size - ctx->gcm_remainder_len;
 
-			if (need > remainder)
-				return (CRYPTO_DATA_LEN_RANGE);
+			if (need > remainder) {
+				rv = CRYPTO_DATA_LEN_RANGE;
+				goto out;
+			}
 
 			bcopy(datap, &((uint8_t *)ctx->gcm_remainder)
 			    [ctx->gcm_remainder_len], need);
@@ -206,7 +324,7 @@ gcm_mode_encrypt_contiguous_blocks(gcm_ctx_t *ctx, char *data, size_t length,
 		}
 
 		/* add ciphertext to the hash */
-		GHASH(ctx, ctx->gcm_tmp, ctx->gcm_ghash);
+		GHASH(ctx, ctx->gcm_tmp, ctx->gcm_ghash, ops);
 
 		/* Update pointer to next block of data to be processed. */
 		if (ctx->gcm_remainder_len != 0) {
@@ -229,7 +347,8 @@ gcm_mode_encrypt_contiguous_blocks(gcm_ctx_t *ctx, char *data, size_t length,
 
 	} while (remainder > 0);
 out:
-	return (CRYPTO_SUCCESS);
+	gcm_fpu_end(ops);
+	return (rv);
 }
 
 /* ARGSUSED */
@@ -240,6 +359,7 @@ gcm_encrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
     void (*xor_block)(uint8_t *, uint8_t *))
 {
 	uint64_t counter_mask = ntohll(0x00000000ffffffffULL);
+	const gcm_ops_t *ops = gcm_impl_get();
 	uint8_t *ghash, *macp = NULL;
 	int i, rv;
 
@@ -250,6 +370,8 @@ gcm_encrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 
 	ghash = (uint8_t *)ctx->gcm_ghash;
 
+	gcm_fpu_begin(ops);
+
 	if (ctx->gcm_remainder_len > 0) {
 		uint64_t counter;
 		uint8_t *tmpp = (uint8_t *)ctx->gcm_tmp;
@@ -280,18 +402,20 @@ gcm_encrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 		}
 
 		/* add ciphertext to the hash */
-		GHASH(ctx, macp, ghash);
+		GHASH(ctx, macp, ghash, ops);
 
 		ctx->gcm_processed_data_len += ctx->gcm_remainder_len;
 	}
 
 	ctx->gcm_len_a_len_c[1] =
 	    htonll(CRYPTO_BYTES2BITS(ctx->gcm_processed_data_len));
-	GHASH(ctx, ctx->gcm_len_a_len_c, ghash);
+	GHASH(ctx, ctx->gcm_len_a_len_c, ghash, ops);
 	encrypt_block(ctx->gcm_keysched, (uint8_t *)ctx->gcm_J0,
 	    (uint8_t *)ctx->gcm_J0);
 	xor_block((uint8_t *)ctx->gcm_J0, ghash);
 
+	gcm_fpu_end(ops);
+
 	if (ctx->gcm_remainder_len > 0) {
 		rv = crypto_put_output_data(macp, out, ctx->gcm_remainder_len);
 		if (rv != CRYPTO_SUCCESS)
@@ -313,6 +437,7 @@ gcm_encrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
  */
 static void
 gcm_decrypt_incomplete_block(gcm_ctx_t *ctx, size_t block_size, size_t index,
+    const gcm_ops_t *ops,
     int (*encrypt_block)(const void *, const uint8_t *, uint8_t *),
     void (*xor_block)(uint8_t *, uint8_t *))
 {
@@ -339,7 +464,7 @@ gcm_decrypt_incomplete_block(gcm_ctx_t *ctx, size_t block_size, size_t index,
 	bcopy(datap, (uint8_t *)ctx->gcm_tmp, ctx->gcm_remainder_len);
 
 	/* add ciphertext to the hash */
-	GHASH(ctx, ctx->gcm_tmp, ctx->gcm_ghash);
+	GHASH(ctx, ctx->gcm_tmp, ctx->gcm_ghash, ops);
 
 	/* decrypt remaining ciphertext */
 	encrypt_block(ctx->gcm_keysched, (uint8_t *)ctx->gcm_cb, counterp);
@@ -397,6 +522,9 @@ gcm_decrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 	uint64_t counter;
 	uint64_t counter_mask = ntohll(0x00000000ffffffffULL);
 	int processed = 0, rv;
+	const gcm_ops_t *ops = gcm_impl_get();
+	gcm_crypt_blocks_f crypt_blocks =
+	    gcm_crypt_blocks_get(ops, encrypt_block);
 
 	ASSERT(ctx->gcm_processed_data_len == ctx->gcm_pt_buf_len);
 
@@ -404,6 +532,18 @@ gcm_decrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 	ghash = (uint8_t *)ctx->gcm_ghash;
 	blockp = ctx->gcm_pt_buf;
 	remainder = pt_len;
+
+	gcm_fpu_begin(ops);
+
+	/* Hash and decrypt whole runs of blocks in place, in a single pass */
+	if (crypt_blocks != NULL && remainder >= GCM_CRYPT_BLOCKS_MIN) {
+		size_t done = crypt_blocks(ctx, blockp, blockp,
+		    P2ALIGN(remainder, GCM_CRYPT_BLOCKS_MIN), B_FALSE);
+
+		processed += done;
+		blockp += done;
+		remainder -= done;
+	}
 	while (remainder > 0) {
 		/* Incomplete last block */
 		if (remainder < block_size) {
@@ -414,12 +554,12 @@ gcm_decrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 			 * compute plaintext for the remaining input
 			 */
 			gcm_decrypt_incomplete_block(ctx, block_size,
-			    processed, encrypt_block, xor_block);
+			    processed, ops, encrypt_block, xor_block);
 			ctx->gcm_remainder_len = 0;
 			goto out;
 		}
 		/* add ciphertext to the hash */
-		GHASH(ctx, blockp, ghash);
+		GHASH(ctx, blockp, ghash, ops);
 
 		/*
 		 * Increment counter.
@@ -442,11 +582,13 @@ gcm_decrypt_final(gcm_ctx_t *ctx, crypto_data_t *out, size_t block_size,
 	}
 out:
 	ctx->gcm_len_a_len_c[1] = htonll(CRYPTO_BYTES2BITS(pt_len));
-	GHASH(ctx, ctx->gcm_len_a_len_c, ghash);
+	GHASH(ctx, ctx->gcm_len_a_len_c, ghash, ops);
 	encrypt_block(ctx->gcm_keysched, (uint8_t *)ctx->gcm_J0,
 	    (uint8_t *)ctx->gcm_J0);
 	xor_block((uint8_t *)ctx->gcm_J0, ghash);
 
+	gcm_fpu_end(ops);
+
 	/* compare the input authentication tag with what we calculated */
 	if (bcmp(&ctx->gcm_pt_buf[pt_len], ghash, ctx->gcm_tag_len)) {
 		/* They don't match */
@@ -490,7 +632,7 @@ gcm_validate_args(CK_AES_GCM_PARAMS *gcm_param)
 
 static void
 gcm_format_initial_blocks(uchar_t *iv, ulong_t iv_len,
-    gcm_ctx_t *ctx, size_t block_size,
+    gcm_ctx_t *ctx, size_t block_size, const gcm_ops_t *ops,
     void (*copy_block)(uint8_t *, uint8_t *),
     void (*xor_block)(uint8_t *, uint8_t *))
 {
@@ -523,12 +665,12 @@ gcm_format_initial_blocks(uchar_t *iv, ulong_t iv_len,
 				processed += block_size;
 				remainder -= block_size;
 			}
-			GHASH(ctx, datap, ghash);
+			GHASH(ctx, datap, ghash, ops);
 		} while (remainder > 0);
 
 		len_a_len_c[0] = 0;
 		len_a_len_c[1] = htonll(CRYPTO_BYTES2BITS(iv_len));
-		GHASH(ctx, len_a_len_c, ctx->gcm_J0);
+		GHASH(ctx, len_a_len_c, ctx->gcm_J0, ops);
 
 		/* J0 will be used again in the final */
 		copy_block((uint8_t *)ctx->gcm_J0, (uint8_t *)cb);
@@ -546,6 +688,7 @@ gcm_init(gcm_ctx_t *ctx, unsigned char *iv, size_t iv_len,
     void (*copy_block)(uint8_t *, uint8_t *),
     void (*xor_block)(uint8_t *, uint8_t *))
 {
+	const gcm_ops_t *ops = gcm_impl_get();
 	uint8_t *ghash, *datap, *authp;
 	size_t remainder, processed;
 
@@ -554,7 +697,9 @@ gcm_init(gcm_ctx_t *ctx, unsigned char *iv, size_t iv_len,
 	encrypt_block(ctx->gcm_keysched, (uint8_t *)ctx->gcm_H,
 	    (uint8_t *)ctx->gcm_H);
 
-	gcm_format_initial_blocks(iv, iv_len, ctx, block_size,
+	gcm_fpu_begin(ops);
+
+	gcm_format_initial_blocks(iv, iv_len, ctx, block_size, ops,
 	    copy_block, xor_block);
 
 	authp = (uint8_t *)ctx->gcm_tmp;
@@ -581,10 +726,12 @@ gcm_init(gcm_ctx_t *ctx, unsigned char *iv, size_t iv_len,
 		}
 
 		/* add auth data to the hash */
-		GHASH(ctx, datap, ghash);
+		GHASH(ctx, datap, ghash, ops);
 
 	} while (remainder > 0);
 
+	gcm_fpu_end(ops);
+
 	return (CRYPTO_SUCCESS);
 }
 
@@ -692,56 +839,3 @@ gcm_set_kmflag(gcm_ctx_t *ctx, int kmflag)
 {
 	ctx->gcm_kmflag = kmflag;
 }
-
-
-#ifdef __amd64
-
-#define	INTEL_PCLMULQDQ_FLAG (1 << 1)
-
-/*
- * Return 1 if executing on Intel with PCLMULQDQ instructions,
- * otherwise 0 (i.e., Intel without PCLMULQDQ or AMD64).
- * Cache the result, as the CPU can't change.
- *
- * Note: the userland version uses getisax().  The kernel version uses
- * is_x86_featureset().
- */
-static int
-intel_pclmulqdq_instruction_present(void)
-{
-	static int cached_result = -1;
-	unsigned eax, ebx, ecx, edx;
-	unsigned func, subfunc;
-
-	if (cached_result == -1) { /* first time */
-		/* check for an intel cpu */
-		func = 0;
-		subfunc = 0;
-
-		__asm__ __volatile__(
-		    "cpuid"
-		    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-		    : "a"(func), "c"(subfunc));
-
-		if (memcmp((char *)(&ebx), "Genu", 4) == 0 &&
-		    memcmp((char *)(&edx), "ineI", 4) == 0 &&
-		    memcmp((char *)(&ecx), "ntel", 4) == 0) {
-			func = 1;
-			subfunc = 0;
-
-			/* check for aes-ni instruction set */
-			__asm__ __volatile__(
-			    "cpuid"
-			    : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
-			    : "a"(func), "c"(subfunc));
-
-			cached_result = !!(ecx & INTEL_PCLMULQDQ_FLAG);
-		} else {
-			cached_result = 0;
-		}
-	}
-
-	return (cached_result);
-}
-
-#endif	/* __amd64 */
@@ -0,0 +1,332 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * AES-GCM using AES-NI and PCLMULQDQ, with the CTR encryption and the
+ * GHASH of the ciphertext stitched together in a single pass over the data.
+ *
+ * Four blocks are processed per iteration.  Their GHASH is computed with
+ * the aggregated reduction method of Intel's "Intel Carry-Less
+ * Multiplication Instruction and its Usage for Computing the GCM Mode"
+ * white paper:
+ *
+ *	X' = (X + C1) * H^4 + C2 * H^3 + C3 * H^2 + C4 * H
+ *
+ * with the multiplications interleaved with the AES rounds of the next
+ * four counter blocks.  When encrypting, the hashed blocks are the
+ * ciphertext of the previous iteration; when decrypting, they are the
+ * ciphertext being decrypted.  Like gcm_mul_pclmulqdq(), the GHASH is
+ * done on byte reflected values, multiplied then shifted left by one bit.
+ *
+ * Register usage:
+ *	xmm0 - xmm3	AES state of the four blocks
+ *	xmm4		round key
+ *	xmm5 - xmm8	byte reflected ciphertext blocks to hash
+ *	xmm9		byte reflected GHASH
+ *	xmm10		byte reflection mask
+ *	xmm11, xmm12	low and high halves of the 256-bit product
+ *	xmm13		middle terms of the product
+ *	xmm14, xmm15	scratch
+ */
+
+#if defined(__amd64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ)
+
+#include <sys/zfs_context.h>
+#include <sys/byteorder.h>
+#include <modes/gcm_impl.h>
+#include <aes/aes_impl.h>
+#include <linux/simd_x86.h>
+
+/* Blocks processed per iteration */
+#define	GCM_AESNI_BLOCKS	4
+
+/* Reverses the bytes of a 128-bit value */
+static const uint8_t gcm_aesni_bswap[16] = {
+	15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0
+};
+
+/*
+ * Counter blocks for the next four blocks.  The counter is the last 32
+ * bits of the counter block, big endian.
+ */
+#define	AESNI_CTR(cb, ctr)						\
+{									\
+	asm volatile("movdqu %0, %%xmm0" :: "m" ((cb)[0]));		\
+	asm volatile("movdqa %xmm0, %xmm1");				\
+	asm volatile("movdqa %xmm0, %xmm2");				\
+	asm volatile("movdqa %xmm0, %xmm3");				\
+	asm volatile("pinsrd $3, %0, %%xmm0" :: "r" (htonl((ctr) + 1)));\
+	asm volatile("pinsrd $3, %0, %%xmm1" :: "r" (htonl((ctr) + 2)));\
+	asm volatile("pinsrd $3, %0, %%xmm2" :: "r" (htonl((ctr) + 3)));\
+	asm volatile("pinsrd $3, %0, %%xmm3" :: "r" (htonl((ctr) + 4)));\
+}
+
+/* AES rounds of the four blocks, with round key rk */
+#define	AESNI_ROUND(insn, rk)						\
+{									\
+	asm volatile("movdqu %0, %%xmm4" :: "m" (*(rk)));		\
+	asm volatile(insn " %xmm4, %xmm0");				\
+	asm volatile(insn " %xmm4, %xmm1");				\
+	asm volatile(insn " %xmm4, %xmm2");				\
+	asm volatile(insn " %xmm4, %xmm3");				\
+}
+
+/* XOR the key stream with the input, and store the output */
+#define	AESNI_XOR_STORE(in, out)					\
+{									\
+	asm volatile("movdqu %0, %%xmm14" :: "m" ((in)[0]));		\
+	asm volatile("pxor %xmm14, %xmm0");				\
+	asm volatile("movdqu %%xmm0, %0" : "=m" ((out)[0]) :: "memory");\
+	asm volatile("movdqu %0, %%xmm14" :: "m" ((in)[16]));		\
+	asm volatile("pxor %xmm14, %xmm1");				\
+	asm volatile("movdqu %%xmm1, %0" : "=m" ((out)[16]) :: "memory");\
+	asm volatile("movdqu %0, %%xmm14" :: "m" ((in)[32]));		\
+	asm volatile("pxor %xmm14, %xmm2");				\
+	asm volatile("movdqu %%xmm2, %0" : "=m" ((out)[32]) :: "memory");\
+	asm volatile("movdqu %0, %%xmm14" :: "m" ((in)[48]));		\
+	asm volatile("pxor %xmm14, %xmm3");				\
+	asm volatile("movdqu %%xmm3, %0" : "=m" ((out)[48]) :: "memory");\
+}
+
+/* Ciphertext to hash, from memory */
+#define	GHASH_LOAD(in)							\
+{									\
+	asm volatile("movdqu %0, %%xmm5" :: "m" ((in)[0]));		\
+	asm volatile("movdqu %0, %%xmm6" :: "m" ((in)[16]));		\
+	asm volatile("movdqu %0, %%xmm7" :: "m" ((in)[32]));		\
+	asm volatile("movdqu %0, %%xmm8" :: "m" ((in)[48]));		\
+	GHASH_REFLECT();						\
+}
+
+/* Ciphertext to hash, from the AES state */
+#define	GHASH_SAVE()							\
+{									\
+	asm volatile("movdqa %xmm0, %xmm5");				\
+	asm volatile("movdqa %xmm1, %xmm6");				\
+	asm volatile("movdqa %xmm2, %xmm7");				\
+	asm volatile("movdqa %xmm3, %xmm8");				\
+	GHASH_REFLECT();						\
+}
+
+#define	GHASH_REFLECT()							\
+{									\
+	asm volatile("pshufb %xmm10, %xmm5");				\
+	asm volatile("pshufb %xmm10, %xmm6");				\
+	asm volatile("pshufb %xmm10, %xmm7");				\
+	asm volatile("pshufb %xmm10, %xmm8");				\
+}
+
+/* Fold the GHASH into the first block, and clear the product */
+#define	GHASH_BEGIN()							\
+{									\
+	asm volatile("pxor %xmm9, %xmm5");				\
+	asm volatile("pxor %xmm11, %xmm11");				\
+	asm volatile("pxor %xmm12, %xmm12");				\
+	asm volatile("pxor %xmm13, %xmm13");				\
+}
+
+/* Add the product of block C and power of H, h, to the product */
+#define	GHASH_MUL(C, h)							\
+{									\
+	asm volatile("movdqu %0, %%xmm15" :: "m" ((h)[0]));		\
+	asm volatile("movdqa %" C ", %xmm14");				\
+	asm volatile("pclmulqdq $0x00, %xmm15, %xmm14");		\
+	asm volatile("pxor %xmm14, %xmm11");				\
+	asm volatile("movdqa %" C ", %xmm14");				\
+	asm volatile("pclmulqdq $0x11, %xmm15, %xmm14");		\
+	asm volatile("pxor %xmm14, %xmm12");				\
+	asm volatile("movdqa %" C ", %xmm14");				\
+	asm volatile("pclmulqdq $0x01, %xmm15, %xmm14");		\
+	asm volatile("pxor %xmm14, %xmm13");				\
+	asm volatile("movdqa %" C ", %xmm14");				\
+	asm volatile("pclmulqdq $0x10, %xmm15, %xmm14");		\
+	asm volatile("pxor %xmm14, %xmm13");				\
+}
+
+/* Reduce the product into the GHASH, as in gcm_mul_pclmulqdq() */
+#define	GHASH_REDUCE()							\
+{									\
+	asm volatile("movdqa %xmm13, %xmm14");				\
+	asm volatile("psrldq $8, %xmm13");				\
+	asm volatile("pslldq $8, %xmm14");				\
+	asm volatile("pxor %xmm14, %xmm11");				\
+	asm volatile("pxor %xmm13, %xmm12");				\
+	/* shift the product left by one bit */				\
+	asm volatile("movdqa %xmm11, %xmm14");				\
+	asm volatile("movdqa %xmm12, %xmm15");				\
+	asm volatile("pslld $1, %xmm11");				\
+	asm volatile("pslld $1, %xmm12");				\
+	asm volatile("psrld $31, %xmm14");				\
+	asm volatile("psrld $31, %xmm15");				\
+	asm volatile("movdqa %xmm14, %xmm13");				\
+	asm volatile("pslldq $4, %xmm15");				\
+	asm volatile("pslldq $4, %xmm14");				\
+	asm volatile("psrldq $12, %xmm13");				\
+	asm volatile("por %xmm14, %xmm11");				\
+	asm volatile("por %xmm15, %xmm12");				\
+	asm volatile("por %xmm13, %xmm12");				\
+	/* first phase of the reduction */				\
+	asm volatile("movdqa %xmm11, %xmm13");				\
+	asm volatile("movdqa %xmm11, %xmm14");				\
+	asm volatile("movdqa %xmm11, %xmm15");				\
+	asm volatile("pslld $31, %xmm13");				\
+	asm volatile("pslld $30, %xmm14");				\
+	asm volatile("pslld $25, %xmm15");				\
+	asm volatile("pxor %xmm14, %xmm13");				\
+	asm volatile("pxor %xmm15, %xmm13");				\
+	asm volatile("movdqa %xmm13, %xmm14");				\
+	asm volatile("pslldq $12, %xmm13");				\
+	asm volatile("psrldq $4, %xmm14");				\
+	asm volatile("pxor %xmm13, %xmm11");				\
+	/* second phase of the reduction */				\
+	asm volatile("movdqa %xmm11, %xmm9");				\
+	asm volatile("movdqa %xmm11, %xmm13");				\
+	asm volatile("movdqa %xmm11, %xmm15");				\
+	asm volatile("psrld $1, %xmm9");				\
+	asm volatile("psrld $2, %xmm13");				\
+	asm volatile("psrld $7, %xmm15");				\
+	asm volatile("pxor %xmm13, %xmm9");				\
+	asm volatile("pxor %xmm15, %xmm9");				\
+	asm volatile("pxor %xmm14, %xmm9");				\
+	asm volatile("pxor %xmm9, %xmm11");				\
+	asm volatile("pxor %xmm11, %xmm12");				\
+	asm volatile("movdqa %xmm12, %xmm9");				\
+}
+
+/*
+ * Multiply the four blocks in xmm5 - xmm8 into the GHASH.  This is
+ * spread over AES rounds 1 to 5 when stitched.
+ */
+#define	GHASH_STEP(step, hpow)						\
+{									\
+	switch (step) {							\
+	case 1:								\
+		GHASH_BEGIN();						\
+		GHASH_MUL("xmm5", (hpow)[3]);				\
+		break;							\
+	case 2:								\
+		GHASH_MUL("xmm6", (hpow)[2]);				\
+		break;							\
+	case 3:								\
+		GHASH_MUL("xmm7", (hpow)[1]);				\
+		break;							\
+	case 4:								\
+		GHASH_MUL("xmm8", (hpow)[0]);				\
+		break;							\
+	case 5:								\
+		GHASH_REDUCE();						\
+		break;							\
+	}								\
+}
+
+/* Called between kfpu_begin() and kfpu_end(), see gcm_ops_t */
+static size_t
+gcm_aesni_crypt_blocks(gcm_ctx_t *ctx, const uint8_t *in, uint8_t *out,
+    size_t len, boolean_t encrypt)
+{
+	const aes_key_t *ks = ctx->gcm_keysched;
+	const uint8_t *rk = (const uint8_t *)&ks->encr_ks.ks32[0];
+	uint32_t *cb = (uint32_t *)ctx->gcm_cb;
+	uint64_t hpow[GCM_AESNI_BLOCKS][2];
+	uint32_t ctr;
+	size_t done;
+	int r, nr = ks->nr;
+
+	/* The key schedule must be the one expected by AES-NI */
+	if (!(ks->flags & INTEL_AES_NI_CAPABLE))
+		return (0);
+
+	len = P2ALIGN(len, GCM_AESNI_BLOCKS * AES_BLOCK_LEN);
+	if (len == 0)
+		return (0);
+
+	ctr = ntohl(cb[3]);
+
+	/* H, H^2, H^3 and H^4, byte reflected */
+	hpow[0][0] = ctx->gcm_H[0];
+	hpow[0][1] = ctx->gcm_H[1];
+	for (r = 1; r < GCM_AESNI_BLOCKS; r++)
+		gcm_mul_pclmulqdq(hpow[r - 1], ctx->gcm_H, hpow[r]);
+
+	asm volatile("movdqu %0, %%xmm10" :: "m" (gcm_aesni_bswap[0]));
+	for (r = 0; r < GCM_AESNI_BLOCKS; r++) {
+		asm volatile("movdqu %0, %%xmm14" :: "m" (hpow[r][0]));
+		asm volatile("pshufb %xmm10, %xmm14");
+		asm volatile("movdqu %%xmm14, %0" : "=m" (hpow[r][0]) ::
+		    "memory");
+	}
+
+	asm volatile("movdqu %0, %%xmm9" :: "m" (ctx->gcm_ghash[0]));
+	asm volatile("pshufb %xmm10, %xmm9");
+
+	for (done = 0; done < len; done += GCM_AESNI_BLOCKS * AES_BLOCK_LEN,
+	    ctr += GCM_AESNI_BLOCKS) {
+		/* Nothing has been encrypted yet to hash */
+		boolean_t ghash = (!encrypt || done > 0);
+
+		if (!encrypt)
+			GHASH_LOAD(in + done);
+
+		AESNI_CTR(ctx->gcm_cb, ctr);
+		AESNI_ROUND("pxor", rk);
+		for (r = 1; r < nr; r++) {
+			AESNI_ROUND("aesenc", rk + r * AES_BLOCK_LEN);
+			if (ghash)
+				GHASH_STEP(r, hpow);
+		}
+		AESNI_ROUND("aesenclast", rk + nr * AES_BLOCK_LEN);
+		AESNI_XOR_STORE(in + done, out + done);
+
+		if (encrypt)
+			GHASH_SAVE();
+	}
+
+	/* Hash the last ciphertext blocks */
+	if (encrypt) {
+		for (r = 1; r <= 5; r++)
+			GHASH_STEP(r, hpow);
+	}
+
+	asm volatile("pshufb %xmm10, %xmm9");
+	asm volatile("movdqu %%xmm9, %0" : "=m" (ctx->gcm_ghash[0]) ::
+	    "memory");
+
+	cb[3] = htonl(ctr);
+
+	return (len);
+}
+
+static boolean_t
+gcm_aesni_valid(void)
+{
+	return (zfs_aes_available() && zfs_pclmulqdq_available() &&
+	    zfs_ssse3_available() && zfs_sse4_1_available());
+}
+
+const gcm_ops_t gcm_aesni_ops = {
+	.mul = gcm_mul_pclmulqdq,
+	.crypt_blocks = gcm_aesni_crypt_blocks,
+	.valid = gcm_aesni_valid,
+	.fpu = B_TRUE,
+	.name = "aesni"
+};
+
+#endif /* defined(__amd64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ) */
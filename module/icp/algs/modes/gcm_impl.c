@@ -0,0 +1,407 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Runtime selection of the GCM implementation.
+ *
+ * Like the SHA2 transforms (see sha2_impl.c), every implementation which
+ * is usable on this CPU is benchmarked on AES-256-GCM encryption when the
+ * module is loaded, and the fastest one is used unless a specific one is
+ * chosen through the zfs_gcm_impl module parameter.  The results are
+ * reported in the "gcm_bench" kstat.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/crypto/common.h>
+#include <modes/gcm_impl.h>
+#include <aes/aes_impl.h>
+
+#if defined(__amd64)
+#include <linux/simd_x86.h>
+
+static boolean_t
+gcm_pclmulqdq_valid(void)
+{
+	return (zfs_pclmulqdq_available() && zfs_ssse3_available());
+}
+
+const gcm_ops_t gcm_pclmulqdq_ops = {
+	.mul = gcm_mul_pclmulqdq,
+	.crypt_blocks = NULL,
+	.valid = gcm_pclmulqdq_valid,
+	.fpu = B_TRUE,
+	.name = "pclmulqdq"
+};
+#endif
+
+static const gcm_ops_t *gcm_all_impl[] = {
+	&gcm_generic_ops,
+#if defined(__amd64)
+	&gcm_pclmulqdq_ops,
+#endif
+#if defined(__amd64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ)
+	&gcm_aesni_ops,
+#endif
+};
+
+/* Indicate that benchmark has been completed */
+static boolean_t gcm_initialized = B_FALSE;
+
+/* Implementations usable on this CPU */
+static const gcm_ops_t *gcm_supp_impl[ARRAY_SIZE(gcm_all_impl)];
+static uint32_t gcm_supp_impl_cnt = 0;
+
+/* Benchmark results, B/s */
+static uint64_t gcm_bench_bw[ARRAY_SIZE(gcm_all_impl)];
+static uint32_t gcm_fastest_impl = 0;
+
+/* Select GCM implementation */
+#define	IMPL_FASTEST	(UINT32_MAX)
+#define	IMPL_CYCLE	(UINT32_MAX - 1)
+
+#define	IMPL_READ(i)	(*(volatile uint32_t *) &(i))
+
+static uint32_t gcm_impl_chosen = IMPL_FASTEST;
+
+const gcm_ops_t *
+gcm_impl_get(void)
+{
+	const uint32_t impl = IMPL_READ(gcm_impl_chosen);
+
+	/* The generic implementation is always safe to use before init */
+	if (!gcm_initialized)
+		return (&gcm_generic_ops);
+
+	switch (impl) {
+	case IMPL_FASTEST:
+		return (gcm_supp_impl[gcm_fastest_impl]);
+#if !defined(_KERNEL)
+	case IMPL_CYCLE: {
+		static uint32_t cycle_count = 0;
+		uint32_t idx = (++cycle_count) % gcm_supp_impl_cnt;
+		return (gcm_supp_impl[idx]);
+	}
+#endif
+	default:
+		ASSERT3U(impl, <, gcm_supp_impl_cnt);
+		return (gcm_supp_impl[impl]);
+	}
+}
+
+int
+gcm_impl_set(const char *val)
+{
+	int err = -EINVAL;
+	uint32_t impl = IMPL_READ(gcm_impl_chosen);
+	size_t i, val_len;
+
+	val_len = strlen(val);
+	while ((val_len > 0) && !!isspace(val[val_len-1])) /* trim '\n' */
+		val_len--;
+
+	if (val_len == strlen("fastest") &&
+	    strncmp(val, "fastest", val_len) == 0) {
+		impl = IMPL_FASTEST;
+		err = 0;
+	}
+#if !defined(_KERNEL)
+	if (val_len == strlen("cycle") && strncmp(val, "cycle", val_len) == 0) {
+		impl = IMPL_CYCLE;
+		err = 0;
+	}
+#endif
+
+	if (err != 0 && gcm_initialized) {
+		/* check all supported implementations */
+		for (i = 0; i < gcm_supp_impl_cnt; i++) {
+			const char *name = gcm_supp_impl[i]->name;
+
+			if (val_len == strlen(name) &&
+			    strncmp(val, name, val_len) == 0) {
+				impl = i;
+				err = 0;
+				break;
+			}
+		}
+	}
+
+	if (err == 0) {
+#if defined(_KERNEL)
+		atomic_swap_32(&gcm_impl_chosen, impl);
+		membar_producer();
+#else
+		/* libicp is linked without libspl's atomics in userland */
+		gcm_impl_chosen = impl;
+#endif
+	}
+
+	return (err);
+}
+
+#if defined(_KERNEL)
+static kstat_t *gcm_kstat;
+
+/* GCM kstats */
+
+static int
+gcm_kstat_headers(char *buf, size_t size)
+{
+	ssize_t off = 0;
+
+	off += snprintf(buf + off, size, "%-17s", "implementation");
+	(void) snprintf(buf + off, size - off, "%-15s\n", "bandwidth");
+
+	return (0);
+}
+
+/*
+ * There is a row per supported implementation, followed by a "fastest"
+ * row naming the implementation picked by the benchmark.
+ */
+static int
+gcm_kstat_data(char *buf, size_t size, void *data)
+{
+	uint64_t n = (uint64_t)(uintptr_t)data - 1;
+	ssize_t off = 0;
+
+	if (n == gcm_supp_impl_cnt) {
+		off += snprintf(buf + off, size - off, "%-17s", "fastest");
+		(void) snprintf(buf + off, size - off, "%-15s\n",
+		    gcm_supp_impl[gcm_fastest_impl]->name);
+	} else {
+		off += snprintf(buf + off, size - off, "%-17s",
+		    gcm_supp_impl[n]->name);
+		(void) snprintf(buf + off, size - off, "%-15llu\n",
+		    (u_longlong_t)gcm_bench_bw[n]);
+	}
+
+	return (0);
+}
+
+static void *
+gcm_kstat_addr(kstat_t *ksp, loff_t n)
+{
+	/* The row number is biased by one so that it is never NULL */
+	if (n <= gcm_supp_impl_cnt)
+		ksp->ks_private = (void *)(uintptr_t)(n + 1);
+	else
+		ksp->ks_private = NULL;
+
+	return (ksp->ks_private);
+}
+
+#define	GCM_BENCH_NS	(MSEC2NSEC(10))		/* 10ms */
+
+/*
+ * Encrypt data_size bytes of data with AES-256-GCM, as a dataset block
+ * would be, using the currently chosen implementation.
+ */
+static void
+gcm_benchmark_encrypt(void *keysched, char *data, uint8_t *ct,
+    size_t data_size)
+{
+	static uint8_t iv[12];
+	CK_AES_GCM_PARAMS params;
+	crypto_data_t out;
+	gcm_ctx_t ctx;
+
+	params.pIv = iv;
+	params.ulIvLen = sizeof (iv);
+	params.ulIvBits = CRYPTO_BYTES2BITS(sizeof (iv));
+	params.pAAD = NULL;
+	params.ulAADLen = 0;
+	params.ulTagBits = CRYPTO_BYTES2BITS(AES_BLOCK_LEN);
+
+	bzero(&ctx, sizeof (ctx));
+	ctx.gcm_keysched = keysched;
+	VERIFY0(gcm_init_ctx(&ctx, (char *)&params, AES_BLOCK_LEN,
+	    aes_encrypt_block, aes_copy_block, aes_xor_block));
+
+	bzero(&out, sizeof (out));
+	out.cd_format = CRYPTO_DATA_RAW;
+	out.cd_length = data_size + AES_BLOCK_LEN;
+	out.cd_raw.iov_base = (char *)ct;
+	out.cd_raw.iov_len = data_size + AES_BLOCK_LEN;
+
+	VERIFY0(gcm_mode_encrypt_contiguous_blocks(&ctx, data, data_size,
+	    &out, AES_BLOCK_LEN, aes_encrypt_block, aes_copy_block,
+	    aes_xor_block));
+	VERIFY0(gcm_encrypt_final(&ctx, &out, AES_BLOCK_LEN,
+	    aes_encrypt_block, aes_copy_block, aes_xor_block));
+}
+
+static void
+gcm_benchmark_impl(char *data, uint8_t *ct, size_t data_size)
+{
+	static const uint8_t key[AES_MAX_KEY_BYTES] = { 0 };
+	hrtime_t start;
+	uint64_t run_bw, run_time_ns, best_run = 0;
+	uint32_t i, l, sel_save = IMPL_READ(gcm_impl_chosen);
+	size_t ks_size;
+	void *keysched;
+
+	keysched = aes_alloc_keysched(&ks_size, KM_SLEEP);
+	aes_init_keysched(key, AES_MAXBITS, keysched);
+
+	for (i = 0; i < gcm_supp_impl_cnt; i++) {
+		uint64_t run_count = 0;
+
+		/* temporary set an implementation */
+		gcm_impl_chosen = i;
+
+		kpreempt_disable();
+		start = gethrtime();
+		do {
+			for (l = 0; l < 4; l++, run_count++)
+				gcm_benchmark_encrypt(keysched, data, ct,
+				    data_size);
+
+			run_time_ns = gethrtime() - start;
+		} while (run_time_ns < GCM_BENCH_NS);
+		kpreempt_enable();
+
+		run_bw = data_size * run_count * NANOSEC;
+		run_bw /= run_time_ns;	/* B/s */
+		gcm_bench_bw[i] = run_bw;
+
+		if (run_bw > best_run) {
+			best_run = run_bw;
+			gcm_fastest_impl = i;
+		}
+	}
+
+	bzero(keysched, ks_size);
+	kmem_free(keysched, ks_size);
+
+	/* restore original selection */
+	atomic_swap_32(&gcm_impl_chosen, sel_save);
+}
+
+static void
+gcm_benchmark(void)
+{
+	static const size_t data_size = 1 << 14; /* 16kiB */
+	char *databuf;
+	uint8_t *ctbuf;
+	int i;
+
+	/* Benchmark all supported implementations */
+	databuf = vmem_alloc(data_size, KM_SLEEP);
+	ctbuf = vmem_alloc(data_size + AES_BLOCK_LEN, KM_SLEEP);
+	for (i = 0; i < data_size / sizeof (uint64_t); i++)
+		((uint64_t *)databuf)[i] = (uintptr_t)(databuf+i); /* warm-up */
+
+	gcm_benchmark_impl(databuf, ctbuf, data_size);
+
+	vmem_free(ctbuf, data_size + AES_BLOCK_LEN);
+	vmem_free(databuf, data_size);
+
+	/* install kstats for all implementations */
+	gcm_kstat = kstat_create("zfs", 0, "gcm_bench", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	if (gcm_kstat != NULL) {
+		gcm_kstat->ks_data = NULL;
+		gcm_kstat->ks_ndata = UINT32_MAX;
+		kstat_set_raw_ops(gcm_kstat,
+		    gcm_kstat_headers,
+		    gcm_kstat_data,
+		    gcm_kstat_addr);
+		kstat_install(gcm_kstat);
+	}
+}
+#endif /* _KERNEL */
+
+void
+gcm_impl_init(void)
+{
+	int i, c;
+
+	/* move supported impl into gcm_supp_impl */
+	for (i = 0, c = 0; i < ARRAY_SIZE(gcm_all_impl); i++) {
+		const gcm_ops_t *curr_impl = gcm_all_impl[i];
+
+		if (curr_impl->valid && curr_impl->valid())
+			gcm_supp_impl[c++] = curr_impl;
+	}
+	gcm_supp_impl_cnt = c;	/* number of supported impl */
+
+	/* Until the benchmark has run, use the last one as fastest */
+	gcm_fastest_impl = c - 1;
+
+#if defined(_KERNEL)
+	membar_producer();	/* complete gcm_supp_impl[] init */
+	gcm_initialized = B_TRUE;
+
+	gcm_benchmark();
+#else
+	/* Skip benchmarking and use last implementation as fastest */
+	gcm_initialized = B_TRUE;
+#endif
+}
+
+void
+gcm_impl_fini(void)
+{
+#if defined(_KERNEL)
+	if (gcm_kstat != NULL) {
+		kstat_delete(gcm_kstat);
+		gcm_kstat = NULL;
+	}
+#endif
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+#include <linux/mod_compat.h>
+
+static int
+gcm_param_get(char *buffer, zfs_kernel_param_t *unused)
+{
+	const uint32_t impl = IMPL_READ(gcm_impl_chosen);
+	char *fmt;
+	int i, cnt = 0;
+
+	/* list fastest */
+	fmt = (impl == IMPL_FASTEST) ? "[%s] " : "%s ";
+	cnt += sprintf(buffer + cnt, fmt, "fastest");
+
+	/* list all supported implementations */
+	for (i = 0; i < gcm_supp_impl_cnt; i++) {
+		fmt = (i == impl) ? "[%s] " : "%s ";
+		cnt += sprintf(buffer + cnt, fmt, gcm_supp_impl[i]->name);
+	}
+
+	return (cnt);
+}
+
+static int
+gcm_param_set(const char *val, zfs_kernel_param_t *unused)
+{
+	return (gcm_impl_set(val));
+}
+
+/*
+ * Choose the GCM implementation.
+ * Users can choose "cycle" to exercise all implementations, but this is
+ * for testing purpose therefore it can only be set in user space.
+ */
+module_param_call(zfs_gcm_impl, gcm_param_set, gcm_param_get, NULL, 0644);
+MODULE_PARM_DESC(zfs_gcm_impl, "Select GCM implementation.");
+#endif
@@ -0,0 +1,226 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * SHA256 block transform using the Intel SHA extensions, following the
+ * instruction sequence of Intel's "New Instructions Supporting the Secure
+ * Hash Algorithm on Intel Architecture Processors" white paper.
+ *
+ * Register usage:
+ *	xmm0		message words plus round constants (implicit operand
+ *			of sha256rnds2)
+ *	xmm1, xmm2	state, as ABEF and CDGH
+ *	xmm3 - xmm6	message schedule, four words each
+ *	xmm7		scratch
+ *	xmm8		byte swap mask
+ *	xmm9, xmm10	state at the start of the block
+ */
+
+#if defined(__amd64) && defined(HAVE_SHA_NI)
+
+#include <sys/zfs_context.h>
+#define	_SHA2_IMPL
+#include <sys/sha2.h>
+#include <sha2/sha2_consts.h>
+#include <sha2/sha2_impl.h>
+#include <linux/simd_x86.h>
+
+static const uint32_t sha256_shani_k[64] __attribute__((aligned(16))) = {
+	SHA256_CONST_0, SHA256_CONST_1, SHA256_CONST_2, SHA256_CONST_3,
+	SHA256_CONST_4, SHA256_CONST_5, SHA256_CONST_6, SHA256_CONST_7,
+	SHA256_CONST_8, SHA256_CONST_9, SHA256_CONST_10, SHA256_CONST_11,
+	SHA256_CONST_12, SHA256_CONST_13, SHA256_CONST_14, SHA256_CONST_15,
+	SHA256_CONST_16, SHA256_CONST_17, SHA256_CONST_18, SHA256_CONST_19,
+	SHA256_CONST_20, SHA256_CONST_21, SHA256_CONST_22, SHA256_CONST_23,
+	SHA256_CONST_24, SHA256_CONST_25, SHA256_CONST_26, SHA256_CONST_27,
+	SHA256_CONST_28, SHA256_CONST_29, SHA256_CONST_30, SHA256_CONST_31,
+	SHA256_CONST_32, SHA256_CONST_33, SHA256_CONST_34, SHA256_CONST_35,
+	SHA256_CONST_36, SHA256_CONST_37, SHA256_CONST_38, SHA256_CONST_39,
+	SHA256_CONST_40, SHA256_CONST_41, SHA256_CONST_42, SHA256_CONST_43,
+	SHA256_CONST_44, SHA256_CONST_45, SHA256_CONST_46, SHA256_CONST_47,
+	SHA256_CONST_48, SHA256_CONST_49, SHA256_CONST_50, SHA256_CONST_51,
+	SHA256_CONST_52, SHA256_CONST_53, SHA256_CONST_54, SHA256_CONST_55,
+	SHA256_CONST_56, SHA256_CONST_57, SHA256_CONST_58, SHA256_CONST_59,
+	SHA256_CONST_60, SHA256_CONST_61, SHA256_CONST_62, SHA256_CONST_63
+};
+
+/* Reverses the bytes of each 32-bit word */
+static const uint8_t sha256_shani_bswap[16] = {
+	3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12
+};
+
+/* Load message words W[i .. i+3] of the block into T */
+#define	SHANI_LOAD(blk, i, T)						\
+{									\
+	asm volatile("movdqu %0, %%xmm0" :: "m" ((blk)[i]));		\
+	asm volatile("pshufb %xmm8, %xmm0");				\
+	asm volatile("movdqa %xmm0, %" T);				\
+}
+
+/* Do rounds i .. i+3, with the message words in xmm0 */
+#define	SHANI_ROUNDS(i)							\
+{									\
+	asm volatile("paddd %0, %%xmm0" :: "m" (sha256_shani_k[i]));	\
+	asm volatile("sha256rnds2 %xmm0, %xmm1, %xmm2");		\
+	asm volatile("pshufd $0x0E, %xmm0, %xmm0");			\
+	asm volatile("sha256rnds2 %xmm0, %xmm2, %xmm1");		\
+}
+
+/*
+ * Finish the next four words of the message schedule in N, using the
+ * last four in C and the four before those in P.
+ */
+#define	SHANI_MSG2(C, P, N)						\
+{									\
+	asm volatile("movdqa %" C ", %xmm7");				\
+	asm volatile("palignr $4, %" P ", %xmm7");			\
+	asm volatile("paddd %xmm7, %" N);				\
+	asm volatile("sha256msg2 %" C ", %" N);				\
+}
+
+/* Start the message schedule four words after the ones in P */
+#define	SHANI_MSG1(C, P)						\
+	asm volatile("sha256msg1 %" C ", %" P)
+
+/* Rounds i .. i+3 from the message schedule in C */
+#define	SHANI_SCHED_ROUNDS(i, C)					\
+{									\
+	asm volatile("movdqa %" C ", %xmm0");				\
+	SHANI_ROUNDS(i);						\
+}
+
+static void
+sha256_shani_transform(SHA2_CTX *ctx, const void *in, size_t num)
+{
+	const uint32_t *blk = in;
+
+	kfpu_begin();
+
+	/* Reorder the state from ABCD, EFGH to ABEF, CDGH */
+	asm volatile("movdqu %0, %%xmm1" :: "m" (ctx->state.s32[0]));
+	asm volatile("movdqu %0, %%xmm2" :: "m" (ctx->state.s32[4]));
+	asm volatile("pshufd $0xB1, %xmm1, %xmm1");
+	asm volatile("pshufd $0x1B, %xmm2, %xmm2");
+	asm volatile("movdqa %xmm1, %xmm7");
+	asm volatile("palignr $8, %xmm2, %xmm1");
+	asm volatile("pblendw $0xF0, %xmm7, %xmm2");
+
+	asm volatile("movdqu %0, %%xmm8" :: "m" (sha256_shani_bswap[0]));
+
+	for (; num > 0; num--, blk += 16) {
+		asm volatile("movdqa %xmm1, %xmm9");
+		asm volatile("movdqa %xmm2, %xmm10");
+
+		/* Rounds 0 - 15, straight from the message */
+		SHANI_LOAD(blk, 0, "xmm3");
+		SHANI_ROUNDS(0);
+
+		SHANI_LOAD(blk, 4, "xmm4");
+		SHANI_ROUNDS(4);
+		SHANI_MSG1("xmm4", "xmm3");
+
+		SHANI_LOAD(blk, 8, "xmm5");
+		SHANI_ROUNDS(8);
+		SHANI_MSG1("xmm5", "xmm4");
+
+		SHANI_LOAD(blk, 12, "xmm6");
+		SHANI_ROUNDS(12);
+		SHANI_MSG2("xmm6", "xmm5", "xmm3");
+		SHANI_MSG1("xmm6", "xmm5");
+
+		/* Rounds 16 - 51, extending the message schedule */
+		SHANI_SCHED_ROUNDS(16, "xmm3");
+		SHANI_MSG2("xmm3", "xmm6", "xmm4");
+		SHANI_MSG1("xmm3", "xmm6");
+
+		SHANI_SCHED_ROUNDS(20, "xmm4");
+		SHANI_MSG2("xmm4", "xmm3", "xmm5");
+		SHANI_MSG1("xmm4", "xmm3");
+
+		SHANI_SCHED_ROUNDS(24, "xmm5");
+		SHANI_MSG2("xmm5", "xmm4", "xmm6");
+		SHANI_MSG1("xmm5", "xmm4");
+
+		SHANI_SCHED_ROUNDS(28, "xmm6");
+		SHANI_MSG2("xmm6", "xmm5", "xmm3");
+		SHANI_MSG1("xmm6", "xmm5");
+
+		SHANI_SCHED_ROUNDS(32, "xmm3");
+		SHANI_MSG2("xmm3", "xmm6", "xmm4");
+		SHANI_MSG1("xmm3", "xmm6");
+
+		SHANI_SCHED_ROUNDS(36, "xmm4");
+		SHANI_MSG2("xmm4", "xmm3", "xmm5");
+		SHANI_MSG1("xmm4", "xmm3");
+
+		SHANI_SCHED_ROUNDS(40, "xmm5");
+		SHANI_MSG2("xmm5", "xmm4", "xmm6");
+		SHANI_MSG1("xmm5", "xmm4");
+
+		SHANI_SCHED_ROUNDS(44, "xmm6");
+		SHANI_MSG2("xmm6", "xmm5", "xmm3");
+		SHANI_MSG1("xmm6", "xmm5");
+
+		SHANI_SCHED_ROUNDS(48, "xmm3");
+		SHANI_MSG2("xmm3", "xmm6", "xmm4");
+		SHANI_MSG1("xmm3", "xmm6");
+
+		/* Rounds 52 - 63, the schedule only needs finishing */
+		SHANI_SCHED_ROUNDS(52, "xmm4");
+		SHANI_MSG2("xmm4", "xmm3", "xmm5");
+
+		SHANI_SCHED_ROUNDS(56, "xmm5");
+		SHANI_MSG2("xmm5", "xmm4", "xmm6");
+
+		SHANI_SCHED_ROUNDS(60, "xmm6");
+
+		asm volatile("paddd %xmm9, %xmm1");
+		asm volatile("paddd %xmm10, %xmm2");
+	}
+
+	/* Reorder the state back to ABCD, EFGH */
+	asm volatile("pshufd $0x1B, %xmm1, %xmm1");
+	asm volatile("pshufd $0xB1, %xmm2, %xmm2");
+	asm volatile("movdqa %xmm1, %xmm7");
+	asm volatile("pblendw $0xF0, %xmm2, %xmm1");
+	asm volatile("palignr $8, %xmm7, %xmm2");
+	asm volatile("movdqu %%xmm1, %0" : "=m" (ctx->state.s32[0]) ::
+	    "memory");
+	asm volatile("movdqu %%xmm2, %0" : "=m" (ctx->state.s32[4]) ::
+	    "memory");
+
+	kfpu_end();
+}
+
+static boolean_t
+sha256_shani_valid(void)
+{
+	return (zfs_shani_available() && zfs_ssse3_available() &&
+	    zfs_sse4_1_available());
+}
+
+const sha2_ops_t sha256_shani_ops = {
+	.transform = sha256_shani_transform,
+	.valid = sha256_shani_valid,
+	.name = "shani"
+};
+
+#endif /* defined(__amd64) && defined(HAVE_SHA_NI) */
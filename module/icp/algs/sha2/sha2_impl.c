@@ -0,0 +1,478 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Runtime selection of the SHA256 and SHA384/512 block transforms.
+ *
+ * Like fletcher 4 (see zfs_fletcher.c), every implementation which is
+ * usable on this CPU is benchmarked when the module is loaded, and the
+ * fastest one is used unless a specific one is chosen through the
+ * zfs_sha256_impl and zfs_sha512_impl module parameters.  The results
+ * are reported in the "sha2_bench" kstat.
+ */
+
+#include <sys/zfs_context.h>
+#define	_SHA2_IMPL
+#include <sys/sha2.h>
+#include <sha2/sha2_impl.h>
+
+#if defined(__amd64)
+extern void SHA256TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
+extern void SHA512TransformBlocks(SHA2_CTX *ctx, const void *in, size_t num);
+
+static boolean_t
+sha2_x86_64_valid(void)
+{
+	return (B_TRUE);
+}
+
+const sha2_ops_t sha256_x86_64_ops = {
+	.transform = SHA256TransformBlocks,
+	.valid = sha2_x86_64_valid,
+	.name = "x86_64"
+};
+
+const sha2_ops_t sha512_x86_64_ops = {
+	.transform = SHA512TransformBlocks,
+	.valid = sha2_x86_64_valid,
+	.name = "x86_64"
+};
+#endif
+
+static const sha2_ops_t *sha256_impls[] = {
+	&sha256_generic_ops,
+#if defined(__amd64)
+	&sha256_x86_64_ops,
+#endif
+#if defined(__amd64) && defined(HAVE_SHA_NI)
+	&sha256_shani_ops,
+#endif
+};
+
+static const sha2_ops_t *sha512_impls[] = {
+	&sha512_generic_ops,
+#if defined(__amd64)
+	&sha512_x86_64_ops,
+#endif
+};
+
+#define	SHA2_IMPL_MAX		MAX(ARRAY_SIZE(sha256_impls), \
+				    ARRAY_SIZE(sha512_impls))
+
+/*
+ * The implementation used before sha2_impl_init(), which must not need
+ * any instruction set extensions.
+ */
+#if defined(__amd64)
+#define	SHA2_IMPL_BOOT	1	/* x86_64 */
+#else
+#define	SHA2_IMPL_BOOT	0	/* generic */
+#endif
+
+/* Select sha2 implementation */
+#define	IMPL_FASTEST	(UINT32_MAX)
+#define	IMPL_CYCLE	(UINT32_MAX - 1)
+
+#define	IMPL_READ(i)	(*(volatile uint32_t *) &(i))
+
+typedef struct sha2_impl {
+	const char		*si_name;	/* algorithm name */
+	uint64_t		si_mech;	/* for SHA2Init() */
+	const sha2_ops_t	**si_impls;	/* compiled in */
+	uint32_t		si_impls_cnt;
+	const sha2_ops_t	*si_supp[SHA2_IMPL_MAX]; /* usable on this CPU */
+	uint32_t		si_supp_cnt;
+	uint64_t		si_bw[SHA2_IMPL_MAX];	/* benchmark, B/s */
+	uint32_t		si_fastest;
+	uint32_t		si_chosen;
+} sha2_impl_t;
+
+static sha2_impl_t sha256_impl = {
+	.si_name = "sha256",
+	.si_mech = SHA256,
+	.si_impls = sha256_impls,
+	.si_impls_cnt = ARRAY_SIZE(sha256_impls),
+	.si_chosen = IMPL_FASTEST
+};
+
+static sha2_impl_t sha512_impl = {
+	.si_name = "sha512",
+	.si_mech = SHA512,
+	.si_impls = sha512_impls,
+	.si_impls_cnt = ARRAY_SIZE(sha512_impls),
+	.si_chosen = IMPL_FASTEST
+};
+
+static sha2_impl_t *sha2_impls[] = {
+	&sha256_impl,
+	&sha512_impl
+};
+
+/* Indicate that benchmark has been completed */
+static boolean_t sha2_initialized = B_FALSE;
+
+static const sha2_ops_t *
+sha2_impl_get(sha2_impl_t *si)
+{
+	const uint32_t impl = IMPL_READ(si->si_chosen);
+
+	if (!sha2_initialized)
+		return (si->si_impls[SHA2_IMPL_BOOT]);
+
+	switch (impl) {
+	case IMPL_FASTEST:
+		return (si->si_supp[si->si_fastest]);
+#if !defined(_KERNEL)
+	case IMPL_CYCLE: {
+		static uint32_t cycle_count = 0;
+		uint32_t idx = (++cycle_count) % si->si_supp_cnt;
+		return (si->si_supp[idx]);
+	}
+#endif
+	default:
+		ASSERT3U(impl, <, si->si_supp_cnt);
+		return (si->si_supp[impl]);
+	}
+}
+
+const sha2_ops_t *
+sha256_impl_get(void)
+{
+	return (sha2_impl_get(&sha256_impl));
+}
+
+const sha2_ops_t *
+sha512_impl_get(void)
+{
+	return (sha2_impl_get(&sha512_impl));
+}
+
+static int
+sha2_impl_set(sha2_impl_t *si, const char *val)
+{
+	int err = -EINVAL;
+	uint32_t impl = IMPL_READ(si->si_chosen);
+	size_t i, val_len;
+
+	val_len = strlen(val);
+	while ((val_len > 0) && !!isspace(val[val_len-1])) /* trim '\n' */
+		val_len--;
+
+	if (val_len == strlen("fastest") &&
+	    strncmp(val, "fastest", val_len) == 0) {
+		impl = IMPL_FASTEST;
+		err = 0;
+	}
+#if !defined(_KERNEL)
+	if (val_len == strlen("cycle") && strncmp(val, "cycle", val_len) == 0) {
+		impl = IMPL_CYCLE;
+		err = 0;
+	}
+#endif
+
+	if (err != 0 && sha2_initialized) {
+		/* check all supported implementations */
+		for (i = 0; i < si->si_supp_cnt; i++) {
+			const char *name = si->si_supp[i]->name;
+
+			if (val_len == strlen(name) &&
+			    strncmp(val, name, val_len) == 0) {
+				impl = i;
+				err = 0;
+				break;
+			}
+		}
+	}
+
+	if (err == 0) {
+#if defined(_KERNEL)
+		atomic_swap_32(&si->si_chosen, impl);
+		membar_producer();
+#else
+		/* libicp is linked without libspl's atomics in userland */
+		si->si_chosen = impl;
+#endif
+	}
+
+	return (err);
+}
+
+int
+sha256_impl_set(const char *val)
+{
+	return (sha2_impl_set(&sha256_impl, val));
+}
+
+int
+sha512_impl_set(const char *val)
+{
+	return (sha2_impl_set(&sha512_impl, val));
+}
+
+#if defined(_KERNEL)
+static kstat_t *sha2_kstat;
+
+/* SHA2 kstats */
+
+static int
+sha2_kstat_headers(char *buf, size_t size)
+{
+	ssize_t off = 0;
+
+	off += snprintf(buf + off, size, "%-10s", "algorithm");
+	off += snprintf(buf + off, size - off, "%-17s", "implementation");
+	(void) snprintf(buf + off, size - off, "%-15s\n", "bandwidth");
+
+	return (0);
+}
+
+/*
+ * Each algorithm has a row per supported implementation, followed by a
+ * "fastest" row naming the implementation picked by the benchmark.
+ */
+static int
+sha2_kstat_data(char *buf, size_t size, void *data)
+{
+	uint64_t n = (uint64_t)(uintptr_t)data - 1;
+	sha2_impl_t *si;
+	ssize_t off = 0;
+	int a;
+
+	for (a = 0; a < ARRAY_SIZE(sha2_impls); a++) {
+		si = sha2_impls[a];
+		if (n <= si->si_supp_cnt)
+			break;
+		n -= si->si_supp_cnt + 1;
+	}
+	ASSERT3U(a, <, ARRAY_SIZE(sha2_impls));
+
+	off += snprintf(buf + off, size - off, "%-10s", si->si_name);
+	if (n == si->si_supp_cnt) {
+		off += snprintf(buf + off, size - off, "%-17s", "fastest");
+		(void) snprintf(buf + off, size - off, "%-15s\n",
+		    si->si_supp[si->si_fastest]->name);
+	} else {
+		off += snprintf(buf + off, size - off, "%-17s",
+		    si->si_supp[n]->name);
+		(void) snprintf(buf + off, size - off, "%-15llu\n",
+		    (u_longlong_t)si->si_bw[n]);
+	}
+
+	return (0);
+}
+
+static void *
+sha2_kstat_addr(kstat_t *ksp, loff_t n)
+{
+	loff_t rows = 0;
+	int a;
+
+	for (a = 0; a < ARRAY_SIZE(sha2_impls); a++)
+		rows += sha2_impls[a]->si_supp_cnt + 1;
+
+	/* The row number is biased by one so that it is never NULL */
+	if (n < rows)
+		ksp->ks_private = (void *)(uintptr_t)(n + 1);
+	else
+		ksp->ks_private = NULL;
+
+	return (ksp->ks_private);
+}
+
+#define	SHA2_BENCH_NS	(MSEC2NSEC(10))		/* 10ms */
+
+static void
+sha2_benchmark_impl(sha2_impl_t *si, const char *data, size_t data_size)
+{
+	hrtime_t start;
+	uint64_t run_bw, run_time_ns, best_run = 0;
+	uint8_t digest[SHA512_DIGEST_LENGTH];
+	SHA2_CTX ctx;
+	uint32_t i, l, sel_save = IMPL_READ(si->si_chosen);
+
+	for (i = 0; i < si->si_supp_cnt; i++) {
+		uint64_t run_count = 0;
+
+		/* temporary set an implementation */
+		si->si_chosen = i;
+
+		kpreempt_disable();
+		start = gethrtime();
+		do {
+			for (l = 0; l < 4; l++, run_count++) {
+				SHA2Init(si->si_mech, &ctx);
+				SHA2Update(&ctx, data, data_size);
+				SHA2Final(digest, &ctx);
+			}
+
+			run_time_ns = gethrtime() - start;
+		} while (run_time_ns < SHA2_BENCH_NS);
+		kpreempt_enable();
+
+		run_bw = data_size * run_count * NANOSEC;
+		run_bw /= run_time_ns;	/* B/s */
+		si->si_bw[i] = run_bw;
+
+		if (run_bw > best_run) {
+			best_run = run_bw;
+			si->si_fastest = i;
+		}
+	}
+
+	/* restore original selection */
+	atomic_swap_32(&si->si_chosen, sel_save);
+}
+
+static void
+sha2_benchmark(void)
+{
+	static const size_t data_size = 1 << 14; /* 16kiB */
+	char *databuf;
+	int a, i;
+
+	/* Benchmark all supported implementations */
+	databuf = vmem_alloc(data_size, KM_SLEEP);
+	for (i = 0; i < data_size / sizeof (uint64_t); i++)
+		((uint64_t *)databuf)[i] = (uintptr_t)(databuf+i); /* warm-up */
+
+	for (a = 0; a < ARRAY_SIZE(sha2_impls); a++)
+		sha2_benchmark_impl(sha2_impls[a], databuf, data_size);
+
+	vmem_free(databuf, data_size);
+
+	/* install kstats for all implementations */
+	sha2_kstat = kstat_create("zfs", 0, "sha2_bench", "misc",
+	    KSTAT_TYPE_RAW, 0, KSTAT_FLAG_VIRTUAL);
+	if (sha2_kstat != NULL) {
+		sha2_kstat->ks_data = NULL;
+		sha2_kstat->ks_ndata = UINT32_MAX;
+		kstat_set_raw_ops(sha2_kstat,
+		    sha2_kstat_headers,
+		    sha2_kstat_data,
+		    sha2_kstat_addr);
+		kstat_install(sha2_kstat);
+	}
+}
+#endif /* _KERNEL */
+
+void
+sha2_impl_init(void)
+{
+	sha2_impl_t *si;
+	int a, i, c;
+
+	/* move supported impl into si_supp */
+	for (a = 0; a < ARRAY_SIZE(sha2_impls); a++) {
+		si = sha2_impls[a];
+
+		for (i = 0, c = 0; i < si->si_impls_cnt; i++) {
+			const sha2_ops_t *curr_impl = si->si_impls[i];
+
+			if (curr_impl->valid && curr_impl->valid())
+				si->si_supp[c++] = curr_impl;
+		}
+		si->si_supp_cnt = c;	/* number of supported impl */
+
+		/* Until the benchmark has run, use the last one as fastest */
+		si->si_fastest = c - 1;
+	}
+#if defined(_KERNEL)
+	membar_producer();	/* complete si_supp[] init */
+	sha2_initialized = B_TRUE;
+
+	sha2_benchmark();
+#else
+	/* Skip benchmarking and use last implementation as fastest */
+	sha2_initialized = B_TRUE;
+#endif
+}
+
+void
+sha2_impl_fini(void)
+{
+#if defined(_KERNEL)
+	if (sha2_kstat != NULL) {
+		kstat_delete(sha2_kstat);
+		sha2_kstat = NULL;
+	}
+#endif
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+#include <linux/mod_compat.h>
+
+static int
+sha2_param_get(sha2_impl_t *si, char *buffer)
+{
+	const uint32_t impl = IMPL_READ(si->si_chosen);
+	char *fmt;
+	int i, cnt = 0;
+
+	/* list fastest */
+	fmt = (impl == IMPL_FASTEST) ? "[%s] " : "%s ";
+	cnt += sprintf(buffer + cnt, fmt, "fastest");
+
+	/* list all supported implementations */
+	for (i = 0; i < si->si_supp_cnt; i++) {
+		fmt = (i == impl) ? "[%s] " : "%s ";
+		cnt += sprintf(buffer + cnt, fmt, si->si_supp[i]->name);
+	}
+
+	return (cnt);
+}
+
+static int
+sha256_param_get(char *buffer, zfs_kernel_param_t *unused)
+{
+	return (sha2_param_get(&sha256_impl, buffer));
+}
+
+static int
+sha256_param_set(const char *val, zfs_kernel_param_t *unused)
+{
+	return (sha256_impl_set(val));
+}
+
+static int
+sha512_param_get(char *buffer, zfs_kernel_param_t *unused)
+{
+	return (sha2_param_get(&sha512_impl, buffer));
+}
+
+static int
+sha512_param_set(const char *val, zfs_kernel_param_t *unused)
+{
+	return (sha512_impl_set(val));
+}
+
+/*
+ * Choose the SHA256 and SHA384/512 implementations.
+ * Users can choose "cycle" to exercise all implementations, but this is
+ * for testing purpose therefore it can only be set in user space.
+ */
+module_param_call(zfs_sha256_impl,
+    sha256_param_set, sha256_param_get, NULL, 0644);
+MODULE_PARM_DESC(zfs_sha256_impl, "Select SHA256 implementation.");
+
+module_param_call(zfs_sha512_impl,
+    sha512_param_set, sha512_param_get, NULL, 0644);
+MODULE_PARM_DESC(zfs_sha512_impl, "Select SHA384/512 implementation.");
+#endif
@@ -0,0 +1,77 @@
+/*
+ * CDDL HEADER START
+ *
+ * The contents of this file are subject to the terms of the
+ * Common Development and Distribution License (the "License").
+ * You may not use this file except in compliance with the License.
+ *
+ * You can obtain a copy of the license at usr/src/OPENSOLARIS.LICENSE
+ * or http://www.opensolaris.org/os/licensing.
+ * See the License for the specific language governing permissions
+ * and limitations under the License.
+ *
+ * When distributing Covered Code, include this CDDL HEADER in each
+ * file and include the License file at usr/src/OPENSOLARIS.LICENSE.
+ * If applicable, add the following below this CDDL HEADER, with the
+ * fields enclosed by brackets "[]" replaced with your own identifying
+ * information: Portions Copyright [yyyy] [name of copyright owner]
+ *
+ * CDDL HEADER END
+ */
+
+#ifndef	_GCM_IMPL_H
+#define	_GCM_IMPL_H
+
+#include <modes/modes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * GCM implementations, selected at runtime.
+ *
+ * mul multiplies two elements of GF(2^128), in the byte order of gcm_mul().
+ *
+ * If fpu is set, mul and crypt_blocks use SIMD registers and must be called
+ * between kfpu_begin() and kfpu_end().  The GCM routines save the FPU state
+ * once per call rather than once per block.
+ *
+ * crypt_blocks is optional.  When present it encrypts (or decrypts) and
+ * hashes whole blocks of AES-GCM data in a single pass, updating the
+ * counter block and GHASH of the context.  It returns the number of bytes
+ * processed, which may be less than len, or zero if it can not handle the
+ * context's key schedule.
+ */
+typedef void (*gcm_mul_f)(uint64_t *x_in, uint64_t *y, uint64_t *res);
+typedef size_t (*gcm_crypt_blocks_f)(gcm_ctx_t *ctx, const uint8_t *in,
+    uint8_t *out, size_t len, boolean_t encrypt);
+typedef boolean_t (*gcm_valid_f)(void);
+
+typedef struct gcm_ops {
+	gcm_mul_f		mul;
+	gcm_crypt_blocks_f	crypt_blocks;
+	gcm_valid_f		valid;
+	boolean_t		fpu;
+	const char		*name;
+} gcm_ops_t;
+
+extern const gcm_ops_t gcm_generic_ops;
+#if defined(__amd64)
+extern const gcm_ops_t gcm_pclmulqdq_ops;
+extern void gcm_mul_pclmulqdq(uint64_t *x_in, uint64_t *y, uint64_t *res);
+#endif
+#if defined(__amd64) && defined(HAVE_AES) && defined(HAVE_PCLMULQDQ)
+extern const gcm_ops_t gcm_aesni_ops;
+#endif
+
+extern const gcm_ops_t *gcm_impl_get(void);
+extern int gcm_impl_set(const char *val);
+extern void gcm_impl_init(void);
+extern void gcm_impl_fini(void);
+
+#ifdef	__cplusplus
+}
+#endif
+
+#endif	/* _GCM_IMPL_H */
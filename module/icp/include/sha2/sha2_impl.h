@@ -57,6 +57,36 @@ typedef struct sha2_hmac_ctx {
 	SHA2_CTX		hc_ocontext;	/* outer SHA2 context */
 } sha2_hmac_ctx_t;
 
+/*
+ * Block transform implementations, selected at runtime.  A transform
+ * processes 'num' consecutive 64 (SHA256) or 128 (SHA384/512) byte blocks.
+ */
+typedef void (*sha2_transform_f)(SHA2_CTX *ctx, const void *in, size_t num);
+typedef boolean_t (*sha2_valid_f)(void);
+
+typedef struct sha2_ops {
+	sha2_transform_f	transform;
+	sha2_valid_f		valid;
+	const char		*name;
+} sha2_ops_t;
+
+extern const sha2_ops_t sha256_generic_ops;
+extern const sha2_ops_t sha512_generic_ops;
+#if defined(__amd64)
+extern const sha2_ops_t sha256_x86_64_ops;
+extern const sha2_ops_t sha512_x86_64_ops;
+#endif
+#if defined(__amd64) && defined(HAVE_SHA_NI)
+extern const sha2_ops_t sha256_shani_ops;
+#endif
+
+extern const sha2_ops_t *sha256_impl_get(void);
+extern const sha2_ops_t *sha512_impl_get(void);
+extern int sha256_impl_set(const char *val);
+extern int sha512_impl_set(const char *val);
+extern void sha2_impl_init(void);
+extern void sha2_impl_fini(void);
+
 #ifdef	__cplusplus
 }
 #endif
@@ -28,10 +28,13 @@
 
 #include <sys/zfs_context.h>
 #include <sys/crypto/common.h>
+#include <sys/crypto/api.h>
 #include <sys/crypto/impl.h>
 #include <sys/crypto/spi.h>
+#include <sys/crypto/sched_impl.h>
 #include <sys/crypto/icp.h>
 #include <modes/modes.h>
+#include <modes/gcm_impl.h>
 #include <sys/modctl.h>
 #define	_AES_IMPL
 #include <aes/aes_impl.h>
@@ -200,11 +203,18 @@ static crypto_provider_info_t aes_prov_info = {{{{
 static crypto_kcf_provider_handle_t aes_prov_handle = 0;
 static crypto_data_t null_crypto_data = { CRYPTO_DATA_RAW };
 
+/* KCF mechanism numbers of AES-CCM and AES-GCM, for the direct calls */
+static crypto_mech_type_t aes_ccm_mech_type = CRYPTO_MECH_INVALID;
+static crypto_mech_type_t aes_gcm_mech_type = CRYPTO_MECH_INVALID;
+
 int
 aes_mod_init(void)
 {
 	int ret;
 
+	/* Determine the fastest available GCM implementation */
+	gcm_impl_init();
+
 	if ((ret = mod_install(&modlinkage)) != 0)
 		return (ret);
 
@@ -214,6 +224,9 @@ aes_mod_init(void)
 		return (EACCES);
 	}
 
+	aes_ccm_mech_type = crypto_mech2id(SUN_CKM_AES_CCM);
+	aes_gcm_mech_type = crypto_mech2id(SUN_CKM_AES_GCM);
+
 	return (0);
 }
 
@@ -226,8 +239,12 @@ aes_mod_fini(void)
 			return (EBUSY);
 
 		aes_prov_handle = 0;
+		aes_ccm_mech_type = CRYPTO_MECH_INVALID;
+		aes_gcm_mech_type = CRYPTO_MECH_INVALID;
 	}
 
+	gcm_impl_fini();
+
 	return (mod_remove(&modlinkage));
 }
 
@@ -1435,3 +1452,147 @@ aes_mac_verify_atomic(crypto_provider_handle_t provider,
 	return (aes_decrypt_atomic(provider, session_id, &gcm_mech,
 	    key, mac, &null_crypto_data, template, req));
 }
+
+/*
+ * Translate a KCF mechanism and context template into the ones of this
+ * provider, as provider selection would have done.  A template created by
+ * another provider is ignored and the key schedule expanded from the key.
+ */
+static int
+aes_direct_mech(crypto_mechanism_t *mech, crypto_ctx_template_t tmpl,
+    crypto_mechanism_t *lmech, crypto_spi_ctx_template_t *spi_tmpl)
+{
+	kcf_ctx_template_t *ctx_tmpl = (kcf_ctx_template_t *)tmpl;
+
+	if (mech->cm_type == CRYPTO_MECH_INVALID)
+		return (CRYPTO_MECHANISM_INVALID);
+
+	*lmech = *mech;
+	if (mech->cm_type == aes_ccm_mech_type)
+		lmech->cm_type = AES_CCM_MECH_INFO_TYPE;
+	else if (mech->cm_type == aes_gcm_mech_type)
+		lmech->cm_type = AES_GCM_MECH_INFO_TYPE;
+	else
+		return (CRYPTO_MECHANISM_INVALID);
+
+	if (ctx_tmpl != NULL && ctx_tmpl->ct_prov_handle == aes_prov_handle)
+		*spi_tmpl = ctx_tmpl->ct_prov_tmpl;
+	else
+		*spi_tmpl = NULL;
+
+	return (CRYPTO_SUCCESS);
+}
+
+int
+crypto_aes_encrypt(crypto_mechanism_t *mech, crypto_data_t *plaintext,
+    crypto_key_t *key, crypto_ctx_template_t tmpl, crypto_data_t *ciphertext)
+{
+	crypto_mechanism_t lmech;
+	crypto_spi_ctx_template_t spi_tmpl;
+	int ret;
+
+	ret = aes_direct_mech(mech, tmpl, &lmech, &spi_tmpl);
+	if (ret != CRYPTO_SUCCESS)
+		return (ret);
+
+	return (aes_encrypt_atomic(NULL, 0, &lmech, key, plaintext,
+	    ciphertext, spi_tmpl, NULL));
+}
+
+int
+crypto_aes_decrypt(crypto_mechanism_t *mech, crypto_data_t *ciphertext,
+    crypto_key_t *key, crypto_ctx_template_t tmpl, crypto_data_t *plaintext)
+{
+	crypto_mechanism_t lmech;
+	crypto_spi_ctx_template_t spi_tmpl;
+	int ret;
+
+	ret = aes_direct_mech(mech, tmpl, &lmech, &spi_tmpl);
+	if (ret != CRYPTO_SUCCESS)
+		return (ret);
+
+	return (aes_decrypt_atomic(NULL, 0, &lmech, key, ciphertext,
+	    plaintext, spi_tmpl, NULL));
+}
+
+int
+crypto_aes_encrypt_init(crypto_mechanism_t *mech, crypto_key_t *key,
+    crypto_ctx_template_t tmpl, crypto_aes_ctx_t *ctx)
+{
+	aes_ctx_t *aes_ctx = (aes_ctx_t *)ctx;
+	crypto_mechanism_t lmech;
+	crypto_spi_ctx_template_t spi_tmpl;
+	int ret;
+
+	CTASSERT(sizeof (aes_ctx_t) <= sizeof (crypto_aes_ctx_t));
+
+	ret = aes_direct_mech(mech, tmpl, &lmech, &spi_tmpl);
+	if (ret != CRYPTO_SUCCESS)
+		return (ret);
+
+	bzero(aes_ctx, sizeof (aes_ctx_t));
+
+	return (aes_common_init_ctx(aes_ctx, spi_tmpl, &lmech, key, KM_SLEEP,
+	    B_TRUE));
+}
+
+int
+crypto_aes_encrypt_update(crypto_aes_ctx_t *ctx, uint8_t *in, uint8_t *out,
+    size_t len)
+{
+	aes_ctx_t *aes_ctx = (aes_ctx_t *)ctx;
+	crypto_data_t ciphertext;
+
+	if ((len & (AES_BLOCK_LEN - 1)) != 0)
+		return (CRYPTO_DATA_LEN_RANGE);
+
+	ciphertext.cd_format = CRYPTO_DATA_RAW;
+	ciphertext.cd_offset = 0;
+	ciphertext.cd_length = len;
+	ciphertext.cd_raw.iov_base = (char *)out;
+	ciphertext.cd_raw.iov_len = len;
+	ciphertext.cd_miscdata = NULL;
+
+	return (aes_encrypt_contiguous_blocks(aes_ctx, (char *)in, len,
+	    &ciphertext));
+}
+
+int
+crypto_aes_encrypt_final(crypto_aes_ctx_t *ctx, uint8_t *mac, size_t maclen)
+{
+	aes_ctx_t *aes_ctx = (aes_ctx_t *)ctx;
+	crypto_data_t macdata;
+	int ret;
+
+	macdata.cd_format = CRYPTO_DATA_RAW;
+	macdata.cd_offset = 0;
+	macdata.cd_length = maclen;
+	macdata.cd_raw.iov_base = (char *)mac;
+	macdata.cd_raw.iov_len = maclen;
+	macdata.cd_miscdata = NULL;
+
+	if (aes_ctx->ac_flags & CCM_MODE) {
+		ret = ccm_encrypt_final((ccm_ctx_t *)aes_ctx, &macdata,
+		    AES_BLOCK_LEN, aes_encrypt_block, aes_xor_block);
+	} else {
+		ret = gcm_encrypt_final((gcm_ctx_t *)aes_ctx, &macdata,
+		    AES_BLOCK_LEN, aes_encrypt_block, aes_copy_block,
+		    aes_xor_block);
+	}
+
+	if (aes_ctx->ac_flags & PROVIDER_OWNS_KEY_SCHEDULE) {
+		bzero(aes_ctx->ac_keysched, aes_ctx->ac_keysched_len);
+		kmem_free(aes_ctx->ac_keysched, aes_ctx->ac_keysched_len);
+	}
+	bzero(aes_ctx, sizeof (aes_ctx_t));
+
+	return (ret);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(crypto_aes_encrypt);
+EXPORT_SYMBOL(crypto_aes_decrypt);
+EXPORT_SYMBOL(crypto_aes_encrypt_init);
+EXPORT_SYMBOL(crypto_aes_encrypt_update);
+EXPORT_SYMBOL(crypto_aes_encrypt_final);
+#endif
@@ -216,6 +216,9 @@ sha2_mod_init(void)
 {
 	int ret;
 
+	/* Determine the fastest available block transforms */
+	sha2_impl_init();
+
 	if ((ret = mod_install(&modlinkage)) != 0)
 		return (ret);
 
@@ -248,6 +251,8 @@ sha2_mod_fini(void)
 		sha2_prov_handle = 0;
 	}
 
+	sha2_impl_fini();
+
 	return (mod_remove(&modlinkage));
 }
 
@@ -61,7 +61,8 @@ zfs_allocatable_devs(nvlist_t *nv)
 		is_log = 0;
 		(void) nvlist_lookup_uint64(child[c], ZPOOL_CONFIG_IS_LOG,
 		    &is_log);
-		if (!is_log)
+		if (!is_log && !nvlist_exists(child[c],
+		    ZPOOL_CONFIG_ALLOCATION_BIAS))
 			return (B_TRUE);
 	}
 	return (B_FALSE);
@@ -323,6 +323,16 @@ static kcondvar_t	arc_reclaim_waiters_cv;
  */
 int zfs_arc_evict_batch_limit = 10;
 
+/*
+ * The number of threads arc_evict_state() spreads a large eviction
+ * across, each of which works on its own range of the state's sublists.
+ * If this is not set to a suitable value by the user, it will be
+ * configured based on the number of CPUs on the system in arc_init().
+ */
+int zfs_arc_evict_threads = 0;
+static int arc_evict_nthreads;
+static taskq_t *arc_evict_taskq;
+
 /*
  * The number of sublists used for each of the arc state lists. If this
  * is not set to a suitable value by the user, it will be configured to
@@ -458,6 +468,13 @@ typedef struct arc_stats {
 	 * buffers to reach its target amount.
 	 */
 	kstat_named_t arcstat_evict_not_enough;
+	/*
+	 * Number of times an allocation had to wait for eviction because
+	 * the ARC was overflowing, and the total time (in nanoseconds)
+	 * spent waiting.
+	 */
+	kstat_named_t arcstat_evict_wait_count;
+	kstat_named_t arcstat_evict_wait_ns;
 	kstat_named_t arcstat_evict_l2_cached;
 	kstat_named_t arcstat_evict_l2_eligible;
 	kstat_named_t arcstat_evict_l2_ineligible;
@@ -467,6 +484,25 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_hash_collisions;
 	kstat_named_t arcstat_hash_chains;
 	kstat_named_t arcstat_hash_chain_max;
+	/*
+	 * Number of buckets in the hash table, and number of times it was
+	 * resized.
+	 */
+	kstat_named_t arcstat_hash_buckets;
+	kstat_named_t arcstat_hash_resizes;
+	/*
+	 * Number of insertions into the hash table which made a chain of
+	 * 1, 2, 3 to 4, 5 to 8, and more than 8 headers.
+	 */
+	kstat_named_t arcstat_hash_insert_chain_1;
+	kstat_named_t arcstat_hash_insert_chain_2;
+	kstat_named_t arcstat_hash_insert_chain_4;
+	kstat_named_t arcstat_hash_insert_chain_8;
+	kstat_named_t arcstat_hash_insert_chain_long;
+	/*
+	 * Number of times a lookup or insertion found its hash lock held.
+	 */
+	kstat_named_t arcstat_hash_lock_contended;
 	kstat_named_t arcstat_p;
 	kstat_named_t arcstat_c;
 	kstat_named_t arcstat_c_min;
@@ -644,9 +680,40 @@ typedef struct arc_stats {
 	kstat_named_t arcstat_l2_abort_lowmem;
 	kstat_named_t arcstat_l2_cksum_bad;
 	kstat_named_t arcstat_l2_io_error;
+	/*
+	 * Buffers not written to the L2ARC because recompressing them
+	 * didn't fit the block's physical size, see
+	 * l2arc_apply_transforms().
+	 */
+	kstat_named_t arcstat_l2_recompress_fail;
 	kstat_named_t arcstat_l2_size;
 	kstat_named_t arcstat_l2_asize;
 	kstat_named_t arcstat_l2_hdr_size;
+	/*
+	 * Bytes of memory used by L2ARC headers per MB of data on the
+	 * cache devices, to size the L2ARC against the memory it costs.
+	 */
+	kstat_named_t arcstat_l2_hdr_bytes_per_mb;
+	/*
+	 * Persistent L2ARC: number of log blocks written to cache devices,
+	 * and the outcome of rebuilding L2-only headers from them on pool
+	 * import. The size, bufs and log_blks counters grow while a rebuild
+	 * is in progress; rebuild_time_ms is the duration of the most
+	 * recently completed rebuild.
+	 */
+	kstat_named_t arcstat_l2_log_blk_writes;
+	kstat_named_t arcstat_l2_rebuild_active;
+	kstat_named_t arcstat_l2_rebuild_success;
+	kstat_named_t arcstat_l2_rebuild_unsupported;
+	kstat_named_t arcstat_l2_rebuild_io_errors;
+	kstat_named_t arcstat_l2_rebuild_cksum_lb_errors;
+	kstat_named_t arcstat_l2_rebuild_lowmem;
+	kstat_named_t arcstat_l2_rebuild_size;
+	kstat_named_t arcstat_l2_rebuild_asize;
+	kstat_named_t arcstat_l2_rebuild_bufs;
+	kstat_named_t arcstat_l2_rebuild_bufs_precached;
+	kstat_named_t arcstat_l2_rebuild_log_blks;
+	kstat_named_t arcstat_l2_rebuild_time_ms;
 	kstat_named_t arcstat_memory_throttle_count;
 	kstat_named_t arcstat_memory_direct_count;
 	kstat_named_t arcstat_memory_indirect_count;
@@ -685,6 +752,8 @@ static arc_stats_t arc_stats = {
 	{ "mutex_miss",			KSTAT_DATA_UINT64 },
 	{ "evict_skip",			KSTAT_DATA_UINT64 },
 	{ "evict_not_enough",		KSTAT_DATA_UINT64 },
+	{ "evict_wait_count",		KSTAT_DATA_UINT64 },
+	{ "evict_wait_ns",		KSTAT_DATA_UINT64 },
 	{ "evict_l2_cached",		KSTAT_DATA_UINT64 },
 	{ "evict_l2_eligible",		KSTAT_DATA_UINT64 },
 	{ "evict_l2_ineligible",	KSTAT_DATA_UINT64 },
@@ -694,6 +763,14 @@ static arc_stats_t arc_stats = {
 	{ "hash_collisions",		KSTAT_DATA_UINT64 },
 	{ "hash_chains",		KSTAT_DATA_UINT64 },
 	{ "hash_chain_max",		KSTAT_DATA_UINT64 },
+	{ "hash_buckets",		KSTAT_DATA_UINT64 },
+	{ "hash_resizes",		KSTAT_DATA_UINT64 },
+	{ "hash_insert_chain_1",	KSTAT_DATA_UINT64 },
+	{ "hash_insert_chain_2",	KSTAT_DATA_UINT64 },
+	{ "hash_insert_chain_4",	KSTAT_DATA_UINT64 },
+	{ "hash_insert_chain_8",	KSTAT_DATA_UINT64 },
+	{ "hash_insert_chain_long",	KSTAT_DATA_UINT64 },
+	{ "hash_lock_contended",	KSTAT_DATA_UINT64 },
 	{ "p",				KSTAT_DATA_UINT64 },
 	{ "c",				KSTAT_DATA_UINT64 },
 	{ "c_min",			KSTAT_DATA_UINT64 },
@@ -740,9 +817,24 @@ static arc_stats_t arc_stats = {
 	{ "l2_abort_lowmem",		KSTAT_DATA_UINT64 },
 	{ "l2_cksum_bad",		KSTAT_DATA_UINT64 },
 	{ "l2_io_error",		KSTAT_DATA_UINT64 },
+	{ "l2_recompress_fail",		KSTAT_DATA_UINT64 },
 	{ "l2_size",			KSTAT_DATA_UINT64 },
 	{ "l2_asize",			KSTAT_DATA_UINT64 },
 	{ "l2_hdr_size",		KSTAT_DATA_UINT64 },
+	{ "l2_hdr_bytes_per_mb",	KSTAT_DATA_UINT64 },
+	{ "l2_log_blk_writes",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_active",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_success",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_unsupported",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_io_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_cksum_lb_errors",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_lowmem",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_size",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_asize",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_bufs_precached",	KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_log_blks",		KSTAT_DATA_UINT64 },
+	{ "l2_rebuild_time_ms",		KSTAT_DATA_UINT64 },
 	{ "memory_throttle_count",	KSTAT_DATA_UINT64 },
 	{ "memory_direct_count",	KSTAT_DATA_UINT64 },
 	{ "memory_indirect_count",	KSTAT_DATA_UINT64 },
@@ -904,31 +996,52 @@ static taskq_t *arc_prune_taskq;
  * Hash table routines
  */
 
+/*
+ * The buckets of the hash table are striped over BUF_LOCKS locks.  The
+ * table never has fewer than BUF_LOCKS buckets, so the lock of a header
+ * only depends on its hash value and stays the same when the table is
+ * resized.  The table is resized by the reclaim thread one stripe at a
+ * time, so each stripe records which table its buckets are currently in.
+ */
+#define	BUF_LOCKS 8192
+
 #define	HT_LOCK_ALIGN	64
-#define	HT_LOCK_PAD	(P2NPHASE(sizeof (kmutex_t), (HT_LOCK_ALIGN)))
+#define	HT_LOCK_SIZE	\
+	(sizeof (kmutex_t) + sizeof (void *) + sizeof (uint64_t))
+#define	HT_LOCK_PAD	(P2NPHASE(HT_LOCK_SIZE, (HT_LOCK_ALIGN)))
 
 struct ht_lock {
 	kmutex_t	ht_lock;
+	arc_buf_hdr_t	**ht_table;	/* table the buckets are in */
+	uint64_t	ht_mask;	/* and its mask */
 #ifdef _KERNEL
 	unsigned char	pad[HT_LOCK_PAD];
 #endif
 };
 
-#define	BUF_LOCKS 8192
 typedef struct buf_hash_table {
 	uint64_t ht_mask;
 	arc_buf_hdr_t **ht_table;
+	uint64_t ht_resize_mask;
+	arc_buf_hdr_t **ht_resize_table;	/* table being replaced */
 	struct ht_lock ht_locks[BUF_LOCKS];
 } buf_hash_table_t;
 
 static buf_hash_table_t buf_hash_table;
 
-#define	BUF_HASH_INDEX(spa, dva, birth) \
-	(buf_hash(spa, dva, birth) & buf_hash_table.ht_mask)
-#define	BUF_HASH_LOCK_NTRY(idx) (buf_hash_table.ht_locks[idx & (BUF_LOCKS-1)])
-#define	BUF_HASH_LOCK(idx)	(&(BUF_HASH_LOCK_NTRY(idx).ht_lock))
+#define	BUF_HASH_LOCK_NTRY(hv)	(buf_hash_table.ht_locks[(hv) & (BUF_LOCKS-1)])
+#define	BUF_HASH_LOCK(hv)	(&(BUF_HASH_LOCK_NTRY(hv).ht_lock))
 #define	HDR_LOCK(hdr) \
-	(BUF_HASH_LOCK(BUF_HASH_INDEX(hdr->b_spa, &hdr->b_dva, hdr->b_birth)))
+	(BUF_HASH_LOCK(buf_hash(hdr->b_spa, &hdr->b_dva, hdr->b_birth)))
+
+/*
+ * The table is doubled once it holds more than BUF_HASH_LOAD_MAX headers
+ * per bucket on average, and halved once it holds fewer than one header
+ * per BUF_HASH_LOAD_MIN buckets, though never below the size needed for
+ * arc_c_max (see buf_hash_table_target()).
+ */
+#define	BUF_HASH_LOAD_MAX	2
+#define	BUF_HASH_LOAD_MIN	8
 
 uint64_t zfs_crc64_table[256];
 
@@ -967,6 +1080,17 @@ int l2arc_noprefetch = B_TRUE;			/* don't cache prefetch bufs */
 int l2arc_feed_again = B_TRUE;			/* turbo warmup */
 int l2arc_norw = B_FALSE;			/* no reads during writes */
 
+/*
+ * Persistent L2ARC tunables. Log blocks describing the cached buffers are
+ * only written to devices of at least l2arc_rebuild_blocks_min_l2size
+ * bytes, since on smaller devices the log block overhead would eat into
+ * the useful capacity and rebuilding buys little. l2arc_rebuild_enabled
+ * controls whether the headers are restored from those log blocks when
+ * a cache device is added to the ARC, e.g. on pool import.
+ */
+int l2arc_rebuild_enabled = B_TRUE;
+unsigned long l2arc_rebuild_blocks_min_l2size = 1024 * 1024 * 1024;
+
 /*
  * L2ARC Internals
  */
@@ -1005,6 +1129,9 @@ static kmutex_t l2arc_feed_thr_lock;
 static kcondvar_t l2arc_feed_thr_cv;
 static uint8_t l2arc_thread_exit;
 
+static kmutex_t l2arc_rebuild_thr_lock;
+static kcondvar_t l2arc_rebuild_thr_cv;
+
 static abd_t *arc_get_data_abd(arc_buf_hdr_t *, uint64_t, void *);
 static void *arc_get_data_buf(arc_buf_hdr_t *, uint64_t, void *);
 static void arc_get_data_impl(arc_buf_hdr_t *, uint64_t, void *);
@@ -1020,13 +1147,18 @@ static void arc_tuning_update(void);
 static void arc_prune_async(int64_t);
 static uint64_t arc_all_memory(void);
 
-static arc_buf_contents_t arc_buf_type(arc_buf_hdr_t *);
+static arc_buf_contents_t arc_buf_type(const arc_buf_hdr_t *);
 static uint32_t arc_bufc_to_flags(arc_buf_contents_t);
 static inline void arc_hdr_set_flags(arc_buf_hdr_t *hdr, arc_flags_t flags);
 static inline void arc_hdr_clear_flags(arc_buf_hdr_t *hdr, arc_flags_t flags);
 
 static boolean_t l2arc_write_eligible(uint64_t, arc_buf_hdr_t *);
 static void l2arc_read_done(zio_t *);
+static uint64_t l2arc_write_distance(l2arc_dev_t *, uint64_t);
+static boolean_t l2arc_log_blk_insert(l2arc_dev_t *, const arc_buf_hdr_t *);
+static void l2arc_log_blk_commit(l2arc_dev_t *, zio_t *);
+static void l2arc_dev_hdr_update(l2arc_dev_t *);
+static void l2arc_rebuild_vdev(l2arc_dev_t *);
 
 static uint64_t
 buf_hash(uint64_t spa, const dva_t *dva, uint64_t birth)
@@ -1062,17 +1194,30 @@ buf_discard_identity(arc_buf_hdr_t *hdr)
 	hdr->b_birth = 0;
 }
 
+/*
+ * Acquire a hash lock, counting the times it was already held.
+ */
+static inline void
+buf_hash_lock_enter(kmutex_t *hash_lock)
+{
+	if (!mutex_tryenter(hash_lock)) {
+		ARCSTAT_BUMP(arcstat_hash_lock_contended);
+		mutex_enter(hash_lock);
+	}
+}
+
 static arc_buf_hdr_t *
 buf_hash_find(uint64_t spa, const blkptr_t *bp, kmutex_t **lockp)
 {
 	const dva_t *dva = BP_IDENTITY(bp);
 	uint64_t birth = BP_PHYSICAL_BIRTH(bp);
-	uint64_t idx = BUF_HASH_INDEX(spa, dva, birth);
-	kmutex_t *hash_lock = BUF_HASH_LOCK(idx);
+	uint64_t hv = buf_hash(spa, dva, birth);
+	struct ht_lock *hl = &BUF_HASH_LOCK_NTRY(hv);
+	kmutex_t *hash_lock = &hl->ht_lock;
 	arc_buf_hdr_t *hdr;
 
-	mutex_enter(hash_lock);
-	for (hdr = buf_hash_table.ht_table[idx]; hdr != NULL;
+	buf_hash_lock_enter(hash_lock);
+	for (hdr = hl->ht_table[hv & hl->ht_mask]; hdr != NULL;
 	    hdr = hdr->b_hash_next) {
 		if (HDR_EQUAL(spa, dva, birth, hdr)) {
 			*lockp = hash_lock;
@@ -1094,9 +1239,11 @@ buf_hash_find(uint64_t spa, const blkptr_t *bp, kmutex_t **lockp)
 static arc_buf_hdr_t *
 buf_hash_insert(arc_buf_hdr_t *hdr, kmutex_t **lockp)
 {
-	uint64_t idx = BUF_HASH_INDEX(hdr->b_spa, &hdr->b_dva, hdr->b_birth);
-	kmutex_t *hash_lock = BUF_HASH_LOCK(idx);
+	uint64_t hv = buf_hash(hdr->b_spa, &hdr->b_dva, hdr->b_birth);
+	struct ht_lock *hl = &BUF_HASH_LOCK_NTRY(hv);
+	kmutex_t *hash_lock = &hl->ht_lock;
 	arc_buf_hdr_t *fhdr;
+	uint64_t idx;
 	uint32_t i;
 
 	ASSERT(!DVA_IS_EMPTY(&hdr->b_dva));
@@ -1105,19 +1252,20 @@ buf_hash_insert(arc_buf_hdr_t *hdr, kmutex_t **lockp)
 
 	if (lockp != NULL) {
 		*lockp = hash_lock;
-		mutex_enter(hash_lock);
+		buf_hash_lock_enter(hash_lock);
 	} else {
 		ASSERT(MUTEX_HELD(hash_lock));
 	}
 
-	for (fhdr = buf_hash_table.ht_table[idx], i = 0; fhdr != NULL;
+	idx = hv & hl->ht_mask;
+	for (fhdr = hl->ht_table[idx], i = 0; fhdr != NULL;
 	    fhdr = fhdr->b_hash_next, i++) {
 		if (HDR_EQUAL(hdr->b_spa, &hdr->b_dva, hdr->b_birth, fhdr))
 			return (fhdr);
 	}
 
-	hdr->b_hash_next = buf_hash_table.ht_table[idx];
-	buf_hash_table.ht_table[idx] = hdr;
+	hdr->b_hash_next = hl->ht_table[idx];
+	hl->ht_table[idx] = hdr;
 	arc_hdr_set_flags(hdr, ARC_FLAG_IN_HASH_TABLE);
 
 	/* collect some hash table performance data */
@@ -1129,6 +1277,17 @@ buf_hash_insert(arc_buf_hdr_t *hdr, kmutex_t **lockp)
 		ARCSTAT_MAX(arcstat_hash_chain_max, i);
 	}
 
+	if (i < 1)
+		ARCSTAT_BUMP(arcstat_hash_insert_chain_1);
+	else if (i < 2)
+		ARCSTAT_BUMP(arcstat_hash_insert_chain_2);
+	else if (i < 4)
+		ARCSTAT_BUMP(arcstat_hash_insert_chain_4);
+	else if (i < 8)
+		ARCSTAT_BUMP(arcstat_hash_insert_chain_8);
+	else
+		ARCSTAT_BUMP(arcstat_hash_insert_chain_long);
+
 	ARCSTAT_BUMP(arcstat_hash_elements);
 	ARCSTAT_MAXSTAT(arcstat_hash_elements);
 
@@ -1139,12 +1298,14 @@ static void
 buf_hash_remove(arc_buf_hdr_t *hdr)
 {
 	arc_buf_hdr_t *fhdr, **hdrp;
-	uint64_t idx = BUF_HASH_INDEX(hdr->b_spa, &hdr->b_dva, hdr->b_birth);
+	uint64_t hv = buf_hash(hdr->b_spa, &hdr->b_dva, hdr->b_birth);
+	struct ht_lock *hl = &BUF_HASH_LOCK_NTRY(hv);
+	uint64_t idx = hv & hl->ht_mask;
 
-	ASSERT(MUTEX_HELD(BUF_HASH_LOCK(idx)));
+	ASSERT(MUTEX_HELD(&hl->ht_lock));
 	ASSERT(HDR_IN_HASH_TABLE(hdr));
 
-	hdrp = &buf_hash_table.ht_table[idx];
+	hdrp = &hl->ht_table[idx];
 	while ((fhdr = *hdrp) != hdr) {
 		ASSERT3P(fhdr, !=, NULL);
 		hdrp = &fhdr->b_hash_next;
@@ -1156,11 +1317,158 @@ buf_hash_remove(arc_buf_hdr_t *hdr)
 	/* collect some hash table performance data */
 	ARCSTAT_BUMPDOWN(arcstat_hash_elements);
 
-	if (buf_hash_table.ht_table[idx] &&
-	    buf_hash_table.ht_table[idx]->b_hash_next == NULL)
+	if (hl->ht_table[idx] &&
+	    hl->ht_table[idx]->b_hash_next == NULL)
 		ARCSTAT_BUMPDOWN(arcstat_hash_chains);
 }
 
+static arc_buf_hdr_t **
+buf_hash_table_alloc(uint64_t hsize, int kmflag)
+{
+#if defined(_KERNEL) && defined(HAVE_SPL)
+	/*
+	 * Large allocations which do not require contiguous pages
+	 * should be using vmem_alloc() in the linux kernel
+	 */
+	return (vmem_zalloc(hsize * sizeof (void *), kmflag));
+#else
+	return (kmem_zalloc(hsize * sizeof (void *), kmflag));
+#endif
+}
+
+static void
+buf_hash_table_free(arc_buf_hdr_t **table, uint64_t hsize)
+{
+#if defined(_KERNEL) && defined(HAVE_SPL)
+	vmem_free(table, hsize * sizeof (void *));
+#else
+	kmem_free(table, hsize * sizeof (void *));
+#endif
+}
+
+/*
+ * The table is big enough to hold all of arc_c_max with an average block
+ * size of zfs_arc_average_blocksize (default 8K), which with the default
+ * arc_c_max takes up totalmem * sizeof(void*) / 16K (512KB per GB with
+ * 8-byte pointers).  It may grow beyond that when the ARC holds smaller
+ * blocks.
+ */
+static uint64_t
+buf_hash_table_target(void)
+{
+	uint64_t hsize = BUF_LOCKS;
+
+	while (hsize * zfs_arc_average_blocksize < arc_c_max)
+		hsize <<= 1;
+
+	return (hsize);
+}
+
+/*
+ * Move the buckets of a stripe to the table being resized to.  Both tables
+ * have at least BUF_LOCKS buckets, so all the buckets the headers of the
+ * stripe hash to are in the same stripe in both tables.
+ */
+static void
+buf_hash_move_stripe(struct ht_lock *hl, uint64_t stripe)
+{
+	buf_hash_table_t *ht = &buf_hash_table;
+	arc_buf_hdr_t **otable = hl->ht_table;
+	arc_buf_hdr_t *hdr;
+	uint64_t idx, nidx;
+	int64_t chains = 0;
+
+	ASSERT(MUTEX_HELD(&hl->ht_lock));
+	ASSERT3P(otable, ==, ht->ht_resize_table);
+
+	for (idx = stripe; idx <= hl->ht_mask; idx += BUF_LOCKS) {
+		if (otable[idx] != NULL && otable[idx]->b_hash_next != NULL)
+			chains--;
+		while ((hdr = otable[idx]) != NULL) {
+			nidx = buf_hash(hdr->b_spa, &hdr->b_dva,
+			    hdr->b_birth) & ht->ht_mask;
+			otable[idx] = hdr->b_hash_next;
+			hdr->b_hash_next = ht->ht_table[nidx];
+			ht->ht_table[nidx] = hdr;
+		}
+	}
+
+	for (idx = stripe; idx <= ht->ht_mask; idx += BUF_LOCKS) {
+		if (ht->ht_table[idx] != NULL &&
+		    ht->ht_table[idx]->b_hash_next != NULL)
+			chains++;
+	}
+
+	hl->ht_table = ht->ht_table;
+	hl->ht_mask = ht->ht_mask;
+	ARCSTAT_INCR(arcstat_hash_chains, chains);
+}
+
+/*
+ * Called by the reclaim thread to grow or shrink the hash table.  A resize
+ * moves the buckets of one stripe at a time under its hash lock, so only
+ * the lookups of that stripe wait for it.  The reclaim thread must never
+ * sleep on a hash lock (see arc_reclaim_thread()), so stripes whose lock
+ * is held are left in the old table and retried on the next call; the
+ * old table is freed once all of them have been moved.
+ */
+static void
+buf_hash_resize(void)
+{
+	buf_hash_table_t *ht = &buf_hash_table;
+	uint64_t elements = ARCSTAT(arcstat_hash_elements);
+	uint64_t hsize, nsize, target;
+	arc_buf_hdr_t **ntable;
+	int i, left = 0;
+
+	if (ht->ht_resize_table == NULL) {
+		hsize = ht->ht_mask + 1;
+		target = buf_hash_table_target();
+
+		if (elements > hsize * BUF_HASH_LOAD_MAX &&
+		    hsize < arc_all_memory() / SPA_MINBLOCKSIZE)
+			nsize = hsize << 1;
+		else if (hsize < target)
+			nsize = hsize << 1;
+		else if (hsize > target &&
+		    elements < hsize / BUF_HASH_LOAD_MIN)
+			nsize = hsize >> 1;
+		else
+			return;
+
+		ntable = buf_hash_table_alloc(nsize, KM_NOSLEEP);
+		if (ntable == NULL)
+			return;
+
+		ht->ht_resize_table = ht->ht_table;
+		ht->ht_resize_mask = ht->ht_mask;
+		ht->ht_table = ntable;
+		ht->ht_mask = nsize - 1;
+		ARCSTAT(arcstat_hash_buckets) = nsize;
+		ARCSTAT_BUMP(arcstat_hash_resizes);
+	}
+
+	for (i = 0; i < BUF_LOCKS; i++) {
+		struct ht_lock *hl = &ht->ht_locks[i];
+
+		if (hl->ht_table == ht->ht_table)
+			continue;
+
+		if (!mutex_tryenter(&hl->ht_lock)) {
+			left++;
+			continue;
+		}
+		buf_hash_move_stripe(hl, i);
+		mutex_exit(&hl->ht_lock);
+	}
+
+	if (left == 0) {
+		buf_hash_table_free(ht->ht_resize_table,
+		    ht->ht_resize_mask + 1);
+		ht->ht_resize_table = NULL;
+	}
+}
+
 /*
  * Global data structures and functions for the buf kmem cache.
  */
@@ -1175,17 +1483,12 @@ buf_fini(void)
 {
 	int i;
 
-#if defined(_KERNEL) && defined(HAVE_SPL)
-	/*
-	 * Large allocations which do not require contiguous pages
-	 * should be using vmem_free() in the linux kernel\
-	 */
-	vmem_free(buf_hash_table.ht_table,
-	    (buf_hash_table.ht_mask + 1) * sizeof (void *));
-#else
-	kmem_free(buf_hash_table.ht_table,
-	    (buf_hash_table.ht_mask + 1) * sizeof (void *));
-#endif
+	if (buf_hash_table.ht_resize_table != NULL) {
+		buf_hash_table_free(buf_hash_table.ht_resize_table,
+		    buf_hash_table.ht_resize_mask + 1);
+	}
+	buf_hash_table_free(buf_hash_table.ht_table,
+	    buf_hash_table.ht_mask + 1);
 	for (i = 0; i < BUF_LOCKS; i++)
 		mutex_destroy(&buf_hash_table.ht_locks[i].ht_lock);
 	kmem_cache_destroy(hdr_full_cache);
@@ -1320,35 +1623,23 @@ static void
 buf_init(void)
 {
 	uint64_t *ct = NULL;
-	uint64_t hsize = 1ULL << 12;
+	uint64_t hsize = buf_hash_table_target();
 	int i, j;
 
-	/*
-	 * The hash table is big enough to fill all of physical memory
-	 * with an average block size of zfs_arc_average_blocksize (default 8K).
-	 * By default, the table will take up
-	 * totalmem * sizeof(void*) / 8K (1MB per GB with 8-byte pointers).
-	 */
-	while (hsize * zfs_arc_average_blocksize < arc_all_memory())
-		hsize <<= 1;
+#ifdef _LP64
+	/* One of these is kept for every buffer on a cache device. */
+	CTASSERT(HDR_L2ONLY_SIZE == 80);
+#endif
+
 retry:
 	buf_hash_table.ht_mask = hsize - 1;
-#if defined(_KERNEL) && defined(HAVE_SPL)
-	/*
-	 * Large allocations which do not require contiguous pages
-	 * should be using vmem_alloc() in the linux kernel
-	 */
-	buf_hash_table.ht_table =
-	    vmem_zalloc(hsize * sizeof (void*), KM_SLEEP);
-#else
-	buf_hash_table.ht_table =
-	    kmem_zalloc(hsize * sizeof (void*), KM_NOSLEEP);
-#endif
+	buf_hash_table.ht_table = buf_hash_table_alloc(hsize,
+	    hsize > BUF_LOCKS ? KM_NOSLEEP : KM_SLEEP);
 	if (buf_hash_table.ht_table == NULL) {
-		ASSERT(hsize > (1ULL << 8));
 		hsize >>= 1;
 		goto retry;
 	}
+	ARCSTAT(arcstat_hash_buckets) = hsize;
 
 	hdr_full_cache = kmem_cache_create("arc_buf_hdr_t_full", HDR_FULL_SIZE,
 	    0, hdr_full_cons, hdr_full_dest, hdr_recl, NULL, NULL, 0);
@@ -1366,8 +1657,11 @@ retry:
 			*ct = (*ct >> 1) ^ (-(*ct & 1) & ZFS_CRC64_POLY);
 
 	for (i = 0; i < BUF_LOCKS; i++) {
-		mutex_init(&buf_hash_table.ht_locks[i].ht_lock,
-		    NULL, MUTEX_DEFAULT, NULL);
+		struct ht_lock *hl = &buf_hash_table.ht_locks[i];
+
+		mutex_init(&hl->ht_lock, NULL, MUTEX_DEFAULT, NULL);
+		hl->ht_table = buf_hash_table.ht_table;
+		hl->ht_mask = buf_hash_table.ht_mask;
 	}
 }
 
@@ -1575,16 +1869,12 @@ arc_buf_watch(arc_buf_t *buf)
 }
 
 static arc_buf_contents_t
-arc_buf_type(arc_buf_hdr_t *hdr)
+arc_buf_type(const arc_buf_hdr_t *hdr)
 {
-	arc_buf_contents_t type;
-	if (HDR_ISTYPE_METADATA(hdr)) {
-		type = ARC_BUFC_METADATA;
-	} else {
-		type = ARC_BUFC_DATA;
-	}
-	VERIFY3U(hdr->b_type, ==, type);
-	return (type);
+	if (HDR_ISTYPE_METADATA(hdr))
+		return (ARC_BUFC_METADATA);
+	else
+		return (ARC_BUFC_DATA);
 }
 
 boolean_t
@@ -2203,12 +2493,12 @@ arc_buf_info(arc_buf_t *ab, arc_buf_info_t *abi, int state_index)
 		abi->abi_mru_ghost_hits = l1hdr->b_mru_ghost_hits;
 		abi->abi_mfu_hits = l1hdr->b_mfu_hits;
 		abi->abi_mfu_ghost_hits = l1hdr->b_mfu_ghost_hits;
+		abi->abi_l2arc_hits = l1hdr->b_l2_hits;
 		abi->abi_holds = refcount_count(&l1hdr->b_refcnt);
 	}
 
 	if (l2hdr) {
 		abi->abi_l2arc_dattr = l2hdr->b_daddr;
-		abi->abi_l2arc_hits = l2hdr->b_hits;
 	}
 
 	abi->abi_state_type = state ? state->arcs_state : ARC_STATE_ANON;
@@ -2562,8 +2852,6 @@ arc_buf_alloc_impl(arc_buf_hdr_t *hdr, spa_t *spa, uint64_t dsobj, void *tag,
 
 	ASSERT(HDR_HAS_L1HDR(hdr));
 	ASSERT3U(HDR_GET_LSIZE(hdr), >, 0);
-	VERIFY(hdr->b_type == ARC_BUFC_DATA ||
-	    hdr->b_type == ARC_BUFC_METADATA);
 	ASSERT3P(ret, !=, NULL);
 	ASSERT3P(*ret, ==, NULL);
 	IMPLY(encrypted, compressed);
@@ -3043,7 +3331,6 @@ arc_hdr_alloc(uint64_t spa, int32_t psize, int32_t lsize,
 	HDR_SET_PSIZE(hdr, psize);
 	HDR_SET_LSIZE(hdr, lsize);
 	hdr->b_spa = spa;
-	hdr->b_type = type;
 	hdr->b_flags = 0;
 	arc_hdr_set_flags(hdr, arc_bufc_to_flags(type) | ARC_FLAG_HAS_L1HDR);
 	arc_hdr_set_compress(hdr, compression_type);
@@ -3648,6 +3935,120 @@ arc_evict_state_impl(multilist_t *ml, int idx, arc_buf_hdr_t *marker,
 	return (bytes_evicted);
 }
 
+/*
+ * Evict from the sublists [first, first + count) of the given multilist
+ * until *remaining drops to zero, or a full pass over the sublists makes
+ * no progress.  *remaining is shared by all the threads evicting from the
+ * multilist, and each of them takes what it evicts off it, so whatever one
+ * thread can't find in its sublists is left for the others.  A *remaining
+ * of ARC_EVICT_ALL is left as it is, and evicts everything.
+ */
+static uint64_t
+arc_evict_sublists(multilist_t *ml, arc_buf_hdr_t **markers, int first,
+    int count, uint64_t spa, int64_t *remaining, arc_buf_contents_t type,
+    boolean_t prune)
+{
+	uint64_t total_evicted = 0;
+	int64_t left = *remaining;
+	boolean_t all = (left == ARC_EVICT_ALL);
+	int i;
+
+	IMPLY(left < 0, all);
+
+	/*
+	 * While we haven't hit our target number of bytes to evict, or
+	 * we're evicting all available buffers.
+	 */
+	while (all || left > 0) {
+		int sublist_idx = first +
+		    multilist_get_random_index(ml) % count;
+		uint64_t scan_evicted = 0;
+
+		/*
+		 * Try to reduce pinned dnodes with a floor of arc_dnode_limit.
+		 * Request that 10% of the LRUs be scanned by the superblock
+		 * shrinker.
+		 */
+		if (prune && type == ARC_BUFC_DATA &&
+		    arc_dnode_size > arc_dnode_limit)
+			arc_prune_async((arc_dnode_size - arc_dnode_limit) /
+			    sizeof (dnode_t) / zfs_arc_dnode_reduce_percent);
+
+		/*
+		 * Start eviction using a randomly selected sublist,
+		 * this is to try and evenly balance eviction across all
+		 * sublists. Always starting at the same sublist
+		 * (e.g. index 0) would cause evictions to favor certain
+		 * sublists over others.
+		 */
+		for (i = 0; i < count; i++) {
+			uint64_t bytes_evicted;
+
+			if (!all && left <= 0)
+				break;
+
+			bytes_evicted = arc_evict_state_impl(ml, sublist_idx,
+			    markers[sublist_idx], spa, left);
+
+			/* This also picks up what the other threads evicted */
+			if (!all) {
+				left = (int64_t)atomic_add_64_nv(
+				    (uint64_t *)remaining, -bytes_evicted);
+			}
+
+			scan_evicted += bytes_evicted;
+			total_evicted += bytes_evicted;
+
+			/* we've reached the end, wrap to the beginning */
+			if (++sublist_idx >= first + count)
+				sublist_idx = first;
+		}
+
+		/*
+		 * If we didn't evict anything during this scan, we have
+		 * no reason to believe we'll evict more during another
+		 * scan, so break the loop.
+		 */
+		if (scan_evicted == 0)
+			break;
+	}
+
+	return (total_evicted);
+}
+
+typedef struct arc_evict_arg {
+	multilist_t		*eva_ml;
+	arc_buf_hdr_t		**eva_markers;
+	int			eva_first;
+	int			eva_count;
+	uint64_t		eva_spa;
+	int64_t			*eva_remaining;
+	arc_buf_contents_t	eva_type;
+	uint64_t		eva_evicted;
+	kmutex_t		*eva_lock;
+	kcondvar_t		*eva_cv;
+	int			*eva_pending;
+	taskq_ent_t		eva_tqent;
+} arc_evict_arg_t;
+
+static void
+arc_evict_task(void *arg)
+{
+	arc_evict_arg_t *eva = arg;
+	fstrans_cookie_t cookie = spl_fstrans_mark();
+
+	eva->eva_evicted = arc_evict_sublists(eva->eva_ml, eva->eva_markers,
+	    eva->eva_first, eva->eva_count, eva->eva_spa, eva->eva_remaining,
+	    eva->eva_type, B_FALSE);
+
+	spl_fstrans_unmark(cookie);
+
+	mutex_enter(eva->eva_lock);
+	if (--(*eva->eva_pending) == 0)
+		cv_signal(eva->eva_cv);
+	mutex_exit(eva->eva_lock);
+}
+
 /*
  * Evict buffers from the given arc state, until we've removed the
  * specified number of bytes. Move the removed buffers to the
@@ -3660,6 +4061,11 @@ arc_evict_state_impl(multilist_t *ml, int idx, arc_buf_hdr_t *marker,
  * If bytes is specified using the special value ARC_EVICT_ALL, this
  * will evict all available (i.e. unlocked and evictable) buffers from
  * the given arc state; which is used by arc_flush().
+ *
+ * Large evictions are split across up to zfs_arc_evict_threads threads,
+ * each of which evicts from a disjoint range of the state's sublists until
+ * the bytes evicted by all of them add up to the target. The calling
+ * thread handles the first range.
  */
 static uint64_t
 arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
@@ -3667,7 +4073,8 @@ arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
 {
 	uint64_t total_evicted = 0;
 	multilist_t *ml = &state->arcs_list[type];
-	int num_sublists;
+	int64_t remaining = bytes;
+	int num_sublists, nthreads;
 	arc_buf_hdr_t **markers;
 	int i;
 
@@ -3701,75 +4108,76 @@ arc_evict_state(arc_state_t *state, uint64_t spa, int64_t bytes,
 	}
 
 	/*
-	 * While we haven't hit our target number of bytes to evict, or
-	 * we're evicting all available buffers.
+	 * Small evictions are not worth the cost of handing them off;
+	 * only go parallel when each thread gets at least a few maximum
+	 * sized blocks worth of work.
 	 */
-	while (total_evicted < bytes || bytes == ARC_EVICT_ALL) {
-		int sublist_idx = multilist_get_random_index(ml);
-		uint64_t scan_evicted = 0;
-
-		/*
-		 * Try to reduce pinned dnodes with a floor of arc_dnode_limit.
-		 * Request that 10% of the LRUs be scanned by the superblock
-		 * shrinker.
-		 */
-		if (type == ARC_BUFC_DATA && arc_dnode_size > arc_dnode_limit)
-			arc_prune_async((arc_dnode_size - arc_dnode_limit) /
-			    sizeof (dnode_t) / zfs_arc_dnode_reduce_percent);
+	nthreads = MIN(arc_evict_nthreads, num_sublists);
+	if (bytes != ARC_EVICT_ALL &&
+	    bytes < (int64_t)nthreads * zfs_arc_evict_batch_limit *
+	    SPA_MAXBLOCKSIZE)
+		nthreads = 1;
 
-		/*
-		 * Start eviction using a randomly selected sublist,
-		 * this is to try and evenly balance eviction across all
-		 * sublists. Always starting at the same sublist
-		 * (e.g. index 0) would cause evictions to favor certain
-		 * sublists over others.
-		 */
-		for (i = 0; i < num_sublists; i++) {
-			uint64_t bytes_remaining;
-			uint64_t bytes_evicted;
-
-			if (bytes == ARC_EVICT_ALL)
-				bytes_remaining = ARC_EVICT_ALL;
-			else if (total_evicted < bytes)
-				bytes_remaining = bytes - total_evicted;
-			else
-				break;
-
-			bytes_evicted = arc_evict_state_impl(ml, sublist_idx,
-			    markers[sublist_idx], spa, bytes_remaining);
-
-			scan_evicted += bytes_evicted;
-			total_evicted += bytes_evicted;
-
-			/* we've reached the end, wrap to the beginning */
-			if (++sublist_idx >= num_sublists)
-				sublist_idx = 0;
+	if (nthreads <= 1) {
+		total_evicted = arc_evict_sublists(ml, markers, 0,
+		    num_sublists, spa, &remaining, type, B_TRUE);
+	} else {
+		arc_evict_arg_t *evas;
+		kmutex_t lock;
+		kcondvar_t cv;
+		int pending = nthreads - 1;
+
+		mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+		cv_init(&cv, NULL, CV_DEFAULT, NULL);
+
+		evas = kmem_zalloc(sizeof (*evas) * nthreads, KM_SLEEP);
+		for (i = 0; i < nthreads; i++) {
+			arc_evict_arg_t *eva = &evas[i];
+
+			eva->eva_ml = ml;
+			eva->eva_markers = markers;
+			eva->eva_first = (num_sublists * i) / nthreads;
+			eva->eva_count = (num_sublists * (i + 1)) / nthreads -
+			    eva->eva_first;
+			eva->eva_spa = spa;
+			eva->eva_remaining = &remaining;
+			eva->eva_type = type;
+			eva->eva_lock = &lock;
+			eva->eva_cv = &cv;
+			eva->eva_pending = &pending;
+			taskq_init_ent(&eva->eva_tqent);
+
+			if (i != 0) {
+				taskq_dispatch_ent(arc_evict_taskq,
+				    arc_evict_task, eva, 0, &eva->eva_tqent);
+			}
 		}
 
-		/*
-		 * If we didn't evict anything during this scan, we have
-		 * no reason to believe we'll evict more during another
-		 * scan, so break the loop.
-		 */
-		if (scan_evicted == 0) {
-			/* This isn't possible, let's make that obvious */
-			ASSERT3S(bytes, !=, 0);
+		evas[0].eva_evicted = arc_evict_sublists(ml, markers,
+		    evas[0].eva_first, evas[0].eva_count, spa, &remaining, type,
+		    B_TRUE);
 
-			/*
-			 * When bytes is ARC_EVICT_ALL, the only way to
-			 * break the loop is when scan_evicted is zero.
-			 * In that case, we actually have evicted enough,
-			 * so we don't want to increment the kstat.
-			 */
-			if (bytes != ARC_EVICT_ALL) {
-				ASSERT3S(total_evicted, <, bytes);
-				ARCSTAT_BUMP(arcstat_evict_not_enough);
-			}
+		mutex_enter(&lock);
+		while (pending != 0)
+			cv_wait(&cv, &lock);
+		mutex_exit(&lock);
 
-			break;
-		}
+		for (i = 0; i < nthreads; i++)
+			total_evicted += evas[i].eva_evicted;
+
+		kmem_free(evas, sizeof (*evas) * nthreads);
+		cv_destroy(&cv);
+		mutex_destroy(&lock);
 	}
 
+	/*
+	 * When bytes is ARC_EVICT_ALL, eviction only stops once a scan
+	 * finds nothing more to evict. In that case, we actually have
+	 * evicted enough, so we don't want to increment the kstat.
+	 */
+	if (bytes != ARC_EVICT_ALL && total_evicted < bytes)
+		ARCSTAT_BUMP(arcstat_evict_not_enough);
+
 	for (i = 0; i < num_sublists; i++) {
 		multilist_sublist_t *mls = multilist_sublist_lock(ml, i);
 		multilist_sublist_remove(mls, markers[i]);
@@ -4518,6 +4926,7 @@ arc_kmem_reap_now(void)
 	kmem_cache_reap_now(hdr_full_cache);
 	kmem_cache_reap_now(hdr_l2only_cache);
 	kmem_cache_reap_now(range_seg_cache);
+	zstd_cache_reap_now();
 
 	if (zio_arena != NULL) {
 		/*
@@ -4612,6 +5021,8 @@ arc_reclaim_thread(void)
 
 		evicted = arc_adjust();
 
+		buf_hash_resize();
+
 		mutex_enter(&arc_reclaim_lock);
 
 		/*
@@ -4955,14 +5366,19 @@ arc_get_data_impl(arc_buf_hdr_t *hdr, uint64_t size, void *tag)
 		 * shouldn't cause any harm.
 		 */
 		if (arc_is_overflowing()) {
+			hrtime_t start = gethrtime();
+
 			cv_signal(&arc_reclaim_thread_cv);
 			cv_wait(&arc_reclaim_waiters_cv, &arc_reclaim_lock);
+
+			ARCSTAT_BUMP(arcstat_evict_wait_count);
+			ARCSTAT_INCR(arcstat_evict_wait_ns, gethrtime() - start);
 		}
 
 		mutex_exit(&arc_reclaim_lock);
 	}
 
-	VERIFY3U(hdr->b_type, ==, type);
+	VERIFY3U(arc_buf_type(hdr), ==, type);
 	if (type == ARC_BUFC_METADATA) {
 		arc_space_consume(size, ARC_SPACE_META);
 	} else {
@@ -5043,7 +5459,7 @@ arc_free_data_impl(arc_buf_hdr_t *hdr, uint64_t size, void *tag)
 	}
 	(void) refcount_remove_many(&state->arcs_size, size, tag);
 
-	VERIFY3U(hdr->b_type, ==, type);
+	VERIFY3U(arc_buf_type(hdr), ==, type);
 	if (type == ARC_BUFC_METADATA) {
 		arc_space_return(size, ARC_SPACE_META);
 	} else {
@@ -5738,7 +6154,7 @@ top:
 
 				DTRACE_PROBE1(l2arc__hit, arc_buf_hdr_t *, hdr);
 				ARCSTAT_BUMP(arcstat_l2_hits);
-				atomic_inc_32(&hdr->b_l2hdr.b_hits);
+				atomic_inc_32(&hdr->b_l1hdr.b_l2_hits);
 
 				cb = kmem_zalloc(sizeof (l2arc_read_callback_t),
 				    KM_SLEEP);
@@ -5818,6 +6234,61 @@ out:
 	return (rc);
 }
 
+/*
+ * Pass size bytes at offset off of the block bp points to to func, straight
+ * from the data of its ARC header, without allocating an arc_buf_t to copy
+ * or decompress it into first.  This is only possible for a block cached
+ * uncompressed and unencrypted with no I/O in progress; otherwise ENOENT is
+ * returned and nothing is done, and the caller has to use arc_read().  func
+ * is called with the hash lock held and pages mapped atomically, so it must
+ * not sleep.  The access counts as a demand hit.
+ */
+int
+arc_read_cached(spa_t *spa, const blkptr_t *bp, uint64_t off, uint64_t size,
+    abd_iter_func_t *func, void *private)
+{
+	arc_buf_hdr_t *hdr;
+	kmutex_t *hash_lock = NULL;
+	int err;
+
+	if (BP_IS_HOLE(bp) || BP_IS_EMBEDDED(bp) || BP_IS_ENCRYPTED(bp) ||
+	    BP_SHOULD_BYTESWAP(bp))
+		return (SET_ERROR(ENOENT));
+
+	hdr = buf_hash_find(spa_load_guid(spa), bp, &hash_lock);
+	if (hdr == NULL)
+		return (SET_ERROR(ENOENT));
+
+	if (!HDR_HAS_L1HDR(hdr) || hdr->b_l1hdr.b_pabd == NULL ||
+	    HDR_IO_IN_PROGRESS(hdr) || HDR_ENCRYPT(hdr) ||
+	    arc_hdr_get_compress(hdr) != ZIO_COMPRESS_OFF) {
+		mutex_exit(hash_lock);
+		return (SET_ERROR(ENOENT));
+	}
+
+	ASSERT(hdr->b_l1hdr.b_state == arc_mru ||
+	    hdr->b_l1hdr.b_state == arc_mfu);
+	ASSERT3U(off + size, <=, HDR_GET_LSIZE(hdr));
+
+	err = abd_iterate_func(hdr->b_l1hdr.b_pabd, off, size, func, private);
+
+	if (hdr->b_flags & ARC_FLAG_PREDICTIVE_PREFETCH) {
+		DTRACE_PROBE1(arc__demand__hit__predictive__prefetch,
+		    arc_buf_hdr_t *, hdr);
+		ARCSTAT_BUMP(arcstat_demand_hit_predictive_prefetch);
+		arc_hdr_clear_flags(hdr, ARC_FLAG_PREDICTIVE_PREFETCH);
+	}
+	DTRACE_PROBE1(arc__hit, arc_buf_hdr_t *, hdr);
+	arc_access(hdr, hash_lock);
+	mutex_exit(hash_lock);
+	ARCSTAT_BUMP(arcstat_hits);
+	ARCSTAT_CONDSTAT(!HDR_PREFETCH(hdr),
+	    demand, prefetch, !HDR_ISTYPE_METADATA(hdr),
+	    data, metadata, hits);
+
+	return (err);
+}
+
 arc_prune_t *
 arc_add_prune_callback(arc_prune_func_t *func, void *private)
 {
@@ -5999,7 +6470,6 @@ arc_release(arc_buf_t *buf, void *tag)
 		enum zio_compress compress = arc_hdr_get_compress(hdr);
 		arc_buf_contents_t type = arc_buf_type(hdr);
 		arc_buf_t *lastbuf = NULL;
-		VERIFY3U(hdr->b_type, ==, type);
 
 		ASSERT(hdr->b_l1hdr.b_buf != buf || buf->b_next != NULL);
 		(void) remove_reference(hdr, hash_lock, tag);
@@ -6093,7 +6563,7 @@ arc_release(arc_buf_t *buf, void *tag)
 		ASSERT3P(nhdr->b_l1hdr.b_buf, ==, NULL);
 		ASSERT0(nhdr->b_l1hdr.b_bufcnt);
 		ASSERT0(refcount_count(&nhdr->b_l1hdr.b_refcnt));
-		VERIFY3U(nhdr->b_type, ==, type);
+		VERIFY3U(arc_buf_type(nhdr), ==, type);
 		ASSERT(!HDR_SHARED_DATA(nhdr));
 
 		nhdr->b_l1hdr.b_buf = buf;
@@ -6611,6 +7081,14 @@ arc_kstat_update(kstat_t *ksp, int rw)
 		    &as->arcstat_mfu_ghost_size,
 		    &as->arcstat_mfu_ghost_evictable_data,
 		    &as->arcstat_mfu_ghost_evictable_metadata);
+
+		if (as->arcstat_l2_asize.value.ui64 != 0) {
+			as->arcstat_l2_hdr_bytes_per_mb.value.ui64 =
+			    (as->arcstat_l2_hdr_size.value.ui64 << 20) /
+			    as->arcstat_l2_asize.value.ui64;
+		} else {
+			as->arcstat_l2_hdr_bytes_per_mb.value.ui64 = 0;
+		}
 	}
 
 	return (0);
@@ -6916,6 +7394,10 @@ arc_init(void)
 	if (zfs_arc_num_sublists_per_state < 1)
 		zfs_arc_num_sublists_per_state = MAX(boot_ncpus, 1);
 
+	if (zfs_arc_evict_threads < 1)
+		zfs_arc_evict_threads = MAX(boot_ncpus / 4, 1);
+	arc_evict_nthreads = zfs_arc_evict_threads;
+
 	/* if kmem_flags are set, lets try to use less memory */
 	if (kmem_debugging())
 		arc_c = arc_c / 2;
@@ -6932,6 +7414,13 @@ arc_init(void)
 	arc_prune_taskq = taskq_create("arc_prune", max_ncpus, defclsyspri,
 	    max_ncpus, INT_MAX, TASKQ_PREPOPULATE | TASKQ_DYNAMIC);
 
+	/* The thread calling arc_evict_state() does a share of the work */
+	if (arc_evict_nthreads > 1) {
+		arc_evict_taskq = taskq_create("arc_evict",
+		    arc_evict_nthreads - 1, defclsyspri, arc_evict_nthreads - 1,
+		    INT_MAX, TASKQ_PREPOPULATE);
+	}
+
 	arc_reclaim_thread_exit = B_FALSE;
 
 	arc_ksp = kstat_create("zfs", 0, "arcstats", "misc", KSTAT_TYPE_NAMED,
@@ -7000,6 +7489,11 @@ arc_fini(void)
 		arc_ksp = NULL;
 	}
 
+	if (arc_evict_taskq != NULL) {
+		taskq_destroy(arc_evict_taskq);
+		arc_evict_taskq = NULL;
+	}
+
 	taskq_wait(arc_prune_taskq);
 	taskq_destroy(arc_prune_taskq);
 
@@ -7142,6 +7636,18 @@ arc_fini(void)
  * 8. If an ARC buffer is written (and dirtied) which also exists in the
  * L2ARC, the now stale L2ARC buffer is immediately dropped.
  *
+ * 9. The contents of the L2ARC survive an export/import or a reboot.
+ * Alongside the buffers, the feed thread writes log blocks recording the
+ * identity and device location of each buffer it wrote, and after every
+ * write it updates a small device header pointing at the latest log
+ * block.  When a cache device is added to the ARC, e.g. on pool import,
+ * a background thread walks that chain of log blocks backwards and
+ * recreates L2-only headers for all buffers still present on the device
+ * (see l2arc_rebuild()).  Import does not wait for this to finish, and
+ * the device is not fed until its rebuild is done.  Any stale entry is
+ * caught by the blkptr checksum verification in l2arc_read_done().
+ * The on-disk format is described in arc_impl.h.
+ *
  * The performance of the L2ARC can be tweaked by a number of tunables, which
  * may be necessary for different workloads:
  *
@@ -7155,6 +7661,7 @@ arc_fini(void)
  *				since more compressed buffers are likely to
  *				be present
  *	l2arc_feed_secs		seconds between L2ARC writing
+ *	l2arc_rebuild_enabled	restore the L2ARC contents on import
  *
  * Tunables may be removed or added as future performance improvements are
  * integrated, and also may become zpool properties.
@@ -7232,6 +7739,26 @@ l2arc_write_interval(clock_t began, uint64_t wanted, uint64_t wrote)
 	return (next);
 }
 
+/*
+ * How far the device hand may advance while writing 'size' bytes of
+ * buffers: the buffers themselves, plus the log blocks committed along
+ * with them, assuming the worst case where every buffer is as small as
+ * possible.  This much is evicted ahead of the hand before each write.
+ */
+static uint64_t
+l2arc_write_distance(l2arc_dev_t *dev, uint64_t size)
+{
+	uint64_t blocks;
+
+	if (dev->l2ad_log_blk == NULL)
+		return (size);
+
+	blocks = (size >> SPA_MINBLOCKSHIFT) / L2ARC_LOG_BLK_MAX_ENTRIES + 1;
+
+	return (size + blocks * vdev_psize_to_asize(dev->l2ad_vdev,
+	    sizeof (l2arc_log_blk_phys_t)));
+}
+
 /*
  * Cycle through L2ARC devices.  This is how L2ARC load balances.
  * If a device is returned, this also returns holding the spa config lock.
@@ -7271,10 +7798,14 @@ l2arc_dev_get_next(void)
 		else if (next == first)
 			break;
 
-	} while (vdev_is_dead(next->l2ad_vdev));
+	} while (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild);
 
-	/* if we were unable to find any usable vdevs, return NULL */
-	if (vdev_is_dead(next->l2ad_vdev))
+	/*
+	 * If we were unable to find any usable vdevs, return NULL.  Devices
+	 * whose contents are still being rebuilt are not fed, as that
+	 * would overwrite the log blocks being read.
+	 */
+	if (vdev_is_dead(next->l2ad_vdev) || next->l2ad_rebuild)
 		next = NULL;
 
 	l2arc_dev_last = next;
@@ -7671,6 +8202,13 @@ l2arc_evict(l2arc_dev_t *dev, uint64_t distance, boolean_t all)
 	DTRACE_PROBE4(l2arc__evict, l2arc_dev_t *, dev, list_t *, buflist,
 	    uint64_t, taddr, boolean_t, all);
 
+	/*
+	 * Record how far ahead of the hand we are about to evict, so that
+	 * a later rebuild knows which log blocks can no longer be trusted.
+	 */
+	if (!all)
+		dev->l2ad_evict = taddr;
+
 top:
 	mutex_enter(&dev->l2ad_mtx);
 	for (hdr = list_tail(buflist); hdr; hdr = hdr_prev) {
@@ -7783,8 +8321,23 @@ l2arc_apply_transforms(spa_t *spa, arc_buf_hdr_t *hdr, abd_t **abd_out,
 		cabd = abd_alloc_for_io(bsize, ismd);
 		tmp = abd_borrow_buf(cabd, bsize);
 
+		/*
+		 * The compression value carries the level the block was
+		 * written with, but recompressing need not reproduce the
+		 * block: the compressor may differ from the one which wrote
+		 * it (the kernel's zstd has no fast levels, for instance)
+		 * or fail to allocate its workspace.  A block which then no
+		 * longer fits in its psize isn't written to the L2ARC.  One
+		 * which fits but differs fails its checksum when read back,
+		 * and the read is reissued to the pool.
+		 */
 		csize = zio_compress_data(compress, to_write, tmp, bsize);
-		ASSERT3U(csize, <=, HDR_GET_PSIZE(hdr));
+		if (csize > HDR_GET_PSIZE(hdr)) {
+			abd_return_buf(cabd, tmp, bsize);
+			ARCSTAT_BUMP(arcstat_l2_recompress_fail);
+			ret = SET_ERROR(EIO);
+			goto error;
+		}
 		if (csize < HDR_GET_PSIZE(hdr)) {
 			bzero((char *)tmp + csize, HDR_GET_PSIZE(hdr) - csize);
 			csize = HDR_GET_PSIZE(hdr);
@@ -8010,8 +8563,6 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			}
 
 			hdr->b_l2hdr.b_dev = dev;
-			hdr->b_l2hdr.b_hits = 0;
-
 			hdr->b_l2hdr.b_daddr = dev->l2ad_hand;
 			arc_hdr_set_flags(hdr, ARC_FLAG_HAS_L2HDR);
 
@@ -8040,6 +8591,15 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 			write_psize += asize;
 			dev->l2ad_hand += asize;
 
+			/*
+			 * Record the buffer in the current log block, unless
+			 * it is encrypted: an L2-only header has no room for
+			 * the encryption parameters needed to read it back.
+			 */
+			if (!HDR_ENCRYPT(hdr) &&
+			    l2arc_log_blk_insert(dev, hdr))
+				l2arc_log_blk_commit(dev, pio);
+
 			mutex_exit(hash_lock);
 
 			(void) zio_nowait(wzio);
@@ -8070,8 +8630,10 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	 * Bump device hand to the device start if it is approaching the end.
 	 * l2arc_evict() will already have evicted ahead for this case.
 	 */
-	if (dev->l2ad_hand >= (dev->l2ad_end - target_sz)) {
+	if (dev->l2ad_hand >= (dev->l2ad_end - l2arc_write_distance(dev,
+	    target_sz))) {
 		dev->l2ad_hand = dev->l2ad_start;
+		dev->l2ad_evict = dev->l2ad_start;
 		dev->l2ad_first = B_FALSE;
 	}
 
@@ -8079,6 +8641,13 @@ l2arc_write_buffers(spa_t *spa, l2arc_dev_t *dev, uint64_t target_sz)
 	(void) zio_wait(pio);
 	dev->l2ad_writing = B_FALSE;
 
+	/*
+	 * Persist the new hand, and any log block committed above, only
+	 * once the buffers and log blocks have reached the device.
+	 */
+	if (dev->l2ad_log_blk != NULL)
+		l2arc_dev_hdr_update(dev);
+
 	return (write_asize);
 }
 
@@ -8159,9 +8728,10 @@ l2arc_feed_thread(void)
 		size = l2arc_write_size();
 
 		/*
-		 * Evict L2ARC buffers that will be overwritten.
+		 * Evict L2ARC buffers that will be overwritten, leaving room
+		 * for any log blocks committed along with them.
 		 */
-		l2arc_evict(dev, size, B_FALSE);
+		l2arc_evict(dev, l2arc_write_distance(dev, size), B_FALSE);
 
 		/*
 		 * Write ARC buffers.
@@ -8215,13 +8785,26 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	adddev = kmem_zalloc(sizeof (l2arc_dev_t), KM_SLEEP);
 	adddev->l2ad_spa = spa;
 	adddev->l2ad_vdev = vd;
-	adddev->l2ad_start = VDEV_LABEL_START_SIZE;
+	/* leave room for the device header ahead of the first buffer */
+	adddev->l2ad_dev_hdr_asize = MAX(sizeof (l2arc_dev_hdr_phys_t),
+	    1ULL << vd->vdev_ashift);
+	adddev->l2ad_dev_hdr = kmem_zalloc(adddev->l2ad_dev_hdr_asize,
+	    KM_SLEEP);
+	adddev->l2ad_start = VDEV_LABEL_START_SIZE +
+	    adddev->l2ad_dev_hdr_asize;
 	adddev->l2ad_end = VDEV_LABEL_START_SIZE + vdev_get_min_asize(vd);
 	adddev->l2ad_hand = adddev->l2ad_start;
+	adddev->l2ad_evict = adddev->l2ad_start;
 	adddev->l2ad_first = B_TRUE;
 	adddev->l2ad_writing = B_FALSE;
 	list_link_init(&adddev->l2ad_node);
 
+	if (vdev_get_min_asize(vd) >= l2arc_rebuild_blocks_min_l2size) {
+		adddev->l2ad_log_blk =
+		    vmem_zalloc(sizeof (l2arc_log_blk_phys_t), KM_SLEEP);
+	}
+	adddev->l2ad_log_blk_payload_start = adddev->l2ad_start;
+
 	mutex_init(&adddev->l2ad_mtx, NULL, MUTEX_DEFAULT, NULL);
 	/*
 	 * This is a list of all ARC buffers that are still valid on the
@@ -8230,9 +8813,15 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	list_create(&adddev->l2ad_buflist, sizeof (arc_buf_hdr_t),
 	    offsetof(arc_buf_hdr_t, b_l2hdr.b_l2node));
 
-	vdev_space_update(vd, 0, 0, adddev->l2ad_end - adddev->l2ad_hand);
+	vdev_space_update(vd, 0, 0, adddev->l2ad_end - adddev->l2ad_start);
 	refcount_create(&adddev->l2ad_alloc);
 
+	/*
+	 * Decide whether the previous contents of the device can be
+	 * restored, before the feed thread gets a chance to write to it.
+	 */
+	l2arc_rebuild_vdev(adddev);
+
 	/*
 	 * Add device to global list
 	 */
@@ -8240,6 +8829,13 @@ l2arc_add_vdev(spa_t *spa, vdev_t *vd)
 	list_insert_head(l2arc_dev_list, adddev);
 	atomic_inc_64(&l2arc_ndev);
 	mutex_exit(&l2arc_dev_mtx);
+
+	/*
+	 * The rebuild itself runs asynchronously so as not to hold up the
+	 * pool import; see l2arc_spa_rebuild_start().
+	 */
+	if (adddev->l2ad_rebuild)
+		spa_async_request(spa, SPA_ASYNC_L2CACHE_REBUILD);
 }
 
 /*
@@ -8262,10 +8858,25 @@ l2arc_remove_vdev(vdev_t *vd)
 		}
 	}
 	ASSERT3P(remdev, !=, NULL);
+	mutex_exit(&l2arc_dev_mtx);
+
+	/*
+	 * Cancel any ongoing rebuild and wait for it to wind down, since
+	 * it adds headers referencing this device.
+	 */
+	mutex_enter(&l2arc_rebuild_thr_lock);
+	if (remdev->l2ad_rebuild_began) {
+		remdev->l2ad_rebuild_cancel = B_TRUE;
+		while (remdev->l2ad_rebuild)
+			cv_wait(&l2arc_rebuild_thr_cv, &l2arc_rebuild_thr_lock);
+	}
+	remdev->l2ad_rebuild = B_FALSE;
+	mutex_exit(&l2arc_rebuild_thr_lock);
 
 	/*
 	 * Remove device from global list
 	 */
+	mutex_enter(&l2arc_dev_mtx);
 	list_remove(l2arc_dev_list, remdev);
 	l2arc_dev_last = NULL;		/* may have been invalidated */
 	atomic_dec_64(&l2arc_ndev);
@@ -8278,6 +8889,11 @@ l2arc_remove_vdev(vdev_t *vd)
 	list_destroy(&remdev->l2ad_buflist);
 	mutex_destroy(&remdev->l2ad_mtx);
 	refcount_destroy(&remdev->l2ad_alloc);
+	if (remdev->l2ad_log_blk != NULL) {
+		vmem_free(remdev->l2ad_log_blk,
+		    sizeof (l2arc_log_blk_phys_t));
+	}
+	kmem_free(remdev->l2ad_dev_hdr, remdev->l2ad_dev_hdr_asize);
 	kmem_free(remdev, sizeof (l2arc_dev_t));
 }
 
@@ -8291,6 +8907,8 @@ l2arc_init(void)
 
 	mutex_init(&l2arc_feed_thr_lock, NULL, MUTEX_DEFAULT, NULL);
 	cv_init(&l2arc_feed_thr_cv, NULL, CV_DEFAULT, NULL);
+	mutex_init(&l2arc_rebuild_thr_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&l2arc_rebuild_thr_cv, NULL, CV_DEFAULT, NULL);
 	mutex_init(&l2arc_dev_mtx, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&l2arc_free_on_write_mtx, NULL, MUTEX_DEFAULT, NULL);
 
@@ -8315,6 +8933,8 @@ l2arc_fini(void)
 
 	mutex_destroy(&l2arc_feed_thr_lock);
 	cv_destroy(&l2arc_feed_thr_cv);
+	mutex_destroy(&l2arc_rebuild_thr_lock);
+	cv_destroy(&l2arc_rebuild_thr_cv);
 	mutex_destroy(&l2arc_dev_mtx);
 	mutex_destroy(&l2arc_free_on_write_mtx);
 
@@ -8346,6 +8966,511 @@ l2arc_stop(void)
 	mutex_exit(&l2arc_feed_thr_lock);
 }
 
+/*
+ * Persistent L2ARC
+ *
+ * See the description of the on-disk structures in arc_impl.h, and point
+ * 9 of the L2ARC overview above.
+ */
+
+/*
+ * Returns B_TRUE if 'check' lies within the device range [bottom, top],
+ * where the range wraps around the end of the device if bottom > top.
+ */
+static boolean_t
+l2arc_range_check_overlap(uint64_t bottom, uint64_t top, uint64_t check)
+{
+	if (bottom < top)
+		return (bottom <= check && check <= top);
+	else if (bottom > top)
+		return (check <= top || bottom <= check);
+	else
+		return (check == top);
+}
+
+/*
+ * A log block pointer can be followed if the log block and the range of
+ * buffers it describes lie within the device, and, once the device has
+ * wrapped around, none of it lies in the region between the hand and
+ * the eviction point, which may have been overwritten since.
+ */
+static boolean_t
+l2arc_log_blkptr_valid(l2arc_dev_t *dev, const l2arc_log_blkptr_t *lbp)
+{
+	uint64_t asize = L2BLK_GET_PSIZE(lbp->lbp_prop);
+	uint64_t start = lbp->lbp_payload_start;
+	uint64_t end = lbp->lbp_daddr + asize - 1;
+	boolean_t evicted;
+
+	if (lbp->lbp_daddr < dev->l2ad_start || start < dev->l2ad_start ||
+	    lbp->lbp_daddr + asize > dev->l2ad_end || start > dev->l2ad_end ||
+	    asize == 0 || asize > sizeof (l2arc_log_blk_phys_t))
+		return (B_FALSE);
+
+	evicted = l2arc_range_check_overlap(start, end, dev->l2ad_hand) ||
+	    l2arc_range_check_overlap(start, end, dev->l2ad_evict) ||
+	    l2arc_range_check_overlap(dev->l2ad_hand, dev->l2ad_evict, start) ||
+	    l2arc_range_check_overlap(dev->l2ad_hand, dev->l2ad_evict, end);
+
+	return (!evicted || dev->l2ad_first);
+}
+
+/*
+ * Write the in-core device header out to the cache device.
+ */
+static void
+l2arc_dev_hdr_update(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	abd_t *abd;
+	int err;
+
+	l2dhdr->dh_magic = L2ARC_DEV_HDR_MAGIC;
+	l2dhdr->dh_version = L2ARC_PERSIST_VERSION;
+	l2dhdr->dh_spa_guid = spa_guid(dev->l2ad_spa);
+	l2dhdr->dh_vdev_guid = dev->l2ad_vdev->vdev_guid;
+	l2dhdr->dh_flags = dev->l2ad_first ? L2ARC_DEV_HDR_EVICT_FIRST : 0;
+	l2dhdr->dh_start = dev->l2ad_start;
+	l2dhdr->dh_end = dev->l2ad_end;
+	l2dhdr->dh_hand = dev->l2ad_hand;
+	l2dhdr->dh_evict = dev->l2ad_evict;
+
+	abd = abd_get_from_buf(l2dhdr, dev->l2ad_dev_hdr_asize);
+	err = zio_wait(zio_write_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, dev->l2ad_dev_hdr_asize, abd,
+	    ZIO_CHECKSUM_LABEL, NULL, NULL, ZIO_PRIORITY_ASYNC_WRITE,
+	    ZIO_FLAG_CANFAIL, B_FALSE));
+	abd_put(abd);
+
+	if (err != 0) {
+		zfs_dbgmsg("L2ARC IO error (%d) while writing device header, "
+		    "vdev guid: %llu", err,
+		    (u_longlong_t)dev->l2ad_vdev->vdev_guid);
+	}
+}
+
+/*
+ * Read the device header from the cache device and check that it
+ * describes this very device, as it is currently laid out.
+ */
+static int
+l2arc_dev_hdr_read(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	abd_t *abd;
+	int err;
+
+	abd = abd_get_from_buf(l2dhdr, dev->l2ad_dev_hdr_asize);
+	err = zio_wait(zio_read_phys(NULL, dev->l2ad_vdev,
+	    VDEV_LABEL_START_SIZE, dev->l2ad_dev_hdr_asize, abd,
+	    ZIO_CHECKSUM_LABEL, NULL, NULL, ZIO_PRIORITY_SYNC_READ,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
+	    ZIO_FLAG_DONT_RETRY | ZIO_FLAG_SPECULATIVE, B_FALSE));
+	abd_put(abd);
+
+	/*
+	 * A device that has never held a header, e.g. one that was just
+	 * added to the pool, fails the checksum; that is not an error.
+	 */
+	if (err != 0 && err != ECKSUM) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_io_errors);
+		return (err);
+	}
+
+	if (err != 0 ||
+	    l2dhdr->dh_magic != L2ARC_DEV_HDR_MAGIC ||
+	    l2dhdr->dh_version != L2ARC_PERSIST_VERSION ||
+	    l2dhdr->dh_spa_guid != spa_guid(dev->l2ad_spa) ||
+	    l2dhdr->dh_vdev_guid != dev->l2ad_vdev->vdev_guid ||
+	    l2dhdr->dh_start != dev->l2ad_start ||
+	    l2dhdr->dh_end != dev->l2ad_end ||
+	    l2dhdr->dh_hand < dev->l2ad_start ||
+	    l2dhdr->dh_hand > dev->l2ad_end ||
+	    l2dhdr->dh_evict < dev->l2ad_start ||
+	    l2dhdr->dh_evict > dev->l2ad_end) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_unsupported);
+		return (SET_ERROR(ENOTSUP));
+	}
+
+	return (0);
+}
+
+/*
+ * Called when a device is added to the L2ARC.  If the device header is
+ * valid, flag the device for a rebuild; otherwise reset the header so
+ * that a stale log block chain is never followed later on.
+ */
+static void
+l2arc_rebuild_vdev(l2arc_dev_t *dev)
+{
+	if (dev->l2ad_log_blk != NULL && l2arc_rebuild_enabled &&
+	    l2arc_dev_hdr_read(dev) == 0) {
+		dev->l2ad_rebuild = B_TRUE;
+	} else if (spa_writeable(dev->l2ad_spa)) {
+		bzero(dev->l2ad_dev_hdr, dev->l2ad_dev_hdr_asize);
+		l2arc_dev_hdr_update(dev);
+	}
+}
+
+/*
+ * Record a buffer that is being written to the device in the log block
+ * being filled.  Returns B_TRUE once the log block is full and should be
+ * committed.
+ */
+static boolean_t
+l2arc_log_blk_insert(l2arc_dev_t *dev, const arc_buf_hdr_t *hdr)
+{
+	l2arc_log_blk_phys_t *lb = dev->l2ad_log_blk;
+	l2arc_log_ent_phys_t *le;
+
+	if (lb == NULL)
+		return (B_FALSE);
+
+	ASSERT3S(dev->l2ad_log_ent_idx, <, L2ARC_LOG_BLK_MAX_ENTRIES);
+	le = &lb->lb_entries[dev->l2ad_log_ent_idx++];
+	bzero(le, sizeof (*le));
+	le->le_dva = hdr->b_dva;
+	le->le_birth = hdr->b_birth;
+	le->le_daddr = hdr->b_l2hdr.b_daddr;
+	L2BLK_SET_LSIZE(le->le_prop, HDR_GET_LSIZE(hdr));
+	L2BLK_SET_PSIZE(le->le_prop, HDR_GET_PSIZE(hdr));
+	L2BLK_SET_COMPRESS(le->le_prop, HDR_GET_COMPRESS(hdr));
+	L2BLK_SET_TYPE(le->le_prop, arc_buf_type(hdr));
+
+	return (dev->l2ad_log_ent_idx == L2ARC_LOG_BLK_MAX_ENTRIES);
+}
+
+/*
+ * Write out the full log block at the device hand, as part of the write
+ * zio of the buffers it describes, and make the in-core device header
+ * point at it.  l2arc_write_buffers() persists the device header once
+ * the whole write has completed.
+ */
+static void
+l2arc_log_blk_commit(l2arc_dev_t *dev, zio_t *pio)
+{
+	l2arc_log_blk_phys_t *lb = dev->l2ad_log_blk;
+	l2arc_log_blkptr_t *lbp = &dev->l2ad_dev_hdr->dh_start_lbp;
+	enum zio_compress compress;
+	uint64_t psize, asize;
+	abd_t *src, *abd;
+	void *buf;
+
+	ASSERT3S(dev->l2ad_log_ent_idx, ==, L2ARC_LOG_BLK_MAX_ENTRIES);
+
+	lb->lb_magic = L2ARC_LOG_BLK_MAGIC;
+	lb->lb_prev_lbp = *lbp;
+
+	/*
+	 * Log blocks usually compress well; store them as-is if not.
+	 */
+	src = abd_get_from_buf(lb, sizeof (*lb));
+	abd = abd_alloc_for_io(sizeof (*lb), B_TRUE);
+	buf = abd_borrow_buf(abd, sizeof (*lb));
+	psize = zio_compress_data(ZIO_COMPRESS_LZ4, src, buf, sizeof (*lb));
+	asize = vdev_psize_to_asize(dev->l2ad_vdev, psize);
+	if (psize < sizeof (*lb) && asize < sizeof (*lb)) {
+		compress = ZIO_COMPRESS_LZ4;
+		bzero((char *)buf + psize, asize - psize);
+	} else {
+		compress = ZIO_COMPRESS_OFF;
+		bcopy(lb, buf, sizeof (*lb));
+		asize = vdev_psize_to_asize(dev->l2ad_vdev, sizeof (*lb));
+	}
+	ASSERT3U(asize, <=, sizeof (*lb));
+	abd_put(src);
+
+	lbp->lbp_daddr = dev->l2ad_hand;
+	lbp->lbp_payload_start = dev->l2ad_log_blk_payload_start;
+	lbp->lbp_prop = 0;
+	L2BLK_SET_LSIZE(lbp->lbp_prop, sizeof (*lb));
+	L2BLK_SET_PSIZE(lbp->lbp_prop, asize);
+	L2BLK_SET_COMPRESS(lbp->lbp_prop, compress);
+	fletcher_4_native(buf, asize, NULL, &lbp->lbp_cksum);
+	abd_return_buf_copy(abd, buf, sizeof (*lb));
+
+	(void) zio_nowait(zio_write_phys(pio, dev->l2ad_vdev, dev->l2ad_hand,
+	    asize, abd, ZIO_CHECKSUM_OFF, NULL, NULL,
+	    ZIO_PRIORITY_ASYNC_WRITE, ZIO_FLAG_CANFAIL, B_FALSE));
+
+	/* released by l2arc_write_done(), along with the buffers */
+	l2arc_free_abd_on_write(abd, sizeof (*lb), ARC_BUFC_METADATA);
+
+	dev->l2ad_hand += asize;
+	dev->l2ad_log_blk_payload_start = dev->l2ad_hand;
+	dev->l2ad_log_ent_idx = 0;
+	ARCSTAT_BUMP(arcstat_l2_log_blk_writes);
+}
+
+/*
+ * Read a log block from the device and verify it against the checksum
+ * stored in the pointer to it.
+ */
+static int
+l2arc_log_blk_read(l2arc_dev_t *dev, const l2arc_log_blkptr_t *lbp,
+    l2arc_log_blk_phys_t *lb)
+{
+	uint64_t asize = L2BLK_GET_PSIZE(lbp->lbp_prop);
+	zio_cksum_t cksum;
+	abd_t *abd;
+	void *buf;
+	int err;
+
+	abd = abd_alloc_for_io(asize, B_TRUE);
+	err = zio_wait(zio_read_phys(NULL, dev->l2ad_vdev, lbp->lbp_daddr,
+	    asize, abd, ZIO_CHECKSUM_OFF, NULL, NULL, ZIO_PRIORITY_ASYNC_READ,
+	    ZIO_FLAG_DONT_CACHE | ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
+	    ZIO_FLAG_DONT_RETRY, B_FALSE));
+	if (err != 0) {
+		ARCSTAT_BUMP(arcstat_l2_rebuild_io_errors);
+		abd_free(abd);
+		return (err);
+	}
+
+	buf = abd_borrow_buf_copy(abd, asize);
+	fletcher_4_native(buf, asize, NULL, &cksum);
+	if (!ZIO_CHECKSUM_EQUAL(cksum, lbp->lbp_cksum)) {
+		err = SET_ERROR(ECKSUM);
+	} else if (L2BLK_GET_COMPRESS(lbp->lbp_prop) == ZIO_COMPRESS_LZ4) {
+		if (zio_decompress_data_buf(ZIO_COMPRESS_LZ4, buf, lb, asize,
+		    sizeof (*lb)) != 0)
+			err = SET_ERROR(ECKSUM);
+	} else if (L2BLK_GET_COMPRESS(lbp->lbp_prop) == ZIO_COMPRESS_OFF &&
+	    asize >= sizeof (*lb)) {
+		bcopy(buf, lb, sizeof (*lb));
+	} else {
+		err = SET_ERROR(ECKSUM);
+	}
+	abd_return_buf(abd, buf, asize);
+	abd_free(abd);
+
+	if (err == 0 && lb->lb_magic != L2ARC_LOG_BLK_MAGIC)
+		err = SET_ERROR(ECKSUM);
+	if (err != 0)
+		ARCSTAT_BUMP(arcstat_l2_rebuild_cksum_lb_errors);
+
+	return (err);
+}
+
+/*
+ * Recreate an L2-only header for a buffer recorded in a log block.
+ */
+static void
+l2arc_hdr_restore(const l2arc_log_ent_phys_t *le, l2arc_dev_t *dev,
+    uint64_t load_guid)
+{
+	arc_buf_hdr_t *hdr, *exists;
+	kmutex_t *hash_lock;
+	arc_buf_contents_t type = L2BLK_GET_TYPE(le->le_prop);
+	enum zio_compress compress = L2BLK_GET_COMPRESS(le->le_prop);
+	uint64_t lsize = L2BLK_GET_LSIZE(le->le_prop);
+	uint64_t psize = L2BLK_GET_PSIZE(le->le_prop);
+	uint64_t asize;
+
+	/* Ignore anything the feed thread could not have written */
+	if (DVA_IS_EMPTY(&le->le_dva) || le->le_birth == 0 ||
+	    (type != ARC_BUFC_DATA && type != ARC_BUFC_METADATA) ||
+	    compress >= ZIO_COMPRESS_FUNCTIONS ||
+	    compress == ZIO_COMPRESS_EMPTY ||
+	    lsize > SPA_MAXBLOCKSIZE || psize > lsize ||
+	    le->le_daddr < dev->l2ad_start ||
+	    le->le_daddr + psize > dev->l2ad_end)
+		return;
+
+	hdr = kmem_cache_alloc(hdr_l2only_cache, KM_SLEEP);
+	ASSERT(HDR_EMPTY(hdr));
+	HDR_SET_PSIZE(hdr, psize);
+	HDR_SET_LSIZE(hdr, lsize);
+	hdr->b_spa = load_guid;
+	hdr->b_flags = 0;
+	arc_hdr_set_flags(hdr, arc_bufc_to_flags(type) | ARC_FLAG_HAS_L2HDR);
+	arc_hdr_set_compress(hdr, compress);
+	hdr->b_l2hdr.b_dev = dev;
+	hdr->b_l2hdr.b_daddr = le->le_daddr;
+	hdr->b_dva = le->le_dva;
+	hdr->b_birth = le->le_birth;
+
+	exists = buf_hash_insert(hdr, &hash_lock);
+	if (exists != NULL) {
+		/*
+		 * Either the ARC already holds this buffer, or a more
+		 * recent copy was restored from a newer log block.
+		 */
+		mutex_exit(hash_lock);
+		buf_discard_identity(hdr);
+		kmem_cache_free(hdr_l2only_cache, hdr);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_bufs_precached);
+		return;
+	}
+
+	asize = arc_hdr_size(hdr);
+
+	/*
+	 * Log blocks are restored newest first, so appending keeps the
+	 * buflist ordered from newest to oldest, as l2arc_evict() expects.
+	 */
+	mutex_enter(&dev->l2ad_mtx);
+	list_insert_tail(&dev->l2ad_buflist, hdr);
+	(void) refcount_add_many(&dev->l2ad_alloc, asize, hdr);
+	mutex_exit(&dev->l2ad_mtx);
+	mutex_exit(hash_lock);
+
+	ARCSTAT_INCR(arcstat_l2_size, lsize);
+	ARCSTAT_INCR(arcstat_l2_asize, asize);
+	vdev_space_update(dev->l2ad_vdev, asize, 0, 0);
+
+	ARCSTAT_BUMP(arcstat_l2_rebuild_bufs);
+	ARCSTAT_INCR(arcstat_l2_rebuild_size, lsize);
+	ARCSTAT_INCR(arcstat_l2_rebuild_asize, asize);
+}
+
+/*
+ * Rebuild the L2-only headers of a cache device, walking the chain of log
+ * blocks backwards from the one the device header points at, until the
+ * chain ends or reaches a log block that has since been overwritten.
+ */
+static int
+l2arc_rebuild(l2arc_dev_t *dev)
+{
+	l2arc_dev_hdr_phys_t *l2dhdr = dev->l2ad_dev_hdr;
+	uint64_t load_guid = spa_load_guid(dev->l2ad_spa);
+	hrtime_t start = gethrtime();
+	l2arc_log_blk_phys_t *lb;
+	l2arc_log_blkptr_t lbp;
+	int i, err = 0;
+
+	/*
+	 * Carry on from where the feed thread left off.  Buffers written
+	 * after the last log block are not restored and will simply be
+	 * overwritten when the hand comes around again.
+	 */
+	dev->l2ad_hand = l2dhdr->dh_hand;
+	dev->l2ad_evict = l2dhdr->dh_evict;
+	dev->l2ad_first = !!(l2dhdr->dh_flags & L2ARC_DEV_HDR_EVICT_FIRST);
+
+	lb = vmem_zalloc(sizeof (*lb), KM_SLEEP);
+	lbp = l2dhdr->dh_start_lbp;
+
+	/*
+	 * The next log block we write follows on from the most recent one,
+	 * keeping the ranges covered by the chain contiguous.
+	 */
+	if (l2arc_log_blkptr_valid(dev, &lbp)) {
+		dev->l2ad_log_blk_payload_start = lbp.lbp_daddr +
+		    L2BLK_GET_PSIZE(lbp.lbp_prop);
+	} else {
+		dev->l2ad_log_blk_payload_start = dev->l2ad_hand;
+	}
+
+	while (l2arc_log_blkptr_valid(dev, &lbp)) {
+		l2arc_log_blkptr_t prev_lbp;
+
+		if (dev->l2ad_rebuild_cancel) {
+			err = SET_ERROR(ECANCELED);
+			break;
+		}
+
+		/*
+		 * Restored headers take up ARC memory; warming the L2ARC
+		 * is not worth pushing the system into reclaim.
+		 */
+		if (arc_reclaim_needed()) {
+			ARCSTAT_BUMP(arcstat_l2_rebuild_lowmem);
+			err = SET_ERROR(ENOMEM);
+			break;
+		}
+
+		if ((err = l2arc_log_blk_read(dev, &lbp, lb)) != 0)
+			break;
+
+		for (i = L2ARC_LOG_BLK_MAX_ENTRIES - 1; i >= 0; i--)
+			l2arc_hdr_restore(&lb->lb_entries[i], dev, load_guid);
+		ARCSTAT_BUMP(arcstat_l2_rebuild_log_blks);
+
+		/*
+		 * The previous log block must lie outside the range covered
+		 * by this one, or we have come full circle.
+		 */
+		prev_lbp = lb->lb_prev_lbp;
+		if (l2arc_range_check_overlap(lbp.lbp_payload_start,
+		    lbp.lbp_daddr, prev_lbp.lbp_daddr))
+			break;
+		lbp = prev_lbp;
+	}
+
+	vmem_free(lb, sizeof (*lb));
+
+	if (err == 0)
+		ARCSTAT_BUMP(arcstat_l2_rebuild_success);
+	ARCSTAT(arcstat_l2_rebuild_time_ms) = NSEC2MSEC(gethrtime() - start);
+
+	return (err);
+}
+
+static void
+l2arc_dev_rebuild_thread(void *arg)
+{
+	l2arc_dev_t *dev = arg;
+	fstrans_cookie_t cookie;
+	int err;
+
+	cookie = spl_fstrans_mark();
+	ARCSTAT_BUMP(arcstat_l2_rebuild_active);
+	err = l2arc_rebuild(dev);
+	ARCSTAT_BUMPDOWN(arcstat_l2_rebuild_active);
+	spl_fstrans_unmark(cookie);
+
+	zfs_dbgmsg("L2ARC rebuild of vdev %llu %s (%d)",
+	    (u_longlong_t)dev->l2ad_vdev->vdev_guid,
+	    err == 0 ? "complete" : "aborted", err);
+
+	mutex_enter(&l2arc_rebuild_thr_lock);
+	dev->l2ad_rebuild = B_FALSE;
+	dev->l2ad_rebuild_began = B_FALSE;
+	cv_broadcast(&l2arc_rebuild_thr_cv);
+	mutex_exit(&l2arc_rebuild_thr_lock);
+
+	thread_exit();
+}
+
+/*
+ * Start a rebuild thread for each of the pool's cache devices flagged
+ * by l2arc_add_vdev().  Called from the spa async thread, holding the
+ * namespace lock and SCL_L2ARC, which keep the devices from going away.
+ */
+void
+l2arc_spa_rebuild_start(spa_t *spa)
+{
+	int i;
+
+	ASSERT(MUTEX_HELD(&spa_namespace_lock));
+
+	for (i = 0; i < spa->spa_l2cache.sav_count; i++) {
+		vdev_t *vd = spa->spa_l2cache.sav_vdevs[i];
+		l2arc_dev_t *dev;
+
+		mutex_enter(&l2arc_dev_mtx);
+		for (dev = list_head(l2arc_dev_list); dev != NULL;
+		    dev = list_next(l2arc_dev_list, dev)) {
+			if (dev->l2ad_vdev == vd)
+				break;
+		}
+		mutex_exit(&l2arc_dev_mtx);
+
+		if (dev == NULL)
+			continue;
+
+		mutex_enter(&l2arc_rebuild_thr_lock);
+		if (dev->l2ad_rebuild && !dev->l2ad_rebuild_began &&
+		    !dev->l2ad_rebuild_cancel) {
+			dev->l2ad_rebuild_began = B_TRUE;
+			(void) thread_create(NULL, 0, l2arc_dev_rebuild_thread,
+			    dev, 0, &p0, TS_RUN, minclsyspri);
+		}
+		mutex_exit(&l2arc_rebuild_thr_lock);
+	}
+}
+
 #if defined(_KERNEL) && defined(HAVE_SPL)
 EXPORT_SYMBOL(arc_buf_size);
 EXPORT_SYMBOL(arc_write);
@@ -8410,6 +9535,10 @@ module_param(zfs_arc_num_sublists_per_state, int, 0644);
 MODULE_PARM_DESC(zfs_arc_num_sublists_per_state,
 	"Number of sublists used in each of the ARC state lists");
 
+module_param(zfs_arc_evict_threads, int, 0444);
+MODULE_PARM_DESC(zfs_arc_evict_threads,
+	"Number of threads used to evict from the ARC state lists");
+
 module_param(l2arc_write_max, ulong, 0644);
 MODULE_PARM_DESC(l2arc_write_max, "Max write bytes per interval");
 
@@ -8437,6 +9566,14 @@ MODULE_PARM_DESC(l2arc_feed_again, "Turbo L2ARC warmup");
 module_param(l2arc_norw, int, 0644);
 MODULE_PARM_DESC(l2arc_norw, "No reads during writes");
 
+module_param(l2arc_rebuild_enabled, int, 0644);
+MODULE_PARM_DESC(l2arc_rebuild_enabled,
+	"Rebuild the L2ARC when importing a pool");
+
+module_param(l2arc_rebuild_blocks_min_l2size, ulong, 0644);
+MODULE_PARM_DESC(l2arc_rebuild_blocks_min_l2size,
+	"Min size in bytes to write rebuild log blocks in L2ARC");
+
 module_param(zfs_arc_lotsfree_percent, int, 0644);
 MODULE_PARM_DESC(zfs_arc_lotsfree_percent,
 	"System free memory I/O throttle in bytes");
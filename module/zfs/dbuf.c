@@ -193,8 +193,6 @@ dbuf_dest(void *vdb, void *unused)
  */
 static dbuf_hash_table_t dbuf_hash_table;
 
-static uint64_t dbuf_hash_count;
-
 static uint64_t
 dbuf_hash(void *os, uint64_t obj, uint8_t lvl, uint64_t blkid)
 {
@@ -224,25 +222,28 @@ dmu_buf_impl_t *
 dbuf_find(objset_t *os, uint64_t obj, uint8_t level, uint64_t blkid)
 {
 	dbuf_hash_table_t *h = &dbuf_hash_table;
+	dbuf_hash_rwlock_t *dhr;
 	uint64_t hv;
-	uint64_t idx;
 	dmu_buf_impl_t *db;
 
 	hv = dbuf_hash(os, obj, level, blkid);
-	idx = hv & h->hash_table_mask;
+	dhr = DBUF_HASH_RWLOCK(h, hv);
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (db = h->hash_table[idx]; db != NULL; db = db->db_hash_next) {
+	rw_enter(&dhr->dhr_lock, RW_READER);
+	for (db = dhr->dhr_table[hv & dhr->dhr_mask]; db != NULL;
+	    db = db->db_hash_next) {
 		if (DBUF_EQUAL(db, os, obj, level, blkid)) {
 			mutex_enter(&db->db_mtx);
 			if (db->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
+				rw_exit(&dhr->dhr_lock);
+				atomic_inc_64(&dhr->dhr_hits);
 				return (db);
 			}
 			mutex_exit(&db->db_mtx);
 		}
 	}
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
+	rw_exit(&dhr->dhr_lock);
+	atomic_inc_64(&dhr->dhr_misses);
 	return (NULL);
 }
 
@@ -274,22 +275,25 @@ static dmu_buf_impl_t *
 dbuf_hash_insert(dmu_buf_impl_t *db)
 {
 	dbuf_hash_table_t *h = &dbuf_hash_table;
+	dbuf_hash_rwlock_t *dhr;
 	objset_t *os = db->db_objset;
 	uint64_t obj = db->db.db_object;
 	int level = db->db_level;
-	uint64_t blkid, hv, idx;
+	uint64_t blkid, hv, idx, i, max;
 	dmu_buf_impl_t *dbf;
 
 	blkid = db->db_blkid;
 	hv = dbuf_hash(os, obj, level, blkid);
-	idx = hv & h->hash_table_mask;
+	dhr = DBUF_HASH_RWLOCK(h, hv);
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	for (dbf = h->hash_table[idx]; dbf != NULL; dbf = dbf->db_hash_next) {
+	rw_enter(&dhr->dhr_lock, RW_WRITER);
+	idx = hv & dhr->dhr_mask;
+	for (dbf = dhr->dhr_table[idx], i = 0; dbf != NULL;
+	    dbf = dbf->db_hash_next, i++) {
 		if (DBUF_EQUAL(dbf, os, obj, level, blkid)) {
 			mutex_enter(&dbf->db_mtx);
 			if (dbf->db_state != DB_EVICTING) {
-				mutex_exit(DBUF_HASH_MUTEX(h, idx));
+				rw_exit(&dhr->dhr_lock);
 				return (dbf);
 			}
 			mutex_exit(&dbf->db_mtx);
@@ -297,10 +301,17 @@ dbuf_hash_insert(dmu_buf_impl_t *db)
 	}
 
 	mutex_enter(&db->db_mtx);
-	db->db_hash_next = h->hash_table[idx];
-	h->hash_table[idx] = db;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
-	atomic_inc_64(&dbuf_hash_count);
+	db->db_hash_next = dhr->dhr_table[idx];
+	dhr->dhr_table[idx] = db;
+	rw_exit(&dhr->dhr_lock);
+	atomic_inc_64(&h->hash_elements);
+
+	if (i > 0) {
+		atomic_inc_64(&h->hash_collisions);
+		while (i + 1 > (max = h->hash_chain_max) &&
+		    max != atomic_cas_64(&h->hash_chain_max, max, i + 1))
+			continue;
+	}
 
 	return (NULL);
 }
@@ -312,31 +323,107 @@ static void
 dbuf_hash_remove(dmu_buf_impl_t *db)
 {
 	dbuf_hash_table_t *h = &dbuf_hash_table;
-	uint64_t hv, idx;
+	dbuf_hash_rwlock_t *dhr;
+	uint64_t hv;
 	dmu_buf_impl_t *dbf, **dbp;
 
 	hv = dbuf_hash(db->db_objset, db->db.db_object,
 	    db->db_level, db->db_blkid);
-	idx = hv & h->hash_table_mask;
+	dhr = DBUF_HASH_RWLOCK(h, hv);
 
 	/*
 	 * We mustn't hold db_mtx to maintain lock ordering:
-	 * DBUF_HASH_MUTEX > db_mtx.
+	 * DBUF_HASH_RWLOCK > db_mtx.
 	 */
 	ASSERT(refcount_is_zero(&db->db_holds));
 	ASSERT(db->db_state == DB_EVICTING);
 	ASSERT(!MUTEX_HELD(&db->db_mtx));
 
-	mutex_enter(DBUF_HASH_MUTEX(h, idx));
-	dbp = &h->hash_table[idx];
+	rw_enter(&dhr->dhr_lock, RW_WRITER);
+	dbp = &dhr->dhr_table[hv & dhr->dhr_mask];
 	while ((dbf = *dbp) != db) {
 		dbp = &dbf->db_hash_next;
 		ASSERT(dbf != NULL);
 	}
 	*dbp = db->db_hash_next;
 	db->db_hash_next = NULL;
-	mutex_exit(DBUF_HASH_MUTEX(h, idx));
-	atomic_dec_64(&dbuf_hash_count);
+	rw_exit(&dhr->dhr_lock);
+	atomic_dec_64(&h->hash_elements);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+/*
+ * Large allocations which do not require contiguous pages
+ * should be using vmem_alloc() in the linux kernel
+ */
+#define	DBUF_HASH_TABLE_ALLOC(size, flags)	vmem_zalloc(size, flags)
+#define	DBUF_HASH_TABLE_FREE(table, size)	vmem_free(table, size)
+#else
+#define	DBUF_HASH_TABLE_ALLOC(size, flags)	kmem_zalloc(size, flags)
+#define	DBUF_HASH_TABLE_FREE(table, size)	kmem_free(table, size)
+#endif
+
+/*
+ * The table starts at 1/2^DBUF_HASH_TABLE_SHIFT of the size it may grow to,
+ * and is doubled by the eviction thread once it holds more than
+ * DBUF_HASH_LOAD_MAX dbufs per bucket on average.
+ */
+#define	DBUF_HASH_TABLE_SHIFT	4
+#define	DBUF_HASH_LOAD_MAX	2
+
+static uint64_t dbuf_hash_table_max;
+
+/*
+ * Double the size of the hash table.  The buckets of each stripe are moved
+ * to the new table under the writer lock of the stripe, so lookups and
+ * insertions only ever wait for the move of the buckets of their own
+ * stripe.  Only called from the eviction thread, so there is never more
+ * than one resize in progress.
+ */
+static void
+dbuf_hash_table_grow(void)
+{
+	dbuf_hash_table_t *h = &dbuf_hash_table;
+	uint64_t hsize = h->hash_table_mask + 1;
+	uint64_t nsize = hsize << 1;
+	dmu_buf_impl_t **otable = h->hash_table;
+	dmu_buf_impl_t **ntable;
+	int i;
+
+	if (h->hash_elements <= hsize * DBUF_HASH_LOAD_MAX ||
+	    nsize > dbuf_hash_table_max)
+		return;
+
+	ntable = DBUF_HASH_TABLE_ALLOC(nsize * sizeof (void *), KM_NOSLEEP);
+	if (ntable == NULL)
+		return;
+
+	for (i = 0; i < DBUF_RWLOCKS; i++) {
+		dbuf_hash_rwlock_t *dhr = &h->hash_rwlocks[i];
+		dmu_buf_impl_t *db;
+		uint64_t idx, nidx;
+
+		rw_enter(&dhr->dhr_lock, RW_WRITER);
+		for (idx = i; idx < hsize; idx += DBUF_RWLOCKS) {
+			while ((db = otable[idx]) != NULL) {
+				nidx = dbuf_hash(db->db_objset,
+				    db->db.db_object, db->db_level,
+				    db->db_blkid) & (nsize - 1);
+				otable[idx] = db->db_hash_next;
+				db->db_hash_next = ntable[nidx];
+				ntable[nidx] = db;
+			}
+		}
+		dhr->dhr_table = ntable;
+		dhr->dhr_mask = nsize - 1;
+		rw_exit(&dhr->dhr_lock);
+	}
+
+	h->hash_table = ntable;
+	h->hash_table_mask = nsize - 1;
+	h->hash_chain_max = 0;
+	h->hash_grows++;
+	DBUF_HASH_TABLE_FREE(otable, hsize * sizeof (void *));
 }
 
 typedef enum {
@@ -531,7 +618,7 @@ dbuf_evict_thread(void)
 
 	mutex_enter(&dbuf_evict_lock);
 	while (!dbuf_evict_thread_exit) {
-		while (!dbuf_cache_above_lowater() && !dbuf_evict_thread_exit) {
+		if (!dbuf_cache_above_lowater()) {
 			CALLB_CPR_SAFE_BEGIN(&cpr);
 			(void) cv_timedwait_sig_hires(&dbuf_evict_cv,
 			    &dbuf_evict_lock, SEC2NSEC(1), MSEC2NSEC(1), 0);
@@ -539,6 +626,8 @@ dbuf_evict_thread(void)
 		}
 		mutex_exit(&dbuf_evict_lock);
 
+		dbuf_hash_table_grow();
+
 		/*
 		 * Keep evicting as long as we're above the low water mark
 		 * for the cache. We do this without holding the locks to
@@ -614,28 +703,28 @@ dbuf_init(void)
 	int i;
 
 	/*
-	 * The hash table is big enough to fill all of physical memory
-	 * with an average block size of zfs_arc_average_blocksize (default 8K).
-	 * By default, the table will take up
+	 * The hash table may grow to be big enough to fill all of physical
+	 * memory with an average block size of zfs_arc_average_blocksize
+	 * (default 8K), in which case it takes up
 	 * totalmem * sizeof(void*) / 8K (1MB per GB with 8-byte pointers).
+	 * It starts at a fraction of that, but never at less than one
+	 * bucket per stripe.
 	 */
 	while (hsize * zfs_arc_average_blocksize < physmem * PAGESIZE)
 		hsize <<= 1;
+	dbuf_hash_table_max = hsize;
+	hsize = MAX(hsize >> DBUF_HASH_TABLE_SHIFT, 1ULL << 16);
 
 retry:
 	h->hash_table_mask = hsize - 1;
 #if defined(_KERNEL) && defined(HAVE_SPL)
-	/*
-	 * Large allocations which do not require contiguous pages
-	 * should be using vmem_alloc() in the linux kernel
-	 */
-	h->hash_table = vmem_zalloc(hsize * sizeof (void *), KM_SLEEP);
+	h->hash_table = DBUF_HASH_TABLE_ALLOC(hsize * sizeof (void *),
+	    KM_SLEEP);
 #else
-	h->hash_table = kmem_zalloc(hsize * sizeof (void *), KM_NOSLEEP);
+	h->hash_table = DBUF_HASH_TABLE_ALLOC(hsize * sizeof (void *),
+	    hsize > DBUF_RWLOCKS ? KM_NOSLEEP : KM_SLEEP);
 #endif
 	if (h->hash_table == NULL) {
-		/* XXX - we should really return an error instead of assert */
-		ASSERT(hsize > (1ULL << 10));
 		hsize >>= 1;
 		goto retry;
 	}
@@ -644,8 +733,15 @@ retry:
 	    sizeof (dmu_buf_impl_t),
 	    0, dbuf_cons, dbuf_dest, NULL, NULL, NULL, 0);
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
-		mutex_init(&h->hash_mutexes[i], NULL, MUTEX_DEFAULT, NULL);
+	/* Every stripe must start on its own cache line */
+	CTASSERT(sizeof (dbuf_hash_rwlock_t) % DBUF_HASH_RWLOCK_ALIGN == 0);
+	for (i = 0; i < DBUF_RWLOCKS; i++) {
+		dbuf_hash_rwlock_t *dhr = &h->hash_rwlocks[i];
+
+		rw_init(&dhr->dhr_lock, NULL, RW_DEFAULT, NULL);
+		dhr->dhr_table = h->hash_table;
+		dhr->dhr_mask = h->hash_table_mask;
+	}
 
 	dbuf_stats_init(h);
 
@@ -684,20 +780,10 @@ dbuf_fini(void)
 
 	dbuf_stats_destroy();
 
-	for (i = 0; i < DBUF_MUTEXES; i++)
-		mutex_destroy(&h->hash_mutexes[i]);
-#if defined(_KERNEL) && defined(HAVE_SPL)
 	/*
-	 * Large allocations which do not require contiguous pages
-	 * should be using vmem_free() in the linux kernel
+	 * The eviction thread may resize the hash table, so it must be
+	 * stopped before the table is freed.
 	 */
-	vmem_free(h->hash_table, (h->hash_table_mask + 1) * sizeof (void *));
-#else
-	kmem_free(h->hash_table, (h->hash_table_mask + 1) * sizeof (void *));
-#endif
-	kmem_cache_destroy(dbuf_kmem_cache);
-	taskq_destroy(dbu_evict_taskq);
-
 	mutex_enter(&dbuf_evict_lock);
 	dbuf_evict_thread_exit = B_TRUE;
 	while (dbuf_evict_thread_exit) {
@@ -707,6 +793,13 @@ dbuf_fini(void)
 	mutex_exit(&dbuf_evict_lock);
 	tsd_destroy(&zfs_dbuf_evict_key);
 
+	for (i = 0; i < DBUF_RWLOCKS; i++)
+		rw_destroy(&h->hash_rwlocks[i].dhr_lock);
+	DBUF_HASH_TABLE_FREE(h->hash_table,
+	    (h->hash_table_mask + 1) * sizeof (void *));
+	kmem_cache_destroy(dbuf_kmem_cache);
+	taskq_destroy(dbu_evict_taskq);
+
 	mutex_destroy(&dbuf_evict_lock);
 	cv_destroy(&dbuf_evict_cv);
 
@@ -1219,8 +1312,10 @@ dbuf_read(dmu_buf_impl_t *db, zio_t *zio, uint32_t flags)
 			dbuf_set_data(db, db->db_buf);
 		}
 		mutex_exit(&db->db_mtx);
-		if (prefetch)
-			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE);
+		if (prefetch) {
+			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE,
+			    B_FALSE);
+		}
 		if ((flags & DB_RF_HAVESTRUCT) == 0)
 			rw_exit(&dn->dn_struct_rwlock);
 		DB_DNODE_EXIT(db);
@@ -1235,8 +1330,10 @@ dbuf_read(dmu_buf_impl_t *db, zio_t *zio, uint32_t flags)
 
 		/* dbuf_read_impl has dropped db_mtx for us */
 
-		if (!err && prefetch)
-			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE);
+		if (!err && prefetch) {
+			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE,
+			    db->db_state != DB_CACHED);
+		}
 
 		if ((flags & DB_RF_HAVESTRUCT) == 0)
 			rw_exit(&dn->dn_struct_rwlock);
@@ -1254,8 +1351,10 @@ dbuf_read(dmu_buf_impl_t *db, zio_t *zio, uint32_t flags)
 		 * occurred and the dbuf went to UNCACHED.
 		 */
 		mutex_exit(&db->db_mtx);
-		if (prefetch)
-			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE);
+		if (prefetch) {
+			dmu_zfetch(&dn->dn_zfetch, db->db_blkid, 1, B_TRUE,
+			    B_TRUE);
+		}
 		if ((flags & DB_RF_HAVESTRUCT) == 0)
 			rw_exit(&dn->dn_struct_rwlock);
 		DB_DNODE_EXIT(db);
@@ -2356,6 +2455,29 @@ dbuf_findbp(dnode_t *dn, int level, uint64_t blkid, int fail_sparse,
 	}
 }
 
+/*
+ * Copy the block pointer of a block of a dnode, reading in the indirect
+ * blocks leading to it if needed, without holding a dbuf for the block
+ * itself.  Returns ENOENT if the block is past the end of the object.
+ */
+int
+dbuf_dnode_findbp(dnode_t *dn, uint64_t level, uint64_t blkid, blkptr_t *bp)
+{
+	dmu_buf_impl_t *parent = NULL;
+	blkptr_t *bpp = NULL;
+	int err;
+
+	ASSERT(RW_LOCK_HELD(&dn->dn_struct_rwlock));
+
+	err = dbuf_findbp(dn, level, blkid, B_TRUE, &parent, &bpp, NULL);
+	if (err == 0) {
+		*bp = *bpp;
+		if (parent != NULL)
+			dbuf_rele(parent, NULL);
+	}
+	return (err);
+}
+
 static dmu_buf_impl_t *
 dbuf_create(dnode_t *dn, uint8_t level, uint64_t blkid,
     dmu_buf_impl_t *parent, blkptr_t *blkptr)
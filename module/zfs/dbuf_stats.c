@@ -129,6 +129,7 @@ dbuf_stats_hash_table_data(char *buf, size_t size, void *data)
 {
 	dbuf_stats_t *dsh = (dbuf_stats_t *)data;
 	dbuf_hash_table_t *h = dsh->hash;
+	dbuf_hash_rwlock_t *dhr = DBUF_HASH_RWLOCK(h, dsh->idx);
 	dmu_buf_impl_t *db;
 	int length, error = 0;
 
@@ -136,8 +137,19 @@ dbuf_stats_hash_table_data(char *buf, size_t size, void *data)
 	ASSERT3S(dsh->idx, <=, h->hash_table_mask);
 	memset(buf, 0, size);
 
-	mutex_enter(DBUF_HASH_MUTEX(h, dsh->idx));
-	for (db = h->hash_table[dsh->idx]; db != NULL; db = db->db_hash_next) {
+	/*
+	 * While the table is being grown, the buckets of a stripe which has
+	 * not been moved yet are still in the smaller table.  Their dbufs
+	 * were already reported under a lower index.
+	 */
+	rw_enter(&dhr->dhr_lock, RW_READER);
+	if (dsh->idx > dhr->dhr_mask) {
+		rw_exit(&dhr->dhr_lock);
+		return (0);
+	}
+
+	for (db = dhr->dhr_table[dsh->idx]; db != NULL;
+	    db = db->db_hash_next) {
 		/*
 		 * Returning ENOMEM will cause the data and header functions
 		 * to be called with a larger scratch buffers.
@@ -157,7 +169,7 @@ dbuf_stats_hash_table_data(char *buf, size_t size, void *data)
 
 		mutex_exit(&db->db_mtx);
 	}
-	mutex_exit(DBUF_HASH_MUTEX(h, dsh->idx));
+	rw_exit(&dhr->dhr_lock);
 
 	return (error);
 }
@@ -213,15 +225,99 @@ dbuf_stats_hash_table_destroy(void)
 	mutex_destroy(&dsh->lock);
 }
 
+/*
+ * ==========================================================================
+ * Dbuf Hash Statistics
+ * ==========================================================================
+ */
+typedef struct dbuf_hash_stats {
+	kstat_named_t dhs_elements;
+	kstat_named_t dhs_buckets;
+	kstat_named_t dhs_hits;
+	kstat_named_t dhs_misses;
+	kstat_named_t dhs_collisions;
+	kstat_named_t dhs_chain_max;
+	kstat_named_t dhs_grows;
+} dbuf_hash_stats_t;
+
+static dbuf_hash_stats_t dbuf_hash_stats = {
+	{ "elements",		KSTAT_DATA_UINT64 },
+	{ "buckets",		KSTAT_DATA_UINT64 },
+	{ "hits",		KSTAT_DATA_UINT64 },
+	{ "misses",		KSTAT_DATA_UINT64 },
+	{ "collisions",		KSTAT_DATA_UINT64 },
+	{ "chain_max",		KSTAT_DATA_UINT64 },
+	{ "grows",		KSTAT_DATA_UINT64 }
+};
+
+static kstat_t *dbuf_hash_ksp;
+
+/*
+ * The lookups are counted by stripe, to keep them from all updating the
+ * same cache line, and are only summed up when the kstat is read.
+ */
+static int
+dbuf_hash_stats_update(kstat_t *ksp, int rw)
+{
+	dbuf_hash_stats_t *dhs = ksp->ks_data;
+	dbuf_hash_table_t *h = ksp->ks_private;
+	uint64_t hits = 0, misses = 0;
+	int i;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	for (i = 0; i < DBUF_RWLOCKS; i++) {
+		hits += h->hash_rwlocks[i].dhr_hits;
+		misses += h->hash_rwlocks[i].dhr_misses;
+	}
+
+	dhs->dhs_elements.value.ui64 = h->hash_elements;
+	dhs->dhs_buckets.value.ui64 = h->hash_table_mask + 1;
+	dhs->dhs_hits.value.ui64 = hits;
+	dhs->dhs_misses.value.ui64 = misses;
+	dhs->dhs_collisions.value.ui64 = h->hash_collisions;
+	dhs->dhs_chain_max.value.ui64 = h->hash_chain_max;
+	dhs->dhs_grows.value.ui64 = h->hash_grows;
+
+	return (0);
+}
+
+static void
+dbuf_hash_stats_init(dbuf_hash_table_t *hash)
+{
+	dbuf_hash_ksp = kstat_create("zfs", 0, "dbuf_hash", "misc",
+	    KSTAT_TYPE_NAMED, sizeof (dbuf_hash_stats) / sizeof (kstat_named_t),
+	    KSTAT_FLAG_VIRTUAL);
+
+	if (dbuf_hash_ksp != NULL) {
+		dbuf_hash_ksp->ks_data = &dbuf_hash_stats;
+		dbuf_hash_ksp->ks_private = hash;
+		dbuf_hash_ksp->ks_update = dbuf_hash_stats_update;
+		kstat_install(dbuf_hash_ksp);
+	}
+}
+
+static void
+dbuf_hash_stats_destroy(void)
+{
+	if (dbuf_hash_ksp != NULL) {
+		kstat_delete(dbuf_hash_ksp);
+		dbuf_hash_ksp = NULL;
+	}
+}
+
 void
 dbuf_stats_init(dbuf_hash_table_t *hash)
 {
 	dbuf_stats_hash_table_init(hash);
+	dbuf_hash_stats_init(hash);
 }
 
 void
 dbuf_stats_destroy(void)
 {
+	dbuf_hash_stats_destroy();
 	dbuf_stats_hash_table_destroy();
 }
 
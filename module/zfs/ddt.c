@@ -202,7 +202,7 @@ ddt_object_update(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
 	    ddt->ddt_object[type][class], dde, tx));
 }
 
-static int
+int
 ddt_object_remove(ddt_t *ddt, enum ddt_type type, enum ddt_class class,
     ddt_entry_t *dde, dmu_tx_t *tx)
 {
@@ -695,11 +695,13 @@ ddt_init(void)
 	    sizeof (ddt_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
 	ddt_entry_cache = kmem_cache_create("ddt_entry_cache",
 	    sizeof (ddt_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	ddt_log_init();
 }
 
 void
 ddt_fini(void)
 {
+	ddt_log_fini();
 	kmem_cache_destroy(ddt_entry_cache);
 	kmem_cache_destroy(ddt_cache);
 }
@@ -771,6 +773,16 @@ ddt_lookup(ddt_t *ddt, const blkptr_t *bp, boolean_t add)
 	if (dde->dde_loaded)
 		return (dde);
 
+	/*
+	 * The log has the newest version of the entries in it, in memory.
+	 */
+	if (ddt_log_lookup(ddt, dde, NULL)) {
+		dde->dde_loaded = B_TRUE;
+		if (dde->dde_type != DDT_TYPES)
+			ddt_stat_update(ddt, dde, -1ULL);
+		return (dde);
+	}
+
 	dde->dde_loading = B_TRUE;
 
 	ddt_exit(ddt);
@@ -843,12 +855,10 @@ typedef struct ddt_key_cmp {
 } ddt_key_cmp_t;
 
 int
-ddt_entry_compare(const void *x1, const void *x2)
+ddt_key_compare(const ddt_key_t *ddk1, const ddt_key_t *ddk2)
 {
-	const ddt_entry_t *dde1 = x1;
-	const ddt_entry_t *dde2 = x2;
-	const ddt_key_cmp_t *k1 = (const ddt_key_cmp_t *)&dde1->dde_key;
-	const ddt_key_cmp_t *k2 = (const ddt_key_cmp_t *)&dde2->dde_key;
+	const ddt_key_cmp_t *k1 = (const ddt_key_cmp_t *)ddk1;
+	const ddt_key_cmp_t *k2 = (const ddt_key_cmp_t *)ddk2;
 	int32_t cmp = 0;
 	int i;
 
@@ -861,6 +871,15 @@ ddt_entry_compare(const void *x1, const void *x2)
 	return (AVL_ISIGN(cmp));
 }
 
+int
+ddt_entry_compare(const void *x1, const void *x2)
+{
+	const ddt_entry_t *dde1 = x1;
+	const ddt_entry_t *dde2 = x2;
+
+	return (ddt_key_compare(&dde1->dde_key, &dde2->dde_key));
+}
+
 static ddt_t *
 ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 {
@@ -874,6 +893,7 @@ ddt_table_alloc(spa_t *spa, enum zio_checksum c)
 	    sizeof (ddt_entry_t), offsetof(ddt_entry_t, dde_node));
 	avl_create(&ddt->ddt_repair_tree, ddt_entry_compare,
 	    sizeof (ddt_entry_t), offsetof(ddt_entry_t, dde_node));
+	ddt_log_alloc(ddt);
 	ddt->ddt_checksum = c;
 	ddt->ddt_spa = spa;
 	ddt->ddt_os = spa->spa_meta_objset;
@@ -888,6 +908,7 @@ ddt_table_free(ddt_t *ddt)
 	ASSERT(avl_numnodes(&ddt->ddt_repair_tree) == 0);
 	avl_destroy(&ddt->ddt_tree);
 	avl_destroy(&ddt->ddt_repair_tree);
+	ddt_log_free(ddt);
 	mutex_destroy(&ddt->ddt_lock);
 	kmem_cache_free(ddt_cache, ddt);
 }
@@ -931,6 +952,10 @@ ddt_load(spa_t *spa)
 			}
 		}
 
+		error = ddt_log_load(ddt);
+		if (error != 0)
+			return (error);
+
 		/*
 		 * Seed the cached histograms.
 		 */
@@ -962,6 +987,7 @@ ddt_class_contains(spa_t *spa, enum ddt_class max_class, const blkptr_t *bp)
 	ddt_entry_t *dde;
 	enum ddt_type type;
 	enum ddt_class class;
+	boolean_t found, moved;
 
 	if (!BP_GET_DEDUP(bp))
 		return (B_FALSE);
@@ -974,6 +1000,18 @@ ddt_class_contains(spa_t *spa, enum ddt_class max_class, const blkptr_t *bp)
 
 	ddt_key_fill(&(dde->dde_key), bp);
 
+	/*
+	 * ddt_walk() skips the logged entries which have moved.
+	 */
+	ddt_enter(ddt);
+	found = ddt_log_lookup(ddt, dde, &moved);
+	ddt_exit(ddt);
+	if (found) {
+		found = !moved && dde->dde_class <= max_class;
+		kmem_cache_free(ddt_entry_cache, dde);
+		return (found);
+	}
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		for (class = 0; class <= max_class; class++) {
 			if (ddt_object_lookup(ddt, type, class, dde) == 0) {
@@ -994,11 +1032,21 @@ ddt_repair_start(ddt_t *ddt, const blkptr_t *bp)
 	ddt_entry_t *dde;
 	enum ddt_type type;
 	enum ddt_class class;
+	boolean_t found;
 
 	ddt_key_fill(&ddk, bp);
 
 	dde = ddt_alloc(&ddk);
 
+	ddt_enter(ddt);
+	found = ddt_log_lookup(ddt, dde, NULL);
+	ddt_exit(ddt);
+	if (found) {
+		if (dde->dde_class == DDT_CLASS_UNIQUE)
+			bzero(dde->dde_phys, sizeof (dde->dde_phys));
+		return (dde);
+	}
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		for (class = 0; class < DDT_CLASSES; class++) {
 			/*
@@ -1095,7 +1143,8 @@ ddt_repair_table(ddt_t *ddt, zio_t *rio)
 }
 
 static void
-ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
+ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg,
+    boolean_t log)
 {
 	dsl_pool_t *dp = ddt->ddt_spa->spa_dsl_pool;
 	ddt_phys_t *ddp = dde->dde_phys;
@@ -1133,7 +1182,7 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 	else
 		nclass = DDT_CLASS_UNIQUE;
 
-	if (otype != DDT_TYPES &&
+	if (otype != DDT_TYPES && !log &&
 	    (otype != ntype || oclass != nclass || total_refcnt == 0)) {
 		VERIFY(ddt_object_remove(ddt, otype, oclass, dde, tx) == 0);
 		ASSERT(ddt_object_lookup(ddt, otype, oclass, dde) == ENOENT);
@@ -1145,7 +1194,11 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 		ddt_stat_update(ddt, dde, 0);
 		if (!ddt_object_exists(ddt, ntype, nclass))
 			ddt_object_create(ddt, ntype, nclass, tx);
-		VERIFY(ddt_object_update(ddt, ntype, nclass, dde, tx) == 0);
+		if (log)
+			ddt_log_entry(ddt, dde, otype, oclass, tx);
+		else
+			VERIFY(ddt_object_update(ddt, ntype, nclass, dde,
+			    tx) == 0);
 
 		/*
 		 * If the class changes, the order that we scan this bp
@@ -1158,6 +1211,10 @@ ddt_sync_entry(ddt_t *ddt, ddt_entry_t *dde, dmu_tx_t *tx, uint64_t txg)
 			dsl_scan_ddt_entry(dp->dp_scan,
 			    ddt->ddt_checksum, dde, tx);
 		}
+	} else if (log && otype != DDT_TYPES) {
+		dde->dde_type = DDT_TYPES;
+		dde->dde_class = DDT_CLASSES;
+		ddt_log_entry(ddt, dde, otype, oclass, tx);
 	}
 }
 
@@ -1169,23 +1226,37 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 	void *cookie = NULL;
 	enum ddt_type type;
 	enum ddt_class class;
+	boolean_t dirty = (avl_numnodes(&ddt->ddt_tree) != 0);
+	boolean_t log;
 
-	if (avl_numnodes(&ddt->ddt_tree) == 0)
+	if (!dirty && list_is_empty(&ddt->ddt_logs))
 		return;
 
 	ASSERT(spa->spa_uberblock.ub_version >= SPA_VERSION_DEDUP);
 
-	if (spa->spa_ddt_stat_object == 0) {
-		spa->spa_ddt_stat_object = zap_create_link(ddt->ddt_os,
-		    DMU_OT_DDT_STATS, DMU_POOL_DIRECTORY_OBJECT,
-		    DMU_POOL_DDT_STATS, tx);
-	}
+	if (dirty) {
+		if (spa->spa_ddt_stat_object == 0) {
+			spa->spa_ddt_stat_object = zap_create_link(ddt->ddt_os,
+			    DMU_OT_DDT_STATS, DMU_POOL_DIRECTORY_OBJECT,
+			    DMU_POOL_DDT_STATS, tx);
+		}
 
-	while ((dde = avl_destroy_nodes(&ddt->ddt_tree, &cookie)) != NULL) {
-		ddt_sync_entry(ddt, dde, tx, txg);
-		ddt_free(dde);
+		log = ddt_log_begin(ddt, tx);
+		while ((dde = avl_destroy_nodes(&ddt->ddt_tree, &cookie)) !=
+		    NULL) {
+			ddt_sync_entry(ddt, dde, tx, txg, log);
+			ddt_free(dde);
+		}
+		if (log)
+			ddt_log_commit(ddt, tx);
 	}
 
+	if (spa_sync_pass(spa) == 1 && ddt_log_flush(ddt, tx))
+		dirty = B_TRUE;
+
+	if (!dirty)
+		return;
+
 	for (type = 0; type < DDT_TYPES; type++) {
 		uint64_t add, count = 0;
 		for (class = 0; class < DDT_CLASSES; class++) {
@@ -1196,6 +1267,12 @@ ddt_sync_table(ddt_t *ddt, dmu_tx_t *tx, uint64_t txg)
 				count += add;
 			}
 		}
+		/*
+		 * The histograms of the classes of logged entries must be
+		 * kept until those are merged.
+		 */
+		if (avl_numnodes(&ddt->ddt_log_tree) != 0)
+			continue;
 		for (class = 0; class < DDT_CLASSES; class++) {
 			if (count == 0 && ddt_object_exists(ddt, type, class))
 				ddt_object_destroy(ddt, type, class, tx);
@@ -1232,6 +1309,23 @@ ddt_sync(spa_t *spa, uint64_t txg)
 	dmu_tx_commit(tx);
 }
 
+/*
+ * A logged entry is returned by ddt_walk() with its logged version if the
+ * ZAP object being walked is the one of its logged class, and skipped
+ * otherwise.  ddt_log_walk() returns the entries skipped.
+ */
+static boolean_t
+ddt_walk_skip(ddt_t *ddt, ddt_entry_t *dde)
+{
+	boolean_t moved = B_FALSE;
+
+	ddt_enter(ddt);
+	(void) ddt_log_lookup(ddt, dde, &moved);
+	ddt_exit(ddt);
+
+	return (moved);
+}
+
 int
 ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 {
@@ -1242,9 +1336,13 @@ ddt_walk(spa_t *spa, ddt_bookmark_t *ddb, ddt_entry_t *dde)
 				int error = ENOENT;
 				if (ddt_object_exists(ddt, ddb->ddb_type,
 				    ddb->ddb_class)) {
-					error = ddt_object_walk(ddt,
-					    ddb->ddb_type, ddb->ddb_class,
-					    &ddb->ddb_cursor, dde);
+					do {
+						error = ddt_object_walk(ddt,
+						    ddb->ddb_type,
+						    ddb->ddb_class,
+						    &ddb->ddb_cursor, dde);
+					} while (error == 0 &&
+					    ddt_walk_skip(ddt, dde));
 				}
 				dde->dde_type = ddb->ddb_type;
 				dde->dde_class = ddb->ddb_class;
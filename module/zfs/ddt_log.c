@@ -0,0 +1,719 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/ddt.h>
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dmu_tx.h>
+#include <sys/zap.h>
+#include <sys/zfeature.h>
+#include <sys/zio_checksum.h>
+
+/*
+ * DDT logs
+ *
+ * Without the ddt_log feature, ddt_sync() updates the ZAP object of every
+ * entry changed in the txg.  Since the entries are keyed by the checksum of
+ * their block, each of them is in a random ZAP leaf, and once the DDT is
+ * larger than the ARC every new entry costs a leaf read and write.
+ *
+ * With the feature active, the entries changed in a txg are appended to a
+ * single log object for the txg instead, and the newest logged version of
+ * each is also kept in memory in the ddt_log_tree of its DDT, which
+ * ddt_lookup() consults before the ZAP objects.  A removed entry is logged
+ * with a type of DDT_TYPES, so that lookups do not find it in the ZAP
+ * objects anymore.  Every txg, some of the logged entries are merged into
+ * the ZAP objects, those of the oldest log first, and once none of the
+ * entries whose newest record is in a log is left, the log is destroyed.
+ * A key changed many times before it is merged only costs one ZAP update.
+ *
+ * Logs are destroyed in txg order, so every log which exists is at least
+ * as new as the newest record of any merged entry that has been changed
+ * since.  When the pool is loaded, the logs are read in txg order and the
+ * newest record of each key is added back to the ddt_log_tree.  Records
+ * which had already been merged are merged again, which is harmless.
+ *
+ * ddt_walk() only walks the ZAP objects.  It returns the logged version of
+ * the entries which are in the ZAP object of their logged class, and skips
+ * the others, which ddt_class_contains() reports as absent so that the scan
+ * traversal visits their blocks.  ddt_log_walk() returns them.
+ *
+ * How many entries are merged each txg trades the ZAP writes the logs are
+ * meant to save against the memory used by the ddt_log_tree and the amount
+ * of log to read at import.  Every txg merges enough entries to merge all
+ * of them every zfs_dedup_log_txg_max txgs, and at least
+ * zfs_dedup_log_flush_entries_min.  More are merged, oldest first, while
+ * any log is older than zfs_dedup_log_txg_max txgs or the logs of the pool
+ * use more than zfs_dedup_log_mem_max bytes of memory.
+ *
+ * The ddt_log_tree and the ddl_entries lists are protected by the ddt_lock,
+ * as lookups for repairs may happen outside of syncing context.  The
+ * ddt_logs list is only used in syncing context and at load.
+ */
+
+/*
+ * Log dedup table changes, if the ddt_log feature is enabled.  When it is
+ * turned off, the logs are merged into the ZAP objects at the next txg.
+ */
+int zfs_dedup_log = 1;
+
+/*
+ * Minimum number of logged entries merged by every txg with changes.
+ */
+int zfs_dedup_log_flush_entries_min = 1000;
+
+/*
+ * Number of txgs after which the logged changes of a DDT are merged.
+ */
+int zfs_dedup_log_txg_max = 100;
+
+/*
+ * Maximum memory used by the logged entries of the pool.
+ */
+unsigned long zfs_dedup_log_mem_max = 128ULL << 20;
+
+/*
+ * Block size of the log objects, and size of the buffers used to write and
+ * read them.
+ */
+int zfs_dedup_log_blksz = (1 << 17);
+
+static kmem_cache_t *ddt_log_entry_cache;
+
+static int
+ddt_log_entry_compare(const void *x1, const void *x2)
+{
+	const ddt_log_entry_t *ddle1 = x1;
+	const ddt_log_entry_t *ddle2 = x2;
+
+	return (ddt_key_compare(&ddle1->ddle_key, &ddle2->ddle_key));
+}
+
+static int
+ddt_log_txg_compare(const void *x1, const void *x2)
+{
+	const ddt_log_t *ddl1 = x1;
+	const ddt_log_t *ddl2 = x2;
+
+	return (AVL_CMP(ddl1->ddl_txg, ddl2->ddl_txg));
+}
+
+void
+ddt_log_init(void)
+{
+	ddt_log_entry_cache = kmem_cache_create("ddt_log_entry_cache",
+	    sizeof (ddt_log_entry_t), 0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+ddt_log_fini(void)
+{
+	kmem_cache_destroy(ddt_log_entry_cache);
+}
+
+void
+ddt_log_alloc(ddt_t *ddt)
+{
+	avl_create(&ddt->ddt_log_tree, ddt_log_entry_compare,
+	    sizeof (ddt_log_entry_t), offsetof(ddt_log_entry_t, ddle_node));
+	list_create(&ddt->ddt_logs, sizeof (ddt_log_t),
+	    offsetof(ddt_log_t, ddl_node));
+}
+
+static ddt_log_t *
+ddt_log_create(uint64_t txg, uint64_t object)
+{
+	ddt_log_t *ddl;
+
+	ddl = kmem_zalloc(sizeof (ddt_log_t), KM_SLEEP);
+	ddl->ddl_txg = txg;
+	ddl->ddl_object = object;
+	list_create(&ddl->ddl_entries, sizeof (ddt_log_entry_t),
+	    offsetof(ddt_log_entry_t, ddle_log_node));
+
+	return (ddl);
+}
+
+static void
+ddt_log_destroy(ddt_log_t *ddl)
+{
+	list_destroy(&ddl->ddl_entries);
+	kmem_free(ddl, sizeof (ddt_log_t));
+}
+
+/*
+ * Called by ddt_unload(), once nothing is syncing anymore.
+ */
+void
+ddt_log_free(ddt_t *ddt)
+{
+	ddt_log_entry_t *ddle;
+	ddt_log_t *ddl;
+	void *cookie = NULL;
+
+	ASSERT3P(ddt->ddt_log_buf, ==, NULL);
+
+	while ((ddle = avl_destroy_nodes(&ddt->ddt_log_tree, &cookie)) !=
+	    NULL) {
+		list_remove(&ddle->ddle_log->ddl_entries, ddle);
+		kmem_cache_free(ddt_log_entry_cache, ddle);
+	}
+	avl_destroy(&ddt->ddt_log_tree);
+
+	while ((ddl = list_remove_head(&ddt->ddt_logs)) != NULL)
+		ddt_log_destroy(ddl);
+	list_destroy(&ddt->ddt_logs);
+
+	ddt->ddt_log_zap = 0;
+}
+
+static void
+ddt_log_name(ddt_t *ddt, char *name)
+{
+	(void) sprintf(name, DMU_POOL_DDT_LOG,
+	    zio_checksum_table[ddt->ddt_checksum].ci_name);
+}
+
+/*
+ * An entry is moved if it is not in the ZAP object of its logged class,
+ * including if it was removed.
+ */
+static boolean_t
+ddt_log_entry_moved(const ddt_log_entry_t *ddle)
+{
+	return (ddle->ddle_type == DDT_TYPES ||
+	    ddle->ddle_zap_type != ddle->ddle_type ||
+	    ddle->ddle_zap_class != ddle->ddle_class);
+}
+
+static void
+ddt_log_entry_fill(const ddt_log_entry_t *ddle, ddt_entry_t *dde)
+{
+	bcopy(ddle->ddle_phys, dde->dde_phys, sizeof (dde->dde_phys));
+	dde->dde_type = ddle->ddle_type;
+	dde->dde_class = ddle->ddle_class;
+}
+
+/*
+ * Look up the key of dde in the log.  If it is there, fill in dde with its
+ * newest logged version, which has a type of DDT_TYPES if it was removed,
+ * and set *moved if it is not in the ZAP object of its logged class.
+ */
+boolean_t
+ddt_log_lookup(ddt_t *ddt, ddt_entry_t *dde, boolean_t *moved)
+{
+	ddt_log_entry_t *ddle, ddle_search;
+
+	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
+
+	if (avl_numnodes(&ddt->ddt_log_tree) == 0)
+		return (B_FALSE);
+
+	ddle_search.ddle_key = dde->dde_key;
+	ddle = avl_find(&ddt->ddt_log_tree, &ddle_search, NULL);
+	if (ddle == NULL)
+		return (B_FALSE);
+
+	ddt_log_entry_fill(ddle, dde);
+	if (moved != NULL)
+		*moved = ddt_log_entry_moved(ddle);
+
+	return (B_TRUE);
+}
+
+/*
+ * Walk the logged entries which ddt_walk() skips, except removed ones.
+ * *walk must be zero to start, and dde must be the entry returned by the
+ * previous call to continue.
+ */
+int
+ddt_log_walk(ddt_t *ddt, uint64_t *walk, ddt_entry_t *dde)
+{
+	avl_tree_t *t = &ddt->ddt_log_tree;
+	ddt_log_entry_t *ddle, ddle_search;
+	avl_index_t where;
+
+	ddt_enter(ddt);
+
+	if (*walk == 0) {
+		ddle = avl_first(t);
+	} else {
+		ddle_search.ddle_key = dde->dde_key;
+		ddle = avl_find(t, &ddle_search, &where);
+		if (ddle != NULL)
+			ddle = AVL_NEXT(t, ddle);
+		else
+			ddle = avl_nearest(t, where, AVL_AFTER);
+	}
+
+	while (ddle != NULL && (ddle->ddle_type == DDT_TYPES ||
+	    !ddt_log_entry_moved(ddle)))
+		ddle = AVL_NEXT(t, ddle);
+
+	if (ddle != NULL) {
+		dde->dde_key = ddle->ddle_key;
+		ddt_log_entry_fill(ddle, dde);
+		*walk = 1;
+	}
+
+	ddt_exit(ddt);
+
+	return (ddle == NULL ? SET_ERROR(ENOENT) : 0);
+}
+
+/*
+ * Make ddlr the newest record of its key, whose entry is now on the list of
+ * ddl.  Unless replaying, an entry already in the log keeps its ZAP type
+ * and class, since it has not been merged since they were logged.
+ */
+static void
+ddt_log_insert(ddt_t *ddt, ddt_log_t *ddl, ddt_log_record_t *ddlr,
+    boolean_t replay)
+{
+	ddt_log_entry_t *ddle, ddle_search;
+	avl_index_t where;
+
+	ASSERT(MUTEX_HELD(&ddt->ddt_lock));
+
+	ddle_search.ddle_key = ddlr->ddlr_key;
+	ddle = avl_find(&ddt->ddt_log_tree, &ddle_search, &where);
+	if (ddle == NULL) {
+		ddle = kmem_cache_alloc(ddt_log_entry_cache, KM_SLEEP);
+		ddle->ddle_key = ddlr->ddlr_key;
+		avl_insert(&ddt->ddt_log_tree, ddle, where);
+	} else {
+		list_remove(&ddle->ddle_log->ddl_entries, ddle);
+		if (!replay) {
+			DDLR_SET_ZAP_TYPE(ddlr, ddle->ddle_zap_type);
+			DDLR_SET_ZAP_CLASS(ddlr, ddle->ddle_zap_class);
+		}
+	}
+
+	bcopy(ddlr->ddlr_phys, ddle->ddle_phys, sizeof (ddle->ddle_phys));
+	ddle->ddle_type = DDLR_GET_TYPE(ddlr);
+	ddle->ddle_class = DDLR_GET_CLASS(ddlr);
+	ddle->ddle_zap_type = DDLR_GET_ZAP_TYPE(ddlr);
+	ddle->ddle_zap_class = DDLR_GET_ZAP_CLASS(ddlr);
+	ddle->ddle_log = ddl;
+	list_insert_tail(&ddl->ddl_entries, ddle);
+}
+
+/*
+ * Decide whether the changes of the syncing txg are logged, and create the
+ * log of the txg if so.  Once an entry is logged, its newer versions must
+ * be logged as well until it is merged, so the log is used while it has
+ * entries even if zfs_dedup_log has been turned off.
+ */
+boolean_t
+ddt_log_begin(ddt_t *ddt, dmu_tx_t *tx)
+{
+	spa_t *spa = ddt->ddt_spa;
+	objset_t *mos = ddt->ddt_os;
+	uint64_t txg = dmu_tx_get_txg(tx);
+	char name[DDT_NAMELEN];
+	ddt_log_phys_t *ddlp;
+	ddt_log_t *ddl;
+	dmu_buf_t *db;
+
+	ASSERT(dmu_tx_is_syncing(tx));
+	ASSERT3P(ddt->ddt_log_buf, ==, NULL);
+
+	if (ddt->ddt_log_zap == 0) {
+		if (!zfs_dedup_log ||
+		    !spa_feature_is_enabled(spa, SPA_FEATURE_DDT_LOG))
+			return (B_FALSE);
+
+		ddt_log_name(ddt, name);
+		ddt->ddt_log_zap = zap_create_link(mos, DMU_OTN_ZAP_METADATA,
+		    DMU_POOL_DIRECTORY_OBJECT, name, tx);
+		spa_feature_incr(spa, SPA_FEATURE_DDT_LOG, tx);
+	} else if (!zfs_dedup_log && avl_numnodes(&ddt->ddt_log_tree) == 0) {
+		return (B_FALSE);
+	}
+
+	ddl = list_tail(&ddt->ddt_logs);
+	if (ddl == NULL || ddl->ddl_txg != txg) {
+		ASSERT(ddl == NULL || ddl->ddl_txg < txg);
+
+		ddl = ddt_log_create(txg, dmu_object_alloc(mos,
+		    DMU_OTN_UINT64_METADATA, zfs_dedup_log_blksz,
+		    DMU_OTN_UINT64_METADATA, sizeof (ddt_log_phys_t), tx));
+		VERIFY0(zap_add_int_key(mos, ddt->ddt_log_zap, txg,
+		    ddl->ddl_object, tx));
+
+		VERIFY0(dmu_bonus_hold(mos, ddl->ddl_object, FTAG, &db));
+		dmu_buf_will_dirty(db, tx);
+		ddlp = db->db_data;
+		ddlp->ddlp_txg = txg;
+		ddlp->ddlp_length = 0;
+		dmu_buf_rele(db, FTAG);
+
+		list_insert_tail(&ddt->ddt_logs, ddl);
+	}
+
+	ddt->ddt_log_buf = vmem_alloc(zfs_dedup_log_blksz, KM_SLEEP);
+	ddt->ddt_log_buf_count = 0;
+
+	return (B_TRUE);
+}
+
+/*
+ * Append the buffered records to the log of the syncing txg.
+ */
+static void
+ddt_log_write(ddt_t *ddt, dmu_tx_t *tx)
+{
+	objset_t *mos = ddt->ddt_os;
+	ddt_log_t *ddl = list_tail(&ddt->ddt_logs);
+	uint64_t size = ddt->ddt_log_buf_count * sizeof (ddt_log_record_t);
+	ddt_log_phys_t *ddlp;
+	dmu_buf_t *db;
+
+	ASSERT3U(ddl->ddl_txg, ==, dmu_tx_get_txg(tx));
+
+	if (size == 0)
+		return;
+
+	VERIFY0(dmu_bonus_hold(mos, ddl->ddl_object, FTAG, &db));
+	dmu_buf_will_dirty(db, tx);
+	ddlp = db->db_data;
+	dmu_write(mos, ddl->ddl_object, ddlp->ddlp_length, size,
+	    ddt->ddt_log_buf, tx);
+	ddlp->ddlp_length += size;
+	dmu_buf_rele(db, FTAG);
+
+	ddt->ddt_log_buf_count = 0;
+}
+
+/*
+ * Log the new version of dde, whose type and class are DDT_TYPES and
+ * DDT_CLASSES if it is removed.  ztype and zclass are those it was loaded
+ * with, which is where the ZAP objects have it unless it is in the log.
+ */
+void
+ddt_log_entry(ddt_t *ddt, const ddt_entry_t *dde, enum ddt_type ztype,
+    enum ddt_class zclass, dmu_tx_t *tx)
+{
+	ddt_log_t *ddl = list_tail(&ddt->ddt_logs);
+	ddt_log_record_t *ddlr;
+
+	ASSERT3P(ddt->ddt_log_buf, !=, NULL);
+	ASSERT3U(ddl->ddl_txg, ==, dmu_tx_get_txg(tx));
+	ASSERT((dde->dde_type == DDT_TYPES) == (dde->dde_class == DDT_CLASSES));
+
+	if (ddt->ddt_log_buf_count ==
+	    zfs_dedup_log_blksz / sizeof (ddt_log_record_t))
+		ddt_log_write(ddt, tx);
+
+	ddlr = &ddt->ddt_log_buf[ddt->ddt_log_buf_count++];
+	ddlr->ddlr_key = dde->dde_key;
+	ddlr->ddlr_prop = 0;
+	DDLR_SET_TYPE(ddlr, dde->dde_type);
+	DDLR_SET_CLASS(ddlr, dde->dde_class);
+	DDLR_SET_ZAP_TYPE(ddlr, ztype);
+	DDLR_SET_ZAP_CLASS(ddlr, zclass);
+	if (dde->dde_type == DDT_TYPES)
+		bzero(ddlr->ddlr_phys, sizeof (ddlr->ddlr_phys));
+	else
+		bcopy(dde->dde_phys, ddlr->ddlr_phys, sizeof (ddlr->ddlr_phys));
+
+	ddt_enter(ddt);
+	ddt_log_insert(ddt, ddl, ddlr, B_FALSE);
+	ddt_exit(ddt);
+}
+
+void
+ddt_log_commit(ddt_t *ddt, dmu_tx_t *tx)
+{
+	ddt_log_write(ddt, tx);
+
+	vmem_free(ddt->ddt_log_buf, zfs_dedup_log_blksz);
+	ddt->ddt_log_buf = NULL;
+}
+
+/*
+ * Merge a logged entry into the ZAP objects, and drop it from the log.
+ */
+static void
+ddt_log_flush_entry(ddt_t *ddt, ddt_log_entry_t *ddle, dmu_tx_t *tx)
+{
+	enum ddt_type type = ddle->ddle_type;
+	enum ddt_class class = ddle->ddle_class;
+	enum ddt_type ztype = ddle->ddle_zap_type;
+	enum ddt_class zclass = ddle->ddle_zap_class;
+	ddt_entry_t dde;
+	int error;
+
+	bzero(&dde, sizeof (ddt_entry_t));
+	dde.dde_key = ddle->ddle_key;
+	bcopy(ddle->ddle_phys, dde.dde_phys, sizeof (dde.dde_phys));
+
+	/*
+	 * A replayed record may have been merged already, in which case the
+	 * entry is not where it was when it was logged anymore.
+	 */
+	if (ztype != DDT_TYPES && (ztype != type || zclass != class) &&
+	    ddt_object_exists(ddt, ztype, zclass)) {
+		error = ddt_object_remove(ddt, ztype, zclass, &dde, tx);
+		VERIFY(error == 0 || error == ENOENT);
+	}
+
+	if (type != DDT_TYPES)
+		VERIFY0(ddt_object_update(ddt, type, class, &dde, tx));
+
+	ddt_enter(ddt);
+	avl_remove(&ddt->ddt_log_tree, ddle);
+	list_remove(&ddle->ddle_log->ddl_entries, ddle);
+	ddt_exit(ddt);
+
+	kmem_cache_free(ddt_log_entry_cache, ddle);
+}
+
+static uint64_t
+ddt_log_mem(spa_t *spa)
+{
+	uint64_t entries = 0;
+	enum zio_checksum c;
+
+	for (c = 0; c < ZIO_CHECKSUM_FUNCTIONS; c++) {
+		ddt_t *ddt = spa->spa_ddt[c];
+		if (ddt != NULL)
+			entries += avl_numnodes(&ddt->ddt_log_tree);
+	}
+
+	return (entries * sizeof (ddt_log_entry_t));
+}
+
+/*
+ * Called in the first pass of spa_sync(), once the changes of the txg are
+ * logged, to merge logged entries into the ZAP objects and destroy the logs
+ * not needed anymore.  Returns B_TRUE if it changed anything.
+ */
+boolean_t
+ddt_log_flush(ddt_t *ddt, dmu_tx_t *tx)
+{
+	spa_t *spa = ddt->ddt_spa;
+	objset_t *mos = ddt->ddt_os;
+	uint64_t txg = dmu_tx_get_txg(tx);
+	uint64_t txg_max = MAX(zfs_dedup_log_txg_max, 1);
+	uint64_t want, mem, flushed = 0;
+	boolean_t changed = B_FALSE;
+	ddt_log_entry_t *ddle;
+	ddt_log_t *ddl;
+
+	ASSERT3U(spa_sync_pass(spa), ==, 1);
+	ASSERT3P(ddt->ddt_log_buf, ==, NULL);
+
+	if (list_is_empty(&ddt->ddt_logs))
+		return (B_FALSE);
+
+	/*
+	 * Leave txgs with nothing else to write no-ops, see spa_sync().
+	 */
+	if (spa->spa_uberblock.ub_rootbp.blk_birth < txg &&
+	    !dmu_objset_is_dirty(mos, txg))
+		return (B_FALSE);
+
+	want = MAX(zfs_dedup_log_flush_entries_min,
+	    howmany(avl_numnodes(&ddt->ddt_log_tree), txg_max));
+	mem = ddt_log_mem(spa);
+
+	while ((ddl = list_head(&ddt->ddt_logs)) != NULL) {
+		/*
+		 * The log of the syncing txg is only merged right away when
+		 * logging has been turned off.
+		 */
+		if (zfs_dedup_log && ddl->ddl_txg == txg)
+			break;
+
+		while ((ddle = list_head(&ddl->ddl_entries)) != NULL) {
+			if (zfs_dedup_log && flushed >= want &&
+			    ddl->ddl_txg + txg_max > txg &&
+			    mem <= zfs_dedup_log_mem_max)
+				break;
+
+			ddt_log_flush_entry(ddt, ddle, tx);
+			mem -= MIN(mem, sizeof (ddt_log_entry_t));
+			flushed++;
+		}
+		if (!list_is_empty(&ddl->ddl_entries))
+			break;
+
+		list_remove(&ddt->ddt_logs, ddl);
+		VERIFY0(dmu_object_free(mos, ddl->ddl_object, tx));
+		VERIFY0(zap_remove_int(mos, ddt->ddt_log_zap, ddl->ddl_txg,
+		    tx));
+		ddt_log_destroy(ddl);
+		changed = B_TRUE;
+	}
+
+	return (changed || flushed != 0);
+}
+
+static int
+ddt_log_replay_record(ddt_t *ddt, ddt_log_t *ddl, ddt_log_record_t *ddlr)
+{
+	uint64_t type = DDLR_GET_TYPE(ddlr);
+	uint64_t class = DDLR_GET_CLASS(ddlr);
+	uint64_t ztype = DDLR_GET_ZAP_TYPE(ddlr);
+	uint64_t zclass = DDLR_GET_ZAP_CLASS(ddlr);
+
+	if (type > DDT_TYPES || class > DDT_CLASSES ||
+	    (type == DDT_TYPES) != (class == DDT_CLASSES) ||
+	    ztype > DDT_TYPES || zclass > DDT_CLASSES ||
+	    (ztype == DDT_TYPES) != (zclass == DDT_CLASSES))
+		return (SET_ERROR(EIO));
+
+	if (type != DDT_TYPES && !ddt_object_exists(ddt, type, class))
+		return (SET_ERROR(EIO));
+
+	ddt_enter(ddt);
+	ddt_log_insert(ddt, ddl, ddlr, B_TRUE);
+	ddt_exit(ddt);
+
+	return (0);
+}
+
+static int
+ddt_log_replay(ddt_t *ddt, ddt_log_t *ddl)
+{
+	objset_t *mos = ddt->ddt_os;
+	uint64_t bufsize = zfs_dedup_log_blksz -
+	    zfs_dedup_log_blksz % sizeof (ddt_log_record_t);
+	ddt_log_record_t *ddlr, *ddlr_buf, *ddlr_end;
+	uint64_t offset, size, length;
+	dmu_object_info_t doi;
+	dmu_buf_t *db;
+	int error;
+
+	error = dmu_bonus_hold(mos, ddl->ddl_object, FTAG, &db);
+	if (error != 0)
+		return (error);
+	dmu_object_info_from_db(db, &doi);
+	if (doi.doi_bonus_size < sizeof (ddt_log_phys_t)) {
+		dmu_buf_rele(db, FTAG);
+		return (SET_ERROR(EIO));
+	}
+	length = ((ddt_log_phys_t *)db->db_data)->ddlp_length;
+	dmu_buf_rele(db, FTAG);
+
+	if (length % sizeof (ddt_log_record_t) != 0)
+		return (SET_ERROR(EIO));
+	if (length == 0)
+		return (0);
+
+	if (length > bufsize) {
+		dmu_prefetch(mos, ddl->ddl_object, 0, bufsize,
+		    length - bufsize, ZIO_PRIORITY_SYNC_READ);
+	}
+
+	ddlr_buf = vmem_alloc(bufsize, KM_SLEEP);
+
+	for (offset = 0; offset < length && error == 0; offset += size) {
+		size = MIN(length - offset, bufsize);
+
+		error = dmu_read(mos, ddl->ddl_object, offset, size,
+		    ddlr_buf, DMU_READ_PREFETCH);
+		if (error != 0)
+			break;
+
+		ddlr_end = ddlr_buf + (size / sizeof (ddt_log_record_t));
+		for (ddlr = ddlr_buf; ddlr < ddlr_end; ddlr++) {
+			error = ddt_log_replay_record(ddt, ddl, ddlr);
+			if (error != 0)
+				break;
+		}
+	}
+
+	vmem_free(ddlr_buf, bufsize);
+	return (error);
+}
+
+/*
+ * Read the logs of the DDT and add the newest record of each key back to
+ * the ddt_log_tree.  Called by ddt_load() once the ZAP objects are loaded.
+ */
+int
+ddt_log_load(ddt_t *ddt)
+{
+	objset_t *mos = ddt->ddt_os;
+	char name[DDT_NAMELEN];
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	avl_tree_t logs;
+	ddt_log_t *ddl;
+	int error;
+
+	ASSERT(list_is_empty(&ddt->ddt_logs));
+
+	ddt_log_name(ddt, name);
+	error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT, name,
+	    sizeof (uint64_t), 1, &ddt->ddt_log_zap);
+	if (error != 0)
+		return (error == ENOENT ? 0 : error);
+
+	/*
+	 * The ZAP is keyed by txg but iterates in hash order, so sort the
+	 * logs before putting them on ddt_logs.
+	 */
+	avl_create(&logs, ddt_log_txg_compare, sizeof (ddt_log_t),
+	    offsetof(ddt_log_t, ddl_load_node));
+	for (zap_cursor_init(&zc, mos, ddt->ddt_log_zap);
+	    (error = zap_cursor_retrieve(&zc, &za)) == 0;
+	    zap_cursor_advance(&zc)) {
+		avl_add(&logs, ddt_log_create(strtonum(za.za_name, NULL),
+		    za.za_first_integer));
+	}
+	zap_cursor_fini(&zc);
+	while ((ddl = avl_first(&logs)) != NULL) {
+		avl_remove(&logs, ddl);
+		list_insert_tail(&ddt->ddt_logs, ddl);
+	}
+	avl_destroy(&logs);
+	if (error != ENOENT)
+		return (error);
+
+	error = 0;
+	for (ddl = list_head(&ddt->ddt_logs); ddl != NULL && error == 0;
+	    ddl = list_next(&ddt->ddt_logs, ddl))
+		error = ddt_log_replay(ddt, ddl);
+
+	if (error != 0) {
+		zfs_dbgmsg("spa %s: failed to replay %s, error %d",
+		    spa_name(ddt->ddt_spa), name, error);
+	}
+
+	return (error);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_dedup_log, int, 0644);
+MODULE_PARM_DESC(zfs_dedup_log, "Log dedup table changes");
+
+module_param(zfs_dedup_log_flush_entries_min, int, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_flush_entries_min,
+	"Min logged dedup table entries merged per txg");
+
+module_param(zfs_dedup_log_txg_max, int, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_txg_max,
+	"Max txgs dedup table changes stay in the log");
+
+module_param(zfs_dedup_log_mem_max, ulong, 0644);
+MODULE_PARM_DESC(zfs_dedup_log_mem_max,
+	"Max memory for the logged dedup table entries");
+#endif
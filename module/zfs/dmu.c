@@ -39,6 +39,7 @@
 #include <sys/dsl_dir.h>
 #include <sys/dsl_pool.h>
 #include <sys/dsl_synctask.h>
+#include <sys/dsl_scan.h>
 #include <sys/dsl_prop.h>
 #include <sys/dmu_zfetch.h>
 #include <sys/zfs_ioctl.h>
@@ -441,6 +442,7 @@ dmu_buf_hold_array_by_dnode(dnode_t *dn, uint64_t offset, uint64_t length,
 	dmu_buf_t **dbp;
 	uint64_t blkid, nblks, i;
 	uint32_t dbuf_flags;
+	boolean_t io_wait = B_FALSE;
 	int err;
 	zio_t *zio;
 
@@ -485,16 +487,23 @@ dmu_buf_hold_array_by_dnode(dnode_t *dn, uint64_t offset, uint64_t length,
 			return (SET_ERROR(EIO));
 		}
 
-		/* initiate async i/o */
-		if (read)
+		/*
+		 * Initiate async i/o.  The state of the dbuf is checked
+		 * after dbuf_read(), which makes it CACHED on an ARC hit,
+		 * to tell the prefetcher whether we will wait for i/o.
+		 */
+		if (read) {
 			(void) dbuf_read(db, zio, dbuf_flags);
+			if (db->db_state != DB_CACHED)
+				io_wait = B_TRUE;
+		}
 		dbp[i] = &db->db;
 	}
 
 	if ((flags & DMU_READ_NO_PREFETCH) == 0 &&
 	    DNODE_META_IS_CACHEABLE(dn) && length <= zfetch_array_rd_sz) {
 		dmu_zfetch(&dn->dn_zfetch, blkid, nblks,
-		    read && DNODE_IS_CACHEABLE(dn));
+		    read && DNODE_IS_CACHEABLE(dn), io_wait);
 	}
 	rw_exit(&dn->dn_struct_rwlock);
 
@@ -1200,6 +1209,90 @@ dmu_read_uio_dbuf(dmu_buf_t *zdb, uio_t *uio, uint64_t size)
 	return (err);
 }
 
+static int
+dmu_read_uio_arc_cb(void *buf, size_t size, void *private)
+{
+	return (uiomove(buf, size, UIO_READ, private));
+}
+
+/*
+ * Copy a block that has no dbuf straight from the ARC into a uio.  A dbuf
+ * may hold newer, dirty data, and an existing one is as cheap to copy from.
+ * A block freed in a txg that hasn't synced yet still has its old block
+ * pointer, so it is left to dbuf_read() to zero fill, like a hole.  Both
+ * are checked under dn_struct_rwlock, which dbuf_hold() and
+ * dnode_free_range() take to create a dbuf or free a range.
+ */
+static int
+dmu_read_uio_arc(dnode_t *dn, uint64_t blkid, uint64_t off, uint64_t size,
+    uio_t *uio)
+{
+	dmu_buf_impl_t *db;
+	blkptr_t bp;
+	int err;
+
+	rw_enter(&dn->dn_struct_rwlock, RW_READER);
+	if (dnode_block_freed(dn, blkid)) {
+		rw_exit(&dn->dn_struct_rwlock);
+		return (SET_ERROR(ENOENT));
+	}
+	db = dbuf_find(dn->dn_objset, dn->dn_object, 0, blkid);
+	if (db != NULL) {
+		mutex_exit(&db->db_mtx);
+		rw_exit(&dn->dn_struct_rwlock);
+		return (SET_ERROR(ENOENT));
+	}
+	err = dbuf_dnode_findbp(dn, 0, blkid, &bp);
+	rw_exit(&dn->dn_struct_rwlock);
+	if (err != 0)
+		return (err);
+
+	return (arc_read_cached(dn->dn_objset->os_spa, &bp, off, size,
+	    dmu_read_uio_arc_cb, uio));
+}
+
+/*
+ * Like dmu_read_uio_dbuf(), but blocks that are cached uncompressed in the
+ * ARC and have no dbuf are copied straight from the ARC into the uio,
+ * instead of first being copied into a new dbuf.  From the first block
+ * that can't be, the rest of the range is read through dbufs as usual, in
+ * parallel.  The number of bytes copied straight from the ARC is added to
+ * *arc_bytes.
+ *
+ * The uio must point to kernel memory, which can be written with pages
+ * mapped atomically, and the caller must keep the range from being written
+ * concurrently, so that a block isn't dirtied after its dbuf was looked up.
+ */
+int
+dmu_read_uio_dbuf_arc(dmu_buf_t *zdb, uio_t *uio, uint64_t size,
+    uint64_t *arc_bytes)
+{
+	dmu_buf_impl_t *db = (dmu_buf_impl_t *)zdb;
+	dnode_t *dn;
+	int err = 0;
+
+	ASSERT(uio->uio_segflg == UIO_SYSSPACE ||
+	    uio->uio_segflg == UIO_BVEC);
+
+	DB_DNODE_ENTER(db);
+	dn = DB_DNODE(db);
+	while (size > 0) {
+		uint64_t blkid = dbuf_whichblock(dn, 0, uio->uio_loffset);
+		uint64_t off = uio->uio_loffset - blkid * dn->dn_datablksz;
+		uint64_t tocpy = MIN(dn->dn_datablksz - off, size);
+
+		if (dmu_read_uio_arc(dn, blkid, off, tocpy, uio) != 0) {
+			err = dmu_read_uio_dnode(dn, uio, size);
+			break;
+		}
+		*arc_bytes += tocpy;
+		size -= tocpy;
+	}
+	DB_DNODE_EXIT(db);
+
+	return (err);
+}
+
 /*
  * Read 'size' bytes into the uio buffer.
  * From the specified object
@@ -1892,6 +1985,8 @@ dmu_write_policy(objset_t *os, dnode_t *dn, int level, int wp, zio_prop_t *zp)
 	zp->zp_dedup_verify = dedup && dedup_verify;
 	zp->zp_nopwrite = nopwrite;
 	zp->zp_encrypt = encrypt;
+	zp->zp_zpl_smallblk = DMU_OT_IS_FILE(zp->zp_type) ?
+	    os->os_zpl_special_smallblock : 0;
 	bzero(zp->zp_salt, DATA_SALT_LEN);
 	bzero(zp->zp_iv, DATA_IV_LEN);
 	bzero(zp->zp_mac, DATA_MAC_LEN);
@@ -1950,7 +2045,7 @@ dmu_offset_next(objset_t *os, uint64_t object, boolean_t hole, uint64_t *off)
 	 * we go trundling through the block pointers.
 	 */
 	for (i = 0; i < TXG_SIZE; i++) {
-		if (list_link_active(&dn->dn_dirty_link[i]))
+		if (multilist_link_active(&dn->dn_dirty_link[i]))
 			break;
 	}
 	if (i != TXG_SIZE) {
@@ -2128,11 +2223,13 @@ dmu_init(void)
 	l2arc_init();
 	arc_init();
 	dbuf_init();
+	scan_init();
 }
 
 void
 dmu_fini(void)
 {
+	scan_fini();
 	arc_fini(); /* arc depends on l2arc, so arc must go first */
 	l2arc_fini();
 	dmu_tx_fini();
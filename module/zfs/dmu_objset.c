@@ -291,6 +291,20 @@ redundant_metadata_changed_cb(void *arg, uint64_t newval)
 	os->os_redundant_metadata = newval;
 }
 
+static void
+smallblk_changed_cb(void *arg, uint64_t newval)
+{
+	objset_t *os = arg;
+
+	/*
+	 * Inheritance and range checking should have been done by now.
+	 */
+	ASSERT(newval <= SPA_OLD_MAXBLOCKSIZE);
+	ASSERT(ISP2(newval));
+
+	os->os_zpl_special_smallblock = newval;
+}
+
 static void
 dnodesize_changed_cb(void *arg, uint64_t newval)
 {
@@ -339,6 +353,18 @@ recordsize_changed_cb(void *arg, uint64_t newval)
 	os->os_recordsize = newval;
 }
 
+/*
+ * The dirty dnodes of an objset are kept on a multilist, one per txg, so
+ * that dmu_objset_sync() can sync each sublist in a separate task.
+ */
+static unsigned int
+dnode_multilist_index_func(multilist_t *ml, void *obj)
+{
+	dnode_t *dn = obj;
+
+	return (dn->dn_object % multilist_get_num_sublists(ml));
+}
+
 void
 dmu_objset_byteswap(void *buf, size_t size)
 {
@@ -490,6 +516,12 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 				    zfs_prop_to_name(ZFS_PROP_DNODESIZE),
 				    dnodesize_changed_cb, os);
 			}
+			if (err == 0) {
+				err = dsl_prop_register(ds,
+				    zfs_prop_to_name(
+				    ZFS_PROP_SPECIAL_SMALL_BLOCKS),
+				    smallblk_changed_cb, os);
+			}
 		}
 		if (needlock)
 			dsl_pool_config_exit(dmu_objset_pool(os), FTAG);
@@ -518,10 +550,9 @@ dmu_objset_open_impl(spa_t *spa, dsl_dataset_t *ds, blkptr_t *bp,
 	os->os_zil = zil_alloc(os, &os->os_zil_header);
 
 	for (i = 0; i < TXG_SIZE; i++) {
-		list_create(&os->os_dirty_dnodes[i], sizeof (dnode_t),
-		    offsetof(dnode_t, dn_dirty_link[i]));
-		list_create(&os->os_free_dnodes[i], sizeof (dnode_t),
-		    offsetof(dnode_t, dn_dirty_link[i]));
+		multilist_create(&os->os_dirty_dnodes[i], sizeof (dnode_t),
+		    offsetof(dnode_t, dn_dirty_link[i]),
+		    MAX(boot_ncpus, 1), dnode_multilist_index_func);
 	}
 	list_create(&os->os_dnodes, sizeof (dnode_t),
 	    offsetof(dnode_t, dn_link));
@@ -814,6 +845,8 @@ dmu_objset_evict(objset_t *os)
 void
 dmu_objset_evict_done(objset_t *os)
 {
+	int i;
+
 	ASSERT3P(list_head(&os->os_dnodes), ==, NULL);
 
 	dnode_special_close(&os->os_meta_dnode);
@@ -823,6 +856,10 @@ dmu_objset_evict_done(objset_t *os)
 	}
 	zil_free(os->os_zil);
 
+	for (i = 0; i < TXG_SIZE; i++)
+		multilist_destroy(&os->os_dirty_dnodes[i]);
+	ASSERT3P(os->os_synced_dnodes, ==, NULL);
+
 	arc_buf_destroy(os->os_phys_buf, &os->os_phys_buf);
 
 	/*
@@ -1221,11 +1258,13 @@ dmu_objset_upgrade_stop(objset_t *os)
 }
 
 static void
-dmu_objset_sync_dnodes(list_t *list, list_t *newlist, dmu_tx_t *tx)
+dmu_objset_sync_dnodes(multilist_sublist_t *list, dmu_tx_t *tx)
 {
 	dnode_t *dn;
 
-	while ((dn = list_head(list))) {
+	while ((dn = multilist_sublist_head(list)) != NULL) {
+		multilist_t *newlist = dn->dn_objset->os_synced_dnodes;
+
 		ASSERT(dn->dn_object != DMU_META_DNODE_OBJECT);
 		ASSERT(dn->dn_dbuf->db_data_pending);
 		/*
@@ -1236,17 +1275,36 @@ dmu_objset_sync_dnodes(list_t *list, list_t *newlist, dmu_tx_t *tx)
 		ASSERT(dn->dn_zio);
 
 		ASSERT3U(dn->dn_nlevels, <=, DN_MAX_LEVELS);
-		list_remove(list, dn);
+		multilist_sublist_remove(list, dn);
 
-		if (newlist) {
+		if (newlist != NULL) {
 			(void) dnode_add_ref(dn, newlist);
-			list_insert_tail(newlist, dn);
+			multilist_insert(newlist, dn);
 		}
 
 		dnode_sync(dn, tx);
 	}
 }
 
+typedef struct sync_dnodes_arg {
+	multilist_t *sda_list;
+	int sda_sublist_idx;
+	dmu_tx_t *sda_tx;
+} sync_dnodes_arg_t;
+
+static void
+sync_dnodes_task(void *arg)
+{
+	sync_dnodes_arg_t *sda = arg;
+	multilist_sublist_t *ms;
+
+	ms = multilist_sublist_lock(sda->sda_list, sda->sda_sublist_idx);
+	dmu_objset_sync_dnodes(ms, sda->sda_tx);
+	multilist_sublist_unlock(ms);
+
+	kmem_free(sda, sizeof (*sda));
+}
+
 /* ARGSUSED */
 static void
 dmu_objset_write_ready(zio_t *zio, arc_buf_t *abuf, void *arg)
@@ -1304,8 +1362,9 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 	zio_prop_t zp;
 	zio_t *zio;
 	list_t *list;
-	list_t *newlist = NULL;
+	multilist_t *dirtylist;
 	dbuf_dirty_record_t *dr;
+	int i;
 
 	dprintf_ds(os->os_dsl_dataset, "txg=%llu\n", tx->tx_txg);
 
@@ -1354,19 +1413,38 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 	}
 
 	txgoff = tx->tx_txg & TXG_MASK;
+	dirtylist = &os->os_dirty_dnodes[txgoff];
 
-	if (dmu_objset_userused_enabled(os)) {
-		newlist = &os->os_synced_dnodes;
+	if (dmu_objset_userused_enabled(os) && !multilist_is_empty(dirtylist)) {
 		/*
 		 * We must create the list here because it uses the
-		 * dn_dirty_link[] of this txg.
+		 * dn_dirty_link[] of this txg.  It is torn down again by
+		 * dmu_objset_do_userquota_updates().
 		 */
-		list_create(newlist, sizeof (dnode_t),
-		    offsetof(dnode_t, dn_dirty_link[txgoff]));
+		ASSERT3P(os->os_synced_dnodes, ==, NULL);
+		os->os_synced_dnodes = kmem_alloc(sizeof (multilist_t),
+		    KM_SLEEP);
+		multilist_create(os->os_synced_dnodes, sizeof (dnode_t),
+		    offsetof(dnode_t, dn_dirty_link[txgoff]),
+		    MAX(boot_ncpus, 1), dnode_multilist_index_func);
 	}
 
-	dmu_objset_sync_dnodes(&os->os_free_dnodes[txgoff], newlist, tx);
-	dmu_objset_sync_dnodes(&os->os_dirty_dnodes[txgoff], newlist, tx);
+	/*
+	 * Sync the dirty (and freed) dnodes.  Each sublist is handed to the
+	 * pool's sync taskq, so that the dnodes of a large objset are synced
+	 * in parallel rather than one at a time by the txg_sync thread.
+	 */
+	for (i = 0; i < multilist_get_num_sublists(dirtylist); i++) {
+		sync_dnodes_arg_t *sda = kmem_alloc(sizeof (*sda), KM_SLEEP);
+
+		sda->sda_list = dirtylist;
+		sda->sda_sublist_idx = i;
+		sda->sda_tx = tx;
+		(void) taskq_dispatch(dmu_objset_pool(os)->dp_sync_taskq,
+		    sync_dnodes_task, sda, TQ_SLEEP);
+		/* callback frees sda */
+	}
+	taskq_wait(dmu_objset_pool(os)->dp_sync_taskq);
 
 	list = &DMU_META_DNODE(os)->dn_dirty_records[txgoff];
 	while ((dr = list_head(list))) {
@@ -1393,8 +1471,7 @@ dmu_objset_sync(objset_t *os, zio_t *pio, dmu_tx_t *tx)
 boolean_t
 dmu_objset_is_dirty(objset_t *os, uint64_t txg)
 {
-	return (!list_is_empty(&os->os_dirty_dnodes[txg & TXG_MASK]) ||
-	    !list_is_empty(&os->os_free_dnodes[txg & TXG_MASK]));
+	return (!multilist_is_empty(&os->os_dirty_dnodes[txg & TXG_MASK]));
 }
 
 static objset_used_cb_t *used_cbs[DMU_OST_NUMTYPES];
@@ -1537,67 +1614,82 @@ void
 dmu_objset_do_userquota_updates(objset_t *os, dmu_tx_t *tx)
 {
 	dnode_t *dn;
-	list_t *list = &os->os_synced_dnodes;
+	multilist_t *list = os->os_synced_dnodes;
+	multilist_sublist_t *mls;
 	userquota_cache_t cache = { { 0 } };
+	int i;
+
+	if (list == NULL)
+		return;
 
-	ASSERT(list_head(list) == NULL || dmu_objset_userused_enabled(os));
+	ASSERT(dmu_objset_userused_enabled(os));
 
 	avl_create(&cache.uqc_user_deltas, userquota_compare,
 	    sizeof (userquota_node_t), offsetof(userquota_node_t, uqn_node));
 	avl_create(&cache.uqc_group_deltas, userquota_compare,
 	    sizeof (userquota_node_t), offsetof(userquota_node_t, uqn_node));
 
-	while ((dn = list_head(list))) {
-		int flags;
-		ASSERT(!DMU_OBJECT_IS_SPECIAL(dn->dn_object));
-		ASSERT(dn->dn_phys->dn_type == DMU_OT_NONE ||
-		    dn->dn_phys->dn_flags &
-		    DNODE_FLAG_USERUSED_ACCOUNTED);
-
-		/* Allocate the user/groupused objects if necessary. */
-		if (DMU_USERUSED_DNODE(os)->dn_type == DMU_OT_NONE) {
-			VERIFY0(zap_create_claim(os, DMU_USERUSED_OBJECT,
-			    DMU_OT_USERGROUP_USED, DMU_OT_NONE, 0, tx));
-			VERIFY0(zap_create_claim(os, DMU_GROUPUSED_OBJECT,
-			    DMU_OT_USERGROUP_USED, DMU_OT_NONE, 0, tx));
-		}
+	/* Allocate the user/groupused objects if necessary. */
+	if (DMU_USERUSED_DNODE(os)->dn_type == DMU_OT_NONE) {
+		VERIFY0(zap_create_claim(os, DMU_USERUSED_OBJECT,
+		    DMU_OT_USERGROUP_USED, DMU_OT_NONE, 0, tx));
+		VERIFY0(zap_create_claim(os, DMU_GROUPUSED_OBJECT,
+		    DMU_OT_USERGROUP_USED, DMU_OT_NONE, 0, tx));
+	}
 
-		flags = dn->dn_id_flags;
-		ASSERT(flags);
-		if (flags & DN_ID_OLD_EXIST)  {
-			do_userquota_update(&cache,
-			    dn->dn_oldused, dn->dn_oldflags,
-			    dn->dn_olduid, dn->dn_oldgid, B_TRUE);
-			do_userobjquota_update(&cache, dn->dn_oldflags,
-			    dn->dn_olduid, dn->dn_oldgid, B_TRUE);
-		}
-		if (flags & DN_ID_NEW_EXIST) {
-			do_userquota_update(&cache,
-			    DN_USED_BYTES(dn->dn_phys), dn->dn_phys->dn_flags,
-			    dn->dn_newuid, dn->dn_newgid, B_FALSE);
-			do_userobjquota_update(&cache, dn->dn_phys->dn_flags,
-			    dn->dn_newuid, dn->dn_newgid, B_FALSE);
-		}
+	for (i = 0; i < multilist_get_num_sublists(list); i++) {
+		mls = multilist_sublist_lock(list, i);
+		while ((dn = multilist_sublist_head(mls)) != NULL) {
+			int flags;
+			ASSERT(!DMU_OBJECT_IS_SPECIAL(dn->dn_object));
+			ASSERT(dn->dn_phys->dn_type == DMU_OT_NONE ||
+			    dn->dn_phys->dn_flags &
+			    DNODE_FLAG_USERUSED_ACCOUNTED);
+
+			flags = dn->dn_id_flags;
+			ASSERT(flags);
+			if (flags & DN_ID_OLD_EXIST)  {
+				do_userquota_update(&cache,
+				    dn->dn_oldused, dn->dn_oldflags,
+				    dn->dn_olduid, dn->dn_oldgid, B_TRUE);
+				do_userobjquota_update(&cache, dn->dn_oldflags,
+				    dn->dn_olduid, dn->dn_oldgid, B_TRUE);
+			}
+			if (flags & DN_ID_NEW_EXIST) {
+				do_userquota_update(&cache,
+				    DN_USED_BYTES(dn->dn_phys),
+				    dn->dn_phys->dn_flags,
+				    dn->dn_newuid, dn->dn_newgid, B_FALSE);
+				do_userobjquota_update(&cache,
+				    dn->dn_phys->dn_flags,
+				    dn->dn_newuid, dn->dn_newgid, B_FALSE);
+			}
 
-		mutex_enter(&dn->dn_mtx);
-		dn->dn_oldused = 0;
-		dn->dn_oldflags = 0;
-		if (dn->dn_id_flags & DN_ID_NEW_EXIST) {
-			dn->dn_olduid = dn->dn_newuid;
-			dn->dn_oldgid = dn->dn_newgid;
-			dn->dn_id_flags |= DN_ID_OLD_EXIST;
-			if (dn->dn_bonuslen == 0)
-				dn->dn_id_flags |= DN_ID_CHKED_SPILL;
-			else
-				dn->dn_id_flags |= DN_ID_CHKED_BONUS;
-		}
-		dn->dn_id_flags &= ~(DN_ID_NEW_EXIST);
-		mutex_exit(&dn->dn_mtx);
+			mutex_enter(&dn->dn_mtx);
+			dn->dn_oldused = 0;
+			dn->dn_oldflags = 0;
+			if (dn->dn_id_flags & DN_ID_NEW_EXIST) {
+				dn->dn_olduid = dn->dn_newuid;
+				dn->dn_oldgid = dn->dn_newgid;
+				dn->dn_id_flags |= DN_ID_OLD_EXIST;
+				if (dn->dn_bonuslen == 0)
+					dn->dn_id_flags |= DN_ID_CHKED_SPILL;
+				else
+					dn->dn_id_flags |= DN_ID_CHKED_BONUS;
+			}
+			dn->dn_id_flags &= ~(DN_ID_NEW_EXIST);
+			mutex_exit(&dn->dn_mtx);
 
-		list_remove(list, dn);
-		dnode_rele(dn, list);
+			multilist_sublist_remove(mls, dn);
+			dnode_rele(dn, list);
+		}
+		multilist_sublist_unlock(mls);
 	}
 	do_userquota_cacheflush(os, &cache, tx);
+
+	multilist_destroy(list);
+	kmem_free(list, sizeof (multilist_t));
+	os->os_synced_dnodes = NULL;
 }
 
 /*
@@ -50,6 +50,8 @@ unsigned int	zfetch_max_streams = 8;
 unsigned int	zfetch_min_sec_reap = 2;
 /* max bytes to prefetch per stream (default 8MB) */
 unsigned int	zfetch_max_distance = 8 * 1024 * 1024;
+/* max bytes to prefetch per stream still waiting for i/o (default 64MB) */
+unsigned int	zfetch_max_adaptive_distance = 64 * 1024 * 1024;
 /* max bytes to prefetch indirects for per stream (default 64MB) */
 unsigned int	zfetch_max_idistance = 64 * 1024 * 1024;
 /* max number of bytes in an array_read in which we allow prefetching (1MB) */
@@ -59,16 +61,38 @@ typedef struct zfetch_stats {
 	kstat_named_t zfetchstat_hits;
 	kstat_named_t zfetchstat_misses;
 	kstat_named_t zfetchstat_max_streams;
+	/* hits of reverse and strided streams, also counted in hits */
+	kstat_named_t zfetchstat_reverse_hits;
+	kstat_named_t zfetchstat_stride_hits;
+	/* hits which still waited for i/o, and resulting distance grows */
+	kstat_named_t zfetchstat_io_waits;
+	kstat_named_t zfetchstat_distance_grows;
+	/* streams freed, by the number of hits they had */
+	kstat_named_t zfetchstat_streams_hits_0;
+	kstat_named_t zfetchstat_streams_hits_1_15;
+	kstat_named_t zfetchstat_streams_hits_16_255;
+	kstat_named_t zfetchstat_streams_hits_256_plus;
+	/* streams freed which waited for i/o on more than half their hits */
+	kstat_named_t zfetchstat_streams_mostly_waiting;
 } zfetch_stats_t;
 
 static zfetch_stats_t zfetch_stats = {
 	{ "hits",			KSTAT_DATA_UINT64 },
 	{ "misses",			KSTAT_DATA_UINT64 },
 	{ "max_streams",		KSTAT_DATA_UINT64 },
+	{ "reverse_hits",		KSTAT_DATA_UINT64 },
+	{ "stride_hits",		KSTAT_DATA_UINT64 },
+	{ "io_waits",			KSTAT_DATA_UINT64 },
+	{ "distance_grows",		KSTAT_DATA_UINT64 },
+	{ "streams_hits_0",		KSTAT_DATA_UINT64 },
+	{ "streams_hits_1_15",		KSTAT_DATA_UINT64 },
+	{ "streams_hits_16_255",	KSTAT_DATA_UINT64 },
+	{ "streams_hits_256_plus",	KSTAT_DATA_UINT64 },
+	{ "streams_mostly_waiting",	KSTAT_DATA_UINT64 },
 };
 
 #define	ZFETCHSTAT_BUMP(stat) \
-	atomic_inc_64(&zfetch_stats.stat.value.ui64);
+	atomic_inc_64(&zfetch_stats.stat.value.ui64)
 
 kstat_t		*zfetch_ksp;
 
@@ -117,6 +141,18 @@ static void
 dmu_zfetch_stream_remove(zfetch_t *zf, zstream_t *zs)
 {
 	ASSERT(RW_WRITE_HELD(&zf->zf_rwlock));
+
+	if (zs->zs_hits == 0)
+		ZFETCHSTAT_BUMP(zfetchstat_streams_hits_0);
+	else if (zs->zs_hits < 16)
+		ZFETCHSTAT_BUMP(zfetchstat_streams_hits_1_15);
+	else if (zs->zs_hits < 256)
+		ZFETCHSTAT_BUMP(zfetchstat_streams_hits_16_255);
+	else
+		ZFETCHSTAT_BUMP(zfetchstat_streams_hits_256_plus);
+	if (zs->zs_io_waits * 2 > zs->zs_hits)
+		ZFETCHSTAT_BUMP(zfetchstat_streams_mostly_waiting);
+
 	list_remove(&zf->zf_stream, zs);
 	mutex_destroy(&zs->zs_lock);
 	kmem_free(zs, sizeof (*zs));
@@ -144,13 +180,13 @@ dmu_zfetch_fini(zfetch_t *zf)
 }
 
 /*
- * If there aren't too many streams already, create a new stream.
- * The "blkid" argument is the next block that we expect this stream to access.
- * While we're here, clean up old streams (which haven't been
- * accessed for at least zfetch_min_sec_reap seconds).
+ * If there aren't too many streams already, create a new stream for an
+ * access of nblks blocks at blkid.  The stream expects its next access to
+ * start where this one ends.  While we're here, clean up old streams
+ * (which haven't been accessed for at least zfetch_min_sec_reap seconds).
  */
 static void
-dmu_zfetch_stream_create(zfetch_t *zf, uint64_t blkid)
+dmu_zfetch_stream_create(zfetch_t *zf, uint64_t blkid, uint64_t nblks)
 {
 	zstream_t *zs;
 	zstream_t *zs_next;
@@ -189,15 +225,167 @@ dmu_zfetch_stream_create(zfetch_t *zf, uint64_t blkid)
 	}
 
 	zs = kmem_zalloc(sizeof (*zs), KM_SLEEP);
-	zs->zs_blkid = blkid;
-	zs->zs_pf_blkid = blkid;
-	zs->zs_ipf_blkid = blkid;
+	zs->zs_blkid = blkid + nblks;
+	zs->zs_pf_blkid = blkid + nblks;
+	zs->zs_ipf_blkid = blkid + nblks;
+	zs->zs_nblks = nblks;
+	zs->zs_last_blkid = blkid;
+	zs->zs_max_dist = zfetch_max_distance;
 	zs->zs_atime = gethrtime();
 	mutex_init(&zs->zs_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	list_insert_head(&zf->zf_stream, zs);
 }
 
+/*
+ * Account for a hit on a stream.  If the accessed blocks still had to be
+ * read (or were still being prefetched), the stream is not far enough ahead
+ * of the reader to hide the i/o latency, so double its distance, up to
+ * zfetch_max_adaptive_distance.
+ */
+static void
+dmu_zfetch_stream_hit(zstream_t *zs, boolean_t io_wait)
+{
+	uint64_t max_dist = MAX(zfetch_max_distance,
+	    zfetch_max_adaptive_distance);
+
+	ASSERT(MUTEX_HELD(&zs->zs_lock));
+
+	zs->zs_hits++;
+	if (!io_wait)
+		return;
+
+	zs->zs_io_waits++;
+	ZFETCHSTAT_BUMP(zfetchstat_io_waits);
+	if (zs->zs_hits > 1 && zs->zs_max_dist < max_dist) {
+		zs->zs_max_dist = MIN(zs->zs_max_dist * 2, max_dist);
+		ZFETCHSTAT_BUMP(zfetchstat_distance_grows);
+	}
+}
+
+/*
+ * An access which is not part of any stream may be the second access of a
+ * reverse or strided stream: look for a stream which has not had any hit
+ * yet and whose first access started close enough before or after this
+ * one for the prefetch to cover at least one more access, and turn it
+ * into a stream expecting its next access one stride further.
+ */
+static boolean_t
+dmu_zfetch_stride_detect(zfetch_t *zf, uint64_t blkid, uint64_t nblks)
+{
+	zstream_t *zs;
+	int64_t stride;
+	uint64_t max_dist_blks;
+
+	ASSERT(RW_LOCK_HELD(&zf->zf_rwlock));
+
+	max_dist_blks = zfetch_max_distance >> zf->zf_dnode->dn_datablkshift;
+
+	for (zs = list_head(&zf->zf_stream); zs != NULL;
+	    zs = list_next(&zf->zf_stream, zs)) {
+		if (zs->zs_stride != 0 || zs->zs_hits != 0)
+			continue;
+
+		mutex_enter(&zs->zs_lock);
+		stride = (int64_t)(blkid - zs->zs_last_blkid);
+		if (zs->zs_stride != 0 || zs->zs_hits != 0 || stride == 0 ||
+		    (uint64_t)ABS(stride) + nblks > max_dist_blks ||
+		    (stride < 0 && blkid < (uint64_t)-stride)) {
+			mutex_exit(&zs->zs_lock);
+			continue;
+		}
+
+		zs->zs_stride = stride;
+		zs->zs_nblks = nblks;
+		zs->zs_last_blkid = blkid;
+		zs->zs_blkid = blkid + stride;
+		zs->zs_pf_blkid = zs->zs_blkid;
+		zs->zs_atime = gethrtime();
+		mutex_exit(&zs->zs_lock);
+		return (B_TRUE);
+	}
+
+	return (B_FALSE);
+}
+
+/*
+ * Prefetch for a hit on a reverse or strided stream.  Like for forward
+ * streams, the number of accesses prefetched ahead is doubled on each hit,
+ * up to the distance of the stream.  Only the blocks of the predicted
+ * accesses are prefetched, or the indirect blocks pointing to them if
+ * data is not to be fetched; dbuf_prefetch() reads the indirect blocks
+ * it needs on its own.  Called with the stream and zfetch locked, drops
+ * both locks.
+ */
+static void
+dmu_zfetch_stride(zfetch_t *zf, zstream_t *zs, uint64_t blkid, uint64_t nblks,
+    boolean_t fetch_data)
+{
+	dnode_t *dn = zf->zf_dnode;
+	int64_t stride = zs->zs_stride;
+	int64_t pf_start, prefetched, nsteps, max_steps, b;
+	int64_t iblk, last_iblk = -1;
+	uint64_t j;
+	int epbs, i;
+
+	ASSERT(MUTEX_HELD(&zs->zs_lock));
+
+	zs->zs_nblks = nblks;
+	max_steps = MAX(1, (zs->zs_max_dist >> dn->dn_datablkshift) / nblks);
+
+	/*
+	 * zs_pf_blkid is the start of the first access which has not been
+	 * prefetched yet, so this and the next (prefetched - 1) accesses
+	 * have been prefetched; on the first hit, none has.  Prefetch that
+	 * many accesses again, plus the one we are catching up by.
+	 */
+	prefetched = ((int64_t)(zs->zs_pf_blkid - blkid)) / stride;
+	if (prefetched <= 0) {
+		prefetched = 0;
+		pf_start = blkid + stride;
+	} else {
+		pf_start = zs->zs_pf_blkid;
+	}
+	nsteps = MIN(prefetched + 1,
+	    max_steps - MAX(prefetched - 1, 0));
+	if (stride < 0)
+		nsteps = MIN(nsteps, pf_start < 0 ? 0 : pf_start / -stride + 1);
+	nsteps = MAX(nsteps, 0);
+
+	zs->zs_pf_blkid = pf_start + nsteps * stride;
+	zs->zs_last_blkid = blkid;
+	zs->zs_blkid = blkid + stride;
+	zs->zs_atime = gethrtime();
+	mutex_exit(&zs->zs_lock);
+	rw_exit(&zf->zf_rwlock);
+
+	epbs = dn->dn_indblkshift - SPA_BLKPTRSHIFT;
+	for (i = 0; i < nsteps; i++) {
+		b = pf_start + i * stride;
+		if (!fetch_data) {
+			iblk = b >> epbs;
+			if (iblk != last_iblk) {
+				dbuf_prefetch(dn, 1, iblk,
+				    ZIO_PRIORITY_ASYNC_READ,
+				    ARC_FLAG_PREDICTIVE_PREFETCH);
+				last_iblk = iblk;
+			}
+			continue;
+		}
+		for (j = 0; j < nblks; j++) {
+			dbuf_prefetch(dn, 0, b + j,
+			    ZIO_PRIORITY_ASYNC_READ,
+			    ARC_FLAG_PREDICTIVE_PREFETCH);
+		}
+	}
+
+	ZFETCHSTAT_BUMP(zfetchstat_hits);
+	if (stride < 0)
+		ZFETCHSTAT_BUMP(zfetchstat_reverse_hits);
+	else
+		ZFETCHSTAT_BUMP(zfetchstat_stride_hits);
+}
+
 /*
  * This is the predictive prefetch entry point.  It associates dnode access
  * specified with blkid and nblks arguments with prefetch stream, predicts
@@ -205,9 +393,12 @@ dmu_zfetch_stream_create(zfetch_t *zf, uint64_t blkid)
  * fetch_data argument specifies whether actual data blocks should be fetched:
  *   FALSE -- prefetch only indirect blocks for predicted data blocks;
  *   TRUE -- prefetch predicted data blocks plus following indirect blocks.
+ * io_wait argument tells whether the accessed blocks were not yet cached,
+ * so that the reader has to wait for them to be read.
  */
 void
-dmu_zfetch(zfetch_t *zf, uint64_t blkid, uint64_t nblks, boolean_t fetch_data)
+dmu_zfetch(zfetch_t *zf, uint64_t blkid, uint64_t nblks, boolean_t fetch_data,
+    boolean_t io_wait)
 {
 	zstream_t *zs;
 	int64_t pf_start, ipf_start, ipf_istart, ipf_iend;
@@ -246,16 +437,24 @@ dmu_zfetch(zfetch_t *zf, uint64_t blkid, uint64_t nblks, boolean_t fetch_data)
 
 	if (zs == NULL) {
 		/*
-		 * This access is not part of any existing stream.  Create
-		 * a new stream for it.
+		 * This access is not part of any existing stream.  Unless
+		 * it continues the first access of a stream in another
+		 * direction, create a new stream for it.
 		 */
 		ZFETCHSTAT_BUMP(zfetchstat_misses);
-		if (rw_tryupgrade(&zf->zf_rwlock))
-			dmu_zfetch_stream_create(zf, end_of_access_blkid);
+		if (!dmu_zfetch_stride_detect(zf, blkid, nblks) &&
+		    rw_tryupgrade(&zf->zf_rwlock))
+			dmu_zfetch_stream_create(zf, blkid, nblks);
 		rw_exit(&zf->zf_rwlock);
 		return;
 	}
 
+	dmu_zfetch_stream_hit(zs, io_wait);
+	if (zs->zs_stride != 0) {
+		dmu_zfetch_stride(zf, zs, blkid, nblks, fetch_data);
+		return;
+	}
+
 	/*
 	 * This access was to a block that we issued a prefetch for on
 	 * behalf of this stream. Issue further prefetches for this stream.
@@ -270,11 +469,11 @@ dmu_zfetch(zfetch_t *zf, uint64_t blkid, uint64_t nblks, boolean_t fetch_data)
 
 	/*
 	 * Double our amount of prefetched data, but don't let the
-	 * prefetch get further ahead than zfetch_max_distance.
+	 * prefetch get further ahead than the distance of the stream.
 	 */
 	if (fetch_data) {
 		max_dist_blks =
-		    zfetch_max_distance >> zf->zf_dnode->dn_datablkshift;
+		    zs->zs_max_dist >> zf->zf_dnode->dn_datablkshift;
 		/*
 		 * Previously, we were (zs_pf_blkid - blkid) ahead.  We
 		 * want to now be double that, so read that amount again,
@@ -314,6 +513,8 @@ dmu_zfetch(zfetch_t *zf, uint64_t blkid, uint64_t nblks, boolean_t fetch_data)
 	ipf_iend = P2ROUNDUP(zs->zs_ipf_blkid, 1 << epbs) >> epbs;
 
 	zs->zs_atime = gethrtime();
+	zs->zs_last_blkid = blkid;
+	zs->zs_nblks = nblks;
 	zs->zs_blkid = end_of_access_blkid;
 	mutex_exit(&zs->zs_lock);
 	rw_exit(&zf->zf_rwlock);
@@ -350,6 +551,10 @@ module_param(zfetch_max_distance, uint, 0644);
 MODULE_PARM_DESC(zfetch_max_distance,
 	"Max bytes to prefetch per stream (default 8MB)");
 
+module_param(zfetch_max_adaptive_distance, uint, 0644);
+MODULE_PARM_DESC(zfetch_max_adaptive_distance,
+	"Max bytes to prefetch per stream waiting for i/o (default 64MB)");
+
 module_param(zfetch_array_rd_sz, ulong, 0644);
 MODULE_PARM_DESC(zfetch_array_rd_sz, "Number of bytes in a array_read");
 /* END CSTYLED */
@@ -1518,14 +1518,6 @@ spa_do_crypt_abd(boolean_t encrypt, spa_t *spa, zbookmark_phys_t *zb,
 		goto error;
 	}
 
-	if (encrypt) {
-		plainbuf = abd_borrow_buf_copy(pabd, datalen);
-		cipherbuf = abd_borrow_buf(cabd, datalen);
-	} else {
-		plainbuf = abd_borrow_buf(pabd, datalen);
-		cipherbuf = abd_borrow_buf_copy(cabd, datalen);
-	}
-
 	/*
 	 * Both encryption and decryption functions need a salt for key
 	 * generation and an IV. When encrypting a non-dedup block, we
@@ -1534,6 +1526,9 @@ spa_do_crypt_abd(boolean_t encrypt, spa_t *spa, zbookmark_phys_t *zb,
 	 * the salt and the IV. ZIL blocks have their salt and IV generated
 	 * at allocation time in zio_alloc_zil(). On decryption, we simply use
 	 * the provided values.
+	 *
+	 * Since non-dedup blocks don't need their plaintext for this, they
+	 * are encrypted straight from the abds.
 	 */
 	if (encrypt && ot != DMU_OT_INTENT_LOG && !BP_GET_DEDUP(bp)) {
 		ret = zio_crypt_key_get_salt(&dck->dck_key, salt);
@@ -1543,7 +1538,24 @@ spa_do_crypt_abd(boolean_t encrypt, spa_t *spa, zbookmark_phys_t *zb,
 		ret = zio_crypt_generate_iv(iv);
 		if (ret)
 			goto error;
-	} else if (encrypt && BP_GET_DEDUP(bp)) {
+
+		ret = zio_do_crypt_abd(encrypt, &dck->dck_key, salt, ot, iv,
+		    mac, datalen, pabd, cabd);
+		if (ret)
+			goto error;
+
+		return (0);
+	}
+
+	if (encrypt) {
+		plainbuf = abd_borrow_buf_copy(pabd, datalen);
+		cipherbuf = abd_borrow_buf(cabd, datalen);
+	} else {
+		plainbuf = abd_borrow_buf(pabd, datalen);
+		cipherbuf = abd_borrow_buf_copy(cabd, datalen);
+	}
+
+	if (encrypt && BP_GET_DEDUP(bp)) {
 		ret = zio_crypt_generate_iv_salt_dedup(&dck->dck_key,
 		    plainbuf, datalen, iv, salt);
 		if (ret)
@@ -48,17 +48,83 @@
 #include <sys/sa_impl.h>
 #include <sys/zfeature.h>
 #include <sys/abd.h>
+#include <sys/range_tree.h>
 #ifdef _KERNEL
 #include <sys/zfs_vfsops.h>
 #endif
 
+/*
+ * Grand theory statement on scan queue sorting
+ *
+ * Scanning is implemented by recursively traversing all indirection levels
+ * in an object and reading all blocks referenced from said objects. This
+ * results in us approximately traversing the object from lowest logical
+ * offset to the highest. For best performance, we would want the logical
+ * blocks to be physically contiguous. However, this is frequently not the
+ * case with pools given the allocation patterns of copy-on-write filesystems.
+ * So instead, we put the I/Os into a reordering queue and issue them in a
+ * way that will most benefit physical disks (LBA-order).
+ *
+ * Queue management:
+ *
+ * Ideally, we would want to scan all metadata and queue up all block I/O
+ * prior to starting to issue it, because that allows us to do an optimal
+ * sorting job. This can however consume large amounts of memory. Therefore
+ * we continuously monitor the size of the queues and constrain them to
+ * zfs_scan_mem_lim_fact of physical memory (further capped at 5% of the
+ * allocated space of the pool). If the queues grow past this limit, we
+ * stop traversing metadata and switch to "clearing" mode, issuing the
+ * queued I/O until we drop below the soft limit given by
+ * zfs_scan_mem_lim_soft_fact, at which point traversal resumes.
+ *
+ * Each top-level vdev has its own queue (a dsl_scan_io_queue_t) which
+ * sorts pending I/Os by offset in q_sios_by_addr. I/Os which are close
+ * together (no more than zfs_scan_max_ext_gap apart) are grouped into
+ * extents in the q_exts_by_addr range tree. The extents are additionally
+ * sorted in q_exts_by_size by how much I/O they contain, weighted by how
+ * densely it is packed (see zfs_scan_fill_weight). While clearing we
+ * issue the best extents first, in the hope that the smaller ones still
+ * grow as traversal continues.
+ *
+ * Checkpointing:
+ *
+ * Because I/O is no longer issued in traversal order, the bookmark saved in
+ * scn_phys does not mean that everything before it has been scrubbed. So
+ * every zfs_scan_checkpoint_intval seconds we stop traversing and drain all
+ * queues (in LBA order, since nothing new will be added). Only once all
+ * queued I/O has been issued is scn_phys written out; until then the last
+ * such checkpoint, scn_phys_cached, is what is kept on disk.
+ *
+ * Gang blocks are not sorted, they are still issued directly from the
+ * traversal as is done by the legacy algorithm (see zfs_scan_legacy).
+ */
+
 typedef int (scan_cb_t)(dsl_pool_t *, const blkptr_t *,
     const zbookmark_phys_t *);
 
+typedef enum {
+	SYNC_OPTIONAL,		/* only sync if all queued I/O was issued */
+	SYNC_MANDATORY,		/* always sync, no I/O may be queued */
+	SYNC_CACHED,		/* sync the last checkpoint if I/O is queued */
+} state_sync_type_t;
+
 static scan_cb_t dsl_scan_scrub_cb;
 static void dsl_scan_cancel_sync(void *, dmu_tx_t *);
-static void dsl_scan_sync_state(dsl_scan_t *, dmu_tx_t *);
+static void dsl_scan_sync_state(dsl_scan_t *, dmu_tx_t *, state_sync_type_t);
 static boolean_t dsl_scan_restarting(dsl_scan_t *, dmu_tx_t *);
+static void dsl_scan_sync_traverse(dsl_scan_t *, dmu_tx_t *);
+
+static void scan_ds_queue_clear(dsl_scan_t *scn);
+static boolean_t scan_ds_queue_contains(dsl_scan_t *scn, uint64_t dsobj,
+    uint64_t *txg);
+static void scan_ds_queue_insert(dsl_scan_t *scn, uint64_t dsobj, uint64_t txg);
+static void scan_ds_queue_remove(dsl_scan_t *scn, uint64_t dsobj);
+static void scan_ds_queue_sync(dsl_scan_t *scn, dmu_tx_t *tx);
+
+static void scan_io_queues_run(dsl_scan_t *scn);
+static void scan_io_queues_destroy(dsl_scan_t *scn);
+static boolean_t dsl_scan_should_clear(dsl_scan_t *scn);
+static void dsl_scan_update_stats(dsl_scan_t *scn);
 
 int zfs_top_maxinflight = 32;		/* maximum I/Os per top-level */
 int zfs_resilver_delay = 2;		/* number of ticks to delay resilver */
@@ -75,6 +141,19 @@ int dsl_scan_delay_completion = B_FALSE; /* set to delay scan completion */
 /* max number of blocks to free in a single TXG */
 unsigned long zfs_free_max_blocks = 100000;
 
+int zfs_scan_legacy = B_FALSE;	/* don't queue & sort I/Os, issue directly */
+unsigned long zfs_scan_vdev_limit = 4 << 20;	/* in-flight bytes per leaf */
+int zfs_scan_checkpoint_intval = 7200;	/* seconds between checkpoints */
+unsigned long zfs_scan_max_ext_gap = 2 << 20;	/* max extent gap in bytes */
+int zfs_scan_mem_lim_fact = 20;		/* fraction of physmem for queues */
+int zfs_scan_mem_lim_soft_fact = 20;	/* fraction of mem limit to drain */
+int zfs_scan_fill_weight = 3;		/* extent fill weight, see below */
+
+#define	ZFS_SCAN_MEM_LIM_MIN		(16 << 20)	/* 16 MiB */
+#define	ZFS_SCAN_MEM_LIM_SOFT_MAX	(128 << 20)	/* 128 MiB */
+#define	ZFS_SCAN_MIN_INFLIGHT_BYTES	(1 << 20)	/* 1 MiB */
+#define	ZFS_SCAN_GATHER_MAX		32	/* max sios issued at once */
+
 #define	DSL_SCAN_IS_SCRUB_RESILVER(scn) \
 	((scn)->scn_phys.scn_func == POOL_SCAN_SCRUB || \
 	(scn)->scn_phys.scn_func == POOL_SCAN_RESILVER)
@@ -91,6 +170,82 @@ static scan_cb_t *scan_funcs[POOL_SCAN_FUNCS] = {
 	dsl_scan_scrub_cb,	/* POOL_SCAN_RESILVER */
 };
 
+/* In-core representation of a dataset waiting to be scanned. */
+typedef struct scan_ds {
+	avl_node_t	sds_node;
+	uint64_t	sds_dsobj;
+	uint64_t	sds_txg;
+} scan_ds_t;
+
+/*
+ * A single queued scrub/resilver read.  A copy of the whole block pointer
+ * is kept so that the read can still fall back on the other copies of the
+ * block if this one turns out to be damaged.  The DVA that the I/O is
+ * sorted on is always swapped into the first slot.
+ */
+typedef struct scan_io {
+	blkptr_t		sio_bp;
+	int			sio_flags;
+	zbookmark_phys_t	sio_zb;
+	union {
+		avl_node_t	sio_addr_node;	/* link into q_sios_by_addr */
+		list_node_t	sio_list_node;	/* link for issuing */
+	} sio_nodes;
+} scan_io_t;
+
+#define	SIO_GET_OFFSET(sio)	DVA_GET_OFFSET(&(sio)->sio_bp.blk_dva[0])
+#define	SIO_GET_ASIZE(sio)	DVA_GET_ASIZE(&(sio)->sio_bp.blk_dva[0])
+#define	SIO_GET_END_OFFSET(sio)	(SIO_GET_OFFSET(sio) + SIO_GET_ASIZE(sio))
+
+struct dsl_scan_io_queue {
+	dsl_scan_t	*q_scn;		/* associated dsl_scan_t */
+	vdev_t		*q_vd;		/* top-level vdev of this queue */
+
+	/* trees used for sorting I/Os and extents of I/Os */
+	range_tree_t	*q_exts_by_addr;
+	avl_tree_t	q_exts_by_size;
+	avl_tree_t	q_sios_by_addr;
+	uint64_t	q_sio_memused;
+
+	/* members for zio rate limiting */
+	uint64_t	q_maxinflight_bytes;
+	uint64_t	q_inflight_bytes;
+	kcondvar_t	q_zio_cv;	/* used under vdev_scan_io_queue_lock */
+
+	/* per txg statistics */
+	uint64_t	q_total_seg_size_this_txg;
+	uint64_t	q_segs_this_txg;
+	uint64_t	q_total_zio_size_this_txg;
+	uint64_t	q_zios_this_txg;
+};
+
+static kmem_cache_t *sio_cache;
+
+void
+scan_init(void)
+{
+	sio_cache = kmem_cache_create("sio_cache", sizeof (scan_io_t),
+	    0, NULL, NULL, NULL, NULL, NULL, 0);
+}
+
+void
+scan_fini(void)
+{
+	kmem_cache_destroy(sio_cache);
+}
+
+static int
+scan_ds_queue_compare(const void *a, const void *b)
+{
+	const scan_ds_t *sds_a = a, *sds_b = b;
+
+	if (sds_a->sds_dsobj < sds_b->sds_dsobj)
+		return (-1);
+	if (sds_a->sds_dsobj == sds_b->sds_dsobj)
+		return (0);
+	return (1);
+}
+
 int
 dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 {
@@ -101,6 +256,9 @@ dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 
 	scn = dp->dp_scan = kmem_zalloc(sizeof (dsl_scan_t), KM_SLEEP);
 	scn->scn_dp = dp;
+	scn->scn_last_checkpoint = ddi_get_lbolt();
+	avl_create(&scn->scn_queue, scan_ds_queue_compare, sizeof (scan_ds_t),
+	    offsetof(scan_ds_t, sds_node));
 
 	/*
 	 * It's possible that we're resuming a scan after a reboot so
@@ -189,6 +347,31 @@ dsl_scan_init(dsl_pool_t *dp, uint64_t txg)
 			    "by old software; restarting in txg %llu",
 			    scn->scn_restart_txg);
 		}
+
+		/*
+		 * The on-disk scan state is always a checkpoint: every block
+		 * examined up to this point was also issued.  Load the queue
+		 * of datasets still to be visited into memory.
+		 */
+		if (scn->scn_phys.scn_state == DSS_SCANNING &&
+		    scn->scn_phys.scn_queue_obj != 0) {
+			zap_cursor_t zc;
+			zap_attribute_t za;
+
+			for (zap_cursor_init(&zc, dp->dp_meta_objset,
+			    scn->scn_phys.scn_queue_obj);
+			    zap_cursor_retrieve(&zc, &za) == 0;
+			    (void) zap_cursor_advance(&zc)) {
+				scan_ds_queue_insert(scn,
+				    strtonum(za.za_name, NULL),
+				    za.za_first_integer);
+			}
+			zap_cursor_fini(&zc);
+		}
+
+		bcopy(&scn->scn_phys, &scn->scn_phys_cached,
+		    sizeof (scn->scn_phys));
+		scn->scn_issued_before_pass = scn->scn_phys.scn_examined;
 	}
 
 	spa_scan_stat_init(spa);
@@ -199,6 +382,14 @@ void
 dsl_scan_fini(dsl_pool_t *dp)
 {
 	if (dp->dp_scan) {
+		dsl_scan_t *scn = dp->dp_scan;
+
+		if (scn->scn_taskq != NULL)
+			taskq_destroy(scn->scn_taskq);
+		scan_ds_queue_clear(scn);
+		avl_destroy(&scn->scn_queue);
+		scan_io_queues_destroy(scn);
+
 		kmem_free(dp->dp_scan, sizeof (dsl_scan_t));
 		dp->dp_scan = NULL;
 	}
@@ -238,6 +429,8 @@ dsl_scan_setup_sync(void *arg, dmu_tx_t *tx)
 	scn->scn_phys.scn_to_examine = spa->spa_root_vdev->vdev_stat.vs_alloc;
 	scn->scn_restart_txg = 0;
 	scn->scn_done_txg = 0;
+	scn->scn_issued_before_pass = 0;
+	scn->scn_last_checkpoint = ddi_get_lbolt();
 	spa_scan_stat_init(spa);
 
 	if (DSL_SCAN_IS_SCRUB_RESILVER(scn)) {
@@ -278,7 +471,9 @@ dsl_scan_setup_sync(void *arg, dmu_tx_t *tx)
 	scn->scn_phys.scn_queue_obj = zap_create(dp->dp_meta_objset,
 	    ot ? ot : DMU_OT_SCAN_QUEUE, DMU_OT_NONE, 0, tx);
 
-	dsl_scan_sync_state(scn, tx);
+	ASSERT0(avl_numnodes(&scn->scn_queue));
+	ASSERT0(scn->scn_bytes_pending);
+	dsl_scan_sync_state(scn, tx, SYNC_MANDATORY);
 
 	spa_history_log_internal(spa, "scan setup", tx,
 	    "func=%u mintxg=%llu maxtxg=%llu",
@@ -316,6 +511,22 @@ dsl_scan_done(dsl_scan_t *scn, boolean_t complete, dmu_tx_t *tx)
 		    scn->scn_phys.scn_queue_obj, tx));
 		scn->scn_phys.scn_queue_obj = 0;
 	}
+	scan_ds_queue_clear(scn);
+
+	/*
+	 * Throw away any I/O which is still queued.  Nothing can be in
+	 * flight from the queues since they are only issued from, and
+	 * waited on in, dsl_scan_sync().
+	 */
+	scan_io_queues_destroy(scn);
+	if (scn->scn_taskq != NULL) {
+		taskq_destroy(scn->scn_taskq);
+		scn->scn_taskq = NULL;
+	}
+	ASSERT0(scn->scn_bytes_pending);
+	scn->scn_is_sorted = B_FALSE;
+	scn->scn_clearing = B_FALSE;
+	scn->scn_checkpointing = B_FALSE;
 
 	/*
 	 * If we were "restarted" from a stopped state, don't bother
@@ -393,7 +604,7 @@ dsl_scan_cancel_sync(void *arg, dmu_tx_t *tx)
 	dsl_scan_t *scn = dmu_tx_pool(tx)->dp_scan;
 
 	dsl_scan_done(scn, B_FALSE, tx);
-	dsl_scan_sync_state(scn, tx);
+	dsl_scan_sync_state(scn, tx, SYNC_MANDATORY);
 }
 
 int
@@ -432,13 +643,115 @@ dsl_scan_ds_maxtxg(dsl_dataset_t *ds)
 	return (smt);
 }
 
+/*
+ * The dataset queue is kept in memory while scanning and only written to
+ * its on-disk ZAP object when the scan state is checkpointed.
+ */
+static void
+scan_ds_queue_clear(dsl_scan_t *scn)
+{
+	void *cookie = NULL;
+	scan_ds_t *sds;
+
+	while ((sds = avl_destroy_nodes(&scn->scn_queue, &cookie)) != NULL)
+		kmem_free(sds, sizeof (*sds));
+}
+
+static boolean_t
+scan_ds_queue_contains(dsl_scan_t *scn, uint64_t dsobj, uint64_t *txg)
+{
+	scan_ds_t srch, *sds;
+
+	srch.sds_dsobj = dsobj;
+	sds = avl_find(&scn->scn_queue, &srch, NULL);
+	if (sds != NULL && txg != NULL)
+		*txg = sds->sds_txg;
+	return (sds != NULL);
+}
+
+static void
+scan_ds_queue_insert(dsl_scan_t *scn, uint64_t dsobj, uint64_t txg)
+{
+	scan_ds_t *sds;
+	avl_index_t where;
+
+	sds = kmem_zalloc(sizeof (*sds), KM_SLEEP);
+	sds->sds_dsobj = dsobj;
+	sds->sds_txg = txg;
+
+	VERIFY3P(avl_find(&scn->scn_queue, sds, &where), ==, NULL);
+	avl_insert(&scn->scn_queue, sds, where);
+}
+
+static void
+scan_ds_queue_remove(dsl_scan_t *scn, uint64_t dsobj)
+{
+	scan_ds_t srch, *sds;
+
+	srch.sds_dsobj = dsobj;
+
+	sds = avl_find(&scn->scn_queue, &srch, NULL);
+	VERIFY(sds != NULL);
+	avl_remove(&scn->scn_queue, sds);
+	kmem_free(sds, sizeof (*sds));
+}
+
+static void
+scan_ds_queue_sync(dsl_scan_t *scn, dmu_tx_t *tx)
+{
+	dsl_pool_t *dp = scn->scn_dp;
+	spa_t *spa = dp->dp_spa;
+	dmu_object_type_t ot = (spa_version(spa) >= SPA_VERSION_DSL_SCRUB) ?
+	    DMU_OT_SCAN_QUEUE : DMU_OT_ZAP_OTHER;
+	scan_ds_t *sds;
+
+	ASSERT0(scn->scn_bytes_pending);
+	ASSERT(scn->scn_phys.scn_queue_obj != 0);
+
+	VERIFY0(dmu_object_free(dp->dp_meta_objset,
+	    scn->scn_phys.scn_queue_obj, tx));
+	scn->scn_phys.scn_queue_obj = zap_create(dp->dp_meta_objset, ot,
+	    DMU_OT_NONE, 0, tx);
+	for (sds = avl_first(&scn->scn_queue); sds != NULL;
+	    sds = AVL_NEXT(&scn->scn_queue, sds)) {
+		VERIFY0(zap_add_int_key(dp->dp_meta_objset,
+		    scn->scn_phys.scn_queue_obj, sds->sds_dsobj,
+		    sds->sds_txg, tx));
+	}
+}
+
+/*
+ * Write the scan state to disk.  As long as queued I/O remains the
+ * in-core position in scn_phys can't be written, since the blocks
+ * before it haven't all been scrubbed yet.  In that case only the last
+ * checkpoint (scn_phys_cached) is synced, and only if asked to with
+ * SYNC_CACHED because something other than the position changed.
+ */
 static void
-dsl_scan_sync_state(dsl_scan_t *scn, dmu_tx_t *tx)
+dsl_scan_sync_state(dsl_scan_t *scn, dmu_tx_t *tx, state_sync_type_t sync_type)
 {
-	VERIFY0(zap_update(scn->scn_dp->dp_meta_objset,
-	    DMU_POOL_DIRECTORY_OBJECT,
-	    DMU_POOL_SCAN, sizeof (uint64_t), SCAN_PHYS_NUMINTS,
-	    &scn->scn_phys, tx));
+	ASSERT(sync_type != SYNC_MANDATORY || scn->scn_bytes_pending == 0);
+
+	if (scn->scn_bytes_pending == 0) {
+		if (scn->scn_phys.scn_queue_obj != 0)
+			scan_ds_queue_sync(scn, tx);
+		VERIFY0(zap_update(scn->scn_dp->dp_meta_objset,
+		    DMU_POOL_DIRECTORY_OBJECT,
+		    DMU_POOL_SCAN, sizeof (uint64_t), SCAN_PHYS_NUMINTS,
+		    &scn->scn_phys, tx));
+		bcopy(&scn->scn_phys, &scn->scn_phys_cached,
+		    sizeof (scn->scn_phys));
+
+		if (scn->scn_checkpointing)
+			zfs_dbgmsg("finish scan checkpoint");
+		scn->scn_checkpointing = B_FALSE;
+		scn->scn_last_checkpoint = ddi_get_lbolt();
+	} else if (sync_type == SYNC_CACHED) {
+		VERIFY0(zap_update(scn->scn_dp->dp_meta_objset,
+		    DMU_POOL_DIRECTORY_OBJECT,
+		    DMU_POOL_SCAN, sizeof (uint64_t), SCAN_PHYS_NUMINTS,
+		    &scn->scn_phys_cached, tx));
+	}
 }
 
 extern int zfs_vdev_async_write_active_min_dirty_percent;
@@ -879,6 +1192,44 @@ dsl_scan_visit_rootbp(dsl_scan_t *scn, dsl_dataset_t *ds, blkptr_t *bp,
 	dprintf_ds(ds, "finished scan%s", "");
 }
 
+static void
+ds_destroyed_scn_phys(dsl_dataset_t *ds, dsl_scan_phys_t *scn_phys)
+{
+	if (scn_phys->scn_bookmark.zb_objset != ds->ds_object)
+		return;
+
+	if (ds->ds_is_snapshot) {
+		/*
+		 * Note:
+		 *  - scn_cur_{min,max}_txg stays the same.
+		 *  - Setting the flag is not really necessary if
+		 *    scn_cur_max_txg == scn_max_txg, because there
+		 *    is nothing after this snapshot that we care
+		 *    about.  However, we set it anyway and then
+		 *    ignore it when we retraverse it in
+		 *    dsl_scan_visitds().
+		 */
+		scn_phys->scn_bookmark.zb_objset =
+		    dsl_dataset_phys(ds)->ds_next_snap_obj;
+		zfs_dbgmsg("destroying ds %llu; currently traversing; "
+		    "reset zb_objset to %llu",
+		    (u_longlong_t)ds->ds_object,
+		    (u_longlong_t)dsl_dataset_phys(ds)->ds_next_snap_obj);
+		scn_phys->scn_flags |= DSF_VISIT_DS_AGAIN;
+	} else {
+		SET_BOOKMARK(&scn_phys->scn_bookmark,
+		    ZB_DESTROYED_OBJSET, 0, 0, 0);
+		zfs_dbgmsg("destroying ds %llu; currently traversing; "
+		    "reset bookmark to -1,0,0,0",
+		    (u_longlong_t)ds->ds_object);
+	}
+}
+
+/*
+ * The in-core position (scn_phys) and the last checkpoint
+ * (scn_phys_cached), along with their dataset queues, are updated
+ * independently since either may refer to the dataset.
+ */
 void
 dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 {
@@ -889,34 +1240,18 @@ dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
+	ds_destroyed_scn_phys(ds, &scn->scn_phys);
+	ds_destroyed_scn_phys(ds, &scn->scn_phys_cached);
+
+	if (scan_ds_queue_contains(scn, ds->ds_object, &mintxg)) {
+		scan_ds_queue_remove(scn, ds->ds_object);
 		if (ds->ds_is_snapshot) {
-			/*
-			 * Note:
-			 *  - scn_cur_{min,max}_txg stays the same.
-			 *  - Setting the flag is not really necessary if
-			 *    scn_cur_max_txg == scn_max_txg, because there
-			 *    is nothing after this snapshot that we care
-			 *    about.  However, we set it anyway and then
-			 *    ignore it when we retraverse it in
-			 *    dsl_scan_visitds().
-			 */
-			scn->scn_phys.scn_bookmark.zb_objset =
-			    dsl_dataset_phys(ds)->ds_next_snap_obj;
-			zfs_dbgmsg("destroying ds %llu; currently traversing; "
-			    "reset zb_objset to %llu",
-			    (u_longlong_t)ds->ds_object,
-			    (u_longlong_t)dsl_dataset_phys(ds)->
-			    ds_next_snap_obj);
-			scn->scn_phys.scn_flags |= DSF_VISIT_DS_AGAIN;
-		} else {
-			SET_BOOKMARK(&scn->scn_phys.scn_bookmark,
-			    ZB_DESTROYED_OBJSET, 0, 0, 0);
-			zfs_dbgmsg("destroying ds %llu; currently traversing; "
-			    "reset bookmark to -1,0,0,0",
-			    (u_longlong_t)ds->ds_object);
+			scan_ds_queue_insert(scn,
+			    dsl_dataset_phys(ds)->ds_next_snap_obj, mintxg);
 		}
-	} else if (zap_lookup_int_key(dp->dp_meta_objset,
+	}
+
+	if (zap_lookup_int_key(dp->dp_meta_objset,
 	    scn->scn_phys.scn_queue_obj, ds->ds_object, &mintxg) == 0) {
 		ASSERT3U(dsl_dataset_phys(ds)->ds_num_children, <=, 1);
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
@@ -946,7 +1281,20 @@ dsl_scan_ds_destroyed(dsl_dataset_t *ds, dmu_tx_t *tx)
 	 * dsl_scan_sync() should be called after this, and should sync
 	 * out our changed state, but just to be safe, do it here.
 	 */
-	dsl_scan_sync_state(scn, tx);
+	dsl_scan_sync_state(scn, tx, SYNC_CACHED);
+}
+
+static void
+ds_snapshotted_bookmark(dsl_dataset_t *ds, zbookmark_phys_t *scn_bookmark)
+{
+	if (scn_bookmark->zb_objset == ds->ds_object) {
+		scn_bookmark->zb_objset =
+		    dsl_dataset_phys(ds)->ds_prev_snap_obj;
+		zfs_dbgmsg("snapshotting ds %llu; currently traversing; "
+		    "reset zb_objset to %llu",
+		    (u_longlong_t)ds->ds_object,
+		    (u_longlong_t)dsl_dataset_phys(ds)->ds_prev_snap_obj);
+	}
 }
 
 void
@@ -961,14 +1309,16 @@ dsl_scan_ds_snapshotted(dsl_dataset_t *ds, dmu_tx_t *tx)
 
 	ASSERT(dsl_dataset_phys(ds)->ds_prev_snap_obj != 0);
 
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset =
-		    dsl_dataset_phys(ds)->ds_prev_snap_obj;
-		zfs_dbgmsg("snapshotting ds %llu; currently traversing; "
-		    "reset zb_objset to %llu",
-		    (u_longlong_t)ds->ds_object,
-		    (u_longlong_t)dsl_dataset_phys(ds)->ds_prev_snap_obj);
-	} else if (zap_lookup_int_key(dp->dp_meta_objset,
+	ds_snapshotted_bookmark(ds, &scn->scn_phys.scn_bookmark);
+	ds_snapshotted_bookmark(ds, &scn->scn_phys_cached.scn_bookmark);
+
+	if (scan_ds_queue_contains(scn, ds->ds_object, &mintxg)) {
+		scan_ds_queue_remove(scn, ds->ds_object);
+		scan_ds_queue_insert(scn,
+		    dsl_dataset_phys(ds)->ds_prev_snap_obj, mintxg);
+	}
+
+	if (zap_lookup_int_key(dp->dp_meta_objset,
 	    scn->scn_phys.scn_queue_obj, ds->ds_object, &mintxg) == 0) {
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, ds->ds_object, tx));
@@ -980,69 +1330,94 @@ dsl_scan_ds_snapshotted(dsl_dataset_t *ds, dmu_tx_t *tx)
 		    (u_longlong_t)ds->ds_object,
 		    (u_longlong_t)dsl_dataset_phys(ds)->ds_prev_snap_obj);
 	}
-	dsl_scan_sync_state(scn, tx);
+
+	dsl_scan_sync_state(scn, tx, SYNC_CACHED);
 }
 
-void
-dsl_scan_ds_clone_swapped(dsl_dataset_t *ds1, dsl_dataset_t *ds2, dmu_tx_t *tx)
+static void
+ds_clone_swapped_bookmark(dsl_dataset_t *ds1, dsl_dataset_t *ds2,
+    zbookmark_phys_t *scn_bookmark)
 {
-	dsl_pool_t *dp = ds1->ds_dir->dd_pool;
-	dsl_scan_t *scn = dp->dp_scan;
-	uint64_t mintxg;
-
-	if (scn->scn_phys.scn_state != DSS_SCANNING)
-		return;
-
-	if (scn->scn_phys.scn_bookmark.zb_objset == ds1->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset = ds2->ds_object;
+	if (scn_bookmark->zb_objset == ds1->ds_object) {
+		scn_bookmark->zb_objset = ds2->ds_object;
 		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
 		    "reset zb_objset to %llu",
 		    (u_longlong_t)ds1->ds_object,
 		    (u_longlong_t)ds2->ds_object);
-	} else if (scn->scn_phys.scn_bookmark.zb_objset == ds2->ds_object) {
-		scn->scn_phys.scn_bookmark.zb_objset = ds1->ds_object;
+	} else if (scn_bookmark->zb_objset == ds2->ds_object) {
+		scn_bookmark->zb_objset = ds1->ds_object;
 		zfs_dbgmsg("clone_swap ds %llu; currently traversing; "
 		    "reset zb_objset to %llu",
 		    (u_longlong_t)ds2->ds_object,
 		    (u_longlong_t)ds1->ds_object);
 	}
+}
+
+void
+dsl_scan_ds_clone_swapped(dsl_dataset_t *ds1, dsl_dataset_t *ds2, dmu_tx_t *tx)
+{
+	dsl_pool_t *dp = ds1->ds_dir->dd_pool;
+	dsl_scan_t *scn = dp->dp_scan;
+	uint64_t mintxg1, mintxg2;
+	boolean_t ds1_queued, ds2_queued;
+
+	if (scn->scn_phys.scn_state != DSS_SCANNING)
+		return;
+
+	ds_clone_swapped_bookmark(ds1, ds2, &scn->scn_phys.scn_bookmark);
+	ds_clone_swapped_bookmark(ds1, ds2,
+	    &scn->scn_phys_cached.scn_bookmark);
+
+	/*
+	 * If only one of the two datasets is queued, it is replaced by the
+	 * other.  If both are queued there is nothing to do.
+	 */
+	ds1_queued = scan_ds_queue_contains(scn, ds1->ds_object, &mintxg1);
+	ds2_queued = scan_ds_queue_contains(scn, ds2->ds_object, &mintxg2);
+	if (ds1_queued && !ds2_queued) {
+		scan_ds_queue_remove(scn, ds1->ds_object);
+		scan_ds_queue_insert(scn, ds2->ds_object, mintxg1);
+	} else if (ds2_queued && !ds1_queued) {
+		scan_ds_queue_remove(scn, ds2->ds_object);
+		scan_ds_queue_insert(scn, ds1->ds_object, mintxg2);
+	}
 
 	if (zap_lookup_int_key(dp->dp_meta_objset, scn->scn_phys.scn_queue_obj,
-	    ds1->ds_object, &mintxg) == 0) {
+	    ds1->ds_object, &mintxg1) == 0) {
 		int err;
 
-		ASSERT3U(mintxg, ==, dsl_dataset_phys(ds1)->ds_prev_snap_txg);
-		ASSERT3U(mintxg, ==, dsl_dataset_phys(ds2)->ds_prev_snap_txg);
+		ASSERT3U(mintxg1, ==, dsl_dataset_phys(ds1)->ds_prev_snap_txg);
+		ASSERT3U(mintxg1, ==, dsl_dataset_phys(ds2)->ds_prev_snap_txg);
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, ds1->ds_object, tx));
 		err = zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj, ds2->ds_object, mintxg, tx);
+		    scn->scn_phys.scn_queue_obj, ds2->ds_object, mintxg1, tx);
 		VERIFY(err == 0 || err == EEXIST);
 		if (err == EEXIST) {
 			/* Both were there to begin with */
 			VERIFY(0 == zap_add_int_key(dp->dp_meta_objset,
 			    scn->scn_phys.scn_queue_obj,
-			    ds1->ds_object, mintxg, tx));
+			    ds1->ds_object, mintxg1, tx));
 		}
 		zfs_dbgmsg("clone_swap ds %llu; in queue; "
 		    "replacing with %llu",
 		    (u_longlong_t)ds1->ds_object,
 		    (u_longlong_t)ds2->ds_object);
 	} else if (zap_lookup_int_key(dp->dp_meta_objset,
-	    scn->scn_phys.scn_queue_obj, ds2->ds_object, &mintxg) == 0) {
-		ASSERT3U(mintxg, ==, dsl_dataset_phys(ds1)->ds_prev_snap_txg);
-		ASSERT3U(mintxg, ==, dsl_dataset_phys(ds2)->ds_prev_snap_txg);
+	    scn->scn_phys.scn_queue_obj, ds2->ds_object, &mintxg2) == 0) {
+		ASSERT3U(mintxg2, ==, dsl_dataset_phys(ds1)->ds_prev_snap_txg);
+		ASSERT3U(mintxg2, ==, dsl_dataset_phys(ds2)->ds_prev_snap_txg);
 		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
 		    scn->scn_phys.scn_queue_obj, ds2->ds_object, tx));
 		VERIFY(0 == zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj, ds1->ds_object, mintxg, tx));
+		    scn->scn_phys.scn_queue_obj, ds1->ds_object, mintxg2, tx));
 		zfs_dbgmsg("clone_swap ds %llu; in queue; "
 		    "replacing with %llu",
 		    (u_longlong_t)ds2->ds_object,
 		    (u_longlong_t)ds1->ds_object);
 	}
 
-	dsl_scan_sync_state(scn, tx);
+	dsl_scan_sync_state(scn, tx, SYNC_CACHED);
 }
 
 struct enqueue_clones_arg {
@@ -1076,9 +1451,8 @@ enqueue_clones_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
 			return (err);
 		ds = prev;
 	}
-	VERIFY(zap_add_int_key(dp->dp_meta_objset,
-	    scn->scn_phys.scn_queue_obj, ds->ds_object,
-	    dsl_dataset_phys(ds)->ds_prev_snap_txg, eca->tx) == 0);
+	scan_ds_queue_insert(scn, ds->ds_object,
+	    dsl_dataset_phys(ds)->ds_prev_snap_txg);
 	dsl_dataset_rele(ds, FTAG);
 	return (0);
 }
@@ -1175,9 +1549,8 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_flags & DSF_VISIT_DS_AGAIN) {
 		zfs_dbgmsg("incomplete pass; visiting again");
 		scn->scn_phys.scn_flags &= ~DSF_VISIT_DS_AGAIN;
-		VERIFY(zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj, ds->ds_object,
-		    scn->scn_phys.scn_cur_max_txg, tx) == 0);
+		scan_ds_queue_insert(scn, ds->ds_object,
+		    scn->scn_phys.scn_cur_max_txg);
 		goto out;
 	}
 
@@ -1185,10 +1558,9 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 	 * Add descendent datasets to work queue.
 	 */
 	if (dsl_dataset_phys(ds)->ds_next_snap_obj != 0) {
-		VERIFY(zap_add_int_key(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj,
+		scan_ds_queue_insert(scn,
 		    dsl_dataset_phys(ds)->ds_next_snap_obj,
-		    dsl_dataset_phys(ds)->ds_creation_txg, tx) == 0);
+		    dsl_dataset_phys(ds)->ds_creation_txg);
 	}
 	if (dsl_dataset_phys(ds)->ds_num_children > 1) {
 		boolean_t usenext = B_FALSE;
@@ -1209,10 +1581,18 @@ dsl_scan_visitds(dsl_scan_t *scn, uint64_t dsobj, dmu_tx_t *tx)
 		}
 
 		if (usenext) {
-			VERIFY0(zap_join_key(dp->dp_meta_objset,
-			    dsl_dataset_phys(ds)->ds_next_clones_obj,
-			    scn->scn_phys.scn_queue_obj,
-			    dsl_dataset_phys(ds)->ds_creation_txg, tx));
+			zap_cursor_t zc;
+			zap_attribute_t za;
+
+			for (zap_cursor_init(&zc, dp->dp_meta_objset,
+			    dsl_dataset_phys(ds)->ds_next_clones_obj);
+			    zap_cursor_retrieve(&zc, &za) == 0;
+			    (void) zap_cursor_advance(&zc)) {
+				scan_ds_queue_insert(scn,
+				    strtonum(za.za_name, NULL),
+				    dsl_dataset_phys(ds)->ds_creation_txg);
+			}
+			zap_cursor_fini(&zc);
 		} else {
 			struct enqueue_clones_arg eca;
 			eca.tx = tx;
@@ -1231,7 +1611,6 @@ out:
 static int
 enqueue_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
 {
-	dmu_tx_t *tx = arg;
 	dsl_dataset_t *ds;
 	int err;
 	dsl_scan_t *scn = dp->dp_scan;
@@ -1261,8 +1640,8 @@ enqueue_cb(dsl_pool_t *dp, dsl_dataset_t *hds, void *arg)
 		ds = prev;
 	}
 
-	VERIFY(zap_add_int_key(dp->dp_meta_objset, scn->scn_phys.scn_queue_obj,
-	    ds->ds_object, dsl_dataset_phys(ds)->ds_prev_snap_txg, tx) == 0);
+	scan_ds_queue_insert(scn, ds->ds_object,
+	    dsl_dataset_phys(ds)->ds_prev_snap_txg);
 	dsl_dataset_rele(ds, FTAG);
 	return (0);
 }
@@ -1370,8 +1749,7 @@ static void
 dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 {
 	dsl_pool_t *dp = scn->scn_dp;
-	zap_cursor_t *zc;
-	zap_attribute_t *za;
+	scan_ds_t *sds;
 
 	if (scn->scn_phys.scn_ddt_bookmark.ddb_class <=
 	    scn->scn_phys.scn_ddt_class_max) {
@@ -1419,26 +1797,21 @@ dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 	 * bookmark so we don't think that we're still trying to resume.
 	 */
 	bzero(&scn->scn_phys.scn_bookmark, sizeof (zbookmark_phys_t));
-	zc = kmem_alloc(sizeof (zap_cursor_t), KM_SLEEP);
-	za = kmem_alloc(sizeof (zap_attribute_t), KM_SLEEP);
 
-	/* keep pulling things out of the zap-object-as-queue */
-	while (zap_cursor_init(zc, dp->dp_meta_objset,
-	    scn->scn_phys.scn_queue_obj),
-	    zap_cursor_retrieve(zc, za) == 0) {
+	/* keep pulling things out of the dataset queue */
+	while ((sds = avl_first(&scn->scn_queue)) != NULL) {
 		dsl_dataset_t *ds;
-		uint64_t dsobj;
+		uint64_t dsobj = sds->sds_dsobj;
+		uint64_t txg = sds->sds_txg;
 
-		dsobj = strtonum(za->za_name, NULL);
-		VERIFY3U(0, ==, zap_remove_int(dp->dp_meta_objset,
-		    scn->scn_phys.scn_queue_obj, dsobj, tx));
+		scan_ds_queue_remove(scn, dsobj);
+		sds = NULL;
 
 		/* Set up min/max txg */
 		VERIFY3U(0, ==, dsl_dataset_hold_obj(dp, dsobj, FTAG, &ds));
-		if (za->za_first_integer != 0) {
+		if (txg != 0) {
 			scn->scn_phys.scn_cur_min_txg =
-			    MAX(scn->scn_phys.scn_min_txg,
-			    za->za_first_integer);
+			    MAX(scn->scn_phys.scn_min_txg, txg);
 		} else {
 			scn->scn_phys.scn_cur_min_txg =
 			    MAX(scn->scn_phys.scn_min_txg,
@@ -1448,14 +1821,9 @@ dsl_scan_visit(dsl_scan_t *scn, dmu_tx_t *tx)
 		dsl_dataset_rele(ds, FTAG);
 
 		dsl_scan_visitds(scn, dsobj, tx);
-		zap_cursor_fini(zc);
 		if (scn->scn_pausing)
-			goto out;
+			return;
 	}
-	zap_cursor_fini(zc);
-out:
-	kmem_free(za, sizeof (zap_attribute_t));
-	kmem_free(zc, sizeof (zap_cursor_t));
 }
 
 static boolean_t
@@ -1681,16 +2049,102 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 	if (scn->scn_phys.scn_state != DSS_SCANNING)
 		return;
 
-	if (scn->scn_done_txg == tx->tx_txg) {
+	/*
+	 * The scan is only complete once the traversal has finished and
+	 * all of the I/O it queued up has been issued.
+	 */
+	if (scn->scn_done_txg != 0 && scn->scn_done_txg <= tx->tx_txg &&
+	    scn->scn_bytes_pending == 0) {
 		ASSERT(!scn->scn_pausing);
 		/* finished with scan. */
 		zfs_dbgmsg("txg %llu scan complete", tx->tx_txg);
 		dsl_scan_done(scn, B_TRUE, tx);
 		ASSERT3U(spa->spa_scrub_inflight, ==, 0);
-		dsl_scan_sync_state(scn, tx);
+		dsl_scan_sync_state(scn, tx, SYNC_MANDATORY);
 		return;
 	}
 
+	/*
+	 * Once a scan has started sorting its I/O it keeps doing so until
+	 * it is done, even if zfs_scan_legacy is set in the meantime.
+	 */
+	if (!zfs_scan_legacy)
+		scn->scn_is_sorted = B_TRUE;
+
+	/*
+	 * Decide whether to traverse more metadata or to issue queued I/O.
+	 * We checkpoint (drain all queues so the position can be written
+	 * out) every zfs_scan_checkpoint_intval seconds and after the
+	 * traversal has finished, and otherwise only stop traversing when
+	 * the queues have grown too large.
+	 */
+	if (scn->scn_is_sorted && scn->scn_bytes_pending != 0 &&
+	    (scn->scn_checkpointing || scn->scn_done_txg != 0 ||
+	    ddi_get_lbolt() - scn->scn_last_checkpoint >
+	    SEC_TO_TICK(zfs_scan_checkpoint_intval))) {
+		if (!scn->scn_checkpointing)
+			zfs_dbgmsg("begin scan checkpoint");
+		scn->scn_checkpointing = B_TRUE;
+		scn->scn_clearing = B_TRUE;
+	} else if (scn->scn_is_sorted) {
+		boolean_t should_clear = (scn->scn_bytes_pending != 0 &&
+		    dsl_scan_should_clear(scn));
+
+		if (should_clear && !scn->scn_clearing) {
+			zfs_dbgmsg("begin scan clearing");
+			scn->scn_clearing = B_TRUE;
+		} else if (!should_clear && scn->scn_clearing) {
+			zfs_dbgmsg("finish scan clearing");
+			scn->scn_clearing = B_FALSE;
+		}
+	}
+
+	if (!scn->scn_clearing && scn->scn_done_txg == 0) {
+		dsl_scan_sync_traverse(scn, tx);
+	} else if (scn->scn_is_sorted && scn->scn_bytes_pending != 0) {
+		uint64_t issued = spa->spa_scan_pass_issued;
+
+		scn->scn_zio_root = zio_root(dp->dp_spa, NULL,
+		    NULL, ZIO_FLAG_CANFAIL);
+		scan_io_queues_run(scn);
+		(void) zio_wait(scn->scn_zio_root);
+		scn->scn_zio_root = NULL;
+
+		dsl_scan_update_stats(scn);
+		zfs_dbgmsg("scan issued %llu bytes in %llu zios (%llu segs) "
+		    "in %llums (avg_zio_size = %llu, avg_seg_size = %llu); "
+		    "%llu bytes pending",
+		    (longlong_t)(spa->spa_scan_pass_issued - issued),
+		    (longlong_t)scn->scn_zios_this_txg,
+		    (longlong_t)scn->scn_segs_this_txg,
+		    (longlong_t)NSEC2MSEC(gethrtime() -
+		    scn->scn_sync_start_time),
+		    (longlong_t)scn->scn_avg_zio_size_this_txg,
+		    (longlong_t)scn->scn_avg_seg_size_this_txg,
+		    (longlong_t)scn->scn_bytes_pending);
+	}
+
+	if (DSL_SCAN_IS_SCRUB_RESILVER(scn)) {
+		mutex_enter(&spa->spa_scrub_lock);
+		while (spa->spa_scrub_inflight > 0) {
+			cv_wait(&spa->spa_scrub_io_cv,
+			    &spa->spa_scrub_lock);
+		}
+		mutex_exit(&spa->spa_scrub_lock);
+	}
+
+	dsl_scan_sync_state(scn, tx, SYNC_OPTIONAL);
+}
+
+/*
+ * Traverse more of the pool's metadata, queueing (or, for a legacy scan,
+ * issuing) the blocks found for scrubbing or resilvering.
+ */
+static void
+dsl_scan_sync_traverse(dsl_scan_t *scn, dmu_tx_t *tx)
+{
+	dsl_pool_t *dp = scn->scn_dp;
+
 	if (scn->scn_phys.scn_ddt_bookmark.ddb_class <=
 	    scn->scn_phys.scn_ddt_class_max) {
 		zfs_dbgmsg("doing scan sync txg %llu; "
@@ -1730,17 +2184,6 @@ dsl_scan_sync(dsl_pool_t *dp, dmu_tx_t *tx)
 		zfs_dbgmsg("txg %llu traversal complete, waiting till txg %llu",
 		    tx->tx_txg, scn->scn_done_txg);
 	}
-
-	if (DSL_SCAN_IS_SCRUB_RESILVER(scn)) {
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight > 0) {
-			cv_wait(&spa->spa_scrub_io_cv,
-			    &spa->spa_scrub_lock);
-		}
-		mutex_exit(&spa->spa_scrub_lock);
-	}
-
-	dsl_scan_sync_state(scn, tx);
 }
 
 /*
@@ -1828,61 +2271,746 @@ static void
 dsl_scan_scrub_done(zio_t *zio)
 {
 	spa_t *spa = zio->io_spa;
+	dsl_scan_io_queue_t *queue = zio->io_private;
 
 	abd_free(zio->io_abd);
 
-	mutex_enter(&spa->spa_scrub_lock);
-	spa->spa_scrub_inflight--;
-	cv_broadcast(&spa->spa_scrub_io_cv);
+	if (queue == NULL) {
+		mutex_enter(&spa->spa_scrub_lock);
+		spa->spa_scrub_inflight--;
+		cv_broadcast(&spa->spa_scrub_io_cv);
+		mutex_exit(&spa->spa_scrub_lock);
+	} else {
+		mutex_enter(&queue->q_vd->vdev_scan_io_queue_lock);
+		ASSERT3U(queue->q_inflight_bytes, >=, zio->io_size);
+		queue->q_inflight_bytes -= zio->io_size;
+		cv_broadcast(&queue->q_zio_cv);
+		mutex_exit(&queue->q_vd->vdev_scan_io_queue_lock);
+	}
 
 	if (zio->io_error && (zio->io_error != ECKSUM ||
 	    !(zio->io_flags & ZIO_FLAG_SPECULATIVE))) {
-		spa->spa_dsl_pool->dp_scan->scn_phys.scn_errors++;
+		atomic_inc_64(&spa->spa_dsl_pool->dp_scan->scn_phys.scn_errors);
 	}
-	mutex_exit(&spa->spa_scrub_lock);
 }
 
-static int
-dsl_scan_scrub_cb(dsl_pool_t *dp,
-    const blkptr_t *bp, const zbookmark_phys_t *zb)
+/*
+ * Issue a single scrub/resilver read.  When called from the traversal
+ * (queue == NULL) the number of outstanding reads is limited by
+ * zfs_top_maxinflight, otherwise by the in-flight byte limit of the
+ * queue the read was sorted into.
+ */
+static void
+scan_exec_io(dsl_pool_t *dp, const blkptr_t *bp, int zio_flags,
+    const zbookmark_phys_t *zb, dsl_scan_io_queue_t *queue)
 {
+	spa_t *spa = dp->dp_spa;
 	dsl_scan_t *scn = dp->dp_scan;
 	size_t size = BP_GET_PSIZE(bp);
-	spa_t *spa = dp->dp_spa;
-	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
-	boolean_t needs_io = B_FALSE;
-	int zio_flags = ZIO_FLAG_SCAN_THREAD | ZIO_FLAG_RAW | ZIO_FLAG_CANFAIL;
-	int scan_delay = 0;
+	abd_t *data = abd_alloc_for_io(size, B_FALSE);
+	zio_t *pio;
 	int d;
 
-	if (phys_birth <= scn->scn_phys.scn_min_txg ||
-	    phys_birth >= scn->scn_phys.scn_max_txg)
-		return (0);
+	if (queue == NULL) {
+		vdev_t *rvd = spa->spa_root_vdev;
+		uint64_t maxinflight = rvd->vdev_children * zfs_top_maxinflight;
+		int scan_delay = (zio_flags & ZIO_FLAG_SCRUB) ?
+		    zfs_scrub_delay : zfs_resilver_delay;
 
-	count_block(dp->dp_blkstats, bp);
+		mutex_enter(&spa->spa_scrub_lock);
+		while (spa->spa_scrub_inflight >= maxinflight)
+			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
+		spa->spa_scrub_inflight++;
+		mutex_exit(&spa->spa_scrub_lock);
 
-	if (BP_IS_EMBEDDED(bp))
-		return (0);
+		/*
+		 * If we're seeing recent (zfs_scan_idle) "important" I/Os
+		 * then throttle our workload to limit the impact of a scan.
+		 */
+		if (ddi_get_lbolt64() - spa->spa_last_io <= zfs_scan_idle)
+			delay(scan_delay);
 
-	ASSERT(DSL_SCAN_IS_SCRUB_RESILVER(scn));
-	if (scn->scn_phys.scn_func == POOL_SCAN_SCRUB) {
-		zio_flags |= ZIO_FLAG_SCRUB;
-		needs_io = B_TRUE;
-		scan_delay = zfs_scrub_delay;
+		for (d = 0; d < BP_GET_NDVAS(bp); d++) {
+			atomic_add_64(&spa->spa_scan_pass_issued,
+			    DVA_GET_ASIZE(&bp->blk_dva[d]));
+		}
+		pio = NULL;
 	} else {
-		ASSERT3U(scn->scn_phys.scn_func, ==, POOL_SCAN_RESILVER);
-		zio_flags |= ZIO_FLAG_RESILVER;
-		needs_io = B_FALSE;
-		scan_delay = zfs_resilver_delay;
+		kmutex_t *q_lock = &queue->q_vd->vdev_scan_io_queue_lock;
+
+		mutex_enter(q_lock);
+		while (queue->q_inflight_bytes >= queue->q_maxinflight_bytes)
+			cv_wait(&queue->q_zio_cv, q_lock);
+		queue->q_inflight_bytes += size;
+		mutex_exit(q_lock);
+
+		/* only the sorted DVA counts, the others are queued too */
+		atomic_add_64(&spa->spa_scan_pass_issued,
+		    DVA_GET_ASIZE(&bp->blk_dva[0]));
+		pio = scn->scn_zio_root;
 	}
 
-	/* If it's an intent log block, failure is expected. */
-	if (zb->zb_level == ZB_ZIL_LEVEL)
-		zio_flags |= ZIO_FLAG_SPECULATIVE;
-
-	for (d = 0; d < BP_GET_NDVAS(bp); d++) {
-		vdev_t *vd = vdev_lookup_top(spa,
-		    DVA_GET_VDEV(&bp->blk_dva[d]));
+	zio_nowait(zio_read(pio, spa, bp, data, size, dsl_scan_scrub_done,
+	    queue, ZIO_PRIORITY_SCRUB, zio_flags, zb));
+}
+
+static int
+sio_addr_compare(const void *x, const void *y)
+{
+	const scan_io_t *a = x, *b = y;
+
+	return (AVL_CMP(SIO_GET_OFFSET(a), SIO_GET_OFFSET(b)));
+}
+
+/*
+ * Extents are sorted by how much I/O they contain (their fill), boosted
+ * by how densely packed that I/O is, so that a short extent full of I/O
+ * is preferred over a longer, sparser one.  zfs_scan_fill_weight sets
+ * how strongly the density counts.  Larger scores sort first and ties
+ * are broken by offset.
+ */
+static int
+ext_size_compare(const void *x, const void *y)
+{
+	const range_seg_t *rsa = x, *rsb = y;
+	uint64_t sa = rsa->rs_end - rsa->rs_start;
+	uint64_t sb = rsb->rs_end - rsb->rs_start;
+	uint64_t score_a, score_b;
+
+	score_a = rsa->rs_fill + ((((rsa->rs_fill << 7) / sa) *
+	    zfs_scan_fill_weight * rsa->rs_fill) >> 7);
+	score_b = rsb->rs_fill + ((((rsb->rs_fill << 7) / sb) *
+	    zfs_scan_fill_weight * rsb->rs_fill) >> 7);
+
+	if (score_a != score_b)
+		return (score_a > score_b ? -1 : 1);
+
+	return (AVL_CMP(rsa->rs_start, rsb->rs_start));
+}
+
+/*
+ * Range tree callbacks which keep q_exts_by_size in sync with the
+ * extents in q_exts_by_addr.
+ */
+/* ARGSUSED */
+static void
+scan_io_queue_exts_create(range_tree_t *rt, void *arg)
+{
+	avl_tree_t *size_tree = arg;
+
+	avl_create(size_tree, ext_size_compare, sizeof (range_seg_t),
+	    offsetof(range_seg_t, rs_pp_node));
+}
+
+/* ARGSUSED */
+static void
+scan_io_queue_exts_destroy(range_tree_t *rt, void *arg)
+{
+	avl_tree_t *size_tree = arg;
+
+	ASSERT0(avl_numnodes(size_tree));
+	avl_destroy(size_tree);
+}
+
+/* ARGSUSED */
+static void
+scan_io_queue_exts_add(range_tree_t *rt, range_seg_t *rs, void *arg)
+{
+	avl_tree_t *size_tree = arg;
+
+	avl_add(size_tree, rs);
+}
+
+/* ARGSUSED */
+static void
+scan_io_queue_exts_remove(range_tree_t *rt, range_seg_t *rs, void *arg)
+{
+	avl_tree_t *size_tree = arg;
+
+	avl_remove(size_tree, rs);
+}
+
+static void
+scan_io_queue_exts_vacate(range_tree_t *rt, void *arg)
+{
+	avl_tree_t *size_tree = arg;
+	void *cookie = NULL;
+
+	while (avl_destroy_nodes(size_tree, &cookie) != NULL)
+		continue;
+	scan_io_queue_exts_destroy(rt, arg);
+	scan_io_queue_exts_create(rt, arg);
+}
+
+static range_tree_ops_t scan_io_queue_exts_ops = {
+	scan_io_queue_exts_create,
+	scan_io_queue_exts_destroy,
+	scan_io_queue_exts_add,
+	scan_io_queue_exts_remove,
+	scan_io_queue_exts_vacate
+};
+
+static dsl_scan_io_queue_t *
+scan_io_queue_create(vdev_t *vd)
+{
+	dsl_scan_t *scn = vd->vdev_spa->spa_dsl_pool->dp_scan;
+	dsl_scan_io_queue_t *queue;
+
+	ASSERT(MUTEX_HELD(&vd->vdev_scan_io_queue_lock));
+
+	queue = kmem_zalloc(sizeof (dsl_scan_io_queue_t), KM_SLEEP);
+	queue->q_scn = scn;
+	queue->q_vd = vd;
+	cv_init(&queue->q_zio_cv, NULL, CV_DEFAULT, NULL);
+	queue->q_exts_by_addr = range_tree_create_impl(&scan_io_queue_exts_ops,
+	    &queue->q_exts_by_size, &vd->vdev_scan_io_queue_lock,
+	    zfs_scan_max_ext_gap);
+	avl_create(&queue->q_sios_by_addr, sio_addr_compare,
+	    sizeof (scan_io_t), offsetof(scan_io_t, sio_nodes.sio_addr_node));
+
+	return (queue);
+}
+
+/*
+ * Destroys a scan queue and all segments and scan_io_t's contained in it.
+ * The caller must hold the vdev_scan_io_queue_lock of the queue's vdev.
+ */
+void
+dsl_scan_io_queue_destroy(dsl_scan_io_queue_t *queue)
+{
+	dsl_scan_t *scn = queue->q_scn;
+	scan_io_t *sio;
+	void *cookie = NULL;
+	int64_t bytes_dequeued = 0;
+
+	ASSERT(MUTEX_HELD(&queue->q_vd->vdev_scan_io_queue_lock));
+	ASSERT0(queue->q_inflight_bytes);
+
+	while ((sio = avl_destroy_nodes(&queue->q_sios_by_addr, &cookie)) !=
+	    NULL) {
+		ASSERT(range_tree_contains(queue->q_exts_by_addr,
+		    SIO_GET_OFFSET(sio), SIO_GET_ASIZE(sio)));
+		bytes_dequeued += SIO_GET_ASIZE(sio);
+		queue->q_sio_memused -= sizeof (scan_io_t);
+		kmem_cache_free(sio_cache, sio);
+	}
+
+	ASSERT0(queue->q_sio_memused);
+	atomic_add_64(&scn->scn_bytes_pending, -bytes_dequeued);
+	range_tree_vacate(queue->q_exts_by_addr, NULL, queue);
+	range_tree_destroy(queue->q_exts_by_addr);
+	avl_destroy(&queue->q_sios_by_addr);
+	cv_destroy(&queue->q_zio_cv);
+
+	kmem_free(queue, sizeof (dsl_scan_io_queue_t));
+}
+
+/*
+ * Properly transfers a dsl_scan_io_queue_t from `svd' to `tvd'. This is
+ * called on behalf of vdev_top_transfer when creating or destroying
+ * a mirror vdev due to zpool attach/detach.
+ */
+void
+dsl_scan_io_queue_vdev_xfer(vdev_t *svd, vdev_t *tvd)
+{
+	mutex_enter(&svd->vdev_scan_io_queue_lock);
+	mutex_enter(&tvd->vdev_scan_io_queue_lock);
+
+	VERIFY3P(tvd->vdev_scan_io_queue, ==, NULL);
+	tvd->vdev_scan_io_queue = svd->vdev_scan_io_queue;
+	svd->vdev_scan_io_queue = NULL;
+	if (tvd->vdev_scan_io_queue != NULL) {
+		tvd->vdev_scan_io_queue->q_vd = tvd;
+		tvd->vdev_scan_io_queue->q_exts_by_addr->rt_lock =
+		    &tvd->vdev_scan_io_queue_lock;
+	}
+
+	mutex_exit(&tvd->vdev_scan_io_queue_lock);
+	mutex_exit(&svd->vdev_scan_io_queue_lock);
+}
+
+static void
+scan_io_queues_destroy(dsl_scan_t *scn)
+{
+	vdev_t *rvd = scn->scn_dp->dp_spa->spa_root_vdev;
+	uint64_t i;
+
+	/* the root vdev is freed before the pool on spa_unload() */
+	if (rvd == NULL)
+		return;
+
+	for (i = 0; i < rvd->vdev_children; i++) {
+		vdev_t *tvd = rvd->vdev_child[i];
+
+		mutex_enter(&tvd->vdev_scan_io_queue_lock);
+		if (tvd->vdev_scan_io_queue != NULL)
+			dsl_scan_io_queue_destroy(tvd->vdev_scan_io_queue);
+		tvd->vdev_scan_io_queue = NULL;
+		mutex_exit(&tvd->vdev_scan_io_queue_lock);
+	}
+}
+
+static void
+scan_io_queue_insert(dsl_scan_io_queue_t *queue, const blkptr_t *bp,
+    int zio_flags, const zbookmark_phys_t *zb)
+{
+	scan_io_t *sio;
+	avl_index_t idx;
+
+	ASSERT(MUTEX_HELD(&queue->q_vd->vdev_scan_io_queue_lock));
+
+	sio = kmem_cache_alloc(sio_cache, KM_SLEEP);
+	sio->sio_bp = *bp;
+	sio->sio_flags = zio_flags;
+	sio->sio_zb = *zb;
+
+	/* the same DVA can be reached twice, e.g. from the DDT */
+	if (avl_find(&queue->q_sios_by_addr, sio, &idx) != NULL) {
+		kmem_cache_free(sio_cache, sio);
+		return;
+	}
+
+	avl_insert(&queue->q_sios_by_addr, sio, idx);
+	queue->q_sio_memused += sizeof (scan_io_t);
+	range_tree_add(queue->q_exts_by_addr, SIO_GET_OFFSET(sio),
+	    SIO_GET_ASIZE(sio));
+	atomic_add_64(&queue->q_scn->scn_bytes_pending, SIO_GET_ASIZE(sio));
+}
+
+/*
+ * Queue a block found by the traversal.  Each of its DVAs is sorted into
+ * the queue of its top-level vdev, unless the scan isn't sorted or the
+ * block is a gang block, in which case the read is issued right away.
+ */
+static void
+dsl_scan_enqueue(dsl_pool_t *dp, const blkptr_t *bp, int zio_flags,
+    const zbookmark_phys_t *zb)
+{
+	spa_t *spa = dp->dp_spa;
+	int d;
+
+	ASSERT(!BP_IS_EMBEDDED(bp));
+
+	if (!dp->dp_scan->scn_is_sorted || BP_IS_GANG(bp)) {
+		scan_exec_io(dp, bp, zio_flags, zb, NULL);
+		return;
+	}
+
+	for (d = 0; d < BP_GET_NDVAS(bp); d++) {
+		blkptr_t tmpbp = *bp;
+		vdev_t *vd;
+
+		tmpbp.blk_dva[0] = bp->blk_dva[d];
+		tmpbp.blk_dva[d] = bp->blk_dva[0];
+
+		vd = vdev_lookup_top(spa, DVA_GET_VDEV(&bp->blk_dva[d]));
+		ASSERT(vd != NULL);
+
+		mutex_enter(&vd->vdev_scan_io_queue_lock);
+		if (vd->vdev_scan_io_queue == NULL)
+			vd->vdev_scan_io_queue = scan_io_queue_create(vd);
+		scan_io_queue_insert(vd->vdev_scan_io_queue, &tmpbp,
+		    zio_flags, zb);
+		mutex_exit(&vd->vdev_scan_io_queue_lock);
+	}
+}
+
+static void
+dsl_scan_freed_dva(dsl_scan_io_queue_t *queue, const dva_t *dva)
+{
+	scan_io_t srch, *sio;
+	uint64_t asize;
+
+	ASSERT(MUTEX_HELD(&queue->q_vd->vdev_scan_io_queue_lock));
+
+	srch.sio_bp.blk_dva[0] = *dva;
+	sio = avl_find(&queue->q_sios_by_addr, &srch, NULL);
+	if (sio == NULL)
+		return;
+
+	asize = SIO_GET_ASIZE(sio);
+	ASSERT3U(asize, ==, DVA_GET_ASIZE(dva));
+	avl_remove(&queue->q_sios_by_addr, sio);
+	queue->q_sio_memused -= sizeof (scan_io_t);
+	range_tree_remove_fill(queue->q_exts_by_addr, SIO_GET_OFFSET(sio),
+	    asize);
+	kmem_cache_free(sio_cache, sio);
+
+	/* the block counts as issued, it no longer needs scrubbing */
+	atomic_add_64(&queue->q_scn->scn_bytes_pending, -asize);
+	atomic_add_64(&queue->q_vd->vdev_spa->spa_scan_pass_issued, asize);
+}
+
+/*
+ * Called whenever a block is freed.  Any I/O still queued for it is
+ * dropped since its space may be reallocated before the read would be
+ * issued, which would then report bogus checksum errors.  Dedup blocks
+ * are only really freed once their last reference goes away, at which
+ * point they are passed in again without the dedup bit set.
+ */
+void
+dsl_scan_freed(spa_t *spa, const blkptr_t *bp)
+{
+	dsl_pool_t *dp = spa->spa_dsl_pool;
+	dsl_scan_t *scn;
+	int d;
+
+	if (dp == NULL || dp->dp_scan == NULL)
+		return;
+
+	scn = dp->dp_scan;
+	if (!scn->scn_is_sorted || BP_IS_EMBEDDED(bp) || BP_IS_GANG(bp) ||
+	    BP_GET_DEDUP(bp))
+		return;
+
+	for (d = 0; d < BP_GET_NDVAS(bp); d++) {
+		vdev_t *vd = vdev_lookup_top(spa,
+		    DVA_GET_VDEV(&bp->blk_dva[d]));
+
+		if (vd == NULL)
+			continue;
+
+		mutex_enter(&vd->vdev_scan_io_queue_lock);
+		if (vd->vdev_scan_io_queue != NULL)
+			dsl_scan_freed_dva(vd->vdev_scan_io_queue,
+			    &bp->blk_dva[d]);
+		mutex_exit(&vd->vdev_scan_io_queue_lock);
+	}
+}
+
+/*
+ * Pick the next extent to issue I/O from.  While the traversal is still
+ * running the fullest extent goes first, leaving the smaller ones to grow
+ * into larger sequential runs.  When checkpointing nothing new is added
+ * to the queues, so they are simply drained in LBA order.
+ */
+static range_seg_t *
+scan_io_queue_fetch_ext(dsl_scan_io_queue_t *queue)
+{
+	dsl_scan_t *scn = queue->q_scn;
+
+	ASSERT(MUTEX_HELD(&queue->q_vd->vdev_scan_io_queue_lock));
+	ASSERT(scn->scn_is_sorted);
+
+	if (scn->scn_checkpointing)
+		return (range_tree_first(queue->q_exts_by_addr));
+	else if (scn->scn_clearing)
+		return (avl_first(&queue->q_exts_by_size));
+	else
+		return (NULL);
+}
+
+/*
+ * Move up to ZFS_SCAN_GATHER_MAX sios from the start of the extent onto
+ * `list' and shrink the extent accordingly.  Returns B_TRUE if the
+ * extent still has sios left in it.
+ */
+static boolean_t
+scan_io_queue_gather(dsl_scan_io_queue_t *queue, range_seg_t *rs,
+    list_t *list)
+{
+	scan_io_t srch, *sio, *next_sio;
+	avl_index_t idx;
+	uint_t num_sios = 0;
+	int64_t bytes_issued = 0;
+
+	ASSERT(rs != NULL);
+	ASSERT(MUTEX_HELD(&queue->q_vd->vdev_scan_io_queue_lock));
+
+	bzero(&srch.sio_bp.blk_dva[0], sizeof (dva_t));
+	DVA_SET_OFFSET(&srch.sio_bp.blk_dva[0], rs->rs_start);
+
+	/*
+	 * The extent may start with a gap that was left behind by a freed
+	 * sio, so also look at the sio following the start.
+	 */
+	sio = avl_find(&queue->q_sios_by_addr, &srch, &idx);
+	if (sio == NULL)
+		sio = avl_nearest(&queue->q_sios_by_addr, idx, AVL_AFTER);
+
+	while (sio != NULL && SIO_GET_OFFSET(sio) < rs->rs_end &&
+	    num_sios < ZFS_SCAN_GATHER_MAX) {
+		ASSERT3U(SIO_GET_OFFSET(sio), >=, rs->rs_start);
+		ASSERT3U(SIO_GET_END_OFFSET(sio), <=, rs->rs_end);
+
+		bytes_issued += SIO_GET_ASIZE(sio);
+		num_sios++;
+		next_sio = AVL_NEXT(&queue->q_sios_by_addr, sio);
+		avl_remove(&queue->q_sios_by_addr, sio);
+		queue->q_sio_memused -= sizeof (scan_io_t);
+		list_insert_tail(list, sio);
+		sio = next_sio;
+	}
+
+	if (sio != NULL && SIO_GET_OFFSET(sio) < rs->rs_end) {
+		range_tree_adjust_fill(queue->q_exts_by_addr, rs,
+		    -bytes_issued);
+		range_tree_resize_segment(queue->q_exts_by_addr, rs,
+		    SIO_GET_OFFSET(sio), rs->rs_end - SIO_GET_OFFSET(sio));
+		return (B_TRUE);
+	} else {
+		range_tree_remove(queue->q_exts_by_addr, rs->rs_start,
+		    rs->rs_end - rs->rs_start);
+		return (B_FALSE);
+	}
+}
+
+/*
+ * Same conditions as dsl_scan_check_pause(), without the bookmark
+ * handling which doesn't apply when issuing from the queues.
+ */
+static boolean_t
+scan_io_queue_check_suspend(dsl_scan_t *scn)
+{
+	uint64_t elapsed_nanosecs = gethrtime() - scn->scn_sync_start_time;
+	int dirty_pct = scn->scn_dp->dp_dirty_total * 100 / zfs_dirty_data_max;
+	int mintime = (scn->scn_phys.scn_func == POOL_SCAN_RESILVER) ?
+	    zfs_resilver_min_time_ms : zfs_scan_min_time_ms;
+
+	return (elapsed_nanosecs / NANOSEC >= zfs_txg_timeout ||
+	    (NSEC2MSEC(elapsed_nanosecs) > mintime &&
+	    (txg_sync_waiting(scn->scn_dp) ||
+	    dirty_pct >= zfs_vdev_async_write_active_min_dirty_percent)) ||
+	    spa_shutting_down(scn->scn_dp->dp_spa));
+}
+
+static uint64_t
+dsl_scan_count_leaves(vdev_t *vd)
+{
+	uint64_t i, leaves = 0;
+
+	/* we only count leaves that belong to the main pool and are readable */
+	if (vd->vdev_islog || vd->vdev_isspare ||
+	    vd->vdev_isl2cache || !vdev_readable(vd))
+		return (0);
+
+	if (vd->vdev_ops->vdev_op_leaf)
+		return (1);
+
+	for (i = 0; i < vd->vdev_children; i++)
+		leaves += dsl_scan_count_leaves(vd->vdev_child[i]);
+
+	return (leaves);
+}
+
+/*
+ * Issue I/O from a single top-level vdev's queue until it is empty, no
+ * longer needs clearing or the txg runs out of time.  Runs in
+ * scn_taskq, one task per queue.
+ */
+static void
+scan_io_queues_run_one(void *arg)
+{
+	dsl_scan_io_queue_t *queue = arg;
+	dsl_scan_t *scn = queue->q_scn;
+	kmutex_t *q_lock = &queue->q_vd->vdev_scan_io_queue_lock;
+	range_seg_t *rs;
+	list_t sio_list;
+
+	ASSERT(scn->scn_is_sorted);
+
+	list_create(&sio_list, sizeof (scan_io_t),
+	    offsetof(scan_io_t, sio_nodes.sio_list_node));
+
+	mutex_enter(q_lock);
+
+	queue->q_maxinflight_bytes = MAX(dsl_scan_count_leaves(queue->q_vd) *
+	    zfs_scan_vdev_limit, ZFS_SCAN_MIN_INFLIGHT_BYTES);
+	queue->q_total_seg_size_this_txg = 0;
+	queue->q_segs_this_txg = 0;
+	queue->q_total_zio_size_this_txg = 0;
+	queue->q_zios_this_txg = 0;
+
+	while (!scan_io_queue_check_suspend(scn) &&
+	    (rs = scan_io_queue_fetch_ext(queue)) != NULL) {
+		scan_io_t *sio;
+		uint64_t seg_start, seg_end;
+		boolean_t more_left;
+
+		more_left = scan_io_queue_gather(queue, rs, &sio_list);
+		ASSERT(!list_is_empty(&sio_list));
+		seg_start = SIO_GET_OFFSET((scan_io_t *)list_head(&sio_list));
+		seg_end = SIO_GET_END_OFFSET((scan_io_t *)list_tail(&sio_list));
+
+		queue->q_total_seg_size_this_txg += seg_end - seg_start;
+		if (!more_left)
+			queue->q_segs_this_txg++;
+
+		/*
+		 * Issuing may block on the in-flight limit, so drop the
+		 * lock.  The sios on the list are no longer in the queue.
+		 */
+		mutex_exit(q_lock);
+		while ((sio = list_remove_head(&sio_list)) != NULL) {
+			queue->q_total_zio_size_this_txg +=
+			    BP_GET_PSIZE(&sio->sio_bp);
+			queue->q_zios_this_txg++;
+			atomic_add_64(&scn->scn_bytes_pending,
+			    -SIO_GET_ASIZE(sio));
+			scan_exec_io(scn->scn_dp, &sio->sio_bp, sio->sio_flags,
+			    &sio->sio_zb, queue);
+			kmem_cache_free(sio_cache, sio);
+		}
+		mutex_enter(q_lock);
+	}
+
+	mutex_exit(q_lock);
+	list_destroy(&sio_list);
+}
+
+/*
+ * Issue queued I/O from all top-level vdevs in parallel.  The reads are
+ * all children of scn_zio_root, which the caller waits on.
+ */
+static void
+scan_io_queues_run(dsl_scan_t *scn)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	uint64_t i;
+
+	ASSERT(scn->scn_is_sorted);
+	ASSERT(spa_config_held(spa, SCL_CONFIG, RW_READER));
+
+	if (scn->scn_bytes_pending == 0)
+		return;
+
+	if (scn->scn_taskq == NULL) {
+		int nthreads = rvd->vdev_children;
+
+		scn->scn_taskq = taskq_create("dsl_scan_iss", nthreads,
+		    minclsyspri, nthreads, nthreads, TASKQ_PREPOPULATE);
+	}
+
+	for (i = 0; i < rvd->vdev_children; i++) {
+		vdev_t *tvd = rvd->vdev_child[i];
+
+		mutex_enter(&tvd->vdev_scan_io_queue_lock);
+		if (tvd->vdev_scan_io_queue != NULL) {
+			VERIFY(taskq_dispatch(scn->scn_taskq,
+			    scan_io_queues_run_one, tvd->vdev_scan_io_queue,
+			    TQ_SLEEP) != TASKQID_INVALID);
+		}
+		mutex_exit(&tvd->vdev_scan_io_queue_lock);
+	}
+
+	/*
+	 * Wait for the queues to finish issuing their I/Os for this run.
+	 * We need to do this before returning since the queues must not
+	 * change while the pool configuration may change.
+	 */
+	taskq_wait(scn->scn_taskq);
+}
+
+/*
+ * Decide whether the traversal has to stop so that queued I/O can be
+ * issued to free up memory.  Clearing starts once the queues use more
+ * than the hard limit and goes on until they are below the soft limit.
+ */
+static boolean_t
+dsl_scan_should_clear(dsl_scan_t *scn)
+{
+	spa_t *spa = scn->scn_dp->dp_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	uint64_t mlim_hard, mlim_soft, mused = 0;
+	uint64_t alloc = metaslab_class_get_alloc(spa_normal_class(spa));
+	uint64_t i;
+
+	mlim_hard = MAX((physmem / zfs_scan_mem_lim_fact) * PAGESIZE,
+	    ZFS_SCAN_MEM_LIM_MIN);
+	mlim_hard = MIN(mlim_hard, alloc / 20);
+	mlim_soft = mlim_hard - MIN(mlim_hard / zfs_scan_mem_lim_soft_fact,
+	    ZFS_SCAN_MEM_LIM_SOFT_MAX);
+
+	for (i = 0; i < rvd->vdev_children; i++) {
+		vdev_t *tvd = rvd->vdev_child[i];
+		dsl_scan_io_queue_t *queue;
+
+		mutex_enter(&tvd->vdev_scan_io_queue_lock);
+		queue = tvd->vdev_scan_io_queue;
+		if (queue != NULL) {
+			mused += avl_numnodes(&queue->q_exts_by_size) *
+			    sizeof (range_seg_t) + queue->q_sio_memused;
+		}
+		mutex_exit(&tvd->vdev_scan_io_queue_lock);
+	}
+
+	dprintf("current scan memory usage: %llu bytes\n", (longlong_t)mused);
+
+	if (mused >= mlim_hard)
+		return (B_TRUE);
+	else if (mused < mlim_soft)
+		return (B_FALSE);
+	else
+		return (scn->scn_clearing);
+}
+
+static void
+dsl_scan_update_stats(dsl_scan_t *scn)
+{
+	vdev_t *rvd = scn->scn_dp->dp_spa->spa_root_vdev;
+	uint64_t seg_size_total = 0, zio_size_total = 0;
+	uint64_t seg_count_total = 0, zio_count_total = 0;
+	uint64_t i;
+
+	for (i = 0; i < rvd->vdev_children; i++) {
+		dsl_scan_io_queue_t *queue = rvd->vdev_child[i]->
+		    vdev_scan_io_queue;
+
+		if (queue == NULL)
+			continue;
+
+		seg_size_total += queue->q_total_seg_size_this_txg;
+		zio_size_total += queue->q_total_zio_size_this_txg;
+		seg_count_total += queue->q_segs_this_txg;
+		zio_count_total += queue->q_zios_this_txg;
+	}
+
+	scn->scn_segs_this_txg = seg_count_total;
+	scn->scn_zios_this_txg = zio_count_total;
+	scn->scn_avg_seg_size_this_txg = (seg_count_total == 0) ? 0 :
+	    seg_size_total / seg_count_total;
+	scn->scn_avg_zio_size_this_txg = (zio_count_total == 0) ? 0 :
+	    zio_size_total / zio_count_total;
+}
+
+static int
+dsl_scan_scrub_cb(dsl_pool_t *dp,
+    const blkptr_t *bp, const zbookmark_phys_t *zb)
+{
+	dsl_scan_t *scn = dp->dp_scan;
+	spa_t *spa = dp->dp_spa;
+	uint64_t phys_birth = BP_PHYSICAL_BIRTH(bp);
+	boolean_t needs_io = B_FALSE;
+	int zio_flags = ZIO_FLAG_SCAN_THREAD | ZIO_FLAG_RAW | ZIO_FLAG_CANFAIL;
+	int d;
+
+	if (phys_birth <= scn->scn_phys.scn_min_txg ||
+	    phys_birth >= scn->scn_phys.scn_max_txg)
+		return (0);
+
+	count_block(dp->dp_blkstats, bp);
+
+	if (BP_IS_EMBEDDED(bp))
+		return (0);
+
+	ASSERT(DSL_SCAN_IS_SCRUB_RESILVER(scn));
+	if (scn->scn_phys.scn_func == POOL_SCAN_SCRUB) {
+		zio_flags |= ZIO_FLAG_SCRUB;
+		needs_io = B_TRUE;
+	} else {
+		ASSERT3U(scn->scn_phys.scn_func, ==, POOL_SCAN_RESILVER);
+		zio_flags |= ZIO_FLAG_RESILVER;
+		needs_io = B_FALSE;
+	}
+
+	/* If it's an intent log block, failure is expected. */
+	if (zb->zb_level == ZB_ZIL_LEVEL)
+		zio_flags |= ZIO_FLAG_SPECULATIVE;
+
+	for (d = 0; d < BP_GET_NDVAS(bp); d++) {
+		vdev_t *vd = vdev_lookup_top(spa,
+		    DVA_GET_VDEV(&bp->blk_dva[d]));
 
 		/*
 		 * Keep track of how much data we've examined so that
@@ -1903,6 +3031,12 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 				 * gang members reside on the same vdev.
 				 */
 				needs_io = B_TRUE;
+			} else if (vd->vdev_ops == &vdev_indirect_ops) {
+				/*
+				 * The block was copied off a removed vdev,
+				 * maybe to one that is being resilvered.
+				 */
+				needs_io = B_TRUE;
 			} else {
 				needs_io = vdev_dtl_contains(vd, DTL_PARTIAL,
 				    phys_birth, 1);
@@ -1911,25 +3045,13 @@ dsl_scan_scrub_cb(dsl_pool_t *dp,
 	}
 
 	if (needs_io && !zfs_no_scrub_io) {
-		vdev_t *rvd = spa->spa_root_vdev;
-		uint64_t maxinflight = rvd->vdev_children * zfs_top_maxinflight;
-
-		mutex_enter(&spa->spa_scrub_lock);
-		while (spa->spa_scrub_inflight >= maxinflight)
-			cv_wait(&spa->spa_scrub_io_cv, &spa->spa_scrub_lock);
-		spa->spa_scrub_inflight++;
-		mutex_exit(&spa->spa_scrub_lock);
-
-		/*
-		 * If we're seeing recent (zfs_scan_idle) "important" I/Os
-		 * then throttle our workload to limit the impact of a scan.
-		 */
-		if (ddi_get_lbolt64() - spa->spa_last_io <= zfs_scan_idle)
-			delay(scan_delay);
-
-		zio_nowait(zio_read(NULL, spa, bp,
-		    abd_alloc_for_io(size, B_FALSE), size, dsl_scan_scrub_done,
-		    NULL, ZIO_PRIORITY_SCRUB, zio_flags, zb));
+		dsl_scan_enqueue(dp, bp, zio_flags, zb);
+	} else {
+		/* nothing to issue, the block is done as far as we care */
+		for (d = 0; d < BP_GET_NDVAS(bp); d++) {
+			atomic_add_64(&spa->spa_scan_pass_issued,
+			    DVA_GET_ASIZE(&bp->blk_dva[d]));
+		}
 	}
 
 	/* do not relocate this block */
@@ -1999,4 +3121,27 @@ MODULE_PARM_DESC(zfs_free_max_blocks, "Max number of blocks freed in one txg");
 
 module_param(zfs_free_bpobj_enabled, int, 0644);
 MODULE_PARM_DESC(zfs_free_bpobj_enabled, "Enable processing of the free_bpobj");
+
+module_param(zfs_scan_legacy, int, 0644);
+MODULE_PARM_DESC(zfs_scan_legacy, "Scrub using legacy unsorted method");
+
+/* CSTYLED */
+module_param(zfs_scan_vdev_limit, ulong, 0644);
+MODULE_PARM_DESC(zfs_scan_vdev_limit, "Max bytes in flight per leaf vdev");
+
+module_param(zfs_scan_checkpoint_intval, int, 0644);
+MODULE_PARM_DESC(zfs_scan_checkpoint_intval, "Scan checkpoint interval");
+
+/* CSTYLED */
+module_param(zfs_scan_max_ext_gap, ulong, 0644);
+MODULE_PARM_DESC(zfs_scan_max_ext_gap, "Max gap in bytes between sorted I/Os");
+
+module_param(zfs_scan_mem_lim_fact, int, 0644);
+MODULE_PARM_DESC(zfs_scan_mem_lim_fact, "Fraction of RAM for scan hard limit");
+
+module_param(zfs_scan_mem_lim_soft_fact, int, 0644);
+MODULE_PARM_DESC(zfs_scan_mem_lim_soft_fact, "Fraction of hard limit");
+
+module_param(zfs_scan_fill_weight, int, 0444);
+MODULE_PARM_DESC(zfs_scan_fill_weight, "Bias towards more filled extents");
 #endif
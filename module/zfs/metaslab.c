@@ -32,6 +32,7 @@
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 #include <sys/spa_impl.h>
+#include <sys/spa_log_spacemap.h>
 #include <sys/zfeature.h>
 
 #define	WITH_DF_BLOCK_ALLOCATOR
@@ -793,7 +794,8 @@ metaslab_group_allocatable(metaslab_group_t *mg, metaslab_group_t *rotor,
 	 * groups to select from. Otherwise, we always consider it eligible
 	 * for allocations.
 	 */
-	if (mc != spa_normal_class(spa) || mc->mc_groups <= 1)
+	if ((mc != spa_normal_class(spa) &&
+	    mc != spa_special_class(spa)) || mc->mc_groups <= 1)
 		return (B_TRUE);
 
 	/*
@@ -1009,6 +1011,7 @@ metaslab_block_alloc(metaslab_t *msp, uint64_t size)
 		VERIFY0(P2PHASE(size, 1ULL << vd->vdev_ashift));
 		VERIFY3U(range_tree_space(rt) - size, <=, msp->ms_size);
 		range_tree_remove(rt, start, size);
+		range_tree_clear(msp->ms_trim, start, size);
 	}
 	return (start);
 }
@@ -1276,6 +1279,96 @@ metaslab_load_wait(metaslab_t *msp)
 	}
 }
 
+/*
+ * ==========================================================================
+ * Changes of a metaslab that are only in the log space maps
+ * ==========================================================================
+ */
+static uint64_t
+metaslab_unflushed_segs(metaslab_t *msp)
+{
+	return (avl_numnodes(&msp->ms_unflushed_allocs->rt_root) +
+	    avl_numnodes(&msp->ms_unflushed_frees->rt_root));
+}
+
+/*
+ * Returns the change to the allocated space by the unflushed changes.
+ */
+static int64_t
+metaslab_unflushed_delta(metaslab_t *msp)
+{
+	return ((int64_t)range_tree_space(msp->ms_unflushed_allocs) -
+	    (int64_t)range_tree_space(msp->ms_unflushed_frees));
+}
+
+/*
+ * Forget the unflushed changes of the metaslab, which the logs do not need
+ * to keep anymore.
+ */
+static void
+metaslab_unflushed_clear(spa_t *spa, metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	atomic_add_64(&spa->spa_unflushed_segs,
+	    -(int64_t)metaslab_unflushed_segs(msp));
+	range_tree_vacate(msp->ms_unflushed_allocs, NULL, NULL);
+	range_tree_vacate(msp->ms_unflushed_frees, NULL, NULL);
+	spa_log_sm_ms_clean(spa, msp);
+}
+
+/*
+ * The unflushed changes have been written to the space map by the syncing
+ * txg.  Keep them in the flushing trees until it has synced, for
+ * metaslab_load() which only reads the synced part of the space map.
+ */
+static void
+metaslab_unflushed_flushing(spa_t *spa, metaslab_t *msp)
+{
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	range_tree_remove_xor_add(msp->ms_unflushed_allocs,
+	    msp->ms_flushing_frees, msp->ms_flushing_allocs);
+	range_tree_remove_xor_add(msp->ms_unflushed_frees,
+	    msp->ms_flushing_allocs, msp->ms_flushing_frees);
+	metaslab_unflushed_clear(spa, msp);
+}
+
+/*
+ * Apply the changes of the metaslab which are not in the synced part of its
+ * space map to rt, as loaded from the space map with the given maptype.
+ */
+void
+metaslab_unflushed_apply(metaslab_t *msp, range_tree_t *rt, maptype_t maptype)
+{
+	range_tree_t *allocs[2] =
+	    { msp->ms_flushing_allocs, msp->ms_unflushed_allocs };
+	range_tree_t *frees[2] =
+	    { msp->ms_flushing_frees, msp->ms_unflushed_frees };
+	int i;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	/*
+	 * The flushing changes are older than the unflushed ones.
+	 */
+	for (i = 0; i < 2; i++) {
+		if (maptype == SM_ALLOC) {
+			range_tree_walk(allocs[i], range_tree_add, rt);
+			range_tree_walk(frees[i], range_tree_remove, rt);
+		} else {
+			range_tree_walk(frees[i], range_tree_add, rt);
+			range_tree_walk(allocs[i], range_tree_remove, rt);
+		}
+	}
+}
+
+static void
+metaslab_tree_clear(void *arg, uint64_t start, uint64_t size)
+{
+	range_tree_clear(arg, start, size);
+}
+
 int
 metaslab_load(metaslab_t *msp)
 {
@@ -1302,6 +1395,22 @@ metaslab_load(metaslab_t *msp)
 	msp->ms_loading = B_FALSE;
 
 	if (msp->ms_loaded) {
+		/*
+		 * Apply the changes which are not in the space map yet.  The
+		 * frees of the syncing txg are among them once it has logged
+		 * them, and like the deferred frees they must not be
+		 * allocated before their txg is synced.
+		 */
+		metaslab_unflushed_apply(msp, msp->ms_tree, SM_FREE);
+		if (msp->ms_unflushed_txg != 0) {
+			for (t = 0; t < TXG_SIZE; t++) {
+				if (msp->ms_freetree[t] == NULL)
+					continue;
+				range_tree_walk(msp->ms_freetree[t],
+				    metaslab_tree_clear, msp->ms_tree);
+			}
+		}
+
 		for (t = 0; t < TXG_DEFER_SIZE; t++) {
 			range_tree_walk(msp->ms_defertree[t],
 			    range_tree_remove, msp->ms_tree);
@@ -1360,6 +1469,11 @@ metaslab_init(metaslab_group_t *mg, uint64_t id, uint64_t object, uint64_t txg,
 	 * data fault on any attempt to use this metaslab before it's ready.
 	 */
 	ms->ms_tree = range_tree_create(&metaslab_rt_ops, ms, &ms->ms_lock);
+	ms->ms_trim = range_tree_create(NULL, ms, &ms->ms_lock);
+	ms->ms_unflushed_allocs = range_tree_create(NULL, ms, &ms->ms_lock);
+	ms->ms_unflushed_frees = range_tree_create(NULL, ms, &ms->ms_lock);
+	ms->ms_flushing_allocs = range_tree_create(NULL, ms, &ms->ms_lock);
+	ms->ms_flushing_frees = range_tree_create(NULL, ms, &ms->ms_lock);
 	metaslab_group_add(mg, ms);
 
 	ms->ms_fragmentation = metaslab_fragmentation(ms);
@@ -1401,18 +1515,29 @@ metaslab_fini(metaslab_t *msp)
 	int t;
 
 	metaslab_group_t *mg = msp->ms_group;
+	spa_t *spa = mg->mg_vd->vdev_spa;
 
 	metaslab_group_remove(mg, msp);
 
 	mutex_enter(&msp->ms_lock);
 
 	VERIFY(msp->ms_group == NULL);
-	vdev_space_update(mg->mg_vd, -space_map_allocated(msp->ms_sm),
+	vdev_space_update(mg->mg_vd, -msp->ms_allocated_space,
 	    0, -msp->ms_size);
 	space_map_close(msp->ms_sm);
 
 	metaslab_unload(msp);
 	range_tree_destroy(msp->ms_tree);
+	range_tree_vacate(msp->ms_trim, NULL, NULL);
+	range_tree_destroy(msp->ms_trim);
+
+	metaslab_unflushed_clear(spa, msp);
+	range_tree_destroy(msp->ms_unflushed_allocs);
+	range_tree_destroy(msp->ms_unflushed_frees);
+	range_tree_vacate(msp->ms_flushing_allocs, NULL, NULL);
+	range_tree_destroy(msp->ms_flushing_allocs);
+	range_tree_vacate(msp->ms_flushing_frees, NULL, NULL);
+	range_tree_destroy(msp->ms_flushing_frees);
 
 	for (t = 0; t < TXG_SIZE; t++) {
 		range_tree_destroy(msp->ms_alloctree[t]);
@@ -1556,16 +1681,13 @@ metaslab_weight(metaslab_t *msp)
 	 * This vdev is in the process of being removed so there is nothing
 	 * for us to do here.
 	 */
-	if (vd->vdev_removing) {
-		ASSERT0(space_map_allocated(msp->ms_sm));
-		ASSERT0(vd->vdev_ms_shift);
+	if (vd->vdev_removing)
 		return (0);
-	}
 
 	/*
 	 * The baseline weight is the metaslab's free space.
 	 */
-	space = msp->ms_size - space_map_allocated(msp->ms_sm);
+	space = msp->ms_size - msp->ms_allocated_space;
 
 	msp->ms_fragmentation = metaslab_fragmentation(msp);
 	if (metaslab_fragmentation_factor_enabled &&
@@ -1893,6 +2015,78 @@ metaslab_condense(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
 	msp->ms_condensing = B_FALSE;
 }
 
+/*
+ * Whether the changes of the metaslab in this txg go to the pool's log
+ * space maps.  Space maps without room for smp_flushed_txg keep being
+ * written directly until they are condensed, as does a space map which
+ * has been condensed in this txg, since it already holds the changes of the
+ * first sync pass.
+ */
+static boolean_t
+metaslab_logs_changes(metaslab_t *msp, uint64_t txg)
+{
+	space_map_t *sm = msp->ms_sm;
+
+	if (!spa_uses_log_spacemap(msp->ms_group->mg_vd->vdev_spa))
+		return (B_FALSE);
+
+	return (sm == NULL ||
+	    (sm->sm_dbuf->db_size == sizeof (space_map_phys_t) &&
+	    space_map_flushed_txg(sm) != txg));
+}
+
+/*
+ * Append the allocs and frees of this txg to the log of the txg, or
+ * condense the space map if it is time to, which also flushes it.
+ */
+static void
+metaslab_sync_log(metaslab_t *msp, uint64_t txg, dmu_tx_t *tx)
+{
+	metaslab_group_t *mg = msp->ms_group;
+	vdev_t *vd = mg->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+	range_tree_t *alloctree = msp->ms_alloctree[txg & TXG_MASK];
+	range_tree_t *freetree = msp->ms_freetree[txg & TXG_MASK];
+	uint64_t segs;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	if (msp->ms_sm != NULL && msp->ms_loaded &&
+	    spa_sync_pass(spa) == 1 && metaslab_should_condense(msp)) {
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+		metaslab_group_histogram_remove(mg, msp);
+
+		metaslab_condense(msp, txg, tx);
+		space_map_histogram_clear(msp->ms_sm);
+		space_map_histogram_add(msp->ms_sm, msp->ms_tree, tx);
+
+		metaslab_group_histogram_add(mg, msp);
+		metaslab_group_histogram_verify(mg);
+		metaslab_class_histogram_verify(mg->mg_class);
+
+		msp->ms_allocated_this_txg -= metaslab_unflushed_delta(msp);
+		space_map_set_flushed_txg(msp->ms_sm, txg, tx);
+		metaslab_unflushed_flushing(spa, msp);
+		return;
+	}
+
+	spa_log_sm_write(spa, vd->vdev_id, alloctree, SM_ALLOC, tx);
+	spa_log_sm_write(spa, vd->vdev_id, freetree, SM_FREE, tx);
+
+	segs = metaslab_unflushed_segs(msp);
+	range_tree_remove_xor_add(alloctree, msp->ms_unflushed_frees,
+	    msp->ms_unflushed_allocs);
+	range_tree_remove_xor_add(freetree, msp->ms_unflushed_allocs,
+	    msp->ms_unflushed_frees);
+	atomic_add_64(&spa->spa_unflushed_segs,
+	    (int64_t)metaslab_unflushed_segs(msp) - (int64_t)segs);
+
+	msp->ms_allocated_this_txg += (int64_t)range_tree_space(alloctree) -
+	    (int64_t)range_tree_space(freetree);
+	spa_log_sm_ms_dirty(spa, msp, txg);
+}
+
 /*
  * Write a metaslab to disk in the context of the specified transaction group.
  */
@@ -1946,6 +2140,13 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 
 	tx = dmu_tx_create_assigned(spa_get_dsl(spa), txg);
 
+	if (metaslab_logs_changes(msp, txg)) {
+		spa_log_sm_open_syncing(spa, tx);
+		mutex_enter(&msp->ms_lock);
+		metaslab_sync_log(msp, txg, tx);
+		goto swap;
+	}
+
 	if (msp->ms_sm == NULL) {
 		uint64_t new_object;
 
@@ -2000,6 +2201,8 @@ metaslab_sync(metaslab_t *msp, uint64_t txg)
 	metaslab_group_histogram_verify(mg);
 	metaslab_class_histogram_verify(mg->mg_class);
 
+swap:
+
 	/*
 	 * For sync pass 1, we avoid traversing this txg's free range tree
 	 * and instead will just swap the pointers for freetree and
@@ -2073,7 +2276,10 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	freed_tree = &msp->ms_freetree[TXG_CLEAN(txg) & TXG_MASK];
 	defer_tree = &msp->ms_defertree[txg % TXG_DEFER_SIZE];
 
-	alloc_delta = space_map_alloc_delta(msp->ms_sm);
+	alloc_delta = space_map_alloc_delta(msp->ms_sm) +
+	    msp->ms_allocated_this_txg;
+	msp->ms_allocated_this_txg = 0;
+	msp->ms_allocated_space += alloc_delta;
 	defer_delta = range_tree_space(*freed_tree) -
 	    range_tree_space(*defer_tree);
 
@@ -2088,6 +2294,17 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	 */
 	metaslab_load_wait(msp);
 
+	/*
+	 * If autotrim is enabled, the frees which are about to become
+	 * allocatable again are queued to be trimmed by the autotrim
+	 * thread of this vdev.  Otherwise any pending ranges are dropped.
+	 */
+	if (vd->vdev_spa->spa_autotrim) {
+		range_tree_walk(*defer_tree, range_tree_add, msp->ms_trim);
+	} else {
+		range_tree_vacate(msp->ms_trim, NULL, NULL);
+	}
+
 	/*
 	 * Move the frees from the defer_tree back to the free
 	 * range tree (if it's loaded). Swap the freed_tree and the
@@ -2099,6 +2316,8 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	range_tree_swap(freed_tree, defer_tree);
 
 	space_map_update(msp->ms_sm);
+	range_tree_vacate(msp->ms_flushing_allocs, NULL, NULL);
+	range_tree_vacate(msp->ms_flushing_frees, NULL, NULL);
 
 	msp->ms_deferspace += defer_delta;
 	ASSERT3S(msp->ms_deferspace, >=, 0);
@@ -2125,6 +2344,132 @@ metaslab_sync_done(metaslab_t *msp, uint64_t txg)
 	mutex_exit(&msp->ms_lock);
 }
 
+/*
+ * Write the changes of the metaslab which are only in the log space maps to
+ * its space map, so that the logs holding them can eventually be destroyed.
+ * Called in the first sync pass, before the metaslabs are synced.  Returns
+ * B_FALSE if the metaslab cannot be flushed.
+ */
+boolean_t
+metaslab_flush(metaslab_t *msp, dmu_tx_t *tx)
+{
+	metaslab_group_t *mg = msp->ms_group;
+	vdev_t *vd = mg->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	uint64_t object = space_map_object(msp->ms_sm);
+
+	ASSERT(!vd->vdev_ishole);
+	ASSERT3U(spa_sync_pass(spa), ==, 1);
+
+	/*
+	 * The metaslab array of a vdev being removed may already be gone.
+	 */
+	if (vd->vdev_ms_array == 0)
+		return (B_FALSE);
+
+	if (msp->ms_sm == NULL) {
+		uint64_t new_object;
+
+		new_object = space_map_alloc(mos, tx);
+		VERIFY3U(new_object, !=, 0);
+
+		VERIFY0(space_map_open(&msp->ms_sm, mos, new_object,
+		    msp->ms_start, msp->ms_size, vd->vdev_ashift,
+		    &msp->ms_lock));
+		ASSERT(msp->ms_sm != NULL);
+	}
+
+	mutex_enter(&msp->ms_lock);
+
+	metaslab_group_histogram_verify(mg);
+	metaslab_class_histogram_verify(mg->mg_class);
+	metaslab_group_histogram_remove(mg, msp);
+
+	space_map_write(msp->ms_sm, msp->ms_unflushed_allocs, SM_ALLOC, tx);
+	space_map_write(msp->ms_sm, msp->ms_unflushed_frees, SM_FREE, tx);
+
+	if (msp->ms_loaded) {
+		space_map_histogram_clear(msp->ms_sm);
+		space_map_histogram_add(msp->ms_sm, msp->ms_tree, tx);
+	} else {
+		space_map_histogram_add(msp->ms_sm, msp->ms_unflushed_frees,
+		    tx);
+	}
+	metaslab_group_histogram_add(mg, msp);
+	metaslab_group_histogram_verify(mg);
+	metaslab_class_histogram_verify(mg->mg_class);
+
+	/*
+	 * The changes are now accounted for by the space map, and those of
+	 * this txg will be logged as usual.
+	 */
+	msp->ms_allocated_this_txg -= metaslab_unflushed_delta(msp);
+	space_map_set_flushed_txg(msp->ms_sm, txg - 1, tx);
+	metaslab_unflushed_flushing(spa, msp);
+
+	mutex_exit(&msp->ms_lock);
+
+	if (object != space_map_object(msp->ms_sm)) {
+		object = space_map_object(msp->ms_sm);
+		dmu_write(mos, vd->vdev_ms_array, sizeof (uint64_t) *
+		    msp->ms_id, sizeof (uint64_t), &object, tx);
+	}
+
+	/*
+	 * Have metaslab_sync_done() pick up the new space map length.
+	 */
+	vdev_dirty(vd, VDD_METASLAB, msp, txg);
+
+	return (B_TRUE);
+}
+
+/*
+ * Add a change from the log of the given txg to the unflushed changes of
+ * the metaslab, while the pool is loaded.
+ */
+void
+metaslab_unflushed_replay(metaslab_t *msp, uint64_t txg, uint64_t start,
+    uint64_t size, maptype_t maptype)
+{
+	vdev_t *vd = msp->ms_group->mg_vd;
+	spa_t *spa = vd->vdev_spa;
+	uint64_t segs;
+
+	mutex_enter(&msp->ms_lock);
+
+	segs = metaslab_unflushed_segs(msp);
+	if (maptype == SM_ALLOC) {
+		range_tree_remove_xor_add_segment(start, start + size,
+		    msp->ms_unflushed_frees, msp->ms_unflushed_allocs);
+		msp->ms_allocated_space += size;
+		vdev_space_update(vd, size, 0, 0);
+	} else {
+		ASSERT3U(msp->ms_allocated_space, >=, size);
+		range_tree_remove_xor_add_segment(start, start + size,
+		    msp->ms_unflushed_allocs, msp->ms_unflushed_frees);
+		msp->ms_allocated_space -= size;
+		vdev_space_update(vd, -size, 0, 0);
+	}
+	atomic_add_64(&spa->spa_unflushed_segs,
+	    (int64_t)metaslab_unflushed_segs(msp) - (int64_t)segs);
+	spa_log_sm_ms_dirty(spa, msp, txg);
+
+	mutex_exit(&msp->ms_lock);
+}
+
+/*
+ * Weigh the metaslab again once all the logs have been replayed.
+ */
+void
+metaslab_unflushed_replay_done(metaslab_t *msp)
+{
+	mutex_enter(&msp->ms_lock);
+	metaslab_group_sort(msp->ms_group, msp, metaslab_weight(msp));
+	mutex_exit(&msp->ms_lock);
+}
+
 void
 metaslab_sync_reassess(metaslab_group_t *mg)
 {
@@ -2245,9 +2590,11 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t asize,
 			}
 
 			/*
-			 * If the selected metaslab is condensing, skip it.
+			 * If the selected metaslab is condensing, being
+			 * trimmed or being reflowed, skip it.
 			 */
-			if (msp->ms_condensing)
+			if (msp->ms_condensing || msp->ms_trimming ||
+			    msp->ms_reflowing)
 				continue;
 
 			was_active = msp->ms_weight & METASLAB_ACTIVE_MASK;
@@ -2255,7 +2602,7 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t asize,
 				break;
 
 			target_distance = min_distance +
-			    (space_map_allocated(msp->ms_sm) != 0 ? 0 :
+			    (msp->ms_allocated_space != 0 ? 0 :
 			    min_distance >> 1);
 
 			for (i = 0; i < d; i++)
@@ -2300,9 +2647,11 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t asize,
 		/*
 		 * If this metaslab is currently condensing then pick again as
 		 * we can't manipulate this metaslab until it's committed
-		 * to disk.
+		 * to disk.  Likewise, its free space can't be handed out while
+		 * it is being trimmed or reflowed.
 		 */
-		if (msp->ms_condensing) {
+		if (msp->ms_condensing || msp->ms_trimming ||
+		    msp->ms_reflowing) {
 			mutex_exit(&msp->ms_lock);
 			continue;
 		}
@@ -2327,7 +2676,7 @@ metaslab_group_alloc(metaslab_group_t *mg, uint64_t asize,
 /*
  * Allocate a block for the specified i/o.
  */
-static int
+int
 metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
     dva_t *dva, int d, dva_t *hintdva, uint64_t txg, int flags)
 {
@@ -2378,7 +2727,7 @@ metaslab_alloc_dva(spa_t *spa, metaslab_class_t *mc, uint64_t psize,
 		 * longer exists (i.e. removed). Consult the rotor when
 		 * all else fails.
 		 */
-		if (vd != NULL) {
+		if (vd != NULL && vd->vdev_mg != NULL) {
 			mg = vd->vdev_mg;
 
 			if (flags & METASLAB_HINTBP_AVOID &&
@@ -2465,7 +2814,7 @@ top:
 		else
 			all_zero = B_FALSE;
 
-		asize = vdev_psize_to_asize(vd, psize);
+		asize = vdev_psize_to_asize_txg(vd, psize, txg);
 		ASSERT(P2PHASE(asize, 1ULL << vd->vdev_ashift) == 0);
 
 		offset = metaslab_group_alloc(mg, asize, txg, distance, dva, d);
@@ -2583,34 +2932,20 @@ next:
 }
 
 /*
- * Free the block represented by DVA in the context of the specified
- * transaction group.
+ * Free the given range of a concrete vdev, i.e. one with metaslabs, in the
+ * context of the specified transaction group.
  */
 static void
-metaslab_free_dva(spa_t *spa, const dva_t *dva, uint64_t txg, boolean_t now)
+metaslab_free_concrete_impl(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg, boolean_t now)
 {
-	uint64_t vdev = DVA_GET_VDEV(dva);
-	uint64_t offset = DVA_GET_OFFSET(dva);
-	uint64_t size = DVA_GET_ASIZE(dva);
-	vdev_t *vd;
 	metaslab_t *msp;
 
-	if (txg > spa_freeze_txg(spa))
-		return;
-
-	if ((vd = vdev_lookup_top(spa, vdev)) == NULL || !DVA_IS_VALID(dva) ||
-	    (offset >> vd->vdev_ms_shift) >= vd->vdev_ms_count) {
-		zfs_panic_recover("metaslab_free_dva(): bad DVA %llu:%llu:%llu",
-		    (u_longlong_t)vdev, (u_longlong_t)offset,
-		    (u_longlong_t)size);
-		return;
-	}
+	ASSERT(vdev_is_concrete(vd));
+	VERIFY3U(offset >> vd->vdev_ms_shift, <, vd->vdev_ms_count);
 
 	msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
 
-	if (DVA_GET_GANG(dva))
-		size = vdev_psize_to_asize(vd, SPA_GANGBLOCKSIZE);
-
 	mutex_enter(&msp->ms_lock);
 
 	if (now) {
@@ -2635,6 +2970,86 @@ metaslab_free_dva(spa_t *spa, const dva_t *dva, uint64_t txg, boolean_t now)
 	mutex_exit(&msp->ms_lock);
 }
 
+void
+metaslab_free_concrete(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg)
+{
+	metaslab_free_concrete_impl(vd, offset, size, txg, B_FALSE);
+}
+
+static void metaslab_free_impl(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg, boolean_t now);
+
+/* ARGSUSED */
+static void
+metaslab_free_impl_cb(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size)
+{
+	uint64_t *txgp = arg;
+
+	metaslab_free_impl(vd, offset, size, *txgp, B_FALSE);
+}
+
+/*
+ * Free a range of a top-level vdev.  A range of an indirect vdev is freed
+ * wherever it was copied to, and the frees of a vdev being removed must
+ * be reflected in the copy (see free_from_removing_vdev()).
+ */
+static void
+metaslab_free_impl(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg, boolean_t now)
+{
+	spa_t *spa = vd->vdev_spa;
+
+	if (vd->vdev_ops == &vdev_indirect_ops) {
+		ASSERT(!now);
+		if (vdev_indirect_remap(vd, offset, size,
+		    metaslab_free_impl_cb, &txg) != 0) {
+			zfs_panic_recover("metaslab_free_impl(): unmapped "
+			    "range %llu:%llu:%llu", (u_longlong_t)vd->vdev_id,
+			    (u_longlong_t)offset, (u_longlong_t)size);
+			return;
+		}
+		vdev_indirect_mark_obsolete(vd, offset, size, txg);
+	} else if (vd->vdev_removing && spa->spa_vdev_removal != NULL &&
+	    spa->spa_vdev_removal->svr_vdev_id == vd->vdev_id && !now) {
+		free_from_removing_vdev(vd, offset, size, txg);
+	} else {
+		metaslab_free_concrete_impl(vd, offset, size, txg, now);
+	}
+}
+
+/*
+ * Free the block represented by DVA in the context of the specified
+ * transaction group.
+ */
+static void
+metaslab_free_dva(spa_t *spa, const dva_t *dva, uint64_t txg, boolean_t now)
+{
+	uint64_t vdev = DVA_GET_VDEV(dva);
+	uint64_t offset = DVA_GET_OFFSET(dva);
+	uint64_t size = DVA_GET_ASIZE(dva);
+	vdev_t *vd;
+
+	if (txg > spa_freeze_txg(spa))
+		return;
+
+	if ((vd = vdev_lookup_top(spa, vdev)) == NULL || !DVA_IS_VALID(dva) ||
+	    (vd->vdev_ops == &vdev_indirect_ops ?
+	    offset + size > vd->vdev_asize :
+	    (offset >> vd->vdev_ms_shift) >= vd->vdev_ms_count)) {
+		zfs_panic_recover("metaslab_free_dva(): bad DVA %llu:%llu:%llu",
+		    (u_longlong_t)vdev, (u_longlong_t)offset,
+		    (u_longlong_t)size);
+		return;
+	}
+
+	if (DVA_GET_GANG(dva))
+		size = vdev_psize_to_asize(vd, SPA_GANGBLOCKSIZE);
+
+	metaslab_free_impl(vd, offset, size, txg, now);
+}
+
 /*
  * Intent log support: upon opening the pool after a crash, notify the SPA
  * of blocks that the intent log has allocated for immediate write, but
@@ -2642,26 +3057,18 @@ metaslab_free_dva(spa_t *spa, const dva_t *dva, uint64_t txg, boolean_t now)
  * group didn't commit yet.
  */
 static int
-metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
+metaslab_claim_concrete(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg)
 {
-	uint64_t vdev = DVA_GET_VDEV(dva);
-	uint64_t offset = DVA_GET_OFFSET(dva);
-	uint64_t size = DVA_GET_ASIZE(dva);
-	vdev_t *vd;
+	spa_t *spa = vd->vdev_spa;
 	metaslab_t *msp;
 	int error = 0;
 
-	ASSERT(DVA_IS_VALID(dva));
-
-	if ((vd = vdev_lookup_top(spa, vdev)) == NULL ||
-	    (offset >> vd->vdev_ms_shift) >= vd->vdev_ms_count)
+	if ((offset >> vd->vdev_ms_shift) >= vd->vdev_ms_count)
 		return (SET_ERROR(ENXIO));
 
 	msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
 
-	if (DVA_GET_GANG(dva))
-		size = vdev_psize_to_asize(vd, SPA_GANGBLOCKSIZE);
-
 	mutex_enter(&msp->ms_lock);
 
 	if ((txg != 0 && spa_writeable(spa)) || !msp->ms_loaded)
@@ -2680,6 +3087,7 @@ metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
 	VERIFY0(P2PHASE(size, 1ULL << vd->vdev_ashift));
 	VERIFY3U(range_tree_space(msp->ms_tree) - size, <=, msp->ms_size);
 	range_tree_remove(msp->ms_tree, offset, size);
+	range_tree_clear(msp->ms_trim, offset, size);
 
 	if (spa_writeable(spa)) {	/* don't dirty if we're zdb(1M) */
 		if (range_tree_space(msp->ms_alloctree[txg & TXG_MASK]) == 0)
@@ -2692,6 +3100,66 @@ metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
 	return (0);
 }
 
+typedef struct metaslab_claim_cb_arg {
+	uint64_t	mcca_txg;
+	int		mcca_error;
+} metaslab_claim_cb_arg_t;
+
+static int metaslab_claim_impl(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg);
+
+/* ARGSUSED */
+static void
+metaslab_claim_impl_cb(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size)
+{
+	metaslab_claim_cb_arg_t *mcca = arg;
+
+	if (mcca->mcca_error == 0) {
+		mcca->mcca_error = metaslab_claim_impl(vd, offset, size,
+		    mcca->mcca_txg);
+	}
+}
+
+/*
+ * A range of an indirect vdev is claimed wherever it was copied to.
+ */
+static int
+metaslab_claim_impl(vdev_t *vd, uint64_t offset, uint64_t size, uint64_t txg)
+{
+	metaslab_claim_cb_arg_t mcca;
+	int error;
+
+	if (vd->vdev_ops != &vdev_indirect_ops)
+		return (metaslab_claim_concrete(vd, offset, size, txg));
+
+	mcca.mcca_txg = txg;
+	mcca.mcca_error = 0;
+	error = vdev_indirect_remap(vd, offset, size,
+	    metaslab_claim_impl_cb, &mcca);
+
+	return (error != 0 ? SET_ERROR(ENXIO) : mcca.mcca_error);
+}
+
+static int
+metaslab_claim_dva(spa_t *spa, const dva_t *dva, uint64_t txg)
+{
+	uint64_t vdev = DVA_GET_VDEV(dva);
+	uint64_t offset = DVA_GET_OFFSET(dva);
+	uint64_t size = DVA_GET_ASIZE(dva);
+	vdev_t *vd;
+
+	ASSERT(DVA_IS_VALID(dva));
+
+	if ((vd = vdev_lookup_top(spa, vdev)) == NULL)
+		return (SET_ERROR(ENXIO));
+
+	if (DVA_GET_GANG(dva))
+		size = vdev_psize_to_asize(vd, SPA_GANGBLOCKSIZE);
+
+	return (metaslab_claim_impl(vd, offset, size, txg));
+}
+
 /*
  * Reserve some allocation slots. The reservation system must be called
  * before we call into the allocator. If there aren't any available slots
@@ -2910,7 +3378,12 @@ metaslab_check_free(spa_t *spa, const blkptr_t *bp)
 		vdev_t *vd = vdev_lookup_top(spa, vdev);
 		uint64_t offset = DVA_GET_OFFSET(&bp->blk_dva[i]);
 		uint64_t size = DVA_GET_ASIZE(&bp->blk_dva[i]);
-		metaslab_t *msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
+		metaslab_t *msp;
+
+		if (vd->vdev_ops == &vdev_indirect_ops)
+			continue;
+
+		msp = vd->vdev_ms[offset >> vd->vdev_ms_shift];
 
 		if (msp->ms_loaded)
 			range_tree_verify(msp->ms_tree, offset, size);
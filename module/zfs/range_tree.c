@@ -121,7 +121,8 @@ range_tree_seg_compare(const void *x1, const void *x2)
 }
 
 range_tree_t *
-range_tree_create(range_tree_ops_t *ops, void *arg, kmutex_t *lp)
+range_tree_create_impl(range_tree_ops_t *ops, void *arg, kmutex_t *lp,
+    uint64_t gap)
 {
 	range_tree_t *rt;
 
@@ -133,6 +134,7 @@ range_tree_create(range_tree_ops_t *ops, void *arg, kmutex_t *lp)
 	rt->rt_lock = lp;
 	rt->rt_ops = ops;
 	rt->rt_arg = arg;
+	rt->rt_gap = gap;
 
 	if (rt->rt_ops != NULL)
 		rt->rt_ops->rtop_create(rt, rt->rt_arg);
@@ -140,6 +142,12 @@ range_tree_create(range_tree_ops_t *ops, void *arg, kmutex_t *lp)
 	return (rt);
 }
 
+range_tree_t *
+range_tree_create(range_tree_ops_t *ops, void *arg, kmutex_t *lp)
+{
+	return (range_tree_create_impl(ops, arg, lp, 0));
+}
+
 void
 range_tree_destroy(range_tree_t *rt)
 {
@@ -153,12 +161,31 @@ range_tree_destroy(range_tree_t *rt)
 }
 
 void
-range_tree_add(void *arg, uint64_t start, uint64_t size)
+range_tree_adjust_fill(range_tree_t *rt, range_seg_t *rs, int64_t delta)
+{
+	ASSERT(MUTEX_HELD(rt->rt_lock));
+	ASSERT3U(rs->rs_fill + delta, !=, 0);
+	ASSERT3U(rs->rs_fill + delta, <=, rs->rs_end - rs->rs_start);
+
+	/*
+	 * The ops callbacks may sort on fill, so the segment must be
+	 * removed and re-added around the update.
+	 */
+	if (rt->rt_ops != NULL)
+		rt->rt_ops->rtop_remove(rt, rs, rt->rt_arg);
+	rs->rs_fill += delta;
+	if (rt->rt_ops != NULL)
+		rt->rt_ops->rtop_add(rt, rs, rt->rt_arg);
+}
+
+static void
+range_tree_add_impl(range_tree_t *rt, uint64_t start, uint64_t size,
+    uint64_t fill)
 {
-	range_tree_t *rt = arg;
 	avl_index_t where;
 	range_seg_t rsearch, *rs_before, *rs_after, *rs;
-	uint64_t end = start + size;
+	uint64_t end = start + size, gap = rt->rt_gap;
+	uint64_t bridge_size = 0;
 	boolean_t merge_before, merge_after;
 
 	ASSERT(MUTEX_HELD(rt->rt_lock));
@@ -168,21 +195,61 @@ range_tree_add(void *arg, uint64_t start, uint64_t size)
 	rsearch.rs_end = end;
 	rs = avl_find(&rt->rt_root, &rsearch, &where);
 
-	if (rs != NULL && rs->rs_start <= start && rs->rs_end >= end) {
+	if (gap == 0 && rs != NULL &&
+	    rs->rs_start <= start && rs->rs_end >= end) {
 		zfs_panic_recover("zfs: allocating allocated segment"
 		    "(offset=%llu size=%llu)\n",
 		    (longlong_t)start, (longlong_t)size);
 		return;
 	}
 
+	/*
+	 * If this is a gap-supporting range tree we may be inserting into
+	 * an existing segment.  If the new range is entirely contained we
+	 * only need to bump the fill count.  Otherwise the existing segment
+	 * is pulled out, widened to cover the new range, and re-inserted
+	 * through the normal path so that it can merge with its neighbors.
+	 */
+	if (gap != 0 && rs != NULL) {
+		if (rs->rs_start <= start && rs->rs_end >= end) {
+			range_tree_adjust_fill(rt, rs, fill);
+			return;
+		}
+
+		avl_remove(&rt->rt_root, rs);
+		if (rt->rt_ops != NULL)
+			rt->rt_ops->rtop_remove(rt, rs, rt->rt_arg);
+
+		range_tree_stat_decr(rt, rs);
+		rt->rt_space -= rs->rs_end - rs->rs_start;
+
+		fill += rs->rs_fill;
+		start = MIN(start, rs->rs_start);
+		end = MAX(end, rs->rs_end);
+		kmem_cache_free(range_seg_cache, rs);
+
+		range_tree_add_impl(rt, start, end - start, fill);
+		return;
+	}
+
 	/* Make sure we don't overlap with either of our neighbors */
 	VERIFY(rs == NULL);
 
+	/*
+	 * Determine whether we have to merge with our neighbors.  With a
+	 * non-zero gap we merge with neighbors that are close even if they
+	 * aren't directly touching, and account for the bridged space.
+	 */
 	rs_before = avl_nearest(&rt->rt_root, where, AVL_BEFORE);
 	rs_after = avl_nearest(&rt->rt_root, where, AVL_AFTER);
 
-	merge_before = (rs_before != NULL && rs_before->rs_end == start);
-	merge_after = (rs_after != NULL && rs_after->rs_start == end);
+	merge_before = (rs_before != NULL && rs_before->rs_end + gap >= start);
+	merge_after = (rs_after != NULL && rs_after->rs_start <= end + gap);
+
+	if (merge_before)
+		bridge_size += start - rs_before->rs_end;
+	if (merge_after)
+		bridge_size += rs_after->rs_start - end;
 
 	if (merge_before && merge_after) {
 		avl_remove(&rt->rt_root, rs_before);
@@ -194,6 +261,7 @@ range_tree_add(void *arg, uint64_t start, uint64_t size)
 		range_tree_stat_decr(rt, rs_before);
 		range_tree_stat_decr(rt, rs_after);
 
+		rs_after->rs_fill += rs_before->rs_fill + fill;
 		rs_after->rs_start = rs_before->rs_start;
 		kmem_cache_free(range_seg_cache, rs_before);
 		rs = rs_after;
@@ -203,6 +271,7 @@ range_tree_add(void *arg, uint64_t start, uint64_t size)
 
 		range_tree_stat_decr(rt, rs_before);
 
+		rs_before->rs_fill += fill;
 		rs_before->rs_end = end;
 		rs = rs_before;
 	} else if (merge_after) {
@@ -211,26 +280,41 @@ range_tree_add(void *arg, uint64_t start, uint64_t size)
 
 		range_tree_stat_decr(rt, rs_after);
 
+		rs_after->rs_fill += fill;
 		rs_after->rs_start = start;
 		rs = rs_after;
 	} else {
 		rs = kmem_cache_alloc(range_seg_cache, KM_SLEEP);
+		rs->rs_fill = fill;
 		rs->rs_start = start;
 		rs->rs_end = end;
 		avl_insert(&rt->rt_root, rs, where);
 	}
 
+	if (gap != 0)
+		ASSERT3U(rs->rs_fill, <=, rs->rs_end - rs->rs_start);
+	else
+		ASSERT3U(rs->rs_fill, ==, rs->rs_end - rs->rs_start);
+
 	if (rt->rt_ops != NULL)
 		rt->rt_ops->rtop_add(rt, rs, rt->rt_arg);
 
 	range_tree_stat_incr(rt, rs);
-	rt->rt_space += size;
+	rt->rt_space += end - start + bridge_size;
 }
 
 void
-range_tree_remove(void *arg, uint64_t start, uint64_t size)
+range_tree_add(void *arg, uint64_t start, uint64_t size)
 {
 	range_tree_t *rt = arg;
+
+	range_tree_add_impl(rt, start, size, size);
+}
+
+static void
+range_tree_remove_impl(range_tree_t *rt, uint64_t start, uint64_t size,
+    boolean_t do_fill)
+{
 	avl_index_t where;
 	range_seg_t rsearch, *rs, *newseg;
 	uint64_t end = start + size;
@@ -251,6 +335,34 @@ range_tree_remove(void *arg, uint64_t start, uint64_t size)
 		    (longlong_t)start, (longlong_t)size);
 		return;
 	}
+
+	/*
+	 * Range trees with gap support may only remove complete segments,
+	 * otherwise the fill accounting and the bridged space would be
+	 * lost.  When removing less than a full segment only the fill
+	 * count is adjusted.
+	 */
+	if (rt->rt_gap != 0) {
+		if (do_fill) {
+			if (rs->rs_fill == size) {
+				start = rs->rs_start;
+				end = rs->rs_end;
+				size = end - start;
+			} else {
+				range_tree_adjust_fill(rt, rs, -size);
+				return;
+			}
+		} else if (rs->rs_start != start || rs->rs_end != end) {
+			zfs_panic_recover("zfs: freeing partial segment of "
+			    "gap tree (offset=%llu size=%llu) of "
+			    "(offset=%llu size=%llu)",
+			    (longlong_t)start, (longlong_t)size,
+			    (longlong_t)rs->rs_start,
+			    (longlong_t)(rs->rs_end - rs->rs_start));
+			return;
+		}
+	}
+
 	VERIFY3U(rs->rs_start, <=, start);
 	VERIFY3U(rs->rs_end, >=, end);
 
@@ -266,6 +378,7 @@ range_tree_remove(void *arg, uint64_t start, uint64_t size)
 		newseg = kmem_cache_alloc(range_seg_cache, KM_SLEEP);
 		newseg->rs_start = end;
 		newseg->rs_end = rs->rs_end;
+		newseg->rs_fill = newseg->rs_end - newseg->rs_start;
 		range_tree_stat_incr(rt, newseg);
 
 		rs->rs_end = start;
@@ -284,6 +397,11 @@ range_tree_remove(void *arg, uint64_t start, uint64_t size)
 	}
 
 	if (rs != NULL) {
+		/*
+		 * The fill of a segment in a gap tree is only adjusted
+		 * above, segments here are always completely filled.
+		 */
+		rs->rs_fill = rs->rs_end - rs->rs_start;
 		range_tree_stat_incr(rt, rs);
 
 		if (rt->rt_ops != NULL)
@@ -293,6 +411,50 @@ range_tree_remove(void *arg, uint64_t start, uint64_t size)
 	rt->rt_space -= size;
 }
 
+void
+range_tree_remove(void *arg, uint64_t start, uint64_t size)
+{
+	range_tree_t *rt = arg;
+
+	range_tree_remove_impl(rt, start, size, B_FALSE);
+}
+
+/*
+ * Remove size bytes of fill from the segment containing [start, start+size).
+ * The segment itself is only removed once it no longer contains any fill.
+ */
+void
+range_tree_remove_fill(range_tree_t *rt, uint64_t start, uint64_t size)
+{
+	range_tree_remove_impl(rt, start, size, B_TRUE);
+}
+
+/*
+ * Shrink (or grow) a segment in place.  The caller is responsible for
+ * making sure the new extent does not overlap any neighboring segments.
+ */
+void
+range_tree_resize_segment(range_tree_t *rt, range_seg_t *rs,
+    uint64_t newstart, uint64_t newsize)
+{
+	int64_t delta = newsize - (rs->rs_end - rs->rs_start);
+
+	ASSERT(MUTEX_HELD(rt->rt_lock));
+
+	range_tree_stat_decr(rt, rs);
+	if (rt->rt_ops != NULL)
+		rt->rt_ops->rtop_remove(rt, rs, rt->rt_arg);
+
+	rs->rs_start = newstart;
+	rs->rs_end = newstart + newsize;
+
+	range_tree_stat_incr(rt, rs);
+	if (rt->rt_ops != NULL)
+		rt->rt_ops->rtop_add(rt, rs, rt->rt_arg);
+
+	rt->rt_space += delta;
+}
+
 static range_seg_t *
 range_tree_find_impl(range_tree_t *rt, uint64_t start, uint64_t size)
 {
@@ -308,7 +470,7 @@ range_tree_find_impl(range_tree_t *rt, uint64_t start, uint64_t size)
 	return (avl_find(&rt->rt_root, &rsearch, &where));
 }
 
-static range_seg_t *
+range_seg_t *
 range_tree_find(range_tree_t *rt, uint64_t start, uint64_t size)
 {
 	range_seg_t *rs = range_tree_find_impl(rt, start, size);
@@ -351,6 +513,64 @@ range_tree_clear(range_tree_t *rt, uint64_t start, uint64_t size)
 	}
 }
 
+/*
+ * Remove the parts of [start, end) that are in removefrom from it, and add
+ * the remaining parts to addto.  This is how a range which is freed after
+ * being allocated (or the opposite) cancels out in a tree of changes.
+ */
+void
+range_tree_remove_xor_add_segment(uint64_t start, uint64_t end,
+    range_tree_t *removefrom, range_tree_t *addto)
+{
+	avl_index_t where;
+	range_seg_t rsearch;
+	range_seg_t *rs, *next;
+
+	ASSERT(MUTEX_HELD(removefrom->rt_lock));
+	ASSERT(MUTEX_HELD(addto->rt_lock));
+	ASSERT3U(start, <, end);
+
+	/*
+	 * Find the first segment of removefrom that ends after start.
+	 */
+	rsearch.rs_start = start;
+	rsearch.rs_end = start + 1;
+	rs = avl_find(&removefrom->rt_root, &rsearch, &where);
+	if (rs == NULL)
+		rs = avl_nearest(&removefrom->rt_root, where, AVL_AFTER);
+
+	for (; rs != NULL && rs->rs_start < end; rs = next) {
+		uint64_t overlap_end = MIN(rs->rs_end, end);
+
+		next = AVL_NEXT(&removefrom->rt_root, rs);
+		if (start < rs->rs_start) {
+			range_tree_add(addto, start, rs->rs_start - start);
+			start = rs->rs_start;
+		}
+		range_tree_remove(removefrom, start, overlap_end - start);
+		start = overlap_end;
+	}
+
+	if (start < end)
+		range_tree_add(addto, start, end - start);
+}
+
+/*
+ * range_tree_remove_xor_add_segment() for every segment of rt.
+ */
+void
+range_tree_remove_xor_add(range_tree_t *rt, range_tree_t *removefrom,
+    range_tree_t *addto)
+{
+	range_seg_t *rs;
+
+	ASSERT(MUTEX_HELD(rt->rt_lock));
+
+	for (rs = avl_first(&rt->rt_root); rs; rs = AVL_NEXT(&rt->rt_root, rs))
+		range_tree_remove_xor_add_segment(rs->rs_start, rs->rs_end,
+		    removefrom, addto);
+}
+
 void
 range_tree_swap(range_tree_t **rtsrc, range_tree_t **rtdst)
 {
@@ -397,6 +617,13 @@ range_tree_walk(range_tree_t *rt, range_tree_func_t *func, void *arg)
 		func(arg, rs->rs_start, rs->rs_end - rs->rs_start);
 }
 
+range_seg_t *
+range_tree_first(range_tree_t *rt)
+{
+	ASSERT(MUTEX_HELD(rt->rt_lock));
+	return (avl_first(&rt->rt_root));
+}
+
 uint64_t
 range_tree_space(range_tree_t *rt)
 {
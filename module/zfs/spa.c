@@ -49,6 +49,9 @@
 #include <sys/ddt.h>
 #include <sys/vdev_impl.h>
 #include <sys/vdev_disk.h>
+#include <sys/vdev_trim.h>
+#include <sys/vdev_removal.h>
+#include <sys/vdev_raidz_expand.h>
 #include <sys/metaslab.h>
 #include <sys/metaslab_impl.h>
 #include <sys/uberblock_impl.h>
@@ -141,6 +144,7 @@ const zio_taskq_info_t zio_taskqs[ZIO_TYPES][ZIO_TASKQ_TYPES] = {
 	{ ZTI_P(12, 8),	ZTI_NULL,	ZTI_ONE,	ZTI_NULL }, /* FREE */
 	{ ZTI_ONE,	ZTI_NULL,	ZTI_ONE,	ZTI_NULL }, /* CLAIM */
 	{ ZTI_ONE,	ZTI_NULL,	ZTI_ONE,	ZTI_NULL }, /* IOCTL */
+	{ ZTI_N(4),	ZTI_NULL,	ZTI_ONE,	ZTI_NULL }, /* TRIM */
 };
 
 static void spa_sync_version(void *arg, dmu_tx_t *tx);
@@ -208,8 +212,10 @@ spa_prop_get_config(spa_t *spa, nvlist_t **nvp)
 	ASSERT(MUTEX_HELD(&spa->spa_props_lock));
 
 	if (rvd != NULL) {
-		alloc = metaslab_class_get_alloc(spa_normal_class(spa));
-		size = metaslab_class_get_space(spa_normal_class(spa));
+		alloc = metaslab_class_get_alloc(spa_normal_class(spa)) +
+		    metaslab_class_get_alloc(spa_special_class(spa));
+		size = metaslab_class_get_space(spa_normal_class(spa)) +
+		    metaslab_class_get_space(spa_special_class(spa));
 		spa_prop_add_list(*nvp, ZPOOL_PROP_NAME, spa_name(spa), 0, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_SIZE, NULL, size, src);
 		spa_prop_add_list(*nvp, ZPOOL_PROP_ALLOCATED, NULL, alloc, src);
@@ -422,6 +428,7 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 	int error = 0, reset_bootfs = 0;
 	uint64_t objnum = 0;
 	boolean_t has_feature = B_FALSE;
+	spa_feature_t fid;
 
 	elem = NULL;
 	while ((elem = nvlist_next_nvpair(props, elem)) != NULL) {
@@ -456,11 +463,17 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 			}
 
 			fname = strchr(propname, '@') + 1;
-			if (zfeature_lookup_name(fname, NULL) != 0) {
+			if (zfeature_lookup_name(fname, &fid) != 0) {
 				error = SET_ERROR(EINVAL);
 				break;
 			}
 
+			if (fid == SPA_FEATURE_ZSTD_COMPRESS &&
+			    !zstd_available()) {
+				error = SET_ERROR(ENOTSUP);
+				break;
+			}
+
 			has_feature = B_TRUE;
 			break;
 
@@ -477,6 +490,7 @@ spa_prop_validate(spa_t *spa, nvlist_t *props)
 		case ZPOOL_PROP_AUTOREPLACE:
 		case ZPOOL_PROP_LISTSNAPS:
 		case ZPOOL_PROP_AUTOEXPAND:
+		case ZPOOL_PROP_AUTOTRIM:
 			error = nvpair_value_uint64(elem, &intval);
 			if (!error && intval > 1)
 				error = SET_ERROR(EINVAL);
@@ -1097,6 +1111,7 @@ spa_activate(spa_t *spa, int mode)
 
 	spa->spa_normal_class = metaslab_class_create(spa, zfs_metaslab_ops);
 	spa->spa_log_class = metaslab_class_create(spa, zfs_metaslab_ops);
+	spa->spa_special_class = metaslab_class_create(spa, zfs_metaslab_ops);
 
 	/* Try to create a covering process */
 	mutex_enter(&spa->spa_proc_lock);
@@ -1224,6 +1239,9 @@ spa_deactivate(spa_t *spa)
 	metaslab_class_destroy(spa->spa_log_class);
 	spa->spa_log_class = NULL;
 
+	metaslab_class_destroy(spa->spa_special_class);
+	spa->spa_special_class = NULL;
+
 	/*
 	 * If this was part of an import or the open otherwise failed, we may
 	 * still have errors left in the queues.  Empty them just in case.
@@ -1325,6 +1343,12 @@ spa_unload(spa_t *spa)
 	 */
 	spa_async_suspend(spa);
 
+	/*
+	 * Stop any TRIM in progress, see vdev_trim.c.
+	 */
+	if (spa->spa_root_vdev != NULL)
+		vdev_trim_stop_all(spa->spa_root_vdev, VDEV_TRIM_CANCELED);
+
 	/*
 	 * Stop syncing.
 	 */
@@ -1342,6 +1366,25 @@ spa_unload(spa_t *spa)
 		kmem_free(spa->spa_async_zio_root, max_ncpus * sizeof (void *));
 		spa->spa_async_zio_root = NULL;
 	}
+	for (i = 0; i < TXG_SIZE; i++) {
+		if (spa->spa_txg_zio[i] != NULL) {
+			(void) zio_wait(spa->spa_txg_zio[i]);
+			spa->spa_txg_zio[i] = NULL;
+		}
+	}
+
+	/*
+	 * The removal in progress, if any, is resumed when the pool is
+	 * loaded again.
+	 */
+	if (spa->spa_vdev_removal != NULL) {
+		spa_vdev_removal_destroy(spa->spa_vdev_removal);
+		spa->spa_vdev_removal = NULL;
+	}
+	if (spa->spa_raidz_expand != NULL) {
+		vdev_raidz_expand_destroy(spa->spa_raidz_expand);
+		spa->spa_raidz_expand = NULL;
+	}
 
 	bpobj_close(&spa->spa_deferred_bpobj);
 
@@ -1353,6 +1396,7 @@ spa_unload(spa_t *spa)
 	if (spa->spa_root_vdev)
 		vdev_free(spa->spa_root_vdev);
 	ASSERT(spa->spa_root_vdev == NULL);
+	spa_log_sm_unload(spa);
 
 	/*
 	 * Close the dsl pool.
@@ -2253,8 +2297,10 @@ spa_load(spa_t *spa, spa_load_state_t state, spa_import_type_t type,
 		spa->spa_load_info = fnvlist_alloc();
 
 		gethrestime(&spa->spa_loaded_ts);
+		spa_load_phase_start(spa);
 		error = spa_load_impl(spa, pool_guid, config, state, type,
 		    mosconfig, &ereport);
+		spa_load_phase_done(spa, SPA_LOAD_PHASE_TOTAL);
 	}
 
 	/*
@@ -2359,6 +2405,10 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		    ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE |
 		    ZIO_FLAG_GODFATHER);
 	}
+	for (i = 0; i < TXG_SIZE; i++) {
+		spa->spa_txg_zio[i] = zio_root(spa, NULL, NULL,
+		    ZIO_FLAG_CANFAIL);
+	}
 
 	/*
 	 * Parse the configuration into a vdev tree.  We explicitly set the
@@ -2386,6 +2436,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 	spa_config_enter(spa, SCL_ALL, FTAG, RW_WRITER);
 	error = vdev_open(rvd);
 	spa_config_exit(spa, SCL_ALL, FTAG);
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_VDEV_OPEN);
 	if (error != 0)
 		return (error);
 
@@ -2511,6 +2562,8 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		spa->spa_config_splitting = NULL;
 	}
 
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_UBERBLOCK);
+
 	/*
 	 * Initialize internal SPA structures.
 	 */
@@ -2523,6 +2576,13 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 	spa->spa_claim_max_txg = spa->spa_first_txg;
 	spa->spa_prev_software_version = ub->ub_software_version;
 
+	/*
+	 * The location of the sectors of an expanding RAID-Z vdev depends
+	 * on how far its reflow got, which must be known before anything
+	 * is read from it.
+	 */
+	spa_raidz_expand_load(spa);
+
 	error = dsl_pool_init(spa, spa->spa_first_txg, &spa->spa_dsl_pool);
 	if (error)
 		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
@@ -2531,6 +2591,16 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 	if (spa_dir_prop(spa, DMU_POOL_CONFIG, &spa->spa_config_object) != 0)
 		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
 
+	/*
+	 * Load the mappings of removed vdevs before reading anything else,
+	 * which may have been copied off a removed vdev.
+	 */
+	if (spa_remove_init(spa) != 0)
+		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
+
+	if (spa_raidz_expand_init(spa) != 0)
+		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
+
 	if (spa_version(spa) >= SPA_VERSION_FEATURES) {
 		boolean_t missing_feat_read = B_FALSE;
 		nvlist_t *unsup_feat, *enabled_feat;
@@ -2833,6 +2903,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		spa_prop_find(spa, ZPOOL_PROP_DELEGATION, &spa->spa_delegation);
 		spa_prop_find(spa, ZPOOL_PROP_FAILUREMODE, &spa->spa_failmode);
 		spa_prop_find(spa, ZPOOL_PROP_AUTOEXPAND, &spa->spa_autoexpand);
+		spa_prop_find(spa, ZPOOL_PROP_AUTOTRIM, &spa->spa_autotrim);
 		spa_prop_find(spa, ZPOOL_PROP_DEDUPDITTO,
 		    &spa->spa_dedup_ditto);
 
@@ -2859,6 +2930,8 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		}
 	}
 
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_MOS);
+
 	/*
 	 * Load the vdev state for all toplevel vdevs.
 	 */
@@ -2871,10 +2944,19 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 	vdev_dtl_reassess(rvd, 0, 0, B_FALSE);
 	spa_config_exit(spa, SCL_ALL, FTAG);
 
+	/*
+	 * Replay the log space maps into the metaslabs just loaded.
+	 */
+	error = spa_log_sm_load(spa);
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_VDEV_LOAD);
+	if (error != 0)
+		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
+
 	/*
 	 * Load the DDTs (dedup tables).
 	 */
 	error = ddt_load(spa);
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_DDT);
 	if (error != 0)
 		return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA, EIO));
 
@@ -2913,6 +2995,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 			return (spa_vdev_err(rvd, VDEV_AUX_BAD_LOG, ENXIO));
 		}
 	}
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_LOG_CHECK);
 
 	if (missing_feat_write) {
 		ASSERT(state == SPA_LOAD_TRYIMPORT);
@@ -2934,6 +3017,7 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 			return (spa_vdev_err(rvd, VDEV_AUX_CORRUPT_DATA,
 			    error));
 	}
+	spa_load_phase_done(spa, SPA_LOAD_PHASE_VERIFY);
 
 	if (spa_writeable(spa) && (state == SPA_LOAD_RECOVER ||
 	    spa->spa_load_max_txg == UINT64_MAX)) {
@@ -3020,6 +3104,20 @@ spa_load_impl(spa_t *spa, uint64_t pool_guid, nvlist_t *config,
 		 * Clean up any stale temporary dataset userrefs.
 		 */
 		dsl_pool_clean_tmp_userrefs(spa->spa_dsl_pool);
+
+		/*
+		 * Start trimming freed space if the autotrim property is on.
+		 */
+		if (spa->spa_autotrim)
+			spa_async_request(spa, SPA_ASYNC_AUTOTRIM_RESTART);
+
+		/*
+		 * Resume the removal of a top-level vdev, or the expansion
+		 * of a RAID-Z vdev, if one was in progress.
+		 */
+		spa_restart_removal(spa);
+		spa_restart_raidz_expand(spa);
+		spa_load_phase_done(spa, SPA_LOAD_PHASE_LOG_CLAIM);
 	}
 
 	return (0);
@@ -3495,6 +3593,40 @@ spa_add_feature_stats(spa_t *spa, nvlist_t *config)
 	mutex_exit(&spa->spa_feat_stats_lock);
 }
 
+/*
+ * Store the space statistics of each allocation class in the config, so
+ * that 'zpool list' and 'zpool iostat' can report them per class.
+ */
+static void
+spa_add_class_stats(spa_t *spa, nvlist_t *config)
+{
+	const char *names[] = { VDEV_ALLOC_CLASS_NORMAL,
+	    VDEV_ALLOC_BIAS_SPECIAL, VDEV_ALLOC_CLASS_LOGS };
+	metaslab_class_t *classes[] = { spa_normal_class(spa),
+	    spa_special_class(spa), spa_log_class(spa) };
+	nvlist_t *nvl;
+	int c;
+
+	VERIFY0(nvlist_alloc(&nvl, NV_UNIQUE_NAME, KM_SLEEP));
+	for (c = 0; c < ARRAY_SIZE(classes); c++) {
+		metaslab_class_t *mc = classes[c];
+		pool_class_stat_t pcs;
+
+		if (mc->mc_groups == 0)
+			continue;
+
+		pcs.pcs_space = metaslab_class_get_space(mc);
+		pcs.pcs_alloc = metaslab_class_get_alloc(mc);
+		pcs.pcs_dspace = metaslab_class_get_dspace(mc);
+		pcs.pcs_fragmentation = metaslab_class_fragmentation(mc);
+		pcs.pcs_esize = metaslab_class_expandable_space(mc);
+		VERIFY0(nvlist_add_uint64_array(nvl, names[c],
+		    (uint64_t *)&pcs, sizeof (pcs) / sizeof (uint64_t)));
+	}
+	VERIFY0(nvlist_add_nvlist(config, ZPOOL_CONFIG_CLASS_STATS, nvl));
+	nvlist_free(nvl);
+}
+
 int
 spa_get_stats(const char *name, nvlist_t **config,
     char *altroot, size_t buflen)
@@ -3533,6 +3665,7 @@ spa_get_stats(const char *name, nvlist_t **config,
 			spa_add_spares(spa, *config);
 			spa_add_l2cache(spa, *config);
 			spa_add_feature_stats(spa, *config);
+			spa_add_class_stats(spa, *config);
 		}
 	}
 
@@ -3755,6 +3888,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	uint64_t version, obj;
 	boolean_t has_features;
 	boolean_t has_encryption;
+	boolean_t has_allocation_classes;
 	spa_feature_t feat;
 	char *feat_name;
 	nvpair_t *elem;
@@ -3785,6 +3919,19 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	fnvlist_free(nvl);
 	spa_activate(spa, spa_mode_global);
 
+	/*
+	 * "zpool create" asks for every feature it knows about.  Leave
+	 * zstd_compress disabled, rather than failing the create, when
+	 * this build can't use zstd; spa_prop_validate() refuses it.
+	 */
+	if (props != NULL && !zstd_available()) {
+		char propname[MAXPATHLEN];
+
+		(void) snprintf(propname, sizeof (propname), "feature@%s",
+		    spa_feature_table[SPA_FEATURE_ZSTD_COMPRESS].fi_uname);
+		(void) nvlist_remove_all(props, propname);
+	}
+
 	if (props && (error = spa_prop_validate(spa, props))) {
 		spa_deactivate(spa);
 		spa_remove(spa);
@@ -3800,6 +3947,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 
 	has_features = B_FALSE;
 	has_encryption = B_FALSE;
+	has_allocation_classes = B_FALSE;
 	for (elem = nvlist_next_nvpair(props, NULL);
 	    elem != NULL; elem = nvlist_next_nvpair(props, elem)) {
 		if (zpool_prop_feature(nvpair_name(elem))) {
@@ -3809,6 +3957,8 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 			VERIFY0(zfeature_lookup_name(feat_name, &feat));
 			if (feat == SPA_FEATURE_ENCRYPTION)
 				has_encryption = B_TRUE;
+			if (feat == SPA_FEATURE_ALLOCATION_CLASSES)
+				has_allocation_classes = B_TRUE;
 		}
 	}
 
@@ -3842,6 +3992,10 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 		    ZIO_FLAG_CANFAIL | ZIO_FLAG_SPECULATIVE |
 		    ZIO_FLAG_GODFATHER);
 	}
+	for (i = 0; i < TXG_SIZE; i++) {
+		spa->spa_txg_zio[i] = zio_root(spa, NULL, NULL,
+		    ZIO_FLAG_CANFAIL);
+	}
 
 	/*
 	 * Create the root vdev.
@@ -3856,6 +4010,16 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	if (error == 0 && !zfs_allocatable_devs(nvroot))
 		error = SET_ERROR(EINVAL);
 
+	/*
+	 * Allocation class vdevs are only allowed when the pool is created
+	 * with the feature enabled.
+	 */
+	for (c = 0; error == 0 && c < rvd->vdev_children; c++) {
+		if (rvd->vdev_child[c]->vdev_alloc_bias != VDEV_BIAS_NONE &&
+		    !has_allocation_classes)
+			error = SET_ERROR(ENOTSUP);
+	}
+
 	if (error == 0 &&
 	    (error = vdev_create(rvd, txg, B_FALSE)) == 0 &&
 	    (error = spa_validate_aux(spa, nvroot, txg,
@@ -3983,6 +4147,7 @@ spa_create(const char *pool, nvlist_t *nvroot, nvlist_t *props,
 	spa->spa_delegation = zpool_prop_default_numeric(ZPOOL_PROP_DELEGATION);
 	spa->spa_failmode = zpool_prop_default_numeric(ZPOOL_PROP_FAILUREMODE);
 	spa->spa_autoexpand = zpool_prop_default_numeric(ZPOOL_PROP_AUTOEXPAND);
+	spa->spa_autotrim = zpool_prop_default_numeric(ZPOOL_PROP_AUTOTRIM);
 
 	if (props != NULL) {
 		spa_configfile_set(spa, props, B_FALSE);
@@ -4496,6 +4661,20 @@ spa_vdev_add(spa_t *spa, nvlist_t *nvroot)
 	    (error = vdev_create(vd, txg, B_FALSE)) != 0)
 		return (spa_vdev_exit(spa, vd, txg, error));
 
+	/*
+	 * A removal in progress may copy to any new top-level vdev, so only
+	 * allow those it can copy to.
+	 */
+	if (spa->spa_vdev_removal != NULL) {
+		vdev_t *rmvd = vdev_lookup_top(spa,
+		    spa->spa_vdev_removal->svr_vdev_id);
+
+		for (c = 0; c < vd->vdev_children; c++) {
+			if (!spa_vdev_remove_copyable(rmvd, vd->vdev_child[c]))
+				return (spa_vdev_exit(spa, vd, txg, EINVAL));
+		}
+	}
+
 	/*
 	 * We must validate the spares and l2cache devices after checking the
 	 * children.  Otherwise, vdev_inuse() will blindly overwrite the spare.
@@ -4558,6 +4737,9 @@ spa_vdev_add(spa_t *spa, nvlist_t *nvroot)
 	spa_event_notify(spa, NULL, ESC_ZFS_VDEV_ADD);
 	mutex_exit(&spa_namespace_lock);
 
+	if (spa->spa_autotrim)
+		spa_async_request(spa, SPA_ASYNC_AUTOTRIM_RESTART);
+
 	return (0);
 }
 
@@ -4589,14 +4771,33 @@ spa_vdev_attach(spa_t *spa, uint64_t guid, nvlist_t *nvroot, int replacing)
 
 	txg = spa_vdev_enter(spa);
 
+	/*
+	 * The removal thread copies the data of the removing vdev as it was
+	 * when it started, and doesn't know about new children.
+	 */
+	if (spa->spa_vdev_removal != NULL)
+		return (spa_vdev_exit(spa, NULL, txg, EBUSY));
+
 	oldvd = spa_lookup_by_guid(spa, guid, B_FALSE);
 
 	if (oldvd == NULL)
 		return (spa_vdev_exit(spa, NULL, txg, ENODEV));
 
-	if (!oldvd->vdev_ops->vdev_op_leaf)
+	/*
+	 * A new child can be attached to a RAID-Z vdev itself, which
+	 * expands it.
+	 */
+	if (!oldvd->vdev_ops->vdev_op_leaf &&
+	    (oldvd->vdev_ops != &vdev_raidz_ops || replacing))
 		return (spa_vdev_exit(spa, NULL, txg, ENOTSUP));
 
+	/*
+	 * The children of an expanding RAID-Z vdev are read and written
+	 * directly by the reflow.
+	 */
+	if (oldvd->vdev_top->vdev_rz_expanding != 0)
+		return (spa_vdev_exit(spa, NULL, txg, EBUSY));
+
 	pvd = oldvd->vdev_parent;
 
 	if ((error = spa_config_parse(spa, &newrootvd, nvroot, NULL, 0,
@@ -4620,6 +4821,17 @@ spa_vdev_attach(spa_t *spa, uint64_t guid, nvlist_t *nvroot, int replacing)
 	if (oldvd->vdev_top->vdev_islog && newvd->vdev_isspare)
 		return (spa_vdev_exit(spa, newrootvd, txg, ENOTSUP));
 
+	if (oldvd->vdev_ops == &vdev_raidz_ops) {
+		if (newvd->vdev_isspare)
+			return (spa_vdev_exit(spa, newrootvd, txg, ENOTSUP));
+
+		error = vdev_raidz_attach(oldvd, newvd, txg);
+		if (error == 0)
+			spa_event_notify(spa, newvd, ESC_ZFS_VDEV_ATTACH);
+
+		return (spa_vdev_exit(spa, newrootvd, txg, error));
+	}
+
 	if (!replacing) {
 		/*
 		 * For attach, the only allowable parent is a mirror or the root
@@ -5045,6 +5257,10 @@ spa_vdev_split_mirror(spa_t *spa, char *newname, nvlist_t *config,
 	if (error != 0)
 		return (spa_vdev_exit(spa, NULL, txg, error));
 
+	/* the new pool wouldn't have the mappings of removed vdevs */
+	if (spa_feature_is_active(spa, SPA_FEATURE_DEVICE_REMOVAL))
+		return (spa_vdev_exit(spa, NULL, txg, ENOTSUP));
+
 	/* check new spa name before going any further */
 	if (spa_lookup(newname) != NULL)
 		return (spa_vdev_exit(spa, NULL, txg, EEXIST));
@@ -5162,8 +5378,12 @@ spa_vdev_split_mirror(spa_t *spa, char *newname, nvlist_t *config,
 
 	/* stop writers from using the disks */
 	for (c = 0; c < children; c++) {
-		if (vml[c] != NULL)
+		if (vml[c] != NULL) {
+			mutex_enter(&vml[c]->vdev_trim_lock);
+			vdev_trim_stop(vml[c], VDEV_TRIM_CANCELED);
+			mutex_exit(&vml[c]->vdev_trim_lock);
 			vml[c]->vdev_offline = B_TRUE;
+		}
 	}
 	vdev_reopen(spa->spa_root_vdev);
 
@@ -5446,8 +5666,9 @@ spa_vdev_remove_from_namespace(spa_t *spa, vdev_t *vd)
  * grab and release the spa_config_lock while still holding the namespace
  * lock.  During each step the configuration is synced out.
  *
- * Currently, this supports removing only hot spares, slogs, and level 2 ARC
- * devices.
+ * This supports removing hot spares, slogs, level 2 ARC devices, and other
+ * top-level vdevs, whose data is copied to the rest of the pool in the
+ * background (see vdev_removal.c).
  */
 int
 spa_vdev_remove(spa_t *spa, uint64_t guid, boolean_t unspare)
@@ -5537,9 +5758,14 @@ spa_vdev_remove(spa_t *spa, uint64_t guid, boolean_t unspare)
 		spa_event_notify(spa, vd, ESC_ZFS_VDEV_REMOVE_DEV);
 	} else if (vd != NULL) {
 		/*
-		 * Normal vdevs cannot be removed (yet).
+		 * Copy the data of a top-level vdev elsewhere, see
+		 * vdev_removal.c.  Leaf vdevs are detached instead.
 		 */
-		error = SET_ERROR(ENOTSUP);
+		ASSERT(!locked);
+		if (vd == vd->vdev_top)
+			error = spa_vdev_remove_top(vd, &txg);
+		else
+			error = SET_ERROR(ENOTSUP);
 	} else {
 		/*
 		 * There is no vdev of any kind with the specified guid.
@@ -5723,6 +5949,105 @@ spa_vdev_setfru(spa_t *spa, uint64_t guid, const char *newfru)
 	return (spa_vdev_set_common(spa, guid, newfru, B_FALSE));
 }
 
+/*
+ * ==========================================================================
+ * SPA TRIM
+ * ==========================================================================
+ */
+
+static int
+spa_vdev_trim_impl(spa_t *spa, uint64_t guid, pool_trim_func_t cmd,
+    uint64_t rate)
+{
+	vdev_t *vd;
+	int error = 0;
+
+	ASSERT(MUTEX_HELD(&spa_namespace_lock));
+
+	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+
+	vd = spa_lookup_by_guid(spa, guid, B_FALSE);
+	if (vd == NULL || vd->vdev_detached) {
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+		return (SET_ERROR(ENODEV));
+	} else if (!vd->vdev_ops->vdev_op_leaf || vd->vdev_top->vdev_ishole ||
+	    vd->vdev_isspare || vd->vdev_isl2cache) {
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+		return (SET_ERROR(EINVAL));
+	} else if (cmd == POOL_TRIM_START && !vdev_writeable(vd)) {
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+		return (SET_ERROR(EROFS));
+	} else if (cmd == POOL_TRIM_START && !vd->vdev_has_trim) {
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+		return (SET_ERROR(ENOTSUP));
+	} else if (cmd == POOL_TRIM_START &&
+	    vd->vdev_top->vdev_rz_expanding != 0) {
+		/* free ranges can't be translated until the reflow is done */
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+		return (SET_ERROR(EBUSY));
+	}
+
+	mutex_enter(&vd->vdev_trim_lock);
+	switch (cmd) {
+	case POOL_TRIM_START:
+		if (vd->vdev_trim_thread != NULL)
+			error = SET_ERROR(EBUSY);
+		else
+			vdev_trim(vd, rate);
+		break;
+	case POOL_TRIM_CANCEL:
+		if (vd->vdev_trim_thread == NULL &&
+		    vd->vdev_trim_state != VDEV_TRIM_SUSPENDED)
+			error = SET_ERROR(ESRCH);
+		else
+			vdev_trim_stop(vd, VDEV_TRIM_CANCELED);
+		break;
+	case POOL_TRIM_SUSPEND:
+		if (vd->vdev_trim_thread == NULL)
+			error = SET_ERROR(ESRCH);
+		else
+			vdev_trim_stop(vd, VDEV_TRIM_SUSPENDED);
+		break;
+	default:
+		error = SET_ERROR(ENOTSUP);
+	}
+	mutex_exit(&vd->vdev_trim_lock);
+
+	spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+	return (error);
+}
+
+/*
+ * Start, cancel or suspend the on-demand TRIM of the leaf vdevs in nv, an
+ * nvlist of vdev names to guids.  The error of each vdev which failed is
+ * added to vdev_errlist under its name.
+ */
+int
+spa_vdev_trim(spa_t *spa, nvlist_t *nv, pool_trim_func_t cmd, uint64_t rate,
+    nvlist_t *vdev_errlist)
+{
+	nvpair_t *pair;
+	int total_errors = 0;
+
+	mutex_enter(&spa_namespace_lock);
+	for (pair = nvlist_next_nvpair(nv, NULL); pair != NULL;
+	    pair = nvlist_next_nvpair(nv, pair)) {
+		uint64_t vdev_guid = fnvpair_value_uint64(pair);
+		int error;
+
+		error = spa_vdev_trim_impl(spa, vdev_guid, cmd, rate);
+		if (error != 0) {
+			fnvlist_add_int64(vdev_errlist, nvpair_name(pair),
+			    error);
+			total_errors++;
+		}
+	}
+	mutex_exit(&spa_namespace_lock);
+
+	return (total_errors != 0 ? SET_ERROR(EINVAL) : 0);
+}
+
 /*
  * ==========================================================================
  * SPA Scanning
@@ -5844,9 +6169,11 @@ spa_async_thread(spa_t *spa)
 		uint64_t old_space, new_space;
 
 		mutex_enter(&spa_namespace_lock);
-		old_space = metaslab_class_get_space(spa_normal_class(spa));
+		old_space = metaslab_class_get_space(spa_normal_class(spa)) +
+		    metaslab_class_get_space(spa_special_class(spa));
 		spa_config_update(spa, SPA_CONFIG_UPDATE_POOL);
-		new_space = metaslab_class_get_space(spa_normal_class(spa));
+		new_space = metaslab_class_get_space(spa_normal_class(spa)) +
+		    metaslab_class_get_space(spa_special_class(spa));
 		mutex_exit(&spa_namespace_lock);
 
 		/*
@@ -5900,6 +6227,39 @@ spa_async_thread(spa_t *spa)
 	if (tasks & SPA_ASYNC_RESILVER)
 		dsl_resilver_restart(spa->spa_dsl_pool, 0);
 
+	/*
+	 * Replace a vdev whose data was copied away with an indirect vdev.
+	 */
+	if (tasks & SPA_ASYNC_REMOVE_DONE)
+		spa_vdev_remove_complete(spa);
+
+	/*
+	 * Start using the new child of a RAID-Z vdev whose data was moved.
+	 */
+	if (tasks & SPA_ASYNC_RAIDZ_EXPAND_DONE)
+		spa_raidz_expand_complete(spa);
+
+	/*
+	 * Start or stop the autotrim threads, after the autotrim property
+	 * changed or top-level vdevs were added.
+	 */
+	if ((tasks & SPA_ASYNC_AUTOTRIM_RESTART) && !spa_suspended(spa)) {
+		spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+		vdev_autotrim_restart(spa);
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+	}
+
+	/*
+	 * Restore the contents of any persistent L2ARC devices.
+	 */
+	if (tasks & SPA_ASYNC_L2CACHE_REBUILD) {
+		mutex_enter(&spa_namespace_lock);
+		spa_config_enter(spa, SCL_L2ARC, FTAG, RW_READER);
+		l2arc_spa_rebuild_start(spa);
+		spa_config_exit(spa, SCL_L2ARC, FTAG);
+		mutex_exit(&spa_namespace_lock);
+	}
+
 	/*
 	 * Let the world know that we're done.
 	 */
@@ -5918,6 +6278,9 @@ spa_async_suspend(spa_t *spa)
 	while (spa->spa_async_thread != NULL)
 		cv_wait(&spa->spa_async_cv, &spa->spa_async_lock);
 	mutex_exit(&spa->spa_async_lock);
+
+	spa_vdev_remove_suspend(spa);
+	spa_raidz_expand_suspend(spa);
 }
 
 void
@@ -5927,6 +6290,9 @@ spa_async_resume(spa_t *spa)
 	ASSERT(spa->spa_async_suspended != 0);
 	spa->spa_async_suspended--;
 	mutex_exit(&spa->spa_async_lock);
+
+	spa_restart_removal(spa);
+	spa_restart_raidz_expand(spa);
 }
 
 static boolean_t
@@ -6384,6 +6750,11 @@ spa_sync_props(void *arg, dmu_tx_t *tx)
 					spa_async_request(spa,
 					    SPA_ASYNC_AUTOEXPAND);
 				break;
+			case ZPOOL_PROP_AUTOTRIM:
+				spa->spa_autotrim = intval;
+				spa_async_request(spa,
+				    SPA_ASYNC_AUTOTRIM_RESTART);
+				break;
 			case ZPOOL_PROP_DEDUPDITTO:
 				spa->spa_dedup_ditto = intval;
 				break;
@@ -6501,6 +6872,14 @@ spa_sync(spa_t *spa, uint64_t txg)
 	spa->spa_syncing_txg = txg;
 	spa->spa_sync_pass = 0;
 
+	/*
+	 * Wait for the copies of a vdev being removed that were issued in
+	 * this txg, before their mapping entries are written out.
+	 */
+	(void) zio_wait(spa->spa_txg_zio[txg & TXG_MASK]);
+	spa->spa_txg_zio[txg & TXG_MASK] = zio_root(spa, NULL, NULL,
+	    ZIO_FLAG_CANFAIL);
+
 	mutex_enter(&spa->spa_alloc_lock);
 	VERIFY0(avl_numnodes(&spa->spa_alloc_tree));
 	mutex_exit(&spa->spa_alloc_lock);
@@ -6619,6 +6998,9 @@ spa_sync(spa_t *spa, uint64_t txg)
 		ddt_sync(spa, txg);
 		dsl_scan_sync(dp, tx);
 
+		if (pass == 1)
+			spa_log_sm_sync(spa, tx);
+
 		while ((vd = txg_list_remove(&spa->spa_vdev_txg_list, txg)))
 			vdev_sync(vd, txg);
 
@@ -6656,6 +7038,8 @@ spa_sync(spa_t *spa, uint64_t txg)
 
 	} while (dmu_objset_is_dirty(mos, txg));
 
+	spa_log_sm_sync_done(spa);
+
 #ifdef ZFS_DEBUG
 	if (!list_is_empty(&spa->spa_config_dirty_list)) {
 		/*
@@ -6986,6 +7370,7 @@ EXPORT_SYMBOL(spa_l2cache_drop);
 /* scanning */
 EXPORT_SYMBOL(spa_scan);
 EXPORT_SYMBOL(spa_scan_stop);
+EXPORT_SYMBOL(spa_vdev_trim);
 
 /* spa syncing */
 EXPORT_SYMBOL(spa_sync); /* only for DMU use */
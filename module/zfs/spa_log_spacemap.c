@@ -0,0 +1,609 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/dmu.h>
+#include <sys/dmu_objset.h>
+#include <sys/dmu_tx.h>
+#include <sys/metaslab_impl.h>
+#include <sys/spa_impl.h>
+#include <sys/spa_log_spacemap.h>
+#include <sys/vdev_impl.h>
+#include <sys/zap.h>
+#include <sys/zfeature.h>
+
+/*
+ * Log space maps
+ *
+ * Without the log_spacemap feature, metaslab_sync() appends the allocs and
+ * frees of every dirty metaslab to the space map of the metaslab.  When the
+ * changes of a txg are spread over many metaslabs, as with random frees on
+ * a fragmented pool, every txg writes at least one block to the space map
+ * of each of them.
+ *
+ * With the feature active, the changes of all the metaslabs in a txg are
+ * appended to a single log object for the txg instead, and are also kept in
+ * memory in the ms_unflushed_allocs and ms_unflushed_frees trees of each
+ * metaslab.  A few metaslabs are flushed every txg: their unflushed changes
+ * are written to their space map, whose smp_flushed_txg records up to which
+ * txg it is complete.  A metaslab being condensed is flushed as well.  Once
+ * no metaslab has unflushed changes in a log, the log is destroyed.
+ *
+ * spa_metaslabs_by_flushed sorts the metaslabs with unflushed changes by
+ * the txg of the oldest of them, which is what metaslabs are flushed by.
+ * When the pool is loaded, the logs are read in txg order and every entry
+ * of a txg after the smp_flushed_txg of its metaslab is added back to the
+ * unflushed trees, which metaslab_load() applies on top of the space map.
+ *
+ * How many metaslabs are flushed each txg trades the writes the logs are
+ * meant to save against the memory used by the unflushed trees and the
+ * number of logs to read at import.  Every txg flushes enough metaslabs to
+ * flush all of them every zfs_unflushed_log_txg_max txgs, and at least
+ * zfs_min_metaslabs_to_flush.  More are flushed, oldest first, while any
+ * metaslab has changes older than zfs_unflushed_log_txg_max txgs or the
+ * unflushed trees use more than zfs_unflushed_max_mem_amt bytes.
+ */
+
+/*
+ * Maximum memory used by the segments of the unflushed trees of the pool.
+ */
+unsigned long zfs_unflushed_max_mem_amt = 1ULL << 30;
+
+/*
+ * Number of txgs after which the changes of any metaslab are flushed.
+ */
+int zfs_unflushed_log_txg_max = 1000;
+
+/*
+ * Minimum number of metaslabs flushed by every txg with changes.
+ */
+int zfs_min_metaslabs_to_flush = 1;
+
+/*
+ * Block size of the log objects, and size of the buffers used to write and
+ * read them.
+ */
+int zfs_log_sm_blksz = (1 << 17);
+
+int
+spa_log_sm_ms_compare(const void *x1, const void *x2)
+{
+	const metaslab_t *m1 = x1;
+	const metaslab_t *m2 = x2;
+	uint64_t v1, v2;
+
+	if (m1->ms_unflushed_txg < m2->ms_unflushed_txg)
+		return (-1);
+	if (m1->ms_unflushed_txg > m2->ms_unflushed_txg)
+		return (1);
+
+	v1 = m1->ms_group->mg_vd->vdev_id;
+	v2 = m2->ms_group->mg_vd->vdev_id;
+	if (v1 < v2)
+		return (-1);
+	if (v1 > v2)
+		return (1);
+
+	if (m1->ms_id < m2->ms_id)
+		return (-1);
+	if (m1->ms_id > m2->ms_id)
+		return (1);
+
+	return (0);
+}
+
+boolean_t
+spa_uses_log_spacemap(spa_t *spa)
+{
+	return (spa_feature_is_active(spa, SPA_FEATURE_LOG_SPACEMAP));
+}
+
+static spa_log_sm_t *
+spa_log_sm_find(spa_t *spa, uint64_t txg)
+{
+	spa_log_sm_t *sls;
+
+	ASSERT(MUTEX_HELD(&spa->spa_flushed_ms_lock));
+
+	for (sls = list_tail(&spa->spa_sm_logs_by_txg); sls != NULL;
+	    sls = list_prev(&spa->spa_sm_logs_by_txg, sls)) {
+		if (sls->sls_txg == txg)
+			return (sls);
+		if (sls->sls_txg < txg)
+			break;
+	}
+
+	return (NULL);
+}
+
+/*
+ * Create the log of the syncing txg, if it does not exist yet.  Must be
+ * called before metaslabs log their changes, without their ms_lock held.
+ */
+void
+spa_log_sm_open_syncing(spa_t *spa, dmu_tx_t *tx)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	spa_log_sm_t *sls = spa->spa_syncing_log_sm;
+	spa_log_sm_phys_t *slsp;
+
+	ASSERT(dmu_tx_is_syncing(tx));
+	ASSERT(spa_uses_log_spacemap(spa));
+
+	if (sls != NULL) {
+		ASSERT3U(sls->sls_txg, ==, txg);
+		return;
+	}
+
+	sls = kmem_zalloc(sizeof (spa_log_sm_t), KM_SLEEP);
+	sls->sls_txg = txg;
+	sls->sls_object = dmu_object_alloc(mos, DMU_OTN_UINT64_METADATA,
+	    zfs_log_sm_blksz, DMU_OTN_UINT64_METADATA,
+	    sizeof (spa_log_sm_phys_t), tx);
+	VERIFY0(zap_add_int_key(mos, spa->spa_log_sm_zap, txg,
+	    sls->sls_object, tx));
+
+	VERIFY0(dmu_bonus_hold(mos, sls->sls_object, sls, &sls->sls_dbuf));
+	dmu_buf_will_dirty(sls->sls_dbuf, tx);
+	slsp = sls->sls_dbuf->db_data;
+	slsp->slsp_txg = txg;
+	slsp->slsp_length = 0;
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	ASSERT(list_is_empty(&spa->spa_sm_logs_by_txg) ||
+	    ((spa_log_sm_t *)list_tail(&spa->spa_sm_logs_by_txg))->sls_txg <
+	    txg);
+	list_insert_tail(&spa->spa_sm_logs_by_txg, sls);
+	mutex_exit(&spa->spa_flushed_ms_lock);
+
+	spa->spa_syncing_log_sm = sls;
+}
+
+/*
+ * Append the ranges of rt, all of type maptype, to the log of the syncing
+ * txg.  Like space_map_write(), drops rt_lock around the calls into the DMU.
+ */
+void
+spa_log_sm_write(spa_t *spa, uint64_t vdev_id, range_tree_t *rt,
+    maptype_t maptype, dmu_tx_t *tx)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	spa_log_sm_t *sls = spa->spa_syncing_log_sm;
+	spa_log_sm_phys_t *slsp;
+	avl_tree_t *t = &rt->rt_root;
+	uint64_t *entry, *entry_map, *entry_map_end;
+	range_seg_t *rs;
+
+	ASSERT(MUTEX_HELD(rt->rt_lock));
+	ASSERT3P(sls, !=, NULL);
+	ASSERT3U(sls->sls_txg, ==, dmu_tx_get_txg(tx));
+	ASSERT3U(vdev_id, ==, SLE_VDEV_DECODE(SLE_VDEV_ENCODE(vdev_id)));
+
+	if (range_tree_space(rt) == 0)
+		return;
+
+	dmu_buf_will_dirty(sls->sls_dbuf, tx);
+	slsp = sls->sls_dbuf->db_data;
+
+	entry_map = vmem_alloc(zfs_log_sm_blksz, KM_SLEEP);
+	entry_map_end = entry_map + (zfs_log_sm_blksz / sizeof (uint64_t));
+	entry = entry_map;
+
+	for (rs = avl_first(t); rs != NULL; rs = AVL_NEXT(t, rs)) {
+		uint64_t start = rs->rs_start;
+		uint64_t size = rs->rs_end - rs->rs_start;
+
+		while (size != 0) {
+			uint64_t run_len = MIN(size, SLE_RUN_MAX);
+
+			if (entry == entry_map_end) {
+				mutex_exit(rt->rt_lock);
+				dmu_write(mos, sls->sls_object,
+				    slsp->slsp_length, zfs_log_sm_blksz,
+				    entry_map, tx);
+				mutex_enter(rt->rt_lock);
+				slsp->slsp_length += zfs_log_sm_blksz;
+				entry = entry_map;
+			}
+
+			entry[0] = SLE_TYPE_ENCODE(maptype) |
+			    SLE_VDEV_ENCODE(vdev_id) | SLE_RUN_ENCODE(run_len);
+			entry[1] = start;
+			entry += SLE_WORDS;
+
+			start += run_len;
+			size -= run_len;
+		}
+	}
+
+	if (entry != entry_map) {
+		uint64_t size = (entry - entry_map) * sizeof (uint64_t);
+
+		mutex_exit(rt->rt_lock);
+		dmu_write(mos, sls->sls_object, slsp->slsp_length, size,
+		    entry_map, tx);
+		mutex_enter(rt->rt_lock);
+		slsp->slsp_length += size;
+	}
+
+	vmem_free(entry_map, zfs_log_sm_blksz);
+}
+
+/*
+ * The metaslab has logged changes in the given txg.  If they are the only
+ * ones it has not flushed, the log of the txg is now the oldest it needs.
+ */
+void
+spa_log_sm_ms_dirty(spa_t *spa, metaslab_t *msp, uint64_t txg)
+{
+	spa_log_sm_t *sls;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	if (msp->ms_unflushed_txg != 0) {
+		ASSERT3U(msp->ms_unflushed_txg, <=, txg);
+		return;
+	}
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	sls = spa_log_sm_find(spa, txg);
+	VERIFY3P(sls, !=, NULL);
+	sls->sls_mscount++;
+	msp->ms_unflushed_txg = txg;
+	avl_add(&spa->spa_metaslabs_by_flushed, msp);
+	mutex_exit(&spa->spa_flushed_ms_lock);
+}
+
+/*
+ * The metaslab does not need any log anymore.
+ */
+void
+spa_log_sm_ms_clean(spa_t *spa, metaslab_t *msp)
+{
+	spa_log_sm_t *sls;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+
+	if (msp->ms_unflushed_txg == 0)
+		return;
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	sls = spa_log_sm_find(spa, msp->ms_unflushed_txg);
+	VERIFY3P(sls, !=, NULL);
+	ASSERT3U(sls->sls_mscount, >, 0);
+	sls->sls_mscount--;
+	avl_remove(&spa->spa_metaslabs_by_flushed, msp);
+	msp->ms_unflushed_txg = 0;
+	mutex_exit(&spa->spa_flushed_ms_lock);
+}
+
+static void
+spa_log_sm_flush_metaslabs(spa_t *spa, dmu_tx_t *tx)
+{
+	avl_tree_t *t = &spa->spa_metaslabs_by_flushed;
+	uint64_t txg = dmu_tx_get_txg(tx);
+	uint64_t txg_max = MAX(zfs_unflushed_log_txg_max, 1);
+	uint64_t want, flushed = 0;
+	metaslab_t *msp, *next;
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	want = MAX(zfs_min_metaslabs_to_flush,
+	    howmany(avl_numnodes(t), txg_max));
+	msp = avl_first(t);
+	mutex_exit(&spa->spa_flushed_ms_lock);
+
+	for (; msp != NULL; msp = next) {
+		mutex_enter(&spa->spa_flushed_ms_lock);
+		next = AVL_NEXT(t, msp);
+		mutex_exit(&spa->spa_flushed_ms_lock);
+
+		if (flushed >= want &&
+		    msp->ms_unflushed_txg + txg_max > txg &&
+		    spa->spa_unflushed_segs * sizeof (range_seg_t) <=
+		    zfs_unflushed_max_mem_amt)
+			break;
+
+		if (metaslab_flush(msp, tx))
+			flushed++;
+	}
+}
+
+/*
+ * Destroy the logs older than the oldest unflushed change of any metaslab.
+ */
+static void
+spa_log_sm_cleanup(spa_t *spa, dmu_tx_t *tx)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	spa_log_sm_t *sls;
+
+	mutex_enter(&spa->spa_flushed_ms_lock);
+	while ((sls = list_head(&spa->spa_sm_logs_by_txg)) != NULL &&
+	    sls->sls_mscount == 0 && sls->sls_txg < txg &&
+	    (spa->spa_log_sm_pin_txg == 0 ||
+	    sls->sls_txg < spa->spa_log_sm_pin_txg)) {
+		ASSERT3P(sls, !=, spa->spa_syncing_log_sm);
+		list_remove(&spa->spa_sm_logs_by_txg, sls);
+		mutex_exit(&spa->spa_flushed_ms_lock);
+
+		VERIFY0(dmu_object_free(mos, sls->sls_object, tx));
+		VERIFY0(zap_remove_int(mos, spa->spa_log_sm_zap,
+		    sls->sls_txg, tx));
+		kmem_free(sls, sizeof (spa_log_sm_t));
+
+		mutex_enter(&spa->spa_flushed_ms_lock);
+	}
+	mutex_exit(&spa->spa_flushed_ms_lock);
+}
+
+/*
+ * Called in the first pass of spa_sync(), before the vdevs are synced, to
+ * activate the feature, flush metaslabs and destroy the logs not needed
+ * anymore.
+ */
+void
+spa_log_sm_sync(spa_t *spa, dmu_tx_t *tx)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t txg = dmu_tx_get_txg(tx);
+
+	ASSERT3U(spa_sync_pass(spa), ==, 1);
+
+	/*
+	 * Leave txgs with nothing else to write no-ops, see spa_sync().
+	 */
+	if (spa->spa_uberblock.ub_rootbp.blk_birth < txg &&
+	    !dmu_objset_is_dirty(mos, txg))
+		return;
+
+	if (!spa_uses_log_spacemap(spa)) {
+		if (!spa_feature_is_enabled(spa, SPA_FEATURE_LOG_SPACEMAP))
+			return;
+
+		spa->spa_log_sm_zap = zap_create(mos, DMU_OTN_ZAP_METADATA,
+		    DMU_OT_NONE, 0, tx);
+		VERIFY0(zap_add(mos, DMU_POOL_DIRECTORY_OBJECT,
+		    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (uint64_t), 1,
+		    &spa->spa_log_sm_zap, tx));
+		spa_feature_incr(spa, SPA_FEATURE_LOG_SPACEMAP, tx);
+		return;
+	}
+
+	spa_log_sm_flush_metaslabs(spa, tx);
+	spa_log_sm_cleanup(spa, tx);
+}
+
+/*
+ * Called once spa_sync() has converged, when nothing will be logged in the
+ * syncing txg anymore.
+ */
+void
+spa_log_sm_sync_done(spa_t *spa)
+{
+	spa_log_sm_t *sls = spa->spa_syncing_log_sm;
+
+	if (sls == NULL)
+		return;
+
+	dmu_buf_rele(sls->sls_dbuf, sls);
+	sls->sls_dbuf = NULL;
+	spa->spa_syncing_log_sm = NULL;
+}
+
+static int
+spa_log_sm_replay_entry(spa_t *spa, uint64_t txg, const uint64_t *entry)
+{
+	uint64_t vdev_id = SLE_VDEV_DECODE(entry[0]);
+	uint64_t size = SLE_RUN_DECODE(entry[0]);
+	uint64_t start = entry[1];
+	maptype_t maptype = SLE_TYPE_DECODE(entry[0]);
+	metaslab_t *msp;
+	vdev_t *vd;
+
+	/*
+	 * Skip the changes of vdevs which have been removed since, including
+	 * those of a removed vdev whose id has been reused.
+	 */
+	vd = vdev_lookup_top(spa, vdev_id);
+	if (vd == NULL || txg < vd->vdev_crtxg)
+		return (0);
+
+	/*
+	 * A vdev which is missing has no metaslabs.  The logs with its
+	 * changes must be kept until it is back.
+	 */
+	if (vd->vdev_ms == NULL) {
+		if (vd->vdev_ms_array != 0 && !vd->vdev_ishole &&
+		    (spa->spa_log_sm_pin_txg == 0 ||
+		    txg < spa->spa_log_sm_pin_txg))
+			spa->spa_log_sm_pin_txg = txg;
+		return (0);
+	}
+
+	if (size == 0 || (start >> vd->vdev_ms_shift) >= vd->vdev_ms_count)
+		return (SET_ERROR(EIO));
+	msp = vd->vdev_ms[start >> vd->vdev_ms_shift];
+	if (start + size > msp->ms_start + msp->ms_size)
+		return (SET_ERROR(EIO));
+
+	if (txg <= space_map_flushed_txg(msp->ms_sm))
+		return (0);
+
+	metaslab_unflushed_replay(msp, txg, start, size, maptype);
+	return (0);
+}
+
+static int
+spa_log_sm_replay(spa_t *spa, spa_log_sm_t *sls)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	uint64_t *entry, *entry_map, *entry_map_end;
+	uint64_t offset, size, length;
+	dmu_object_info_t doi;
+	dmu_buf_t *db;
+	int error;
+
+	error = dmu_bonus_hold(mos, sls->sls_object, FTAG, &db);
+	if (error != 0)
+		return (error);
+	dmu_object_info_from_db(db, &doi);
+	if (doi.doi_bonus_size < sizeof (spa_log_sm_phys_t)) {
+		dmu_buf_rele(db, FTAG);
+		return (SET_ERROR(EIO));
+	}
+	length = ((spa_log_sm_phys_t *)db->db_data)->slsp_length;
+	dmu_buf_rele(db, FTAG);
+
+	if (P2PHASE(length, SLE_WORDS * sizeof (uint64_t)) != 0)
+		return (SET_ERROR(EIO));
+	if (length == 0)
+		return (0);
+
+	if (length > zfs_log_sm_blksz) {
+		dmu_prefetch(mos, sls->sls_object, 0, zfs_log_sm_blksz,
+		    length - zfs_log_sm_blksz, ZIO_PRIORITY_SYNC_READ);
+	}
+
+	entry_map = vmem_alloc(zfs_log_sm_blksz, KM_SLEEP);
+
+	for (offset = 0; offset < length && error == 0; offset += size) {
+		size = MIN(length - offset, zfs_log_sm_blksz);
+
+		error = dmu_read(mos, sls->sls_object, offset, size,
+		    entry_map, DMU_READ_PREFETCH);
+		if (error != 0)
+			break;
+
+		entry_map_end = entry_map + (size / sizeof (uint64_t));
+		for (entry = entry_map; entry < entry_map_end;
+		    entry += SLE_WORDS) {
+			error = spa_log_sm_replay_entry(spa, sls->sls_txg,
+			    entry);
+			if (error != 0)
+				break;
+		}
+	}
+
+	vmem_free(entry_map, zfs_log_sm_blksz);
+	return (error);
+}
+
+/*
+ * Read the logs of the pool and replay the changes in them which are not
+ * in the space maps of the metaslabs yet.  Called once the metaslabs are
+ * loaded by vdev_load().
+ */
+int
+spa_log_sm_load(spa_t *spa)
+{
+	objset_t *mos = spa_meta_objset(spa);
+	zap_cursor_t zc;
+	zap_attribute_t za;
+	spa_log_sm_t *sls, *prev;
+	metaslab_t *msp;
+	int error;
+
+	ASSERT(list_is_empty(&spa->spa_sm_logs_by_txg));
+
+	if (!spa_uses_log_spacemap(spa))
+		return (0);
+
+	error = zap_lookup(mos, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_LOG_SPACEMAP_ZAP, sizeof (uint64_t), 1,
+	    &spa->spa_log_sm_zap);
+	if (error != 0)
+		return (error);
+
+	for (zap_cursor_init(&zc, mos, spa->spa_log_sm_zap);
+	    (error = zap_cursor_retrieve(&zc, &za)) == 0;
+	    zap_cursor_advance(&zc)) {
+		sls = kmem_zalloc(sizeof (spa_log_sm_t), KM_SLEEP);
+		sls->sls_txg = strtonum(za.za_name, NULL);
+		sls->sls_object = za.za_first_integer;
+
+		/*
+		 * The ZAP returns the logs in hash order.
+		 */
+		for (prev = list_tail(&spa->spa_sm_logs_by_txg);
+		    prev != NULL && prev->sls_txg > sls->sls_txg;
+		    prev = list_prev(&spa->spa_sm_logs_by_txg, prev))
+			continue;
+		if (prev == NULL)
+			list_insert_head(&spa->spa_sm_logs_by_txg, sls);
+		else
+			list_insert_after(&spa->spa_sm_logs_by_txg, prev, sls);
+	}
+	zap_cursor_fini(&zc);
+	if (error != ENOENT)
+		return (error);
+
+	error = 0;
+	spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+	for (sls = list_head(&spa->spa_sm_logs_by_txg);
+	    sls != NULL && error == 0;
+	    sls = list_next(&spa->spa_sm_logs_by_txg, sls))
+		error = spa_log_sm_replay(spa, sls);
+	spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+	if (error != 0) {
+		zfs_dbgmsg("spa %s: failed to replay log space maps, "
+		    "error %d", spa_name(spa), error);
+		return (error);
+	}
+
+	for (msp = avl_first(&spa->spa_metaslabs_by_flushed); msp != NULL;
+	    msp = AVL_NEXT(&spa->spa_metaslabs_by_flushed, msp))
+		metaslab_unflushed_replay_done(msp);
+
+	return (0);
+}
+
+/*
+ * Called by spa_unload() once the metaslabs are gone.
+ */
+void
+spa_log_sm_unload(spa_t *spa)
+{
+	spa_log_sm_t *sls;
+
+	ASSERT3P(spa->spa_syncing_log_sm, ==, NULL);
+	ASSERT0(avl_numnodes(&spa->spa_metaslabs_by_flushed));
+
+	while ((sls = list_head(&spa->spa_sm_logs_by_txg)) != NULL) {
+		ASSERT0(sls->sls_mscount);
+		list_remove(&spa->spa_sm_logs_by_txg, sls);
+		kmem_free(sls, sizeof (spa_log_sm_t));
+	}
+
+	spa->spa_log_sm_zap = 0;
+	spa->spa_unflushed_segs = 0;
+	spa->spa_log_sm_pin_txg = 0;
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_unflushed_max_mem_amt, ulong, 0644);
+MODULE_PARM_DESC(zfs_unflushed_max_mem_amt,
+	"Max memory for the unflushed changes of the log space maps");
+
+module_param(zfs_unflushed_log_txg_max, int, 0644);
+MODULE_PARM_DESC(zfs_unflushed_log_txg_max,
+	"Max txgs the changes of a metaslab stay unflushed");
+
+module_param(zfs_min_metaslabs_to_flush, int, 0644);
+MODULE_PARM_DESC(zfs_min_metaslabs_to_flush,
+	"Min metaslabs flushed every txg");
+#endif
@@ -339,6 +339,22 @@ int spa_asize_inflation = 24;
  */
 int spa_slop_shift = 5;
 
+/*
+ * Metadata and small blocks are placed in the special allocation class, when
+ * the pool has one (see spa_preferred_class()).  Once it fills up they fall
+ * back to the normal class.  So that small file blocks cannot push metadata
+ * out of the special class, they are only placed there while more than this
+ * percentage of it is free.
+ */
+int zfs_special_class_metadata_reserve_pct = 25;
+
+/*
+ * Whether the dedup tables are placed in the special class, and whether the
+ * indirect blocks of files and volumes are.
+ */
+int zfs_ddt_data_is_special = B_TRUE;
+int zfs_user_indirect_is_special = B_TRUE;
+
 /*
  * ==========================================================================
  * SPA config locking
@@ -565,6 +581,7 @@ spa_add(const char *name, nvlist_t *config, const char *altroot)
 	mutex_init(&spa->spa_vdev_top_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_feat_stats_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&spa->spa_alloc_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&spa->spa_flushed_ms_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	cv_init(&spa->spa_async_cv, NULL, CV_DEFAULT, NULL);
 	cv_init(&spa->spa_evicting_os_cv, NULL, CV_DEFAULT, NULL);
@@ -600,6 +617,11 @@ spa_add(const char *name, nvlist_t *config, const char *altroot)
 	avl_create(&spa->spa_alloc_tree, zio_timestamp_compare,
 	    sizeof (zio_t), offsetof(zio_t, io_alloc_node));
 
+	avl_create(&spa->spa_metaslabs_by_flushed, spa_log_sm_ms_compare,
+	    sizeof (metaslab_t), offsetof(metaslab_t, ms_unflushed_node));
+	list_create(&spa->spa_sm_logs_by_txg, sizeof (spa_log_sm_t),
+	    offsetof(spa_log_sm_t, sls_node));
+
 	/*
 	 * Every pool starts with the default cachefile
 	 */
@@ -681,6 +703,8 @@ spa_remove(spa_t *spa)
 	}
 
 	avl_destroy(&spa->spa_alloc_tree);
+	avl_destroy(&spa->spa_metaslabs_by_flushed);
+	list_destroy(&spa->spa_sm_logs_by_txg);
 	list_destroy(&spa->spa_config_list);
 
 	nvlist_free(spa->spa_label_features);
@@ -705,6 +729,7 @@ spa_remove(spa_t *spa)
 	cv_destroy(&spa->spa_suspend_cv);
 
 	mutex_destroy(&spa->spa_alloc_lock);
+	mutex_destroy(&spa->spa_flushed_ms_lock);
 	mutex_destroy(&spa->spa_async_lock);
 	mutex_destroy(&spa->spa_errlist_lock);
 	mutex_destroy(&spa->spa_errlog_lock);
@@ -1082,6 +1107,7 @@ spa_vdev_config_exit(spa_t *spa, vdev_t *vd, uint64_t txg, int error, char *tag)
 	 */
 	ASSERT(metaslab_class_validate(spa_normal_class(spa)) == 0);
 	ASSERT(metaslab_class_validate(spa_log_class(spa)) == 0);
+	ASSERT(metaslab_class_validate(spa_special_class(spa)) == 0);
 
 	spa_config_exit(spa, SCL_ALL, spa);
 
@@ -1627,7 +1653,21 @@ void
 spa_update_dspace(spa_t *spa)
 {
 	spa->spa_dspace = metaslab_class_get_dspace(spa_normal_class(spa)) +
+	    metaslab_class_get_dspace(spa_special_class(spa)) +
 	    ddt_get_dedup_dspace(spa);
+
+	/*
+	 * A vdev being removed can't be allocated from, and everything on
+	 * it is about to be copied elsewhere, so don't count its space.
+	 * Otherwise the pool could fill up while the removal copies.
+	 */
+	if (spa->spa_vdev_removal != NULL) {
+		vdev_t *vd = vdev_lookup_top(spa,
+		    spa->spa_vdev_removal->svr_vdev_id);
+
+		spa->spa_dspace -= MIN(spa->spa_dspace,
+		    vd->vdev_stat.vs_dspace);
+	}
 }
 
 /*
@@ -1670,6 +1710,54 @@ spa_log_class(spa_t *spa)
 	return (spa->spa_log_class);
 }
 
+metaslab_class_t *
+spa_special_class(spa_t *spa)
+{
+	return (spa->spa_special_class);
+}
+
+/*
+ * Locate an appropriate allocation class for a block of the given type and
+ * size.  Intent log blocks are allocated by zio_alloc_zil() and never come
+ * here.  Everything else goes to the normal class unless the pool has a
+ * special class: that receives all metadata, and file or volume blocks no
+ * larger than the dataset's special_small_blocks.
+ */
+metaslab_class_t *
+spa_preferred_class(spa_t *spa, uint64_t size, dmu_object_type_t objtype,
+    uint_t level, uint_t special_smallblk)
+{
+	metaslab_class_t *special = spa_special_class(spa);
+	uint64_t alloc, space, limit;
+
+	if (special->mc_groups == 0)
+		return (spa_normal_class(spa));
+
+	if (objtype == DMU_OT_DDT_ZAP) {
+		return (zfs_ddt_data_is_special ? special :
+		    spa_normal_class(spa));
+	}
+
+	if (level > 0 && DMU_OT_IS_FILE(objtype)) {
+		return (zfs_user_indirect_is_special ? special :
+		    spa_normal_class(spa));
+	}
+
+	if (DMU_OT_IS_METADATA(objtype) || level > 0)
+		return (special);
+
+	if (DMU_OT_IS_FILE(objtype) && size <= special_smallblk) {
+		alloc = metaslab_class_get_alloc(special);
+		space = metaslab_class_get_space(special);
+		limit = space * (100 - zfs_special_class_metadata_reserve_pct) /
+		    100;
+		if (alloc < limit)
+			return (special);
+	}
+
+	return (spa_normal_class(spa));
+}
+
 void
 spa_evicting_os_register(spa_t *spa, objset_t *os)
 {
@@ -1960,6 +2048,7 @@ spa_scan_stat_init(spa_t *spa)
 	/* data not stored on disk */
 	spa->spa_scan_pass_start = gethrestime_sec();
 	spa->spa_scan_pass_exam = 0;
+	spa->spa_scan_pass_issued = 0;
 	vdev_scan_stat_init(spa->spa_root_vdev);
 }
 
@@ -1989,6 +2078,9 @@ spa_scan_get_stats(spa_t *spa, pool_scan_stat_t *ps)
 	/* data not stored on disk */
 	ps->pss_pass_start = spa->spa_scan_pass_start;
 	ps->pss_pass_exam = spa->spa_scan_pass_exam;
+	ps->pss_pass_issued = spa->spa_scan_pass_issued;
+	ps->pss_issued =
+	    scn->scn_issued_before_pass + spa->spa_scan_pass_issued;
 
 	return (0);
 }
@@ -2065,6 +2157,8 @@ EXPORT_SYMBOL(spa_update_dspace);
 EXPORT_SYMBOL(spa_deflate);
 EXPORT_SYMBOL(spa_normal_class);
 EXPORT_SYMBOL(spa_log_class);
+EXPORT_SYMBOL(spa_special_class);
+EXPORT_SYMBOL(spa_preferred_class);
 EXPORT_SYMBOL(spa_max_replication);
 EXPORT_SYMBOL(spa_prev_software_version);
 EXPORT_SYMBOL(spa_get_failmode);
@@ -2120,5 +2214,17 @@ MODULE_PARM_DESC(spa_asize_inflation,
 
 module_param(spa_slop_shift, int, 0644);
 MODULE_PARM_DESC(spa_slop_shift, "Reserved free space in pool");
+
+module_param(zfs_special_class_metadata_reserve_pct, int, 0644);
+MODULE_PARM_DESC(zfs_special_class_metadata_reserve_pct,
+	"Percent of the special class kept free of small file blocks");
+
+module_param(zfs_ddt_data_is_special, int, 0644);
+MODULE_PARM_DESC(zfs_ddt_data_is_special,
+	"Place the dedup tables in the special class");
+
+module_param(zfs_user_indirect_is_special, int, 0644);
+MODULE_PARM_DESC(zfs_user_indirect_is_special,
+	"Place the indirect blocks of files in the special class");
 /* END CSTYLED */
 #endif
@@ -701,6 +701,123 @@ spa_io_history_destroy(spa_t *spa)
 	mutex_destroy(&ssh->lock);
 }
 
+/*
+ * ==========================================================================
+ * SPA Load Phase Routines
+ * ==========================================================================
+ */
+
+/*
+ * Time spent in each step of the last spa_load() of the pool, normally its
+ * import.  Steps which were not reached are reported as zero.
+ */
+typedef struct spa_load_phases {
+	kstat_named_t	slp_time[SPA_LOAD_PHASES];
+	hrtime_t	slp_start;
+	hrtime_t	slp_last;
+} spa_load_phases_t;
+
+static const char *spa_load_phase_names[SPA_LOAD_PHASES] = {
+	"vdev_open",
+	"uberblock",
+	"mos",
+	"vdev_load",
+	"ddt_load",
+	"log_check",
+	"load_verify",
+	"log_claim",
+	"total",
+};
+
+static void
+spa_load_phases_init(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.load_phases;
+	spa_load_phases_t *slp;
+	char name[KSTAT_STRLEN];
+	kstat_t *ksp;
+	int i;
+
+	mutex_init(&ssh->lock, NULL, MUTEX_DEFAULT, NULL);
+
+	ssh->count = SPA_LOAD_PHASES;
+	ssh->size = sizeof (spa_load_phases_t);
+	ssh->private = slp = kmem_zalloc(ssh->size, KM_SLEEP);
+
+	for (i = 0; i < SPA_LOAD_PHASES; i++) {
+		slp->slp_time[i].data_type = KSTAT_DATA_UINT64;
+		(void) strlcpy(slp->slp_time[i].name, spa_load_phase_names[i],
+		    KSTAT_STRLEN);
+	}
+
+	(void) snprintf(name, KSTAT_STRLEN, "zfs/%s", spa_name(spa));
+
+	ksp = kstat_create(name, 0, "import", "misc",
+	    KSTAT_TYPE_NAMED, 0, KSTAT_FLAG_VIRTUAL);
+	ssh->kstat = ksp;
+
+	if (ksp) {
+		ksp->ks_lock = &ssh->lock;
+		ksp->ks_data = slp->slp_time;
+		ksp->ks_ndata = SPA_LOAD_PHASES;
+		ksp->ks_data_size = sizeof (slp->slp_time);
+		ksp->ks_private = spa;
+		kstat_install(ksp);
+	}
+}
+
+static void
+spa_load_phases_destroy(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.load_phases;
+
+	if (ssh->kstat)
+		kstat_delete(ssh->kstat);
+
+	kmem_free(ssh->private, ssh->size);
+	mutex_destroy(&ssh->lock);
+}
+
+/*
+ * Called when spa_load() begins, to clear the times of the previous load.
+ */
+void
+spa_load_phase_start(spa_t *spa)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.load_phases;
+	spa_load_phases_t *slp = ssh->private;
+	int i;
+
+	mutex_enter(&ssh->lock);
+	for (i = 0; i < SPA_LOAD_PHASES; i++)
+		slp->slp_time[i].value.ui64 = 0;
+	slp->slp_start = slp->slp_last = gethrtime();
+	mutex_exit(&ssh->lock);
+}
+
+/*
+ * Charge the time since the end of the previous phase to 'phase'.  The
+ * total is measured from spa_load_phase_start().
+ */
+void
+spa_load_phase_done(spa_t *spa, spa_load_phase_t phase)
+{
+	spa_stats_history_t *ssh = &spa->spa_stats.load_phases;
+	spa_load_phases_t *slp = ssh->private;
+	hrtime_t now = gethrtime();
+
+	ASSERT3U(phase, <, SPA_LOAD_PHASES);
+
+	mutex_enter(&ssh->lock);
+	if (phase == SPA_LOAD_PHASE_TOTAL) {
+		slp->slp_time[phase].value.ui64 = now - slp->slp_start;
+	} else {
+		slp->slp_time[phase].value.ui64 += now - slp->slp_last;
+		slp->slp_last = now;
+	}
+	mutex_exit(&ssh->lock);
+}
+
 void
 spa_stats_init(spa_t *spa)
 {
@@ -708,6 +825,7 @@ spa_stats_init(spa_t *spa)
 	spa_txg_history_init(spa);
 	spa_tx_assign_init(spa);
 	spa_io_history_init(spa);
+	spa_load_phases_init(spa);
 }
 
 void
@@ -717,6 +835,7 @@ spa_stats_destroy(spa_t *spa)
 	spa_txg_history_destroy(spa);
 	spa_read_history_destroy(spa);
 	spa_io_history_destroy(spa);
+	spa_load_phases_destroy(spa);
 }
 
 #if defined(_KERNEL) && defined(HAVE_SPL)
@@ -538,6 +538,28 @@ space_map_length(space_map_t *sm)
 	return (sm != NULL ? sm->sm_length : 0);
 }
 
+/*
+ * Returns the txg up to which the changes logged in the pool's log space
+ * maps are already in this space map, or 0 if there is no such txg.
+ */
+uint64_t
+space_map_flushed_txg(space_map_t *sm)
+{
+	if (sm == NULL || sm->sm_dbuf->db_size != sizeof (space_map_phys_t))
+		return (0);
+	return (sm->sm_phys->smp_flushed_txg);
+}
+
+void
+space_map_set_flushed_txg(space_map_t *sm, uint64_t txg, dmu_tx_t *tx)
+{
+	ASSERT(dmu_tx_is_syncing(tx));
+	VERIFY3U(sm->sm_dbuf->db_size, ==, sizeof (space_map_phys_t));
+
+	dmu_buf_will_dirty(sm->sm_dbuf, tx);
+	sm->sm_phys->smp_flushed_txg = txg;
+}
+
 /*
  * Returns the allocated space that is currently syncing.
  */
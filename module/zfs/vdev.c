@@ -32,6 +32,7 @@
 #include <sys/dmu.h>
 #include <sys/dmu_tx.h>
 #include <sys/vdev_impl.h>
+#include <sys/vdev_trim.h>
 #include <sys/uberblock_impl.h>
 #include <sys/metaslab.h>
 #include <sys/metaslab_impl.h>
@@ -39,6 +40,7 @@
 #include <sys/space_reftree.h>
 #include <sys/zio.h>
 #include <sys/zap.h>
+#include <sys/zfeature.h>
 #include <sys/fs/zfs.h>
 #include <sys/arc.h>
 #include <sys/zil.h>
@@ -67,6 +69,7 @@ static vdev_ops_t *vdev_ops_table[] = {
 	&vdev_file_ops,
 	&vdev_missing_ops,
 	&vdev_hole_ops,
+	&vdev_indirect_ops,
 	NULL
 };
 
@@ -90,20 +93,56 @@ vdev_getops(const char *type)
  * all children.  This is what's used by anything other than RAID-Z.
  */
 uint64_t
-vdev_default_asize(vdev_t *vd, uint64_t psize)
+vdev_default_asize(vdev_t *vd, uint64_t psize, uint64_t txg)
 {
 	uint64_t asize = P2ROUNDUP(psize, 1ULL << vd->vdev_top->vdev_ashift);
 	uint64_t csize;
 	int c;
 
 	for (c = 0; c < vd->vdev_children; c++) {
-		csize = vdev_psize_to_asize(vd->vdev_child[c], psize);
+		csize = vdev_psize_to_asize_txg(vd->vdev_child[c], psize, txg);
 		asize = MAX(asize, csize);
 	}
 
 	return (asize);
 }
 
+/*
+ * Default translation function: the range of a child is the same as that
+ * of its parent.  This is what's used by anything other than RAID-Z.
+ */
+/* ARGSUSED */
+void
+vdev_default_xlate(vdev_t *vd, const range_seg_t *in, range_seg_t *res)
+{
+	res->rs_start = in->rs_start;
+	res->rs_end = in->rs_end;
+}
+
+/*
+ * Translate a logical range of the top-level vdev of leaf vd into the
+ * range of vd it is stored on, applying the translation of each vdev on
+ * the way down.  The result does not include the front labels.
+ */
+void
+vdev_xlate(vdev_t *vd, const range_seg_t *logical_rs, range_seg_t *physical_rs)
+{
+	vdev_t *pvd = vd->vdev_parent;
+	range_seg_t intermediate;
+
+	if (vd == vd->vdev_top) {
+		physical_rs->rs_start = logical_rs->rs_start;
+		physical_rs->rs_end = logical_rs->rs_end;
+		return;
+	}
+
+	ASSERT3P(pvd, !=, NULL);
+	ASSERT3P(pvd->vdev_ops->vdev_op_xlate, !=, NULL);
+
+	vdev_xlate(pvd, logical_rs, &intermediate);
+	pvd->vdev_ops->vdev_op_xlate(vd, &intermediate, physical_rs);
+}
+
 /*
  * Get the minimum allocatable size. We define the allocatable size as
  * the vdev's asize rounded to the nearest metaslab. This allows us to
@@ -131,10 +170,13 @@ vdev_get_min_asize(vdev_t *vd)
 
 	/*
 	 * The allocatable space for a raidz vdev is N * sizeof(smallest child),
-	 * so each child must provide at least 1/Nth of its asize.
+	 * so each child must provide at least 1/Nth of its asize.  The child
+	 * being added to an expanding raidz vdev isn't counted in N yet.
 	 */
-	if (pvd->vdev_ops == &vdev_raidz_ops)
-		return (pvd->vdev_min_asize / pvd->vdev_children);
+	if (pvd->vdev_ops == &vdev_raidz_ops) {
+		return (pvd->vdev_min_asize / (pvd->vdev_children -
+		    (pvd->vdev_rz_expanding != 0 ? 1 : 0)));
+	}
 
 	return (pvd->vdev_min_asize);
 }
@@ -362,6 +404,13 @@ vdev_alloc_common(spa_t *spa, uint_t id, uint64_t guid, vdev_ops_t *ops)
 	mutex_init(&vd->vdev_stat_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&vd->vdev_probe_lock, NULL, MUTEX_DEFAULT, NULL);
 	mutex_init(&vd->vdev_queue_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&vd->vdev_scan_io_queue_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&vd->vdev_trim_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&vd->vdev_trim_cv, NULL, CV_DEFAULT, NULL);
+	rw_init(&vd->vdev_indirect_rwlock, NULL, RW_DEFAULT, NULL);
+	mutex_init(&vd->vdev_obsolete_lock, NULL, MUTEX_DEFAULT, NULL);
+	vd->vdev_obsolete_segments = range_tree_create(NULL, NULL,
+	    &vd->vdev_obsolete_lock);
 
 	for (t = 0; t < DTL_TYPES; t++) {
 		vd->vdev_dtl[t] = range_tree_create(NULL, NULL,
@@ -388,8 +437,11 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
     int alloctype)
 {
 	vdev_ops_t *ops;
-	char *type;
+	char *type, *bias;
 	uint64_t guid = 0, islog, nparity;
+	uint64_t *widths;
+	uint_t nwidths;
+	vdev_alloc_bias_t alloc_bias = VDEV_BIAS_NONE;
 	vdev_t *vd;
 
 	ASSERT(spa_config_held(spa, SCL_ALL, RW_WRITER) == SCL_ALL);
@@ -441,6 +493,26 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 	if (ops == &vdev_hole_ops && spa_version(spa) < SPA_VERSION_HOLES)
 		return (SET_ERROR(ENOTSUP));
 
+	/*
+	 * Determine whether the vdev belongs to an allocation class.  Only
+	 * top-level vdevs which are not logs may, and adding one to an
+	 * existing pool requires the feature.  spa_create() checks the
+	 * feature for new pools, whose features are not yet enabled here.
+	 */
+	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+	    &bias) == 0) {
+		if (strcmp(bias, VDEV_ALLOC_BIAS_SPECIAL) != 0)
+			return (SET_ERROR(EINVAL));
+		if (islog || parent == NULL || parent->vdev_parent != NULL)
+			return (SET_ERROR(EINVAL));
+		if (alloctype == VDEV_ALLOC_ADD &&
+		    spa->spa_load_state != SPA_LOAD_CREATE &&
+		    !spa_feature_is_enabled(spa,
+		    SPA_FEATURE_ALLOCATION_CLASSES))
+			return (SET_ERROR(ENOTSUP));
+		alloc_bias = VDEV_BIAS_SPECIAL;
+	}
+
 	/*
 	 * Set the nparity property for RAID-Z vdevs.
 	 */
@@ -480,6 +552,7 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 	vd = vdev_alloc_common(spa, id, guid, ops);
 
 	vd->vdev_islog = islog;
+	vd->vdev_alloc_bias = alloc_bias;
 	vd->vdev_nparity = nparity;
 
 	if (nvlist_lookup_string(nv, ZPOOL_CONFIG_PATH, &vd->vdev_path) == 0)
@@ -538,6 +611,22 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 		    &vd->vdev_removing);
 		(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_VDEV_TOP_ZAP,
 		    &vd->vdev_top_zap);
+		(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_INDIRECT_OBJECT,
+		    &vd->vdev_im_object);
+		(void) nvlist_lookup_uint64(nv,
+		    ZPOOL_CONFIG_INDIRECT_OBSOLETE_SM,
+		    &vd->vdev_obsolete_sm_object);
+		(void) nvlist_lookup_uint64(nv, ZPOOL_CONFIG_RAIDZ_EXPANDING,
+		    &vd->vdev_rz_expanding);
+		if (nvlist_lookup_uint64_array(nv,
+		    ZPOOL_CONFIG_RAIDZ_EXPAND_TXGS, &widths, &nwidths) == 0 &&
+		    nwidths >= 2) {
+			vd->vdev_rz_nwidths = nwidths / 2;
+			vd->vdev_rz_widths = kmem_alloc(vd->vdev_rz_nwidths *
+			    2 * sizeof (uint64_t), KM_SLEEP);
+			bcopy(widths, vd->vdev_rz_widths,
+			    vd->vdev_rz_nwidths * 2 * sizeof (uint64_t));
+		}
 	} else {
 		ASSERT0(vd->vdev_top_zap);
 	}
@@ -547,8 +636,13 @@ vdev_alloc(spa_t *spa, vdev_t **vdp, nvlist_t *nv, vdev_t *parent, uint_t id,
 		    alloctype == VDEV_ALLOC_ADD ||
 		    alloctype == VDEV_ALLOC_SPLIT ||
 		    alloctype == VDEV_ALLOC_ROOTPOOL);
-		vd->vdev_mg = metaslab_group_create(islog ?
-		    spa_log_class(spa) : spa_normal_class(spa), vd);
+		metaslab_class_t *mc = spa_normal_class(spa);
+
+		if (islog)
+			mc = spa_log_class(spa);
+		else if (alloc_bias == VDEV_BIAS_SPECIAL)
+			mc = spa_special_class(spa);
+		vd->vdev_mg = metaslab_group_create(mc, vd);
 	}
 
 	if (vd->vdev_ops->vdev_op_leaf &&
@@ -630,6 +724,12 @@ vdev_free(vdev_t *vd)
 	int c, t;
 	spa_t *spa = vd->vdev_spa;
 
+	/*
+	 * Stop any TRIM of this part of the vdev tree, and wait for its I/O
+	 * to drain before closing the devices.
+	 */
+	vdev_trim_stop_all(vd, VDEV_TRIM_CANCELED);
+
 	/*
 	 * vdev_free() implies closing the vdev first.  This is simpler than
 	 * trying to ensure complicated semantics for all callers.
@@ -660,6 +760,21 @@ vdev_free(vdev_t *vd)
 	ASSERT0(vd->vdev_stat.vs_dspace);
 	ASSERT0(vd->vdev_stat.vs_alloc);
 
+	/*
+	 * Discard the indirect mapping, if any.
+	 */
+	vdev_indirect_unload(vd);
+
+	/*
+	 * Discard any scrub/resilver I/O still queued for this vdev.
+	 */
+	mutex_enter(&vd->vdev_scan_io_queue_lock);
+	if (vd->vdev_scan_io_queue != NULL) {
+		dsl_scan_io_queue_destroy(vd->vdev_scan_io_queue);
+		vd->vdev_scan_io_queue = NULL;
+	}
+	mutex_exit(&vd->vdev_scan_io_queue_lock);
+
 	/*
 	 * Remove this vdev from its parent's child list.
 	 */
@@ -686,6 +801,11 @@ vdev_free(vdev_t *vd)
 	if (vd->vdev_fru)
 		spa_strfree(vd->vdev_fru);
 
+	if (vd->vdev_rz_widths != NULL) {
+		kmem_free(vd->vdev_rz_widths,
+		    vd->vdev_rz_nwidths * 2 * sizeof (uint64_t));
+	}
+
 	if (vd->vdev_isspare)
 		spa_spare_remove(vd);
 	if (vd->vdev_isl2cache)
@@ -702,7 +822,17 @@ vdev_free(vdev_t *vd)
 	}
 	mutex_exit(&vd->vdev_dtl_lock);
 
+	mutex_enter(&vd->vdev_obsolete_lock);
+	range_tree_vacate(vd->vdev_obsolete_segments, NULL, NULL);
+	range_tree_destroy(vd->vdev_obsolete_segments);
+	mutex_exit(&vd->vdev_obsolete_lock);
+
 	mutex_destroy(&vd->vdev_queue_lock);
+	mutex_destroy(&vd->vdev_scan_io_queue_lock);
+	mutex_destroy(&vd->vdev_trim_lock);
+	cv_destroy(&vd->vdev_trim_cv);
+	rw_destroy(&vd->vdev_indirect_rwlock);
+	mutex_destroy(&vd->vdev_obsolete_lock);
 	mutex_destroy(&vd->vdev_dtl_lock);
 	mutex_destroy(&vd->vdev_stat_lock);
 	mutex_destroy(&vd->vdev_probe_lock);
@@ -778,8 +908,43 @@ vdev_top_transfer(vdev_t *svd, vdev_t *tvd)
 	tvd->vdev_deflate_ratio = svd->vdev_deflate_ratio;
 	svd->vdev_deflate_ratio = 0;
 
+	dsl_scan_io_queue_vdev_xfer(svd, tvd);
+
 	tvd->vdev_islog = svd->vdev_islog;
 	svd->vdev_islog = 0;
+
+	tvd->vdev_alloc_bias = svd->vdev_alloc_bias;
+	svd->vdev_alloc_bias = VDEV_BIAS_NONE;
+
+	tvd->vdev_removing = svd->vdev_removing;
+	svd->vdev_removing = 0;
+
+	/*
+	 * The indirect mapping of a vdev being removed, and the ranges freed
+	 * since they were copied, move along with its metaslabs.
+	 */
+	rw_enter(&svd->vdev_indirect_rwlock, RW_WRITER);
+	rw_enter(&tvd->vdev_indirect_rwlock, RW_WRITER);
+	tvd->vdev_im_object = svd->vdev_im_object;
+	tvd->vdev_indirect_mapping = svd->vdev_indirect_mapping;
+	svd->vdev_im_object = 0;
+	svd->vdev_indirect_mapping = NULL;
+	rw_exit(&tvd->vdev_indirect_rwlock);
+	rw_exit(&svd->vdev_indirect_rwlock);
+
+	mutex_enter(&svd->vdev_obsolete_lock);
+	mutex_enter(&tvd->vdev_obsolete_lock);
+	ASSERT0(range_tree_space(tvd->vdev_obsolete_segments));
+	range_tree_vacate(svd->vdev_obsolete_segments, range_tree_add,
+	    tvd->vdev_obsolete_segments);
+	tvd->vdev_obsolete_sm = svd->vdev_obsolete_sm;
+	tvd->vdev_obsolete_sm_object = svd->vdev_obsolete_sm_object;
+	svd->vdev_obsolete_sm = NULL;
+	svd->vdev_obsolete_sm_object = 0;
+	if (tvd->vdev_obsolete_sm != NULL)
+		tvd->vdev_obsolete_sm->sm_lock = &tvd->vdev_obsolete_lock;
+	mutex_exit(&tvd->vdev_obsolete_lock);
+	mutex_exit(&svd->vdev_obsolete_lock);
 }
 
 static void
@@ -909,9 +1074,12 @@ vdev_metaslab_init(vdev_t *vd, uint64_t txg)
 	 * in 128k (1 << 17) because it is the "typical" blocksize.
 	 * Even though SPA_MAXBLOCKSIZE changed, this algorithm can not change,
 	 * otherwise it would inconsistently account for existing bp's.
+	 * For the same reason an expanded RAID-Z vdev keeps the ratio of
+	 * the width it was created with.
 	 */
 	vd->vdev_deflate_ratio = (1 << 17) /
-	    (vdev_psize_to_asize(vd, 1 << 17) >> SPA_MINBLOCKSHIFT);
+	    (vdev_psize_to_asize_txg(vd, 1 << 17, TXG_INITIAL) >>
+	    SPA_MINBLOCKSHIFT);
 
 	ASSERT(oldc <= newc);
 
@@ -1875,7 +2043,8 @@ vdev_dtl_reassess(vdev_t *vd, uint64_t txg, uint64_t scrub_txg, int scrub_done)
 		vdev_dtl_reassess(vd->vdev_child[c], txg,
 		    scrub_txg, scrub_done);
 
-	if (vd == spa->spa_root_vdev || vd->vdev_ishole || vd->vdev_aux)
+	if (vd == spa->spa_root_vdev || vd->vdev_ishole || vd->vdev_aux ||
+	    vd->vdev_ops == &vdev_indirect_ops)
 		return;
 
 	if (vd->vdev_ops->vdev_op_leaf) {
@@ -2225,16 +2394,21 @@ vdev_resilver_needed(vdev_t *vd, uint64_t *minp, uint64_t *maxp)
 	return (needed);
 }
 
-void
-vdev_load(vdev_t *vd)
+/*
+ * Read the on-disk state of a vdev and its children: the metaslabs of a
+ * top-level vdev and the DTL of a leaf.  Failures are only recorded in
+ * vdev_load_error, as this may run concurrently for several top-level
+ * vdevs while vdev_set_state() propagates state up the tree.
+ */
+static void
+vdev_load_impl(vdev_t *vd)
 {
 	int c;
 
-	/*
-	 * Recursively load all children.
-	 */
 	for (c = 0; c < vd->vdev_children; c++)
-		vdev_load(vd->vdev_child[c]);
+		vdev_load_impl(vd->vdev_child[c]);
+
+	vd->vdev_load_error = 0;
 
 	/*
 	 * If this is a top-level vdev, initialize its metaslabs.
@@ -2242,16 +2416,76 @@ vdev_load(vdev_t *vd)
 	if (vd == vd->vdev_top && !vd->vdev_ishole &&
 	    (vd->vdev_ashift == 0 || vd->vdev_asize == 0 ||
 	    vdev_metaslab_init(vd, 0) != 0))
-		vdev_set_state(vd, B_FALSE, VDEV_STATE_CANT_OPEN,
-		    VDEV_AUX_CORRUPT_DATA);
+		vd->vdev_load_error = SET_ERROR(EIO);
 	/*
 	 * If this is a leaf vdev, load its DTL.
 	 */
 	if (vd->vdev_ops->vdev_op_leaf && vdev_dtl_load(vd) != 0)
+		vd->vdev_load_error = SET_ERROR(EIO);
+}
+
+static void
+vdev_load_child(void *arg)
+{
+	vdev_t *vd = arg;
+
+	vdev_load_impl(vd);
+}
+
+/*
+ * Mark the vdevs that failed to load, children first.
+ */
+static void
+vdev_load_set_state(vdev_t *vd)
+{
+	int c;
+
+	for (c = 0; c < vd->vdev_children; c++)
+		vdev_load_set_state(vd->vdev_child[c]);
+
+	if (vd->vdev_load_error != 0)
 		vdev_set_state(vd, B_FALSE, VDEV_STATE_CANT_OPEN,
 		    VDEV_AUX_CORRUPT_DATA);
 }
 
+/*
+ * Load the vdev state of vd and its children.  On large pools most of the
+ * import time is spent here reading space map headers and DTLs, so when
+ * loading the whole pool each top-level vdev is loaded in its own thread.
+ */
+void
+vdev_load(vdev_t *vd)
+{
+	taskq_t *tq;
+	int children = vd->vdev_children;
+	int c;
+
+	/*
+	 * As in vdev_open_children(), do everything in this thread for
+	 * pools on top of zvols.
+	 */
+	if (vd != vd->vdev_spa->spa_root_vdev || children < 2 ||
+	    vdev_uses_zvols(vd)) {
+retry_sync:
+		vdev_load_impl(vd);
+	} else {
+		tq = taskq_create("vdev_load", children, minclsyspri,
+		    children, children, TASKQ_PREPOPULATE);
+		if (tq == NULL)
+			goto retry_sync;
+
+		for (c = 0; c < children; c++)
+			VERIFY(taskq_dispatch(tq, vdev_load_child,
+			    vd->vdev_child[c], TQ_SLEEP) != TASKQID_INVALID);
+
+		taskq_destroy(tq);
+
+		vd->vdev_load_error = 0;
+	}
+
+	vdev_load_set_state(vd);
+}
+
 /*
  * The special vdev case is used for hot spares and l2cache devices.  Its
  * sole purpose it to set the vdev state for the associated vdev.  To do this,
@@ -2328,7 +2562,7 @@ vdev_remove(vdev_t *vd, uint64_t txg)
 			 */
 			metaslab_group_histogram_remove(mg, msp);
 
-			VERIFY0(space_map_allocated(msp->ms_sm));
+			VERIFY0(msp->ms_allocated_space);
 			space_map_free(msp->ms_sm, tx);
 			space_map_close(msp->ms_sm);
 			msp->ms_sm = NULL;
@@ -2386,13 +2620,32 @@ vdev_sync(vdev_t *vd, uint64_t txg)
 		    DMU_OT_OBJECT_ARRAY, 0, DMU_OT_NONE, 0, tx);
 		ASSERT(vd->vdev_ms_array != 0);
 		vdev_config_dirty(vd);
+		/*
+		 * The feature counts the allocation class vdevs in the pool;
+		 * this is the first txg in which a new one is synced.
+		 */
+		if (vd->vdev_alloc_bias != VDEV_BIAS_NONE)
+			spa_feature_incr(spa, SPA_FEATURE_ALLOCATION_CLASSES,
+			    tx);
+		dmu_tx_commit(tx);
+	}
+
+	/*
+	 * Record the ranges of an indirect vdev which were freed in this txg.
+	 */
+	if (vd->vdev_indirect_mapping != NULL) {
+		tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+		vdev_indirect_sync_obsolete(vd, tx);
 		dmu_tx_commit(tx);
 	}
 
 	/*
-	 * Remove the metadata associated with this vdev once it's empty.
+	 * Remove the metadata associated with a log device once it's empty.
+	 * Other top-level vdevs are removed by copying their data away, see
+	 * vdev_removal.c.
 	 */
-	if (vd->vdev_stat.vs_alloc == 0 && vd->vdev_removing)
+	if (vd->vdev_stat.vs_alloc == 0 && vd->vdev_removing &&
+	    vd->vdev_islog)
 		vdev_remove(vd, txg);
 
 	while ((msp = txg_list_remove(&vd->vdev_ms_list, txg)) != NULL) {
@@ -2406,10 +2659,22 @@ vdev_sync(vdev_t *vd, uint64_t txg)
 	(void) txg_list_add(&spa->spa_vdev_txg_list, vd, TXG_CLEAN(txg));
 }
 
+/*
+ * Return the allocated size of a block of psize bytes born in the given
+ * txg.  The layout of a RAID-Z vdev depends on its width at the time the
+ * block was written (see vdev_raidz_logical_width()); a txg of 0 asks for
+ * the size of a block written now.
+ */
+uint64_t
+vdev_psize_to_asize_txg(vdev_t *vd, uint64_t psize, uint64_t txg)
+{
+	return (vd->vdev_ops->vdev_op_asize(vd, psize, txg));
+}
+
 uint64_t
 vdev_psize_to_asize(vdev_t *vd, uint64_t psize)
 {
-	return (vd->vdev_ops->vdev_op_asize(vd, psize));
+	return (vdev_psize_to_asize_txg(vd, psize, 0));
 }
 
 /*
@@ -2740,6 +3005,19 @@ vdev_clear(spa_t *spa, vdev_t *vd)
 		vd->vdev_unspare = B_TRUE;
 }
 
+/*
+ * Return B_TRUE if the vdev has storage of its own, i.e. it is not the root,
+ * a hole, a missing device, or a removed (indirect) vdev.
+ */
+boolean_t
+vdev_is_concrete(vdev_t *vd)
+{
+	vdev_ops_t *ops = vd->vdev_ops;
+
+	return (ops != &vdev_indirect_ops && ops != &vdev_hole_ops &&
+	    ops != &vdev_missing_ops && ops != &vdev_root_ops);
+}
+
 boolean_t
 vdev_is_dead(vdev_t *vd)
 {
@@ -2780,7 +3058,7 @@ vdev_allocatable(vdev_t *vd)
 	 * we're asking two separate questions about it.
 	 */
 	return (!(state < VDEV_STATE_DEGRADED && state != VDEV_STATE_CLOSED) &&
-	    !vd->vdev_cant_write && !vd->vdev_ishole &&
+	    !vd->vdev_cant_write && vdev_is_concrete(vd) &&
 	    vd->vdev_mg->mg_initialized);
 }
 
@@ -2805,7 +3083,7 @@ static void
 vdev_get_child_stat(vdev_t *cvd, vdev_stat_t *vs, vdev_stat_t *cvs)
 {
 	int t;
-	for (t = 0; t < ZIO_TYPES; t++) {
+	for (t = 0; t < VS_ZIO_TYPES; t++) {
 		vs->vs_ops[t] += cvs->vs_ops[t];
 		vs->vs_bytes[t] += cvs->vs_bytes[t];
 	}
@@ -2906,12 +3184,17 @@ vdev_get_stats_ex(vdev_t *vd, vdev_stat_t *vs, vdev_stat_ex_t *vsx)
 		vs->vs_timestamp = gethrtime() - vs->vs_timestamp;
 		vs->vs_state = vd->vdev_state;
 		vs->vs_rsize = vdev_get_min_asize(vd);
-		if (vd->vdev_ops->vdev_op_leaf)
+		if (vd->vdev_ops->vdev_op_leaf) {
 			vs->vs_rsize += VDEV_LABEL_START_SIZE +
 			    VDEV_LABEL_END_SIZE;
+			vs->vs_trim_state = vd->vdev_trim_state;
+			vs->vs_trim_action_time = vd->vdev_trim_action_time;
+			vs->vs_trim_bytes_done = vd->vdev_trim_bytes_done;
+			vs->vs_trim_bytes_est = vd->vdev_trim_bytes_est;
+		}
 		vs->vs_esize = vd->vdev_max_asize - vd->vdev_asize;
 		if (vd->vdev_aux == NULL && vd == vd->vdev_top &&
-		    !vd->vdev_ishole) {
+		    vd->vdev_mg != NULL) {
 			vs->vs_fragmentation = vd->vdev_mg->mg_fragmentation;
 		}
 	}
@@ -3017,6 +3300,12 @@ vdev_stat_update(zio_t *zio, uint64_t psize)
 		 */
 		if (vd->vdev_ops->vdev_op_leaf &&
 		    (zio->io_priority < ZIO_PRIORITY_NUM_QUEUEABLE)) {
+			/*
+			 * vdev_stat_t has no room for TRIM, which is
+			 * accounted as an ioctl instead.
+			 */
+			if (type == ZIO_TYPE_TRIM)
+				type = ZIO_TYPE_IOCTL;
 
 			vs->vs_ops[type]++;
 			vs->vs_bytes[type] += psize;
@@ -3150,7 +3439,7 @@ vdev_space_update(vdev_t *vd, int64_t alloc_delta, int64_t defer_delta,
 	vd->vdev_stat.vs_dspace += dspace_delta;
 	mutex_exit(&vd->vdev_stat_lock);
 
-	if (mc == spa_normal_class(spa)) {
+	if (mc == spa_normal_class(spa) || mc == spa_special_class(spa)) {
 		mutex_enter(&rvd->vdev_stat_lock);
 		rvd->vdev_stat.vs_alloc += alloc_delta;
 		rvd->vdev_stat.vs_space += space_delta;
@@ -28,6 +28,7 @@
 
 #include <sys/zfs_context.h>
 #include <sys/spa.h>
+#include <sys/spa_impl.h>
 #include <sys/vdev_disk.h>
 #include <sys/vdev_impl.h>
 #include <sys/abd.h>
@@ -322,6 +323,9 @@ skip_open:
 	/* Inform the ZIO pipeline that we are non-rotational */
 	v->vdev_nonrot = blk_queue_nonrot(bdev_get_queue(vd->vd_bdev));
 
+	/* Inform the ZIO pipeline that the device supports discard */
+	v->vdev_has_trim = blk_queue_discard(bdev_get_queue(vd->vd_bdev));
+
 	/* Physical volume size in bytes */
 	*psize = bdev_capacity(vd->vd_bdev);
 
@@ -661,6 +665,26 @@ vdev_disk_io_flush(struct block_device *bdev, zio_t *zio)
 	return (0);
 }
 
+/*
+ * blkdev_issue_discard() waits for the discard to complete, so it's issued
+ * from the TRIM taskq rather than from the context which started the zio.
+ */
+static void
+vdev_disk_io_trim(void *arg)
+{
+	zio_t *zio = arg;
+	vdev_disk_t *vd = zio->io_vd->vdev_tsd;
+
+	zio->io_error = -blkdev_issue_discard(vd->vd_bdev,
+	    zio->io_offset >> 9, zio->io_size >> 9, GFP_NOFS, 0);
+	if (zio->io_error == EOPNOTSUPP) {
+		zio->io_vd->vdev_has_trim = B_FALSE;
+		zio->io_error = SET_ERROR(ENOTSUP);
+	}
+
+	zio_interrupt(zio);
+}
+
 static void
 vdev_disk_io_start(zio_t *zio)
 {
@@ -726,6 +750,18 @@ vdev_disk_io_start(zio_t *zio)
 #endif
 		break;
 
+	case ZIO_TYPE_TRIM:
+		if (!v->vdev_has_trim) {
+			zio->io_error = SET_ERROR(ENOTSUP);
+			zio_interrupt(zio);
+			return;
+		}
+
+		spa_taskq_dispatch_ent(zio->io_spa, ZIO_TYPE_TRIM,
+		    ZIO_TASKQ_ISSUE, vdev_disk_io_trim, zio, 0,
+		    &zio->io_tqent);
+		return;
+
 	default:
 		zio->io_error = SET_ERROR(ENOTSUP);
 		zio_interrupt(zio);
@@ -800,6 +836,7 @@ vdev_ops_t vdev_disk_ops = {
 	NULL,
 	vdev_disk_hold,
 	vdev_disk_rele,
+	vdev_default_xlate,
 	VDEV_TYPE_DISK,		/* name of this vdev type */
 	B_TRUE			/* leaf vdev */
 };
@@ -39,6 +39,17 @@
 
 static taskq_t *vdev_file_taskq;
 
+/*
+ * The maximum number of taskq threads issuing reads and writes to a single
+ * file vdev at once. Each of them keeps draining the queue of the vdev until
+ * it is empty, and another one is started whenever more I/Os are queued
+ * than there are idle threads to pick them up.
+ */
+int zfs_vdev_file_max_workers = 16;
+
+/* Initial number of slots in the queue of a file vdev, a power of 2 */
+#define	VDEV_FILE_QUEUE_SIZE	64
+
 static void
 vdev_file_hold(vdev_t *vd)
 {
@@ -63,6 +74,13 @@ vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *max_psize,
 	/* Rotational optimizations only make sense on block devices */
 	vd->vdev_nonrot = B_TRUE;
 
+	/*
+	 * TRIM is implemented by punching holes in the file.  Filesystems
+	 * which can't do that fail the request with EOPNOTSUPP, after which
+	 * the vdev is no longer trimmed.
+	 */
+	vd->vdev_has_trim = B_TRUE;
+
 	/*
 	 * We must have a pathname, and it must be absolute.
 	 */
@@ -82,6 +100,11 @@ vdev_file_open(vdev_t *vd, uint64_t *psize, uint64_t *max_psize,
 	}
 
 	vf = vd->vdev_tsd = kmem_zalloc(sizeof (vdev_file_t), KM_SLEEP);
+	mutex_init(&vf->vf_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&vf->vf_cv, NULL, CV_DEFAULT, NULL);
+	vf->vf_queue_size = VDEV_FILE_QUEUE_SIZE;
+	vf->vf_queue = kmem_alloc(vf->vf_queue_size * sizeof (zio_t *),
+	    KM_SLEEP);
 
 	/*
 	 * We always open the files from the root of the global zone, even if
@@ -135,6 +158,12 @@ vdev_file_close(vdev_t *vd)
 	if (vd->vdev_reopening || vf == NULL)
 		return;
 
+	/* Wait for the last worker to finish with the queue */
+	mutex_enter(&vf->vf_lock);
+	while (vf->vf_workers != 0)
+		cv_wait(&vf->vf_cv, &vf->vf_lock);
+	mutex_exit(&vf->vf_lock);
+
 	if (vf->vf_vnode != NULL) {
 		(void) VOP_PUTPAGE(vf->vf_vnode, 0, 0, B_INVAL, kcred, NULL);
 		(void) VOP_CLOSE(vf->vf_vnode, spa_mode(vd->vdev_spa), 1, 0,
@@ -142,16 +171,17 @@ vdev_file_close(vdev_t *vd)
 	}
 
 	vd->vdev_delayed_close = B_FALSE;
+	ASSERT0(vf->vf_queue_count);
+	kmem_free(vf->vf_queue, vf->vf_queue_size * sizeof (zio_t *));
+	cv_destroy(&vf->vf_cv);
+	mutex_destroy(&vf->vf_lock);
 	kmem_free(vf, sizeof (vdev_file_t));
 	vd->vdev_tsd = NULL;
 }
 
 static void
-vdev_file_io_strategy(void *arg)
+vdev_file_io_strategy(vdev_file_t *vf, zio_t *zio)
 {
-	zio_t *zio = (zio_t *)arg;
-	vdev_t *vd = zio->io_vd;
-	vdev_file_t *vf = vd->vdev_tsd;
 	ssize_t resid;
 	void *buf;
 
@@ -175,6 +205,96 @@ vdev_file_io_strategy(void *arg)
 	zio_delay_interrupt(zio);
 }
 
+/*
+ * Issue the reads and writes queued on a file vdev, until there are none
+ * left.  Up to zfs_vdev_file_max_workers of these run per vdev, and each
+ * picks up whatever has been queued while it was busy, so once they are all
+ * busy the I/Os queued behind them cost no taskq dispatches at all.
+ */
+static void
+vdev_file_io_worker(void *arg)
+{
+	vdev_file_t *vf = arg;
+	zio_t *zio;
+
+	mutex_enter(&vf->vf_lock);
+	while (vf->vf_queue_count != 0) {
+		zio = vf->vf_queue[vf->vf_queue_head];
+		vf->vf_queue_head = (vf->vf_queue_head + 1) &
+		    (vf->vf_queue_size - 1);
+		vf->vf_queue_count--;
+		vf->vf_busy++;
+		mutex_exit(&vf->vf_lock);
+		vdev_file_io_strategy(vf, zio);
+		mutex_enter(&vf->vf_lock);
+		vf->vf_busy--;
+	}
+	if (--vf->vf_workers == 0)
+		cv_broadcast(&vf->vf_cv);
+	mutex_exit(&vf->vf_lock);
+}
+
+/*
+ * Double the size of the queue, unwrapping the ring into the new one.  The
+ * new ring is allocated with vf_lock dropped, so the queue may have been
+ * grown or drained in the meantime and the caller has to check again.
+ */
+static void
+vdev_file_queue_grow(vdev_file_t *vf)
+{
+	uint_t size = vf->vf_queue_size;
+	zio_t **queue;
+	uint_t i;
+
+	ASSERT(MUTEX_HELD(&vf->vf_lock));
+
+	mutex_exit(&vf->vf_lock);
+	queue = kmem_alloc(2 * size * sizeof (zio_t *), KM_SLEEP);
+	mutex_enter(&vf->vf_lock);
+
+	if (vf->vf_queue_size != size) {
+		kmem_free(queue, 2 * size * sizeof (zio_t *));
+		return;
+	}
+
+	for (i = 0; i < vf->vf_queue_count; i++)
+		queue[i] = vf->vf_queue[(vf->vf_queue_head + i) & (size - 1)];
+	kmem_free(vf->vf_queue, size * sizeof (zio_t *));
+
+	vf->vf_queue = queue;
+	vf->vf_queue_size = 2 * size;
+	vf->vf_queue_head = 0;
+}
+
+static void
+vdev_file_io_queue(vdev_file_t *vf, zio_t *zio)
+{
+	boolean_t dispatch = B_FALSE;
+
+	mutex_enter(&vf->vf_lock);
+	while (vf->vf_queue_count == vf->vf_queue_size)
+		vdev_file_queue_grow(vf);
+	vf->vf_queue[(vf->vf_queue_head + vf->vf_queue_count) &
+	    (vf->vf_queue_size - 1)] = zio;
+	vf->vf_queue_count++;
+
+	/*
+	 * Workers which aren't issuing a zio are about to take one of the
+	 * queued ones; start another if that leaves any behind.
+	 */
+	if (vf->vf_workers - vf->vf_busy < vf->vf_queue_count &&
+	    vf->vf_workers < MAX(zfs_vdev_file_max_workers, 1)) {
+		vf->vf_workers++;
+		dispatch = B_TRUE;
+	}
+	mutex_exit(&vf->vf_lock);
+
+	if (dispatch) {
+		VERIFY3U(taskq_dispatch(vdev_file_taskq, vdev_file_io_worker,
+		    vf, TQ_SLEEP), !=, TASKQID_INVALID);
+	}
+}
+
 static void
 vdev_file_io_fsync(void *arg)
 {
@@ -186,6 +306,27 @@ vdev_file_io_fsync(void *arg)
 	zio_interrupt(zio);
 }
 
+static void
+vdev_file_io_trim(void *arg)
+{
+	zio_t *zio = (zio_t *)arg;
+	vdev_file_t *vf = zio->io_vd->vdev_tsd;
+	flock64_t flck;
+
+	bzero(&flck, sizeof (flck));
+	flck.l_type = F_FREESP;
+	flck.l_start = zio->io_offset;
+	flck.l_len = zio->io_size;
+	flck.l_whence = 0;
+
+	zio->io_error = VOP_SPACE(vf->vf_vnode, F_FREESP, &flck,
+	    0, 0, kcred, NULL);
+	if (zio->io_error == EOPNOTSUPP)
+		zio->io_error = SET_ERROR(ENOTSUP);
+
+	zio_interrupt(zio);
+}
+
 static void
 vdev_file_io_start(zio_t *zio)
 {
@@ -231,10 +372,15 @@ vdev_file_io_start(zio_t *zio)
 		return;
 	}
 
+	if (zio->io_type == ZIO_TYPE_TRIM) {
+		VERIFY3U(taskq_dispatch(vdev_file_taskq, vdev_file_io_trim,
+		    zio, TQ_SLEEP), !=, TASKQID_INVALID);
+		return;
+	}
+
 	zio->io_target_timestamp = zio_handle_io_delay(zio);
 
-	VERIFY3U(taskq_dispatch(vdev_file_taskq, vdev_file_io_strategy, zio,
-	    TQ_SLEEP), !=, TASKQID_INVALID);
+	vdev_file_io_queue(vf, zio);
 }
 
 /* ARGSUSED */
@@ -252,6 +398,7 @@ vdev_ops_t vdev_file_ops = {
 	NULL,
 	vdev_file_hold,
 	vdev_file_rele,
+	vdev_default_xlate,
 	VDEV_TYPE_FILE,		/* name of this vdev type */
 	B_TRUE			/* leaf vdev */
 };
@@ -285,8 +432,15 @@ vdev_ops_t vdev_disk_ops = {
 	NULL,
 	vdev_file_hold,
 	vdev_file_rele,
+	vdev_default_xlate,
 	VDEV_TYPE_DISK,		/* name of this vdev type */
 	B_TRUE			/* leaf vdev */
 };
 
 #endif
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+module_param(zfs_vdev_file_max_workers, int, 0644);
+MODULE_PARM_DESC(zfs_vdev_file_max_workers,
+	"Max threads issuing I/O to a single file vdev");
+#endif
@@ -0,0 +1,517 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/vdev_impl.h>
+#include <sys/fs/zfs.h>
+#include <sys/zio.h>
+#include <sys/abd.h>
+#include <sys/dmu_tx.h>
+#include <sys/space_map.h>
+#include <sys/range_tree.h>
+#include <sys/vdev_indirect_mapping.h>
+
+/*
+ * An indirect vdev is what remains of a top-level vdev after it has been
+ * removed (see vdev_removal.c).  It has no children and no metaslabs, only
+ * the indirect mapping, which tells where each allocated range of the
+ * removed vdev was copied to.  Block pointers are never rewritten, so any
+ * I/O to an indirect vdev is split up according to the mapping and issued
+ * as child I/Os to the top-level vdevs the data now lives on.
+ *
+ * When a block on an indirect vdev is freed, its new locations are freed
+ * as well, and its range is marked obsolete: it is added to the in-core
+ * vdev_obsolete_segments tree, which is appended to the vdev's obsolete
+ * space map in syncing context.  Once enough of the mapping is obsolete,
+ * the mapping is condensed by rewriting it without the obsolete ranges,
+ * which shrinks the memory it takes up while the pool is imported.
+ */
+
+/*
+ * Condense the mapping of an indirect vdev once at least this percentage
+ * of the bytes it maps is obsolete.
+ */
+int zfs_condense_indirect_obsolete_pct = 25;
+
+/*
+ * Don't bother condensing a mapping that takes up less memory than this.
+ */
+unsigned long zfs_condense_min_mapping_bytes = 128 * 1024;
+
+/*
+ * Enable or disable condensing of indirect mappings.
+ */
+int zfs_condense_indirect_vdevs_enable = B_TRUE;
+
+/* ARGSUSED */
+static int
+vdev_indirect_open(vdev_t *vd, uint64_t *psize, uint64_t *max_psize,
+    uint64_t *ashift)
+{
+	*psize = *max_psize = vd->vdev_asize +
+	    VDEV_LABEL_START_SIZE + VDEV_LABEL_END_SIZE;
+	*ashift = vd->vdev_ashift;
+	return (0);
+}
+
+/* ARGSUSED */
+static void
+vdev_indirect_close(vdev_t *vd)
+{
+}
+
+/*
+ * Call func for every range the range [offset, offset + size) of the
+ * indirect (or being removed) vdev was copied to, in order.  split_offset
+ * is the offset of that piece within the given range.  Fails without
+ * calling func at all if any part of the range is not mapped.
+ */
+int
+vdev_indirect_remap(vdev_t *vd, uint64_t offset, uint64_t size,
+    vdev_remap_cb_t *func, void *arg)
+{
+	spa_t *spa = vd->vdev_spa;
+	vdev_indirect_mapping_t *vim;
+	vdev_indirect_mapping_entry_phys_t *first, *vimep, *last;
+	uint64_t end = offset + size;
+	uint64_t cur;
+	int error = 0;
+
+	rw_enter(&vd->vdev_indirect_rwlock, RW_READER);
+
+	vim = vd->vdev_indirect_mapping;
+	if (vim == NULL) {
+		rw_exit(&vd->vdev_indirect_rwlock);
+		return (SET_ERROR(ENXIO));
+	}
+
+	first = vdev_indirect_mapping_entry_for_offset(vim, offset);
+	last = vim->vim_entries + vim->vim_entries_count;
+
+	for (cur = offset, vimep = first; cur < end; vimep++) {
+		if (vimep == NULL || vimep == last ||
+		    DVA_MAPPING_GET_SRC_OFFSET(vimep) > cur ||
+		    vdev_lookup_top(spa,
+		    DVA_GET_VDEV(&vimep->vimep_dst)) == NULL) {
+			error = SET_ERROR(EIO);
+			break;
+		}
+		cur = DVA_MAPPING_GET_SRC_OFFSET(vimep) +
+		    DVA_MAPPING_GET_SIZE(vimep);
+	}
+
+	for (cur = offset, vimep = first; error == 0 && cur < end; vimep++) {
+		uint64_t src = DVA_MAPPING_GET_SRC_OFFSET(vimep);
+		uint64_t len = MIN(src + DVA_MAPPING_GET_SIZE(vimep), end) -
+		    cur;
+		dva_t *dva = &vimep->vimep_dst;
+
+		func(arg, cur - offset,
+		    vdev_lookup_top(spa, DVA_GET_VDEV(dva)),
+		    DVA_GET_OFFSET(dva) + cur - src, len);
+		cur += len;
+	}
+
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	return (error);
+}
+
+static void
+vdev_indirect_child_io_done(zio_t *zio)
+{
+	zio_t *pio = zio->io_private;
+
+	mutex_enter(&pio->io_lock);
+	pio->io_error = zio_worst_error(pio->io_error, zio->io_error);
+	mutex_exit(&pio->io_lock);
+
+	abd_put(zio->io_abd);
+}
+
+static void
+vdev_indirect_child_io_start(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size)
+{
+	zio_t *zio = arg;
+	blkptr_t *bp = NULL;
+
+	/*
+	 * If the block was copied in one piece, let the vdev it was copied
+	 * to verify the checksum, so that a mirror can try its other sides.
+	 */
+	if (split_offset == 0 && size == zio->io_size)
+		bp = zio->io_bp;
+
+	zio_nowait(zio_vdev_child_io(zio, bp, vd, offset,
+	    abd_get_offset_size(zio->io_abd, split_offset, size), size,
+	    zio->io_type, zio->io_priority, 0,
+	    vdev_indirect_child_io_done, zio));
+}
+
+static void
+vdev_indirect_io_start(zio_t *zio)
+{
+	ASSERT(spa_config_held(zio->io_spa, SCL_ALL, RW_READER) != 0);
+
+	if (zio->io_type != ZIO_TYPE_READ && zio->io_type != ZIO_TYPE_WRITE) {
+		zio->io_error = SET_ERROR(ENOTSUP);
+	} else if (vdev_indirect_remap(zio->io_vd, zio->io_offset,
+	    zio->io_size, vdev_indirect_child_io_start, zio) != 0) {
+		zio->io_error = SET_ERROR(EIO);
+	}
+
+	zio_execute(zio);
+}
+
+/* ARGSUSED */
+static void
+vdev_indirect_io_done(zio_t *zio)
+{
+}
+
+/*
+ * Open the indirect mapping and the obsolete space map of a top-level
+ * vdev, as recorded in its config.
+ */
+int
+vdev_indirect_load(vdev_t *vd)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	vdev_indirect_mapping_t *vim;
+	int error;
+
+	ASSERT(vd == vd->vdev_top);
+
+	if (vd->vdev_im_object != 0 && vd->vdev_indirect_mapping == NULL) {
+		error = vdev_indirect_mapping_open(mos, vd->vdev_im_object,
+		    &vim);
+		if (error != 0)
+			return (error);
+
+		rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+		vd->vdev_indirect_mapping = vim;
+		rw_exit(&vd->vdev_indirect_rwlock);
+	}
+
+	if (vd->vdev_obsolete_sm_object != 0 && vd->vdev_obsolete_sm == NULL) {
+		space_map_t *sm = NULL;
+
+		error = space_map_open(&sm, mos, vd->vdev_obsolete_sm_object,
+		    0, vd->vdev_asize, vd->vdev_ashift,
+		    &vd->vdev_obsolete_lock);
+		if (error != 0)
+			return (error);
+
+		mutex_enter(&vd->vdev_obsolete_lock);
+		space_map_update(sm);
+		vd->vdev_obsolete_sm = sm;
+		mutex_exit(&vd->vdev_obsolete_lock);
+	}
+
+	return (0);
+}
+
+void
+vdev_indirect_unload(vdev_t *vd)
+{
+	vdev_indirect_mapping_t *vim;
+
+	rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+	vim = vd->vdev_indirect_mapping;
+	vd->vdev_indirect_mapping = NULL;
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	if (vim != NULL)
+		vdev_indirect_mapping_close(vim);
+
+	mutex_enter(&vd->vdev_obsolete_lock);
+	if (vd->vdev_obsolete_sm != NULL) {
+		vd->vdev_obsolete_sm_object =
+		    space_map_object(vd->vdev_obsolete_sm);
+		space_map_close(vd->vdev_obsolete_sm);
+		vd->vdev_obsolete_sm = NULL;
+	}
+	mutex_exit(&vd->vdev_obsolete_lock);
+}
+
+/*
+ * Record that a mapped range is no longer referenced.  It is written to
+ * the obsolete space map when txg syncs.
+ */
+void
+vdev_indirect_mark_obsolete(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg)
+{
+	ASSERT(vd == vd->vdev_top);
+	ASSERT(vd->vdev_indirect_mapping != NULL);
+
+	mutex_enter(&vd->vdev_obsolete_lock);
+	range_tree_add(vd->vdev_obsolete_segments, offset, size);
+	mutex_exit(&vd->vdev_obsolete_lock);
+
+	vdev_dirty(vd, 0, NULL, txg);
+}
+
+static boolean_t
+vdev_indirect_should_condense(vdev_t *vd)
+{
+	vdev_indirect_mapping_t *vim = vd->vdev_indirect_mapping;
+	uint64_t obsolete;
+
+	ASSERT(MUTEX_HELD(&vd->vdev_obsolete_lock));
+
+	if (!zfs_condense_indirect_vdevs_enable ||
+	    vd->vdev_ops != &vdev_indirect_ops || vim == NULL ||
+	    vd->vdev_obsolete_sm == NULL ||
+	    vdev_indirect_mapping_size(vim) < zfs_condense_min_mapping_bytes)
+		return (B_FALSE);
+
+	obsolete = space_map_allocated(vd->vdev_obsolete_sm);
+
+	return (obsolete != 0 && obsolete * 100 >=
+	    vdev_indirect_mapping_bytes_mapped(vim) *
+	    zfs_condense_indirect_obsolete_pct);
+}
+
+static void
+vdev_indirect_clear_cb(void *arg, uint64_t start, uint64_t size)
+{
+	range_tree_clear(arg, start, size);
+}
+
+/*
+ * Add the ranges mapped by the indirect mapping of vd which are not
+ * obsolete to live.  The ranges in vdev_obsolete_segments, which are not
+ * yet in the obsolete space map, are only left out if in_core is set.
+ */
+void
+vdev_indirect_live_ranges(vdev_t *vd, range_tree_t *live, boolean_t in_core)
+{
+	vdev_indirect_mapping_t *vim = vd->vdev_indirect_mapping;
+	uint64_t i;
+
+	ASSERT(MUTEX_HELD(&vd->vdev_obsolete_lock));
+
+	mutex_enter(live->rt_lock);
+	for (i = 0; i < vdev_indirect_mapping_num_entries(vim); i++) {
+		vdev_indirect_mapping_entry_phys_t *vimep =
+		    &vim->vim_entries[i];
+		range_tree_add(live, DVA_MAPPING_GET_SRC_OFFSET(vimep),
+		    DVA_MAPPING_GET_SIZE(vimep));
+	}
+	mutex_exit(live->rt_lock);
+
+	if (vd->vdev_obsolete_sm != NULL) {
+		range_tree_t *obsolete = range_tree_create(NULL, NULL,
+		    &vd->vdev_obsolete_lock);
+
+		VERIFY0(space_map_load(vd->vdev_obsolete_sm, obsolete,
+		    SM_ALLOC));
+		mutex_enter(live->rt_lock);
+		range_tree_walk(obsolete, vdev_indirect_clear_cb, live);
+		mutex_exit(live->rt_lock);
+		range_tree_vacate(obsolete, NULL, NULL);
+		range_tree_destroy(obsolete);
+	}
+
+	if (in_core) {
+		mutex_enter(live->rt_lock);
+		range_tree_walk(vd->vdev_obsolete_segments,
+		    vdev_indirect_clear_cb, live);
+		mutex_exit(live->rt_lock);
+	}
+}
+
+/*
+ * Rewrite the mapping without any of the ranges in the obsolete space
+ * map, whose new locations have already been freed.  Entries which are
+ * partially obsolete are split, so the new mapping has no obsolete bytes
+ * and the obsolete space map is freed.  Ranges which become obsolete in
+ * the meantime are still in vdev_obsolete_segments, and are written to a
+ * new obsolete space map by the next sync.
+ */
+static void
+vdev_indirect_condense(vdev_t *vd, dmu_tx_t *tx)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	vdev_indirect_mapping_t *vim = vd->vdev_indirect_mapping;
+	vdev_indirect_mapping_t *newvim, condensed;
+	range_tree_t *live;
+	range_seg_t *rs;
+	kmutex_t lock;
+	uint64_t i, old_count, object;
+
+	ASSERT(MUTEX_HELD(&vd->vdev_obsolete_lock));
+	ASSERT(dmu_tx_is_syncing(tx));
+
+	old_count = vdev_indirect_mapping_num_entries(vim);
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	live = range_tree_create(NULL, NULL, &lock);
+	vdev_indirect_live_ranges(vd, live, B_FALSE);
+
+	/*
+	 * Walk the entries and the live ranges side by side.  Both are
+	 * sorted by offset, and every live range lies within the entries.
+	 */
+	bzero(&condensed, sizeof (condensed));
+	mutex_enter(&lock);
+	rs = avl_first(&live->rt_root);
+	for (i = 0; i < old_count; i++) {
+		vdev_indirect_mapping_entry_phys_t *vimep =
+		    &vim->vim_entries[i];
+		uint64_t src = DVA_MAPPING_GET_SRC_OFFSET(vimep);
+		uint64_t end = src + DVA_MAPPING_GET_SIZE(vimep);
+		range_seg_t *r;
+
+		while (rs != NULL && rs->rs_end <= src)
+			rs = AVL_NEXT(&live->rt_root, rs);
+
+		for (r = rs; r != NULL && r->rs_start < end;
+		    r = AVL_NEXT(&live->rt_root, r)) {
+			uint64_t start = MAX(r->rs_start, src);
+			dva_t dva;
+
+			bzero(&dva, sizeof (dva));
+			DVA_SET_VDEV(&dva, DVA_GET_VDEV(&vimep->vimep_dst));
+			DVA_SET_OFFSET(&dva,
+			    DVA_GET_OFFSET(&vimep->vimep_dst) + start - src);
+			DVA_SET_ASIZE(&dva, MIN(r->rs_end, end) - start);
+			vdev_indirect_mapping_add_entry(&condensed, start, &dva);
+		}
+	}
+	range_tree_vacate(live, NULL, NULL);
+	mutex_exit(&lock);
+	range_tree_destroy(live);
+	mutex_destroy(&lock);
+
+	object = vdev_indirect_mapping_write(mos, condensed.vim_entries,
+	    condensed.vim_entries_count, tx);
+	if (condensed.vim_entries != NULL) {
+		vmem_free(condensed.vim_entries, condensed.vim_entries_alloc *
+		    sizeof (vdev_indirect_mapping_entry_phys_t));
+	}
+	VERIFY0(vdev_indirect_mapping_open(mos, object, &newvim));
+
+	zfs_dbgmsg("condensed indirect vdev %llu: %llu entries -> %llu",
+	    (u_longlong_t)vd->vdev_id, (u_longlong_t)old_count,
+	    (u_longlong_t)vdev_indirect_mapping_num_entries(newvim));
+
+	vdev_indirect_mapping_free(mos, vd->vdev_im_object, tx);
+	space_map_free(vd->vdev_obsolete_sm, tx);
+	space_map_close(vd->vdev_obsolete_sm);
+	vd->vdev_obsolete_sm = NULL;
+	vd->vdev_obsolete_sm_object = 0;
+
+	rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+	vd->vdev_indirect_mapping = newvim;
+	vd->vdev_im_object = object;
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	vdev_indirect_mapping_close(vim);
+	vdev_config_dirty(vd);
+}
+
+/*
+ * Append the ranges marked obsolete in this txg to the obsolete space map,
+ * creating it if needed, and condense the mapping if it's worthwhile.
+ */
+void
+vdev_indirect_sync_obsolete(vdev_t *vd, dmu_tx_t *tx)
+{
+	spa_t *spa = vd->vdev_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	range_tree_t *rt;
+
+	ASSERT(vd == vd->vdev_top);
+	ASSERT(dmu_tx_is_syncing(tx));
+
+	mutex_enter(&vd->vdev_obsolete_lock);
+	if (range_tree_space(vd->vdev_obsolete_segments) == 0) {
+		mutex_exit(&vd->vdev_obsolete_lock);
+		return;
+	}
+
+	if (vd->vdev_obsolete_sm == NULL) {
+		uint64_t object;
+
+		mutex_exit(&vd->vdev_obsolete_lock);
+		object = space_map_alloc(mos, tx);
+		mutex_enter(&vd->vdev_obsolete_lock);
+		VERIFY0(space_map_open(&vd->vdev_obsolete_sm, mos, object,
+		    0, vd->vdev_asize, vd->vdev_ashift,
+		    &vd->vdev_obsolete_lock));
+		space_map_update(vd->vdev_obsolete_sm);
+		vd->vdev_obsolete_sm_object = object;
+		vdev_config_dirty(vd);
+	}
+
+	/*
+	 * space_map_write() drops the lock while writing, so write out a
+	 * tree of our own while new obsolete ranges go to a fresh one.
+	 */
+	rt = range_tree_create(NULL, NULL, &vd->vdev_obsolete_lock);
+	range_tree_swap(&vd->vdev_obsolete_segments, &rt);
+	space_map_write(vd->vdev_obsolete_sm, rt, SM_ALLOC, tx);
+	range_tree_vacate(rt, NULL, NULL);
+	space_map_update(vd->vdev_obsolete_sm);
+
+	if (vdev_indirect_should_condense(vd))
+		vdev_indirect_condense(vd, tx);
+	mutex_exit(&vd->vdev_obsolete_lock);
+
+	range_tree_destroy(rt);
+}
+
+vdev_ops_t vdev_indirect_ops = {
+	vdev_indirect_open,
+	vdev_indirect_close,
+	vdev_default_asize,
+	vdev_indirect_io_start,
+	vdev_indirect_io_done,
+	NULL,
+	NULL,
+	NULL,
+	NULL,
+	VDEV_TYPE_INDIRECT,	/* name of this vdev type */
+	B_FALSE			/* not a leaf vdev */
+};
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(vdev_indirect_remap);
+EXPORT_SYMBOL(vdev_indirect_load);
+EXPORT_SYMBOL(vdev_indirect_unload);
+EXPORT_SYMBOL(vdev_indirect_mark_obsolete);
+EXPORT_SYMBOL(vdev_indirect_live_ranges);
+EXPORT_SYMBOL(vdev_indirect_sync_obsolete);
+
+module_param(zfs_condense_indirect_vdevs_enable, int, 0644);
+MODULE_PARM_DESC(zfs_condense_indirect_vdevs_enable,
+	"Whether to condense indirect vdev mappings");
+
+/* CSTYLED */
+module_param(zfs_condense_min_mapping_bytes, ulong, 0644);
+MODULE_PARM_DESC(zfs_condense_min_mapping_bytes,
+	"Minimum size of a vdev mapping to condense");
+
+module_param(zfs_condense_indirect_obsolete_pct, int, 0644);
+MODULE_PARM_DESC(zfs_condense_indirect_obsolete_pct,
+	"Minimum obsolete percent of a vdev mapping to condense");
+#endif
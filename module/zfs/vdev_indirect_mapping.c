@@ -0,0 +1,282 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/dmu_tx.h>
+#include <sys/dnode.h>
+#include <sys/dmu.h>
+#include <sys/spa.h>
+#include <sys/zfs_context.h>
+#include <sys/vdev_indirect_mapping.h>
+
+/*
+ * The mapping of a removed vdev is a MOS object holding a packed array of
+ * vdev_indirect_mapping_entry_phys_t, sorted by source offset, with a
+ * vdev_indirect_mapping_phys_t in its bonus buffer.  Entries are only ever
+ * appended while the vdev is being removed, and the whole array is
+ * rewritten into a new object when the mapping is condensed.
+ *
+ * The complete array is kept in memory, so that remapping an offset is a
+ * binary search without any I/O.  The caller serializes access, see
+ * vdev_indirect_rwlock.
+ */
+
+#define	VIM_ENTRY_SIZE	sizeof (vdev_indirect_mapping_entry_phys_t)
+
+static void
+vdev_indirect_mapping_grow(vdev_indirect_mapping_t *vim, uint64_t count)
+{
+	vdev_indirect_mapping_entry_phys_t *entries;
+	uint64_t alloc;
+
+	if (count <= vim->vim_entries_alloc)
+		return;
+
+	alloc = MAX(vim->vim_entries_alloc * 2, 64);
+	while (alloc < count)
+		alloc *= 2;
+
+	entries = vmem_alloc(alloc * VIM_ENTRY_SIZE, KM_SLEEP);
+	if (vim->vim_entries != NULL) {
+		bcopy(vim->vim_entries, entries,
+		    vim->vim_entries_count * VIM_ENTRY_SIZE);
+		vmem_free(vim->vim_entries,
+		    vim->vim_entries_alloc * VIM_ENTRY_SIZE);
+	}
+	vim->vim_entries = entries;
+	vim->vim_entries_alloc = alloc;
+}
+
+uint64_t
+vdev_indirect_mapping_alloc(objset_t *os, dmu_tx_t *tx)
+{
+	ASSERT(dmu_tx_is_syncing(tx));
+
+	return (dmu_object_alloc(os, DMU_OTN_UINT64_METADATA,
+	    SPA_OLD_MAXBLOCKSIZE, DMU_OTN_UINT64_METADATA,
+	    sizeof (vdev_indirect_mapping_phys_t), tx));
+}
+
+/*
+ * Write a complete mapping into a new object, and return the object.
+ */
+uint64_t
+vdev_indirect_mapping_write(objset_t *os,
+    const vdev_indirect_mapping_entry_phys_t *entries, uint64_t count,
+    dmu_tx_t *tx)
+{
+	vdev_indirect_mapping_phys_t *vimp;
+	dmu_buf_t *db;
+	uint64_t object, i;
+
+	object = vdev_indirect_mapping_alloc(os, tx);
+
+	VERIFY0(dmu_bonus_hold(os, object, FTAG, &db));
+	dmu_buf_will_dirty(db, tx);
+	vimp = db->db_data;
+	bzero(vimp, sizeof (*vimp));
+	for (i = 0; i < count; i++)
+		vimp->vimp_bytes_mapped += DVA_MAPPING_GET_SIZE(&entries[i]);
+	if (count != 0) {
+		vimp->vimp_max_offset =
+		    DVA_MAPPING_GET_SRC_OFFSET(&entries[count - 1]) +
+		    DVA_MAPPING_GET_SIZE(&entries[count - 1]);
+		dmu_write(os, object, 0, count * VIM_ENTRY_SIZE, entries, tx);
+	}
+	vimp->vimp_num_entries = count;
+	dmu_buf_rele(db, FTAG);
+
+	return (object);
+}
+
+void
+vdev_indirect_mapping_free(objset_t *os, uint64_t object, dmu_tx_t *tx)
+{
+	VERIFY0(dmu_object_free(os, object, tx));
+}
+
+int
+vdev_indirect_mapping_open(objset_t *os, uint64_t object,
+    vdev_indirect_mapping_t **vimp)
+{
+	vdev_indirect_mapping_t *vim;
+	dmu_object_info_t doi;
+	uint64_t count;
+	int error;
+
+	vim = kmem_zalloc(sizeof (*vim), KM_SLEEP);
+	vim->vim_objset = os;
+	vim->vim_object = object;
+
+	error = dmu_bonus_hold(os, object, vim, &vim->vim_dbuf);
+	if (error == 0) {
+		dmu_object_info_from_db(vim->vim_dbuf, &doi);
+		if (doi.doi_bonus_size < sizeof (vdev_indirect_mapping_phys_t))
+			error = SET_ERROR(EIO);
+	}
+	if (error != 0) {
+		if (vim->vim_dbuf != NULL)
+			dmu_buf_rele(vim->vim_dbuf, vim);
+		kmem_free(vim, sizeof (*vim));
+		return (error);
+	}
+	vim->vim_phys = vim->vim_dbuf->db_data;
+
+	count = vim->vim_phys->vimp_num_entries;
+	if (count != 0) {
+		vdev_indirect_mapping_grow(vim, count);
+		error = dmu_read(os, object, 0, count * VIM_ENTRY_SIZE,
+		    vim->vim_entries, DMU_READ_PREFETCH);
+		if (error != 0) {
+			vdev_indirect_mapping_close(vim);
+			return (error);
+		}
+	}
+	vim->vim_entries_count = count;
+	vim->vim_bytes_mapped = vim->vim_phys->vimp_bytes_mapped;
+	vim->vim_max_offset = vim->vim_phys->vimp_max_offset;
+
+	*vimp = vim;
+	return (0);
+}
+
+void
+vdev_indirect_mapping_close(vdev_indirect_mapping_t *vim)
+{
+	if (vim->vim_entries != NULL) {
+		vmem_free(vim->vim_entries,
+		    vim->vim_entries_alloc * VIM_ENTRY_SIZE);
+	}
+	dmu_buf_rele(vim->vim_dbuf, vim);
+	kmem_free(vim, sizeof (*vim));
+}
+
+/*
+ * Append an entry in core.  It must start at or after the end of the last
+ * entry, and is written out by vdev_indirect_mapping_sync().
+ */
+void
+vdev_indirect_mapping_add_entry(vdev_indirect_mapping_t *vim, uint64_t src,
+    const dva_t *dst)
+{
+	vdev_indirect_mapping_entry_phys_t *vimep;
+
+	ASSERT3U(src, >=, vim->vim_max_offset);
+
+	vdev_indirect_mapping_grow(vim, vim->vim_entries_count + 1);
+	vimep = &vim->vim_entries[vim->vim_entries_count++];
+	vimep->vimep_src = src;
+	vimep->vimep_dst = *dst;
+
+	vim->vim_bytes_mapped += DVA_GET_ASIZE(dst);
+	vim->vim_max_offset = src + DVA_GET_ASIZE(dst);
+}
+
+/*
+ * Write out the first 'count' in-core entries, of which those up to
+ * vimp_num_entries are already on disk.
+ */
+void
+vdev_indirect_mapping_sync(vdev_indirect_mapping_t *vim, uint64_t count,
+    dmu_tx_t *tx)
+{
+	vdev_indirect_mapping_phys_t *vimp = vim->vim_phys;
+	vdev_indirect_mapping_entry_phys_t *last;
+	uint64_t i;
+
+	ASSERT(dmu_tx_is_syncing(tx));
+	ASSERT3U(count, <=, vim->vim_entries_count);
+
+	if (count <= vimp->vimp_num_entries)
+		return;
+
+	dmu_write(vim->vim_objset, vim->vim_object,
+	    vimp->vimp_num_entries * VIM_ENTRY_SIZE,
+	    (count - vimp->vimp_num_entries) * VIM_ENTRY_SIZE,
+	    &vim->vim_entries[vimp->vimp_num_entries], tx);
+
+	dmu_buf_will_dirty(vim->vim_dbuf, tx);
+	for (i = vimp->vimp_num_entries; i < count; i++) {
+		vimp->vimp_bytes_mapped +=
+		    DVA_MAPPING_GET_SIZE(&vim->vim_entries[i]);
+	}
+	last = &vim->vim_entries[count - 1];
+	vimp->vimp_max_offset = DVA_MAPPING_GET_SRC_OFFSET(last) +
+	    DVA_MAPPING_GET_SIZE(last);
+	vimp->vimp_num_entries = count;
+}
+
+/*
+ * Return the entry containing the given offset or, if there is none, the
+ * first entry after it.  Returns NULL if no entry ends after the offset.
+ */
+vdev_indirect_mapping_entry_phys_t *
+vdev_indirect_mapping_entry_for_offset(vdev_indirect_mapping_t *vim,
+    uint64_t offset)
+{
+	uint64_t lo = 0, hi = vim->vim_entries_count;
+
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		vdev_indirect_mapping_entry_phys_t *vimep =
+		    &vim->vim_entries[mid];
+
+		if (DVA_MAPPING_GET_SRC_OFFSET(vimep) +
+		    DVA_MAPPING_GET_SIZE(vimep) <= offset)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo < vim->vim_entries_count ? &vim->vim_entries[lo] : NULL);
+}
+
+uint64_t
+vdev_indirect_mapping_num_entries(vdev_indirect_mapping_t *vim)
+{
+	return (vim->vim_entries_count);
+}
+
+uint64_t
+vdev_indirect_mapping_bytes_mapped(vdev_indirect_mapping_t *vim)
+{
+	return (vim->vim_bytes_mapped);
+}
+
+uint64_t
+vdev_indirect_mapping_max_offset(vdev_indirect_mapping_t *vim)
+{
+	return (vim->vim_max_offset);
+}
+
+/*
+ * In-core size of the mapping, as reported by zpool status.
+ */
+uint64_t
+vdev_indirect_mapping_size(vdev_indirect_mapping_t *vim)
+{
+	return (vim->vim_entries_count * VIM_ENTRY_SIZE);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(vdev_indirect_mapping_alloc);
+EXPORT_SYMBOL(vdev_indirect_mapping_free);
+EXPORT_SYMBOL(vdev_indirect_mapping_open);
+EXPORT_SYMBOL(vdev_indirect_mapping_close);
+EXPORT_SYMBOL(vdev_indirect_mapping_entry_for_offset);
+EXPORT_SYMBOL(vdev_indirect_mapping_num_entries);
+EXPORT_SYMBOL(vdev_indirect_mapping_bytes_mapped);
+EXPORT_SYMBOL(vdev_indirect_mapping_max_offset);
+EXPORT_SYMBOL(vdev_indirect_mapping_size);
+#endif
@@ -425,9 +425,32 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 		fnvlist_add_uint64(nv, ZPOOL_CONFIG_ASIZE,
 		    vd->vdev_asize);
 		fnvlist_add_uint64(nv, ZPOOL_CONFIG_IS_LOG, vd->vdev_islog);
+		if (vd->vdev_alloc_bias == VDEV_BIAS_SPECIAL)
+			fnvlist_add_string(nv, ZPOOL_CONFIG_ALLOCATION_BIAS,
+			    VDEV_ALLOC_BIAS_SPECIAL);
 		if (vd->vdev_removing)
 			fnvlist_add_uint64(nv, ZPOOL_CONFIG_REMOVING,
 			    vd->vdev_removing);
+		if (vd->vdev_im_object != 0)
+			fnvlist_add_uint64(nv, ZPOOL_CONFIG_INDIRECT_OBJECT,
+			    vd->vdev_im_object);
+		if (vd->vdev_obsolete_sm != NULL) {
+			fnvlist_add_uint64(nv,
+			    ZPOOL_CONFIG_INDIRECT_OBSOLETE_SM,
+			    space_map_object(vd->vdev_obsolete_sm));
+		} else if (vd->vdev_obsolete_sm_object != 0) {
+			fnvlist_add_uint64(nv,
+			    ZPOOL_CONFIG_INDIRECT_OBSOLETE_SM,
+			    vd->vdev_obsolete_sm_object);
+		}
+		if (vd->vdev_rz_expanding != 0)
+			fnvlist_add_uint64(nv, ZPOOL_CONFIG_RAIDZ_EXPANDING,
+			    vd->vdev_rz_expanding);
+		if (vd->vdev_rz_nwidths != 0) {
+			fnvlist_add_uint64_array(nv,
+			    ZPOOL_CONFIG_RAIDZ_EXPAND_TXGS, vd->vdev_rz_widths,
+			    vd->vdev_rz_nwidths * 2);
+		}
 	}
 
 	if (vd->vdev_dtl_sm != NULL) {
@@ -454,6 +477,8 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 
 	if (getstats) {
 		pool_scan_stat_t ps;
+		pool_removal_stat_t prs;
+		pool_raidz_expand_stat_t pres;
 
 		vdev_config_generate_stats(vd, nv);
 
@@ -463,6 +488,23 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 			    ZPOOL_CONFIG_SCAN_STATS, (uint64_t *)&ps,
 			    sizeof (pool_scan_stat_t) / sizeof (uint64_t));
 		}
+
+		/* and of the current or last top-level vdev removal */
+		if (vd == spa->spa_root_vdev &&
+		    spa_removal_get_stats(spa, &prs) == 0) {
+			fnvlist_add_uint64_array(nv,
+			    ZPOOL_CONFIG_REMOVAL_STATS, (uint64_t *)&prs,
+			    sizeof (pool_removal_stat_t) / sizeof (uint64_t));
+		}
+
+		/* and of the current or last raidz expansion */
+		if (vd == spa->spa_root_vdev &&
+		    spa_raidz_expand_get_stats(spa, &pres) == 0) {
+			fnvlist_add_uint64_array(nv,
+			    ZPOOL_CONFIG_RAIDZ_EXPAND_STATS, (uint64_t *)&pres,
+			    sizeof (pool_raidz_expand_stat_t) /
+			    sizeof (uint64_t));
+		}
 	}
 
 	if (!vd->vdev_ops->vdev_op_leaf) {
@@ -544,23 +586,32 @@ vdev_config_generate(spa_t *spa, vdev_t *vd, boolean_t getstats,
 /*
  * Generate a view of the top-level vdevs.  If we currently have holes
  * in the namespace, then generate an array which contains a list of holey
- * vdevs.  Additionally, add the number of top-level children that currently
- * exist.
+ * vdevs.  Removed (indirect) vdevs have no labels of their own, so their
+ * configs are included, so that the pool can be assembled from the labels
+ * of the remaining vdevs.  Additionally, add the number of top-level
+ * children that currently exist.
  */
 void
 vdev_top_config_generate(spa_t *spa, nvlist_t *config)
 {
 	vdev_t *rvd = spa->spa_root_vdev;
 	uint64_t *array;
-	uint_t c, idx;
+	nvlist_t **indirect;
+	uint_t c, idx, nindirect;
 
 	array = kmem_alloc(rvd->vdev_children * sizeof (uint64_t), KM_SLEEP);
+	indirect = kmem_alloc(rvd->vdev_children * sizeof (nvlist_t *),
+	    KM_SLEEP);
 
-	for (c = 0, idx = 0; c < rvd->vdev_children; c++) {
+	for (c = 0, idx = 0, nindirect = 0; c < rvd->vdev_children; c++) {
 		vdev_t *tvd = rvd->vdev_child[c];
 
 		if (tvd->vdev_ishole)
 			array[idx++] = c;
+		if (tvd->vdev_ops == &vdev_indirect_ops) {
+			indirect[nindirect++] = vdev_config_generate(spa, tvd,
+			    B_FALSE, 0);
+		}
 	}
 
 	if (idx) {
@@ -568,9 +619,17 @@ vdev_top_config_generate(spa_t *spa, nvlist_t *config)
 		    array, idx) == 0);
 	}
 
+	if (nindirect) {
+		fnvlist_add_nvlist_array(config, ZPOOL_CONFIG_INDIRECT_VDEVS,
+		    indirect, nindirect);
+		for (c = 0; c < nindirect; c++)
+			nvlist_free(indirect[c]);
+	}
+
 	VERIFY(nvlist_add_uint64(config, ZPOOL_CONFIG_VDEV_CHILDREN,
 	    rvd->vdev_children) == 0);
 
+	kmem_free(indirect, rvd->vdev_children * sizeof (nvlist_t *));
 	kmem_free(array, rvd->vdev_children * sizeof (uint64_t));
 }
 
@@ -29,6 +29,9 @@
 
 #include <sys/zfs_context.h>
 #include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/dsl_pool.h>
+#include <sys/dsl_scan.h>
 #include <sys/vdev_impl.h>
 #include <sys/zio.h>
 #include <sys/abd.h>
@@ -179,9 +182,27 @@ vdev_mirror_map_init(zio_t *zio)
 	if (vd == NULL) {
 		dva_t *dva = zio->io_bp->blk_dva;
 		spa_t *spa = zio->io_spa;
+		dsl_scan_t *scn = NULL;
+		int numdvas = BP_GET_NDVAS(zio->io_bp);
 
-		mm = vdev_mirror_map_alloc(BP_GET_NDVAS(zio->io_bp), B_FALSE,
-		    B_TRUE);
+		/*
+		 * A sorted scrub queues a separate read for every DVA of a
+		 * block, with that DVA placed first.  The other copies are
+		 * only included so that they can be used for repair, and
+		 * they are checked by their own reads.  Therefore only the
+		 * first DVA is read, unless the read failed and is retried.
+		 * Gang blocks are never sorted.
+		 */
+		if (spa->spa_dsl_pool != NULL)
+			scn = spa->spa_dsl_pool->dp_scan;
+		if (scn != NULL && scn->scn_is_sorted &&
+		    (zio->io_flags & ZIO_FLAG_SCRUB) &&
+		    (zio->io_flags & ZIO_FLAG_SCAN_THREAD) &&
+		    !(zio->io_flags & (ZIO_FLAG_IO_RETRY | ZIO_FLAG_GANG_CHILD)) &&
+		    !BP_IS_GANG(zio->io_bp))
+			numdvas = 1;
+
+		mm = vdev_mirror_map_alloc(numdvas, B_FALSE, B_TRUE);
 		for (c = 0; c < mm->mm_children; c++) {
 			mc = &mm->mm_child[c];
 
@@ -615,6 +636,7 @@ vdev_ops_t vdev_mirror_ops = {
 	vdev_mirror_state_change,
 	NULL,
 	NULL,
+	vdev_default_xlate,
 	VDEV_TYPE_MIRROR,	/* name of this vdev type */
 	B_FALSE			/* not a leaf vdev */
 };
@@ -628,6 +650,7 @@ vdev_ops_t vdev_replacing_ops = {
 	vdev_mirror_state_change,
 	NULL,
 	NULL,
+	vdev_default_xlate,
 	VDEV_TYPE_REPLACING,	/* name of this vdev type */
 	B_FALSE			/* not a leaf vdev */
 };
@@ -641,6 +664,7 @@ vdev_ops_t vdev_spare_ops = {
 	vdev_mirror_state_change,
 	NULL,
 	NULL,
+	vdev_default_xlate,
 	VDEV_TYPE_SPARE,	/* name of this vdev type */
 	B_FALSE			/* not a leaf vdev */
 };
@@ -35,6 +35,7 @@
 #include <sys/fm/fs/zfs.h>
 #include <sys/vdev_raidz.h>
 #include <sys/vdev_raidz_impl.h>
+#include <sys/vdev_raidz_expand.h>
 
 /*
  * Virtual device vector for RAID-Z.
@@ -133,9 +134,19 @@
 void
 vdev_raidz_map_free(raidz_map_t *rm)
 {
-	int c;
+	int c, r;
 	size_t size;
 
+	for (r = 0; r < rm->rm_nrows; r++) {
+		raidz_map_t *row = rm->rm_row[r];
+
+		for (c = 0; c < row->rm_cols; c++)
+			abd_put(row->rm_col[c].rc_abd);
+		kmem_free(row, offsetof(raidz_map_t, rm_col[row->rm_scols]));
+	}
+	if (rm->rm_row != NULL)
+		kmem_free(rm->rm_row, rm->rm_nrows * sizeof (raidz_map_t *));
+
 	for (c = 0; c < rm->rm_firstdatacol; c++) {
 		abd_free(rm->rm_col[c].rc_abd);
 
@@ -164,6 +175,11 @@ vdev_raidz_map_free_vsd(zio_t *zio)
 	ASSERT0(rm->rm_freed);
 	rm->rm_freed = 1;
 
+	if (rm->rm_lr != NULL) {
+		zfs_range_unlock(rm->rm_lr);
+		rm->rm_lr = NULL;
+	}
+
 	if (rm->rm_reports == 0)
 		vdev_raidz_map_free(rm);
 }
@@ -398,6 +414,9 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift, uint64_t dcols,
 	rm->rm_reports = 0;
 	rm->rm_freed = 0;
 	rm->rm_ecksuminjected = 0;
+	rm->rm_row = NULL;
+	rm->rm_nrows = 0;
+	rm->rm_lr = NULL;
 
 	asize = 0;
 
@@ -415,6 +434,8 @@ vdev_raidz_map_alloc(zio_t *zio, uint64_t unit_shift, uint64_t dcols,
 		rm->rm_col[c].rc_error = 0;
 		rm->rm_col[c].rc_tried = 0;
 		rm->rm_col[c].rc_skipped = 0;
+		rm->rm_col[c].rc_shadow_devidx = SIZE_MAX;
+		rm->rm_col[c].rc_shadow_offset = 0;
 
 		if (c >= acols)
 			rm->rm_col[c].rc_size = 0;
@@ -1573,6 +1594,7 @@ vdev_raidz_open(vdev_t *vd, uint64_t *asize, uint64_t *max_asize,
 {
 	vdev_t *cvd;
 	uint64_t nparity = vd->vdev_nparity;
+	uint64_t width = vd->vdev_children;
 	int c;
 	int lasterror = 0;
 	int numerrors = 0;
@@ -1601,8 +1623,15 @@ vdev_raidz_open(vdev_t *vd, uint64_t *asize, uint64_t *max_asize,
 		*ashift = MAX(*ashift, cvd->vdev_ashift);
 	}
 
-	*asize *= vd->vdev_children;
-	*max_asize *= vd->vdev_children;
+	/*
+	 * The child being added to an expanding vdev provides no space
+	 * until all of the data has been reflowed onto it.
+	 */
+	if (vd->vdev_rz_expanding != 0)
+		width--;
+
+	*asize *= width;
+	*max_asize *= width;
 
 	if (numerrors > nparity) {
 		vd->vdev_stat.vs_aux = VDEV_AUX_NO_REPLICAS;
@@ -1622,11 +1651,11 @@ vdev_raidz_close(vdev_t *vd)
 }
 
 static uint64_t
-vdev_raidz_asize(vdev_t *vd, uint64_t psize)
+vdev_raidz_asize(vdev_t *vd, uint64_t psize, uint64_t txg)
 {
 	uint64_t asize;
 	uint64_t ashift = vd->vdev_top->vdev_ashift;
-	uint64_t cols = vd->vdev_children;
+	uint64_t cols = vdev_raidz_logical_width(vd, txg);
 	uint64_t nparity = vd->vdev_nparity;
 
 	asize = ((psize - 1) >> ashift) + 1;
@@ -1646,6 +1675,152 @@ vdev_raidz_child_done(zio_t *zio)
 	rc->rc_skipped = 0;
 }
 
+/*
+ * Split a block whose sectors are not all laid out with the width it was
+ * written with into rows of one sector per column.  The sectors of a RAID-Z
+ * vdev are numbered across its children in rows, and a block of logical
+ * width lwidth has sector k of column c at sector
+ * (rc_offset / sectorsize + k) * lwidth + rc_devidx of the vdev.  Each row
+ * holds that sector of every column long enough to have one, at wherever
+ * the vdev's layout has put it: sectors below "reflowed" have been moved
+ * to the current width of the vdev, the rest are still laid out with the
+ * width from before the expansion.  Sectors between "synced" and
+ * "reflowed" also have a shadow at their old location, which writes must
+ * keep up to date until the reflow past them is on disk.
+ *
+ * Each row is a complete RAID-Z stripe of its own, so parity is generated
+ * on the whole map but verified and used for reconstruction row by row.
+ */
+static void
+vdev_raidz_map_alloc_rows(zio_t *zio, raidz_map_t *rm, uint64_t lwidth,
+    uint64_t synced, uint64_t reflowed)
+{
+	vdev_t *vd = zio->io_vd;
+	uint64_t ashift = vd->vdev_top->vdev_ashift;
+	uint64_t width = vd->vdev_children;
+	uint64_t r, c, ncols, sector, w;
+
+	rm->rm_nrows = rm->rm_col[0].rc_size >> ashift;
+	rm->rm_row = kmem_alloc(rm->rm_nrows * sizeof (raidz_map_t *),
+	    KM_SLEEP);
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		raidz_map_t *row;
+
+		/* columns are never longer than the ones before them */
+		for (ncols = 0; ncols < rm->rm_cols &&
+		    rm->rm_col[ncols].rc_size > (r << ashift); ncols++)
+			continue;
+		ASSERT3U(ncols, >, rm->rm_firstdatacol);
+
+		row = kmem_zalloc(offsetof(raidz_map_t, rm_col[ncols]),
+		    KM_SLEEP);
+		row->rm_cols = ncols;
+		row->rm_scols = ncols;
+		row->rm_bigcols = ncols;
+		row->rm_asize = ncols << ashift;
+		row->rm_firstdatacol = rm->rm_firstdatacol;
+		row->rm_ops = rm->rm_ops;
+
+		for (c = 0; c < ncols; c++) {
+			raidz_col_t *lc = &rm->rm_col[c];
+			raidz_col_t *rc = &row->rm_col[c];
+
+			sector = ((lc->rc_offset >> ashift) + r) * lwidth +
+			    lc->rc_devidx;
+			w = (sector << ashift) < reflowed ? width : width - 1;
+
+			rc->rc_devidx = sector % w;
+			rc->rc_offset = (sector / w) << ashift;
+			rc->rc_size = 1ULL << ashift;
+			rc->rc_abd = abd_get_offset_size(lc->rc_abd,
+			    r << ashift, rc->rc_size);
+			rc->rc_shadow_devidx = SIZE_MAX;
+			if ((sector << ashift) >= synced &&
+			    (sector << ashift) < reflowed) {
+				rc->rc_shadow_devidx = sector % (width - 1);
+				rc->rc_shadow_offset =
+				    (sector / (width - 1)) << ashift;
+			}
+		}
+
+		rm->rm_row[r] = row;
+	}
+}
+
+/*
+ * Issue the child writes for the columns of rm, and for any shadows of
+ * them at the old location of a reflowed sector.
+ */
+static void
+vdev_raidz_io_start_write(zio_t *zio, raidz_map_t *rm)
+{
+	vdev_t *vd = zio->io_vd;
+	raidz_col_t *rc;
+	int c;
+
+	for (c = 0; c < rm->rm_cols; c++) {
+		rc = &rm->rm_col[c];
+		zio_nowait(zio_vdev_child_io(zio, NULL,
+		    vd->vdev_child[rc->rc_devidx], rc->rc_offset, rc->rc_abd,
+		    rc->rc_size, zio->io_type, zio->io_priority, 0,
+		    vdev_raidz_child_done, rc));
+
+		if (rc->rc_shadow_devidx != SIZE_MAX) {
+			zio_nowait(zio_vdev_child_io(zio, NULL,
+			    vd->vdev_child[rc->rc_shadow_devidx],
+			    rc->rc_shadow_offset, rc->rc_abd, rc->rc_size,
+			    zio->io_type, zio->io_priority, 0, NULL, NULL));
+		}
+	}
+}
+
+/*
+ * Issue the child reads for the columns of rm.
+ *
+ * Iterate over the columns in reverse order so that we hit the parity
+ * last -- any errors along the way will force us to read the parity.
+ */
+static void
+vdev_raidz_io_start_read(zio_t *zio, raidz_map_t *rm)
+{
+	vdev_t *vd = zio->io_vd;
+	vdev_t *cvd;
+	raidz_col_t *rc;
+	int c;
+
+	for (c = rm->rm_cols - 1; c >= 0; c--) {
+		rc = &rm->rm_col[c];
+		cvd = vd->vdev_child[rc->rc_devidx];
+		if (!vdev_readable(cvd)) {
+			if (c >= rm->rm_firstdatacol)
+				rm->rm_missingdata++;
+			else
+				rm->rm_missingparity++;
+			rc->rc_error = SET_ERROR(ENXIO);
+			rc->rc_tried = 1;	/* don't even try */
+			rc->rc_skipped = 1;
+			continue;
+		}
+		if (vdev_dtl_contains(cvd, DTL_MISSING, zio->io_txg, 1)) {
+			if (c >= rm->rm_firstdatacol)
+				rm->rm_missingdata++;
+			else
+				rm->rm_missingparity++;
+			rc->rc_error = SET_ERROR(ESTALE);
+			rc->rc_skipped = 1;
+			continue;
+		}
+		if (c >= rm->rm_firstdatacol || rm->rm_missingdata > 0 ||
+		    (zio->io_flags & (ZIO_FLAG_SCRUB | ZIO_FLAG_RESILVER))) {
+			zio_nowait(zio_vdev_child_io(zio, NULL, cvd,
+			    rc->rc_offset, rc->rc_abd, rc->rc_size,
+			    zio->io_type, zio->io_priority, 0,
+			    vdev_raidz_child_done, rc));
+		}
+	}
+}
+
 /*
  * Start an IO operation on a RAIDZ VDev
  *
@@ -1662,6 +1837,11 @@ vdev_raidz_child_done(zio_t *zio)
  *   2. If this is a scrub or resilver operation, or if any of the data
  *      vdevs have had errors, then create zio read operations to the parity
  *      columns' VDevs as well.
+ *
+ * A block is laid out across as many children as the vdev had when it was
+ * written.  If the vdev has been expanded since, or the block is being
+ * moved by an expansion in progress, its sectors are issued row by row
+ * instead, see vdev_raidz_map_alloc_rows().
  */
 static void
 vdev_raidz_io_start(zio_t *zio)
@@ -1671,24 +1851,48 @@ vdev_raidz_io_start(zio_t *zio)
 	vdev_t *cvd;
 	raidz_map_t *rm;
 	raidz_col_t *rc;
+	uint64_t txg, lwidth, pwidth, synced, reflowed, start, end;
 	int c, i;
 
-	rm = vdev_raidz_map_alloc(zio, tvd->vdev_ashift, vd->vdev_children,
+	txg = (zio->io_bp != NULL ? BP_PHYSICAL_BIRTH(zio->io_bp) :
+	    zio->io_txg);
+	lwidth = vdev_raidz_logical_width(vd, txg);
+
+	rm = vdev_raidz_map_alloc(zio, tvd->vdev_ashift, lwidth,
 	    vd->vdev_nparity);
 
-	ASSERT3U(rm->rm_asize, ==, vdev_psize_to_asize(vd, zio->io_size));
+	ASSERT3U(rm->rm_asize, ==,
+	    vdev_psize_to_asize_txg(vd, zio->io_size, txg));
+
+	start = zio->io_offset;
+	end = zio->io_offset + rm->rm_asize;
+	rm->rm_lr = vdev_raidz_expand_lock(vd, start, rm->rm_asize,
+	    &synced, &reflowed);
+	pwidth = (end <= reflowed ? vd->vdev_children : vd->vdev_children - 1);
+
+	if (lwidth != pwidth || (start < reflowed && end > reflowed) ||
+	    (zio->io_type == ZIO_TYPE_WRITE && start < reflowed &&
+	    end > synced)) {
+		vdev_raidz_map_alloc_rows(zio, rm, lwidth, synced, reflowed);
+
+		if (zio->io_type == ZIO_TYPE_WRITE) {
+			vdev_raidz_generate_parity(rm);
+			for (i = 0; i < rm->rm_nrows; i++)
+				vdev_raidz_io_start_write(zio, rm->rm_row[i]);
+		} else {
+			ASSERT(zio->io_type == ZIO_TYPE_READ);
+			for (i = 0; i < rm->rm_nrows; i++)
+				vdev_raidz_io_start_read(zio, rm->rm_row[i]);
+		}
+
+		zio_execute(zio);
+		return;
+	}
 
 	if (zio->io_type == ZIO_TYPE_WRITE) {
 		vdev_raidz_generate_parity(rm);
 
-		for (c = 0; c < rm->rm_cols; c++) {
-			rc = &rm->rm_col[c];
-			cvd = vd->vdev_child[rc->rc_devidx];
-			zio_nowait(zio_vdev_child_io(zio, NULL, cvd,
-			    rc->rc_offset, rc->rc_abd, rc->rc_size,
-			    zio->io_type, zio->io_priority, 0,
-			    vdev_raidz_child_done, rc));
-		}
+		vdev_raidz_io_start_write(zio, rm);
 
 		/*
 		 * Generate optional I/Os for any skipped sectors to improve
@@ -1713,40 +1917,7 @@ vdev_raidz_io_start(zio_t *zio)
 
 	ASSERT(zio->io_type == ZIO_TYPE_READ);
 
-	/*
-	 * Iterate over the columns in reverse order so that we hit the parity
-	 * last -- any errors along the way will force us to read the parity.
-	 */
-	for (c = rm->rm_cols - 1; c >= 0; c--) {
-		rc = &rm->rm_col[c];
-		cvd = vd->vdev_child[rc->rc_devidx];
-		if (!vdev_readable(cvd)) {
-			if (c >= rm->rm_firstdatacol)
-				rm->rm_missingdata++;
-			else
-				rm->rm_missingparity++;
-			rc->rc_error = SET_ERROR(ENXIO);
-			rc->rc_tried = 1;	/* don't even try */
-			rc->rc_skipped = 1;
-			continue;
-		}
-		if (vdev_dtl_contains(cvd, DTL_MISSING, zio->io_txg, 1)) {
-			if (c >= rm->rm_firstdatacol)
-				rm->rm_missingdata++;
-			else
-				rm->rm_missingparity++;
-			rc->rc_error = SET_ERROR(ESTALE);
-			rc->rc_skipped = 1;
-			continue;
-		}
-		if (c >= rm->rm_firstdatacol || rm->rm_missingdata > 0 ||
-		    (zio->io_flags & (ZIO_FLAG_SCRUB | ZIO_FLAG_RESILVER))) {
-			zio_nowait(zio_vdev_child_io(zio, NULL, cvd,
-			    rc->rc_offset, rc->rc_abd, rc->rc_size,
-			    zio->io_type, zio->io_priority, 0,
-			    vdev_raidz_child_done, rc));
-		}
-	}
+	vdev_raidz_io_start_read(zio, rm);
 
 	zio_execute(zio);
 }
@@ -2013,6 +2184,313 @@ done:
 	return (ret);
 }
 
+static int
+vdev_raidz_worst_error_rows(raidz_map_t *rm)
+{
+	int r, error = 0;
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		error = zio_worst_error(error,
+		    vdev_raidz_worst_error(rm->rm_row[r]));
+	}
+
+	return (error);
+}
+
+/*
+ * Try reconstructing, in every row of a block split into rows, the data
+ * columns held by the children in set[], and report them if that produces
+ * valid data.  orig is a copy of the block as read.
+ */
+static boolean_t
+vdev_raidz_combrec_rows_try(zio_t *zio, const int *set, int n, abd_t *orig)
+{
+	raidz_map_t *rm = zio->io_vsd;
+	uint64_t ashift = zio->io_vd->vdev_top->vdev_ashift;
+	raidz_map_t *row;
+	raidz_col_t *rc;
+	int tgts[VDEV_RAIDZ_MAXPARITY];
+	boolean_t tried = B_FALSE;
+	size_t off;
+	int r, c, x, i, nt, errors;
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		row = rm->rm_row[r];
+		for (nt = 0, errors = 0, c = 0; c < row->rm_cols; c++) {
+			rc = &row->rm_col[c];
+			if (rc->rc_error != 0) {
+				errors++;
+				continue;
+			}
+			for (i = 0; i < n; i++) {
+				if (c < row->rm_firstdatacol ||
+				    rc->rc_devidx != (size_t)set[i])
+					continue;
+				if (nt < VDEV_RAIDZ_MAXPARITY)
+					tgts[nt] = c;
+				nt++;
+			}
+		}
+
+		/*
+		 * Near the reflow pointer two columns of a row can be on the
+		 * same child; skip sets that leave a row without enough parity.
+		 */
+		if (nt + errors > row->rm_firstdatacol)
+			return (B_FALSE);
+		if (nt != 0) {
+			(void) vdev_raidz_reconstruct(row, tgts, nt);
+			tried = B_TRUE;
+		}
+	}
+
+	if (!tried || raidz_checksum_verify(zio) != 0)
+		return (B_FALSE);
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		row = rm->rm_row[r];
+		for (c = row->rm_firstdatacol; c < row->rm_cols; c++) {
+			rc = &row->rm_col[c];
+			for (i = 0; i < n; i++) {
+				if (rc->rc_error != 0 ||
+				    rc->rc_devidx != (size_t)set[i])
+					continue;
+
+				/* where this sector of the block was read to */
+				off = r << ashift;
+				for (x = rm->rm_firstdatacol; x < c; x++)
+					off += rm->rm_col[x].rc_size;
+
+				if (rc->rc_tried) {
+					raidz_checksum_error(zio, rc,
+					    (char *)abd_to_buf(orig) + off);
+				}
+				rc->rc_error = SET_ERROR(ECKSUM);
+			}
+		}
+	}
+
+	return (B_TRUE);
+}
+
+/*
+ * Combinatorial reconstruction of a block split into rows.  The silent
+ * errors we are looking for come from a child vdev, which holds a different
+ * column in each row, so rather than every combination of columns we try
+ * every combination of up to as many children as the rows have parity to
+ * spare.
+ */
+static boolean_t
+vdev_raidz_combrec_rows(zio_t *zio, int max_errors)
+{
+	raidz_map_t *rm = zio->io_vsd;
+	int children = zio->io_vd->vdev_children;
+	int set[VDEV_RAIDZ_MAXPARITY];
+	boolean_t found = B_FALSE;
+	abd_t *orig;
+	int n, i;
+
+	orig = abd_alloc_linear(zio->io_size, B_FALSE);
+	abd_copy(orig, zio->io_abd, zio->io_size);
+
+	for (n = 1; n <= rm->rm_firstdatacol - max_errors && !found; n++) {
+		for (i = 0; i < n; i++)
+			set[i] = i;
+
+		for (;;) {
+			if (vdev_raidz_combrec_rows_try(zio, set, n, orig)) {
+				found = B_TRUE;
+				break;
+			}
+			abd_copy(zio->io_abd, orig, zio->io_size);
+
+			/* advance to the next combination of n children */
+			for (i = n - 1; i >= 0 && set[i] == children - n + i;
+			    i--)
+				continue;
+			if (i < 0)
+				break;
+			for (set[i]++, i++; i < n; i++)
+				set[i] = set[i - 1] + 1;
+		}
+	}
+
+	abd_free(orig);
+	return (found);
+}
+
+/*
+ * Regenerate and verify the parity of the rows that read any, or of all
+ * rows when resilvering so that it can be written out to failed devices.
+ * Returns the number of parity columns found to be bad.
+ */
+static int
+raidz_parity_verify_rows(zio_t *zio, raidz_map_t *rm)
+{
+	raidz_map_t *row;
+	raidz_col_t *rc;
+	int r, c, n = 0;
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		row = rm->rm_row[r];
+		for (c = 0; c < row->rm_firstdatacol; c++) {
+			rc = &row->rm_col[c];
+			if (rc->rc_tried && rc->rc_error == 0)
+				break;
+		}
+		if (c < row->rm_firstdatacol ||
+		    (zio->io_flags & ZIO_FLAG_RESILVER))
+			n += raidz_parity_verify(zio, row);
+	}
+
+	return (n);
+}
+
+/*
+ * Complete an IO operation on a block split into rows, going through the
+ * same phases as vdev_raidz_io_done() for each row.  There is no checksum
+ * ereport detail for such a block if it can not be reconstructed.
+ */
+static void
+vdev_raidz_io_done_rows(zio_t *zio)
+{
+	vdev_t *vd = zio->io_vd;
+	raidz_map_t *rm = zio->io_vsd;
+	raidz_map_t *row;
+	raidz_col_t *rc;
+	boolean_t correctable = B_TRUE;
+	boolean_t reissued = B_FALSE;
+	int unexpected_errors = 0;
+	int max_errors = 0;
+	int total_errors, parity_untried;
+	int tgts[VDEV_RAIDZ_MAXPARITY];
+	int r, c, n;
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		row = rm->rm_row[r];
+		total_errors = parity_untried = 0;
+		for (c = 0; c < row->rm_cols; c++) {
+			rc = &row->rm_col[c];
+			if (rc->rc_error) {
+				if (!rc->rc_skipped)
+					unexpected_errors++;
+				total_errors++;
+			} else if (c < row->rm_firstdatacol && !rc->rc_tried) {
+				parity_untried++;
+			}
+		}
+		max_errors = MAX(max_errors, total_errors);
+		if (total_errors > row->rm_firstdatacol - parity_untried)
+			correctable = B_FALSE;
+	}
+
+	if (zio->io_type == ZIO_TYPE_WRITE) {
+		/* XXPOLICY, see vdev_raidz_io_done() */
+		if (max_errors > rm->rm_firstdatacol)
+			zio->io_error = vdev_raidz_worst_error_rows(rm);
+
+		return;
+	}
+
+	ASSERT(zio->io_type == ZIO_TYPE_READ);
+
+	/*
+	 * Phase 1: reconstruct the data columns that reported an error in
+	 * each row from the parity read.
+	 */
+	if (correctable) {
+		for (r = 0; r < rm->rm_nrows; r++) {
+			row = rm->rm_row[r];
+			for (n = 0, c = row->rm_firstdatacol;
+			    c < row->rm_cols; c++) {
+				if (row->rm_col[c].rc_error != 0)
+					tgts[n++] = c;
+			}
+			if (n != 0)
+				(void) vdev_raidz_reconstruct(row, tgts, n);
+		}
+
+		if (raidz_checksum_verify(zio) == 0) {
+			unexpected_errors += raidz_parity_verify_rows(zio, rm);
+			goto done;
+		}
+	}
+
+	/*
+	 * Phase 2: read every column we have not tried yet.
+	 */
+	unexpected_errors = 1;
+
+	for (r = 0; r < rm->rm_nrows; r++) {
+		row = rm->rm_row[r];
+		for (c = 0; c < row->rm_cols; c++) {
+			rc = &row->rm_col[c];
+			if (rc->rc_tried)
+				continue;
+
+			if (!reissued) {
+				zio_vdev_io_redone(zio);
+				reissued = B_TRUE;
+			}
+			zio_nowait(zio_vdev_child_io(zio, NULL,
+			    vd->vdev_child[rc->rc_devidx],
+			    rc->rc_offset, rc->rc_abd, rc->rc_size,
+			    zio->io_type, zio->io_priority, 0,
+			    vdev_raidz_child_done, rc));
+		}
+	}
+	if (reissued)
+		return;
+
+	/*
+	 * Phase 3: combinatorial reconstruction.
+	 */
+	if (max_errors > rm->rm_firstdatacol) {
+		zio->io_error = vdev_raidz_worst_error_rows(rm);
+	} else if (max_errors < rm->rm_firstdatacol &&
+	    vdev_raidz_combrec_rows(zio, max_errors)) {
+		(void) raidz_parity_verify_rows(zio, rm);
+	} else {
+		zio->io_error = SET_ERROR(ECKSUM);
+	}
+
+done:
+	zio_checksum_verified(zio);
+
+	if (zio->io_error == 0 && spa_writeable(zio->io_spa) &&
+	    (unexpected_errors || (zio->io_flags & ZIO_FLAG_RESILVER))) {
+		/*
+		 * Use the good data we have in hand to repair damaged
+		 * children, including the old location of a reflowed sector.
+		 */
+		for (r = 0; r < rm->rm_nrows; r++) {
+			row = rm->rm_row[r];
+			for (c = 0; c < row->rm_cols; c++) {
+				rc = &row->rm_col[c];
+				if (rc->rc_error == 0)
+					continue;
+
+				zio_nowait(zio_vdev_child_io(zio, NULL,
+				    vd->vdev_child[rc->rc_devidx],
+				    rc->rc_offset, rc->rc_abd, rc->rc_size,
+				    ZIO_TYPE_WRITE, ZIO_PRIORITY_ASYNC_WRITE,
+				    ZIO_FLAG_IO_REPAIR | (unexpected_errors ?
+				    ZIO_FLAG_SELF_HEAL : 0), NULL, NULL));
+
+				if (rc->rc_shadow_devidx == SIZE_MAX)
+					continue;
+
+				zio_nowait(zio_vdev_child_io(zio, NULL,
+				    vd->vdev_child[rc->rc_shadow_devidx],
+				    rc->rc_shadow_offset, rc->rc_abd,
+				    rc->rc_size, ZIO_TYPE_WRITE,
+				    ZIO_PRIORITY_ASYNC_WRITE,
+				    ZIO_FLAG_IO_REPAIR, NULL, NULL));
+			}
+		}
+	}
+}
+
 /*
  * Complete an IO operation on a RAIDZ VDev
  *
@@ -2052,6 +2530,11 @@ vdev_raidz_io_done(zio_t *zio)
 
 	ASSERT(zio->io_bp != NULL);  /* XXX need to add code to enforce this */
 
+	if (rm->rm_row != NULL) {
+		vdev_raidz_io_done_rows(zio);
+		return;
+	}
+
 	ASSERT(rm->rm_missingparity <= rm->rm_firstdatacol);
 	ASSERT(rm->rm_missingdata <= rm->rm_cols - rm->rm_firstdatacol);
 
@@ -2308,6 +2791,35 @@ vdev_raidz_state_change(vdev_t *vd, int faulted, int degraded)
 		vdev_set_state(vd, B_FALSE, VDEV_STATE_HEALTHY, VDEV_AUX_NONE);
 }
 
+/*
+ * Translate a range of the RAID-Z vdev to the sectors of child cvd that it
+ * covers.  Sectors are laid out across the children in rows, so child c
+ * holds every width'th sector of the vdev, starting with sector c.  Only
+ * sectors wholly within the range are included.
+ */
+static void
+vdev_raidz_xlate(vdev_t *cvd, const range_seg_t *in, range_seg_t *res)
+{
+	vdev_t *raidvd = cvd->vdev_parent;
+	uint64_t width = raidvd->vdev_children;
+	uint64_t tgt_col = cvd->vdev_id;
+	uint64_t ashift = raidvd->vdev_top->vdev_ashift;
+	uint64_t b_start = P2ROUNDUP(in->rs_start, 1ULL << ashift) >> ashift;
+	uint64_t b_end = in->rs_end >> ashift;
+	uint64_t start_row = 0, end_row = 0;
+
+	ASSERT(raidvd->vdev_ops == &vdev_raidz_ops);
+
+	/* first and last row with a sector of this child in the range */
+	if (b_start > tgt_col)
+		start_row = ((b_start - tgt_col - 1) / width) + 1;
+	if (b_end > tgt_col)
+		end_row = ((b_end - tgt_col - 1) / width) + 1;
+
+	res->rs_start = start_row << ashift;
+	res->rs_end = MAX(end_row, start_row) << ashift;
+}
+
 vdev_ops_t vdev_raidz_ops = {
 	vdev_raidz_open,
 	vdev_raidz_close,
@@ -2317,6 +2829,7 @@ vdev_ops_t vdev_raidz_ops = {
 	vdev_raidz_state_change,
 	NULL,
 	NULL,
+	vdev_raidz_xlate,
 	VDEV_TYPE_RAIDZ,	/* name of this vdev type */
 	B_FALSE			/* not a leaf vdev */
 };
@@ -0,0 +1,909 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa_impl.h>
+#include <sys/dmu.h>
+#include <sys/dmu_tx.h>
+#include <sys/zap.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_raidz.h>
+#include <sys/metaslab.h>
+#include <sys/metaslab_impl.h>
+#include <sys/txg.h>
+#include <sys/dsl_pool.h>
+#include <sys/dsl_synctask.h>
+#include <sys/zfeature.h>
+#include <sys/abd.h>
+#include <sys/vdev_trim.h>
+#include <sys/vdev_raidz_expand.h>
+#include <sys/fs/zfs.h>
+
+/*
+ * A RAID-Z vdev is expanded by attaching a new child to it.  The sectors of
+ * a RAID-Z vdev are numbered across its children in rows: with W children,
+ * sector S of the vdev is sector S / W of child S % W.  Blocks are never
+ * rewritten, so a block keeps the sectors it was allocated, and the number
+ * of columns it was laid out with, the "logical width".  What changes is
+ * where those sectors are: the expansion moves every sector of the vdev to
+ * its location in the wider row numbering, from the start of the vdev to
+ * its end.  The logical width of the vdev is recorded in the config for
+ * each txg it changed in, see vdev_raidz_logical_width(), and blocks born
+ * before the expansion completed are read and written one sector at a time
+ * at wherever the layout has put them (see vdev_raidz_map_alloc_rows()).
+ *
+ * The expansion thread moves the allocated ranges of one metaslab after the
+ * other, in chunks of up to zfs_raidz_expand_max_copy_bytes.  Sectors below
+ * vre_offset have been moved; sectors above it are still where they were
+ * in the narrower layout.  The move of a chunk overwrites the old location
+ * of sectors moved before it, so a chunk may only go as far as the old
+ * location of every sector it is written to belongs to a sector whose move
+ * is already on disk, below the offset recorded in the uberblock in
+ * ub_raidz_reflow_info.  A crash therefore never loses data: the reflow
+ * resumes at that offset and moves the sectors after it again.  With W
+ * children, W / (W - 1) times as many sectors as were synced may be moved,
+ * so this limit grows geometrically with each txg, starting from the first
+ * row, which is the same in both layouts.  No scratch space is needed.
+ *
+ * Writes to sectors that were moved but whose move isn't on disk yet go to
+ * both locations, so that the data is current whichever offset the pool is
+ * imported with.  Each I/O to the vdev holds a range lock as reader on the
+ * sectors it covers while it is issued and done, and the move of a chunk
+ * holds it as writer.  No new blocks are allocated from a metaslab while it
+ * is being moved (ms_reflowing), so that the ranges which were free when the
+ * move started can be skipped.
+ *
+ * Once every metaslab has been moved, spa_raidz_expand_complete() records
+ * the new logical width for blocks born from then on, and the vdev grows by
+ * the size of the new child.
+ */
+
+/*
+ * Maximum number of bytes moved at once.
+ */
+int zfs_raidz_expand_max_copy_bytes = 16 * 1024 * 1024;
+
+static void vdev_raidz_expand_thread(void *arg);
+
+static void
+spa_raidz_expand_sync_phys(spa_t *spa, dmu_tx_t *tx)
+{
+	VERIFY0(zap_update(spa->spa_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_RAIDZ_EXPAND, sizeof (uint64_t),
+	    sizeof (spa_raidz_expand_phys_t) / sizeof (uint64_t),
+	    &spa->spa_raidz_expand_phys, tx));
+}
+
+/*
+ * Return the number of columns blocks born in the given txg are laid out
+ * with, or those of blocks written now for a txg of 0.  vdev_rz_widths
+ * holds the width of the vdev from each txg on; it is only set once the
+ * vdev was expanded.
+ */
+uint64_t
+vdev_raidz_logical_width(vdev_t *vd, uint64_t txg)
+{
+	uint64_t width;
+	uint_t i;
+
+	ASSERT3P(vd->vdev_ops, ==, &vdev_raidz_ops);
+
+	if (vd->vdev_rz_nwidths == 0)
+		return (vd->vdev_children);
+
+	width = vd->vdev_rz_widths[1];
+	for (i = 0; i < vd->vdev_rz_nwidths; i++) {
+		if (txg != 0 && vd->vdev_rz_widths[2 * i] > txg)
+			break;
+		width = vd->vdev_rz_widths[2 * i + 1];
+	}
+
+	return (width);
+}
+
+static void
+vdev_raidz_add_width(vdev_t *vd, uint64_t txg, uint64_t width)
+{
+	uint_t n = vd->vdev_rz_nwidths;
+	uint64_t *widths;
+
+	widths = kmem_alloc((n + 1) * 2 * sizeof (uint64_t), KM_SLEEP);
+	if (n != 0) {
+		bcopy(vd->vdev_rz_widths, widths, n * 2 * sizeof (uint64_t));
+		kmem_free(vd->vdev_rz_widths, n * 2 * sizeof (uint64_t));
+	}
+	widths[2 * n] = txg;
+	widths[2 * n + 1] = width;
+
+	vd->vdev_rz_widths = widths;
+	vd->vdev_rz_nwidths = n + 1;
+}
+
+/*
+ * The first row of the vdev is laid out the same with and without the new
+ * child, so the reflow starts after it.
+ */
+static uint64_t
+vdev_raidz_expand_start(vdev_t *vd)
+{
+	return ((vd->vdev_children - 1) << vd->vdev_ashift);
+}
+
+static vdev_raidz_expand_t *
+vdev_raidz_expand_create(vdev_t *vd, uint64_t offset)
+{
+	vdev_raidz_expand_t *vre = kmem_zalloc(sizeof (*vre), KM_SLEEP);
+
+	mutex_init(&vre->vre_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&vre->vre_cv, NULL, CV_DEFAULT, NULL);
+	zfs_rlock_init(&vre->vre_rangelock);
+	vre->vre_vdev_id = vd->vdev_id;
+	vre->vre_offset = offset;
+	vre->vre_offset_synced = offset;
+
+	return (vre);
+}
+
+void
+vdev_raidz_expand_destroy(vdev_raidz_expand_t *vre)
+{
+	ASSERT3P(vre->vre_thread, ==, NULL);
+
+	zfs_rlock_destroy(&vre->vre_rangelock);
+	mutex_destroy(&vre->vre_lock);
+	cv_destroy(&vre->vre_cv);
+	kmem_free(vre, sizeof (*vre));
+}
+
+/*
+ * Lock the range of the vdev an I/O covers against the reflow, and return
+ * how far the reflow got.  Returns NULL, and offsets past the end of any
+ * vdev, if the vdev isn't being expanded.
+ */
+rl_t *
+vdev_raidz_expand_lock(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t *synced, uint64_t *reflowed)
+{
+	vdev_raidz_expand_t *vre = vd->vdev_spa->spa_raidz_expand;
+	rl_t *rl;
+
+	if (vre == NULL || vre->vre_vdev_id != vd->vdev_id ||
+	    vd->vdev_rz_expanding == 0) {
+		*synced = UINT64_MAX;
+		*reflowed = UINT64_MAX;
+		return (NULL);
+	}
+
+	rl = zfs_range_lock(&vre->vre_rangelock, offset, size, RL_READER);
+
+	mutex_enter(&vre->vre_lock);
+	*synced = vre->vre_offset_synced;
+	*reflowed = vre->vre_offset;
+	mutex_exit(&vre->vre_lock);
+
+	return (rl);
+}
+
+/*
+ * Start the expansion in syncing context, in the txg the new child was
+ * attached in.
+ */
+static void
+vdev_raidz_expand_initiate_sync(void *arg, dmu_tx_t *tx)
+{
+	uint64_t vdev_id = (uintptr_t)arg;
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+	vdev_raidz_expand_t *vre = spa->spa_raidz_expand;
+	spa_raidz_expand_phys_t *rep = &spa->spa_raidz_expand_phys;
+	vdev_t *vd = vdev_lookup_top(spa, vdev_id);
+
+	ASSERT3P(vre, !=, NULL);
+	ASSERT3U(vre->vre_vdev_id, ==, vdev_id);
+	ASSERT(vd->vdev_rz_expanding != 0);
+
+	/*
+	 * Blocks written before the expansion can only be read knowing
+	 * about it, so the feature stays active from now on.
+	 */
+	spa_feature_incr(spa, SPA_FEATURE_RAIDZ_EXPANSION, tx);
+
+	rep->rep_state = DSS_SCANNING;
+	rep->rep_expanding_vdev = vdev_id;
+	rep->rep_start_time = gethrestime_sec();
+	rep->rep_end_time = 0;
+	rep->rep_to_reflow = vd->vdev_stat.vs_alloc;
+	rep->rep_reflowed = 0;
+	spa_raidz_expand_sync_phys(spa, tx);
+
+	spa->spa_uberblock.ub_raidz_reflow_info = vre->vre_offset;
+
+	spa_history_log_internal(spa, "raidz expand started", tx,
+	    "%s vdev %llu children %llu", spa_name(spa),
+	    (u_longlong_t)vdev_id, (u_longlong_t)vd->vdev_children);
+
+	spa_restart_raidz_expand(spa);
+}
+
+/*
+ * Attach newvd to the RAID-Z vdev vd, and start moving its data to the
+ * wider layout.  Called from spa_vdev_attach() with the vdev config lock
+ * held, in the given txg.
+ */
+int
+vdev_raidz_attach(vdev_t *vd, vdev_t *newvd, uint64_t txg)
+{
+	spa_t *spa = vd->vdev_spa;
+	dmu_tx_t *tx;
+
+	ASSERT(spa_config_held(spa, SCL_ALL, RW_WRITER) == SCL_ALL);
+	ASSERT3P(vd->vdev_ops, ==, &vdev_raidz_ops);
+	ASSERT3P(vd, ==, vd->vdev_top);
+
+	if (!spa_feature_is_enabled(spa, SPA_FEATURE_RAIDZ_EXPANSION))
+		return (SET_ERROR(ENOTSUP));
+
+	if (spa->spa_raidz_expand != NULL || vd->vdev_rz_expanding != 0)
+		return (SET_ERROR(EBUSY));
+
+	/*
+	 * Every sector is read from the child it's on when it's moved,
+	 * without reconstruction.
+	 */
+	if (vd->vdev_state != VDEV_STATE_HEALTHY)
+		return (SET_ERROR(ENXIO));
+
+	/*
+	 * The new child cannot have a higher alignment requirement than
+	 * the vdev, and must be as large as its other children.
+	 */
+	if (newvd->vdev_ashift > vd->vdev_ashift)
+		return (SET_ERROR(EDOM));
+
+	if (newvd->vdev_asize < vdev_get_min_asize(vd->vdev_child[0]))
+		return (SET_ERROR(EOVERFLOW));
+
+	/*
+	 * TRIM translates ranges with the layout of the whole vdev, which
+	 * is only known again once the expansion is complete.
+	 */
+	vdev_trim_stop_all(vd, VDEV_TRIM_CANCELED);
+
+	/* blocks born so far keep the current width */
+	if (vd->vdev_rz_nwidths == 0)
+		vdev_raidz_add_width(vd, 0, vd->vdev_children);
+
+	vdev_remove_child(newvd->vdev_parent, newvd);
+	newvd->vdev_id = vd->vdev_children;
+	newvd->vdev_crtxg = vd->vdev_crtxg;
+	vdev_add_child(vd, newvd);
+
+	vd->vdev_rz_expanding = txg;
+	vdev_config_dirty(vd);
+
+	spa->spa_raidz_expand = vdev_raidz_expand_create(vd,
+	    vdev_raidz_expand_start(vd));
+
+	tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+	dsl_sync_task_nowait(spa->spa_dsl_pool, vdev_raidz_expand_initiate_sync,
+	    (void *)(uintptr_t)vd->vdev_id, 0, ZFS_SPACE_CHECK_NONE, tx);
+	dmu_tx_commit(tx);
+
+	return (0);
+}
+
+/*
+ * Record how far the reflow got by the end of this txg, which is where it
+ * resumes after a crash.  The moves up to there were written and flushed
+ * before the txg was assigned.
+ */
+static void
+vdev_raidz_expand_progress_sync(void *arg, dmu_tx_t *tx)
+{
+	spa_t *spa = arg;
+	vdev_raidz_expand_t *vre = spa->spa_raidz_expand;
+	int t = dmu_tx_get_txg(tx) & TXG_MASK;
+
+	if (vre == NULL)
+		return;
+
+	mutex_enter(&vre->vre_lock);
+	if (vre->vre_offset_pending[t] != 0) {
+		spa->spa_uberblock.ub_raidz_reflow_info =
+		    vre->vre_offset_pending[t];
+	}
+	spa->spa_raidz_expand_phys.rep_reflowed += vre->vre_bytes_done[t];
+	vre->vre_offset_pending[t] = 0;
+	vre->vre_bytes_done[t] = 0;
+	mutex_exit(&vre->vre_lock);
+
+	spa_raidz_expand_sync_phys(spa, tx);
+}
+
+static void
+vdev_raidz_reflow_done(zio_t *zio)
+{
+	vdev_raidz_expand_t *vre = zio->io_private;
+
+	if (zio->io_error != 0) {
+		mutex_enter(&vre->vre_lock);
+		vre->vre_failed = B_TRUE;
+		mutex_exit(&vre->vre_lock);
+	}
+}
+
+/*
+ * Move the sectors of the range [start, end) of the vdev from their
+ * location in the narrower layout to the one including the new child.  The
+ * sectors of a range are contiguous on each child in both layouts, so this
+ * is one read from each of the old children, and one write to each child.
+ */
+static int
+vdev_raidz_reflow_copy(vdev_raidz_expand_t *vre, vdev_t *vd, uint64_t start,
+    uint64_t end)
+{
+	spa_t *spa = vd->vdev_spa;
+	uint64_t ashift = vd->vdev_ashift;
+	uint64_t width = vd->vdev_children;
+	uint64_t owidth = width - 1;
+	uint64_t a = start >> ashift;
+	uint64_t b = end >> ashift;
+	uint64_t *ofirst, *nfirst;
+	uint64_t c, s, lo, hi;
+	abd_t **oabd, **nabd;
+	zio_t *pio;
+	int error = 0;
+
+	ofirst = kmem_zalloc(width * sizeof (uint64_t), KM_SLEEP);
+	nfirst = kmem_zalloc(width * sizeof (uint64_t), KM_SLEEP);
+	oabd = kmem_zalloc(width * sizeof (abd_t *), KM_SLEEP);
+	nabd = kmem_zalloc(width * sizeof (abd_t *), KM_SLEEP);
+
+	pio = zio_null(NULL, spa, vd, NULL, NULL, ZIO_FLAG_CANFAIL);
+	for (c = 0; c < owidth; c++) {
+		/* rows of child c with a sector in [a, b) */
+		lo = (a + owidth - 1 - c) / owidth;
+		hi = (b + owidth - 1 - c) / owidth;
+		if (hi <= lo)
+			continue;
+
+		ofirst[c] = lo;
+		oabd[c] = abd_alloc_for_io((hi - lo) << ashift, B_FALSE);
+		zio_nowait(zio_vdev_child_io(pio, NULL, vd->vdev_child[c],
+		    lo << ashift, oabd[c], (hi - lo) << ashift, ZIO_TYPE_READ,
+		    ZIO_PRIORITY_SCRUB, 0, vdev_raidz_reflow_done, vre));
+	}
+	(void) zio_wait(pio);
+
+	mutex_enter(&vre->vre_lock);
+	if (vre->vre_failed)
+		error = SET_ERROR(EIO);
+	mutex_exit(&vre->vre_lock);
+	if (error != 0)
+		goto out;
+
+	for (c = 0; c < width; c++) {
+		lo = (a + width - 1 - c) / width;
+		hi = (b + width - 1 - c) / width;
+		if (hi <= lo)
+			continue;
+
+		nfirst[c] = lo;
+		nabd[c] = abd_alloc_for_io((hi - lo) << ashift, B_FALSE);
+	}
+
+	for (s = a; s < b; s++) {
+		abd_copy_off(nabd[s % width], oabd[s % owidth],
+		    (s / width - nfirst[s % width]) << ashift,
+		    (s / owidth - ofirst[s % owidth]) << ashift,
+		    1ULL << ashift);
+	}
+
+	pio = zio_null(NULL, spa, vd, NULL, NULL, ZIO_FLAG_CANFAIL);
+	for (c = 0; c < width; c++) {
+		if (nabd[c] == NULL)
+			continue;
+
+		hi = (b + width - 1 - c) / width;
+		zio_nowait(zio_vdev_child_io(pio, NULL, vd->vdev_child[c],
+		    nfirst[c] << ashift, nabd[c], (hi - nfirst[c]) << ashift,
+		    ZIO_TYPE_WRITE, ZIO_PRIORITY_ASYNC_WRITE, 0,
+		    vdev_raidz_reflow_done, vre));
+	}
+	(void) zio_wait(pio);
+
+	/*
+	 * The move is recorded in the uberblock of a later txg, which must
+	 * not be written before the moved data is stable.
+	 */
+	pio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
+	zio_flush(pio, vd);
+	(void) zio_wait(pio);
+
+	mutex_enter(&vre->vre_lock);
+	if (vre->vre_failed)
+		error = SET_ERROR(EIO);
+	mutex_exit(&vre->vre_lock);
+
+out:
+	for (c = 0; c < width; c++) {
+		if (oabd[c] != NULL)
+			abd_free(oabd[c]);
+		if (nabd[c] != NULL)
+			abd_free(nabd[c]);
+	}
+	kmem_free(nabd, width * sizeof (abd_t *));
+	kmem_free(oabd, width * sizeof (abd_t *));
+	kmem_free(nfirst, width * sizeof (uint64_t));
+	kmem_free(ofirst, width * sizeof (uint64_t));
+
+	return (error);
+}
+
+/*
+ * Wait for the moves so far to be on disk, which allows the next chunk to
+ * overwrite the old location of the sectors they moved.
+ */
+static void
+vdev_raidz_expand_wait_synced(spa_t *spa, vdev_raidz_expand_t *vre)
+{
+	uint64_t synced, offset;
+	rl_t *rl;
+
+	txg_wait_synced(spa->spa_dsl_pool, vre->vre_last_txg);
+
+	/*
+	 * I/Os which may still write the old location of those sectors
+	 * hold them as readers, so wait for them before moving on.
+	 */
+	mutex_enter(&vre->vre_lock);
+	synced = vre->vre_offset_synced;
+	offset = vre->vre_offset;
+	mutex_exit(&vre->vre_lock);
+
+	if (offset == synced)
+		return;
+
+	rl = zfs_range_lock(&vre->vre_rangelock, synced, offset - synced,
+	    RL_WRITER);
+	mutex_enter(&vre->vre_lock);
+	vre->vre_offset_synced = offset;
+	mutex_exit(&vre->vre_lock);
+	zfs_range_unlock(rl);
+}
+
+/*
+ * Move the next chunk of the current metaslab, up to ms_end.  Ranges that
+ * were free when the metaslab was started are skipped, without I/O.
+ */
+static int
+vdev_raidz_expand_chunk(spa_t *spa, vdev_raidz_expand_t *vre,
+    range_tree_t *allocd, uint64_t ms_end)
+{
+	vdev_t *vd;
+	range_seg_t *rs;
+	dmu_tx_t *tx;
+	rl_t *rl;
+	uint64_t start, end, last, limit, synced, owidth, txg, max_copy;
+	boolean_t copy;
+	int t, error = 0;
+
+	spa_config_enter(spa, SCL_STATE, FTAG, RW_READER);
+	vd = vdev_lookup_top(spa, vre->vre_vdev_id);
+	owidth = vd->vdev_children - 1;
+	max_copy = MAX(P2ALIGN((uint64_t)zfs_raidz_expand_max_copy_bytes,
+	    1ULL << vd->vdev_ashift), 1ULL << vd->vdev_ashift);
+
+	/*
+	 * The new location of sector s is the old location of sector
+	 * (s / width) * owidth + s % width, so everything below the sector
+	 * whose new location is the old one of the first sector not synced
+	 * may be moved.
+	 */
+	mutex_enter(&vre->vre_lock);
+	start = vre->vre_offset;
+	synced = vre->vre_offset_synced >> vd->vdev_ashift;
+	limit = ((synced / owidth) * vd->vdev_children + synced % owidth) <<
+	    vd->vdev_ashift;
+
+	rs = avl_first(&allocd->rt_root);
+	if (rs != NULL && rs->rs_start <= start) {
+		end = MIN(MIN(limit, ms_end), start + max_copy);
+		copy = B_TRUE;
+
+		/* small free ranges are moved along, not the trailing one */
+		for (last = start; rs != NULL && rs->rs_start < end;
+		    rs = AVL_NEXT(&allocd->rt_root, rs))
+			last = MIN(rs->rs_end, end);
+		if (last > start)
+			end = last;
+	} else {
+		end = (rs != NULL ? MIN(rs->rs_start, ms_end) : ms_end);
+		copy = B_FALSE;
+	}
+	mutex_exit(&vre->vre_lock);
+
+	if (end <= start) {
+		spa_config_exit(spa, SCL_STATE, FTAG);
+		vdev_raidz_expand_wait_synced(spa, vre);
+		return (0);
+	}
+
+	tx = dmu_tx_create_dd(spa_get_dsl(spa)->dp_mos_dir);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	txg = dmu_tx_get_txg(tx);
+	t = txg & TXG_MASK;
+
+	rl = zfs_range_lock(&vre->vre_rangelock, start, end - start,
+	    RL_WRITER);
+	if (copy)
+		error = vdev_raidz_reflow_copy(vre, vd, start, end);
+
+	mutex_enter(&vre->vre_lock);
+	if (error == 0) {
+		if (vre->vre_offset_pending[t] == 0) {
+			dsl_sync_task_nowait(dmu_tx_pool(tx),
+			    vdev_raidz_expand_progress_sync, spa, 0,
+			    ZFS_SPACE_CHECK_NONE, tx);
+		}
+		vre->vre_offset = end;
+		vre->vre_offset_pending[t] = end;
+		if (copy)
+			vre->vre_bytes_done[t] += end - start;
+		vre->vre_last_txg = txg;
+		range_tree_clear(allocd, start, end - start);
+	}
+	mutex_exit(&vre->vre_lock);
+	zfs_range_unlock(rl);
+
+	dmu_tx_commit(tx);
+	spa_config_exit(spa, SCL_STATE, FTAG);
+
+	return (error);
+}
+
+/*
+ * Set allocd to the allocated ranges of the metaslab which have not been
+ * moved yet.  No new blocks are allocated from it until it's done, so this
+ * is everything but its free space and the frees not yet returned to it.
+ * vre_lock is only taken once the metaslab is loaded: its space map may be
+ * read from the expanding vdev, whose I/Os take vre_lock.
+ */
+static int
+vdev_raidz_expand_allocd(vdev_raidz_expand_t *vre, metaslab_t *msp,
+    range_tree_t *allocd)
+{
+	int t, error;
+
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT(MUTEX_NOT_HELD(&vre->vre_lock));
+
+	metaslab_load_wait(msp);
+	if (!msp->ms_loaded && (error = metaslab_load(msp)) != 0)
+		return (error);
+
+	mutex_enter(&vre->vre_lock);
+	ASSERT0(range_tree_space(allocd));
+	range_tree_add(allocd, msp->ms_start, msp->ms_size);
+	range_tree_walk(msp->ms_tree, range_tree_remove, allocd);
+	for (t = 0; t < TXG_SIZE; t++) {
+		if (msp->ms_freetree[t] != NULL) {
+			range_tree_walk(msp->ms_freetree[t],
+			    range_tree_remove, allocd);
+		}
+	}
+	for (t = 0; t < TXG_DEFER_SIZE; t++) {
+		if (msp->ms_defertree[t] != NULL) {
+			range_tree_walk(msp->ms_defertree[t],
+			    range_tree_remove, allocd);
+		}
+	}
+
+	if (vre->vre_offset > msp->ms_start) {
+		range_tree_clear(allocd, msp->ms_start,
+		    vre->vre_offset - msp->ms_start);
+	}
+	mutex_exit(&vre->vre_lock);
+
+	return (0);
+}
+
+static void
+vdev_raidz_expand_thread(void *arg)
+{
+	spa_t *spa = arg;
+	vdev_raidz_expand_t *vre = spa->spa_raidz_expand;
+	range_tree_t *allocd;
+	boolean_t exiting, failed;
+	int error = 0;
+
+	mutex_enter(&vre->vre_lock);
+	allocd = range_tree_create(NULL, NULL, &vre->vre_lock);
+	while (!vre->vre_thread_exit && !vre->vre_failed) {
+		vdev_t *vd;
+		metaslab_t *msp;
+		uint64_t msi, ms_end;
+
+		mutex_exit(&vre->vre_lock);
+
+		spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+		vd = vdev_lookup_top(spa, vre->vre_vdev_id);
+		msi = vre->vre_offset >> vd->vdev_ms_shift;
+		if (msi >= vd->vdev_ms_count) {
+			spa_config_exit(spa, SCL_CONFIG, FTAG);
+			mutex_enter(&vre->vre_lock);
+			break;
+		}
+		msp = vd->vdev_ms[msi];
+		ms_end = msp->ms_start + msp->ms_size;
+
+		mutex_enter(&msp->ms_lock);
+		msp->ms_reflowing = B_TRUE;
+		error = vdev_raidz_expand_allocd(vre, msp, allocd);
+		mutex_exit(&msp->ms_lock);
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+		while (error == 0 && !vre->vre_thread_exit &&
+		    vre->vre_offset < ms_end)
+			error = vdev_raidz_expand_chunk(spa, vre, allocd, ms_end);
+
+		mutex_enter(&msp->ms_lock);
+		msp->ms_reflowing = B_FALSE;
+		mutex_exit(&msp->ms_lock);
+
+		mutex_enter(&vre->vre_lock);
+		if (error != 0)
+			vre->vre_failed = B_TRUE;
+		range_tree_vacate(allocd, NULL, NULL);
+	}
+	range_tree_destroy(allocd);
+
+	/*
+	 * After an I/O error the reflow is paused, at the offset it got to,
+	 * until the pool is imported again.
+	 */
+	failed = vre->vre_failed;
+	if (failed) {
+		zfs_dbgmsg("expansion of vdev %llu paused at offset %llu: "
+		    "error %d", (u_longlong_t)vre->vre_vdev_id,
+		    (u_longlong_t)vre->vre_offset, error);
+	}
+	exiting = vre->vre_thread_exit;
+	mutex_exit(&vre->vre_lock);
+
+	if (!exiting && !failed)
+		txg_wait_synced(spa->spa_dsl_pool, 0);
+
+	mutex_enter(&vre->vre_lock);
+	vre->vre_thread = NULL;
+	cv_broadcast(&vre->vre_cv);
+	mutex_exit(&vre->vre_lock);
+
+	/*
+	 * Once everything has been moved and that is on disk, the vdev can
+	 * start using the new child for new blocks.
+	 */
+	if (!exiting && !failed)
+		spa_async_request(spa, SPA_ASYNC_RAIDZ_EXPAND_DONE);
+
+	thread_exit();
+}
+
+/*
+ * Start the expansion thread, if an expansion is in progress.
+ */
+void
+spa_restart_raidz_expand(spa_t *spa)
+{
+	vdev_raidz_expand_t *vre = spa->spa_raidz_expand;
+
+	if (vre == NULL || !spa_writeable(spa) ||
+	    spa->spa_async_suspended != 0)
+		return;
+
+	mutex_enter(&vre->vre_lock);
+	if (vre->vre_thread == NULL && !vre->vre_failed) {
+		ASSERT(!vre->vre_thread_exit);
+		vre->vre_thread = thread_create(NULL, 0,
+		    vdev_raidz_expand_thread, spa, 0, &p0, TS_RUN,
+		    minclsyspri);
+	}
+	mutex_exit(&vre->vre_lock);
+}
+
+/*
+ * Stop the expansion thread.  It's restarted by spa_restart_raidz_expand().
+ */
+void
+spa_raidz_expand_suspend(spa_t *spa)
+{
+	vdev_raidz_expand_t *vre = spa->spa_raidz_expand;
+
+	if (vre == NULL)
+		return;
+
+	mutex_enter(&vre->vre_lock);
+	vre->vre_thread_exit = B_TRUE;
+	cv_broadcast(&vre->vre_cv);
+	while (vre->vre_thread != NULL)
+		cv_wait(&vre->vre_cv, &vre->vre_lock);
+	vre->vre_thread_exit = B_FALSE;
+	mutex_exit(&vre->vre_lock);
+}
+
+static void
+vdev_raidz_expand_complete_sync(void *arg, dmu_tx_t *tx)
+{
+	uint64_t vdev_id = (uintptr_t)arg;
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+	spa_raidz_expand_phys_t *rep = &spa->spa_raidz_expand_phys;
+
+	rep->rep_state = DSS_FINISHED;
+	rep->rep_end_time = gethrestime_sec();
+	spa_raidz_expand_sync_phys(spa, tx);
+
+	spa_history_log_internal(spa, "raidz expand completed", tx,
+	    "%s vdev %llu", spa_name(spa), (u_longlong_t)vdev_id);
+}
+
+/*
+ * Start allocating across all children of the vdev once everything has
+ * been moved.  Called from the async thread after the expansion thread is
+ * done.
+ */
+void
+spa_raidz_expand_complete(spa_t *spa)
+{
+	vdev_raidz_expand_t *vre;
+	vdev_t *vd;
+	dmu_tx_t *tx;
+	uint64_t txg;
+
+	txg = spa_vdev_enter(spa);
+
+	vre = spa->spa_raidz_expand;
+	if (vre == NULL || vre->vre_thread != NULL || vre->vre_failed) {
+		(void) spa_vdev_exit(spa, NULL, txg, 0);
+		return;
+	}
+
+	vd = vdev_lookup_top(spa, vre->vre_vdev_id);
+	if (vre->vre_offset < vd->vdev_ms_count << vd->vdev_ms_shift) {
+		(void) spa_vdev_exit(spa, NULL, txg, 0);
+		return;
+	}
+
+	/*
+	 * Blocks may already have been allocated in the txgs up to the
+	 * open one with the old width, so the new width applies to the
+	 * blocks born after them.
+	 */
+	vdev_raidz_add_width(vd, txg + TXG_CONCURRENT_STATES,
+	    vd->vdev_children);
+	vd->vdev_rz_expanding = 0;
+
+	spa->spa_raidz_expand = NULL;
+	vdev_raidz_expand_destroy(vre);
+
+	/* the new child adds to the size of the vdev from now on */
+	vd->vdev_expanding = B_TRUE;
+	vdev_reopen(vd);
+	vd->vdev_expanding = B_FALSE;
+	vdev_expand(vd, txg);
+	vdev_config_dirty(vd);
+
+	tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+	dsl_sync_task_nowait(spa->spa_dsl_pool, vdev_raidz_expand_complete_sync,
+	    (void *)(uintptr_t)vd->vdev_id, 0, ZFS_SPACE_CHECK_NONE, tx);
+	dmu_tx_commit(tx);
+
+	(void) spa_vdev_exit(spa, NULL, txg, 0);
+
+	if (spa->spa_autotrim)
+		spa_async_request(spa, SPA_ASYNC_AUTOTRIM_RESTART);
+}
+
+/*
+ * Set up the expansion in progress, if any, before anything is read from
+ * the pool.  Called from spa_load() once the uberblock has been selected:
+ * the reflow resumes where the last synced txg says it got to.
+ */
+void
+spa_raidz_expand_load(spa_t *spa)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	uberblock_t *ub = &spa->spa_uberblock;
+	int c;
+
+	ASSERT3P(spa->spa_raidz_expand, ==, NULL);
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *vd = rvd->vdev_child[c];
+		uint64_t offset;
+
+		if (vd->vdev_ops != &vdev_raidz_ops ||
+		    vd->vdev_rz_expanding == 0)
+			continue;
+
+		offset = vdev_raidz_expand_start(vd);
+		if (ub->ub_txg >= vd->vdev_rz_expanding)
+			offset = MAX(offset, ub->ub_raidz_reflow_info);
+
+		spa->spa_raidz_expand = vdev_raidz_expand_create(vd, offset);
+		break;
+	}
+}
+
+/*
+ * Load the state of the last expansion.  Called from spa_load() once the
+ * MOS is open.
+ */
+int
+spa_raidz_expand_init(spa_t *spa)
+{
+	int error;
+
+	error = zap_lookup(spa->spa_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_RAIDZ_EXPAND, sizeof (uint64_t),
+	    sizeof (spa_raidz_expand_phys_t) / sizeof (uint64_t),
+	    &spa->spa_raidz_expand_phys);
+	if (error == ENOENT) {
+		bzero(&spa->spa_raidz_expand_phys,
+		    sizeof (spa_raidz_expand_phys_t));
+		spa->spa_raidz_expand_phys.rep_state = DSS_NONE;
+		spa->spa_raidz_expand_phys.rep_expanding_vdev = -1ULL;
+	} else if (error != 0) {
+		return (error);
+	}
+
+	if (spa->spa_raidz_expand_phys.rep_state == DSS_SCANNING &&
+	    spa->spa_raidz_expand == NULL)
+		return (SET_ERROR(EIO));
+
+	return (0);
+}
+
+int
+spa_raidz_expand_get_stats(spa_t *spa, pool_raidz_expand_stat_t *pres)
+{
+	spa_raidz_expand_phys_t *rep = &spa->spa_raidz_expand_phys;
+
+	if (rep->rep_state == DSS_NONE)
+		return (SET_ERROR(ENOENT));
+
+	bzero(pres, sizeof (*pres));
+	pres->pres_state = rep->rep_state;
+	pres->pres_expanding_vdev = rep->rep_expanding_vdev;
+	pres->pres_start_time = rep->rep_start_time;
+	pres->pres_end_time = rep->rep_end_time;
+	pres->pres_to_reflow = rep->rep_to_reflow;
+	pres->pres_reflowed = rep->rep_reflowed;
+
+	return (0);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(vdev_raidz_attach);
+EXPORT_SYMBOL(vdev_raidz_logical_width);
+EXPORT_SYMBOL(spa_raidz_expand_complete);
+EXPORT_SYMBOL(spa_raidz_expand_suspend);
+EXPORT_SYMBOL(spa_restart_raidz_expand);
+EXPORT_SYMBOL(spa_raidz_expand_load);
+EXPORT_SYMBOL(spa_raidz_expand_init);
+EXPORT_SYMBOL(spa_raidz_expand_get_stats);
+
+module_param(zfs_raidz_expand_max_copy_bytes, int, 0644);
+MODULE_PARM_DESC(zfs_raidz_expand_max_copy_bytes,
+	"Max bytes moved at once when expanding a raidz vdev");
+#endif
@@ -0,0 +1,1177 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/spa_impl.h>
+#include <sys/dmu.h>
+#include <sys/dmu_tx.h>
+#include <sys/zap.h>
+#include <sys/vdev_impl.h>
+#include <sys/metaslab.h>
+#include <sys/metaslab_impl.h>
+#include <sys/txg.h>
+#include <sys/dsl_pool.h>
+#include <sys/dsl_synctask.h>
+#include <sys/zfeature.h>
+#include <sys/abd.h>
+#include <sys/vdev_trim.h>
+#include <sys/vdev_removal.h>
+#include <sys/vdev_indirect_mapping.h>
+#include <sys/fs/zfs.h>
+#include <sys/sysevent/eventdefs.h>
+
+/*
+ * Removal of a top-level vdev other than a log device works by copying all
+ * of its allocated space to the other top-level vdevs of its class, and then
+ * replacing it with an indirect vdev (see vdev_indirect.c).  Block pointers
+ * are never rewritten; instead, the indirect mapping records where each
+ * copied range of the removed vdev now lives.
+ *
+ * spa_vdev_remove_top() stops allocations from the vdev and starts the
+ * removal in syncing context, which creates the mapping.  The removal thread
+ * then walks the metaslabs of the vdev in order.  For each, it determines
+ * the allocated ranges and copies them in chunks of up to
+ * zfs_remove_max_segment bytes: each chunk is allocated elsewhere, appended
+ * to the in-core mapping, and copied with a read from the removing vdev
+ * followed by a write to the new location.  The copies of a txg are children
+ * of spa_txg_zio[], which spa_sync() waits for before the new mapping
+ * entries are written out by spa_vdev_mapping_sync().  Everything below
+ * svr_max_offset has been copied.
+ *
+ * Blocks freed while the vdev is being removed are freed from the vdev
+ * itself and, if they were already copied, from their new location as well,
+ * see free_from_removing_vdev().  Once every metaslab has been copied,
+ * spa_vdev_remove_complete() frees the metaslabs of the vdev and swaps it
+ * for an indirect vdev.  The removal can be canceled until then, which
+ * frees all the copies.
+ *
+ * Pools with RAID-Z top-level vdevs are not supported, and all top-level
+ * vdevs must have the same ashift, so that every copied range has the same
+ * allocated size on its new vdev.
+ */
+
+/*
+ * Maximum number of bytes of copies in flight.
+ */
+int zfs_remove_max_copy_bytes = 64 * 1024 * 1024;
+
+/*
+ * Maximum size of a single copy, and so of a single mapping entry.  Larger
+ * allocated ranges are split up.
+ */
+int zfs_remove_max_segment = SPA_MAXBLOCKSIZE;
+
+static void spa_vdev_remove_thread(void *arg);
+
+static void
+spa_removal_sync_phys(spa_t *spa, dmu_tx_t *tx)
+{
+	VERIFY0(zap_update(spa->spa_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_REMOVING, sizeof (uint64_t),
+	    sizeof (spa_removing_phys_t) / sizeof (uint64_t),
+	    &spa->spa_removing_phys, tx));
+}
+
+static spa_vdev_removal_t *
+spa_vdev_removal_create(vdev_t *vd)
+{
+	spa_vdev_removal_t *svr = kmem_zalloc(sizeof (*svr), KM_SLEEP);
+
+	mutex_init(&svr->svr_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&svr->svr_cv, NULL, CV_DEFAULT, NULL);
+	svr->svr_allocd_segs = range_tree_create(NULL, NULL, &svr->svr_lock);
+	svr->svr_vdev_id = vd->vdev_id;
+
+	return (svr);
+}
+
+void
+spa_vdev_removal_destroy(spa_vdev_removal_t *svr)
+{
+	ASSERT3P(svr->svr_thread, ==, NULL);
+
+	mutex_enter(&svr->svr_lock);
+	range_tree_vacate(svr->svr_allocd_segs, NULL, NULL);
+	range_tree_destroy(svr->svr_allocd_segs);
+	mutex_exit(&svr->svr_lock);
+
+	mutex_destroy(&svr->svr_lock);
+	cv_destroy(&svr->svr_cv);
+	kmem_free(svr, sizeof (*svr));
+}
+
+static boolean_t
+vdev_has_raidz(vdev_t *vd)
+{
+	int c;
+
+	if (vd->vdev_ops == &vdev_raidz_ops)
+		return (B_TRUE);
+	for (c = 0; c < vd->vdev_children; c++) {
+		if (vdev_has_raidz(vd->vdev_child[c]))
+			return (B_TRUE);
+	}
+	return (B_FALSE);
+}
+
+/*
+ * Whether the ranges of vd, or vd itself, can be copied to the top-level
+ * vdev tvd.  Ranges are copied as they are, so tvd may not allocate more
+ * than it is asked to, as RAID-Z does even below a mirror, and must have
+ * the same ashift, unless it is a log vdev, which nothing is copied to.
+ */
+boolean_t
+spa_vdev_remove_copyable(vdev_t *vd, vdev_t *tvd)
+{
+	if (vdev_has_raidz(tvd))
+		return (B_FALSE);
+
+	return (!vdev_is_concrete(tvd) || tvd->vdev_islog ||
+	    tvd->vdev_ashift == vd->vdev_ashift);
+}
+
+/*
+ * Return the class the data of a removing vdev is copied to: its own if
+ * another vdev can take it, or else the normal class for a special vdev.
+ * Returns NULL if there is nowhere to copy to.
+ */
+static metaslab_class_t *
+spa_vdev_remove_class(vdev_t *vd)
+{
+	spa_t *spa = vd->vdev_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	metaslab_class_t *mc = vd->vdev_mg->mg_class;
+	boolean_t normal = B_FALSE;
+	int c;
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *cvd = rvd->vdev_child[c];
+
+		if (cvd == vd || !vdev_is_concrete(cvd) ||
+		    cvd->vdev_removing || cvd->vdev_mg == NULL)
+			continue;
+		if (cvd->vdev_mg->mg_class == mc)
+			return (mc);
+		if (cvd->vdev_mg->mg_class == spa_normal_class(spa))
+			normal = B_TRUE;
+	}
+
+	if (mc == spa_special_class(spa) && normal)
+		return (spa_normal_class(spa));
+
+	return (NULL);
+}
+
+static int
+spa_vdev_remove_top_check(vdev_t *vd)
+{
+	spa_t *spa = vd->vdev_spa;
+	vdev_t *rvd = spa->spa_root_vdev;
+	metaslab_class_t *mc;
+	uint64_t available;
+	int c;
+
+	if (vd != vd->vdev_top)
+		return (SET_ERROR(ENOTSUP));
+
+	if (!spa_feature_is_enabled(spa, SPA_FEATURE_DEVICE_REMOVAL))
+		return (SET_ERROR(ENOTSUP));
+
+	if (spa->spa_vdev_removal != NULL)
+		return (SET_ERROR(EBUSY));
+
+	if (vd->vdev_removing || !vdev_is_concrete(vd) ||
+	    vd->vdev_ms_count == 0)
+		return (SET_ERROR(EINVAL));
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		if (!spa_vdev_remove_copyable(vd, rvd->vdev_child[c]))
+			return (SET_ERROR(EINVAL));
+	}
+
+	if ((mc = spa_vdev_remove_class(vd)) == NULL)
+		return (SET_ERROR(EINVAL));
+
+	/*
+	 * The other vdevs of the class must have room for everything
+	 * allocated on this one.
+	 */
+	available = metaslab_class_get_space(mc) -
+	    metaslab_class_get_alloc(mc);
+	if (mc == vd->vdev_mg->mg_class) {
+		available -= vd->vdev_stat.vs_space -
+		    vd->vdev_stat.vs_alloc;
+	}
+	if (available < vd->vdev_stat.vs_alloc)
+		return (SET_ERROR(ENOSPC));
+
+	return (0);
+}
+
+/*
+ * Start the removal of the vdev in syncing context: create its mapping, and
+ * record that it is being removed.
+ */
+static void
+vdev_remove_initiate_sync(void *arg, dmu_tx_t *tx)
+{
+	uint64_t vdev_id = (uintptr_t)arg;
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	vdev_t *vd = vdev_lookup_top(spa, vdev_id);
+	spa_removing_phys_t *srp = &spa->spa_removing_phys;
+	vdev_indirect_mapping_t *vim;
+
+	ASSERT(vd->vdev_removing);
+	ASSERT3P(vd->vdev_indirect_mapping, ==, NULL);
+	ASSERT3P(spa->spa_vdev_removal, ==, NULL);
+
+	spa_feature_incr(spa, SPA_FEATURE_DEVICE_REMOVAL, tx);
+
+	vd->vdev_im_object = vdev_indirect_mapping_alloc(mos, tx);
+	VERIFY0(vdev_indirect_mapping_open(mos, vd->vdev_im_object, &vim));
+	rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+	vd->vdev_indirect_mapping = vim;
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	srp->sr_state = DSS_SCANNING;
+	srp->sr_removing_vdev = vdev_id;
+	srp->sr_start_time = gethrestime_sec();
+	srp->sr_end_time = 0;
+	srp->sr_to_copy = vd->vdev_stat.vs_alloc;
+	srp->sr_copied = 0;
+	spa_removal_sync_phys(spa, tx);
+
+	spa->spa_vdev_removal = spa_vdev_removal_create(vd);
+	vdev_config_dirty(vd);
+
+	spa_history_log_internal(spa, "vdev remove started", tx,
+	    "%s vdev %llu %s", spa_name(spa), (u_longlong_t)vdev_id,
+	    vd->vdev_path != NULL ? vd->vdev_path : "-");
+
+	spa_restart_removal(spa);
+}
+
+/*
+ * Start removing the given top-level vdev.  Called from spa_vdev_remove()
+ * with the vdev config lock held, which is dropped while the allocations
+ * and frees of the vdev drain.
+ */
+int
+spa_vdev_remove_top(vdev_t *vd, uint64_t *txg)
+{
+	spa_t *spa = vd->vdev_spa;
+	metaslab_group_t *mg = vd->vdev_mg;
+	dmu_tx_t *tx;
+	int error;
+
+	if ((error = spa_vdev_remove_top_check(vd)) != 0)
+		return (error);
+
+	/*
+	 * Stop allocating from this vdev, and wait for the youngest
+	 * allocations and frees to sync, and for the deferral of those
+	 * frees to finish.
+	 */
+	metaslab_group_passivate(mg);
+	spa_vdev_config_exit(spa, NULL,
+	    *txg + TXG_CONCURRENT_STATES + TXG_DEFER_SIZE, 0, FTAG);
+
+	/*
+	 * The ZIL preallocates the next log block, which may be on this
+	 * vdev and would be written after it was copied.  Reset the logs so
+	 * that all log blocks are allocated elsewhere.
+	 */
+	error = spa_offline_log(spa);
+
+	*txg = spa_vdev_config_enter(spa);
+
+	if (error == 0)
+		error = spa_vdev_remove_top_check(vd);
+	if (error != 0) {
+		metaslab_group_activate(mg);
+		return (error);
+	}
+
+	vd->vdev_removing = B_TRUE;
+	vdev_dirty_leaves(vd, VDD_DTL, *txg);
+	vdev_config_dirty(vd);
+
+	tx = dmu_tx_create_assigned(spa->spa_dsl_pool, *txg);
+	dsl_sync_task_nowait(spa->spa_dsl_pool, vdev_remove_initiate_sync,
+	    (void *)(uintptr_t)vd->vdev_id, 0, ZFS_SPACE_CHECK_NONE, tx);
+	dmu_tx_commit(tx);
+
+	return (0);
+}
+
+/*
+ * Write out the mapping entries added in this txg, whose copies spa_sync()
+ * waited for, and the progress of the removal.
+ */
+static void
+spa_vdev_mapping_sync(void *arg, dmu_tx_t *tx)
+{
+	spa_t *spa = arg;
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	int t = dmu_tx_get_txg(tx) & TXG_MASK;
+	vdev_t *vd;
+
+	/* the removal may have been canceled since */
+	if (svr == NULL)
+		return;
+
+	vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+
+	mutex_enter(&svr->svr_lock);
+	if (svr->svr_max_offset_to_sync[t] != 0) {
+		rw_enter(&vd->vdev_indirect_rwlock, RW_READER);
+		vdev_indirect_mapping_sync(vd->vdev_indirect_mapping,
+		    svr->svr_entries_to_sync[t], tx);
+		rw_exit(&vd->vdev_indirect_rwlock);
+	}
+	spa->spa_removing_phys.sr_copied += svr->svr_bytes_done[t];
+	svr->svr_entries_to_sync[t] = 0;
+	svr->svr_max_offset_to_sync[t] = 0;
+	svr->svr_bytes_done[t] = 0;
+	mutex_exit(&svr->svr_lock);
+
+	spa_removal_sync_phys(spa, tx);
+}
+
+static void
+spa_vdev_copy_write_done(zio_t *zio)
+{
+	spa_vdev_removal_t *svr = zio->io_private;
+
+	abd_free(zio->io_abd);
+
+	mutex_enter(&svr->svr_lock);
+	if (zio->io_error != 0)
+		svr->svr_copy_errors++;
+	ASSERT3U(svr->svr_bytes_inflight, >=, zio->io_size);
+	svr->svr_bytes_inflight -= zio->io_size;
+	cv_broadcast(&svr->svr_cv);
+	mutex_exit(&svr->svr_lock);
+
+	spa_config_exit(zio->io_spa, SCL_STATE, zio->io_spa);
+}
+
+static void
+spa_vdev_copy_read_done(zio_t *zio)
+{
+	zio_t *wzio = zio->io_private;
+	spa_vdev_removal_t *svr = wzio->io_private;
+
+	if (zio->io_error != 0) {
+		mutex_enter(&svr->svr_lock);
+		svr->svr_copy_errors++;
+		mutex_exit(&svr->svr_lock);
+	}
+
+	zio_nowait(wzio);
+}
+
+/*
+ * Copy the first of the allocated ranges left in the current metaslab, or
+ * as much of it as fits in one allocation.
+ */
+static int
+spa_vdev_copy_segment(spa_t *spa, spa_vdev_removal_t *svr)
+{
+	vdev_t *vd, *dvd;
+	metaslab_class_t *mc;
+	range_seg_t *rs;
+	dmu_tx_t *tx;
+	dva_t dst;
+	abd_t *abd;
+	zio_t *nzio, *wzio;
+	uint64_t txg, start, size, align;
+	int t, error;
+
+	mutex_enter(&svr->svr_lock);
+	while (svr->svr_bytes_inflight >= zfs_remove_max_copy_bytes &&
+	    !svr->svr_thread_exit)
+		cv_wait(&svr->svr_cv, &svr->svr_lock);
+	mutex_exit(&svr->svr_lock);
+
+	if (svr->svr_thread_exit)
+		return (0);
+
+	tx = dmu_tx_create_dd(spa_get_dsl(spa)->dp_mos_dir);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+	txg = dmu_tx_get_txg(tx);
+	t = txg & TXG_MASK;
+
+	/*
+	 * Keep the vdevs from going away until the copy is written, see
+	 * spa_vdev_copy_write_done().
+	 */
+	spa_config_enter(spa, SCL_STATE, spa, RW_READER);
+	spa_config_enter(spa, SCL_ALLOC, FTAG, RW_READER);
+
+	vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+	align = 1ULL << vd->vdev_ashift;
+	mc = spa_vdev_remove_class(vd);
+
+	mutex_enter(&svr->svr_lock);
+	rs = avl_first(&svr->svr_allocd_segs->rt_root);
+	if (rs == NULL) {
+		mutex_exit(&svr->svr_lock);
+		spa_config_exit(spa, SCL_ALLOC, FTAG);
+		spa_config_exit(spa, SCL_STATE, spa);
+		dmu_tx_commit(tx);
+		return (0);
+	}
+	start = rs->rs_start;
+	size = MIN(rs->rs_end - start, zfs_remove_max_segment);
+	size = MAX(P2ALIGN(size, align), align);
+
+	/*
+	 * Without contiguous free space, copy the range in smaller pieces.
+	 */
+	error = SET_ERROR(ENOSPC);
+	while (mc != NULL && mc->mc_rotor != NULL) {
+		bzero(&dst, sizeof (dst));
+		error = metaslab_alloc_dva(spa, mc, size, &dst, 0, NULL,
+		    txg, 0);
+		if (error == 0 || size == align)
+			break;
+		size = MAX(P2ALIGN(size / 2, align), align);
+	}
+	if (error != 0) {
+		mutex_exit(&svr->svr_lock);
+		spa_config_exit(spa, SCL_ALLOC, FTAG);
+		spa_config_exit(spa, SCL_STATE, spa);
+		dmu_tx_commit(tx);
+		return (error);
+	}
+	ASSERT3U(DVA_GET_ASIZE(&dst), ==, size);
+	dvd = vdev_lookup_top(spa, DVA_GET_VDEV(&dst));
+
+	range_tree_remove(svr->svr_allocd_segs, start, size);
+
+	rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+	vdev_indirect_mapping_add_entry(vd->vdev_indirect_mapping, start,
+	    &dst);
+	svr->svr_entries_to_sync[t] =
+	    vdev_indirect_mapping_num_entries(vd->vdev_indirect_mapping);
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	if (svr->svr_max_offset_to_sync[t] == 0) {
+		dsl_sync_task_nowait(dmu_tx_pool(tx), spa_vdev_mapping_sync,
+		    spa, 0, ZFS_SPACE_CHECK_NONE, tx);
+	}
+	svr->svr_max_offset = start + size;
+	svr->svr_max_offset_to_sync[t] = start + size;
+	svr->svr_bytes_done[t] += size;
+	svr->svr_bytes_inflight += size;
+	mutex_exit(&svr->svr_lock);
+
+	spa_config_exit(spa, SCL_ALLOC, FTAG);
+
+	/*
+	 * The write is a child of the null zio as well, so spa_sync() waits
+	 * for it even though it's only issued once the read is done.
+	 */
+	abd = abd_alloc_for_io(size, B_FALSE);
+	nzio = zio_null(spa->spa_txg_zio[t], spa, NULL, NULL, NULL,
+	    ZIO_FLAG_CANFAIL);
+	wzio = zio_vdev_child_io(nzio, NULL, dvd, DVA_GET_OFFSET(&dst), abd,
+	    size, ZIO_TYPE_WRITE, ZIO_PRIORITY_ASYNC_WRITE, 0,
+	    spa_vdev_copy_write_done, svr);
+	zio_nowait(zio_vdev_child_io(nzio, NULL, vd, start, abd, size,
+	    ZIO_TYPE_READ, ZIO_PRIORITY_SCRUB, 0,
+	    spa_vdev_copy_read_done, wzio));
+	zio_nowait(nzio);
+
+	dmu_tx_commit(tx);
+
+	return (0);
+}
+
+/*
+ * Set svr_allocd_segs to the allocated ranges of the metaslab which have
+ * not been copied yet.  The metaslab is not allocated from any more, so
+ * this is everything but its free space and the frees not yet returned to
+ * it.
+ */
+static int
+spa_vdev_remove_allocd(spa_vdev_removal_t *svr, metaslab_t *msp)
+{
+	range_tree_t *allocd = svr->svr_allocd_segs;
+	int t, error;
+
+	ASSERT(MUTEX_HELD(&svr->svr_lock));
+	ASSERT(MUTEX_HELD(&msp->ms_lock));
+	ASSERT0(range_tree_space(allocd));
+
+	metaslab_load_wait(msp);
+	if (!msp->ms_loaded && (error = metaslab_load(msp)) != 0)
+		return (error);
+
+	range_tree_add(allocd, msp->ms_start, msp->ms_size);
+	range_tree_walk(msp->ms_tree, range_tree_remove, allocd);
+	for (t = 0; t < TXG_SIZE; t++) {
+		if (msp->ms_freetree[t] != NULL) {
+			range_tree_walk(msp->ms_freetree[t],
+			    range_tree_remove, allocd);
+		}
+	}
+	for (t = 0; t < TXG_DEFER_SIZE; t++) {
+		if (msp->ms_defertree[t] != NULL) {
+			range_tree_walk(msp->ms_defertree[t],
+			    range_tree_remove, allocd);
+		}
+	}
+
+	if (svr->svr_max_offset > msp->ms_start) {
+		range_tree_clear(allocd, msp->ms_start,
+		    svr->svr_max_offset - msp->ms_start);
+	}
+	svr->svr_max_offset = MAX(svr->svr_max_offset, msp->ms_start);
+
+	return (0);
+}
+
+static void
+spa_vdev_remove_thread(void *arg)
+{
+	spa_t *spa = arg;
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	boolean_t exiting;
+	int error = 0;
+
+	mutex_enter(&svr->svr_lock);
+	while (!svr->svr_thread_exit && error == 0) {
+		vdev_t *vd;
+		metaslab_t *msp;
+		uint64_t msi, ms_end;
+
+		mutex_exit(&svr->svr_lock);
+
+		spa_config_enter(spa, SCL_CONFIG, FTAG, RW_READER);
+		vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+		msi = svr->svr_max_offset >> vd->vdev_ms_shift;
+		if (msi >= vd->vdev_ms_count) {
+			spa_config_exit(spa, SCL_CONFIG, FTAG);
+			mutex_enter(&svr->svr_lock);
+			break;
+		}
+		msp = vd->vdev_ms[msi];
+		ms_end = msp->ms_start + msp->ms_size;
+
+		mutex_enter(&svr->svr_lock);
+		mutex_enter(&msp->ms_lock);
+		error = spa_vdev_remove_allocd(svr, msp);
+		mutex_exit(&msp->ms_lock);
+		mutex_exit(&svr->svr_lock);
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+		while (error == 0 && !svr->svr_thread_exit &&
+		    range_tree_space(svr->svr_allocd_segs) != 0)
+			error = spa_vdev_copy_segment(spa, svr);
+
+		mutex_enter(&svr->svr_lock);
+		if (error == 0 && !svr->svr_thread_exit) {
+			ASSERT0(range_tree_space(svr->svr_allocd_segs));
+			svr->svr_max_offset = ms_end;
+		}
+		range_tree_vacate(svr->svr_allocd_segs, NULL, NULL);
+	}
+
+	while (svr->svr_bytes_inflight != 0)
+		cv_wait(&svr->svr_cv, &svr->svr_lock);
+	if (error != 0) {
+		zfs_dbgmsg("removal of vdev %llu failed: error %d",
+		    (u_longlong_t)svr->svr_vdev_id, error);
+		svr->svr_copy_errors++;
+	}
+	exiting = svr->svr_thread_exit;
+	mutex_exit(&svr->svr_lock);
+
+	if (!exiting)
+		txg_wait_synced(spa->spa_dsl_pool, 0);
+
+	mutex_enter(&svr->svr_lock);
+	svr->svr_thread = NULL;
+	cv_broadcast(&svr->svr_cv);
+	mutex_exit(&svr->svr_lock);
+
+	/*
+	 * Once everything has been copied and the mapping has been
+	 * written out, the vdev can be replaced by an indirect vdev.  If
+	 * a copy failed, this cancels the removal instead.
+	 */
+	if (!exiting)
+		spa_async_request(spa, SPA_ASYNC_REMOVE_DONE);
+
+	thread_exit();
+}
+
+/*
+ * Start the removal thread, if a removal is in progress.
+ */
+void
+spa_restart_removal(spa_t *spa)
+{
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+
+	if (svr == NULL || !spa_writeable(spa) ||
+	    spa->spa_async_suspended != 0)
+		return;
+
+	mutex_enter(&svr->svr_lock);
+	if (svr->svr_thread == NULL && svr->svr_copy_errors == 0) {
+		ASSERT(!svr->svr_thread_exit);
+		svr->svr_thread = thread_create(NULL, 0,
+		    spa_vdev_remove_thread, spa, 0, &p0, TS_RUN, minclsyspri);
+	}
+	mutex_exit(&svr->svr_lock);
+}
+
+/*
+ * Stop the removal thread.  It's restarted by spa_restart_removal().
+ */
+void
+spa_vdev_remove_suspend(spa_t *spa)
+{
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+
+	if (svr == NULL)
+		return;
+
+	mutex_enter(&svr->svr_lock);
+	svr->svr_thread_exit = B_TRUE;
+	cv_broadcast(&svr->svr_cv);
+	while (svr->svr_thread != NULL)
+		cv_wait(&svr->svr_cv, &svr->svr_lock);
+	svr->svr_thread_exit = B_FALSE;
+	mutex_exit(&svr->svr_lock);
+}
+
+/*
+ * Return the txg in which the mapping entry for the given offset is, or
+ * will be, written out.  The new location of a copied range is allocated
+ * in that txg, so it can only be freed in it or later.
+ */
+static uint64_t
+spa_vdev_removal_entry_txg(spa_vdev_removal_t *svr, uint64_t offset,
+    uint64_t txg)
+{
+	uint64_t t;
+
+	ASSERT(MUTEX_HELD(&svr->svr_lock));
+
+	for (t = txg; t < txg + TXG_CONCURRENT_STATES; t++) {
+		if (offset < svr->svr_max_offset_to_sync[t & TXG_MASK])
+			return (t);
+	}
+
+	return (txg);
+}
+
+typedef struct removal_free_arg {
+	spa_vdev_removal_t *rfa_svr;
+	uint64_t	rfa_offset;	/* of the range being remapped */
+	uint64_t	rfa_txg;
+} removal_free_arg_t;
+
+static void
+free_mapped_segment_cb(void *arg, uint64_t split_offset, vdev_t *vd,
+    uint64_t offset, uint64_t size)
+{
+	removal_free_arg_t *rfa = arg;
+
+	metaslab_free_concrete(vd, offset, size,
+	    spa_vdev_removal_entry_txg(rfa->rfa_svr,
+	    rfa->rfa_offset + split_offset, rfa->rfa_txg));
+}
+
+/*
+ * Free a range of the vdev being removed.  The part which was already
+ * copied is freed from its new location and marked obsolete, and the rest
+ * is left out of the copy.
+ */
+void
+free_from_removing_vdev(vdev_t *vd, uint64_t offset, uint64_t size,
+    uint64_t txg)
+{
+	spa_t *spa = vd->vdev_spa;
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	uint64_t end = offset + size;
+
+	ASSERT3U(txg, ==, spa_syncing_txg(spa));
+	ASSERT3U(vd->vdev_id, ==, svr->svr_vdev_id);
+
+	mutex_enter(&svr->svr_lock);
+
+	if (offset < svr->svr_max_offset) {
+		uint64_t len = MIN(end, svr->svr_max_offset) - offset;
+		removal_free_arg_t rfa;
+
+		rfa.rfa_svr = svr;
+		rfa.rfa_offset = offset;
+		rfa.rfa_txg = txg;
+		VERIFY0(vdev_indirect_remap(vd, offset, len,
+		    free_mapped_segment_cb, &rfa));
+		vdev_indirect_mark_obsolete(vd, offset, len, txg);
+	}
+
+	if (end > svr->svr_max_offset) {
+		uint64_t start = MAX(offset, svr->svr_max_offset);
+
+		range_tree_clear(svr->svr_allocd_segs, start, end - start);
+		spa->spa_removing_phys.sr_to_copy -=
+		    MIN(spa->spa_removing_phys.sr_to_copy, end - start);
+	}
+
+	metaslab_free_concrete(vd, offset, size, txg);
+
+	mutex_exit(&svr->svr_lock);
+}
+
+typedef struct vdev_remove_complete_arg {
+	uint64_t	vrca_ms_array;
+	uint64_t	vrca_ms_count;
+	uint64_t	vrca_ms_shift;
+	uint64_t	vrca_asize;
+	uint64_t	vrca_ashift;
+	boolean_t	vrca_biased;
+	nvlist_t	*vrca_leaf_zaps;
+} vdev_remove_complete_arg_t;
+
+static void
+vdev_remove_enlist_zaps(vdev_t *vd, nvlist_t *zaps)
+{
+	int c;
+
+	for (c = 0; c < vd->vdev_children; c++)
+		vdev_remove_enlist_zaps(vd->vdev_child[c], zaps);
+
+	if (vd->vdev_leaf_zap != 0) {
+		char name[32];
+
+		(void) snprintf(name, sizeof (name), "%llu",
+		    (u_longlong_t)vd->vdev_leaf_zap);
+		fnvlist_add_uint64(zaps, name, vd->vdev_leaf_zap);
+		vd->vdev_leaf_zap = 0;
+	}
+}
+
+/*
+ * Free the metaslab space maps and leaf ZAPs of the removed vdev, and record
+ * that the removal is finished.
+ */
+static void
+vdev_remove_complete_sync(void *arg, dmu_tx_t *tx)
+{
+	vdev_remove_complete_arg_t *vrca = arg;
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	vdev_t *vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+	nvpair_t *pair;
+	kmutex_t lock;
+	uint64_t m;
+
+	ASSERT3P(vd->vdev_ops, ==, &vdev_indirect_ops);
+
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	for (m = 0; m < vrca->vrca_ms_count; m++) {
+		space_map_t *sm = NULL;
+		uint64_t object;
+
+		if (dmu_read(mos, vrca->vrca_ms_array, m * sizeof (uint64_t),
+		    sizeof (uint64_t), &object, DMU_READ_PREFETCH) != 0 ||
+		    object == 0)
+			continue;
+
+		mutex_enter(&lock);
+		VERIFY0(space_map_open(&sm, mos, object,
+		    m << vrca->vrca_ms_shift, 1ULL << vrca->vrca_ms_shift,
+		    vrca->vrca_ashift, &lock));
+		space_map_free(sm, tx);
+		space_map_close(sm);
+		mutex_exit(&lock);
+	}
+	mutex_destroy(&lock);
+	VERIFY0(dmu_object_free(mos, vrca->vrca_ms_array, tx));
+
+	for (pair = nvlist_next_nvpair(vrca->vrca_leaf_zaps, NULL);
+	    pair != NULL;
+	    pair = nvlist_next_nvpair(vrca->vrca_leaf_zaps, pair))
+		vdev_destroy_unlink_zap(vd, fnvpair_value_uint64(pair), tx);
+
+	if (vrca->vrca_biased)
+		spa_feature_decr(spa, SPA_FEATURE_ALLOCATION_CLASSES, tx);
+
+	spa->spa_removing_phys.sr_state = DSS_FINISHED;
+	spa->spa_removing_phys.sr_end_time = gethrestime_sec();
+	spa_removal_sync_phys(spa, tx);
+
+	spa_history_log_internal(spa, "vdev remove completed", tx,
+	    "%s vdev %llu", spa_name(spa), (u_longlong_t)vd->vdev_id);
+
+	spa->spa_vdev_removal = NULL;
+	spa_vdev_removal_destroy(svr);
+
+	fnvlist_free(vrca->vrca_leaf_zaps);
+	kmem_free(vrca, sizeof (*vrca));
+}
+
+static int spa_vdev_remove_cancel_impl(spa_t *spa);
+
+/*
+ * Replace the vdev by an indirect vdev once everything has been copied.
+ * Called from the async thread after the removal thread is done.
+ */
+void
+spa_vdev_remove_complete(spa_t *spa)
+{
+	spa_vdev_removal_t *svr;
+	vdev_remove_complete_arg_t *vrca;
+	metaslab_group_t *mg;
+	vdev_t *vd, *ivd;
+	dmu_tx_t *tx;
+	uint64_t txg, m;
+	int t;
+
+	txg = spa_vdev_enter(spa);
+
+	svr = spa->spa_vdev_removal;
+	if (svr == NULL || svr->svr_thread != NULL) {
+		(void) spa_vdev_exit(spa, NULL, txg, 0);
+		return;
+	}
+
+	if (svr->svr_copy_errors != 0) {
+		(void) spa_vdev_exit(spa, NULL, txg, 0);
+		zfs_dbgmsg("canceling removal of vdev %llu after %llu errors",
+		    (u_longlong_t)svr->svr_vdev_id,
+		    (u_longlong_t)svr->svr_copy_errors);
+		(void) spa_vdev_remove_cancel_impl(spa);
+		return;
+	}
+
+	vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+	if (svr->svr_max_offset < vd->vdev_ms_count << vd->vdev_ms_shift) {
+		(void) spa_vdev_exit(spa, NULL, txg, 0);
+		return;
+	}
+
+	vdev_trim_stop_all(vd, VDEV_TRIM_CANCELED);
+
+	/*
+	 * The recent frees of the vdev are never returned to its metaslabs,
+	 * which are about to go away.
+	 */
+	for (m = 0; m < vd->vdev_ms_count; m++) {
+		metaslab_t *msp = vd->vdev_ms[m];
+
+		mutex_enter(&msp->ms_lock);
+		for (t = 0; t < TXG_DEFER_SIZE; t++) {
+			if (msp->ms_defertree[t] != NULL) {
+				range_tree_vacate(msp->ms_defertree[t],
+				    NULL, NULL);
+			}
+		}
+		vdev_space_update(vd, -msp->ms_deferspace,
+		    -msp->ms_deferspace, 0);
+		msp->ms_deferspace = 0;
+		mutex_exit(&msp->ms_lock);
+
+		for (t = 0; t < TXG_SIZE; t++)
+			(void) txg_list_remove_this(&vd->vdev_ms_list, msp, t);
+	}
+	for (t = 0; t < TXG_SIZE; t++) {
+		while (txg_list_remove(&vd->vdev_dtl_list, t) != NULL)
+			continue;
+	}
+
+	vrca = kmem_zalloc(sizeof (*vrca), KM_SLEEP);
+	vrca->vrca_ms_array = vd->vdev_ms_array;
+	vrca->vrca_ms_count = vd->vdev_ms_count;
+	vrca->vrca_ms_shift = vd->vdev_ms_shift;
+	vrca->vrca_asize = vd->vdev_asize;
+	vrca->vrca_ashift = vd->vdev_ashift;
+	vrca->vrca_biased = (vd->vdev_alloc_bias != VDEV_BIAS_NONE);
+	vrca->vrca_leaf_zaps = fnvlist_alloc();
+	vdev_remove_enlist_zaps(vd, vrca->vrca_leaf_zaps);
+
+	mg = vd->vdev_mg;
+	vdev_metaslab_fini(vd);
+	metaslab_group_destroy(mg);
+	vd->vdev_mg = NULL;
+	vd->vdev_ms_array = 0;
+	vd->vdev_ms_count = 0;
+	vd->vdev_ms_shift = 0;
+	vd->vdev_alloc_bias = VDEV_BIAS_NONE;
+
+	ASSERT0(vd->vdev_stat.vs_space);
+	ASSERT0(vd->vdev_stat.vs_dspace);
+	ASSERT0(vd->vdev_stat.vs_alloc);
+
+	tx = dmu_tx_create_assigned(spa->spa_dsl_pool, txg);
+	dsl_sync_task_nowait(spa->spa_dsl_pool, vdev_remove_complete_sync,
+	    vrca, 0, ZFS_SPACE_CHECK_NONE, tx);
+	dmu_tx_commit(tx);
+
+	/*
+	 * The indirect vdev takes over the id, mapping and top-level ZAP of
+	 * the removed vdev, and the removed vdev is freed.
+	 */
+	ivd = vdev_add_parent(vd, &vdev_indirect_ops);
+	ivd->vdev_removing = B_FALSE;
+	vdev_remove_child(ivd, vd);
+	vdev_compact_children(ivd);
+	vdev_config_dirty(ivd);
+
+	(void) spa_vdev_exit(spa, NULL, txg, 0);
+
+	/*
+	 * Wipe the labels of the removed devices, once the config without
+	 * them is on disk.
+	 */
+	txg = spa_vdev_enter(spa);
+	(void) vdev_label_init(vd, 0, VDEV_LABEL_REMOVE);
+	vdev_config_dirty(spa->spa_root_vdev);
+	(void) spa_vdev_exit(spa, vd, txg, 0);
+
+	spa_event_notify(spa, NULL, ESC_ZFS_VDEV_REMOVE_DEV);
+}
+
+static int
+spa_vdev_remove_cancel_check(void *arg, dmu_tx_t *tx)
+{
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+
+	if (spa->spa_vdev_removal == NULL)
+		return (SET_ERROR(ENOENT));
+	return (0);
+}
+
+/*
+ * Throw away the copies made so far, and the mapping.
+ */
+static void
+spa_vdev_remove_cancel_sync(void *arg, dmu_tx_t *tx)
+{
+	spa_t *spa = dmu_tx_pool(tx)->dp_spa;
+	objset_t *mos = spa->spa_meta_objset;
+	spa_vdev_removal_t *svr = spa->spa_vdev_removal;
+	vdev_t *vd = vdev_lookup_top(spa, svr->svr_vdev_id);
+	uint64_t txg = dmu_tx_get_txg(tx);
+	range_tree_t *live;
+	range_seg_t *rs;
+	kmutex_t lock;
+
+	ASSERT3P(svr->svr_thread, ==, NULL);
+
+	/*
+	 * Free the new location of everything that was copied and is still
+	 * allocated.  Freed ranges were already freed from there.
+	 */
+	mutex_init(&lock, NULL, MUTEX_DEFAULT, NULL);
+	live = range_tree_create(NULL, NULL, &lock);
+
+	mutex_enter(&vd->vdev_obsolete_lock);
+	vdev_indirect_live_ranges(vd, live, B_TRUE);
+	range_tree_vacate(vd->vdev_obsolete_segments, NULL, NULL);
+	if (vd->vdev_obsolete_sm != NULL) {
+		space_map_free(vd->vdev_obsolete_sm, tx);
+		space_map_close(vd->vdev_obsolete_sm);
+		vd->vdev_obsolete_sm = NULL;
+	}
+	vd->vdev_obsolete_sm_object = 0;
+	mutex_exit(&vd->vdev_obsolete_lock);
+
+	mutex_enter(&svr->svr_lock);
+	mutex_enter(&lock);
+	for (rs = avl_first(&live->rt_root); rs != NULL;
+	    rs = AVL_NEXT(&live->rt_root, rs)) {
+		removal_free_arg_t rfa;
+
+		rfa.rfa_svr = svr;
+		rfa.rfa_offset = rs->rs_start;
+		rfa.rfa_txg = txg;
+		VERIFY0(vdev_indirect_remap(vd, rs->rs_start,
+		    rs->rs_end - rs->rs_start, free_mapped_segment_cb, &rfa));
+	}
+	range_tree_vacate(live, NULL, NULL);
+	mutex_exit(&lock);
+	mutex_exit(&svr->svr_lock);
+	range_tree_destroy(live);
+	mutex_destroy(&lock);
+
+	vdev_indirect_mapping_free(mos, vd->vdev_im_object, tx);
+	rw_enter(&vd->vdev_indirect_rwlock, RW_WRITER);
+	vdev_indirect_mapping_close(vd->vdev_indirect_mapping);
+	vd->vdev_indirect_mapping = NULL;
+	vd->vdev_im_object = 0;
+	rw_exit(&vd->vdev_indirect_rwlock);
+
+	vd->vdev_removing = B_FALSE;
+	vdev_dirty_leaves(vd, VDD_DTL, txg);
+	vdev_config_dirty(vd);
+
+	spa_feature_decr(spa, SPA_FEATURE_DEVICE_REMOVAL, tx);
+
+	spa->spa_removing_phys.sr_state = DSS_CANCELED;
+	spa->spa_removing_phys.sr_end_time = gethrestime_sec();
+	spa_removal_sync_phys(spa, tx);
+
+	spa_history_log_internal(spa, "vdev remove canceled", tx,
+	    "%s vdev %llu %s", spa_name(spa), (u_longlong_t)vd->vdev_id,
+	    vd->vdev_path != NULL ? vd->vdev_path : "-");
+
+	spa->spa_vdev_removal = NULL;
+	spa_vdev_removal_destroy(svr);
+}
+
+/*
+ * Cancel the removal in progress, whose thread must not be running.
+ */
+static int
+spa_vdev_remove_cancel_impl(spa_t *spa)
+{
+	uint64_t vdev_id;
+	int error;
+
+	if (spa->spa_vdev_removal == NULL)
+		return (SET_ERROR(ENOENT));
+	vdev_id = spa->spa_vdev_removal->svr_vdev_id;
+
+	error = dsl_sync_task(spa->spa_name, spa_vdev_remove_cancel_check,
+	    spa_vdev_remove_cancel_sync, NULL, 0, ZFS_SPACE_CHECK_NONE);
+
+	if (error == 0) {
+		vdev_t *vd;
+
+		spa_config_enter(spa, SCL_ALLOC | SCL_VDEV, FTAG, RW_WRITER);
+		vd = vdev_lookup_top(spa, vdev_id);
+		metaslab_group_activate(vd->vdev_mg);
+		spa_config_exit(spa, SCL_ALLOC | SCL_VDEV, FTAG);
+	}
+
+	return (error);
+}
+
+int
+spa_vdev_remove_cancel(spa_t *spa)
+{
+	int error;
+
+	spa_async_suspend(spa);
+	error = spa_vdev_remove_cancel_impl(spa);
+	spa_async_resume(spa);
+
+	return (error);
+}
+
+/*
+ * Load the state of the last removal, and the mappings of the indirect
+ * vdevs.  Called from spa_load() once the MOS is open.
+ */
+int
+spa_remove_init(spa_t *spa)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int c, error;
+
+	error = zap_lookup(spa->spa_meta_objset, DMU_POOL_DIRECTORY_OBJECT,
+	    DMU_POOL_REMOVING, sizeof (uint64_t),
+	    sizeof (spa_removing_phys_t) / sizeof (uint64_t),
+	    &spa->spa_removing_phys);
+	if (error == ENOENT) {
+		bzero(&spa->spa_removing_phys, sizeof (spa_removing_phys_t));
+		spa->spa_removing_phys.sr_state = DSS_NONE;
+		spa->spa_removing_phys.sr_removing_vdev = -1ULL;
+	} else if (error != 0) {
+		return (error);
+	}
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		if ((error = vdev_indirect_load(rvd->vdev_child[c])) != 0)
+			return (error);
+	}
+
+	if (spa->spa_removing_phys.sr_state == DSS_SCANNING) {
+		vdev_t *vd;
+
+		vd = vdev_lookup_top(spa,
+		    spa->spa_removing_phys.sr_removing_vdev);
+		if (vd == NULL || vd->vdev_indirect_mapping == NULL)
+			return (SET_ERROR(EIO));
+
+		ASSERT(vd->vdev_removing);
+		spa->spa_vdev_removal = spa_vdev_removal_create(vd);
+		spa->spa_vdev_removal->svr_max_offset =
+		    vdev_indirect_mapping_max_offset(vd->vdev_indirect_mapping);
+	}
+
+	return (0);
+}
+
+int
+spa_removal_get_stats(spa_t *spa, pool_removal_stat_t *prs)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int c;
+
+	if (spa->spa_removing_phys.sr_state == DSS_NONE)
+		return (SET_ERROR(ENOENT));
+
+	bzero(prs, sizeof (*prs));
+	prs->prs_state = spa->spa_removing_phys.sr_state;
+	prs->prs_removing_vdev = spa->spa_removing_phys.sr_removing_vdev;
+	prs->prs_start_time = spa->spa_removing_phys.sr_start_time;
+	prs->prs_end_time = spa->spa_removing_phys.sr_end_time;
+	prs->prs_to_copy = spa->spa_removing_phys.sr_to_copy;
+	prs->prs_copied = spa->spa_removing_phys.sr_copied;
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *tvd = rvd->vdev_child[c];
+
+		rw_enter(&tvd->vdev_indirect_rwlock, RW_READER);
+		if (tvd->vdev_indirect_mapping != NULL) {
+			prs->prs_mapping_memory +=
+			    vdev_indirect_mapping_size(
+			    tvd->vdev_indirect_mapping);
+		}
+		rw_exit(&tvd->vdev_indirect_rwlock);
+	}
+
+	return (0);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(spa_vdev_remove_top);
+EXPORT_SYMBOL(spa_vdev_remove_cancel);
+EXPORT_SYMBOL(spa_vdev_remove_complete);
+EXPORT_SYMBOL(spa_vdev_remove_suspend);
+EXPORT_SYMBOL(spa_restart_removal);
+EXPORT_SYMBOL(spa_remove_init);
+EXPORT_SYMBOL(spa_removal_get_stats);
+EXPORT_SYMBOL(free_from_removing_vdev);
+
+module_param(zfs_remove_max_copy_bytes, int, 0644);
+MODULE_PARM_DESC(zfs_remove_max_copy_bytes,
+	"Max bytes in flight when copying a removed vdev");
+
+module_param(zfs_remove_max_segment, int, 0644);
+MODULE_PARM_DESC(zfs_remove_max_segment,
+	"Max size of each copy when removing a vdev");
+#endif
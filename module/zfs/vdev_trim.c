@@ -0,0 +1,726 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+#include <sys/spa.h>
+#include <sys/spa_impl.h>
+#include <sys/txg.h>
+#include <sys/vdev_impl.h>
+#include <sys/vdev_trim.h>
+#include <sys/metaslab_impl.h>
+#include <sys/range_tree.h>
+#include <sys/zio.h>
+
+/*
+ * TRIM (also known as discard or UNMAP) tells a device that a range of
+ * blocks no longer holds any data.  SSDs use this to keep a pool of
+ * pre-erased blocks, thinly provisioned storage to release the space.
+ * Free space gets trimmed in two ways:
+ *
+ * - On demand: "zpool trim" starts a thread per leaf vdev which walks
+ *   the metaslabs of its top-level vdev and trims all of their free space.
+ *   A TRIM may be suspended and later resumed at the metaslab it stopped
+ *   at, or canceled.  This state is kept in-core only, it's not preserved
+ *   across an export or reboot.
+ *
+ * - Automatically: while the autotrim pool property is on, ranges freed
+ *   are collected in each metaslab's ms_trim tree by metaslab_sync_done()
+ *   as they become allocatable again.  A thread per top-level vdev takes
+ *   these ranges from a batch of metaslabs every zfs_txg_timeout seconds
+ *   and trims them on all of its leaves.
+ *
+ * In both cases ms_trimming is raised while the ranges of a metaslab are
+ * being trimmed.  The allocator skips such metaslabs, which guarantees the
+ * ranges are not reallocated (and written) before their TRIM completed.
+ * The logical ranges of the top-level vdev are translated to physical
+ * ranges of each leaf with vdev_xlate(), and issued as ZIO_TYPE_TRIM zios
+ * in the ZIO_PRIORITY_TRIM class of the vdev queue.
+ *
+ * The trim threads never block on the spa config lock.  vdev_free() stops
+ * them while the config lock is held as writer, so they only ever try to
+ * enter it and otherwise recheck whether they were asked to exit.
+ */
+
+/*
+ * Maximum size of a single TRIM command, larger ranges are split.
+ */
+unsigned int zfs_trim_extent_bytes_max = 128 * 1024 * 1024;
+
+/*
+ * Minimum size of a range to TRIM, smaller ranges are skipped.  Small
+ * ranges are likely to be reallocated soon, and are relatively costly
+ * to trim on many devices.
+ */
+unsigned int zfs_trim_extent_bytes_min = 32 * 1024;
+
+/*
+ * Maximum number of TRIM zios outstanding per leaf vdev.
+ */
+unsigned int zfs_trim_queue_limit = 10;
+
+/*
+ * Number of transaction groups over which the autotrim thread spreads
+ * a pass over all metaslabs; every zfs_txg_timeout seconds the freed
+ * space of 1/zfs_trim_txg_batch of the metaslabs is trimmed.
+ */
+unsigned int zfs_trim_txg_batch = 32;
+
+typedef struct trim_args {
+	vdev_t		*ta_vdev;	/* leaf vdev to trim */
+	kmutex_t	ta_lock;	/* protects the fields below */
+	kcondvar_t	ta_cv;
+	range_tree_t	*ta_tree;	/* physical ranges of ta_vdev */
+	uint64_t	ta_inflight;	/* outstanding zios */
+	int		ta_error;	/* first error of the zios */
+	boolean_t	*ta_exit_wanted; /* thread was asked to stop */
+	uint64_t	ta_rate;	/* bytes/sec, 0 for no limit */
+	hrtime_t	ta_start_time;	/* for rate limiting */
+	uint64_t	ta_bytes_issued;
+} trim_args_t;
+
+static void
+vdev_trim_args_init(trim_args_t *ta, vdev_t *vd, boolean_t *exit_wanted,
+    uint64_t rate)
+{
+	bzero(ta, sizeof (trim_args_t));
+	mutex_init(&ta->ta_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&ta->ta_cv, NULL, CV_DEFAULT, NULL);
+	ta->ta_tree = range_tree_create(NULL, NULL, &ta->ta_lock);
+	ta->ta_vdev = vd;
+	ta->ta_exit_wanted = exit_wanted;
+	ta->ta_rate = rate;
+	ta->ta_start_time = gethrtime();
+}
+
+static void
+vdev_trim_args_fini(trim_args_t *ta)
+{
+	mutex_enter(&ta->ta_lock);
+	ASSERT0(ta->ta_inflight);
+	range_tree_vacate(ta->ta_tree, NULL, NULL);
+	range_tree_destroy(ta->ta_tree);
+	mutex_exit(&ta->ta_lock);
+
+	mutex_destroy(&ta->ta_lock);
+	cv_destroy(&ta->ta_cv);
+}
+
+/*
+ * Enter the spa config lock as reader without blocking on a writer, which
+ * may be waiting for this thread to exit.  Returns B_FALSE if the thread
+ * was asked to exit before the lock could be taken.
+ */
+static boolean_t
+vdev_trim_config_enter(spa_t *spa, boolean_t *exit_wanted, int locks,
+    void *tag)
+{
+	while (!spa_config_tryenter(spa, locks, tag, RW_READER)) {
+		if (*exit_wanted)
+			return (B_FALSE);
+		delay(1);
+	}
+
+	if (*exit_wanted) {
+		spa_config_exit(spa, locks, tag);
+		return (B_FALSE);
+	}
+
+	return (B_TRUE);
+}
+
+static void
+vdev_trim_change_state(vdev_t *vd, vdev_trim_state_t new_state)
+{
+	ASSERT(MUTEX_HELD(&vd->vdev_trim_lock));
+
+	if (vd->vdev_trim_state == new_state)
+		return;
+
+	vd->vdev_trim_state = new_state;
+	vd->vdev_trim_action_time = gethrestime_sec();
+}
+
+static void
+vdev_trim_cb(zio_t *zio)
+{
+	trim_args_t *ta = zio->io_private;
+	vdev_t *vd = zio->io_vd;
+
+	if (zio->io_error != 0) {
+		mutex_enter(&vd->vdev_stat_lock);
+		if (zio->io_error == ENOTSUP)
+			vd->vdev_stat.vs_trim_notsup++;
+		else
+			vd->vdev_stat.vs_trim_errors++;
+		mutex_exit(&vd->vdev_stat_lock);
+
+		/* The device rejected TRIM, don't try again */
+		if (zio->io_error == ENOTSUP)
+			vd->vdev_has_trim = B_FALSE;
+	}
+
+	spa_config_exit(vd->vdev_spa, SCL_STATE_ALL, vd);
+
+	mutex_enter(&ta->ta_lock);
+	if (zio->io_error != 0 && ta->ta_error == 0)
+		ta->ta_error = zio->io_error;
+	ASSERT3U(ta->ta_inflight, >, 0);
+	ta->ta_inflight--;
+	cv_broadcast(&ta->ta_cv);
+	mutex_exit(&ta->ta_lock);
+}
+
+/*
+ * Wait until the bytes issued so far are within ta_rate.  Returns B_FALSE
+ * if the thread was asked to exit while waiting.
+ */
+static boolean_t
+vdev_trim_throttle(trim_args_t *ta)
+{
+	vdev_t *vd = ta->ta_vdev;
+	uint64_t rate = ta->ta_rate;
+	hrtime_t deadline, now;
+
+	if (rate == 0)
+		return (!*ta->ta_exit_wanted);
+
+	deadline = ta->ta_start_time +
+	    SEC2NSEC(ta->ta_bytes_issued / rate) +
+	    MSEC2NSEC((ta->ta_bytes_issued % rate) * MILLISEC / rate);
+
+	mutex_enter(&vd->vdev_trim_lock);
+	while (!*ta->ta_exit_wanted && (now = gethrtime()) < deadline) {
+		(void) cv_timedwait_hires(&vd->vdev_trim_cv,
+		    &vd->vdev_trim_lock, deadline - now, MSEC2NSEC(1), 0);
+	}
+	mutex_exit(&vd->vdev_trim_lock);
+
+	return (!*ta->ta_exit_wanted);
+}
+
+/*
+ * Issue a TRIM of the physical range [start, start + size) of the leaf,
+ * excluding the front labels.
+ */
+static int
+vdev_trim_range(trim_args_t *ta, uint64_t start, uint64_t size)
+{
+	vdev_t *vd = ta->ta_vdev;
+	spa_t *spa = vd->vdev_spa;
+
+	mutex_enter(&ta->ta_lock);
+	while (ta->ta_inflight >= zfs_trim_queue_limit)
+		cv_wait(&ta->ta_cv, &ta->ta_lock);
+	mutex_exit(&ta->ta_lock);
+
+	if (!vdev_trim_throttle(ta))
+		return (SET_ERROR(EINTR));
+
+	/*
+	 * Each zio holds the config lock, which is released by
+	 * vdev_trim_cb(), so the vdev can't go away while it's in flight.
+	 */
+	if (!vdev_trim_config_enter(spa, ta->ta_exit_wanted,
+	    SCL_STATE_ALL, vd))
+		return (SET_ERROR(EINTR));
+
+	if (!vdev_writeable(vd) || !vd->vdev_has_trim) {
+		spa_config_exit(spa, SCL_STATE_ALL, vd);
+		return (vd->vdev_has_trim ? SET_ERROR(ENXIO) :
+		    SET_ERROR(ENOTSUP));
+	}
+
+	mutex_enter(&ta->ta_lock);
+	ta->ta_inflight++;
+	mutex_exit(&ta->ta_lock);
+	ta->ta_bytes_issued += size;
+
+	zio_nowait(zio_trim(NULL, vd, start + VDEV_LABEL_START_SIZE, size,
+	    vdev_trim_cb, ta, ZIO_PRIORITY_TRIM,
+	    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_RETRY));
+
+	return (0);
+}
+
+/*
+ * Trim all ranges in ta_tree and wait for the zios to complete.  The tree
+ * is empty on return.
+ */
+static int
+vdev_trim_ranges(trim_args_t *ta)
+{
+	vdev_t *vd = ta->ta_vdev;
+	uint64_t align = 1ULL << vd->vdev_top->vdev_ashift;
+	uint64_t extent_max = MAX(P2ALIGN(zfs_trim_extent_bytes_max, align),
+	    align);
+	int error = 0;
+
+	while (error == 0) {
+		range_seg_t *rs;
+		uint64_t start, size;
+
+		mutex_enter(&ta->ta_lock);
+		if ((rs = range_tree_first(ta->ta_tree)) == NULL) {
+			mutex_exit(&ta->ta_lock);
+			break;
+		}
+		start = rs->rs_start;
+		size = MIN(rs->rs_end - rs->rs_start, extent_max);
+		range_tree_remove(ta->ta_tree, start, size);
+		mutex_exit(&ta->ta_lock);
+
+		error = vdev_trim_range(ta, start, size);
+	}
+
+	mutex_enter(&ta->ta_lock);
+	while (ta->ta_inflight > 0)
+		cv_wait(&ta->ta_cv, &ta->ta_lock);
+	range_tree_vacate(ta->ta_tree, NULL, NULL);
+	if (error == 0)
+		error = ta->ta_error;
+	ta->ta_error = 0;
+	mutex_exit(&ta->ta_lock);
+
+	return (error);
+}
+
+/*
+ * range_tree_walk() callback which translates a free range of the top-level
+ * vdev to the leaf being trimmed, and adds it to ta_tree.
+ */
+static void
+vdev_trim_xlate_add(void *arg, uint64_t start, uint64_t size)
+{
+	trim_args_t *ta = arg;
+	range_seg_t logical_rs, physical_rs;
+
+	logical_rs.rs_start = start;
+	logical_rs.rs_end = start + size;
+	vdev_xlate(ta->ta_vdev, &logical_rs, &physical_rs);
+
+	if (physical_rs.rs_end <= physical_rs.rs_start)
+		return;
+
+	size = physical_rs.rs_end - physical_rs.rs_start;
+	if (size < zfs_trim_extent_bytes_min)
+		return;
+
+	range_tree_add(ta->ta_tree, physical_rs.rs_start, size);
+}
+
+/*
+ * Free space of the top-level vdev, the unit in which the progress of an
+ * on-demand TRIM is reported.
+ */
+static uint64_t
+vdev_trim_free_space(vdev_t *tvd)
+{
+	uint64_t space;
+
+	mutex_enter(&tvd->vdev_stat_lock);
+	space = tvd->vdev_stat.vs_space - tvd->vdev_stat.vs_alloc;
+	mutex_exit(&tvd->vdev_stat_lock);
+
+	return (space);
+}
+
+static void
+vdev_trim_thread(void *arg)
+{
+	vdev_t *vd = arg;
+	spa_t *spa = vd->vdev_spa;
+	trim_args_t ta;
+	uint64_t msi;
+	int error = 0;
+
+	ASSERT(vd->vdev_ops->vdev_op_leaf);
+
+	vdev_trim_args_init(&ta, vd, &vd->vdev_trim_exit_wanted,
+	    vd->vdev_trim_rate);
+
+	for (msi = vd->vdev_trim_next_ms; error == 0; msi++) {
+		vdev_t *tvd;
+		metaslab_t *msp;
+		uint64_t ms_free = 0;
+
+		if (!vdev_trim_config_enter(spa, &vd->vdev_trim_exit_wanted,
+		    SCL_CONFIG, FTAG)) {
+			error = SET_ERROR(EINTR);
+			break;
+		}
+
+		tvd = vd->vdev_top;
+		if (msi >= tvd->vdev_ms_count) {
+			spa_config_exit(spa, SCL_CONFIG, FTAG);
+			break;
+		}
+
+		msp = tvd->vdev_ms[msi];
+		mutex_enter(&msp->ms_lock);
+
+		/* Space which was just added isn't usable yet */
+		if (msp->ms_freetree[0] == NULL) {
+			mutex_exit(&msp->ms_lock);
+			spa_config_exit(spa, SCL_CONFIG, FTAG);
+			continue;
+		}
+
+		metaslab_load_wait(msp);
+		if (!msp->ms_loaded)
+			error = metaslab_load(msp);
+
+		if (error == 0) {
+			msp->ms_trimming++;
+			ms_free = range_tree_space(msp->ms_tree);
+
+			mutex_enter(&ta.ta_lock);
+			range_tree_walk(msp->ms_tree, vdev_trim_xlate_add, &ta);
+			mutex_exit(&ta.ta_lock);
+		}
+		mutex_exit(&msp->ms_lock);
+
+		if (error == 0) {
+			error = vdev_trim_ranges(&ta);
+
+			mutex_enter(&msp->ms_lock);
+			msp->ms_trimming--;
+			mutex_exit(&msp->ms_lock);
+		}
+		spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+		if (error == 0) {
+			mutex_enter(&vd->vdev_trim_lock);
+			vd->vdev_trim_next_ms = msi + 1;
+			vd->vdev_trim_bytes_done += ms_free;
+			mutex_exit(&vd->vdev_trim_lock);
+		}
+	}
+
+	vdev_trim_args_fini(&ta);
+
+	mutex_enter(&vd->vdev_trim_lock);
+	if (!vd->vdev_trim_exit_wanted) {
+		if (error == 0) {
+			vd->vdev_trim_bytes_done = vd->vdev_trim_bytes_est;
+			vdev_trim_change_state(vd, VDEV_TRIM_COMPLETE);
+		} else if (error == ENXIO) {
+			/* The device went away; it can be resumed later */
+			vdev_trim_change_state(vd, VDEV_TRIM_SUSPENDED);
+		} else {
+			vdev_trim_change_state(vd, VDEV_TRIM_CANCELED);
+		}
+	}
+	vd->vdev_trim_thread = NULL;
+	cv_broadcast(&vd->vdev_trim_cv);
+	mutex_exit(&vd->vdev_trim_lock);
+
+	thread_exit();
+}
+
+/*
+ * Start an on-demand TRIM of the leaf vdev, or resume a suspended one,
+ * limited to rate bytes per second (0 for no limit).  The caller must
+ * hold vdev_trim_lock.
+ */
+void
+vdev_trim(vdev_t *vd, uint64_t rate)
+{
+	ASSERT(MUTEX_HELD(&vd->vdev_trim_lock));
+	ASSERT(vd->vdev_ops->vdev_op_leaf);
+	ASSERT3P(vd->vdev_trim_thread, ==, NULL);
+	ASSERT(!vd->vdev_detached);
+
+	if (vd->vdev_trim_state != VDEV_TRIM_SUSPENDED) {
+		vd->vdev_trim_next_ms = 0;
+		vd->vdev_trim_bytes_done = 0;
+		vd->vdev_trim_bytes_est = vdev_trim_free_space(vd->vdev_top);
+	}
+
+	vd->vdev_trim_rate = rate;
+	vd->vdev_trim_exit_wanted = B_FALSE;
+	vdev_trim_change_state(vd, VDEV_TRIM_ACTIVE);
+	vd->vdev_trim_thread = thread_create(NULL, 0, vdev_trim_thread, vd,
+	    0, &p0, TS_RUN, maxclsyspri);
+}
+
+/*
+ * Stop the on-demand TRIM of the leaf vdev, and wait for its thread to
+ * exit.  tgt_state is either VDEV_TRIM_CANCELED or VDEV_TRIM_SUSPENDED.
+ * The caller must hold vdev_trim_lock.
+ */
+void
+vdev_trim_stop(vdev_t *vd, vdev_trim_state_t tgt_state)
+{
+	ASSERT(MUTEX_HELD(&vd->vdev_trim_lock));
+	ASSERT(tgt_state == VDEV_TRIM_CANCELED ||
+	    tgt_state == VDEV_TRIM_SUSPENDED);
+
+	if (vd->vdev_trim_thread == NULL) {
+		/* A suspended TRIM can still be canceled */
+		if (vd->vdev_trim_state == VDEV_TRIM_SUSPENDED &&
+		    tgt_state == VDEV_TRIM_CANCELED)
+			vdev_trim_change_state(vd, tgt_state);
+		return;
+	}
+
+	vdev_trim_change_state(vd, tgt_state);
+	vd->vdev_trim_exit_wanted = B_TRUE;
+	cv_broadcast(&vd->vdev_trim_cv);
+
+	while (vd->vdev_trim_thread != NULL)
+		cv_wait(&vd->vdev_trim_cv, &vd->vdev_trim_lock);
+
+	vd->vdev_trim_exit_wanted = B_FALSE;
+}
+
+/*
+ * Trim the freed ranges of metaslab msp on all leaves below vd.  Called
+ * with the SCL_CONFIG lock held, and ranges holding the logical ranges.
+ */
+static int
+vdev_autotrim_leaves(vdev_t *vd, trim_args_t *ta, range_tree_t *ranges)
+{
+	int error = 0;
+	int c;
+
+	for (c = 0; c < vd->vdev_children && error == 0; c++)
+		error = vdev_autotrim_leaves(vd->vdev_child[c], ta, ranges);
+
+	if (error != 0 || !vd->vdev_ops->vdev_op_leaf ||
+	    !vd->vdev_has_trim || !vdev_writeable(vd))
+		return (error);
+
+	ta->ta_vdev = vd;
+	ta->ta_bytes_issued = 0;
+	ta->ta_start_time = gethrtime();
+
+	mutex_enter(ranges->rt_lock);
+	mutex_enter(&ta->ta_lock);
+	range_tree_walk(ranges, vdev_trim_xlate_add, ta);
+	mutex_exit(&ta->ta_lock);
+	mutex_exit(ranges->rt_lock);
+
+	error = vdev_trim_ranges(ta);
+
+	/* Failures of individual leaves are only recorded in their stats */
+	return (error == EINTR ? error : 0);
+}
+
+static void
+vdev_autotrim_thread(void *arg)
+{
+	vdev_t *vd = arg;
+	spa_t *spa = vd->vdev_spa;
+	kmutex_t ranges_lock;
+	range_tree_t *ranges;
+	trim_args_t ta;
+	uint64_t shift = 0;
+
+	ASSERT3P(vd, ==, vd->vdev_top);
+
+	mutex_init(&ranges_lock, NULL, MUTEX_DEFAULT, NULL);
+	ranges = range_tree_create(NULL, NULL, &ranges_lock);
+	vdev_trim_args_init(&ta, vd, &vd->vdev_autotrim_exit_wanted, 0);
+
+	mutex_enter(&vd->vdev_trim_lock);
+	while (!vd->vdev_autotrim_exit_wanted) {
+		uint64_t batch = MAX(zfs_trim_txg_batch, 1);
+		uint64_t i;
+
+		mutex_exit(&vd->vdev_trim_lock);
+
+		for (i = shift % batch; ; i += batch) {
+			metaslab_t *msp;
+			int error;
+
+			if (!vdev_trim_config_enter(spa,
+			    &vd->vdev_autotrim_exit_wanted, SCL_CONFIG, FTAG))
+				break;
+
+			if (i >= vd->vdev_ms_count || !spa->spa_autotrim) {
+				spa_config_exit(spa, SCL_CONFIG, FTAG);
+				break;
+			}
+
+			msp = vd->vdev_ms[i];
+			mutex_enter(&msp->ms_lock);
+			if (range_tree_space(msp->ms_trim) == 0) {
+				mutex_exit(&msp->ms_lock);
+				spa_config_exit(spa, SCL_CONFIG, FTAG);
+				continue;
+			}
+
+			msp->ms_trimming++;
+			mutex_enter(&ranges_lock);
+			range_tree_vacate(msp->ms_trim, range_tree_add, ranges);
+			mutex_exit(&ranges_lock);
+			mutex_exit(&msp->ms_lock);
+
+			error = vdev_autotrim_leaves(vd, &ta, ranges);
+
+			mutex_enter(&ranges_lock);
+			range_tree_vacate(ranges, NULL, NULL);
+			mutex_exit(&ranges_lock);
+
+			mutex_enter(&msp->ms_lock);
+			msp->ms_trimming--;
+			mutex_exit(&msp->ms_lock);
+
+			spa_config_exit(spa, SCL_CONFIG, FTAG);
+
+			if (error != 0)
+				break;
+		}
+		shift++;
+
+		mutex_enter(&vd->vdev_trim_lock);
+		if (!vd->vdev_autotrim_exit_wanted) {
+			(void) cv_timedwait(&vd->vdev_trim_cv,
+			    &vd->vdev_trim_lock,
+			    ddi_get_lbolt() + SEC_TO_TICK(zfs_txg_timeout));
+		}
+	}
+	mutex_exit(&vd->vdev_trim_lock);
+
+	vdev_trim_args_fini(&ta);
+	mutex_enter(&ranges_lock);
+	range_tree_destroy(ranges);
+	mutex_exit(&ranges_lock);
+	mutex_destroy(&ranges_lock);
+
+	mutex_enter(&vd->vdev_trim_lock);
+	vd->vdev_autotrim_thread = NULL;
+	cv_broadcast(&vd->vdev_trim_cv);
+	mutex_exit(&vd->vdev_trim_lock);
+
+	thread_exit();
+}
+
+static void
+vdev_autotrim_stop(vdev_t *tvd)
+{
+	ASSERT3P(tvd, ==, tvd->vdev_top);
+
+	mutex_enter(&tvd->vdev_trim_lock);
+	if (tvd->vdev_autotrim_thread != NULL) {
+		tvd->vdev_autotrim_exit_wanted = B_TRUE;
+		cv_broadcast(&tvd->vdev_trim_cv);
+
+		while (tvd->vdev_autotrim_thread != NULL)
+			cv_wait(&tvd->vdev_trim_cv, &tvd->vdev_trim_lock);
+
+		tvd->vdev_autotrim_exit_wanted = B_FALSE;
+	}
+	mutex_exit(&tvd->vdev_trim_lock);
+}
+
+/*
+ * Stop all on-demand TRIM of the leaves below vd, as well as the autotrim
+ * threads of any top-level vdevs in this part of the tree.
+ */
+void
+vdev_trim_stop_all(vdev_t *vd, vdev_trim_state_t tgt_state)
+{
+	int c;
+
+	for (c = 0; c < vd->vdev_children; c++)
+		vdev_trim_stop_all(vd->vdev_child[c], tgt_state);
+
+	if (vd->vdev_ops->vdev_op_leaf) {
+		mutex_enter(&vd->vdev_trim_lock);
+		vdev_trim_stop(vd, tgt_state);
+		mutex_exit(&vd->vdev_trim_lock);
+	}
+
+	if (vd == vd->vdev_top)
+		vdev_autotrim_stop(vd);
+}
+
+/*
+ * Start an autotrim thread for each top-level vdev which doesn't have one.
+ */
+void
+vdev_autotrim(spa_t *spa)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int c;
+
+	if (!spa->spa_autotrim || !spa_writeable(spa))
+		return;
+
+	for (c = 0; c < rvd->vdev_children; c++) {
+		vdev_t *tvd = rvd->vdev_child[c];
+
+		/* an expanding RAID-Z vdev is trimmed once it's done */
+		if (tvd->vdev_ishole || tvd->vdev_ms_count == 0 ||
+		    tvd->vdev_rz_expanding != 0)
+			continue;
+
+		mutex_enter(&tvd->vdev_trim_lock);
+		if (tvd->vdev_autotrim_thread == NULL) {
+			ASSERT(!tvd->vdev_autotrim_exit_wanted);
+			tvd->vdev_autotrim_thread = thread_create(NULL, 0,
+			    vdev_autotrim_thread, tvd, 0, &p0, TS_RUN,
+			    minclsyspri);
+		}
+		mutex_exit(&tvd->vdev_trim_lock);
+	}
+}
+
+void
+vdev_autotrim_stop_all(spa_t *spa)
+{
+	vdev_t *rvd = spa->spa_root_vdev;
+	int c;
+
+	for (c = 0; c < rvd->vdev_children; c++)
+		vdev_autotrim_stop(rvd->vdev_child[c]);
+}
+
+/*
+ * Called when the autotrim property changed or top-level vdevs were added.
+ */
+void
+vdev_autotrim_restart(spa_t *spa)
+{
+	if (spa->spa_autotrim)
+		vdev_autotrim(spa);
+	else
+		vdev_autotrim_stop_all(spa);
+}
+
+#if defined(_KERNEL) && defined(HAVE_SPL)
+EXPORT_SYMBOL(vdev_trim);
+EXPORT_SYMBOL(vdev_trim_stop);
+EXPORT_SYMBOL(vdev_trim_stop_all);
+EXPORT_SYMBOL(vdev_autotrim);
+EXPORT_SYMBOL(vdev_autotrim_stop_all);
+EXPORT_SYMBOL(vdev_autotrim_restart);
+
+module_param(zfs_trim_extent_bytes_max, uint, 0644);
+MODULE_PARM_DESC(zfs_trim_extent_bytes_max,
+	"Max size of TRIM commands, larger will be split");
+
+module_param(zfs_trim_extent_bytes_min, uint, 0644);
+MODULE_PARM_DESC(zfs_trim_extent_bytes_min,
+	"Min size of TRIM commands, smaller will be skipped");
+
+module_param(zfs_trim_queue_limit, uint, 0644);
+MODULE_PARM_DESC(zfs_trim_queue_limit,
+	"Max queued TRIMs outstanding per leaf vdev");
+
+module_param(zfs_trim_txg_batch, uint, 0644);
+MODULE_PARM_DESC(zfs_trim_txg_batch,
+	"Number of txgs over which autotrim spreads a pass over all metaslabs");
+#endif
@@ -35,6 +35,7 @@
 #include <sys/fs/zfs.h>
 #include <sys/inttypes.h>
 #include <sys/types.h>
+#include <sys/zio_compress.h>
 #include "zfeature_common.h"
 
 /*
@@ -97,8 +98,17 @@ zfeature_is_supported(const char *guid)
 
 	for (i = 0; i < SPA_FEATURES; i++) {
 		zfeature_info_t *feature = &spa_feature_table[i];
-		if (strcmp(guid, feature->fi_guid) == 0)
-			return (B_TRUE);
+		if (strcmp(guid, feature->fi_guid) != 0)
+			continue;
+
+		/*
+		 * A build without a zstd library can't read zstd blocks,
+		 * so a pool with zstd_compress active must not be opened.
+		 */
+		if (i == SPA_FEATURE_ZSTD_COMPRESS && !zstd_available())
+			return (B_FALSE);
+
+		return (B_TRUE);
 	}
 
 	return (B_FALSE);
@@ -307,4 +317,48 @@ zpool_feature_init(void)
 	    "Support for dataset level encryption",
 	    0, encryption_deps);
 	}
+
+	{
+	static const spa_feature_t zstd_deps[] = {
+		SPA_FEATURE_EXTENSIBLE_DATASET,
+		SPA_FEATURE_NONE
+	};
+	zfeature_register(SPA_FEATURE_ZSTD_COMPRESS,
+	    "org.zfsonlinux:zstd_compress", "zstd_compress",
+	    "zstd compression algorithm support.",
+	    ZFEATURE_FLAG_PER_DATASET, zstd_deps);
+	}
+
+	zfeature_register(SPA_FEATURE_ALLOCATION_CLASSES,
+	    "org.zfsonlinux:allocation_classes", "allocation_classes",
+	    "Support for separate allocation classes.",
+	    ZFEATURE_FLAG_READONLY_COMPAT, NULL);
+
+	zfeature_register(SPA_FEATURE_DEVICE_REMOVAL,
+	    "com.delphix:device_removal", "device_removal",
+	    "Top-level vdevs can be removed, reducing logical pool size.",
+	    ZFEATURE_FLAG_MOS, NULL);
+
+	zfeature_register(SPA_FEATURE_RAIDZ_EXPANSION,
+	    "org.zfsonlinux:raidz_expansion", "raidz_expansion",
+	    "Support for raidz expansion.",
+	    ZFEATURE_FLAG_MOS, NULL);
+
+	{
+	static const spa_feature_t log_spacemap_deps[] = {
+		SPA_FEATURE_SPACEMAP_HISTOGRAM,
+		SPA_FEATURE_NONE
+	};
+	zfeature_register(SPA_FEATURE_LOG_SPACEMAP,
+	    "com.delphix:log_spacemap", "log_spacemap",
+	    "Log metaslab changes on a single spacemap and "
+	    "flush them periodically.",
+	    ZFEATURE_FLAG_READONLY_COMPAT, log_spacemap_deps);
+	}
+
+	zfeature_register(SPA_FEATURE_DDT_LOG,
+	    "org.zfsonlinux:ddt_log", "ddt_log",
+	    "Log dedup table changes and merge them into the tables "
+	    "incrementally.",
+	    ZFEATURE_FLAG_READONLY_COMPAT, NULL);
 }
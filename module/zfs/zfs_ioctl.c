@@ -1894,8 +1894,8 @@ zfs_ioc_vdev_add(zfs_cmd_t *zc)
 /*
  * inputs:
  * zc_name		name of the pool
- * zc_nvlist_conf	nvlist of devices to remove
- * zc_cookie		to stop the remove?
+ * zc_guid		guid of the device to remove
+ * zc_cookie		cancel the top-level vdev removal in progress instead
  */
 static int
 zfs_ioc_vdev_remove(zfs_cmd_t *zc)
@@ -1906,7 +1906,10 @@ zfs_ioc_vdev_remove(zfs_cmd_t *zc)
 	error = spa_open(zc->zc_name, &spa, FTAG);
 	if (error != 0)
 		return (error);
-	error = spa_vdev_remove(spa, zc->zc_guid, B_FALSE);
+	if (zc->zc_cookie != 0)
+		error = spa_vdev_remove_cancel(spa);
+	else
+		error = spa_vdev_remove(spa, zc->zc_guid, B_FALSE);
 	spa_close(spa, FTAG);
 	return (error);
 }
@@ -3882,6 +3885,25 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 				spa_close(spa, FTAG);
 			}
 
+			if (intval < ZIO_COMPRESS_FUNCTIONS &&
+			    zio_compress_to_feature(intval) ==
+			    SPA_FEATURE_ZSTD_COMPRESS) {
+				spa_t *spa;
+
+				if (!zstd_available())
+					return (SET_ERROR(ENOTSUP));
+
+				if ((err = spa_open(dsname, &spa, FTAG)) != 0)
+					return (err);
+
+				if (!spa_feature_is_enabled(spa,
+				    SPA_FEATURE_ZSTD_COMPRESS)) {
+					spa_close(spa, FTAG);
+					return (SET_ERROR(ENOTSUP));
+				}
+				spa_close(spa, FTAG);
+			}
+
 			/*
 			 * If this is a bootable dataset then
 			 * verify that the compression algorithm
@@ -3938,6 +3960,27 @@ zfs_check_settable(const char *dsname, nvpair_t *pair, cred_t *cr)
 		}
 		break;
 
+	case ZFS_PROP_SPECIAL_SMALL_BLOCKS:
+		/* Any nonzero value needs the feature to be enabled */
+		if (nvpair_value_uint64(pair, &intval) == 0 && intval != 0) {
+			spa_t *spa;
+
+			if (intval < SPA_MINBLOCKSIZE ||
+			    intval > SPA_OLD_MAXBLOCKSIZE || !ISP2(intval))
+				return (SET_ERROR(ERANGE));
+
+			if ((err = spa_open(dsname, &spa, FTAG)) != 0)
+				return (err);
+
+			if (!spa_feature_is_enabled(spa,
+			    SPA_FEATURE_ALLOCATION_CLASSES)) {
+				spa_close(spa, FTAG);
+				return (SET_ERROR(ENOTSUP));
+			}
+			spa_close(spa, FTAG);
+		}
+		break;
+
 	case ZFS_PROP_DNODESIZE:
 		/* Dnode sizes above 512 need the feature to be enabled */
 		if (nvpair_value_uint64(pair, &intval) == 0 &&
@@ -5828,6 +5871,53 @@ error:
 	return (ret);
 }
 
+/*
+ * innvl: {
+ *     "trim_command" -> POOL_TRIM_{START|CANCEL|SUSPEND} (uint64)
+ *     "trim_vdevs" -> { vdev name -> vdev guid (uint64), ... } (nvlist)
+ *     (optional) "trim_rate" -> bytes per second, 0 for no limit (uint64)
+ * }
+ *
+ * outnvl: {
+ *     "trim_vdevs" -> { vdev name -> errno (int64), ... } (nvlist)
+ * }
+ *
+ * outnvl only lists the vdevs which failed, if any.
+ */
+static int
+zfs_ioc_pool_trim(const char *poolname, nvlist_t *innvl, nvlist_t *outnvl)
+{
+	spa_t *spa;
+	nvlist_t *vdev_guids, *vdev_errlist;
+	uint64_t cmd_type, rate = 0;
+	int error;
+
+	if (nvlist_lookup_uint64(innvl, ZPOOL_TRIM_COMMAND, &cmd_type) != 0)
+		return (SET_ERROR(EINVAL));
+
+	if (!(cmd_type == POOL_TRIM_START || cmd_type == POOL_TRIM_CANCEL ||
+	    cmd_type == POOL_TRIM_SUSPEND))
+		return (SET_ERROR(EINVAL));
+
+	if (nvlist_lookup_nvlist(innvl, ZPOOL_TRIM_VDEVS, &vdev_guids) != 0)
+		return (SET_ERROR(EINVAL));
+
+	(void) nvlist_lookup_uint64(innvl, ZPOOL_TRIM_RATE, &rate);
+
+	if ((error = spa_open(poolname, &spa, FTAG)) != 0)
+		return (error);
+
+	vdev_errlist = fnvlist_alloc();
+	error = spa_vdev_trim(spa, vdev_guids, cmd_type, rate, vdev_errlist);
+	if (!nvlist_empty(vdev_errlist))
+		fnvlist_add_nvlist(outnvl, ZPOOL_TRIM_VDEVS, vdev_errlist);
+	fnvlist_free(vdev_errlist);
+
+	spa_close(spa, FTAG);
+
+	return (error);
+}
+
 static zfs_ioc_vec_t zfs_ioc_vec[ZFS_IOC_LAST - ZFS_IOC_FIRST];
 
 static void
@@ -6003,6 +6093,10 @@ zfs_ioctl_init(void)
 	    zfs_ioc_key, zfs_secpolicy_key,
 	    DATASET_NAME, POOL_CHECK_SUSPENDED, B_TRUE, B_TRUE);
 
+	zfs_ioctl_register("trim", ZFS_IOC_POOL_TRIM,
+	    zfs_ioc_pool_trim, zfs_secpolicy_config, POOL_NAME,
+	    POOL_CHECK_SUSPENDED | POOL_CHECK_READONLY, B_TRUE, B_TRUE);
+
 	/* IOCTLS that use the legacy function signature */
 
 	zfs_ioctl_register_legacy(ZFS_IOC_POOL_FREEZE, zfs_ioc_pool_freeze,
@@ -487,9 +487,12 @@ zil_alloc_lwb(zilog_t *zilog, blkptr_t *bp, uint64_t txg, boolean_t fastwrite)
 	lwb->lwb_zilog = zilog;
 	lwb->lwb_blk = *bp;
 	lwb->lwb_fastwrite = fastwrite;
+	lwb->lwb_state = LWB_STATE_CLOSED;
 	lwb->lwb_buf = zio_buf_alloc(BP_GET_LSIZE(bp));
 	lwb->lwb_max_txg = txg;
+	lwb->lwb_max_lr_seq = 0;
 	lwb->lwb_zio = NULL;
+	lwb->lwb_root_zio = NULL;
 	lwb->lwb_tx = NULL;
 	if (BP_GET_CHECKSUM(bp) == ZIO_CHECKSUM_ZILOG2) {
 		lwb->lwb_nused = sizeof (zil_chain_t);
@@ -515,10 +518,21 @@ zilog_dirty(zilog_t *zilog, uint64_t txg)
 {
 	dsl_pool_t *dp = zilog->zl_dmu_pool;
 	dsl_dataset_t *ds = dmu_objset_ds(zilog->zl_os);
+	uint64_t max_txg;
 
 	if (ds->ds_is_snapshot)
 		panic("dirtying snapshot!");
 
+	/*
+	 * Remembered so that zil_close() can wait for every txg the log
+	 * has been dirtied in, including those of commit itxs that never
+	 * made it into an lwb.  We only hold the lock of the itxg of txg,
+	 * so another txg may be dirtying the log concurrently.
+	 */
+	while ((max_txg = zilog->zl_dirty_max_txg) < txg &&
+	    atomic_cas_64(&zilog->zl_dirty_max_txg, max_txg, txg) != max_txg)
+		continue;
+
 	if (txg_list_add(&dp->dp_dirty_zilogs, zilog, txg)) {
 		/* up the hold count until we can be written out */
 		dmu_buf_add_ref(ds->ds_dbuf, zilog);
@@ -592,6 +606,15 @@ zil_create(zilog_t *zilog)
 	if (error == 0)
 		lwb = zil_alloc_lwb(zilog, &blk, txg, fastwrite);
 
+	/*
+	 * The new chain doesn't depend on any lwb whose write failed.
+	 */
+	if (lwb != NULL) {
+		mutex_enter(&zilog->zl_lock);
+		zilog->zl_lwb_error = 0;
+		mutex_exit(&zilog->zl_lock);
+	}
+
 	/*
 	 * If we just allocated the first log block, commit our transaction
 	 * and wait for zil_sync() to stuff the block poiner into zh_log.
@@ -650,9 +673,13 @@ zil_destroy(zilog_t *zilog, boolean_t keep_first)
 		VERIFY(!keep_first);
 		while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
 			ASSERT(lwb->lwb_zio == NULL);
+			ASSERT(lwb->lwb_state == LWB_STATE_CLOSED ||
+			    lwb->lwb_state == LWB_STATE_DONE);
 			if (lwb->lwb_fastwrite)
 				metaslab_fastwrite_unmark(zilog->zl_spa,
 				    &lwb->lwb_blk);
+			if (zilog->zl_last_lwb_issued == lwb)
+				zilog->zl_last_lwb_issued = NULL;
 			list_remove(&zilog->zl_lwb_list, lwb);
 			if (lwb->lwb_buf != NULL)
 				zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
@@ -818,12 +845,10 @@ zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 	if (zfs_nocacheflush)
 		return;
 
-	ASSERT(zilog->zl_writer);
-
 	/*
-	 * Even though we're zl_writer, we still need a lock because the
-	 * zl_get_data() callbacks may have dmu_sync() done callbacks
-	 * that will run concurrently.
+	 * Blocks are added by the dmu_sync() done callbacks of the
+	 * zl_get_data() calls and by the lwb write done callbacks, all of
+	 * which can run concurrently.
 	 */
 	mutex_enter(&zilog->zl_vdev_lock);
 	for (i = 0; i < ndvas; i++) {
@@ -837,42 +862,116 @@ zil_add_block(zilog_t *zilog, const blkptr_t *bp)
 	mutex_exit(&zilog->zl_vdev_lock);
 }
 
+/*
+ * Flush the vdevs written since the last lwb write completed.  This takes
+ * every vdev in zl_vdev_tree, including those recorded for later lwbs:
+ * flushing them early is harmless, and because lwb writes complete in log
+ * order no earlier lwb can be left with a vdev that nobody flushes.  The
+ * flushes are children of the lwb's root zio, so it becomes DONE only once
+ * they have completed.
+ */
 static void
-zil_flush_vdevs(zilog_t *zilog)
+zil_lwb_flush_vdevs(lwb_t *lwb)
 {
+	zilog_t *zilog = lwb->lwb_zilog;
 	spa_t *spa = zilog->zl_spa;
-	avl_tree_t *t = &zilog->zl_vdev_tree;
+	avl_tree_t t;
 	void *cookie = NULL;
 	zil_vdev_node_t *zv;
-	zio_t *zio;
 
-	ASSERT(zilog->zl_writer);
+	avl_create(&t, zil_vdev_compare,
+	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
+
+	mutex_enter(&zilog->zl_vdev_lock);
+	avl_swap(&t, &zilog->zl_vdev_tree);
+	mutex_exit(&zilog->zl_vdev_lock);
 
 	/*
-	 * We don't need zl_vdev_lock here because we're the zl_writer,
-	 * and all zl_get_data() callbacks are done.
+	 * The caller holds SCL_STATE as reader on behalf of the lwb (see
+	 * zil_lwb_write_start()), which keeps the vdevs from going away.
+	 * Not all devices actually support the DKIOCFLUSHWRITECACHE ioctl,
+	 * so it's OK if the flushes fail.
 	 */
-	if (avl_numnodes(t) == 0)
-		return;
-
-	spa_config_enter(spa, SCL_STATE, FTAG, RW_READER);
-
-	zio = zio_root(spa, NULL, NULL, ZIO_FLAG_CANFAIL);
-
-	while ((zv = avl_destroy_nodes(t, &cookie)) != NULL) {
+	while ((zv = avl_destroy_nodes(&t, &cookie)) != NULL) {
 		vdev_t *vd = vdev_lookup_top(spa, zv->zv_vdev);
 		if (vd != NULL)
-			zio_flush(zio, vd);
+			zio_flush(lwb->lwb_root_zio, vd);
 		kmem_free(zv, sizeof (*zv));
 	}
+	avl_destroy(&t);
+}
+
+/*
+ * Function called when an lwb is on stable storage: its write and the
+ * vdev flushes that followed it are done, and so are those of every lwb
+ * issued before it.  Wake the commit waiters attached to it.
+ */
+static void
+zil_lwb_flush_vdevs_done(zio_t *zio)
+{
+	lwb_t *lwb = zio->io_private;
+	zilog_t *zilog = lwb->lwb_zilog;
+	dmu_tx_t *tx = lwb->lwb_tx;
+	zil_commit_waiter_t *zcw;
+	itx_t *itx;
+
+	spa_config_exit(zilog->zl_spa, SCL_STATE, lwb);
+
+	while ((itx = list_head(&lwb->lwb_itxs)) != NULL) {
+		list_remove(&lwb->lwb_itxs, itx);
+		if (itx->itx_callback != NULL)
+			itx->itx_callback(itx->itx_callback_data);
+		zil_itx_destroy(itx);
+	}
+
+	mutex_enter(&zilog->zl_lock);
 
 	/*
-	 * Wait for all the flushes to complete.  Not all devices actually
-	 * support the DKIOCFLUSHWRITECACHE ioctl, so it's OK if it fails.
+	 * Once an lwb write has failed, the chain is broken before every
+	 * lwb issued after it, including those which were not chained to
+	 * it because it had already failed.  Their waiters must fall back
+	 * to txg_wait_synced() as well, until a new chain is started.
 	 */
-	(void) zio_wait(zio);
+	if (zio->io_error != 0 && zilog->zl_lwb_error == 0)
+		zilog->zl_lwb_error = zio->io_error;
+
+	/*
+	 * Remember the highest committed log sequence number for ztest.
+	 * We only update this value when all the log writes succeeded,
+	 * because ztest wants to ASSERT that it got the whole log chain.
+	 */
+	if (zilog->zl_lwb_error == 0 &&
+	    lwb->lwb_max_lr_seq > zilog->zl_commit_lr_seq)
+		zilog->zl_commit_lr_seq = lwb->lwb_max_lr_seq;
+
+	while ((zcw = list_head(&lwb->lwb_waiters)) != NULL) {
+		mutex_enter(&zcw->zcw_lock);
+		list_remove(&lwb->lwb_waiters, zcw);
+		ASSERT3P(zcw->zcw_lwb, ==, lwb);
+		zcw->zcw_lwb = NULL;
+		zcw->zcw_zio_error = zilog->zl_lwb_error;
+		zcw->zcw_done = B_TRUE;
+		cv_broadcast(&zcw->zcw_cv);
+		mutex_exit(&zcw->zcw_lock);
+	}
+
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_WRITE_DONE);
+	lwb->lwb_state = LWB_STATE_DONE;
+	lwb->lwb_root_zio = NULL;
+	lwb->lwb_tx = NULL;
 
-	spa_config_exit(spa, SCL_STATE, FTAG);
+	ASSERT3U(zilog->zl_lwb_inflight, >, 0);
+	if (--zilog->zl_lwb_inflight == 0)
+		cv_broadcast(&zilog->zl_cv_lwb_done);
+	mutex_exit(&zilog->zl_lock);
+
+	/*
+	 * Now that this log block is on stable storage, we have a stable
+	 * pointer to the next block in the chain, so it's OK to let the txg
+	 * in which we allocated the next block sync.  zil_sync() may free
+	 * the lwb as soon as we do, so it must not be touched after this.
+	 */
+	dmu_tx_commit(tx);
 }
 
 /*
@@ -883,7 +982,6 @@ zil_lwb_write_done(zio_t *zio)
 {
 	lwb_t *lwb = zio->io_private;
 	zilog_t *zilog = lwb->lwb_zilog;
-	dmu_tx_t *tx = lwb->lwb_tx;
 
 	ASSERT(BP_GET_COMPRESS(zio->io_bp) == ZIO_COMPRESS_OFF);
 	ASSERT(BP_GET_TYPE(zio->io_bp) == DMU_OT_INTENT_LOG);
@@ -893,29 +991,25 @@ zil_lwb_write_done(zio_t *zio)
 	ASSERT(!BP_IS_HOLE(zio->io_bp));
 	ASSERT(BP_GET_FILL(zio->io_bp) == 0);
 
-	/*
-	 * Ensure the lwb buffer pointer is cleared before releasing
-	 * the txg. If we have had an allocation failure and
-	 * the txg is waiting to sync then we want want zil_sync()
-	 * to remove the lwb so that it's not picked up as the next new
-	 * one in zil_commit_writer(). zil_sync() will only remove
-	 * the lwb if lwb_buf is null.
-	 */
 	abd_put(zio->io_abd);
 	zio_buf_free(lwb->lwb_buf, lwb->lwb_sz);
 	mutex_enter(&zilog->zl_lock);
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_ISSUED);
+	lwb->lwb_state = LWB_STATE_WRITE_DONE;
 	lwb->lwb_zio = NULL;
 	lwb->lwb_fastwrite = FALSE;
 	lwb->lwb_buf = NULL;
-	lwb->lwb_tx = NULL;
 	mutex_exit(&zilog->zl_lock);
 
 	/*
-	 * Now that we've written this log block, we have a stable pointer
-	 * to the next block in the chain, so it's OK to let the txg in
-	 * which we allocated the next block sync.
+	 * If the write failed the waiters fall back to txg_wait_synced(),
+	 * so there is no point in flushing anything.
 	 */
-	dmu_tx_commit(tx);
+	if (zio->io_error != 0)
+		return;
+
+	zil_add_block(zilog, zio->io_bp);
+	zil_lwb_flush_vdevs(lwb);
 }
 
 /*
@@ -930,25 +1024,23 @@ zil_lwb_write_init(zilog_t *zilog, lwb_t *lwb)
 	    ZB_ZIL_OBJECT, ZB_ZIL_LEVEL,
 	    lwb->lwb_blk.blk_cksum.zc_word[ZIL_ZC_SEQ]);
 
-	if (zilog->zl_root_zio == NULL) {
-		zilog->zl_root_zio = zio_root(zilog->zl_spa, NULL, NULL,
-		    ZIO_FLAG_CANFAIL);
-	}
-
 	/* Lock so zil_sync() doesn't fastwrite_unmark after zio is created */
 	mutex_enter(&zilog->zl_lock);
 	if (lwb->lwb_zio == NULL) {
 		abd_t *lwb_abd = abd_get_from_buf(lwb->lwb_buf,
 		    BP_GET_LSIZE(&lwb->lwb_blk));
+		ASSERT3S(lwb->lwb_state, ==, LWB_STATE_CLOSED);
 		if (!lwb->lwb_fastwrite) {
 			metaslab_fastwrite_mark(zilog->zl_spa, &lwb->lwb_blk);
 			lwb->lwb_fastwrite = 1;
 		}
-		lwb->lwb_zio = zio_rewrite(zilog->zl_root_zio, zilog->zl_spa,
+		lwb->lwb_root_zio = zio_root(zilog->zl_spa,
+		    zil_lwb_flush_vdevs_done, lwb, ZIO_FLAG_CANFAIL);
+		lwb->lwb_zio = zio_rewrite(lwb->lwb_root_zio, zilog->zl_spa,
 		    0, &lwb->lwb_blk, lwb_abd, BP_GET_LSIZE(&lwb->lwb_blk),
 		    zil_lwb_write_done, lwb, ZIO_PRIORITY_SYNC_WRITE,
-		    ZIO_FLAG_CANFAIL | ZIO_FLAG_DONT_PROPAGATE |
-		    ZIO_FLAG_FASTWRITE, &zb);
+		    ZIO_FLAG_CANFAIL | ZIO_FLAG_FASTWRITE, &zb);
+		lwb->lwb_state = LWB_STATE_OPENED;
 	}
 	mutex_exit(&zilog->zl_lock);
 }
@@ -978,12 +1070,12 @@ unsigned long zil_slog_limit = 1024 * 1024;
 
 /*
  * Start a log block write and advance to the next log block.
- * Calls are serialized.
+ * Calls are serialized by zl_writer_lock.
  */
 static lwb_t *
 zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 {
-	lwb_t *nlwb = NULL;
+	lwb_t *nlwb = NULL, *plwb;
 	zil_chain_t *zilc;
 	spa_t *spa = zilog->zl_spa;
 	blkptr_t *bp;
@@ -1008,7 +1100,8 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 * before writing it in order to establish the log chain.
 	 * Note that if the allocation of nlwb synced before we wrote
 	 * the block that points at it (lwb), we'd leak it if we crashed.
-	 * Therefore, we don't do dmu_tx_commit() until zil_lwb_write_done().
+	 * Therefore, we don't do dmu_tx_commit() until the lwb is on stable
+	 * storage, in zil_lwb_flush_vdevs_done().
 	 * We dirty the dataset to ensure that zil_sync() will be called
 	 * to clean up in the event of allocation failure or I/O failure.
 	 */
@@ -1066,9 +1159,6 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 		 * Allocate a new log write buffer (lwb).
 		 */
 		nlwb = zil_alloc_lwb(zilog, bp, txg, TRUE);
-
-		/* Record the block for later vdev flushing */
-		zil_add_block(zilog, &lwb->lwb_blk);
 	}
 
 	if (BP_GET_CHECKSUM(&lwb->lwb_blk) == ZIO_CHECKSUM_ZILOG2) {
@@ -1090,7 +1180,37 @@ zil_lwb_write_start(zilog_t *zilog, lwb_t *lwb)
 	 */
 	bzero(lwb->lwb_buf + lwb->lwb_nused, wsz - lwb->lwb_nused);
 
+	/*
+	 * Held until zil_lwb_flush_vdevs_done() so that the vdevs we flush
+	 * from zil_lwb_write_done() can't go away.
+	 */
+	spa_config_enter(spa, SCL_STATE, lwb, RW_READER);
+
+	/*
+	 * We don't wait for this write before issuing the next lwb.
+	 * Instead, make its write and root zios wait for those
+	 * of the previous lwb, so that lwbs are written and become stable
+	 * in the order of the log chain: an lwb is of no use to replay
+	 * until every block before it is on disk.  A previous lwb which is
+	 * already done may have failed; zl_lwb_error then makes our
+	 * waiters fall back to txg_wait_synced().
+	 */
+	mutex_enter(&zilog->zl_lock);
+	plwb = zilog->zl_last_lwb_issued;
+	if (plwb != NULL && plwb->lwb_state != LWB_STATE_DONE) {
+		zio_add_child(lwb->lwb_root_zio, plwb->lwb_root_zio);
+		if (plwb->lwb_state == LWB_STATE_ISSUED)
+			zio_add_child(lwb->lwb_zio, plwb->lwb_zio);
+	}
+	ASSERT3S(lwb->lwb_state, ==, LWB_STATE_OPENED);
+	lwb->lwb_state = LWB_STATE_ISSUED;
+	zilog->zl_last_lwb_issued = lwb;
+	zilog->zl_lwb_inflight++;
+	zilog->zl_lwb_count++;
+	mutex_exit(&zilog->zl_lock);
+
 	zio_nowait(lwb->lwb_zio); /* Kick off the write for the old log block */
+	zio_nowait(lwb->lwb_root_zio);
 
 	/*
 	 * If there was an allocation failure then nlwb will be null which
@@ -1193,7 +1313,8 @@ zil_lwb_commit(zilog_t *zilog, itx_t *itx, lwb_t *lwb)
 	 * equal to the itx sequence number because not all transactions
 	 * are synchronous, and sometimes spa_sync() gets there first.
 	 */
-	lrc->lrc_seq = ++zilog->zl_lr_seq; /* we are single threaded */
+	lrc->lrc_seq = ++zilog->zl_lr_seq; /* we hold zl_writer_lock */
+	lwb->lwb_max_lr_seq = lrc->lrc_seq;
 	lwb->lwb_nused += reclen + dlen;
 	lwb->lwb_max_txg = MAX(lwb->lwb_max_txg, txg);
 	ASSERT3U(lwb->lwb_nused, <=, lwb->lwb_sz);
@@ -1227,6 +1348,78 @@ zil_itx_destroy(itx_t *itx)
 	zio_data_buf_free(itx, offsetof(itx_t, itx_lr)+itx->itx_lr.lrc_reclen);
 }
 
+static void
+zil_commit_waiter_init(zil_commit_waiter_t *zcw)
+{
+	mutex_init(&zcw->zcw_lock, NULL, MUTEX_DEFAULT, NULL);
+	cv_init(&zcw->zcw_cv, NULL, CV_DEFAULT, NULL);
+	list_link_init(&zcw->zcw_node);
+	zcw->zcw_lwb = NULL;
+	zcw->zcw_done = B_FALSE;
+	zcw->zcw_zio_error = 0;
+}
+
+static void
+zil_commit_waiter_fini(zil_commit_waiter_t *zcw)
+{
+	ASSERT(zcw->zcw_done);
+	ASSERT3P(zcw->zcw_lwb, ==, NULL);
+	ASSERT(!list_link_active(&zcw->zcw_node));
+	cv_destroy(&zcw->zcw_cv);
+	mutex_destroy(&zcw->zcw_lock);
+}
+
+/*
+ * Mark a waiter done without attaching it to an lwb, because everything
+ * it waits for has reached stable storage some other way, typically by
+ * its txg having synced.  The waiter may be freed as soon as we drop
+ * zcw_lock.
+ */
+static void
+zil_commit_waiter_skip(zil_commit_waiter_t *zcw)
+{
+	mutex_enter(&zcw->zcw_lock);
+	ASSERT(!zcw->zcw_done);
+	zcw->zcw_done = B_TRUE;
+	cv_broadcast(&zcw->zcw_cv);
+	mutex_exit(&zcw->zcw_lock);
+}
+
+/*
+ * Attach a commit waiter to the lwb that will make its itxs stable: the
+ * open lwb if records have been copied into it, which the writer issues
+ * before it drops zl_writer_lock, or else the last lwb issued.  Since
+ * lwbs become stable in order, this covers every itx before the waiter's.
+ */
+static void
+zil_commit_waiter_link(zilog_t *zilog, zil_commit_waiter_t *zcw, lwb_t *lwb)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_writer_lock));
+
+	mutex_enter(&zilog->zl_lock);
+	if (lwb == NULL || lwb->lwb_state != LWB_STATE_OPENED)
+		lwb = zilog->zl_last_lwb_issued;
+
+	if (lwb == NULL || lwb->lwb_state == LWB_STATE_DONE) {
+		/*
+		 * Everything issued is done, but not necessarily stable if
+		 * an lwb write failed.
+		 */
+		zcw->zcw_zio_error = zilog->zl_lwb_error;
+		mutex_exit(&zilog->zl_lock);
+		zil_commit_waiter_skip(zcw);
+		return;
+	}
+
+	mutex_enter(&zcw->zcw_lock);
+	ASSERT(!zcw->zcw_done);
+	ASSERT3P(zcw->zcw_lwb, ==, NULL);
+	zcw->zcw_lwb = lwb;
+	list_insert_tail(&lwb->lwb_waiters, zcw);
+	mutex_exit(&zcw->zcw_lock);
+	mutex_exit(&zilog->zl_lock);
+}
+
 /*
  * Free up the sync and async itxs. The itxs_t has already been detached
  * so no locks are needed.
@@ -1242,6 +1435,13 @@ zil_itxg_clean(itxs_t *itxs)
 
 	list = &itxs->i_sync_list;
 	while ((itx = list_head(list)) != NULL) {
+		/*
+		 * A commit itx normally goes to zil_commit_writer(), but
+		 * one whose txg synced before a writer picked it up ends
+		 * here, and its waiter is satisfied by the sync.
+		 */
+		if (itx->itx_lr.lrc_txtype == TX_COMMIT)
+			zil_commit_waiter_skip(itx->itx_private);
 		if (itx->itx_callback != NULL)
 			itx->itx_callback(itx->itx_callback_data);
 		list_remove(list, itx);
@@ -1399,8 +1599,12 @@ zil_itx_assign(zilog_t *zilog, itx_t *itx, dmu_tx_t *tx)
 		list_insert_tail(&ian->ia_list, itx);
 	}
 
+	/*
+	 * Dirty the log in the txg of the tx even on a frozen pool, where
+	 * the itx went to ZILTEST_TXG, which never syncs.
+	 */
 	itx->itx_lr.lrc_txg = dmu_tx_get_txg(tx);
-	zilog_dirty(zilog, txg);
+	zilog_dirty(zilog, dmu_tx_get_txg(tx));
 	mutex_exit(&itxg->itxg_lock);
 
 	/* Release the old itxs now we've dropped the lock */
@@ -1531,49 +1735,140 @@ zil_async_to_sync(zilog_t *zilog, uint64_t foid)
 	}
 }
 
+/*
+ * Wait until every issued lwb is on stable storage.  The caller holds
+ * zl_writer_lock, so no new lwb can be issued in the meantime.
+ */
+static void
+zil_lwb_wait_inflight(zilog_t *zilog)
+{
+	ASSERT(MUTEX_HELD(&zilog->zl_writer_lock));
+
+	mutex_enter(&zilog->zl_lock);
+	while (zilog->zl_lwb_inflight != 0)
+		cv_wait(&zilog->zl_cv_lwb_done, &zilog->zl_lock);
+	mutex_exit(&zilog->zl_lock);
+}
+
+/*
+ * Copy the pending itxs into log blocks and issue them.  We hold
+ * zl_writer_lock only while doing so, not while the blocks are written:
+ * each committer then sleeps until the lwb holding its commit itx is
+ * stable, while the next writer already fills and issues further lwbs.
+ */
 static void
 zil_commit_writer(zilog_t *zilog)
 {
-	uint64_t txg;
+	list_t *commit_list = &zilog->zl_itx_commit_list;
+	list_t nolwb_itxs, nolwb_waiters;
+	uint64_t txg, used;
 	itx_t *itx;
-	lwb_t *lwb;
+	lwb_t *lwb, *olwb;
+	zil_commit_waiter_t *zcw;
 	spa_t *spa = zilog->zl_spa;
-	int error = 0;
+	boolean_t records;
 
-	ASSERT(zilog->zl_root_zio == NULL);
-
-	mutex_exit(&zilog->zl_lock);
+	mutex_enter(&zilog->zl_writer_lock);
 
 	zil_get_commit_list(zilog);
 
 	/*
 	 * Return if there's nothing to commit before we dirty the fs by
-	 * calling zil_create().
+	 * calling zil_create().  Our own commit itx may already have been
+	 * handled by the previous writer.
 	 */
-	if (list_head(&zilog->zl_itx_commit_list) == NULL) {
-		mutex_enter(&zilog->zl_lock);
+	if (list_head(commit_list) == NULL) {
+		mutex_exit(&zilog->zl_writer_lock);
 		return;
 	}
 
+	ZIL_STAT_BUMP(zil_commit_writer_count);
+
+	/*
+	 * Commit itxs alone don't need a log chain: their waiters only
+	 * wait for the lwbs already issued.
+	 */
+	records = B_FALSE;
+	for (itx = list_head(commit_list); itx != NULL;
+	    itx = list_next(commit_list, itx)) {
+		if (itx->itx_lr.lrc_txtype != TX_COMMIT) {
+			records = B_TRUE;
+			break;
+		}
+	}
+
 	if (zilog->zl_suspend) {
 		lwb = NULL;
 	} else {
 		lwb = list_tail(&zilog->zl_lwb_list);
-		if (lwb == NULL)
+		if (lwb == NULL && records)
 			lwb = zil_create(zilog);
 	}
 
+	list_create(&nolwb_itxs, sizeof (itx_t), offsetof(itx_t, itx_node));
+	list_create(&nolwb_waiters, sizeof (zil_commit_waiter_t),
+	    offsetof(zil_commit_waiter_t, zcw_node));
+
 	DTRACE_PROBE1(zil__cw1, zilog_t *, zilog);
-	for (itx = list_head(&zilog->zl_itx_commit_list); itx != NULL;
-	    itx = list_next(&zilog->zl_itx_commit_list, itx)) {
-		txg = itx->itx_lr.lrc_txg;
-		ASSERT(txg);
+	do {
+		olwb = lwb;
+		used = zilog->zl_cur_used;
+		while ((itx = list_head(commit_list)) != NULL) {
+			boolean_t synced;
+
+			list_remove(commit_list, itx);
+			txg = itx->itx_lr.lrc_txg;
+			ASSERT(txg);
+
+			synced = (txg <= spa_last_synced_txg(spa) &&
+			    txg <= spa_freeze_txg(spa));
+
+			if (itx->itx_lr.lrc_txtype == TX_COMMIT) {
+				zcw = itx->itx_private;
+				if (synced)
+					zil_commit_waiter_skip(zcw);
+				else if (lwb == NULL && records)
+					list_insert_tail(&nolwb_waiters, zcw);
+				else
+					zil_commit_waiter_link(zilog, zcw, lwb);
+				zil_itx_destroy(itx);
+				continue;
+			}
 
-		if (txg > spa_last_synced_txg(spa) || txg > spa_freeze_txg(spa))
+			if (synced) {
+				if (itx->itx_callback != NULL)
+					itx->itx_callback(
+					    itx->itx_callback_data);
+				zil_itx_destroy(itx);
+				continue;
+			}
+
+			/*
+			 * The itx is freed, and its callback called, once
+			 * the lwb it was copied into is stable.
+			 */
 			lwb = zil_lwb_commit(zilog, itx, lwb);
-	}
+			if (lwb == NULL)
+				list_insert_tail(&nolwb_itxs, itx);
+			else
+				list_insert_tail(&lwb->lwb_itxs, itx);
+		}
+
+		/*
+		 * Let committers that arrived while we were copying join
+		 * the lwb that is still open, rather than waiting for it to
+		 * be issued and starting a new one.  Once the open lwb has
+		 * filled up and been issued, or a pass brought no records,
+		 * leave the rest to them.
+		 */
+		if (lwb == NULL || lwb != olwb || zilog->zl_cur_used == used)
+			break;
+		zil_get_commit_list(zilog);
+	} while (list_head(commit_list) != NULL);
 	DTRACE_PROBE1(zil__cw2, zilog_t *, zilog);
 
+	ASSERT(list_is_empty(commit_list));
+
 	/* write the last block out */
 	if (lwb != NULL && lwb->lwb_zio != NULL)
 		lwb = zil_lwb_write_start(zilog, lwb);
@@ -1581,36 +1876,94 @@ zil_commit_writer(zilog_t *zilog)
 	zilog->zl_cur_used = 0;
 
 	/*
-	 * Wait if necessary for the log blocks to be on stable storage.
+	 * If the log is suspended or we failed to allocate a log block,
+	 * fall back to txg_wait_synced() for everything that didn't make
+	 * it into an lwb.  Wait for the issued lwbs first: once they are
+	 * stable and their txg has synced, zil_sync() has freed them and
+	 * the next writer starts a new log chain.
 	 */
-	if (zilog->zl_root_zio) {
-		error = zio_wait(zilog->zl_root_zio);
-		zilog->zl_root_zio = NULL;
-		zil_flush_vdevs(zilog);
-	}
-
-	if (error || lwb == NULL)
+	if (lwb == NULL && records) {
+		zil_lwb_wait_inflight(zilog);
 		txg_wait_synced(zilog->zl_dmu_pool, 0);
+	}
 
-	while ((itx = list_head(&zilog->zl_itx_commit_list))) {
-		txg = itx->itx_lr.lrc_txg;
-		ASSERT(txg);
+	mutex_exit(&zilog->zl_writer_lock);
 
+	while ((itx = list_head(&nolwb_itxs)) != NULL) {
+		list_remove(&nolwb_itxs, itx);
 		if (itx->itx_callback != NULL)
 			itx->itx_callback(itx->itx_callback_data);
-		list_remove(&zilog->zl_itx_commit_list, itx);
 		zil_itx_destroy(itx);
 	}
+	list_destroy(&nolwb_itxs);
 
-	mutex_enter(&zilog->zl_lock);
+	while ((zcw = list_head(&nolwb_waiters)) != NULL) {
+		list_remove(&nolwb_waiters, zcw);
+		zil_commit_waiter_skip(zcw);
+	}
+	list_destroy(&nolwb_waiters);
+}
+
+/*
+ * Insert a commit itx for the waiter after all the itxs assigned so far.
+ * The writer that comes across it attaches the waiter to the right lwb.
+ */
+static void
+zil_commit_itx_assign(zilog_t *zilog, zil_commit_waiter_t *zcw)
+{
+	dmu_tx_t *tx;
+	itx_t *itx;
+
+	tx = dmu_tx_create(zilog->zl_os);
+	VERIFY0(dmu_tx_assign(tx, TXG_WAIT));
+
+	itx = zil_itx_create(TX_COMMIT, sizeof (lr_t));
+	itx->itx_sync = B_TRUE;
+	itx->itx_private = zcw;
+
+	zil_itx_assign(zilog, itx, tx);
+
+	dmu_tx_commit(tx);
+}
+
+static void
+zil_commit_impl(zilog_t *zilog, uint64_t foid)
+{
+	zil_commit_waiter_t zcw;
+	hrtime_t start;
+	uint64_t us;
+	int bucket;
+
+	ZIL_STAT_BUMP(zil_commit_count);
+	atomic_inc_64(&zilog->zl_commit_count);
+	start = gethrtime();
+
+	/* move the async itxs for the foid to the sync queues */
+	zil_async_to_sync(zilog, foid);
+
+	zil_commit_waiter_init(&zcw);
+	zil_commit_itx_assign(zilog, &zcw);
+
+	zil_commit_writer(zilog);
+
+	mutex_enter(&zcw.zcw_lock);
+	while (!zcw.zcw_done)
+		cv_wait(&zcw.zcw_cv, &zcw.zcw_lock);
+	mutex_exit(&zcw.zcw_lock);
 
 	/*
-	 * Remember the highest committed log sequence number for ztest.
-	 * We only update this value when all the log writes succeeded,
-	 * because ztest wants to ASSERT that it got the whole log chain.
+	 * If an lwb write failed, the log chain may be broken before our
+	 * records, so rely on the txg to make them stable instead.
 	 */
-	if (error == 0 && lwb != NULL)
-		zilog->zl_commit_lr_seq = zilog->zl_lr_seq;
+	if (zcw.zcw_zio_error != 0)
+		txg_wait_synced(zilog->zl_dmu_pool, 0);
+
+	zil_commit_waiter_fini(&zcw);
+
+	us = (gethrtime() - start) / NSEC_PER_USEC;
+	bucket = (us == 0) ? 0 :
+	    MIN(highbit64(us) - 1, ZIL_COMMIT_LAT_BUCKETS - 1);
+	atomic_inc_64(&zilog->zl_commit_lat[bucket]);
 }
 
 /*
@@ -1618,61 +1971,47 @@ zil_commit_writer(zilog_t *zilog)
  * If foid is 0 push out all transactions, otherwise push only those
  * for that object or might reference that object.
  *
- * itxs are committed in batches. In a heavily stressed zil there will be
- * a commit writer thread who is writing out a bunch of itxs to the log
- * for a set of committing threads (cthreads) in the same batch as the writer.
- * Those cthreads are all waiting on the same cv for that batch.
- *
- * There will also be a different and growing batch of threads that are
- * waiting to commit (qthreads). When the committing batch completes
- * a transition occurs such that the cthreads exit and the qthreads become
- * cthreads. One of the new cthreads becomes the writer thread for the
- * batch. Any new threads arriving become new qthreads.
- *
- * Only 2 condition variables are needed and there's no transition
- * between the two cvs needed. They just flip-flop between qthreads
- * and cthreads.
+ * Each caller inserts a commit itx behind the itxs it wants committed and
+ * then sleeps on its own zil_commit_waiter_t until the lwb that itx ends
+ * up in is on stable storage.  Getting the itxs into lwbs is done by
+ * whichever caller gets zl_writer_lock first: it copies all pending itxs,
+ * including those of the callers queued behind it, into lwbs and issues
+ * them.  Callers arriving while it is copying join the open lwb.
  *
- * Using this scheme we can efficiently wakeup up only those threads
- * that have been committed.
+ * The writer doesn't wait for the lwbs it issued, so the next writer can
+ * fill and issue more lwbs while they are being written.  The root zio of
+ * each lwb depends on that of the previous one, so lwbs become stable in
+ * log order, and each waiter is woken as soon as its own lwb is stable
+ * instead of when the whole batch is.
  */
 void
 zil_commit(zilog_t *zilog, uint64_t foid)
 {
-	uint64_t mybatch;
-
 	if (zilog->zl_sync == ZFS_SYNC_DISABLED)
 		return;
 
-	ZIL_STAT_BUMP(zil_commit_count);
-
-	/* move the async itxs for the foid to the sync queues */
-	zil_async_to_sync(zilog, foid);
-
-	mutex_enter(&zilog->zl_lock);
-	mybatch = zilog->zl_next_batch;
-	while (zilog->zl_writer) {
-		cv_wait(&zilog->zl_cv_batch[mybatch & 1], &zilog->zl_lock);
-		if (mybatch <= zilog->zl_com_batch) {
-			mutex_exit(&zilog->zl_lock);
-			return;
-		}
+	/*
+	 * Nothing can have been logged on a read-only pool or a snapshot,
+	 * and a commit itx can't be assigned to either: there is no sync
+	 * thread for its txg, and a snapshot must never be dirtied.
+	 */
+	if (!spa_writeable(zilog->zl_spa) ||
+	    dmu_objset_is_snapshot(zilog->zl_os)) {
+		ASSERT(list_is_empty(&zilog->zl_lwb_list));
+		return;
 	}
 
-	zilog->zl_next_batch++;
-	zilog->zl_writer = B_TRUE;
-	ZIL_STAT_BUMP(zil_commit_writer_count);
-	zil_commit_writer(zilog);
-	zilog->zl_com_batch = mybatch;
-	zilog->zl_writer = B_FALSE;
-
-	/* wake up one thread to become the next writer */
-	cv_signal(&zilog->zl_cv_batch[(mybatch+1) & 1]);
-
-	/* wake up all threads waiting for this batch to be committed */
-	cv_broadcast(&zilog->zl_cv_batch[mybatch & 1]);
+	/*
+	 * A suspended log has no on-disk chain to write into, and
+	 * zil_suspend() has already pushed out what was pending.
+	 */
+	if (zilog->zl_suspend > 0) {
+		ZIL_STAT_BUMP(zil_commit_count);
+		txg_wait_synced(zilog->zl_dmu_pool, 0);
+		return;
+	}
 
-	mutex_exit(&zilog->zl_lock);
+	zil_commit_impl(zilog, foid);
 }
 
 /*
@@ -1728,11 +2067,14 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 
 	while ((lwb = list_head(&zilog->zl_lwb_list)) != NULL) {
 		zh->zh_log = lwb->lwb_blk;
-		if (lwb->lwb_buf != NULL || lwb->lwb_max_txg > txg)
+		if (lwb->lwb_state != LWB_STATE_DONE || lwb->lwb_max_txg > txg)
 			break;
 
 		ASSERT(lwb->lwb_zio == NULL);
+		ASSERT(lwb->lwb_buf == NULL);
 
+		if (zilog->zl_last_lwb_issued == lwb)
+			zilog->zl_last_lwb_issued = NULL;
 		list_remove(&zilog->zl_lwb_list, lwb);
 		zio_free_zil(spa, txg, &lwb->lwb_blk);
 		kmem_cache_free(zil_lwb_cache, lwb);
@@ -1762,11 +2104,34 @@ zil_sync(zilog_t *zilog, dmu_tx_t *tx)
 	mutex_exit(&zilog->zl_lock);
 }
 
+/* ARGSUSED */
+static int
+zil_lwb_cons(void *vbuf, void *unused, int kmflag)
+{
+	lwb_t *lwb = vbuf;
+
+	list_create(&lwb->lwb_itxs, sizeof (itx_t), offsetof(itx_t, itx_node));
+	list_create(&lwb->lwb_waiters, sizeof (zil_commit_waiter_t),
+	    offsetof(zil_commit_waiter_t, zcw_node));
+	return (0);
+}
+
+/* ARGSUSED */
+static void
+zil_lwb_dest(void *vbuf, void *unused)
+{
+	lwb_t *lwb = vbuf;
+
+	list_destroy(&lwb->lwb_waiters);
+	list_destroy(&lwb->lwb_itxs);
+}
+
 void
 zil_init(void)
 {
 	zil_lwb_cache = kmem_cache_create("zil_lwb_cache",
-	    sizeof (struct lwb), 0, NULL, NULL, NULL, NULL, NULL, 0);
+	    sizeof (struct lwb), 0, zil_lwb_cons, zil_lwb_dest, NULL, NULL,
+	    NULL, 0);
 
 	zil_ksp = kstat_create("zfs", 0, "zil", "misc",
 	    KSTAT_TYPE_NAMED, sizeof (zil_stats) / sizeof (kstat_named_t),
@@ -1816,9 +2181,9 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	zilog->zl_destroy_txg = TXG_INITIAL - 1;
 	zilog->zl_logbias = dmu_objset_logbias(os);
 	zilog->zl_sync = dmu_objset_syncprop(os);
-	zilog->zl_next_batch = 1;
 
 	mutex_init(&zilog->zl_lock, NULL, MUTEX_DEFAULT, NULL);
+	mutex_init(&zilog->zl_writer_lock, NULL, MUTEX_DEFAULT, NULL);
 
 	for (i = 0; i < TXG_SIZE; i++) {
 		mutex_init(&zilog->zl_itxg[i].itxg_lock, NULL,
@@ -1836,10 +2201,8 @@ zil_alloc(objset_t *os, zil_header_t *zh_phys)
 	avl_create(&zilog->zl_vdev_tree, zil_vdev_compare,
 	    sizeof (zil_vdev_node_t), offsetof(zil_vdev_node_t, zv_node));
 
-	cv_init(&zilog->zl_cv_writer, NULL, CV_DEFAULT, NULL);
 	cv_init(&zilog->zl_cv_suspend, NULL, CV_DEFAULT, NULL);
-	cv_init(&zilog->zl_cv_batch[0], NULL, CV_DEFAULT, NULL);
-	cv_init(&zilog->zl_cv_batch[1], NULL, CV_DEFAULT, NULL);
+	cv_init(&zilog->zl_cv_lwb_done, NULL, CV_DEFAULT, NULL);
 
 	return (zilog);
 }
@@ -1856,6 +2219,7 @@ zil_free(zilog_t *zilog)
 
 	ASSERT(list_is_empty(&zilog->zl_lwb_list));
 	list_destroy(&zilog->zl_lwb_list);
+	ASSERT0(zilog->zl_lwb_inflight);
 
 	avl_destroy(&zilog->zl_vdev_tree);
 	mutex_destroy(&zilog->zl_vdev_lock);
@@ -1877,15 +2241,96 @@ zil_free(zilog_t *zilog)
 	}
 
 	mutex_destroy(&zilog->zl_lock);
+	mutex_destroy(&zilog->zl_writer_lock);
 
-	cv_destroy(&zilog->zl_cv_writer);
 	cv_destroy(&zilog->zl_cv_suspend);
-	cv_destroy(&zilog->zl_cv_batch[0]);
-	cv_destroy(&zilog->zl_cv_batch[1]);
+	cv_destroy(&zilog->zl_cv_lwb_done);
 
 	kmem_free(zilog, sizeof (zilog_t));
 }
 
+/*
+ * Per-dataset commit statistics, exported as zfs/<pool>/zil-<objset id>:
+ * the number of zil_commit() calls and lwbs issued, the lwbs currently in
+ * flight, and the commit latency histogram.
+ */
+#define	ZIL_KSTAT_COMMITS	0
+#define	ZIL_KSTAT_LWBS		1
+#define	ZIL_KSTAT_INFLIGHT	2
+#define	ZIL_KSTAT_LAT		3
+#define	ZIL_KSTAT_NUM		(ZIL_KSTAT_LAT + ZIL_COMMIT_LAT_BUCKETS)
+
+static int
+zil_kstat_update(kstat_t *ksp, int rw)
+{
+	zilog_t *zilog = ksp->ks_private;
+	kstat_named_t *ks = ksp->ks_data;
+	int i;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	ks[ZIL_KSTAT_COMMITS].value.ui64 = zilog->zl_commit_count;
+	ks[ZIL_KSTAT_LWBS].value.ui64 = zilog->zl_lwb_count;
+	ks[ZIL_KSTAT_INFLIGHT].value.ui64 = zilog->zl_lwb_inflight;
+	for (i = 0; i < ZIL_COMMIT_LAT_BUCKETS; i++)
+		ks[ZIL_KSTAT_LAT + i].value.ui64 = zilog->zl_commit_lat[i];
+
+	return (0);
+}
+
+static void
+zil_kstat_init(zilog_t *zilog)
+{
+	char module[KSTAT_STRLEN], name[KSTAT_STRLEN];
+	kstat_named_t *ks;
+	kstat_t *ksp;
+	int i;
+
+	(void) snprintf(module, KSTAT_STRLEN, "zfs/%s",
+	    spa_name(zilog->zl_spa));
+	(void) snprintf(name, KSTAT_STRLEN, "zil-%llu",
+	    (u_longlong_t)dmu_objset_id(zilog->zl_os));
+
+	ksp = kstat_create(module, 0, name, "misc", KSTAT_TYPE_NAMED,
+	    ZIL_KSTAT_NUM, KSTAT_FLAG_VIRTUAL);
+	zilog->zl_ksp = ksp;
+	if (ksp == NULL)
+		return;
+
+	ks = kmem_zalloc(ZIL_KSTAT_NUM * sizeof (kstat_named_t), KM_SLEEP);
+	(void) strlcpy(ks[ZIL_KSTAT_COMMITS].name, "commits", KSTAT_STRLEN);
+	(void) strlcpy(ks[ZIL_KSTAT_LWBS].name, "lwbs", KSTAT_STRLEN);
+	(void) strlcpy(ks[ZIL_KSTAT_INFLIGHT].name, "lwbs_inflight",
+	    KSTAT_STRLEN);
+	for (i = 0; i < ZIL_COMMIT_LAT_BUCKETS; i++) {
+		(void) snprintf(ks[ZIL_KSTAT_LAT + i].name, KSTAT_STRLEN,
+		    "commit_lat_%lluus", (u_longlong_t)1ULL << i);
+	}
+	for (i = 0; i < ZIL_KSTAT_NUM; i++)
+		ks[i].data_type = KSTAT_DATA_UINT64;
+
+	ksp->ks_data = ks;
+	ksp->ks_private = zilog;
+	ksp->ks_update = zil_kstat_update;
+	kstat_install(ksp);
+}
+
+static void
+zil_kstat_fini(zilog_t *zilog)
+{
+	kstat_t *ksp = zilog->zl_ksp;
+	kstat_named_t *ks;
+
+	if (ksp == NULL)
+		return;
+
+	ks = ksp->ks_data;
+	kstat_delete(ksp);
+	kmem_free(ks, ZIL_KSTAT_NUM * sizeof (kstat_named_t));
+	zilog->zl_ksp = NULL;
+}
+
 /*
  * Open an intent log.
  */
@@ -1902,6 +2347,8 @@ zil_open(objset_t *os, zil_get_data_t *get_data)
 	zilog->zl_clean_taskq = taskq_create("zil_clean", 1, defclsyspri,
 	    2, 2, TASKQ_PREPOPULATE);
 
+	zil_kstat_init(zilog);
+
 	return (zilog);
 }
 
@@ -1914,18 +2361,37 @@ zil_close(zilog_t *zilog)
 	lwb_t *lwb;
 	uint64_t txg = 0;
 
-	zil_commit(zilog, 0); /* commit all itx */
+	/*
+	 * A snapshot, such as that of a zvol opened read-only, never has
+	 * anything to commit.
+	 */
+	if (!dmu_objset_is_snapshot(zilog->zl_os)) {
+		zil_commit(zilog, 0); /* commit all itx */
+	} else {
+		ASSERT(list_is_empty(&zilog->zl_lwb_list));
+		ASSERT0(zilog->zl_dirty_max_txg);
+	}
+
+	/*
+	 * Our commit only waited for the lwbs up to the one holding its
+	 * commit itx; make sure none issued after it is still in flight.
+	 */
+	mutex_enter(&zilog->zl_writer_lock);
+	zil_lwb_wait_inflight(zilog);
+	mutex_exit(&zilog->zl_writer_lock);
 
 	/*
 	 * The lwb_max_txg for the stubby lwb will reflect the last activity
-	 * for the zil.  After a txg_wait_synced() on the txg we know all the
-	 * callbacks have occurred that may clean the zil.  Only then can we
-	 * destroy the zl_clean_taskq.
+	 * for the zil, and zl_dirty_max_txg that of commit itxs, which are
+	 * not in any lwb.  After a txg_wait_synced() on the txg we know all
+	 * the callbacks have occurred that may clean the zil.  Only then can
+	 * we destroy the zl_clean_taskq.
 	 */
 	mutex_enter(&zilog->zl_lock);
 	lwb = list_tail(&zilog->zl_lwb_list);
 	if (lwb != NULL)
 		txg = lwb->lwb_max_txg;
+	txg = MAX(txg, zilog->zl_dirty_max_txg);
 	mutex_exit(&zilog->zl_lock);
 	if (txg)
 		txg_wait_synced(zilog->zl_dmu_pool, txg);
@@ -1936,6 +2402,8 @@ zil_close(zilog_t *zilog)
 	zilog->zl_clean_taskq = NULL;
 	zilog->zl_get_data = NULL;
 
+	zil_kstat_fini(zilog);
+
 	/*
 	 * We should have only one LWB left on the list; remove it now.
 	 */
@@ -1944,6 +2412,7 @@ zil_close(zilog_t *zilog)
 	if (lwb != NULL) {
 		ASSERT(lwb == list_tail(&zilog->zl_lwb_list));
 		ASSERT(lwb->lwb_zio == NULL);
+		ASSERT3S(lwb->lwb_state, ==, LWB_STATE_CLOSED);
 		if (lwb->lwb_fastwrite)
 			metaslab_fastwrite_unmark(zilog->zl_spa, &lwb->lwb_blk);
 		list_remove(&zilog->zl_lwb_list, lwb);
@@ -1983,6 +2452,7 @@ zil_suspend(const char *osname, void **cookiep)
 	objset_t *os;
 	zilog_t *zilog;
 	const zil_header_t *zh;
+	boolean_t opened;
 	int error;
 
 	error = dmu_objset_hold(osname, suspend_tag, &os);
@@ -2047,10 +2517,25 @@ zil_suspend(const char *osname, void **cookiep)
 		return (0);
 	}
 
+	/*
+	 * A log which isn't open has no itxs to commit, and the commit itx
+	 * would be left for a zil_clean() without a zl_clean_taskq.
+	 */
+	opened = (zilog->zl_clean_taskq != NULL);
 	zilog->zl_suspending = B_TRUE;
 	mutex_exit(&zilog->zl_lock);
 
-	zil_commit(zilog, 0);
+	if (opened)
+		zil_commit_impl(zilog, 0);
+
+	/*
+	 * A writer that started before we bumped zl_suspend may still have
+	 * issued lwbs after the one holding our commit itx.  Writers that
+	 * come after us won't issue any.
+	 */
+	mutex_enter(&zilog->zl_writer_lock);
+	zil_lwb_wait_inflight(zilog);
+	mutex_exit(&zilog->zl_writer_lock);
 
 	zil_destroy(zilog, B_FALSE);
 
@@ -57,7 +57,41 @@ zio_compress_info_t zio_compress_table[ZIO_COMPRESS_FUNCTIONS] = {
 	{"gzip-8",		8,	gzip_compress,	gzip_decompress},
 	{"gzip-9",		9,	gzip_compress,	gzip_decompress},
 	{"zle",			64,	zle_compress,	zle_decompress},
-	{"lz4",			0,	lz4_compress_zfs, lz4_decompress_zfs}
+	{"lz4",			0,	lz4_compress_zfs, lz4_decompress_zfs},
+	{"zstd-1",		1,	zstd_compress,	zstd_decompress},
+	{"zstd-2",		2,	zstd_compress,	zstd_decompress},
+	{"zstd-3",		3,	zstd_compress,	zstd_decompress},
+	{"zstd-4",		4,	zstd_compress,	zstd_decompress},
+	{"zstd-5",		5,	zstd_compress,	zstd_decompress},
+	{"zstd-6",		6,	zstd_compress,	zstd_decompress},
+	{"zstd-7",		7,	zstd_compress,	zstd_decompress},
+	{"zstd-8",		8,	zstd_compress,	zstd_decompress},
+	{"zstd-9",		9,	zstd_compress,	zstd_decompress},
+	{"zstd-10",		10,	zstd_compress,	zstd_decompress},
+	{"zstd-11",		11,	zstd_compress,	zstd_decompress},
+	{"zstd-12",		12,	zstd_compress,	zstd_decompress},
+	{"zstd-13",		13,	zstd_compress,	zstd_decompress},
+	{"zstd-14",		14,	zstd_compress,	zstd_decompress},
+	{"zstd-15",		15,	zstd_compress,	zstd_decompress},
+	{"zstd-16",		16,	zstd_compress,	zstd_decompress},
+	{"zstd-17",		17,	zstd_compress,	zstd_decompress},
+	{"zstd-18",		18,	zstd_compress,	zstd_decompress},
+	{"zstd-19",		19,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-1",		-1,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-2",		-2,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-3",		-3,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-4",		-4,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-5",		-5,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-6",		-6,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-7",		-7,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-8",		-8,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-9",		-9,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-10",	-10,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-20",	-20,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-50",	-50,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-100",	-100,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-500",	-500,	zstd_compress,	zstd_decompress},
+	{"zstd-fast-1000",	-1000,	zstd_compress,	zstd_decompress}
 };
 
 enum zio_compress
@@ -84,6 +118,20 @@ zio_compress_select(spa_t *spa, enum zio_compress child,
 	return (result);
 }
 
+/*
+ * Return the pool feature which must be enabled to use the given compression
+ * function, and which is activated on a dataset once it has a block
+ * compressed with it.
+ */
+spa_feature_t
+zio_compress_to_feature(enum zio_compress comp)
+{
+	if (comp >= ZIO_COMPRESS_ZSTD_1 && comp <= ZIO_COMPRESS_ZSTD_FAST_1000)
+		return (SPA_FEATURE_ZSTD_COMPRESS);
+
+	return (SPA_FEATURE_NONE);
+}
+
 /*ARGSUSED*/
 static int
 zio_compress_zeroed_cb(void *data, size_t len, void *private)
@@ -305,6 +305,7 @@ zio_crypt_key_destroy(zio_crypt_key_t *key)
 
 	/* free crypto templates */
 	crypto_destroy_ctx_template(key->zk_current_tmpl);
+	crypto_destroy_ctx_template(key->zk_prev_tmpl);
 	crypto_destroy_ctx_template(key->zk_hmac_tmpl);
 
 	/* zero out sensitive data */
@@ -351,6 +352,11 @@ zio_crypt_key_init(uint64_t crypt, zio_crypt_key_t *key)
 	key->zk_hmac_key.ck_data = &key->zk_hmac_key;
 	key->zk_hmac_key.ck_length = BYTES_TO_BITS(HMAC_SHA256_KEYLEN);
 
+	key->zk_prev_key.ck_format = CRYPTO_KEY_RAW;
+	key->zk_prev_key.ck_data = key->zk_prev_keydata;
+	key->zk_prev_key.ck_length = BYTES_TO_BITS(keydata_len);
+	key->zk_prev_tmpl = NULL;
+
 	/*
 	 * Initialize the crypto templates. It's ok if this fails because
 	 * this is just an optimization.
@@ -405,6 +411,8 @@ zio_crypt_key_change_salt(zio_crypt_key_t *key)
 
 	/* destroy the old context template and create the new one */
 	crypto_destroy_ctx_template(key->zk_current_tmpl);
+	mech.cm_type =
+	    crypto_mech2id(zio_crypt_table[key->zk_crypt].ci_mechname);
 	ret = crypto_create_ctx_template(&mech, &key->zk_current_key,
 	    &key->zk_current_tmpl, KM_SLEEP);
 	if (ret != CRYPTO_SUCCESS)
@@ -447,6 +455,49 @@ error:
 	return (ret);
 }
 
+/*
+ * Set up the encryption mechanism for an AES-CCM or AES-GCM operation over
+ * plain_full_len bytes of plaintext, with the MAC of maclen bytes appended.
+ * The parameters are stored in ccmp or gcmp, which must outlive the
+ * mechanism.
+ */
+static void
+zio_crypt_init_mech(uint64_t crypt, uint8_t *ivbuf, uint_t plain_full_len,
+    uint_t maclen, crypto_mechanism_t *mech, CK_AES_CCM_PARAMS *ccmp,
+    CK_AES_GCM_PARAMS *gcmp)
+{
+	zio_crypt_info_t *crypt_info = &zio_crypt_table[crypt];
+
+	/* setup encryption mechanism (same as crypt) */
+	mech->cm_type = crypto_mech2id(crypt_info->ci_mechname);
+
+	/*
+	 * setup encryption params (currently only AES CCM and AES GCM
+	 * are supported)
+	 */
+	if (crypt_info->ci_crypt_type == ZC_TYPE_CCM) {
+		ccmp->ulNonceSize = DATA_IV_LEN;
+		ccmp->ulAuthDataSize = 0;
+		ccmp->authData = NULL;
+		ccmp->ulMACSize = maclen;
+		ccmp->nonce = ivbuf;
+		ccmp->ulDataSize = plain_full_len;
+
+		mech->cm_param = (char *)ccmp;
+		mech->cm_param_len = sizeof (CK_AES_CCM_PARAMS);
+	} else {
+		gcmp->ulIvLen = DATA_IV_LEN;
+		gcmp->ulIvBits = BYTES_TO_BITS(DATA_IV_LEN);
+		gcmp->ulAADLen = 0;
+		gcmp->pAAD = NULL;
+		gcmp->ulTagBits = BYTES_TO_BITS(maclen);
+		gcmp->pIv = ivbuf;
+
+		mech->cm_param = (char *)gcmp;
+		mech->cm_param_len = sizeof (CK_AES_GCM_PARAMS);
+	}
+}
+
 /*
  * This function handles all encryption and decryption in zfs. When
  * encrypting it expects puio to refernce the plaintext and cuio to
@@ -454,6 +505,10 @@ error:
  * it expects both puio and cuio to have enough room for a MAC, although
  * the plaintext uio can be dsicarded afterwards. datalen should be the
  * length of only the plaintext / ciphertext in either case.
+ *
+ * All of the supported algorithms are AES modes, so this calls the AES
+ * provider directly rather than having the KCF pick a provider for every
+ * block.
  */
 static int
 zio_do_crypt_uio(boolean_t encrypt, uint64_t crypt, crypto_key_t *key,
@@ -465,23 +520,16 @@ zio_do_crypt_uio(boolean_t encrypt, uint64_t crypt, crypto_key_t *key,
 	CK_AES_CCM_PARAMS ccmp;
 	CK_AES_GCM_PARAMS gcmp;
 	crypto_mechanism_t mech;
-	zio_crypt_info_t crypt_info;
 	uint_t plain_full_len, maclen;
 
 	ASSERT3U(crypt, <, ZIO_CRYPT_FUNCTIONS);
 	ASSERT3U(key->ck_format, ==, CRYPTO_KEY_RAW);
 
-	/* lookup the encryption info */
-	crypt_info = zio_crypt_table[crypt];
-
 	/* the mac will always be the last iovec_t in the cipher uio */
 	maclen = cuio->uio_iov[cuio->uio_iovcnt - 1].iov_len;
 
 	ASSERT(maclen <= DATA_MAC_LEN);
 
-	/* setup encryption mechanism (same as crypt) */
-	mech.cm_type = crypto_mech2id(crypt_info.ci_mechname);
-
 	/* plain length will include the MAC if we are decrypting */
 	if (encrypt) {
 		plain_full_len = datalen;
@@ -489,31 +537,8 @@ zio_do_crypt_uio(boolean_t encrypt, uint64_t crypt, crypto_key_t *key,
 		plain_full_len = datalen + maclen;
 	}
 
-	/*
-	 * setup encryption params (currently only AES CCM and AES GCM
-	 * are supported)
-	 */
-	if (crypt_info.ci_crypt_type == ZC_TYPE_CCM) {
-		ccmp.ulNonceSize = DATA_IV_LEN;
-		ccmp.ulAuthDataSize = 0;
-		ccmp.authData = NULL;
-		ccmp.ulMACSize = maclen;
-		ccmp.nonce = ivbuf;
-		ccmp.ulDataSize = plain_full_len;
-
-		mech.cm_param = (char *)(&ccmp);
-		mech.cm_param_len = sizeof (CK_AES_CCM_PARAMS);
-	} else {
-		gcmp.ulIvLen = DATA_IV_LEN;
-		gcmp.ulIvBits = BYTES_TO_BITS(DATA_IV_LEN);
-		gcmp.ulAADLen = 0;
-		gcmp.pAAD = NULL;
-		gcmp.ulTagBits = BYTES_TO_BITS(maclen);
-		gcmp.pIv = ivbuf;
-
-		mech.cm_param = (char *)(&gcmp);
-		mech.cm_param_len = sizeof (CK_AES_GCM_PARAMS);
-	}
+	zio_crypt_init_mech(crypt, ivbuf, plain_full_len, maclen, &mech,
+	    &ccmp, &gcmp);
 
 	/* populate the cipher and plain data structs. */
 	plaindata.cd_format = CRYPTO_DATA_UIO;
@@ -530,11 +555,11 @@ zio_do_crypt_uio(boolean_t encrypt, uint64_t crypt, crypto_key_t *key,
 
 	/* perform the actual encryption */
 	if (encrypt) {
-		ret = crypto_encrypt(&mech, &plaindata, key, tmpl, &cipherdata,
-		    NULL);
+		ret = crypto_aes_encrypt(&mech, &plaindata, key, tmpl,
+		    &cipherdata);
 	} else {
-		ret = crypto_decrypt(&mech, &cipherdata, key, tmpl, &plaindata,
-		    NULL);
+		ret = crypto_aes_decrypt(&mech, &cipherdata, key, tmpl,
+		    &plaindata);
 	}
 
 	if (ret != CRYPTO_SUCCESS) {
@@ -666,6 +691,11 @@ zio_crypt_key_unwrap(crypto_key_t *cwkey, uint64_t crypt, uint8_t *keydata,
 	key->zk_hmac_key.ck_data = key->zk_hmac_keydata;
 	key->zk_hmac_key.ck_length = BYTES_TO_BITS(HMAC_SHA256_KEYLEN);
 
+	key->zk_prev_key.ck_format = CRYPTO_KEY_RAW;
+	key->zk_prev_key.ck_data = key->zk_prev_keydata;
+	key->zk_prev_key.ck_length = BYTES_TO_BITS(keydata_len);
+	key->zk_prev_tmpl = NULL;
+
 	/*
 	 * Initialize the crypto templates. It's ok if this fails because
 	 * this is just an optimization.
@@ -1146,61 +1176,34 @@ error:
 	return (ret);
 }
 
+/*
+ * Normal blocks are encrypted as a whole, so their uios are built on the
+ * three iovecs passed in by the caller (plaintext, ciphertext and MAC)
+ * rather than allocated.
+ */
 static int
 zio_crypt_init_uios_normal(boolean_t encrypt, uint8_t *plainbuf,
-    uint8_t *cipherbuf, uint_t datalen, uio_t *puio, uio_t *cuio,
-    uint_t *enc_len)
+    uint8_t *cipherbuf, uint_t datalen, iovec_t *iovecs, uio_t *puio,
+    uio_t *cuio, uint_t *enc_len)
 {
-	int ret;
-	uint_t nr_plain = 1, nr_cipher = 2;
-	iovec_t *plain_iovecs = NULL, *cipher_iovecs = NULL;
-
-	/* allocate the iovecs for the plain and cipher data */
-	plain_iovecs = kmem_alloc(nr_plain * sizeof (iovec_t),
-	    KM_SLEEP);
-	if (!plain_iovecs) {
-		ret = SET_ERROR(ENOMEM);
-		goto error;
-	}
-
-	cipher_iovecs = kmem_alloc(nr_cipher * sizeof (iovec_t),
-	    KM_SLEEP);
-	if (!cipher_iovecs) {
-		ret = SET_ERROR(ENOMEM);
-		goto error;
-	}
-
-	plain_iovecs[0].iov_base = plainbuf;
-	plain_iovecs[0].iov_len = datalen;
-	cipher_iovecs[0].iov_base = cipherbuf;
-	cipher_iovecs[0].iov_len = datalen;
+	iovecs[0].iov_base = plainbuf;
+	iovecs[0].iov_len = datalen;
+	iovecs[1].iov_base = cipherbuf;
+	iovecs[1].iov_len = datalen;
 
 	*enc_len = datalen;
-	puio->uio_iov = plain_iovecs;
-	puio->uio_iovcnt = nr_plain;
-	cuio->uio_iov = cipher_iovecs;
-	cuio->uio_iovcnt = nr_cipher;
+	puio->uio_iov = &iovecs[0];
+	puio->uio_iovcnt = 1;
+	cuio->uio_iov = &iovecs[1];
+	cuio->uio_iovcnt = 2;
 
 	return (0);
-
-error:
-	if (plain_iovecs)
-		kmem_free(plain_iovecs, nr_plain * sizeof (iovec_t));
-	if (cipher_iovecs)
-		kmem_free(cipher_iovecs, nr_cipher * sizeof (iovec_t));
-
-	*enc_len = 0;
-	puio->uio_iov = NULL;
-	puio->uio_iovcnt = 0;
-	cuio->uio_iov = NULL;
-	cuio->uio_iovcnt = 0;
-	return (ret);
 }
 
 static int
 zio_crypt_init_uios(boolean_t encrypt, dmu_object_type_t ot, uint8_t *plainbuf,
-    uint8_t *cipherbuf, uint_t datalen, uint8_t *mac, uio_t *puio, uio_t *cuio,
-    uint_t *enc_len)
+    uint8_t *cipherbuf, uint_t datalen, uint8_t *mac, iovec_t *iovecs,
+    uio_t *puio, uio_t *cuio, uint_t *enc_len)
 {
 	int ret;
 	uint_t maclen;
@@ -1222,7 +1225,7 @@ zio_crypt_init_uios(boolean_t encrypt, dmu_object_type_t ot, uint8_t *plainbuf,
 		break;
 	default:
 		ret = zio_crypt_init_uios_normal(encrypt, plainbuf, cipherbuf,
-		    datalen, puio, cuio, enc_len);
+		    datalen, iovecs, puio, cuio, enc_len);
 		maclen = DATA_MAC_LEN;
 		break;
 	}
@@ -1245,6 +1248,108 @@ error:
 	return (ret);
 }
 
+/*
+ * The encryption key for a block, as returned by zio_crypt_key_hold().
+ */
+typedef struct zio_crypt_key_ref {
+	zio_crypt_key_t *zr_key;
+	crypto_key_t *zr_ckey;
+	crypto_ctx_template_t zr_tmpl;
+	boolean_t zr_locked;
+	crypto_key_t zr_tmp_ckey;
+	uint8_t zr_salt[DATA_SALT_LEN];
+	uint8_t zr_keydata[MAX_MASTER_KEY_LEN];
+} zio_crypt_key_ref_t;
+
+/*
+ * Look up the encryption key for the given salt. If the needed key is the
+ * current one or the cached one for an older salt, just use it. Otherwise
+ * we need to generate a temporary one from the given salt + master key,
+ * which zio_crypt_key_rele() will cache for the following blocks written
+ * with the same salt.
+ */
+static int
+zio_crypt_key_hold(zio_crypt_key_t *key, uint8_t *salt,
+    zio_crypt_key_ref_t *ref)
+{
+	int ret;
+	crypto_mechanism_t mech;
+	uint_t keydata_len = zio_crypt_table[key->zk_crypt].ci_keylen;
+
+	ref->zr_key = key;
+
+	rw_enter(&key->zk_salt_lock, RW_READER);
+	ref->zr_locked = B_TRUE;
+
+	if (bcmp(salt, key->zk_salt, DATA_SALT_LEN) == 0) {
+		ref->zr_ckey = &key->zk_current_key;
+		ref->zr_tmpl = key->zk_current_tmpl;
+		return (0);
+	}
+
+	if (key->zk_prev_tmpl != NULL &&
+	    bcmp(salt, key->zk_prev_salt, DATA_SALT_LEN) == 0) {
+		ref->zr_ckey = &key->zk_prev_key;
+		ref->zr_tmpl = key->zk_prev_tmpl;
+		return (0);
+	}
+
+	rw_exit(&key->zk_salt_lock);
+	ref->zr_locked = B_FALSE;
+
+	ret = hkdf_sha256(key->zk_master_keydata, keydata_len, NULL, 0,
+	    salt, DATA_SALT_LEN, ref->zr_keydata, keydata_len);
+	if (ret) {
+		bzero(ref->zr_keydata, keydata_len);
+		return (ret);
+	}
+
+	bcopy(salt, ref->zr_salt, DATA_SALT_LEN);
+	ref->zr_tmp_ckey.ck_format = CRYPTO_KEY_RAW;
+	ref->zr_tmp_ckey.ck_data = ref->zr_keydata;
+	ref->zr_tmp_ckey.ck_length = BYTES_TO_BITS(keydata_len);
+	ref->zr_ckey = &ref->zr_tmp_ckey;
+
+	/* as above, it's ok if creating the template fails */
+	mech.cm_type =
+	    crypto_mech2id(zio_crypt_table[key->zk_crypt].ci_mechname);
+	ret = crypto_create_ctx_template(&mech, ref->zr_ckey, &ref->zr_tmpl,
+	    KM_SLEEP);
+	if (ret != CRYPTO_SUCCESS)
+		ref->zr_tmpl = NULL;
+
+	return (0);
+}
+
+static void
+zio_crypt_key_rele(zio_crypt_key_ref_t *ref)
+{
+	zio_crypt_key_t *key = ref->zr_key;
+	uint_t keydata_len = zio_crypt_table[key->zk_crypt].ci_keylen;
+
+	if (ref->zr_locked) {
+		rw_exit(&key->zk_salt_lock);
+		return;
+	}
+
+	/*
+	 * Keep the temporary key for the next block with the same salt. This
+	 * is only an optimization, so don't wait for readers of the key.
+	 */
+	if (ref->zr_tmpl != NULL &&
+	    rw_tryenter(&key->zk_salt_lock, RW_WRITER)) {
+		crypto_destroy_ctx_template(key->zk_prev_tmpl);
+		bcopy(ref->zr_salt, key->zk_prev_salt, DATA_SALT_LEN);
+		bcopy(ref->zr_keydata, key->zk_prev_keydata, keydata_len);
+		key->zk_prev_tmpl = ref->zr_tmpl;
+		rw_exit(&key->zk_salt_lock);
+	} else {
+		crypto_destroy_ctx_template(ref->zr_tmpl);
+	}
+
+	bzero(ref->zr_keydata, keydata_len);
+}
+
 /*
  * Primary encryption / decryption entrypoint for zio data.
  */
@@ -1254,79 +1359,97 @@ zio_do_crypt_data(boolean_t encrypt, zio_crypt_key_t *key, uint8_t *salt,
     uint8_t *plainbuf, uint8_t *cipherbuf)
 {
 	int ret;
-	boolean_t locked = B_FALSE;
-	uint64_t crypt = key->zk_crypt;
-	uint_t enc_len, keydata_len = zio_crypt_table[crypt].ci_keylen;
+	uint_t enc_len;
 	uio_t puio, cuio;
-	uint8_t enc_keydata[MAX_MASTER_KEY_LEN];
-	crypto_key_t tmp_ckey, *ckey = NULL;
-	crypto_ctx_template_t tmpl;
+	iovec_t iovecs[3];
+	zio_crypt_key_ref_t ref;
 
 	bzero(&puio, sizeof (uio_t));
 	bzero(&cuio, sizeof (uio_t));
 
 	/* create uios for encryption */
 	ret = zio_crypt_init_uios(encrypt, ot, plainbuf, cipherbuf, datalen,
-	    mac, &puio, &cuio, &enc_len);
+	    mac, iovecs, &puio, &cuio, &enc_len);
 
 	/* return the error or ZIO_NO_ENCRYPTION_NEEDED to the caller */
 	if (ret)
 		return (ret);
 
 	/*
-	 * If the needed key is the current one, just use it. Otherwise we
-	 * need to generate a temporary one from the given salt + master key.
-	 * If we are encrypting, we must return a copy of the current salt
-	 * so that it can be stored in the blkptr_t.
+	 * Find the key for the salt. If we are encrypting, the salt is a
+	 * copy of the current one so that it can be stored in the blkptr_t.
 	 */
-	rw_enter(&key->zk_salt_lock, RW_READER);
-	locked = B_TRUE;
+	ret = zio_crypt_key_hold(key, salt, &ref);
+	if (ret)
+		goto error;
 
-	if (bcmp(salt, key->zk_salt, DATA_SALT_LEN) == 0) {
-		ckey = &key->zk_current_key;
-		tmpl = key->zk_current_tmpl;
-	} else {
-		rw_exit(&key->zk_salt_lock);
-		locked = B_FALSE;
+	/* perform the encryption / decryption */
+	ret = zio_do_crypt_uio(encrypt, key->zk_crypt, ref.zr_ckey,
+	    ref.zr_tmpl, iv, enc_len, &puio, &cuio);
+	zio_crypt_key_rele(&ref);
 
-		ret = hkdf_sha256(key->zk_master_keydata, keydata_len, NULL, 0,
-		    salt, DATA_SALT_LEN, enc_keydata, keydata_len);
-		if (ret)
-			goto error;
+error:
+	if (puio.uio_iov != iovecs) {
+		zio_crypt_destroy_uio(&puio);
+		zio_crypt_destroy_uio(&cuio);
+	}
 
-		tmp_ckey.ck_format = CRYPTO_KEY_RAW;
-		tmp_ckey.ck_data = enc_keydata;
-		tmp_ckey.ck_length = BYTES_TO_BITS(keydata_len);
+	return (ret);
+}
 
-		ckey = &tmp_ckey;
-		tmpl = NULL;
-	}
+static int
+zio_crypt_encrypt_abd_cb(void *cbuf, void *pbuf, size_t len, void *private)
+{
+	crypto_aes_ctx_t *ctx = private;
+	int ret;
 
-	/* perform the encryption / decryption */
-	ret = zio_do_crypt_uio(encrypt, key->zk_crypt, ckey, tmpl, iv, enc_len,
-	    &puio, &cuio);
+	ret = crypto_aes_encrypt_update(ctx, pbuf, cbuf, len);
+	if (ret == CRYPTO_DATA_LEN_RANGE)
+		return (SET_ERROR(ENOTSUP));
+	else if (ret != CRYPTO_SUCCESS)
+		return (SET_ERROR(EIO));
+
+	return (0);
+}
+
+/*
+ * Encrypt a normal block straight from the plaintext abd into the ciphertext
+ * abd, one chunk at a time. This avoids copying scatter abds into linear
+ * buffers and back. It returns ENOTSUP if the chunks are not whole AES
+ * blocks, in which case the caller falls back to zio_do_crypt_data().
+ */
+static int
+zio_crypt_encrypt_abd(zio_crypt_key_t *key, uint8_t *salt, uint8_t *iv,
+    uint8_t *mac, uint_t datalen, abd_t *pabd, abd_t *cabd)
+{
+	int ret;
+	CK_AES_CCM_PARAMS ccmp;
+	CK_AES_GCM_PARAMS gcmp;
+	crypto_mechanism_t mech;
+	zio_crypt_key_ref_t ref;
+	crypto_aes_ctx_t ctx;
+
+	zio_crypt_init_mech(key->zk_crypt, iv, datalen, DATA_MAC_LEN, &mech,
+	    &ccmp, &gcmp);
+
+	ret = zio_crypt_key_hold(key, salt, &ref);
 	if (ret)
-		goto error;
+		return (ret);
 
-	if (locked) {
-		rw_exit(&key->zk_salt_lock);
-		locked = B_FALSE;
+	ret = crypto_aes_encrypt_init(&mech, ref.zr_ckey, ref.zr_tmpl, &ctx);
+	if (ret != CRYPTO_SUCCESS) {
+		zio_crypt_key_rele(&ref);
+		return (SET_ERROR(EIO));
 	}
 
-	if (ckey == &tmp_ckey)
-		bzero(enc_keydata, keydata_len);
-	zio_crypt_destroy_uio(&puio);
-	zio_crypt_destroy_uio(&cuio);
+	ret = abd_iterate_func2(cabd, pabd, 0, 0, datalen,
+	    zio_crypt_encrypt_abd_cb, &ctx);
 
-	return (0);
+	if (crypto_aes_encrypt_final(&ctx, mac, DATA_MAC_LEN) !=
+	    CRYPTO_SUCCESS && ret == 0)
+		ret = SET_ERROR(EIO);
 
-error:
-	if (locked)
-		rw_exit(&key->zk_salt_lock);
-	if (ckey == &tmp_ckey)
-		bzero(enc_keydata, keydata_len);
-	zio_crypt_destroy_uio(&puio);
-	zio_crypt_destroy_uio(&cuio);
+	zio_crypt_key_rele(&ref);
 
 	return (ret);
 }
@@ -1343,6 +1466,18 @@ zio_do_crypt_abd(boolean_t encrypt, zio_crypt_key_t *key, uint8_t *salt,
 	int ret;
 	void *ptmp, *ctmp;
 
+	/*
+	 * Normal blocks can be encrypted without linearizing the abds.
+	 * Decryption has to buffer the whole ciphertext to check the MAC
+	 * before releasing any plaintext, so it gains nothing from this.
+	 */
+	if (encrypt && ot != DMU_OT_INTENT_LOG && ot != DMU_OT_DNODE) {
+		ret = zio_crypt_encrypt_abd(key, salt, iv, mac, datalen, pabd,
+		    cabd);
+		if (ret != ENOTSUP)
+			return (ret);
+	}
+
 	if (encrypt) {
 		ptmp = abd_borrow_buf_copy(pabd, datalen);
 		ctmp = abd_borrow_buf(cabd, datalen);
@@ -0,0 +1,342 @@
+/*
+ * CDDL HEADER START
+ *
+ * This file and its contents are supplied under the terms of the
+ * Common Development and Distribution License ("CDDL"), version 1.0.
+ * You may only use this file in accordance with the terms of version
+ * 1.0 of the CDDL.
+ *
+ * A full copy of the text of the CDDL should have accompanied this
+ * source.  A copy of the CDDL is also available via the Internet at
+ * http://www.illumos.org/license/CDDL.
+ *
+ * CDDL HEADER END
+ */
+
+/*
+ * Zstandard compression.
+ *
+ * The zstd library itself is not part of this tree.  The kernel module uses
+ * the copy of zstd which Linux provides in <linux/zstd.h> (4.14 and later)
+ * and libzpool uses the system libzstd.  A build without either still knows
+ * about the zstd compression values, but refuses to set them or to enable
+ * the zstd_compress feature, and won't open a pool on which that feature is
+ * active, since it couldn't read the zstd blocks.
+ *
+ * Each level ("zstd-N" and "zstd-fast-N") is a separate zio_compress value,
+ * as with gzip, and is passed in as the compression level.  The fast levels
+ * are negative, which is how zstd expresses them.  The in-kernel zstd
+ * predates the negative levels, so there they are all treated as level 1.
+ * The level only matters when compressing; a zstd block is decompressed the
+ * same way regardless of the level it was written with.
+ *
+ * Setting up a zstd context is expensive: the workspace for the higher
+ * levels runs to megabytes.  Rather than allocating one for every block,
+ * a compression and a decompression context are kept per CPU and reused.
+ * They are allocated the first time they are needed on that CPU and, for
+ * compression in the kernel, grown when a higher level needs a larger
+ * workspace.  The compression allocations may not sleep, since we are in
+ * the write path; if one fails the block is simply written uncompressed.
+ * A read has no such way out, so the decompression workspace, which is
+ * small and the same for every level, is allocated with KM_SLEEP.  The
+ * compression contexts are freed again by zstd_cache_reap_now() when the
+ * ARC reaps its caches, so the workspaces of the higher levels don't stay
+ * pinned on every CPU after memory gets tight.
+ *
+ * As with lz4, the compressed length is stored in a 4-byte big endian
+ * header in front of the zstd frame so that the padding which follows the
+ * compressed data in the block is not mistaken for another frame.
+ */
+
+#include <sys/zfs_context.h>
+#include <sys/zio_compress.h>
+
+#if defined(_KERNEL) && defined(HAVE_KERNEL_ZSTD)
+#include <linux/zstd.h>
+#define	ZFS_HAVE_ZSTD
+#elif !defined(_KERNEL) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define	ZFS_HAVE_ZSTD
+#endif
+
+#ifdef ZFS_HAVE_ZSTD
+
+typedef struct zstd_ctx {
+	kmutex_t	zc_lock;
+	ZSTD_CCtx	*zc_cctx;
+	ZSTD_DCtx	*zc_dctx;
+#ifdef _KERNEL
+	void		*zc_cws;	/* compression workspace */
+	size_t		zc_cws_size;
+	void		*zc_dws;	/* decompression workspace */
+	size_t		zc_dws_size;
+#endif
+} zstd_ctx_t;
+
+static zstd_ctx_t *zstd_ctxs;
+static uint_t zstd_nctxs;
+
+static zstd_ctx_t *
+zstd_ctx_enter(void)
+{
+	zstd_ctx_t *zc = &zstd_ctxs[CPU_SEQID % zstd_nctxs];
+
+	mutex_enter(&zc->zc_lock);
+	return (zc);
+}
+
+static void
+zstd_ctx_exit(zstd_ctx_t *zc)
+{
+	mutex_exit(&zc->zc_lock);
+}
+
+#ifdef _KERNEL
+
+static size_t
+zstd_compress_ctx(zstd_ctx_t *zc, void *src, size_t s_len, void *dst,
+    size_t d_len, int level)
+{
+	ZSTD_parameters params;
+	size_t ws_size;
+
+	params = ZSTD_getParams(MAX(level, 1), s_len, 0);
+	ws_size = ZSTD_CCtxWorkspaceBound(params.cParams);
+
+	if (ws_size > zc->zc_cws_size) {
+		void *ws = vmem_alloc(ws_size, KM_NOSLEEP);
+
+		if (ws == NULL)
+			return (0);
+		if (zc->zc_cws != NULL)
+			vmem_free(zc->zc_cws, zc->zc_cws_size);
+		zc->zc_cws = ws;
+		zc->zc_cws_size = ws_size;
+		zc->zc_cctx = ZSTD_initCCtx(zc->zc_cws, zc->zc_cws_size);
+	}
+	if (zc->zc_cctx == NULL)
+		return (0);
+
+	return (ZSTD_compressCCtx(zc->zc_cctx, dst, d_len, src, s_len, params));
+}
+
+static size_t
+zstd_decompress_ctx(zstd_ctx_t *zc, void *src, size_t s_len, void *dst,
+    size_t d_len)
+{
+	if (zc->zc_dctx == NULL) {
+		if (zc->zc_dws == NULL) {
+			zc->zc_dws_size = ZSTD_DCtxWorkspaceBound();
+			zc->zc_dws = vmem_alloc(zc->zc_dws_size, KM_SLEEP);
+		}
+		zc->zc_dctx = ZSTD_initDCtx(zc->zc_dws, zc->zc_dws_size);
+		if (zc->zc_dctx == NULL)
+			return ((size_t)-1);
+	}
+
+	return (ZSTD_decompressDCtx(zc->zc_dctx, dst, d_len, src, s_len));
+}
+
+static void
+zstd_cctx_free(zstd_ctx_t *zc)
+{
+	if (zc->zc_cws != NULL) {
+		vmem_free(zc->zc_cws, zc->zc_cws_size);
+		zc->zc_cws = NULL;
+		zc->zc_cws_size = 0;
+		zc->zc_cctx = NULL;
+	}
+}
+
+static void
+zstd_ctx_free(zstd_ctx_t *zc)
+{
+	zstd_cctx_free(zc);
+	if (zc->zc_dws != NULL)
+		vmem_free(zc->zc_dws, zc->zc_dws_size);
+}
+
+#else /* _KERNEL */
+
+static size_t
+zstd_compress_ctx(zstd_ctx_t *zc, void *src, size_t s_len, void *dst,
+    size_t d_len, int level)
+{
+	if (zc->zc_cctx == NULL && (zc->zc_cctx = ZSTD_createCCtx()) == NULL)
+		return (0);
+
+	return (ZSTD_compressCCtx(zc->zc_cctx, dst, d_len, src, s_len, level));
+}
+
+static size_t
+zstd_decompress_ctx(zstd_ctx_t *zc, void *src, size_t s_len, void *dst,
+    size_t d_len)
+{
+	if (zc->zc_dctx == NULL && (zc->zc_dctx = ZSTD_createDCtx()) == NULL)
+		return ((size_t)-1);
+
+	return (ZSTD_decompressDCtx(zc->zc_dctx, dst, d_len, src, s_len));
+}
+
+static void
+zstd_cctx_free(zstd_ctx_t *zc)
+{
+	if (zc->zc_cctx != NULL) {
+		(void) ZSTD_freeCCtx(zc->zc_cctx);
+		zc->zc_cctx = NULL;
+	}
+}
+
+static void
+zstd_ctx_free(zstd_ctx_t *zc)
+{
+	zstd_cctx_free(zc);
+	if (zc->zc_dctx != NULL)
+		(void) ZSTD_freeDCtx(zc->zc_dctx);
+}
+
+#endif /* _KERNEL */
+
+size_t
+zstd_compress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	char *dest = d_start;
+	zstd_ctx_t *zc;
+	size_t c_len;
+	uint32_t bufsiz;
+
+	ASSERT(d_len <= s_len);
+
+	if (d_len <= sizeof (bufsiz))
+		return (s_len);
+
+	zc = zstd_ctx_enter();
+	c_len = zstd_compress_ctx(zc, s_start, s_len, &dest[sizeof (bufsiz)],
+	    d_len - sizeof (bufsiz), level);
+	zstd_ctx_exit(zc);
+
+	/* The data did not fit in d_len, or we ran out of memory. */
+	if (c_len == 0 || ZSTD_isError(c_len))
+		return (s_len);
+
+	bufsiz = c_len;
+	*(uint32_t *)dest = BE_32(bufsiz);
+
+	return (bufsiz + sizeof (bufsiz));
+}
+
+/*ARGSUSED*/
+int
+zstd_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	const char *src = s_start;
+	uint32_t bufsiz = BE_IN32(src);
+	zstd_ctx_t *zc;
+	size_t ret;
+
+	/* invalid compressed buffer size encoded at start */
+	if (bufsiz + sizeof (bufsiz) > s_len)
+		return (-1);
+
+	zc = zstd_ctx_enter();
+	ret = zstd_decompress_ctx(zc, (void *)&src[sizeof (bufsiz)], bufsiz,
+	    d_start, d_len);
+	zstd_ctx_exit(zc);
+
+	return (ZSTD_isError(ret) ? -1 : 0);
+}
+
+boolean_t
+zstd_available(void)
+{
+	return (B_TRUE);
+}
+
+/*
+ * Free the compression contexts of all CPUs, except those which are in use
+ * right now.  The next block compressed on a CPU sets its context up again.
+ */
+void
+zstd_cache_reap_now(void)
+{
+	uint_t i;
+
+	for (i = 0; i < zstd_nctxs; i++) {
+		zstd_ctx_t *zc = &zstd_ctxs[i];
+
+		if (!mutex_tryenter(&zc->zc_lock))
+			continue;
+		zstd_cctx_free(zc);
+		mutex_exit(&zc->zc_lock);
+	}
+}
+
+void
+zstd_init(void)
+{
+	uint_t i;
+
+	zstd_nctxs = max_ncpus;
+	zstd_ctxs = kmem_zalloc(zstd_nctxs * sizeof (zstd_ctx_t), KM_SLEEP);
+	for (i = 0; i < zstd_nctxs; i++)
+		mutex_init(&zstd_ctxs[i].zc_lock, NULL, MUTEX_DEFAULT, NULL);
+}
+
+void
+zstd_fini(void)
+{
+	uint_t i;
+
+	if (zstd_ctxs == NULL)
+		return;
+
+	for (i = 0; i < zstd_nctxs; i++) {
+		zstd_ctx_free(&zstd_ctxs[i]);
+		mutex_destroy(&zstd_ctxs[i].zc_lock);
+	}
+	kmem_free(zstd_ctxs, zstd_nctxs * sizeof (zstd_ctx_t));
+	zstd_ctxs = NULL;
+}
+
+#else /* ZFS_HAVE_ZSTD */
+
+/*ARGSUSED*/
+size_t
+zstd_compress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	return (s_len);
+}
+
+/*ARGSUSED*/
+int
+zstd_decompress(void *s_start, void *d_start, size_t s_len, size_t d_len,
+    int level)
+{
+	return (-1);
+}
+
+boolean_t
+zstd_available(void)
+{
+	return (B_FALSE);
+}
+
+void
+zstd_cache_reap_now(void)
+{
+}
+
+void
+zstd_init(void)
+{
+}
+
+void
+zstd_fini(void)
+{
+}
+
+#endif /* ZFS_HAVE_ZSTD */
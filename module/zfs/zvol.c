@@ -58,6 +58,41 @@ unsigned int zvol_inhibit_dev = 0;
 unsigned int zvol_major = ZVOL_MAJOR;
 unsigned int zvol_prefetch_bytes = (128 * 1024);
 unsigned long zvol_max_discard_blocks = 16384;
+unsigned int zvol_threads = 32;
+unsigned int zvol_request_sync = 0;
+unsigned int zvol_use_blk_mq = 0;
+unsigned int zvol_blk_mq_queues = 0;
+unsigned int zvol_blk_mq_queue_depth = 128;
+unsigned int zvol_read_arc_direct = 1;
+unsigned int zvol_minor_threads = 16;
+
+static taskq_t *zvol_taskq;
+
+/*
+ * Progress of the zvol tasks, so that whoever imports a pool or changes
+ * snapdev can tell when all device nodes have appeared: the tasks that are
+ * queued or running, the volumes found whose minor is not created yet,
+ * and the minors created and failed.
+ */
+typedef struct zvol_stats {
+	kstat_named_t zvol_tasks_pending;
+	kstat_named_t zvol_minors_pending;
+	kstat_named_t zvol_minors_created;
+	kstat_named_t zvol_minors_failed;
+} zvol_stats_t;
+
+static zvol_stats_t zvol_stats = {
+	{ "tasks_pending",		KSTAT_DATA_UINT64 },
+	{ "minors_pending",		KSTAT_DATA_UINT64 },
+	{ "minors_created",		KSTAT_DATA_UINT64 },
+	{ "minors_failed",		KSTAT_DATA_UINT64 },
+};
+
+#define	ZVOL_STAT_INCR(stat, val) \
+	atomic_add_64(&zvol_stats.stat.value.ui64, (val))
+#define	ZVOL_STAT_BUMP(stat)	ZVOL_STAT_INCR(stat, 1)
+
+static kstat_t *zvol_ksp;
 
 static kmutex_t zvol_state_lock;
 static list_t zvol_state_list;
@@ -68,6 +103,14 @@ static struct hlist_head *zvol_htable;
 #define	ZVOL_HT_HEAD(hash)	(&zvol_htable[(hash) & (ZVOL_HT_SIZE-1)])
 static DEFINE_IDA(zvol_ida);
 
+/*
+ * Counters of a blk-mq hardware queue of a volume.
+ */
+typedef struct zvol_hwq {
+	uint32_t		zhq_inflight;	/* requests being processed */
+	uint64_t		zhq_requests;	/* requests received */
+} zvol_hwq_t;
+
 /*
  * The in-core state of each volume.
  */
@@ -85,6 +128,14 @@ typedef struct zvol_state {
 	dev_t			zv_dev;		/* device id */
 	struct gendisk		*zv_disk;	/* generic disk */
 	struct request_queue	*zv_queue;	/* request queue */
+#ifdef HAVE_BLK_MQ
+	struct blk_mq_tag_set	zv_tag_set;	/* blk-mq tags */
+#endif
+	zvol_hwq_t		*zv_hwqs;	/* blk-mq queue counters */
+	uint_t			zv_nr_hwqs;	/* blk-mq hardware queues */
+	uint64_t		zv_read_arc_bytes; /* read straight from ARC */
+	uint64_t		zv_read_dbuf_bytes; /* read through dbufs */
+	kstat_t			*zv_ksp;	/* zfs/<pool>/zd<N> */
 	list_node_t		zv_next;	/* next zvol_state_t linkage */
 	uint64_t		zv_hash;	/* name hash */
 	struct hlist_node	zv_hlink;	/* hash link */
@@ -628,46 +679,126 @@ zvol_log_write(zvol_state_t *zv, dmu_tx_t *tx, uint64_t offset,
 	}
 }
 
-static int
-zvol_write(zvol_state_t *zv, uio_t *uio, boolean_t sync)
+/*
+ * A request being processed by zvol_taskq.  The submitter takes the range
+ * lock before dispatching it, so that overlapping requests are processed
+ * in the order they were submitted; the taskq function drops it and ends
+ * the request.  With make_request_fn a request is a single bio, and is
+ * freed once ended.  With blk-mq it is the driver data of a struct request
+ * holding one or more merged bios, or none for a flush.
+ */
+typedef struct zv_request {
+	zvol_state_t	*zv;
+	struct bio	*bio;
+	rl_t		*rl;
+	uint64_t	offset;
+	uint64_t	size;
+	unsigned long	start;		/* jiffies, for io accounting */
+#ifdef HAVE_BLK_MQ
+	struct request	*rq;
+	zvol_hwq_t	*hwq;
+#endif
+} zv_request_t;
+
+static inline struct bio *
+zvol_next_bio(zv_request_t *zvr, struct bio *bio)
+{
+#ifdef HAVE_BLK_MQ
+	if (zvr->rq != NULL)
+		return (bio->bi_next);
+#endif
+	return (NULL);
+}
+
+static void
+uio_from_bio(uio_t *uio, struct bio *bio)
+{
+	uio->uio_bvec = &bio->bi_io_vec[BIO_BI_IDX(bio)];
+	uio->uio_skip = BIO_BI_SKIP(bio);
+	uio->uio_resid = BIO_BI_SIZE(bio);
+	uio->uio_iovcnt = bio->bi_vcnt - BIO_BI_IDX(bio);
+	uio->uio_loffset = BIO_BI_SECTOR(bio) << 9;
+	uio->uio_limit = MAXOFFSET_T;
+	uio->uio_segflg = UIO_BVEC;
+}
+
+static void
+zvol_request_done(zv_request_t *zvr, int error)
+{
+	struct bio *bio = zvr->bio;
+	zvol_state_t *zv = zvr->zv;
+
+#ifdef HAVE_BLK_MQ
+	if (zvr->rq != NULL) {
+		atomic_dec_32(&zvr->hwq->zhq_inflight);
+		blk_mq_end_request(zvr->rq, -error);
+		return;
+	}
+#endif
+	generic_end_io_acct(bio_data_dir(bio), &zv->zv_disk->part0,
+	    zvr->start);
+	BIO_END_IO(bio, -error);
+	kmem_free(zvr, sizeof (zv_request_t));
+}
+
+static void
+zvol_write(void *arg)
 {
+	zv_request_t *zvr = arg;
+	zvol_state_t *zv = zvr->zv;
+	fstrans_cookie_t cookie = spl_fstrans_mark();
 	uint64_t volsize = zv->zv_volsize;
-	rl_t *rl;
+	boolean_t sync;
+	struct bio *bio;
+	uio_t uio;
 	int error = 0;
 
 	ASSERT(zv && zv->zv_open_count > 0);
 
-	rl = zfs_range_lock(&zv->zv_range_lock, uio->uio_loffset,
-	    uio->uio_resid, RL_WRITER);
+	/* A blk-mq flush has no bio */
+	sync = zvr->bio == NULL || zv->zv_objset->os_sync == ZFS_SYNC_ALWAYS;
+	for (bio = zvr->bio; bio != NULL; bio = zvol_next_bio(zvr, bio))
+		sync |= bio_is_flush(bio) || bio_is_fua(bio);
 
-	while (uio->uio_resid > 0 && uio->uio_loffset < volsize) {
-		uint64_t bytes = MIN(uio->uio_resid, DMU_MAX_ACCESS >> 1);
-		uint64_t off = uio->uio_loffset;
-		dmu_tx_t *tx = dmu_tx_create(zv->zv_objset);
+	for (bio = zvr->bio; bio != NULL && error == 0;
+	    bio = zvol_next_bio(zvr, bio)) {
+		uio_from_bio(&uio, bio);
 
-		if (bytes > volsize - off)	/* don't write past the end */
-			bytes = volsize - off;
+		while (uio.uio_resid > 0 && uio.uio_loffset < volsize) {
+			uint64_t bytes = MIN(uio.uio_resid,
+			    DMU_MAX_ACCESS >> 1);
+			uint64_t off = uio.uio_loffset;
+			dmu_tx_t *tx = dmu_tx_create(zv->zv_objset);
 
-		dmu_tx_hold_write(tx, ZVOL_OBJ, off, bytes);
+			/* don't write past the end */
+			if (bytes > volsize - off)
+				bytes = volsize - off;
 
-		/* This will only fail for ENOSPC */
-		error = dmu_tx_assign(tx, TXG_WAIT);
-		if (error) {
-			dmu_tx_abort(tx);
-			break;
-		}
-		error = dmu_write_uio_dbuf(zv->zv_dbuf, uio, bytes, tx);
-		if (error == 0)
-			zvol_log_write(zv, tx, off, bytes, sync);
-		dmu_tx_commit(tx);
+			dmu_tx_hold_write(tx, ZVOL_OBJ, off, bytes);
 
-		if (error)
-			break;
+			/* This will only fail for ENOSPC */
+			error = dmu_tx_assign(tx, TXG_WAIT);
+			if (error) {
+				dmu_tx_abort(tx);
+				break;
+			}
+			error = dmu_write_uio_dbuf(zv->zv_dbuf, &uio, bytes,
+			    tx);
+			if (error == 0)
+				zvol_log_write(zv, tx, off, bytes, sync);
+			dmu_tx_commit(tx);
+
+			if (error)
+				break;
+		}
 	}
-	zfs_range_unlock(rl);
+	if (zvr->rl != NULL)
+		zfs_range_unlock(zvr->rl);
 	if (sync)
 		zil_commit(zv->zv_zilog, ZVOL_OBJ);
-	return (error);
+
+	zvol_request_done(zvr, error);
+	spl_fstrans_unmark(cookie);
 }
 
 /*
@@ -694,21 +825,24 @@ zvol_log_truncate(zvol_state_t *zv, dmu_tx_t *tx, uint64_t off, uint64_t len,
 	zil_itx_assign(zilog, itx, tx);
 }
 
-static int
-zvol_discard(struct bio *bio)
+static void
+zvol_discard(void *arg)
 {
-	zvol_state_t *zv = bio->bi_bdev->bd_disk->private_data;
-	uint64_t start = BIO_BI_SECTOR(bio) << 9;
-	uint64_t size = BIO_BI_SIZE(bio);
+	zv_request_t *zvr = arg;
+	zvol_state_t *zv = zvr->zv;
+	fstrans_cookie_t cookie = spl_fstrans_mark();
+	uint64_t start = zvr->offset;
+	uint64_t size = zvr->size;
 	uint64_t end = start + size;
-	int error;
-	rl_t *rl;
+	int error = 0;
 	dmu_tx_t *tx;
 
 	ASSERT(zv && zv->zv_open_count > 0);
 
-	if (end > zv->zv_volsize)
-		return (SET_ERROR(EIO));
+	if (end > zv->zv_volsize) {
+		error = SET_ERROR(EIO);
+		goto out;
+	}
 
 	/*
 	 * Align the request to volume block boundaries when a secure erase is
@@ -716,16 +850,15 @@ zvol_discard(struct bio *bio)
 	 * the unaligned parts which is slow (read-modify-write) and useless
 	 * since we are not freeing any space by doing so.
 	 */
-	if (!bio_is_secure_erase(bio)) {
+	if (!bio_is_secure_erase(zvr->bio)) {
 		start = P2ROUNDUP(start, zv->zv_volblocksize);
 		end = P2ALIGN(end, zv->zv_volblocksize);
 		size = end - start;
 	}
 
 	if (start >= end)
-		return (0);
+		goto out;
 
-	rl = zfs_range_lock(&zv->zv_range_lock, start, size, RL_WRITER);
 	tx = dmu_tx_create(zv->zv_objset);
 	dmu_tx_mark_netfree(tx);
 	error = dmu_tx_assign(tx, TXG_WAIT);
@@ -737,105 +870,158 @@ zvol_discard(struct bio *bio)
 		error = dmu_free_long_range(zv->zv_objset,
 		    ZVOL_OBJ, start, size);
 	}
-
-	zfs_range_unlock(rl);
-
-	return (error);
+out:
+	zfs_range_unlock(zvr->rl);
+	zvol_request_done(zvr, error);
+	spl_fstrans_unmark(cookie);
 }
 
-static int
-zvol_read(zvol_state_t *zv, uio_t *uio)
+static void
+zvol_read(void *arg)
 {
+	zv_request_t *zvr = arg;
+	zvol_state_t *zv = zvr->zv;
+	fstrans_cookie_t cookie = spl_fstrans_mark();
 	uint64_t volsize = zv->zv_volsize;
-	rl_t *rl;
+	uint64_t arc_bytes = 0, dbuf_bytes = 0;
+	struct bio *bio;
+	uio_t uio;
 	int error = 0;
 
 	ASSERT(zv && zv->zv_open_count > 0);
 
-	rl = zfs_range_lock(&zv->zv_range_lock, uio->uio_loffset,
-	    uio->uio_resid, RL_READER);
-	while (uio->uio_resid > 0 && uio->uio_loffset < volsize) {
-		uint64_t bytes = MIN(uio->uio_resid, DMU_MAX_ACCESS >> 1);
+	for (bio = zvr->bio; bio != NULL && error == 0;
+	    bio = zvol_next_bio(zvr, bio)) {
+		uio_from_bio(&uio, bio);
 
-		/* don't read past the end */
-		if (bytes > volsize - uio->uio_loffset)
-			bytes = volsize - uio->uio_loffset;
+		while (uio.uio_resid > 0 && uio.uio_loffset < volsize) {
+			uint64_t bytes = MIN(uio.uio_resid,
+			    DMU_MAX_ACCESS >> 1);
+			uint64_t direct = 0;
 
-		error = dmu_read_uio_dbuf(zv->zv_dbuf, uio, bytes);
-		if (error) {
-			/* convert checksum errors into IO errors */
-			if (error == ECKSUM)
-				error = SET_ERROR(EIO);
-			break;
+			/* don't read past the end */
+			if (bytes > volsize - uio.uio_loffset)
+				bytes = volsize - uio.uio_loffset;
+
+			/*
+			 * The range lock keeps the blocks from being dirtied
+			 * while they are copied straight from the ARC.
+			 */
+			if (zvol_read_arc_direct) {
+				error = dmu_read_uio_dbuf_arc(zv->zv_dbuf,
+				    &uio, bytes, &direct);
+			} else {
+				error = dmu_read_uio_dbuf(zv->zv_dbuf, &uio,
+				    bytes);
+			}
+			if (error) {
+				/* convert checksum errors into IO errors */
+				if (error == ECKSUM)
+					error = SET_ERROR(EIO);
+				break;
+			}
+			arc_bytes += direct;
+			dbuf_bytes += bytes - direct;
 		}
 	}
-	zfs_range_unlock(rl);
-	return (error);
+	zfs_range_unlock(zvr->rl);
+
+	atomic_add_64(&zv->zv_read_arc_bytes, arc_bytes);
+	atomic_add_64(&zv->zv_read_dbuf_bytes, dbuf_bytes);
+
+	zvol_request_done(zvr, error);
+	spl_fstrans_unmark(cookie);
+}
+
+/*
+ * Hand a request to zvol_taskq, so that the submitting thread, often the
+ * only one an iSCSI target or VM uses to drive the volume, doesn't block on
+ * cache misses or dmu_tx_assign() and can keep more requests in flight.  Up
+ * to zvol_threads requests are processed concurrently across all zvols.
+ * With zvol_request_sync set, or if the dispatch fails, process it here.
+ */
+static void
+zvol_dispatch(task_func_t func, zv_request_t *zvr)
+{
+	if (zvol_request_sync || taskq_dispatch(zvol_taskq, func, zvr,
+	    TQ_SLEEP) == TASKQID_INVALID)
+		func(zvr);
+}
+
+/*
+ * Lock the range of a request and dispatch it, for both make_request_fn
+ * and blk-mq.
+ */
+static void
+zvol_request_impl(zv_request_t *zvr, int rw)
+{
+	zvol_state_t *zv = zvr->zv;
+	struct bio *bio = zvr->bio;
+
+	if (rw == WRITE) {
+		boolean_t discard = bio != NULL &&
+		    (bio_is_discard(bio) || bio_is_secure_erase(bio));
+
+		/*
+		 * Some requests are just for flush and nothing else; they
+		 * need no range lock and go straight to zil_commit().
+		 */
+		if (zvr->size == 0 && !discard) {
+			if (bio == NULL || bio_is_flush(bio))
+				zvol_dispatch(zvol_write, zvr);
+			else
+				zvol_request_done(zvr, 0);
+			return;
+		}
+
+		zvr->rl = zfs_range_lock(&zv->zv_range_lock, zvr->offset,
+		    zvr->size, RL_WRITER);
+		if (discard)
+			zvol_dispatch(zvol_discard, zvr);
+		else
+			zvol_dispatch(zvol_write, zvr);
+	} else {
+		zvr->rl = zfs_range_lock(&zv->zv_range_lock, zvr->offset,
+		    zvr->size, RL_READER);
+		zvol_dispatch(zvol_read, zvr);
+	}
 }
 
 static MAKE_REQUEST_FN_RET
 zvol_request(struct request_queue *q, struct bio *bio)
 {
-	uio_t uio;
 	zvol_state_t *zv = q->queuedata;
 	fstrans_cookie_t cookie = spl_fstrans_mark();
+	uint64_t offset = BIO_BI_SECTOR(bio) << 9;
+	uint64_t size = BIO_BI_SIZE(bio);
 	int rw = bio_data_dir(bio);
-#ifdef HAVE_GENERIC_IO_ACCT
-	unsigned long start = jiffies;
-#endif
-	int error = 0;
+	zv_request_t *zvr;
 
-	uio.uio_bvec = &bio->bi_io_vec[BIO_BI_IDX(bio)];
-	uio.uio_skip = BIO_BI_SKIP(bio);
-	uio.uio_resid = BIO_BI_SIZE(bio);
-	uio.uio_iovcnt = bio->bi_vcnt - BIO_BI_IDX(bio);
-	uio.uio_loffset = BIO_BI_SECTOR(bio) << 9;
-	uio.uio_limit = MAXOFFSET_T;
-	uio.uio_segflg = UIO_BVEC;
-
-	if (bio_has_data(bio) && uio.uio_loffset + uio.uio_resid >
-	    zv->zv_volsize) {
+	if (bio_has_data(bio) && offset + size > zv->zv_volsize) {
 		printk(KERN_INFO
 		    "%s: bad access: offset=%llu, size=%lu\n",
 		    zv->zv_disk->disk_name,
-		    (long long unsigned)uio.uio_loffset,
-		    (long unsigned)uio.uio_resid);
-		error = SET_ERROR(EIO);
-		goto out1;
+		    (long long unsigned)offset,
+		    (long unsigned)size);
+		BIO_END_IO(bio, -SET_ERROR(EIO));
+		goto out;
 	}
 
-	generic_start_io_acct(rw, bio_sectors(bio), &zv->zv_disk->part0);
-
-	if (rw == WRITE) {
-		if (unlikely(zv->zv_flags & ZVOL_RDONLY)) {
-			error = SET_ERROR(EROFS);
-			goto out2;
-		}
-
-		if (bio_is_discard(bio) || bio_is_secure_erase(bio)) {
-			error = zvol_discard(bio);
-			goto out2;
-		}
-
-		/*
-		 * Some requests are just for flush and nothing else.
-		 */
-		if (uio.uio_resid == 0) {
-			if (bio_is_flush(bio))
-				zil_commit(zv->zv_zilog, ZVOL_OBJ);
-			goto out2;
-		}
+	if (rw == WRITE && unlikely(zv->zv_flags & ZVOL_RDONLY)) {
+		BIO_END_IO(bio, -SET_ERROR(EROFS));
+		goto out;
+	}
 
-		error = zvol_write(zv, &uio,
-		    bio_is_flush(bio) || bio_is_fua(bio) ||
-		    zv->zv_objset->os_sync == ZFS_SYNC_ALWAYS);
-	} else
-		error = zvol_read(zv, &uio);
+	zvr = kmem_zalloc(sizeof (zv_request_t), KM_SLEEP);
+	zvr->zv = zv;
+	zvr->bio = bio;
+	zvr->offset = offset;
+	zvr->size = size;
+	zvr->start = jiffies;
+	generic_start_io_acct(rw, bio_sectors(bio), &zv->zv_disk->part0);
 
-out2:
-	generic_end_io_acct(rw, &zv->zv_disk->part0, start);
-out1:
-	BIO_END_IO(bio, -error);
+	zvol_request_impl(zvr, rw);
+out:
 	spl_fstrans_unmark(cookie);
 #ifdef HAVE_MAKE_REQUEST_FN_RET_INT
 	return (0);
@@ -844,6 +1030,74 @@ out1:
 #endif
 }
 
+#ifdef HAVE_BLK_MQ
+/*
+ * blk-mq entry point.  The queue is BLK_MQ_F_BLOCKING, so this may sleep
+ * on the range lock and the dispatch like zvol_request().  The block layer
+ * does the io accounting, and turns REQ_PREFLUSH into a separate request
+ * without bio.
+ */
+static int
+zvol_mq_queue_rq(struct blk_mq_hw_ctx *hctx,
+    const struct blk_mq_queue_data *bd)
+{
+	struct request *rq = bd->rq;
+	zvol_state_t *zv = hctx->queue->queuedata;
+	zv_request_t *zvr = blk_mq_rq_to_pdu(rq);
+	fstrans_cookie_t cookie = spl_fstrans_mark();
+	uint64_t offset = blk_rq_pos(rq) << 9;
+	uint64_t size = blk_rq_bytes(rq);
+	int rw = (rq->bio == NULL) ? WRITE : rq_data_dir(rq);
+
+	blk_mq_start_request(rq);
+
+	if (offset + size > zv->zv_volsize) {
+		printk(KERN_INFO
+		    "%s: bad access: offset=%llu, size=%lu\n",
+		    zv->zv_disk->disk_name,
+		    (long long unsigned)offset,
+		    (long unsigned)size);
+		blk_mq_end_request(rq, -SET_ERROR(EIO));
+		goto out;
+	}
+
+	if (rw == WRITE && unlikely(zv->zv_flags & ZVOL_RDONLY)) {
+		blk_mq_end_request(rq, -SET_ERROR(EROFS));
+		goto out;
+	}
+
+	bzero(zvr, sizeof (zv_request_t));
+	zvr->zv = zv;
+	zvr->bio = rq->bio;
+	zvr->offset = offset;
+	zvr->size = size;
+	zvr->rq = rq;
+	zvr->hwq = hctx->driver_data;
+	atomic_inc_32(&zvr->hwq->zhq_inflight);
+	atomic_inc_64(&zvr->hwq->zhq_requests);
+
+	zvol_request_impl(zvr, rw);
+out:
+	spl_fstrans_unmark(cookie);
+	return (BLK_MQ_RQ_QUEUE_OK);
+}
+
+static int
+zvol_mq_init_hctx(struct blk_mq_hw_ctx *hctx, void *data, unsigned int idx)
+{
+	zvol_state_t *zv = data;
+
+	ASSERT3U(idx, <, zv->zv_nr_hwqs);
+	hctx->driver_data = &zv->zv_hwqs[idx];
+	return (0);
+}
+
+static struct blk_mq_ops zvol_mq_ops = {
+	.queue_rq		= zvol_mq_queue_rq,
+	.init_hctx		= zvol_mq_init_hctx,
+};
+#endif /* HAVE_BLK_MQ */
+
 static void
 zvol_get_done(zgd_t *zgd, int error)
 {
@@ -1266,6 +1520,153 @@ static struct block_device_operations zvol_ops = {
 };
 #endif /* HAVE_BDEV_BLOCK_DEVICE_OPERATIONS */
 
+/*
+ * Per-volume statistics, exported as zfs/<pool>/zd<N>: the bytes read
+ * straight from the ARC and through dbufs, and the requests in flight on
+ * and received by each blk-mq hardware queue.
+ */
+#define	ZVOL_KSTAT_READ_ARC	0
+#define	ZVOL_KSTAT_READ_DBUF	1
+#define	ZVOL_KSTAT_HWQ		2
+#define	ZVOL_KSTAT_NUM(zv)	(ZVOL_KSTAT_HWQ + 2 * (zv)->zv_nr_hwqs)
+
+static int
+zvol_kstat_update(kstat_t *ksp, int rw)
+{
+	zvol_state_t *zv = ksp->ks_private;
+	kstat_named_t *ks = ksp->ks_data;
+	uint_t i;
+
+	if (rw == KSTAT_WRITE)
+		return (EACCES);
+
+	ks[ZVOL_KSTAT_READ_ARC].value.ui64 = zv->zv_read_arc_bytes;
+	ks[ZVOL_KSTAT_READ_DBUF].value.ui64 = zv->zv_read_dbuf_bytes;
+	for (i = 0; i < zv->zv_nr_hwqs; i++) {
+		ks[ZVOL_KSTAT_HWQ + 2 * i].value.ui64 =
+		    zv->zv_hwqs[i].zhq_inflight;
+		ks[ZVOL_KSTAT_HWQ + 2 * i + 1].value.ui64 =
+		    zv->zv_hwqs[i].zhq_requests;
+	}
+
+	return (0);
+}
+
+static void
+zvol_kstat_init(zvol_state_t *zv, const char *pool)
+{
+	char module[KSTAT_STRLEN];
+	kstat_named_t *ks;
+	kstat_t *ksp;
+	uint_t i;
+
+	(void) snprintf(module, KSTAT_STRLEN, "zfs/%s", pool);
+	ksp = kstat_create(module, 0, zv->zv_disk->disk_name, "misc",
+	    KSTAT_TYPE_NAMED, ZVOL_KSTAT_NUM(zv), KSTAT_FLAG_VIRTUAL);
+	zv->zv_ksp = ksp;
+	if (ksp == NULL)
+		return;
+
+	ks = kmem_zalloc(ZVOL_KSTAT_NUM(zv) * sizeof (kstat_named_t),
+	    KM_SLEEP);
+	(void) strlcpy(ks[ZVOL_KSTAT_READ_ARC].name, "read_arc_bytes",
+	    KSTAT_STRLEN);
+	(void) strlcpy(ks[ZVOL_KSTAT_READ_DBUF].name, "read_dbuf_bytes",
+	    KSTAT_STRLEN);
+	for (i = 0; i < zv->zv_nr_hwqs; i++) {
+		(void) snprintf(ks[ZVOL_KSTAT_HWQ + 2 * i].name, KSTAT_STRLEN,
+		    "hwq%u_inflight", i);
+		(void) snprintf(ks[ZVOL_KSTAT_HWQ + 2 * i + 1].name,
+		    KSTAT_STRLEN, "hwq%u_requests", i);
+	}
+	for (i = 0; i < ZVOL_KSTAT_NUM(zv); i++)
+		ks[i].data_type = KSTAT_DATA_UINT64;
+
+	ksp->ks_data = ks;
+	ksp->ks_private = zv;
+	ksp->ks_update = zvol_kstat_update;
+	kstat_install(ksp);
+}
+
+static void
+zvol_kstat_fini(zvol_state_t *zv)
+{
+	kstat_t *ksp = zv->zv_ksp;
+	kstat_named_t *ks;
+
+	if (ksp == NULL)
+		return;
+
+	ks = ksp->ks_data;
+	kstat_delete(ksp);
+	kmem_free(ks, ZVOL_KSTAT_NUM(zv) * sizeof (kstat_named_t));
+	zv->zv_ksp = NULL;
+}
+
+/*
+ * Set up the request queue of a zvol: a blk-mq queue with
+ * zvol_blk_mq_queues hardware queues (one per online CPU if 0) of
+ * zvol_blk_mq_queue_depth requests each when zvol_use_blk_mq is set and
+ * the kernel supports it, a make_request_fn queue otherwise.
+ */
+static int
+zvol_alloc_queue(zvol_state_t *zv)
+{
+#ifdef HAVE_BLK_MQ
+	struct blk_mq_tag_set *set = &zv->zv_tag_set;
+	struct request_queue *q;
+
+	if (zvol_use_blk_mq) {
+		set->ops = &zvol_mq_ops;
+		set->nr_hw_queues = zvol_blk_mq_queues ?
+		    zvol_blk_mq_queues : num_online_cpus();
+		set->queue_depth = MIN(MAX(zvol_blk_mq_queue_depth, 1),
+		    BLK_MQ_MAX_DEPTH);
+		set->numa_node = NUMA_NO_NODE;
+		set->cmd_size = sizeof (zv_request_t);
+		set->flags = BLK_MQ_F_SHOULD_MERGE | BLK_MQ_F_BLOCKING;
+		set->driver_data = zv;
+		if (blk_mq_alloc_tag_set(set) != 0)
+			return (SET_ERROR(ENOMEM));
+
+		/* blk_mq_alloc_tag_set() caps nr_hw_queues at nr_cpu_ids */
+		zv->zv_nr_hwqs = set->nr_hw_queues;
+		zv->zv_hwqs = kmem_zalloc(zv->zv_nr_hwqs * sizeof (zvol_hwq_t),
+		    KM_SLEEP);
+
+		q = blk_mq_init_queue(set);
+		if (IS_ERR(q)) {
+			kmem_free(zv->zv_hwqs,
+			    zv->zv_nr_hwqs * sizeof (zvol_hwq_t));
+			zv->zv_hwqs = NULL;
+			zv->zv_nr_hwqs = 0;
+			blk_mq_free_tag_set(set);
+			return (SET_ERROR(ENOMEM));
+		}
+		zv->zv_queue = q;
+		return (0);
+	}
+#endif
+	zv->zv_queue = blk_alloc_queue(GFP_ATOMIC);
+	if (zv->zv_queue == NULL)
+		return (SET_ERROR(ENOMEM));
+
+	blk_queue_make_request(zv->zv_queue, zvol_request);
+	return (0);
+}
+
+static void
+zvol_free_queue(zvol_state_t *zv)
+{
+	blk_cleanup_queue(zv->zv_queue);
+#ifdef HAVE_BLK_MQ
+	if (zv->zv_hwqs != NULL) {
+		blk_mq_free_tag_set(&zv->zv_tag_set);
+		kmem_free(zv->zv_hwqs, zv->zv_nr_hwqs * sizeof (zvol_hwq_t));
+	}
+#endif
+}
+
 /*
  * Allocate memory for a new zvol_state_t and setup the required
  * request queue and generic disk structures for the block device.
@@ -1279,11 +1680,9 @@ zvol_alloc(dev_t dev, const char *name)
 
 	list_link_init(&zv->zv_next);
 
-	zv->zv_queue = blk_alloc_queue(GFP_ATOMIC);
-	if (zv->zv_queue == NULL)
+	if (zvol_alloc_queue(zv) != 0)
 		goto out_kmem;
 
-	blk_queue_make_request(zv->zv_queue, zvol_request);
 	blk_queue_set_write_cache(zv->zv_queue, B_TRUE, B_TRUE);
 
 	zv->zv_disk = alloc_disk(ZVOL_MINORS);
@@ -1308,7 +1707,7 @@ zvol_alloc(dev_t dev, const char *name)
 	return (zv);
 
 out_queue:
-	blk_cleanup_queue(zv->zv_queue);
+	zvol_free_queue(zv);
 out_kmem:
 	kmem_free(zv, sizeof (zvol_state_t));
 
@@ -1326,11 +1725,12 @@ zvol_free_impl(void *arg)
 	ASSERT(zv->zv_open_count == 0);
 
 	zfs_rlock_destroy(&zv->zv_range_lock);
+	zvol_kstat_fini(zv);
 
 	zv->zv_disk->private_data = NULL;
 
 	del_gendisk(zv->zv_disk);
-	blk_cleanup_queue(zv->zv_queue);
+	zvol_free_queue(zv);
 	put_disk(zv->zv_disk);
 
 	ida_simple_remove(&zvol_ida, MINOR(zv->zv_dev) >> ZVOL_MINOR_BITS);
@@ -1351,6 +1751,11 @@ zvol_free(zvol_state_t *zv)
  * Create a block device minor node and setup the linkage between it
  * and the specified volume.  Once this function returns the block
  * device is live and ready for use.
+ *
+ * zvol_state_lock is only held to look the name up and to insert the new
+ * zvol_state_t, so that minors can be created in parallel.  Minors of a
+ * pool are only created from its spa_zvol_taskq, by a single task at a
+ * time for distinct names, so the name can't be inserted in between.
  */
 static int
 zvol_create_minor_impl(const char *name)
@@ -1371,8 +1776,8 @@ zvol_create_minor_impl(const char *name)
 	minor = idx << ZVOL_MINOR_BITS;
 
 	mutex_enter(&zvol_state_lock);
-
 	zv = zvol_find_by_name_hash(name, hash);
+	mutex_exit(&zvol_state_lock);
 	if (zv) {
 		error = SET_ERROR(EEXIST);
 		goto out;
@@ -1399,6 +1804,7 @@ zvol_create_minor_impl(const char *name)
 		goto out_dmu_objset_disown;
 	}
 	zv->zv_hash = hash;
+	zvol_kstat_init(zv, spa_name(dmu_objset_spa(os)));
 
 	if (dmu_objset_is_snapshot(os))
 		zv->zv_flags |= ZVOL_RDONLY;
@@ -1455,6 +1861,7 @@ out_doi:
 out:
 
 	if (error == 0) {
+		mutex_enter(&zvol_state_lock);
 		zvol_insert(zv);
 		/*
 		 * Drop the lock to prevent deadlock with sys_open() ->
@@ -1464,9 +1871,11 @@ out:
 		 */
 		mutex_exit(&zvol_state_lock);
 		add_disk(zv->zv_disk);
+		ZVOL_STAT_BUMP(zvol_minors_created);
 	} else {
-		mutex_exit(&zvol_state_lock);
 		ida_simple_remove(&zvol_ida, idx);
+		if (error != EEXIST)
+			ZVOL_STAT_BUMP(zvol_minors_failed);
 	}
 
 	return (SET_ERROR(error));
@@ -1498,6 +1907,7 @@ zvol_rename_minor(zvol_state_t *zv, const char *newname)
 
 typedef struct minors_job {
 	list_t *list;
+	taskq_t *tq;
 	list_node_t link;
 	/* input */
 	char *name;
@@ -1506,7 +1916,9 @@ typedef struct minors_job {
 } minors_job_t;
 
 /*
- * Prefetch zvol dnodes for the minors_job
+ * Prefetch the metadata zvol_create_minor_impl() reads for the
+ * minors_job: the zvol dnode, and the dnode and block of the ZAP holding
+ * the volume size.
  */
 static void
 zvol_prefetch_minors_impl(void *arg)
@@ -1525,11 +1937,94 @@ zvol_prefetch_minors_impl(void *arg)
 		if (!os->os_encrypted) {
 			dmu_prefetch(os, ZVOL_OBJ, 0, 0, 0,
 			    ZIO_PRIORITY_SYNC_READ);
+			dmu_prefetch(os, ZVOL_ZAP_OBJ, 0, 0, 1,
+			    ZIO_PRIORITY_SYNC_READ);
 		}
 		dmu_objset_disown(os, zvol_tag);
 	}
 }
 
+static void
+zvol_create_minor_job(void *arg)
+{
+	minors_job_t *job = arg;
+
+	job->error = zvol_create_minor_impl(job->name);
+	ZVOL_STAT_INCR(zvol_minors_pending, -1);
+}
+
+/*
+ * Set up a list of minors to create, and the taskq that prefetches their
+ * metadata as they are added to it and then creates them, with up to
+ * zvol_minor_threads of each in flight.
+ */
+static void
+zvol_minors_init(minors_job_t *parent, list_t *minors_list)
+{
+	list_create(minors_list, sizeof (minors_job_t),
+	    offsetof(minors_job_t, link));
+	parent->list = minors_list;
+	parent->tq = taskq_create("z_zvol_minors", MAX(zvol_minor_threads, 1),
+	    defclsyspri, 1, INT_MAX, TASKQ_DYNAMIC);
+	parent->name = NULL;
+	parent->error = 0;
+}
+
+static minors_job_t *
+zvol_minors_add(minors_job_t *parent, const char *dsname)
+{
+	minors_job_t *job;
+	char *n = strdup(dsname);
+	if (n == NULL)
+		return (NULL);
+
+	job = kmem_alloc(sizeof (minors_job_t), KM_SLEEP);
+	job->name = n;
+	job->list = parent->list;
+	job->tq = parent->tq;
+	job->error = 0;
+	list_insert_tail(parent->list, job);
+	ZVOL_STAT_BUMP(zvol_minors_pending);
+	/* don't care if dispatch fails, because job->error is 0 */
+	taskq_dispatch(parent->tq, zvol_prefetch_minors_impl, job, TQ_SLEEP);
+
+	return (job);
+}
+
+/*
+ * Once all prefetches are done, create the minors whose objset could be
+ * owned, then free the list and the taskq.
+ */
+static void
+zvol_minors_fini(minors_job_t *parent)
+{
+	list_t *minors_list = parent->list;
+	minors_job_t *job;
+
+	taskq_wait(parent->tq);
+
+	for (job = list_head(minors_list); job != NULL;
+	    job = list_next(minors_list, job)) {
+		if (job->error) {
+			ZVOL_STAT_INCR(zvol_minors_pending, -1);
+			continue;
+		}
+		if (taskq_dispatch(parent->tq, zvol_create_minor_job, job,
+		    TQ_SLEEP) == TASKQID_INVALID)
+			zvol_create_minor_job(job);
+	}
+	taskq_wait(parent->tq);
+
+	while ((job = list_head(minors_list)) != NULL) {
+		list_remove(minors_list, job);
+		strfree(job->name);
+		kmem_free(job, sizeof (minors_job_t));
+	}
+
+	list_destroy(minors_list);
+	taskq_destroy(parent->tq);
+}
+
 /*
  * Mask errors to continue dmu_objset_find() traversal
  */
@@ -1537,7 +2032,6 @@ static int
 zvol_create_snap_minor_cb(const char *dsname, void *arg)
 {
 	minors_job_t *j = arg;
-	list_t *minors_list = j->list;
 	const char *name = j->name;
 
 	ASSERT0(MUTEX_HELD(&spa_namespace_lock));
@@ -1551,19 +2045,7 @@ zvol_create_snap_minor_cb(const char *dsname, void *arg)
 		dprintf("zvol_create_snap_minor_cb(): "
 		    "%s is not a shapshot name\n", dsname);
 	} else {
-		minors_job_t *job;
-		char *n = strdup(dsname);
-		if (n == NULL)
-			return (0);
-
-		job = kmem_alloc(sizeof (minors_job_t), KM_SLEEP);
-		job->name = n;
-		job->list = minors_list;
-		job->error = 0;
-		list_insert_tail(minors_list, job);
-		/* don't care if dispatch fails, because job->error is 0 */
-		taskq_dispatch(system_taskq, zvol_prefetch_minors_impl, job,
-		    TQ_SLEEP);
+		(void) zvol_minors_add(j, dsname);
 	}
 
 	return (0);
@@ -1577,7 +2059,7 @@ zvol_create_minors_cb(const char *dsname, void *arg)
 {
 	uint64_t snapdev;
 	int error;
-	list_t *minors_list = arg;
+	minors_job_t *parent = arg;
 
 	ASSERT0(MUTEX_HELD(&spa_namespace_lock));
 
@@ -1593,21 +2075,9 @@ zvol_create_minors_cb(const char *dsname, void *arg)
 	 * snapshots and create device minor nodes for those.
 	 */
 	if (strchr(dsname, '@') == 0) {
-		minors_job_t *job;
-		char *n = strdup(dsname);
-		if (n == NULL)
-			return (0);
-
-		job = kmem_alloc(sizeof (minors_job_t), KM_SLEEP);
-		job->name = n;
-		job->list = minors_list;
-		job->error = 0;
-		list_insert_tail(minors_list, job);
-		/* don't care if dispatch fails, because job->error is 0 */
-		taskq_dispatch(system_taskq, zvol_prefetch_minors_impl, job,
-		    TQ_SLEEP);
-
-		if (snapdev == ZFS_SNAPDEV_VISIBLE) {
+		minors_job_t *job = zvol_minors_add(parent, dsname);
+
+		if (job != NULL && snapdev == ZFS_SNAPDEV_VISIBLE) {
 			/*
 			 * traverse snapshots only, do not traverse children,
 			 * and skip the 'dsname'
@@ -1648,23 +2118,11 @@ zvol_create_minors_impl(const char *name)
 	fstrans_cookie_t cookie;
 	char *atp, *parent;
 	list_t minors_list;
-	minors_job_t *job;
+	minors_job_t job;
 
 	if (zvol_inhibit_dev)
 		return (0);
 
-	/*
-	 * This is the list for prefetch jobs. Whenever we found a match
-	 * during dmu_objset_find, we insert a minors_job to the list and do
-	 * taskq_dispatch to parallel prefetch zvol dnodes. Note we don't need
-	 * any lock because all list operation is done on the current thread.
-	 *
-	 * We will use this list to do zvol_create_minor_impl after prefetch
-	 * so we don't have to traverse using dmu_objset_find again.
-	 */
-	list_create(&minors_list, sizeof (minors_job_t),
-	    offsetof(minors_job_t, link));
-
 	parent = kmem_alloc(MAXPATHLEN, KM_SLEEP);
 	(void) strlcpy(parent, name, MAXPATHLEN);
 
@@ -1678,28 +2136,23 @@ zvol_create_minors_impl(const char *name)
 		if (error == 0 && snapdev == ZFS_SNAPDEV_VISIBLE)
 			error = zvol_create_minor_impl(name);
 	} else {
+		/*
+		 * Whenever we find a match during dmu_objset_find, we insert
+		 * a minors_job in the list and dispatch the prefetch of its
+		 * metadata.  We don't need any lock because all list
+		 * operations are done on the current thread.  Once the
+		 * traversal and prefetches are done, the minors are created
+		 * in parallel from the list.
+		 */
+		zvol_minors_init(&job, &minors_list);
 		cookie = spl_fstrans_mark();
 		error = dmu_objset_find(parent, zvol_create_minors_cb,
-		    &minors_list, DS_FIND_CHILDREN);
+		    &job, DS_FIND_CHILDREN);
 		spl_fstrans_unmark(cookie);
+		zvol_minors_fini(&job);
 	}
 
 	kmem_free(parent, MAXPATHLEN);
-	taskq_wait_outstanding(system_taskq, 0);
-
-	/*
-	 * Prefetch is completed, we can do zvol_create_minor_impl
-	 * sequentially.
-	 */
-	while ((job = list_head(&minors_list)) != NULL) {
-		list_remove(&minors_list, job);
-		if (!job->error)
-			zvol_create_minor_impl(job->name);
-		strfree(job->name);
-		kmem_free(job, sizeof (minors_job_t));
-	}
-
-	list_destroy(&minors_list);
 
 	return (SET_ERROR(error));
 }
@@ -1825,6 +2278,7 @@ zvol_rename_minors_impl(const char *oldname, const char *newname)
 
 typedef struct zvol_snapdev_cb_arg {
 	uint64_t snapdev;
+	minors_job_t job;
 } zvol_snapdev_cb_arg_t;
 
 static int
@@ -1836,7 +2290,7 @@ zvol_set_snapdev_cb(const char *dsname, void *param) {
 
 	switch (arg->snapdev) {
 		case ZFS_SNAPDEV_VISIBLE:
-			(void) zvol_create_minor_impl(dsname);
+			(void) zvol_minors_add(&arg->job, dsname);
 			break;
 		case ZFS_SNAPDEV_HIDDEN:
 			(void) zvol_remove_minor_impl(dsname);
@@ -1850,13 +2304,22 @@ static void
 zvol_set_snapdev_impl(char *name, uint64_t snapdev)
 {
 	zvol_snapdev_cb_arg_t arg = {snapdev};
-	fstrans_cookie_t cookie = spl_fstrans_mark();
+	list_t minors_list;
+	fstrans_cookie_t cookie;
+
+	if (snapdev == ZFS_SNAPDEV_VISIBLE)
+		zvol_minors_init(&arg.job, &minors_list);
+
 	/*
 	 * The zvol_set_snapdev_sync() sets snapdev appropriately
 	 * in the dataset hierarchy. Here, we only scan snapshots.
 	 */
+	cookie = spl_fstrans_mark();
 	dmu_objset_find(name, zvol_set_snapdev_cb, &arg, DS_FIND_SNAPSHOTS);
 	spl_fstrans_unmark(cookie);
+
+	if (snapdev == ZFS_SNAPDEV_VISIBLE)
+		zvol_minors_fini(&arg.job);
 }
 
 static zvol_task_t *
@@ -1871,6 +2334,7 @@ zvol_task_alloc(zvol_async_op_t op, const char *name1, const char *name2,
 		return (NULL);
 
 	task = kmem_zalloc(sizeof (zvol_task_t), KM_SLEEP);
+	ZVOL_STAT_BUMP(zvol_tasks_pending);
 	task->op = op;
 	task->snapdev = snapdev;
 	delim = strchr(name1, '/');
@@ -1886,6 +2350,7 @@ zvol_task_alloc(zvol_async_op_t op, const char *name1, const char *name2,
 static void
 zvol_task_free(zvol_task_t *task)
 {
+	ZVOL_STAT_INCR(zvol_tasks_pending, -1);
 	kmem_free(task, sizeof (zvol_task_t));
 }
 
@@ -2064,17 +2529,35 @@ zvol_init(void)
 	for (i = 0; i < ZVOL_HT_SIZE; i++)
 		INIT_HLIST_HEAD(&zvol_htable[i]);
 
+	zvol_taskq = taskq_create(ZVOL_DRIVER, MAX(zvol_threads, 1),
+	    maxclsyspri, MAX(zvol_threads, 1), INT_MAX,
+	    TASKQ_PREPOPULATE | TASKQ_DYNAMIC);
+	if (zvol_taskq == NULL) {
+		printk(KERN_INFO "ZFS: taskq_create() failed\n");
+		error = ENOMEM;
+		goto out_free;
+	}
+
 	error = register_blkdev(zvol_major, ZVOL_DRIVER);
 	if (error) {
 		printk(KERN_INFO "ZFS: register_blkdev() failed %d\n", error);
-		goto out_free;
+		goto out_taskq;
 	}
 
 	blk_register_region(MKDEV(zvol_major, 0), 1UL << MINORBITS,
 	    THIS_MODULE, zvol_probe, NULL, NULL);
 
+	zvol_ksp = kstat_create("zfs", 0, "zvol", "misc", KSTAT_TYPE_NAMED,
+	    sizeof (zvol_stats) / sizeof (kstat_named_t), KSTAT_FLAG_VIRTUAL);
+	if (zvol_ksp != NULL) {
+		zvol_ksp->ks_data = &zvol_stats;
+		kstat_install(zvol_ksp);
+	}
+
 	return (0);
 
+out_taskq:
+	taskq_destroy(zvol_taskq);
 out_free:
 	kmem_free(zvol_htable, ZVOL_HT_SIZE * sizeof (struct hlist_head));
 out:
@@ -2089,8 +2572,14 @@ zvol_fini(void)
 {
 	zvol_remove_minors_impl(NULL);
 
+	if (zvol_ksp != NULL) {
+		kstat_delete(zvol_ksp);
+		zvol_ksp = NULL;
+	}
+
 	blk_unregister_region(MKDEV(zvol_major, 0), 1UL << MINORBITS);
 	unregister_blkdev(zvol_major, ZVOL_DRIVER);
+	taskq_destroy(zvol_taskq);
 	kmem_free(zvol_htable, ZVOL_HT_SIZE * sizeof (struct hlist_head));
 
 	list_destroy(&zvol_state_list);
@@ -2106,9 +2595,30 @@ MODULE_PARM_DESC(zvol_inhibit_dev, "Do not create zvol device nodes");
 module_param(zvol_major, uint, 0444);
 MODULE_PARM_DESC(zvol_major, "Major number for zvol device");
 
+module_param(zvol_minor_threads, uint, 0644);
+MODULE_PARM_DESC(zvol_minor_threads, "Max number of minors created in parallel");
+
 module_param(zvol_max_discard_blocks, ulong, 0444);
 MODULE_PARM_DESC(zvol_max_discard_blocks, "Max number of blocks to discard");
 
 module_param(zvol_prefetch_bytes, uint, 0644);
 MODULE_PARM_DESC(zvol_prefetch_bytes, "Prefetch N bytes at zvol start+end");
+
+module_param(zvol_threads, uint, 0444);
+MODULE_PARM_DESC(zvol_threads, "Max number of threads to handle I/O requests");
+
+module_param(zvol_request_sync, uint, 0644);
+MODULE_PARM_DESC(zvol_request_sync, "Synchronously handle bio requests");
+
+module_param(zvol_use_blk_mq, uint, 0644);
+MODULE_PARM_DESC(zvol_use_blk_mq, "Register new zvols with blk-mq");
+
+module_param(zvol_blk_mq_queues, uint, 0644);
+MODULE_PARM_DESC(zvol_blk_mq_queues, "Hardware queues per blk-mq zvol");
+
+module_param(zvol_blk_mq_queue_depth, uint, 0644);
+MODULE_PARM_DESC(zvol_blk_mq_queue_depth, "Requests per blk-mq hardware queue");
+
+module_param(zvol_read_arc_direct, uint, 0644);
+MODULE_PARM_DESC(zvol_read_arc_direct, "Copy reads straight from the ARC");
 /* END CSTYLED */